@@ -1,60 +1,395 @@
-#if defined(XV6_USER)
-#include "pthread.h"
-#else
-#include <pthread.h>
-#endif
-#include "xsys.h"
-#include <inttypes.h>
+// Kernel memory allocator benchmarks.  Each mode drives the kernel's
+// allocators (kalloc's hot lists and buddies, kmalloc, and the object
+// caches) through the system calls that use them most:
+//
+//  local    Map, fault in, and unmap npg pages on each core.
+//  xcore    Each core faults in npg pages that the next core unmaps, so
+//           every page is freed on a different core than allocated it.
+//  mixed    A random mix of small and large page-faulted mappings,
+//           pipes, and small files, roughly in the proportions a build
+//           or mail workload asks for them.
+//  exhaust  All cores fault in npg pages before any core frees them.
+//           With the default npg this overflows the per-core hot lists;
+//           with npg over a core's share of memory, it makes the buddy
+//           allocators steal from each other.
+//  fork     Fork and reap a child, which allocates multi-page kernel
+//           stacks as well as process and address space objects.
+//
+// Each core reports its cycles per operation.  On xv6, the kalloc and
+// TLB counters from /dev/kstats and, in DEBUG kernels, the per-core lock
+// contention from /dev/lockstat are reported too.
+//
+// To build on Linux:
+//  make HW=linux
+
+#include <atomic>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/mman.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "libutil.h"
+#include "amd64.h"
+#include "rnd.hh"
+#include "xsys.h"
+
+#if !defined(XV6_USER)
+#include <pthread.h>
 #include <sys/wait.h>
+#else
+#include "types.h"
+#include "user.h"
+#include "pthread.h"
+#include "kstats.hh"
+#include "uk/lockstat.h"
+#endif
+
+#define PGSIZE 4096
+
+enum class bench_mode
+{
+  LOCAL, XCORE, MIXED, EXHAUST, FORK
+};
+
+static const struct {
+  const char *name;
+  bench_mode mode;
+  // Default pages per operation, where the mode uses it.
+  int npg;
+} modes[] = {
+  { "local", bench_mode::LOCAL, 64 },
+  { "xcore", bench_mode::XCORE, 64 },
+  { "mixed", bench_mode::MIXED, 0 },
+  // Several times the kernel's per-core hot list (KALLOC_HOT_PAGES).
+  { "exhaust", bench_mode::EXHAUST, 1024 },
+  { "fork", bench_mode::FORK, 0 },
+};
+
+char * const base = (char*)0x100000000UL;
+// Address space for each thread's mappings.
+static const uint64_t stride = 0x40000000ull;
+
+static int nthread, niter, npg;
+static bench_mode mode;
 
 static pthread_barrier_t bar;
-static int niter;
+
+// For XCORE mode.  produced is the last round a thread's pages were
+// mapped in; consumed is the last round they were unmapped.
+static struct
+{
+  std::atomic<uint64_t> produced __mpalign__;
+  std::atomic<uint64_t> consumed __mpalign__;
+  __padout__;
+} channels[NCPU];
+
+// For EXHAUST mode
+static struct
+{
+  std::atomic<uint64_t> round __mpalign__;
+  std::atomic<uint64_t> left __mpalign__;
+  __padout__;
+
+  void wait()
+  {
+    uint64_t curround = round;
+    if (--left) {
+      while (round == curround)
+        ;
+    } else {
+      left = nthread;
+      ++round;
+    }
+  }
+} gbarrier;
+
+static struct
+{
+  uint64_t ops;
+  uint64_t cycles;
+  __padout__;
+} results[NCPU] __mpalign__;
+
+static void
+map_fault(volatile char *p, size_t npages, int cpu)
+{
+  if (mmap((void *) p, npages * PGSIZE, PROT_READ|PROT_WRITE,
+           MAP_PRIVATE|MAP_FIXED|MAP_ANONYMOUS, -1, 0) == MAP_FAILED)
+    die("%d: map failed", cpu);
+  for (size_t j = 0; j < npages * PGSIZE; j += PGSIZE)
+    p[j] = '\0';
+}
+
+static void
+unmap(volatile char *p, size_t npages, int cpu)
+{
+  if (munmap((void *) p, npages * PGSIZE) < 0)
+    die("%d: unmap failed", cpu);
+}
+
+// One operation of MIXED mode.  Returns the number of operations done.
+static uint64_t
+mixed_op(int cpu, uint64_t i)
+{
+  volatile char *p = base + cpu * stride;
+  int r = rnd() % 100;
+  if (r < 40) {
+    // Small anonymous mappings: page faults, vmas, page table pages.
+    size_t n = 1 + rnd() % 16;
+    map_fault(p, n, cpu);
+    unmap(p, n, cpu);
+  } else if (r < 70) {
+    // Pipes: the pipe and its buffer, plus two file objects.
+    int fds[2];
+    char c = 0;
+    if (pipe(fds) < 0)
+      die("%d: pipe failed", cpu);
+    if (write(fds[1], &c, 1) != 1 || read(fds[0], &c, 1) != 1)
+      die("%d: pipe I/O failed", cpu);
+    close(fds[0]);
+    close(fds[1]);
+  } else if (r < 90) {
+    // Small files: an inode, a directory entry, and a page cache page.
+    char name[32], buf[512] = {};
+    snprintf(name, sizeof name, "/allocbench.%d.%lu", cpu, i % 8);
+    int fd = open(name, O_CREAT|O_RDWR, 0666);
+    if (fd < 0)
+      die("%d: open %s failed", cpu, name);
+    if (write(fd, buf, sizeof buf) != sizeof buf)
+      die("%d: write %s failed", cpu, name);
+    close(fd);
+    if (unlink(name) < 0)
+      die("%d: unlink %s failed", cpu, name);
+  } else {
+    // Large mappings, in the style of a heap or file buffer.
+    map_fault(p, 64, cpu);
+    unmap(p, 64, cpu);
+  }
+  return 1;
+}
 
 void*
 thr(void *arg)
 {
-  int tid = (uintptr_t)arg;
+  const int cpu = (uintptr_t)arg;
 
-  if (setaffinity(tid) < 0)
+  if (setaffinity(cpu) < 0)
     die("setaffinity err");
 
+  volatile char *mine = base + cpu * stride;
+  uint64_t ops = 0;
+
   pthread_barrier_wait(&bar);
+  uint64_t tsc1 = rdtsc();
+
+  switch (mode) {
+  case bench_mode::LOCAL:
+    for (int i = 0; i < niter; i++) {
+      map_fault(mine, npg, cpu);
+      unmap(mine, npg, cpu);
+    }
+    ops = (uint64_t)niter * npg;
+    break;
 
-  for (int i = 0; i < niter; i++) {
-    if ((i % 100) == 0)
-      printf("%d: %d ops\n", tid, i);
+  case bench_mode::XCORE: {
+    // Each core frees the pages of the previous core, and waits for
+    // the next core to free its pages before faulting in more.
+    const int prev = (cpu + nthread - 1) % nthread;
+    volatile char *theirs = base + prev * stride;
+    for (uint64_t round = 1; round <= (uint64_t)niter; round++) {
+      map_fault(mine, npg, cpu);
+      channels[cpu].produced = round;
 
-    char *p = (char*) mmap(0, 256 * 1024, PROT_READ|PROT_WRITE,
-                           MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-    if (p == MAP_FAILED)
-      die("%d: map failed", tid);
+      while (channels[prev].produced < round)
+        ;
+      unmap(theirs, npg, cpu);
+      channels[prev].consumed = round;
+
+      while (channels[cpu].consumed < round)
+        ;
+    }
+    ops = (uint64_t)niter * npg;
+    break;
   }
-  return 0;
+
+  case bench_mode::MIXED:
+    for (int i = 0; i < niter; i++)
+      ops += mixed_op(cpu, i);
+    break;
+
+  case bench_mode::EXHAUST:
+    for (int i = 0; i < niter; i++) {
+      map_fault(mine, npg, cpu);
+      // Wait until every core holds its pages
+      gbarrier.wait();
+      unmap(mine, npg, cpu);
+      gbarrier.wait();
+    }
+    ops = (uint64_t)niter * npg;
+    break;
+
+  case bench_mode::FORK:
+    for (int i = 0; i < niter; i++) {
+      int pid = fork();
+      if (pid < 0)
+        die("%d: fork failed", cpu);
+      if (pid == 0)
+        exit(0);
+      if (waitpid(pid, NULL, 0) < 0)
+        die("%d: wait failed", cpu);
+    }
+    ops = niter;
+    break;
+  }
+
+  results[cpu].cycles = rdtsc() - tsc1;
+  results[cpu].ops = ops;
+  return nullptr;
 }
 
+#ifdef XV6_USER
+static void
+read_kstats(kstats *out)
+{
+  int fd = open("/dev/kstats", O_RDONLY);
+  if (fd < 0)
+    die("Couldn't open /dev/kstats");
+  int r = xread(fd, out, sizeof *out);
+  if (r != sizeof *out)
+    die("Short read from /dev/kstats");
+  close(fd);
+}
+
+// Start or stop lockstat.  Returns false if the kernel doesn't have it.
+static bool
+lockstat_ctl(int fd, int cmd)
+{
+  char c = '0' + cmd;
+  return fd >= 0 && write(fd, &c, 1) == 1;
+}
+
+static void
+print_lockstat(void)
+{
+  int fd = open("/dev/lockstat", O_RDONLY);
+  if (fd < 0)
+    return;
+  struct lockstat *ls = (struct lockstat*) malloc(sizeof *ls);
+
+  printf("# contended locks: name acquires contends [contends per core]\n");
+  while (true) {
+    int r = read(fd, ls, sizeof *ls);
+    if (r <= 0)
+      break;
+    if (r != sizeof *ls)
+      die("Short read from /dev/lockstat");
+
+    uint64_t acquires = 0, contends = 0;
+    for (int i = 0; i < NCPU; i++) {
+      acquires += ls->cpu[i].acquires;
+      contends += ls->cpu[i].contends;
+    }
+    if (!contends)
+      continue;
+    printf("%.16s %lu %lu [", ls->name, acquires, contends);
+    for (int i = 0; i < nthread; i++)
+      printf(i ? " %lu" : "%lu", ls->cpu[i].contends);
+    printf("]\n");
+  }
+  close(fd);
+  free(ls);
+}
+#endif
+
 int
 main(int ac, char **av)
 {
   if (ac < 2)
-    die("usage: %s nthreads [nloop]", av[0]);
+    die("usage: %s nthreads [local|xcore|mixed|exhaust|fork [niter [npg]]]",
+        av[0]);
 
-  int nthread = atoi(av[1]);
-  niter = 100;
-  if (ac > 2)
-    niter = atoi(av[2]);
+  nthread = atoi(av[1]);
+  if (nthread < 1 || nthread > NCPU)
+    die("nthreads must be between 1 and %d", NCPU);
 
-  pthread_t* tid = (pthread_t*) malloc(sizeof(*tid)*nthread);
+  const char *modename = ac > 2 ? av[2] : "local";
+  size_t m;
+  for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+    if (strcmp(modename, modes[m].name) == 0)
+      break;
+  if (m == sizeof(modes) / sizeof(modes[0]))
+    die("bad mode argument");
+  mode = modes[m].mode;
 
+  niter = mode == bench_mode::MIXED ? 10000 : 100;
+  if (ac > 3)
+    niter = atoi(av[3]);
+  npg = modes[m].npg;
+  if (ac > 4)
+    npg = atoi(av[4]);
+
+  printf("# --cores=%d --mode=%s --iterations=%d --npg=%d\n",
+         nthread, modename, niter, npg);
+
+  gbarrier.left = nthread;
   pthread_barrier_init(&bar, 0, nthread);
 
-  for(uint64_t i = 0; i < nthread; i++)
-    xthread_create(&tid[i], 0, thr, (void*) i);
+#ifdef XV6_USER
+  struct kstats kstats_before, kstats_after;
+  int lsfd = open("/dev/lockstat", O_RDWR);
+  bool lockstat = lockstat_ctl(lsfd, LOCKSTAT_CLEAR) &&
+    lockstat_ctl(lsfd, LOCKSTAT_START);
+  read_kstats(&kstats_before);
+#endif
 
+  pthread_t* tid = (pthread_t*) malloc(sizeof(*tid)*nthread);
+  for(int i = 0; i < nthread; i++)
+    xthread_create(&tid[i], 0, thr, (void*)(uintptr_t) i);
   for(int i = 0; i < nthread; i++)
     xpthread_join(tid[i]);
+
+#ifdef XV6_USER
+  read_kstats(&kstats_after);
+  if (lockstat)
+    lockstat_ctl(lsfd, LOCKSTAT_STOP);
+#endif
+
+  // Summarize
+  uint64_t ops = 0, cycles = 0, maxcycles = 0;
+  for (int i = 0; i < nthread; i++) {
+    printf("core %d: %lu ops %lu cycles/op\n", i, results[i].ops,
+           results[i].ops ? results[i].cycles / results[i].ops : 0);
+    ops += results[i].ops;
+    cycles += results[i].cycles;
+    if (results[i].cycles > maxcycles)
+      maxcycles = results[i].cycles;
+  }
+  printf("%lu ops\n", ops);
+  if (ops) {
+    printf("%lu cycles/op\n", cycles / ops);
+    printf("%f ops/Mcycle\n", (double)ops * 1000000 / maxcycles);
+  }
+
+#ifdef XV6_USER
+  struct kstats kstats = kstats_after - kstats_before;
+  printf("%lu page allocs\n", kstats.kalloc_page_alloc_count);
+  printf("%lu page frees\n", kstats.kalloc_page_free_count);
+  printf("%lu hot list refills\n", kstats.kalloc_hot_list_refill_count);
+  printf("%lu hot list flushes\n", kstats.kalloc_hot_list_flush_count);
+  printf("%lu hot list steals\n", kstats.kalloc_hot_list_steal_count);
+  printf("%lu remote frees\n", kstats.kalloc_hot_list_remote_free_count);
+  printf("%lu TLB shootdowns\n", kstats.tlb_shootdown_count);
+  if (lockstat) {
+    print_lockstat();
+    lockstat_ctl(lsfd, LOCKSTAT_CLEAR);
+  }
+  if (lsfd >= 0)
+    close(lsfd);
+#endif
+  printf("\n");
   return 0;
 }
@@ -1,32 +1,145 @@
+// cp fromfile tofile
+// cp -r [-p cores] fromdir todir
+//
+// With -r, copies the tree at fromdir to a new directory todir, walking
+// it on cores cores (default: 1).
+
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "libutil.h"
 
-int
-main(int argc, char *argv[])
-{
-  if(argc != 3){
-    printf("Usage: cp fromfile tofile\n");
-    exit(2);
-  }
+#ifdef XV6_USER
+#include "types.h"
+#include "user.h"
+#include "fs.h"
+#include "treewalk.hh"
 
-  int fd1 = open(argv[1], 0);
-  if(fd1 < 0)
-    die("cp: cannot open %s", argv[1]);
+#include <string>
+#endif
 
-  int fd2 = open(argv[2], O_CREAT|O_WRONLY, 0666);
-  if(fd2 < 0)
-    die("cp: cannot create %s", argv[2]);
+static void
+usage(void)
+{
+  printf("Usage: cp fromfile tofile\n");
+  printf("       cp -r [-p cores] fromdir todir\n");
+  exit(2);
+}
 
+static void
+copy(int fd1, int fd2)
+{
   int n;
-  char buf[512];
+  char buf[4096];
   while((n = read(fd1, buf, sizeof(buf))) > 0){
     if(write(fd2, buf, n) != n)
       die("cp: write failed");
   }
+  if (n < 0)
+    die("cp: read failed");
+}
+
+#ifdef XV6_USER
+class cp_walk : public tree_walk
+{
+  const std::string from_, to_;
+
+  std::string dest(const std::string &path) const
+  {
+    return to_ + (path.c_str() + from_.size());
+  }
+
+public:
+  cp_walk(task_pool *pool, const char *from, const char *to)
+    : tree_walk(pool), from_(from), to_(to) { }
+
+protected:
+  bool enter(const std::string &path, int fd) override
+  {
+    std::string d = dest(path);
+    if (mkdir(d.c_str(), 0777) < 0)
+      die("cp: cannot create %s", d.c_str());
+    return true;
+  }
+
+  // Maildir-style trees put most of their files in a few large
+  // directories, so spread each directory's files over the pool too.
+  void files(const std::string &path, int fd,
+             struct xv6_direntstat *const *ents, size_t n) override
+  {
+    std::string d = dest(path);
+    pool()->parallel_for(0, n, 16, [&](size_t i) {
+        const char *name = ents[i]->d_name;
+        if (ents[i]->d_type != T_FILE) {
+          fprintf(stderr, "cp: skipping %s/%s\n", path.c_str(), name);
+          return;
+        }
+        int fd1 = openat(fd, name, O_RDONLY);
+        if (fd1 < 0)
+          die("cp: cannot open %s/%s", path.c_str(), name);
+        std::string to = d + "/" + name;
+        int fd2 = open(to.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0666);
+        if (fd2 < 0)
+          die("cp: cannot create %s", to.c_str());
+        copy(fd1, fd2);
+        close(fd1);
+        close(fd2);
+      });
+  }
+
+  void error(const std::string &path) override
+  {
+    die("cp: cannot read %s", path.c_str());
+  }
+};
+#endif
+
+int
+main(int argc, char *argv[])
+{
+  bool recursive = false;
+  int cores = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "rp:")) != -1) {
+    switch (opt) {
+    case 'r':
+      recursive = true;
+      break;
+    case 'p':
+      cores = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (argc - optind != 2 || cores < 1)
+    usage();
+  const char *from = argv[optind], *to = argv[optind + 1];
+
+  if (recursive) {
+#ifdef XV6_USER
+    task_pool pool(cores);
+    cp_walk w(&pool, from, to);
+    if (w.walk(from) < 0)
+      die("cp: cannot open directory %s", from);
+    return 0;
+#else
+    die("cp: -r is not supported here");
+#endif
+  }
+
+  int fd1 = open(from, 0);
+  if(fd1 < 0)
+    die("cp: cannot open %s", from);
+
+  int fd2 = open(to, O_CREAT|O_WRONLY, 0666);
+  if(fd2 < 0)
+    die("cp: cannot create %s", to);
 
+  copy(fd1, fd2);
   return 0;
 }
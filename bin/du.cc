@@ -1,49 +1,96 @@
+// du [-p cores] [dir]
+//
+// Prints the total size of the files and directories under dir (default
+// "."), walking it on cores cores (default: 1).
+
 #include "types.h"
 #include <sys/stat.h>
 #include "user.h"
 #include "fs.h"
+#include "libutil.h"
+#include "treewalk.hh"
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <atomic>
 
-static int
-du(int fd)
+class du_walk : public tree_walk
 {
-  struct stat st;
-  if (fstat(fd, &st) < 0) {
-    fprintf(stderr, "du: cannot stat\n");
-    close(fd);
-    return 0;
-  }
+public:
+  std::atomic<long> size;
 
-  int size = st.st_size;
-  if (S_ISDIR(st.st_mode)) {
-    struct dirent de;
-    while (read(fd, &de, sizeof(de)) == sizeof(de)) {
-      if (de.inum == 0)
-        continue;
+  explicit du_walk(task_pool *pool) : tree_walk(pool), size(0) { }
 
-      char buf[DIRSIZ+1];
-      memmove(buf, de.name, DIRSIZ);
-      buf[DIRSIZ] = 0;
+protected:
+  bool enter(const std::string &path, int fd) override
+  {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+      fprintf(stderr, "du: cannot stat %s\n", path.c_str());
+      return false;
+    }
+    size += st.st_size;
+    return true;
+  }
 
-      if (!strcmp(buf, ".") || !strcmp(buf, ".."))
-        continue;
+  // getdents_stat() gives each file's size, so only subdirectories
+  // need to be opened.
+  void files(const std::string &path, int fd,
+             struct xv6_direntstat *const *ents, size_t n) override
+  {
+    long sum = 0;
+    for (size_t i = 0; i < n; i++)
+      sum += ents[i]->d_size;
+    size += sum;
+  }
 
-      int nfd = openat(fd, buf, 0);
-      if (nfd >= 0)
-        size += du(nfd);  // should go into work queue
-    }
+  void error(const std::string &path) override
+  {
+    fprintf(stderr, "du: cannot read %s\n", path.c_str());
   }
+};
 
-  close(fd);
-  return size;
+static void
+usage(void)
+{
+  fprintf(stderr, "Usage: du [-p cores] [dir]\n");
+  exit(2);
 }
 
 int
 main(int ac, char **av)
 {
-  printf("%d\n", du(open(".", 0)));
+  int cores = 1;
+  int opt;
+  while ((opt = getopt(ac, av, "p:")) != -1) {
+    switch (opt) {
+    case 'p':
+      cores = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (cores < 1 || optind < ac - 1)
+    usage();
+  const char *dir = optind < ac ? av[optind] : ".";
+
+  struct stat st;
+  if (stat(dir, &st) < 0)
+    die("du: cannot stat %s", dir);
+  if (!S_ISDIR(st.st_mode)) {
+    printf("%ld\n", (long)st.st_size);
+    return 0;
+  }
+
+  task_pool pool(cores);
+  du_walk w(&pool);
+  if (w.walk(dir) < 0)
+    die("du: cannot open %s", dir);
+  printf("%ld\n", w.size.load());
   return 0;
 }
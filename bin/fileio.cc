@@ -0,0 +1,214 @@
+// Large-file I/O benchmark:
+//
+//   fileio [-o read|write] [-p seq|rand] [-b bytes] [-s MB] [-m] [-c] file
+//
+//  -o  Read or (over)write the file (default: read)
+//  -p  Visit the blocks in order or in a random order (default: seq)
+//  -b  Block size of each read or write (default: 4096)
+//  -s  File size in megabytes (default: 64)
+//  -m  Go through a shared mmap of the file instead of read/write
+//  -c  Cold cache: write back and evict the buffer and page caches
+//      before the run, so reads come from the disk.  Otherwise the
+//      file is read once before the run, so reads come from the page
+//      cache.
+//
+// Random runs visit every block exactly once too, so they move as many
+// bytes as sequential ones.  Writes are followed by an fsync, which is
+// timed separately.  Reports MB/s and the page faults the run took,
+// from /dev/faultstats.
+
+#include "types.h"
+#include "user.h"
+#include "amd64.h"
+#include "libutil.h"
+#include "faultstats.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char *fault_names[PF_NTYPES] = {
+  "zero", "cow", "present", "file-hit", "file-miss", "io-retry",
+};
+
+static pagefault_stats
+read_faults(void)
+{
+  static char buf[sizeof(faultstats_info)];
+  int fd = open("/dev/faultstats", O_RDONLY);
+  if (fd < 0)
+    die("fileio: open /dev/faultstats failed");
+  // Only the header, which holds this process's counts, is needed.
+  if (xread(fd, buf, sizeof(buf)) != sizeof(buf))
+    die("fileio: short read from /dev/faultstats");
+  close(fd);
+  return ((faultstats_info*)buf)->self;
+}
+
+static void
+evict_caches(void)
+{
+  static const char *cmds[] = { "1", "2" };
+  sync();
+  for (const char *c : cmds) {
+    int fd = open("/dev/evict_caches", O_WRONLY);
+    if (fd < 0)
+      die("fileio: open /dev/evict_caches failed");
+    if (write(fd, c, 1) != 1)
+      die("fileio: write /dev/evict_caches failed");
+    close(fd);
+  }
+}
+
+static void
+make_file(const char *path, size_t size, char *buf, size_t bs)
+{
+  int fd = open(path, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+  if (fd < 0)
+    die("fileio: create %s failed", path);
+  for (size_t off = 0; off < size; off += bs)
+    if (write(fd, buf, bs) != (ssize_t)bs)
+      die("fileio: write %s failed", path);
+  if (fsync(fd) < 0)
+    die("fileio: fsync %s failed", path);
+  close(fd);
+}
+
+static void __attribute__((noreturn))
+usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-o read|write] [-p seq|rand] [-b bytes] "
+          "[-s MB] [-m] [-c] file\n", argv0);
+  exit(2);
+}
+
+int
+main(int ac, char *av[])
+{
+  bool writing = false, random = false, use_mmap = false, cold = false;
+  size_t bs = 4096, size = 64 << 20;
+
+  int opt;
+  while ((opt = getopt(ac, av, "o:p:b:s:mc")) != -1) {
+    switch (opt) {
+    case 'o':
+      if (strcmp(optarg, "write") == 0)
+        writing = true;
+      else if (strcmp(optarg, "read") != 0)
+        usage(av[0]);
+      break;
+    case 'p':
+      if (strcmp(optarg, "rand") == 0)
+        random = true;
+      else if (strcmp(optarg, "seq") != 0)
+        usage(av[0]);
+      break;
+    case 'b':
+      bs = atoi(optarg);
+      break;
+    case 's':
+      size = (size_t)atoi(optarg) << 20;
+      break;
+    case 'm':
+      use_mmap = true;
+      break;
+    case 'c':
+      cold = true;
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+  if (optind != ac - 1 || bs == 0 || size == 0 || size % bs)
+    usage(av[0]);
+  const char *path = av[optind];
+
+  char *buf = (char*)malloc(bs);
+  memset(buf, 'f', bs);
+  size_t nblocks = size / bs;
+
+  struct stat st;
+  if (stat(path, &st) < 0 || (size_t)st.st_size != size)
+    make_file(path, size, buf, bs);
+
+  size_t *order = (size_t*)malloc(nblocks * sizeof(*order));
+  for (size_t i = 0; i < nblocks; i++)
+    order[i] = i;
+  if (random) {
+    u64 seed = rdtsc() | 1;
+    for (size_t i = nblocks - 1; i > 0; i--) {
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      size_t j = seed % (i + 1);
+      size_t t = order[i];
+      order[i] = order[j];
+      order[j] = t;
+    }
+  }
+
+  int fd = open(path, writing ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+    die("fileio: open %s failed", path);
+  if (cold) {
+    evict_caches();
+  } else {
+    for (size_t off = 0; off < size; off += bs)
+      if (pread(fd, buf, bs, off) != (ssize_t)bs)
+        die("fileio: read %s failed", path);
+  }
+
+  pagefault_stats f0 = read_faults();
+  u64 t0 = rdtsc();
+  char *map = nullptr;
+  if (use_mmap) {
+    map = (char*)mmap(nullptr, size, writing ? PROT_READ|PROT_WRITE : PROT_READ,
+                      MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+      die("fileio: mmap %s failed", path);
+  }
+
+  for (size_t i = 0; i < nblocks; i++) {
+    size_t off = order[i] * bs;
+    if (use_mmap) {
+      if (writing)
+        memcpy(map + off, buf, bs);
+      else
+        memcpy(buf, map + off, bs);
+    } else if (writing) {
+      if (pwrite(fd, buf, bs, off) != (ssize_t)bs)
+        die("fileio: write %s failed", path);
+    } else {
+      if (pread(fd, buf, bs, off) != (ssize_t)bs)
+        die("fileio: read %s failed", path);
+    }
+    // Keep the mmap copies from being optimized away.
+    asm volatile("" : : "r"(buf) : "memory");
+  }
+  u64 t1 = rdtsc();
+  if (writing && fsync(fd) < 0)
+    die("fileio: fsync %s failed", path);
+  u64 t2 = rdtsc();
+  pagefault_stats f1 = read_faults();
+  if (map)
+    munmap(map, size);
+  close(fd);
+
+  double secs = (double)(t1 - t0) / cpuhz();
+  printf("# %s %s %s bs %zu size %zu MB %s\n", writing ? "write" : "read",
+         random ? "rand" : "seq", use_mmap ? "mmap" : "syscall", bs,
+         size >> 20, cold ? "cold" : "warm");
+  printf("%.2f MB/s, %.3f s", size / 1e6 / secs, secs);
+  if (writing)
+    printf(", fsync %.3f s", (double)(t2 - t1) / cpuhz());
+  printf("\n");
+  printf("faults");
+  for (int t = 0; t < PF_NTYPES; t++)
+    printf(" %s %lu", fault_names[t], f1.count[t] - f0.count[t]);
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,77 @@
+// Benchmark fork of a large process: touch [-m mb] megabytes of
+// anonymous memory (1024 by default), then repeatedly fork a child
+// that exits right away and wait for it.  Most of fork's cost here is
+// copying the parent's address space and marking it copy-on-write.
+
+#include "types.h"
+#include "user.h"
+#include "amd64.h"
+#include "libutil.h"
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PGSIZE 4096
+#define NITERS 16
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [-m mb] [-n iters]\n", argv0);
+  exit(2);
+}
+
+int
+main(int ac, char **av)
+{
+  size_t mb = 1024;
+  int niters = NITERS;
+  int opt;
+  while ((opt = getopt(ac, av, "m:n:")) != -1) {
+    switch (opt) {
+    case 'm':
+      mb = atol(optarg);
+      break;
+    case 'n':
+      niters = atoi(optarg);
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+  if (optind != ac || niters < 1)
+    usage(av[0]);
+
+  size_t len = mb << 20;
+  char *p = (char*)mmap(0, len, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    die("mmap %lu MB failed", mb);
+  // Write every page, so the parent has a page behind each of them
+  // for fork to mark COW.
+  for (size_t off = 0; off < len; off += PGSIZE)
+    p[off] = 1;
+
+  printf("# --parent-mb=%lu --iters=%d\n", mb, niters);
+
+  u64 total = 0;
+  for (int i = 0; i < niters; i++) {
+    u64 s = rdtsc();
+    int pid = fork();
+    if (pid < 0)
+      die("fork error");
+    if (pid == 0)
+      exit(0);
+    wait(NULL);
+    total += rdtsc() - s;
+    // Write the pages again (untimed) so the next fork has to mark
+    // them COW again, rather than finding them still COW from this one.
+    for (size_t off = 0; off < len; off += PGSIZE)
+      p[off] = 1;
+  }
+
+  printf("%lu cycles/fork\n", total / niters);
+  return 0;
+}
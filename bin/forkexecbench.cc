@@ -1,42 +1,104 @@
+// Benchmark process creation: each of ncore processes, pinned to its
+// own core, repeatedly starts this program (which exits right away)
+// and waits for it, either with fork+exec or with posix_spawn.
+
 #include "types.h"
 #include "user.h"
 #include "mtrace.h"
 #include "amd64.h"
+#include "libutil.h"
+#include <spawn.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #define NITERS 1024
 
+static bool use_spawn;
+
 static void
-execbench(void)
+startone(void)
 {
-  u64 s = rdtsc();
-  mtenable("xv6-forkexecbench");
-  for (int i = 0; i < NITERS; i++) {
+  const char *av[] = { "forkexecbench", "x", 0 };
+  if (use_spawn) {
+    pid_t pid;
+    if (posix_spawn(&pid, av[0], nullptr, nullptr,
+                    const_cast<char * const *>(av), nullptr))
+      die("posix_spawn failed");
+  } else {
     int pid = fork();
-    if (pid < 0) {
+    if (pid < 0)
       die("fork error");
-    }
     if (pid == 0) {
-      const char *av[] = { "forkexecbench", "x", 0 };
-      execv("forkexecbench", const_cast<char * const *>(av));
+      execv(av[0], const_cast<char * const *>(av));
       die("exec failed\n");
-    } else {
-      wait(NULL);
     }
   }
-  mtops(NITERS);
-  mtdisable("xv6-forkexecbench");
+  wait(NULL);
+}
 
-  u64 e = rdtsc();
-  printf("%lu\n", (e-s) / NITERS);
+static void
+execbench(int core)
+{
+  if (setaffinity(core) < 0)
+    die("setaffinity %d failed", core);
+  for (int i = 0; i < NITERS; i++)
+    startone();
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [-s] [ncore]\n", argv0);
+  fprintf(stderr, "  -s  Use posix_spawn instead of fork+exec\n");
+  exit(2);
 }
 
 int
 main(int ac, char **av)
 {
-  if (ac == 2)
+  if (ac == 2 && strcmp(av[1], "x") == 0)
     exit(0);
-  execbench();
+
+  int opt;
+  while ((opt = getopt(ac, av, "s")) != -1) {
+    switch (opt) {
+    case 's':
+      use_spawn = true;
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+  int ncore = 1;
+  if (optind < ac)
+    ncore = atoi(av[optind++]);
+  if (optind != ac || ncore < 1)
+    usage(av[0]);
+
+  printf("# --mode=%s --cores=%d\n", use_spawn ? "spawn" : "fork+exec", ncore);
+
+  u64 s = rdtsc();
+  mtenable("xv6-forkexecbench");
+  for (int i = 0; i < ncore; i++) {
+    int pid = fork();
+    if (pid < 0)
+      die("fork error");
+    if (pid == 0) {
+      execbench(i);
+      exit(0);
+    }
+  }
+  for (int i = 0; i < ncore; i++)
+    wait(NULL);
+  mtops(NITERS * ncore);
+  mtdisable("xv6-forkexecbench");
+  u64 e = rdtsc();
+
+  // Cycles per process started, on each core, and processes started
+  // per million cycles, over all cores.
+  printf("%lu cycles/proc\n", (e-s) / NITERS);
+  printf("%lu procs/Mcycle\n", (u64)NITERS * ncore * 1000000 / (e-s));
   return 0;
 }
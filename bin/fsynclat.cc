@@ -0,0 +1,220 @@
+// fsync latency benchmark.  Runs one writer per core, each appending to
+// its own file and fsyncing it after every few writes, and reports the
+// distribution of fsync latencies on each core:
+//
+//   fsynclat [-w writers] [-s bytes] [-k writes] [-d secs] [-b] dir
+//
+//  -w  Number of writers, on cores 0 to writers-1 (default: 1)
+//  -s  Size of each write (default: 4096)
+//  -k  Writes per fsync (default: 1)
+//  -d  Seconds to run (default: 5)
+//  -b  Also run a bulk writer on the next core, which streams large
+//      writes to a file of its own and fsyncs it every few megabytes,
+//      to see how a competing flush and the checkpointer it keeps busy
+//      affect the writers.
+
+#include "types.h"
+#include "user.h"
+#include "pthread.h"
+#include "amd64.h"
+#include "libutil.h"
+#include "xsys.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#define MAX_SAMPLES (1 << 18)
+#define BULK_WRITE (1 << 20)
+#define BULK_FSYNC (16 << 20)
+// Bulk writer starts the file over after this much, to bound its size.
+#define BULK_FILE (256 << 20)
+
+static const char *dir;
+static int write_size = 4096, writes_per_fsync = 1;
+static std::atomic<bool> stop;
+static pthread_barrier_t bar;
+
+struct writer
+{
+  std::vector<u64> lat;         // fsync latencies, in cycles
+  u64 bytes;
+} __attribute__((aligned(64)));
+
+static writer writers[NCPU];
+static u64 bulk_bytes, bulk_fsyncs;
+
+static void*
+fsync_writer(void *arg)
+{
+  int cpu = (uintptr_t)arg;
+  writer *w = &writers[cpu];
+  if (setaffinity(cpu) < 0)
+    die("fsynclat: setaffinity %d failed", cpu);
+
+  char name[128];
+  snprintf(name, sizeof(name), "%s/w%d", dir, cpu);
+  int fd = open(name, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+  if (fd < 0)
+    die("fsynclat: open %s failed", name);
+  char *buf = (char*)malloc(write_size);
+  memset(buf, 'a' + cpu % 26, write_size);
+  w->lat.reserve(MAX_SAMPLES);
+
+  pthread_barrier_wait(&bar);
+  while (!stop && w->lat.size() < MAX_SAMPLES) {
+    for (int i = 0; i < writes_per_fsync; i++) {
+      if (write(fd, buf, write_size) != write_size)
+        die("fsynclat: write %s failed", name);
+      w->bytes += write_size;
+    }
+    u64 t0 = rdtsc();
+    if (fsync(fd) < 0)
+      die("fsynclat: fsync %s failed", name);
+    w->lat.push_back(rdtsc() - t0);
+  }
+  close(fd);
+  free(buf);
+  return nullptr;
+}
+
+static void*
+bulk_writer(void *arg)
+{
+  int cpu = (uintptr_t)arg;
+  if (setaffinity(cpu) < 0)
+    die("fsynclat: setaffinity %d failed", cpu);
+
+  char name[128];
+  snprintf(name, sizeof(name), "%s/bulk", dir);
+  char *buf = (char*)malloc(BULK_WRITE);
+  memset(buf, 'B', BULK_WRITE);
+  int fd = open(name, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+  if (fd < 0)
+    die("fsynclat: open %s failed", name);
+
+  pthread_barrier_wait(&bar);
+  u64 off = 0;
+  while (!stop) {
+    if (write(fd, buf, BULK_WRITE) != BULK_WRITE)
+      die("fsynclat: write %s failed", name);
+    bulk_bytes += BULK_WRITE;
+    off += BULK_WRITE;
+    if (off % BULK_FSYNC == 0) {
+      if (fsync(fd) < 0)
+        die("fsynclat: fsync %s failed", name);
+      bulk_fsyncs++;
+    }
+    if (off == BULK_FILE) {
+      close(fd);
+      fd = open(name, O_WRONLY|O_TRUNC);
+      if (fd < 0)
+        die("fsynclat: open %s failed", name);
+      off = 0;
+    }
+  }
+  close(fd);
+  free(buf);
+  return nullptr;
+}
+
+// The p/1000'th quantile of sorted samples.
+static u64
+quantile(const std::vector<u64> &v, int p)
+{
+  return v[(v.size() - 1) * p / 1000];
+}
+
+static void __attribute__((noreturn))
+usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-w writers] [-s bytes] [-k writes] [-d secs] "
+          "[-b] dir\n", argv0);
+  exit(2);
+}
+
+int
+main(int ac, char *av[])
+{
+  int nwriters = 1, secs = 5;
+  bool bulk = false;
+
+  int opt;
+  while ((opt = getopt(ac, av, "w:s:k:d:b")) != -1) {
+    switch (opt) {
+    case 'w':
+      nwriters = atoi(optarg);
+      break;
+    case 's':
+      write_size = atoi(optarg);
+      break;
+    case 'k':
+      writes_per_fsync = atoi(optarg);
+      break;
+    case 'd':
+      secs = atoi(optarg);
+      break;
+    case 'b':
+      bulk = true;
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+  if (optind != ac - 1 || nwriters < 1 || write_size < 1 ||
+      writes_per_fsync < 1 || secs < 1 || nwriters + bulk > NCPU)
+    usage(av[0]);
+  dir = av[optind];
+
+  mkdir(dir, 0777);
+  pthread_barrier_init(&bar, 0, nwriters + bulk + 1);
+
+  pthread_t tids[NCPU];
+  for (int i = 0; i < nwriters; i++)
+    xthread_create(&tids[i], 0, fsync_writer, (void*)(uintptr_t)i);
+  if (bulk)
+    xthread_create(&tids[nwriters], 0, bulk_writer,
+                   (void*)(uintptr_t)nwriters);
+
+  pthread_barrier_wait(&bar);
+  nsleep((u64)secs * 1000000000);
+  stop = true;
+  for (int i = 0; i < nwriters + bulk; i++)
+    xpthread_join(tids[i]);
+
+  double us = cpuhz() / 1e6;
+  printf("# writers %d write %d writes/fsync %d secs %d bulk %s\n",
+         nwriters, write_size, writes_per_fsync, secs, bulk ? "yes" : "no");
+  printf("%-5s %9s %10s %10s %10s %10s %10s\n", "cpu", "fsyncs", "MB/s",
+         "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+  std::vector<u64> all;
+  u64 bytes = 0;
+  for (int i = 0; i < nwriters; i++) {
+    std::vector<u64> &lat = writers[i].lat;
+    bytes += writers[i].bytes;
+    if (lat.empty())
+      continue;
+    for (u64 l : lat)
+      all.push_back(l);
+    std::sort(lat.begin(), lat.end());
+    printf("%-5d %9zu %10.2f %10.1f %10.1f %10.1f %10.1f\n", i, lat.size(),
+           writers[i].bytes / 1e6 / secs, quantile(lat, 500) / us,
+           quantile(lat, 990) / us, quantile(lat, 999) / us, lat.back() / us);
+  }
+  if (!all.empty()) {
+    std::sort(all.begin(), all.end());
+    printf("%-5s %9zu %10.2f %10.1f %10.1f %10.1f %10.1f\n", "all",
+           all.size(), bytes / 1e6 / secs, quantile(all, 500) / us,
+           quantile(all, 990) / us, quantile(all, 999) / us, all.back() / us);
+  }
+  if (bulk)
+    printf("bulk  %9lu %10.2f\n", bulk_fsyncs, bulk_bytes / 1e6 / secs);
+  return 0;
+}
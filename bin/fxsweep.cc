@@ -0,0 +1,337 @@
+// Run fxmark microbenchmarks across a range of core counts and print
+// one CSV row per run: the benchmark's throughput, followed by the
+// lockstat totals and the kstats deltas of that run.
+//
+//   fxsweep [-t tests] [-n cores] [-d secs] [-r root] [-x fxmark]
+//
+// tests and cores are comma-separated lists.  Each run gets a fresh
+// directory under root, which is removed afterwards.  The sweep of a
+// test stops at the first core count fxmark fails at.
+
+#include "types.h"
+#include "user.h"
+#include "kstats.hh"
+#include "uk/lockstat.h"
+#include "libutil.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <string>
+#include <vector>
+
+// The tests that build on sv6 (see fxmark/Makefrag)
+#define DEFAULT_TESTS \
+  "MWCL,DWAL,DWOL,DWSL,DWOM,MWRL,DRBL,DRBM,DRBH,MRPL,MRPM,MRPH,MWCM,MWUM,MWUL"
+
+struct lock_totals
+{
+  u64 acquires, contends, spins, sleeps;
+};
+
+struct result
+{
+  double secs, works;
+};
+
+static std::vector<std::string>
+split(const char *list)
+{
+  std::vector<std::string> v;
+  std::string cur;
+  for (const char *p = list; ; p++) {
+    if (*p == ',' || *p == 0) {
+      if (!cur.empty())
+        v.push_back(cur);
+      cur.clear();
+      if (*p == 0)
+        break;
+    } else {
+      cur += *p;
+    }
+  }
+  return v;
+}
+
+static void
+read_kstats(kstats *out)
+{
+  int fd = open("/dev/kstats", O_RDONLY);
+  if (fd < 0)
+    die("fxsweep: open /dev/kstats failed");
+  if (xread(fd, out, sizeof *out) != sizeof *out)
+    die("fxsweep: short read from /dev/kstats");
+  close(fd);
+}
+
+// Send a LOCKSTAT_* command.  Returns false if this kernel doesn't
+// keep lock statistics.
+static bool
+lockstat_ctl(int cmd)
+{
+  int fd = open("/dev/lockstat", O_WRONLY);
+  if (fd < 0)
+    return false;
+  char c = '0' + cmd;
+  bool ok = write(fd, &c, 1) == 1;
+  close(fd);
+  return ok;
+}
+
+static lock_totals
+read_lockstat(void)
+{
+  lock_totals t{};
+  static struct lockstat ls;
+  int fd = open("/dev/lockstat", O_RDONLY);
+  if (fd < 0)
+    return t;
+  while (read(fd, &ls, sizeof ls) == sizeof ls) {
+    for (int i = 0; i < NCPU; i++) {
+      t.acquires += ls.cpu[i].acquires;
+      t.contends += ls.cpu[i].contends;
+      t.spins += ls.cpu[i].spins;
+      t.sleeps += ls.cpu[i].sleeps;
+    }
+  }
+  close(fd);
+  return t;
+}
+
+// Parse an unsigned decimal number, with an optional fraction, at *p.
+static bool
+parse_number(const char **p, double *out)
+{
+  const char *s = *p;
+  double v = 0, scale = 1;
+  bool any = false, frac = false;
+  for (; (*s >= '0' && *s <= '9') || (*s == '.' && !frac); s++) {
+    if (*s == '.') {
+      frac = true;
+      continue;
+    }
+    any = true;
+    v = v * 10 + (*s - '0');
+    if (frac)
+      scale *= 10;
+  }
+  if (!any)
+    return false;
+  while (*s == ' ')
+    s++;
+  *p = s;
+  *out = v / scale;
+  return true;
+}
+
+// fxmark's report is a "# ncpu secs works works/sec ..." header and a
+// line of values.
+static bool
+parse_report(const std::string &out, result *res)
+{
+  for (const char *p = out.c_str(); *p; ) {
+    const char *line = p;
+    while (*p && *p != '\n')
+      p++;
+    if (*p)
+      p++;
+    if (*line == '#' || *line == '\n')
+      continue;
+    double ncpu;
+    const char *q = line;
+    if (parse_number(&q, &ncpu) && parse_number(&q, &res->secs) &&
+        parse_number(&q, &res->works))
+      return true;
+  }
+  return false;
+}
+
+static void
+rmtree(const char *path)
+{
+  int pid = fork();
+  if (pid < 0)
+    die("fxsweep: fork failed");
+  if (pid == 0) {
+    const char *args[] = { "/bin/rm", "-r", path, nullptr };
+    execv(args[0], const_cast<char * const *>(args));
+    die("fxsweep: exec rm failed");
+  }
+  waitpid(pid, NULL, 0);
+}
+
+// Run fxmark once and collect its report from a pipe.  Returns false
+// if it failed.
+static bool
+run_fxmark(const char *fxmark, const char *test, int ncore, int secs,
+           const char *root, result *res)
+{
+  char ncore_s[16], secs_s[16];
+  snprintf(ncore_s, sizeof ncore_s, "%d", ncore);
+  snprintf(secs_s, sizeof secs_s, "%d", secs);
+
+  int p[2];
+  if (pipe(p) < 0)
+    die("fxsweep: pipe failed");
+  int pid = fork();
+  if (pid < 0)
+    die("fxsweep: fork failed");
+  if (pid == 0) {
+    close(1);
+    dup(p[1]);
+    close(p[0]);
+    close(p[1]);
+    const char *args[] = {
+      fxmark, "--type", test, "--ncore", ncore_s, "--duration", secs_s,
+      "--root", root, nullptr
+    };
+    execv(args[0], const_cast<char * const *>(args));
+    die("fxsweep: exec %s failed", fxmark);
+  }
+  close(p[1]);
+
+  std::string out;
+  char buf[512];
+  int n;
+  while ((n = read(p[0], buf, sizeof buf)) > 0)
+    out.append(buf, n);
+  close(p[0]);
+
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || WEXITSTATUS(status) != 0)
+    return false;
+  return parse_report(out, res);
+}
+
+static void
+print_header(void)
+{
+  printf("test,ncore,secs,works,works_per_sec,"
+         "lock_acquires,lock_contends,lock_spins,lock_sleeps");
+#define X(type, name) printf("," #name);
+  KSTATS_ALL(X);
+#undef X
+  printf("\n");
+}
+
+static void
+print_row(const char *test, int ncore, const result &r, bool have_lockstat,
+          const lock_totals &lt, const kstats &ks)
+{
+  printf("%s,%d,%.3f,%.0f,%.1f", test, ncore, r.secs, r.works,
+         r.secs > 0 ? r.works / r.secs : 0.0);
+  if (have_lockstat)
+    printf(",%lu,%lu,%lu,%lu", lt.acquires, lt.contends, lt.spins,
+           lt.sleeps);
+  else
+    printf(",,,,");
+  // XXX Assumes uint64_t, like monkstats.
+#define X(type, name) printf(",%lu", (u64)ks.name);
+  KSTATS_ALL(X);
+#undef X
+  printf("\n");
+}
+
+static void __attribute__((noreturn))
+usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-t tests] [-n cores] [-d secs] [-r root] [-x fxmark]\n"
+          "  -t  Comma-separated fxmark tests (default: " DEFAULT_TESTS ")\n"
+          "  -n  Comma-separated core counts (default: 1,2,4,... to NCPU)\n"
+          "  -d  Seconds per run (default: 5)\n"
+          "  -r  Directory to run in (default: /fxsweep)\n"
+          "  -x  fxmark binary (default: /bin/fxmark)\n", argv0);
+  exit(2);
+}
+
+int
+main(int ac, char * const av[])
+{
+  const char *tests = DEFAULT_TESTS, *cores = nullptr;
+  const char *root = "/fxsweep", *fxmark = "/bin/fxmark";
+  int secs = 5;
+
+  int opt;
+  while ((opt = getopt(ac, av, "t:n:d:r:x:")) != -1) {
+    switch (opt) {
+    case 't':
+      tests = optarg;
+      break;
+    case 'n':
+      cores = optarg;
+      break;
+    case 'd':
+      secs = atoi(optarg);
+      if (secs <= 0)
+        usage(av[0]);
+      break;
+    case 'r':
+      root = optarg;
+      break;
+    case 'x':
+      fxmark = optarg;
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+  if (optind != ac)
+    usage(av[0]);
+
+  std::vector<int> ncores;
+  if (cores) {
+    for (auto &s : split(cores))
+      if (atoi(s.c_str()) > 0)
+        ncores.push_back(atoi(s.c_str()));
+  } else {
+    for (int n = 1; n < NCPU; n *= 2)
+      ncores.push_back(n);
+    ncores.push_back(NCPU);
+  }
+  if (ncores.empty())
+    usage(av[0]);
+
+  mkdir(root, 0777);
+  bool have_lockstat = lockstat_ctl(LOCKSTAT_STOP);
+  print_header();
+
+  for (auto &test : split(tests)) {
+    for (int ncore : ncores) {
+      char dir[128];
+      snprintf(dir, sizeof dir, "%s/%s-%d", root, test.c_str(), ncore);
+      if (mkdir(dir, 0777) < 0)
+        die("fxsweep: mkdir %s failed", dir);
+
+      kstats before, after;
+      result res{};
+      if (have_lockstat) {
+        lockstat_ctl(LOCKSTAT_CLEAR);
+        lockstat_ctl(LOCKSTAT_START);
+      }
+      read_kstats(&before);
+      bool ok = run_fxmark(fxmark, test.c_str(), ncore, secs, dir, &res);
+      read_kstats(&after);
+      lock_totals lt{};
+      if (have_lockstat) {
+        lockstat_ctl(LOCKSTAT_STOP);
+        lt = read_lockstat();
+      }
+      rmtree(dir);
+
+      if (!ok) {
+        fprintf(stderr, "fxsweep: %s failed at %d cores\n",
+                test.c_str(), ncore);
+        break;
+      }
+      print_row(test.c_str(), ncore, res, have_lockstat, lt,
+                after - before);
+    }
+  }
+  return 0;
+}
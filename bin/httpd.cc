@@ -6,8 +6,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 
 #include "sockutil.h"
 
@@ -132,6 +134,22 @@ content(int s, int fd)
   char buf[256];
   int n;
 
+  // Send regular files straight from the page cache.  sendfile fails
+  // up front on anything else, so fall back to copying through buf.
+  bool sent = false;
+  for (;;) {
+    ssize_t r = sendfile(s, fd, nullptr, 64*1024);
+    if (r == 0)
+      return 0;
+    if (r < 0) {
+      if (!sent)
+        break;
+      fprintf(stderr, "httpd content: sendfile failed\n");
+      return -1;
+    }
+    sent = true;
+  }
+
   for (;;) {
     n = read(fd, buf, sizeof(buf));
     if (n < 0) {
@@ -337,8 +355,9 @@ client(int s)
   free(url);
 }
 
-int
-main(void)
+// Listen on port 80 and serve connections one at a time.
+static void __attribute__((noreturn))
+serve(bool reuseport)
 {
   int s;
   int r;
@@ -347,6 +366,13 @@ main(void)
   if (s < 0)
     die("httpd socket: %d\n", s);
 
+  if (reuseport) {
+    int on = 1;
+    r = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    if (r < 0)
+      die("httpd setsockopt: %d\n", r);
+  }
+
   struct sockaddr_in sin;
   sin.sin_family = AF_INET;
   sin.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -377,3 +403,28 @@ main(void)
     close(ss);
   }
 }
+
+// Usage: httpd [nworkers]
+// With more than one worker, each runs on its own core with its own
+// SO_REUSEPORT listener, so they don't share an accept queue.
+int
+main(int argc, char **argv)
+{
+  int nworkers = argc > 1 ? atoi(argv[1]) : 1;
+  if (nworkers <= 1)
+    serve(false);
+
+  for (int i = 1; i < nworkers; i++) {
+    int pid = fork();
+    if (pid < 0)
+      die("httpd fork");
+    if (pid == 0) {
+      if (setaffinity(i) < 0)
+        die("httpd setaffinity %d", i);
+      serve(true);
+    }
+  }
+  if (setaffinity(0) < 0)
+    die("httpd setaffinity 0");
+  serve(true);
+}
@@ -45,6 +45,21 @@ static struct {
   { "/dev/mfsstats",    MAJ_MFSSTATS},
   { "/dev/blkstats",    MAJ_BLKSTATS},
   { "/dev/evict_caches",    MAJ_EVICTCACHES},
+  { "/dev/bufcache",    MAJ_BUFCACHE},
+  { "/dev/memdisk",    MAJ_MEMDISK},
+  { "/dev/blkio",    MAJ_BLKIO},
+  { "/dev/heapprof",    MAJ_HEAPPROF},
+  { "/dev/rcustats",    MAJ_RCUSTATS},
+  { "/dev/schedtrace",    MAJ_SCHEDTRACE},
+  { "/dev/faultstats",    MAJ_FAULTSTATS},
+  { "/dev/netstat",    MAJ_NETSTAT},
+  { "/dev/fsstats",    MAJ_FSSTATS},
+  { "/dev/lockprof",    MAJ_LOCKPROF},
+  { "/dev/perfregions",    MAJ_PERFREGIONS},
+  { "/dev/syscalls",    MAJ_SYSCALLS},
+  { "/dev/tracepoints",    MAJ_TRACEPOINTS},
+  { "/dev/kbench",    MAJ_KBENCH},
+  { "/dev/irqaffinity",    MAJ_IRQAFFINITY},
 };
 #endif
 
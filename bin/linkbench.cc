@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -141,6 +142,36 @@ do_link(int cpu)
   tsc_link.add(tsc2 - tsc1);
 }
 
+// Return the kernel's link count scheme (FS_NLINK_REFCOUNT), so runs
+// against kernels built with different schemes can be told apart.
+static const char *
+nlink_scheme(void)
+{
+#if defined(XV6_USER)
+  static char buf[16384];
+  int fd = open("/dev/kconfig", O_RDONLY);
+  if (fd < 0)
+    return "unknown";
+  size_t pos = 0;
+  int n;
+  while (pos < sizeof(buf) - 1 &&
+         (n = read(fd, buf + pos, sizeof(buf) - 1 - pos)) > 0)
+    pos += n;
+  close(fd);
+  buf[pos] = 0;
+  const char *key = "FS_NLINK_REFCOUNT=";
+  char *p = strstr(buf, key);
+  if (!p)
+    return "unknown";
+  p += strlen(key);
+  if (char *nl = strchr(p, '\n'))
+    *nl = 0;
+  return p;
+#else
+  return "linux";
+#endif
+}
+
 void
 usage(const char *argv0)
 {
@@ -190,7 +221,7 @@ main(int argc, char **argv)
 
   printf("# --cores=%d --duration=%ds --st_nlink=%s", nstats+nlinks, duration,
          omit_nlink ? "false" : "true");
-  printf(" --stats=%d --links=%d\n", nstats, nlinks);
+  printf(" --stats=%d --links=%d --nlink=%s\n", nstats, nlinks, nlink_scheme());
 
 #if defined(XV6_USER)
   // Configure PMC
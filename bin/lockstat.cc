@@ -32,8 +32,8 @@ stats(void)
   if (sfd < 0)
     die("lockstat: open failed");
 
-  printf("## name acquires contends locking locked\n");
-  dprintf(sfd, "## name acquires contends locking locked\n");
+  printf("## name acquires contends locking locked spins sleeps\n");
+  dprintf(sfd, "## name acquires contends locking locked spins sleeps\n");
   
   while (1) {
     r = read(fd, &ls, sz);
@@ -45,19 +45,21 @@ stats(void)
       die("lockstat: unexpected read");
 
     u64 acquires = 0, contends = 0,
-      locking = 0, locked = 0;
+      locking = 0, locked = 0, spins = 0, sleeps = 0;
     
     for (int i = 0; i < NCPU; i++) {
       acquires += ls.cpu[i].acquires;
       contends += ls.cpu[i].contends;
       locking += ls.cpu[i].locking;
       locked += ls.cpu[i].locked;
+      spins += ls.cpu[i].spins;
+      sleeps += ls.cpu[i].sleeps;
     }
-    if (contends > 0) {
-      printf("%s %lu %lu %lu %lu\n", 
-             ls.name, acquires, contends, locking, locked);
-      dprintf(sfd, "%s %lu %lu %lu %lu\n",
-             ls.name, acquires, contends, locking, locked);
+    if (contends > 0 || spins > 0 || sleeps > 0) {
+      printf("%s %lu %lu %lu %lu %lu %lu\n",
+             ls.name, acquires, contends, locking, locked, spins, sleeps);
+      dprintf(sfd, "%s %lu %lu %lu %lu %lu %lu\n",
+             ls.name, acquires, contends, locking, locked, spins, sleeps);
     }
   }
 
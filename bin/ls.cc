@@ -68,30 +68,45 @@ ls(const std::string &path)
     break;
 
   case S_IFDIR:
-    std::vector<std::string> names;
+    std::vector<std::pair<std::string, struct stat>> ents;
 #ifdef XV6_USER
-    char namebuf[DIRSIZ+1];
-    char *prev = nullptr;
-    while(readdir(fd, prev, namebuf) > 0) {
-      prev = namebuf;
-      names.push_back(path + '/' + namebuf);
+    // getdents_stat() has everything printout() needs, so there's no
+    // stat() per entry.
+    char buf[4096];
+    ssize_t n;
+    while ((n = getdents_stat(fd, buf, sizeof(buf))) > 0) {
+      for (ssize_t off = 0; off < n; ) {
+        struct xv6_direntstat *de = (struct xv6_direntstat*)(buf + off);
+        struct stat est = {};
+        est.st_mode = de->d_type << __S_IFMT_SHIFT;
+        est.st_ino = de->d_ino;
+        est.st_size = de->d_size;
+        est.st_nlink = de->d_nlink;
+        ents.emplace_back(path + '/' + de->d_name, est);
+        off += de->d_reclen;
+      }
     }
 #else
     DIR *dir = fdopendir(fd);
     struct dirent *de;
-    while ((de = readdir(dir)))
-      names.push_back(path + '/' + de->d_name);
-#endif
-
-    std::sort(names.begin(), names.end());
-
-    for (auto &n: names) {
-      if (stat(n.c_str(), &st) < 0){
+    while ((de = readdir(dir))) {
+      std::string n = path + '/' + de->d_name;
+      if (stat(n.c_str(), &st) < 0) {
         fprintf(stderr, "ls: cannot stat %s\n", n.c_str());
         continue;
       }
-      printout(&st, n);
+      ents.emplace_back(n, st);
     }
+#endif
+
+    std::sort(ents.begin(), ents.end(),
+              [](const std::pair<std::string, struct stat> &a,
+                 const std::pair<std::string, struct stat> &b) {
+                return a.first < b.first;
+              });
+
+    for (auto &e: ents)
+      printout(&e.second, e.first);
     break;
   }
   close(fd);
@@ -15,53 +15,60 @@ using std::string;
 class maildir_writer
 {
   string maildir_;
+  int dirfd_;
   unsigned long seqno_;
 
 public:
   maildir_writer(const string &maildir) : maildir_(maildir), seqno_(0)
   {
-    // Check for mailbox
+    // Check for mailbox.  Everything below is looked up relative to it,
+    // so that each delivery doesn't walk the whole maildir path again.
     struct stat st;
-    if (stat(maildir.c_str(), &st) < 0 ||
+    dirfd_ = open(maildir.c_str(), O_RDONLY|O_DIRECTORY);
+    if (dirfd_ < 0 || fstat(dirfd_, &st) < 0 ||
         (st.st_mode & S_IFMT) != S_IFDIR)
       die("No such mailbox: %s", maildir.c_str());
   }
 
+  ~maildir_writer()
+  {
+    close(dirfd_);
+  }
+
   void deliver(int msgfd, size_t limit = (size_t)-1)
   {
     // Generate unique tmp path
     char unique[16];
     snprintf(unique, sizeof(unique), "%d.%lu", getpid(), seqno_);
-    string tmppath(maildir_);
-    tmppath.append("/tmp/").append(unique);
+    string tmppath("tmp/");
+    tmppath.append(unique);
     ++seqno_;
 
     // Write message
-    int fd = open(tmppath.c_str(), O_CREAT|O_EXCL|O_WRONLY, 0600);
+    int fd = openat(dirfd_, tmppath.c_str(), O_CREAT|O_EXCL|O_WRONLY, 0600);
     if (fd < 0)
-      edie("open %s failed", tmppath.c_str());
+      edie("open %s/%s failed", maildir_.c_str(), tmppath.c_str());
     if (copy_fd_n(fd, 0, limit) < 0)
       edie("copy_fd failed");
     struct stat st;
     if (fstatx(fd, &st, STAT_OMIT_NLINK) < 0)
-      edie("fstat %s failed", tmppath.c_str());
+      edie("fstat %s/%s failed", maildir_.c_str(), tmppath.c_str());
     if (fsync(fd) < 0)
-      edie("fsync %s failed", tmppath.c_str());
+      edie("fsync %s/%s failed", maildir_.c_str(), tmppath.c_str());
     close(fd);
 
     // Deliver message
     snprintf(unique, sizeof(unique), "%lu", (unsigned long)st.st_ino);
-    string newpath(maildir_);
-    newpath.append("/new/").append(unique);
-    if (rename(tmppath.c_str(), newpath.c_str()) < 0)
-      edie("rename %s %s failed", tmppath.c_str(), newpath.c_str());
-
-    string newdir(maildir_);
-    newdir.append("/new");
-    fd = open(newdir.c_str(), O_RDONLY|O_DIRECTORY);
+    string newpath("new/");
+    newpath.append(unique);
+    if (renameat(dirfd_, tmppath.c_str(), dirfd_, newpath.c_str()) < 0)
+      edie("rename %s/%s %s/%s failed", maildir_.c_str(), tmppath.c_str(),
+           maildir_.c_str(), newpath.c_str());
+
+    fd = openat(dirfd_, "new", O_RDONLY|O_DIRECTORY);
     if (fd >= 0) {
       if (fsync(fd) < 0)
-        edie("fsync %s failed", newdir.c_str());
+        edie("fsync %s/new failed", maildir_.c_str());
       close(fd);
     }
   }
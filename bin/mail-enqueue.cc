@@ -14,6 +14,7 @@
 #include <sys/un.h>
 
 #include <string>
+#include <vector>
 
 using std::string;
 
@@ -23,9 +24,27 @@ class spool_writer
   int notifyfd_;
   struct sockaddr_un notify_addr_;
   socklen_t notify_len_;
+  // Notifications not sent yet, sent notify_batch_ at a time with
+  // sendmmsg.
+  size_t notify_batch_;
+  std::vector<string> pending_;
+
+  void notify(const char *msg)
+  {
+    if (notify_batch_ <= 1) {
+      if (sendto(notifyfd_, msg, strlen(msg), 0,
+                 (struct sockaddr*)&notify_addr_, notify_len_) < 0)
+        edie("send failed");
+      return;
+    }
+    pending_.push_back(msg);
+    if (pending_.size() >= notify_batch_)
+      flush();
+  }
 
 public:
-  spool_writer(const string &spooldir) : spooldir_(spooldir), notify_addr_{}
+  spool_writer(const string &spooldir, size_t notify_batch = 1)
+    : spooldir_(spooldir), notify_addr_{}, notify_batch_(notify_batch)
   {
     notifyfd_ = socket(AF_UNIX, SOCK_DGRAM, 0);
     if (notifyfd_ < 0)
@@ -37,6 +56,37 @@ public:
     notify_len_ = SUN_LEN(&notify_addr_);
   }
 
+  ~spool_writer()
+  {
+    flush();
+  }
+
+  // Send any notifications queue() has held back.
+  void flush()
+  {
+    size_t sent = 0;
+    while (sent < pending_.size()) {
+      struct iovec iov[16];
+      struct mmsghdr msgs[16];
+      size_t n = 0;
+      for (; n < 16 && sent + n < pending_.size(); n++) {
+        string &s = pending_[sent + n];
+        iov[n].iov_base = &s[0];
+        iov[n].iov_len = s.size();
+        msgs[n] = {};
+        msgs[n].msg_hdr.msg_name = &notify_addr_;
+        msgs[n].msg_hdr.msg_namelen = notify_len_;
+        msgs[n].msg_hdr.msg_iov = &iov[n];
+        msgs[n].msg_hdr.msg_iovlen = 1;
+      }
+      int r = sendmmsg(notifyfd_, msgs, n, 0);
+      if (r <= 0)
+        edie("sendmmsg failed");
+      sent += r;
+    }
+    pending_.clear();
+  }
+
   void queue(int msgfd, const char *recipient, size_t limit = (size_t)-1)
   {
     // Create temporary message
@@ -99,9 +149,7 @@ public:
     // we've already "durably" queued the message.
     char notif[16];
     snprintf(notif, sizeof notif, "%lu", (unsigned long)st.st_ino);
-    if (sendto(notifyfd_, notif, strlen(notif), 0,
-               (struct sockaddr*)&notify_addr_, notify_len_) < 0)
-      edie("send failed");
+    notify(notif);
   }
 
   void queue_exit()
@@ -135,12 +183,13 @@ static void
 usage(const char *argv0)
 {
   fprintf(stderr, "Usage: %s spooldir recipient <message\n", argv0);
-  fprintf(stderr, "       %s -b spooldir recipient <message-stream\n", argv0);
+  fprintf(stderr, "       %s -b [-n N] spooldir recipient <message-stream\n", argv0);
   fprintf(stderr, "       %s --exit spooldir\n", argv0);
   fprintf(stderr, "\n");
   fprintf(stderr,
           "In batch mode, message-stream is a sequence of <u64 N><char[N]> and\n"
           "a <u64> return code will be written to stdout after every delivery.\n"
+          "-n sends the queue manager notifications N at a time.\n"
     );
   exit(2);
 }
@@ -156,11 +205,15 @@ main(int argc, char **argv)
 
   int opt;
   bool batch_mode = false;
-  while ((opt = getopt(argc, argv, "b")) != -1) {
+  size_t notify_batch = 1;
+  while ((opt = getopt(argc, argv, "bn:")) != -1) {
     switch (opt) {
     case 'b':
       batch_mode = true;
       break;
+    case 'n':
+      notify_batch = atoi(optarg);
+      break;
     default:
       usage(argv[0]);
     }
@@ -172,7 +225,7 @@ main(int argc, char **argv)
   const char *spooldir = argv[optind];
   const char *recip = argv[optind + 1];
 
-  spool_writer spool{spooldir};
+  spool_writer spool{spooldir, batch_mode ? notify_batch : 1};
   if (batch_mode)
     do_batch_mode(0, 1, recip, &spool);
   else
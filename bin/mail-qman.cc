@@ -24,6 +24,7 @@
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <vector>
 
 using std::string;
 using std::thread;
@@ -31,6 +32,8 @@ using std::thread;
 extern char **environ;
 
 static bool alt;
+// Notifications to receive per recvmmsg.
+static size_t notify_batch = 1;
 
 class spool_reader
 {
@@ -72,6 +75,33 @@ public:
     return {buf, (size_t)r};
   }
 
+  // Wait for notifications and append up to max of them to *out.
+  void dequeue_batch(std::vector<string> *out, size_t max)
+  {
+    if (max <= 1) {
+      out->push_back(dequeue());
+      return;
+    }
+    enum { MAX = 16 };
+    char bufs[MAX][256];
+    struct iovec iov[MAX];
+    struct mmsghdr msgs[MAX];
+    if (max > MAX)
+      max = MAX;
+    for (size_t i = 0; i < max; i++) {
+      iov[i].iov_base = bufs[i];
+      iov[i].iov_len = sizeof bufs[i];
+      msgs[i] = {};
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int r = recvmmsg(notifyfd_, msgs, max, 0, nullptr);
+    if (r <= 0)
+      edie("recvmmsg failed");
+    for (int i = 0; i < r; i++)
+      out->push_back(string(bufs[i], msgs[i].msg_len));
+  }
+
   string get_recipient(const string &id)
   {
     char path[256];
@@ -268,19 +298,23 @@ do_process(spool_reader *spool, const string &mailroot, bool pool,
            int nthread, int cpu)
 {
   deliverer d{mailroot, pool};
+  std::vector<string> ids;
   while (true) {
-    string id = spool->dequeue();
-    if (id == "EXIT") {
-      spool->exit_others(cpu, nthread);
-      return;
+    ids.clear();
+    spool->dequeue_batch(&ids, notify_batch);
+    for (const string &id : ids) {
+      if (id == "EXIT") {
+        spool->exit_others(cpu, nthread);
+        return;
+      }
+      if (id == "EXIT2")
+        return;
+      string recip = spool->get_recipient(id);
+      int msgfd = spool->open_message(id);
+      d.deliver(recip, msgfd);
+      close(msgfd);
+      spool->remove(id);
     }
-    if (id == "EXIT2")
-      return;
-    string recip = spool->get_recipient(id);
-    int msgfd = spool->open_message(id);
-    d.deliver(recip, msgfd);
-    close(msgfd);
-    spool->remove(id);
   }
 }
 
@@ -292,6 +326,7 @@ usage(const char *argv0)
   fprintf(stderr, "     all    Use alternate APIs\n");
   fprintf(stderr, "  -p        Use pooled mail-deliver\n");
   fprintf(stderr, "  -c cpu    Pin to cpu (nthread must be 1)\n");
+  fprintf(stderr, "  -n N      Receive up to N notifications at a time\n");
   exit(2);
 }
 
@@ -301,7 +336,7 @@ main(int argc, char **argv)
   int opt;
   bool pool = false, do_pin = false;
   int cpuid = 0;
-  while ((opt = getopt(argc, argv, "a:pc:")) != -1) {
+  while ((opt = getopt(argc, argv, "a:pc:n:")) != -1) {
     switch (opt) {
     case 'a':
       if (strcmp(optarg, "all") == 0)
@@ -318,6 +353,9 @@ main(int argc, char **argv)
       cpuid = atoi(optarg);
       do_pin = true;
       break;
+    case 'n':
+      notify_batch = atoi(optarg);
+      break;
     default:
       usage(argv[0]);
     }
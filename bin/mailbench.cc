@@ -103,7 +103,8 @@ xwaitpid(int pid, const char *cmd)
 
 static void
 do_mua(int cpu, string spooldir, string msgpath, string* userdirs, int nusers,
-       bool random_order, size_t batch_size, bool verbose)
+       bool random_order, size_t batch_size, const char *notify_batch,
+       bool verbose)
 {
 #if defined(XV6_USER)
   int errno;
@@ -133,8 +134,13 @@ do_mua(int cpu, string spooldir, string msgpath, string* userdirs, int nusers,
 
     std::vector<const char*> argv{"./mail-enqueue"};
     // Construct command line
-    if (batch_size)
+    if (batch_size) {
       argv.push_back("-b");
+      if (notify_batch) {
+        argv.push_back("-n");
+        argv.push_back(notify_batch);
+      }
+    }
     argv.push_back(spooldir.c_str());
     if (random_order) // Pick a user at random to deliver mail to.
       argv.push_back(userdirs[(unsigned int)rand() % nusers].c_str());
@@ -250,6 +256,8 @@ usage(const char *argv0)
   fprintf(stderr, "  -b 0      Do not use batch spooling (default)\n");
   fprintf(stderr, "     N      Spool in batches of size N\n");
   fprintf(stderr, "     inf    Spool in unbounded batches\n");
+  fprintf(stderr, "  -n N      Send and receive queue notifications N at a time\n");
+  fprintf(stderr, "            (with batch spooling)\n");
   fprintf(stderr, "  -p        Use delivery process pooling\n");
   fprintf(stderr, "  -c        Use nthreads spool directories\n");
   fprintf(stderr, "  -u N      Use N user mailboxes (N should be between 1 and 1000)\n");
@@ -268,6 +276,7 @@ main(int argc, char **argv)
 {
   const char *alt_str = "none";
   size_t batch_size = 0;
+  const char *notify_batch = nullptr;
   bool verbose = false;
   bool pool = false;
   bool percpu_spooldirs = false;
@@ -275,7 +284,7 @@ main(int argc, char **argv)
   int nusers = 1;
   bool do_warmup = true;
   int opt;
-  while ((opt = getopt(argc, argv, "a:b:pcru:vW")) != -1) {
+  while ((opt = getopt(argc, argv, "a:b:n:pcru:vW")) != -1) {
     switch (opt) {
     case 'a':
       alt_str = optarg;
@@ -286,6 +295,9 @@ main(int argc, char **argv)
       else
         batch_size = atoi(optarg);
       break;
+    case 'n':
+      notify_batch = optarg;
+      break;
     case 'p':
       pool = true;
       break;
@@ -364,6 +376,10 @@ main(int argc, char **argv)
       std::vector<const char*> qman{"./mail-qman", "-a", alt_str};
       if (pool)
         qman.push_back("-p");
+      if (notify_batch) {
+        qman.push_back("-n");
+        qman.push_back(notify_batch);
+      }
 
       if (percpu_spooldirs) {
         char cpu_str[32];
@@ -406,6 +422,8 @@ main(int argc, char **argv)
     printf(" --batch-size=inf");
   else
     printf(" --batch-size=%zu", batch_size);
+  if (notify_batch)
+    printf(" --notify-batch=%s", notify_batch);
   printf(" --pool=%s\n", pool ? "true" : "false");
 
   // Run benchmark
@@ -417,7 +435,7 @@ main(int argc, char **argv)
   for (int i = 0; i < nthreads; ++i)
     threads[i] = std::thread(do_mua, i, percpu_spooldirs ? spooldirs[i] : spooldirs[0],
                              basedir + "/msg", userdirs, nusers, random_order, batch_size,
-                             verbose);
+                             notify_batch, verbose);
 
   // Wait
   timer.join();
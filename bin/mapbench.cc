@@ -492,6 +492,7 @@ main(int argc, char **argv)
   struct kstats kstats = kstats_after - kstats_before;
 
   printf("%lu TLB shootdowns\n", kstats.tlb_shootdown_count);
+  printf("%lu lazy TLB shootdowns\n", kstats.tlb_lazy_count);
   printf("%f TLB shootdowns/page touch\n",
          (double)kstats.tlb_shootdown_count / sum(pages, nthread));
   printf("%f TLB shootdowns/iteration\n",
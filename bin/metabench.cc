@@ -0,0 +1,308 @@
+// File system metadata operation mix, for reproducing maildir-like
+// workloads without the rest of the mail pipeline:
+//
+//   metabench [-c cores] [-d secs] [-s percent] [-n files] [-m mix] dir
+//
+//  -c  Number of cores, each running one worker (default: 1)
+//  -d  Seconds to run (default: 5)
+//  -s  Percentage of operations done in the shared directory; the
+//      rest are done in the worker's private one (default: 0)
+//  -n  Most files a worker keeps in each of its directories
+//      (default: 128)
+//  -m  Weights of each operation, as op=weight,... with ops create,
+//      rename, link, unlink, readdir and stat
+//      (default: create=30,rename=20,link=10,unlink=30,readdir=5,stat=5)
+//
+// Each worker only operates on files it created itself, so workers
+// contend on the shared directory but don't race on names.  The
+// default mix follows a maildir: messages are created, renamed once
+// delivered, and eventually deleted.  Reports ops/s and the mean and
+// max latency of each kind of operation.
+
+#include "types.h"
+#include "user.h"
+#include "pthread.h"
+#include "amd64.h"
+#include "libutil.h"
+#include "xsys.h"
+#include "fs.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <vector>
+
+#define OPS(X) X(create) X(rename) X(link) X(unlink) X(readdir) X(stat)
+
+enum op_t {
+#define X(name) OP_##name,
+  OPS(X)
+#undef X
+  NOPS
+};
+
+static const char *op_names[] = {
+#define X(name) #name,
+  OPS(X)
+#undef X
+};
+
+static int weights[NOPS] = { 30, 20, 10, 30, 5, 5 };
+static int total_weight;
+
+struct op_stats
+{
+  u64 count, cycles, max;
+};
+
+struct worker
+{
+  op_stats ops[NOPS];
+} __attribute__((aligned(64)));
+
+static const char *root;
+static int shared_pct, max_files = 128;
+static std::atomic<bool> stop;
+static pthread_barrier_t bar;
+static worker workers[NCPU];
+
+// One of the directories a worker uses, with the names it has created
+// there.
+struct dirstate
+{
+  char path[128];
+  std::vector<u64> files;
+};
+
+static inline u64
+xorshift(u64 *s)
+{
+  u64 x = *s;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *s = x;
+}
+
+static void
+file_path(char *buf, size_t n, const dirstate &d, int cpu, u64 id)
+{
+  snprintf(buf, n, "%s/c%d.%lu", d.path, cpu, id);
+}
+
+static void*
+meta_worker(void *arg)
+{
+  int cpu = (uintptr_t)arg;
+  worker *w = &workers[cpu];
+  if (setaffinity(cpu) < 0)
+    die("metabench: setaffinity %d failed", cpu);
+
+  u64 seed = 0x9e3779b97f4a7c15ull * (cpu + 1);
+  dirstate dirs[2];
+  snprintf(dirs[0].path, sizeof(dirs[0].path), "%s/p%d", root, cpu);
+  snprintf(dirs[1].path, sizeof(dirs[1].path), "%s/shared", root);
+  if (mkdir(dirs[0].path, 0777) < 0)
+    die("metabench: mkdir %s failed", dirs[0].path);
+  u64 next_id = 0;
+  char pn[160], pn2[160], name[DIRSIZ + 1];
+
+  pthread_barrier_wait(&bar);
+  while (!stop) {
+    dirstate &d = dirs[(int)(xorshift(&seed) % 100) < shared_pct];
+    int r = xorshift(&seed) % total_weight;
+    int op = 0;
+    while (r >= weights[op])
+      r -= weights[op++];
+
+    // Operations on an existing file fall back to creating one, and
+    // creating one to deleting one when the directory is full.
+    if (op != OP_readdir && op != OP_create && d.files.empty())
+      op = OP_create;
+    if ((op == OP_create || op == OP_link) &&
+        d.files.size() >= (size_t)max_files)
+      op = OP_unlink;
+    size_t idx = d.files.empty() ? 0 : xorshift(&seed) % d.files.size();
+
+    u64 t0 = rdtsc();
+    switch (op) {
+    case OP_create: {
+      file_path(pn, sizeof(pn), d, cpu, next_id);
+      int fd = open(pn, O_CREAT|O_EXCL|O_WRONLY, 0666);
+      if (fd < 0)
+        die("metabench: create %s failed", pn);
+      close(fd);
+      d.files.push_back(next_id++);
+      break;
+    }
+    case OP_rename:
+      file_path(pn, sizeof(pn), d, cpu, d.files[idx]);
+      file_path(pn2, sizeof(pn2), d, cpu, next_id);
+      if (rename(pn, pn2) < 0)
+        die("metabench: rename %s failed", pn);
+      d.files[idx] = next_id++;
+      break;
+    case OP_link:
+      file_path(pn, sizeof(pn), d, cpu, d.files[idx]);
+      file_path(pn2, sizeof(pn2), d, cpu, next_id);
+      if (link(pn, pn2) < 0)
+        die("metabench: link %s failed", pn);
+      d.files.push_back(next_id++);
+      break;
+    case OP_unlink:
+      file_path(pn, sizeof(pn), d, cpu, d.files[idx]);
+      if (unlink(pn) < 0)
+        die("metabench: unlink %s failed", pn);
+      d.files[idx] = d.files.back();
+      d.files.pop_back();
+      break;
+    case OP_readdir: {
+      int fd = open(d.path, O_RDONLY);
+      if (fd < 0)
+        die("metabench: open %s failed", d.path);
+      char *prev = nullptr;
+      while (readdir(fd, prev, name) > 0)
+        prev = name;
+      close(fd);
+      break;
+    }
+    case OP_stat: {
+      struct stat st;
+      file_path(pn, sizeof(pn), d, cpu, d.files[idx]);
+      if (stat(pn, &st) < 0)
+        die("metabench: stat %s failed", pn);
+      break;
+    }
+    }
+    u64 t = rdtsc() - t0;
+    op_stats &s = w->ops[op];
+    s.count++;
+    s.cycles += t;
+    if (t > s.max)
+      s.max = t;
+  }
+  return nullptr;
+}
+
+// Parse op=weight,... into weights.
+static bool
+parse_mix(const char *mix)
+{
+  for (int op = 0; op < NOPS; op++)
+    weights[op] = 0;
+  while (*mix) {
+    const char *eq = strchr(mix, '=');
+    if (!eq)
+      return false;
+    int op;
+    for (op = 0; op < NOPS; op++)
+      if (strlen(op_names[op]) == (size_t)(eq - mix) &&
+          strncmp(op_names[op], mix, eq - mix) == 0)
+        break;
+    if (op == NOPS)
+      return false;
+    char *end;
+    weights[op] = strtol(eq + 1, &end, 10);
+    if (end == eq + 1 || weights[op] < 0)
+      return false;
+    mix = end;
+    if (*mix == ',')
+      mix++;
+    else if (*mix)
+      return false;
+  }
+  return true;
+}
+
+static void __attribute__((noreturn))
+usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-c cores] [-d secs] [-s percent] [-n files] "
+          "[-m mix] dir\n", argv0);
+  exit(2);
+}
+
+int
+main(int ac, char *av[])
+{
+  int ncores = 1, secs = 5;
+
+  int opt;
+  while ((opt = getopt(ac, av, "c:d:s:n:m:")) != -1) {
+    switch (opt) {
+    case 'c':
+      ncores = atoi(optarg);
+      break;
+    case 'd':
+      secs = atoi(optarg);
+      break;
+    case 's':
+      shared_pct = atoi(optarg);
+      break;
+    case 'n':
+      max_files = atoi(optarg);
+      break;
+    case 'm':
+      if (!parse_mix(optarg))
+        usage(av[0]);
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+  for (int op = 0; op < NOPS; op++)
+    total_weight += weights[op];
+  if (optind != ac - 1 || ncores < 1 || ncores > NCPU || secs < 1 ||
+      shared_pct < 0 || shared_pct > 100 || max_files < 1 || !total_weight)
+    usage(av[0]);
+  root = av[optind];
+
+  char pn[128];
+  mkdir(root, 0777);
+  snprintf(pn, sizeof(pn), "%s/shared", root);
+  if (mkdir(pn, 0777) < 0)
+    die("metabench: mkdir %s failed", pn);
+  pthread_barrier_init(&bar, 0, ncores + 1);
+
+  pthread_t tids[NCPU];
+  for (int i = 0; i < ncores; i++)
+    xthread_create(&tids[i], 0, meta_worker, (void*)(uintptr_t)i);
+  pthread_barrier_wait(&bar);
+  nsleep((u64)secs * 1000000000);
+  stop = true;
+  for (int i = 0; i < ncores; i++)
+    xpthread_join(tids[i]);
+
+  double us = cpuhz() / 1e6;
+  op_stats total[NOPS] = {};
+  u64 nops = 0;
+  for (int i = 0; i < ncores; i++) {
+    for (int op = 0; op < NOPS; op++) {
+      op_stats &s = workers[i].ops[op];
+      total[op].count += s.count;
+      total[op].cycles += s.cycles;
+      if (s.max > total[op].max)
+        total[op].max = s.max;
+      nops += s.count;
+    }
+  }
+
+  printf("# cores %d secs %d shared %d%% files %d\n", ncores, secs,
+         shared_pct, max_files);
+  printf("%-8s %10s %12s %10s %10s\n", "op", "count", "ops/s", "avg(us)",
+         "max(us)");
+  for (int op = 0; op < NOPS; op++) {
+    if (!total[op].count)
+      continue;
+    printf("%-8s %10lu %12.1f %10.2f %10.2f\n", op_names[op], total[op].count,
+           (double)total[op].count / secs,
+           total[op].cycles / us / total[op].count, total[op].max / us);
+  }
+  printf("%-8s %10lu %12.1f\n", "total", nops, (double)nops / secs);
+  return 0;
+}
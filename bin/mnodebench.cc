@@ -0,0 +1,154 @@
+// Measure the kernel memory that each cached file costs:
+//
+//   mnodebench -c [-n files] dir
+//   mnodebench dir
+//
+//  -c  Create that many empty files under dir, spread over subdirectories
+//      of 1000, and sync
+//  -n  Number of files to create (default: 100000)
+//
+// Without -c, stats every file under dir, which after a reboot loads
+// them all from the disk into the mnode cache.  Either way it reports
+// the drop in free kernel pages, from /dev/kmemstats, per file.  That
+// includes the buffer cache blocks read or written along the way, so
+// it's an upper bound on what an mnode costs.
+
+#include "types.h"
+#include "user.h"
+#include "libutil.h"
+#include "fs.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <string>
+
+enum { files_per_dir = 1000 };
+
+static u64 page_size;
+
+static u64
+free_pages(void)
+{
+  int fd = open("/dev/kmemstats", O_RDONLY);
+  if (fd < 0)
+    die("mnodebench: open /dev/kmemstats failed");
+  std::string out;
+  char buf[512];
+  int n;
+  while ((n = read(fd, buf, sizeof buf)) > 0)
+    out.append(buf, n);
+  close(fd);
+
+  const char *key = "Total free pages: ";
+  const char *p = strstr(out.c_str(), key);
+  if (!p)
+    die("mnodebench: no free page count in /dev/kmemstats");
+  const char *ps = strstr(p, "Page size: ");
+  if (ps)
+    page_size = strtoul(ps + strlen("Page size: "), nullptr, 10);
+  return strtoul(p + strlen(key), nullptr, 10);
+}
+
+static u64
+create(const std::string &dir, u64 nfiles)
+{
+  if (mkdir(dir.c_str(), 0777) < 0)
+    die("mnodebench: mkdir %s failed", dir.c_str());
+  char path[256];
+  for (u64 i = 0; i < nfiles; i++) {
+    if (i % files_per_dir == 0) {
+      snprintf(path, sizeof path, "%s/%lu", dir.c_str(), i / files_per_dir);
+      if (mkdir(path, 0777) < 0)
+        die("mnodebench: mkdir %s failed", path);
+    }
+    snprintf(path, sizeof path, "%s/%lu/%lu", dir.c_str(),
+             i / files_per_dir, i);
+    int fd = open(path, O_CREAT|O_WRONLY, 0666);
+    if (fd < 0)
+      die("mnodebench: create %s failed", path);
+    close(fd);
+  }
+  sync();
+  return nfiles;
+}
+
+// Stat everything under dir and return the number of files.
+static u64
+walk(const std::string &dir)
+{
+  int fd = open(dir.c_str(), O_RDONLY);
+  if (fd < 0)
+    die("mnodebench: open %s failed", dir.c_str());
+  u64 nfiles = 0;
+  char buf[4096];
+  ssize_t n;
+  while ((n = getdents(fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t off = 0; off < n; ) {
+      struct xv6_dirent *de = (struct xv6_dirent*)(buf + off);
+      off += de->d_reclen;
+      if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+        continue;
+      std::string path = dir + "/" + de->d_name;
+      struct stat st;
+      if (stat(path.c_str(), &st) < 0)
+        die("mnodebench: stat %s failed", path.c_str());
+      if (S_ISDIR(st.st_mode))
+        nfiles += walk(path);
+      else
+        nfiles++;
+    }
+  }
+  if (n < 0)
+    die("mnodebench: getdents %s failed", dir.c_str());
+  close(fd);
+  return nfiles;
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-c] [-n files] dir\n", argv0);
+  exit(2);
+}
+
+int
+main(int ac, char *av[])
+{
+  bool docreate = false;
+  u64 nfiles = 100000;
+  int opt;
+  while ((opt = getopt(ac, av, "cn:")) != -1) {
+    switch (opt) {
+    case 'c':
+      docreate = true;
+      break;
+    case 'n':
+      nfiles = strtoul(optarg, nullptr, 10);
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+  if (optind != ac - 1 || nfiles < 1)
+    usage(av[0]);
+  std::string dir = av[optind];
+
+  u64 before = free_pages();
+  u64 t0 = now_usec();
+  u64 n = docreate ? create(dir, nfiles) : walk(dir);
+  u64 t1 = now_usec();
+  u64 after = free_pages();
+  if (!n)
+    die("mnodebench: no files under %s", dir.c_str());
+
+  u64 pages = before > after ? before - after : 0;
+  printf("%s %lu files in %lu us: %lu pages, %lu bytes per file\n",
+         docreate ? "created" : "loaded", n, t1 - t0, pages,
+         pages * page_size / n);
+  return 0;
+}
@@ -5,7 +5,9 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <sys/wait.h>
 
 #include <vector>
 
@@ -21,13 +23,63 @@ read_kstats(kstats *out)
   close(fd);
 }
 
+static void
+print_kstats(const kstats &kstats, bool nonzero)
+{
+  // XXX Assumes uint64_t.  Use to_stream instead.
+  // XXX Would be nice if this knew what fields were relative to other
+  // fields and could divide them for you.
+#define X(type, name)                                   \
+  if (!nonzero || kstats.name)                          \
+    printf("%lu " #name "\n", kstats.name);
+  KSTATS_ALL(X);
+#undef X
+  printf("\n");
+}
+
+// Print what changed in each interval of ms milliseconds, until killed.
+static void __attribute__((noreturn))
+monitor(unsigned ms)
+{
+  struct kstats before, after;
+
+  read_kstats(&before);
+  for (unsigned long t = ms;; t += ms) {
+    usleep(ms * 1000);
+    read_kstats(&after);
+    printf("--- %lu ms\n", t);
+    print_kstats(after - before, true);
+    before = after;
+  }
+}
+
+static void __attribute__((noreturn))
+usage(const char *argv0)
+{
+  die("usage: %s [-i interval-ms] command...", argv0);
+}
+
 int
 main(int ac, char * const av[])
 {
   struct kstats kstats_before, kstats_after;
+  unsigned interval = 0;
+
+  int opt;
+  while ((opt = getopt(ac, av, "i:")) != -1) {
+    switch (opt) {
+    case 'i':
+      interval = atoi(optarg);
+      if (interval == 0)
+        usage(av[0]);
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
 
-  if (ac <= 1)
-    die("usage: %s command...", av[0]);
+  if (optind == ac)
+    usage(av[0]);
 
   read_kstats(&kstats_before);
 
@@ -36,24 +88,33 @@ main(int ac, char * const av[])
     die("monkstats: fork failed");
 
   if (pid == 0) {
-    std::vector<const char *> args(av + 1, av + ac);
+    std::vector<const char *> args(av + optind, av + ac);
     args.push_back(nullptr);
     execv(args[0], const_cast<char * const *>(args.data()));
     die("monkstats: exec failed");
   }
 
-  wait(NULL);
+  // With -i, a second child reports the counters as the command runs.
+  int monpid = -1;
+  if (interval) {
+    monpid = fork();
+    if (monpid < 0)
+      die("monkstats: fork failed");
+    if (monpid == 0)
+      monitor(interval);
+  }
 
-  read_kstats(&kstats_after);
+  waitpid(pid, NULL, 0);
 
-  struct kstats kstats = kstats_after - kstats_before;
+  if (monpid > 0) {
+    kill(monpid);
+    waitpid(monpid, NULL, 0);
+  }
 
-  // XXX Assumes uint64_t.  Use to_stream instead.
-  // XXX Would be nice if this knew what fields were relative to other
-  // fields and could divide them for you.
-#define X(type, name) printf("%lu " #name "\n", kstats.name);
-  KSTATS_ALL(X);
-#undef X
-  printf("\n");
+  read_kstats(&kstats_after);
+
+  if (interval)
+    printf("--- total\n");
+  print_kstats(kstats_after - kstats_before, false);
   return 0;
 }
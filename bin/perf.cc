@@ -3,6 +3,8 @@
 #include "sampler.h"
 #include "bits.hh"
 #include "pmcdb.hh"
+#include "faultstats.h"
+#include "libutil.h"
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -15,6 +17,10 @@
 #define DEFAULT_EVENT "CPU cycle unhalted"
 #define DEFAULT_PERIOD 100000
 
+static const char *fault_names[PF_NTYPES] = {
+  "zero", "cow", "present", "file-hit", "file-miss", "io-retry",
+};
+
 static void
 conf(int fd, const struct perf_selector &c)
 {
@@ -23,6 +29,71 @@ conf(int fd, const struct perf_selector &c)
   close(fd);
 }
 
+#define FAULTSTATS_SZ (sizeof(faultstats_info) + NCPU * sizeof(pagefault_stats))
+
+// Read /dev/faultstats into buf and return the number of cores it
+// covers.
+static size_t
+read_faultstats(char *buf)
+{
+  int fd = open("/dev/faultstats", O_RDONLY);
+  if (fd < 0)
+    die("perf: open /dev/faultstats failed");
+  int r = xread(fd, buf, FAULTSTATS_SZ);
+  close(fd);
+  if (r < (int)sizeof(faultstats_info))
+    die("perf: short read from /dev/faultstats");
+  return (r - sizeof(faultstats_info)) / sizeof(pagefault_stats);
+}
+
+static pagefault_stats
+diff(const pagefault_stats &a, const pagefault_stats &b)
+{
+  pagefault_stats d;
+  for (int t = 0; t < PF_NTYPES; t++) {
+    d.count[t] = a.count[t] - b.count[t];
+    d.cycles[t] = a.cycles[t] - b.cycles[t];
+    for (int i = 0; i < PF_HIST_BUCKETS; i++)
+      d.hist[t][i] = a.hist[t][i] - b.hist[t][i];
+  }
+  return d;
+}
+
+// Print the page faults of the command (from the growth of our
+// children's totals) and of each core while it ran.
+static void
+print_faults(const char *before, const char *after, size_t ncpus)
+{
+  const faultstats_info *b = (const faultstats_info*)before;
+  const faultstats_info *a = (const faultstats_info*)after;
+  double us = a->cpuhz / 1e6;
+  pagefault_stats d = diff(a->children, b->children);
+
+  printf("\n%-10s %10s %12s %10s  cycles histogram from 2^%d\n",
+         "fault", "count", "total(ms)", "avg(us)", PF_HIST_SHIFT);
+  for (int t = 0; t < PF_NTYPES; t++) {
+    printf("%-10s %10lu %12.3f %10.3f ", fault_names[t], d.count[t],
+           d.cycles[t] / us / 1000,
+           d.count[t] ? d.cycles[t] / us / d.count[t] : 0.0);
+    for (int i = 0; i < PF_HIST_BUCKETS; i++)
+      printf(" %lu", d.hist[t][i]);
+    printf("\n");
+  }
+
+  printf("\n%-5s %10s %12s\n", "cpu", "faults", "total(ms)");
+  for (size_t c = 0; c < ncpus; c++) {
+    pagefault_stats dc = diff(a->cpu[c], b->cpu[c]);
+    uint64_t n = 0, cycles = 0;
+    // io-retry cycles are already part of file-miss faults.
+    for (int t = 0; t < PF_RETRY; t++) {
+      n += dc.count[t];
+      cycles += dc.cycles[t];
+    }
+    if (n)
+      printf("%-5zu %10lu %12.3f\n", c, n, cycles / us / 1000);
+  }
+}
+
 void
 usage(const char *argv0)
 {
@@ -30,7 +101,9 @@ usage(const char *argv0)
   printf("  -e event   Event to sample (default: %s)\n"
          "  -p period  Sample every PERIOD events (default: %d)\n"
          "  -P         Precise sampling\n"
-         "  -l cycles  Sample loads longer than CYCLES (implies -P)\n",
+         "  -l cycles  Sample loads longer than CYCLES (implies -P)\n"
+         "  -o         Profile time spent asleep instead of events\n"
+         "  -f         Print the command's page faults by type\n",
          DEFAULT_EVENT, DEFAULT_PERIOD);
 }
 
@@ -39,12 +112,13 @@ main(int ac, char *av[])
 {
   struct perf_selector c{};
   const char *event = DEFAULT_EVENT;
+  bool faults = false;
 
   c.enable = true;
   c.period = DEFAULT_PERIOD;
 
   int opt;
-  while ((opt = getopt(ac, av, "e:p:Pl:")) != -1) {
+  while ((opt = getopt(ac, av, "e:p:Pl:of")) != -1) {
     switch (opt) {
     case 'e':                   // Event name
       event = optarg;
@@ -66,6 +140,12 @@ main(int ac, char *av[])
       if (!c.load_latency)
         die("perf: bad -l argument");
       break;
+    case 'o':                   // Off-CPU time
+      c.offcpu = true;
+      break;
+    case 'f':                   // Page fault stats
+      faults = true;
+      break;
     default:
       usage(av[0]);
       return -1;
@@ -90,6 +170,11 @@ main(int ac, char *av[])
   if (fd < 0)
     die("perf: open failed");
 
+  static char faults_before[FAULTSTATS_SZ], faults_after[FAULTSTATS_SZ];
+  size_t ncpus = 0;
+  if (faults)
+    ncpus = read_faultstats(faults_before);
+
   int pid = fork();
   if (pid < 0)
     die("perf: fork failed");
@@ -103,5 +188,9 @@ main(int ac, char *av[])
   wait(NULL);
   c.enable = false;
   conf(fd, c);
+  if (faults) {
+    size_t n = read_faultstats(faults_after);
+    print_faults(faults_before, faults_after, n < ncpus ? n : ncpus);
+  }
   return 0;
 }
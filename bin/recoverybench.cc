@@ -0,0 +1,160 @@
+// Set up a crash with the per-core journals filled to a given level, to
+// measure how long crash-recovery takes.
+//
+//   recoverybench [-c cpus] [-l percent] [-b blocks] [-n] dir
+//
+// Holds off the checkpointers, then creates and fsyncs files in dir
+// from each of the first cpus cores until that core's journal is
+// percent full of committed but unapplied transactions, and halts
+// without syncing.  After the reboot, the recovery section of
+// /dev/fsstats breaks down the time recovery took.  -n fills the
+// journals but doesn't halt.
+
+#include "types.h"
+#include "user.h"
+#include "libutil.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static char fsstats[64 * 1024];
+static char filebuf[16 * 4096];
+
+static void
+fsstats_ctl(const char *cmd)
+{
+  int fd = open("/dev/fsstats", O_WRONLY);
+  if (fd < 0)
+    die("recoverybench: open /dev/fsstats failed");
+  if (write(fd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd))
+    die("recoverybench: %s failed", cmd);
+  close(fd);
+}
+
+// Returns how full (in percent) the journal of core cpu is, from the
+// "journal used_bytes log_bytes" table of /dev/fsstats.
+static int
+journal_fill(int cpu, u64 *used)
+{
+  int fd = open("/dev/fsstats", O_RDONLY);
+  if (fd < 0)
+    die("recoverybench: open /dev/fsstats failed");
+  int n = xread(fd, fsstats, sizeof(fsstats) - 1);
+  close(fd);
+  if (n < 0)
+    die("recoverybench: read /dev/fsstats failed");
+  fsstats[n] = 0;
+
+  const char *hdr = "journal used_bytes log_bytes\n";
+  char *p = strstr(fsstats, hdr);
+  if (!p)
+    die("recoverybench: no journal table in /dev/fsstats");
+  p += strlen(hdr);
+  while (*p >= '0' && *p <= '9') {
+    char *end;
+    long c = strtol(p, &end, 10);
+    u64 u = strtoul(end, &end, 10);
+    u64 size = strtoul(end, &end, 10);
+    if (c == cpu) {
+      *used = u;
+      return size ? u * 100 / size : 100;
+    }
+    p = strchr(end, '\n');
+    if (!p)
+      break;
+    p++;
+  }
+  die("recoverybench: no journal for cpu %d", cpu);
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-c cpus] [-l percent] [-b blocks] [-n] dir\n",
+          argv0);
+  fprintf(stderr, "  -c  Number of journals to fill (default: 1)\n"
+                  "  -l  How full to fill each journal (default: 50)\n"
+                  "  -b  Blocks written per fsync (default: 1)\n"
+                  "  -n  Don't halt once the journals are filled\n");
+  exit(2);
+}
+
+int
+main(int ac, char *av[])
+{
+  int ncpu = 1, level = 50, nblocks = 1;
+  bool crash = true;
+
+  int opt;
+  while ((opt = getopt(ac, av, "c:l:b:n")) != -1) {
+    switch (opt) {
+    case 'c':
+      ncpu = atoi(optarg);
+      break;
+    case 'l':
+      level = atoi(optarg);
+      break;
+    case 'b':
+      nblocks = atoi(optarg);
+      break;
+    case 'n':
+      crash = false;
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+  if (optind != ac - 1 || ncpu < 1 || level < 1 || level > 100 ||
+      nblocks < 1 || nblocks * 4096 > (int)sizeof(filebuf))
+    usage(av[0]);
+  const char *dir = av[optind];
+
+  if (mkdir(dir, 0777) < 0)
+    die("recoverybench: mkdir %s failed", dir);
+  // Start from empty journals.
+  sync();
+  fsstats_ctl("hold");
+
+  int filenum = 0;
+  for (int cpu = 0; cpu < ncpu; cpu++) {
+    if (setaffinity(cpu) < 0)
+      die("recoverybench: setaffinity %d failed", cpu);
+
+    u64 used = 0, last = 0;
+    int nfiles = 0, fill;
+    while ((fill = journal_fill(cpu, &used)) < level) {
+      // The journal ran out of room and the checkpointer emptied it, so
+      // this level can't be reached with these transactions.
+      if (used < last)
+        die("recoverybench: journal %d overflowed at %lu bytes", cpu, last);
+      last = used;
+
+      char name[128];
+      snprintf(name, sizeof(name), "%s/f%d", dir, filenum++);
+      int fd = open(name, O_CREAT|O_WRONLY, 0666);
+      if (fd < 0)
+        die("recoverybench: open %s failed", name);
+      memset(filebuf, filenum, nblocks * 4096);
+      if (write(fd, filebuf, nblocks * 4096) != nblocks * 4096)
+        die("recoverybench: write %s failed", name);
+      if (fsync(fd) < 0)
+        die("recoverybench: fsync %s failed", name);
+      close(fd);
+      nfiles++;
+    }
+    printf("journal %d: %d%% full, %lu bytes, %d files\n",
+           cpu, fill, used, nfiles);
+  }
+
+  if (!crash) {
+    fsstats_ctl("release");
+    return 0;
+  }
+  printf("halting; cat /dev/fsstats after the reboot\n");
+  halt();
+  return 0;
+}
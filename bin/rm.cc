@@ -1,50 +1,81 @@
 #include "types.h"
 #include "user.h"
-#include "fs.h"                 // DIRSIZ
+#include "fs.h"                 // xv6_direntstat
 #include "libutil.h"
+#include "treewalk.hh"
 
 #include <fcntl.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/syscall_batch.h>
 
+#include <algorithm>
+#include <memory>
 #include <string>
-#include <vector>
 
 using std::string;
-using std::vector;
+
+// Unlinks per syscall_batch call
+enum { BATCH = 64 };
+
+class rm_walk : public tree_walk
+{
+public:
+  explicit rm_walk(task_pool *pool) : tree_walk(pool) { }
+
+protected:
+  // Unlink the files in batches, rather than a system call apiece, and
+  // spread the batches of a large directory over the pool.
+  void files(const string &path, int fd,
+             struct xv6_direntstat *const *ents, size_t n) override
+  {
+    size_t nbatch = (n + BATCH - 1) / BATCH;
+    pool()->parallel_for(0, nbatch, 1, [&](size_t b) {
+        struct syscall_batch_entry batch[BATCH];
+        size_t first = b * BATCH;
+        size_t k = std::min(n - first, (size_t)BATCH);
+        for (size_t j = 0; j < k; j++) {
+          batch[j] = {};
+          batch[j].num = SYS_unlinkat;
+          batch[j].args[0] = fd;
+          batch[j].args[1] = (uintptr_t)ents[first + j]->d_name;
+          batch[j].flags = SYSCALL_BATCH_BARRIER;
+        }
+        long r = syscall_batch(batch, k);
+        if (r > 0 && (int)batch[r - 1].ret < 0)
+          edie("rm: failed to unlink %s/%s", path.c_str(),
+               ents[first + r - 1]->d_name);
+        if (r != (long)k)
+          edie("rm: syscall_batch failed");
+      });
+  }
+
+  void leave(const string &path) override
+  {
+    if (unlink(path.c_str()) < 0)
+      edie("rm: failed to unlink %s", path.c_str());
+  }
+
+  void error(const string &path) override
+  {
+    edie("rm: failed to read %s", path.c_str());
+  }
+};
 
 static void
-rmtree(const char *base)
+rmtree(task_pool *pool, const char *base)
 {
   struct stat st;
   if (lstat(base, &st) < 0)
     edie("rm: failed to stat %s", base);
   if ((st.st_mode & S_IFMT) == S_IFDIR) {
-    // Get all directory entries
-    vector<string> names;
-    int fd = open(base, O_RDONLY);
-    if (fd < 0)
+    rm_walk w(pool);
+    if (w.walk(base) < 0)
       edie("rm: failed to open %s", base);
-    char buf[DIRSIZ];
-    char *prev = nullptr;
-    while (true) {
-      int r = readdir(fd, prev, buf);
-      prev = buf;
-      if (r < 0)
-        edie("rm: failed to readdir %s", base);
-      if (r == 0)
-        break;
-      if (strcmp(buf, ".") == 0 || strcmp(buf, "..") == 0)
-        continue;
-      names.push_back(string(base).append("/").append(buf));
-    }
-    close(fd);
-    // Delete children
-    for (auto &name : names)
-      rmtree(name.c_str());
-  }
-  if (unlink(base) < 0)
+  } else if (unlink(base) < 0) {
     edie("rm: failed to unlink %s", base);
+  }
 }
 
 int
@@ -53,18 +84,31 @@ main(int argc, char *argv[])
   int i;
 
   if(argc < 2)
-    die("Usage: rm [-r] files...");
+    die("Usage: rm [-r [-p cores]] files...");
 
   bool recursive = false;
+  int cores = 1;
   if (strcmp(argv[1], "-r") == 0) {
     recursive = true;
     argc--;
     argv++;
+    if (argc > 2 && strcmp(argv[1], "-p") == 0) {
+      cores = atoi(argv[2]);
+      if (cores < 1)
+        die("rm: bad core count %s", argv[2]);
+      argc -= 2;
+      argv += 2;
+    }
   }
 
+  // Only start the pool's threads if there's a tree to walk.
+  std::unique_ptr<task_pool> pool;
+  if (recursive)
+    pool.reset(new task_pool(cores));
+
   for(i = 1; i < argc; i++){
     if (recursive)
-      rmtree(argv[i]);
+      rmtree(pool.get(), argv[i]);
     else if(unlink(argv[i]) < 0)
       die("rm: %s failed to delete\n", argv[i]);
   }
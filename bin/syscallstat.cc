@@ -0,0 +1,175 @@
+// Print system call counts and latencies from /dev/syscalls, either
+// since boot (or the last reset) or while a command runs.
+
+#include "types.h"
+#include "user.h"
+#include "syscallstats.h"
+#include "libutil.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#define SYSCALLSTATS_SZ \
+  (sizeof(syscallstats_info) + NCPU * sizeof(syscall_stats))
+
+static char before[SYSCALLSTATS_SZ], after[SYSCALLSTATS_SZ];
+
+// Read /dev/syscalls into buf and return the number of cores it
+// covers.
+static size_t
+read_stats(char *buf)
+{
+  int fd = open("/dev/syscalls", O_RDONLY);
+  if (fd < 0)
+    die("syscallstat: open /dev/syscalls failed");
+  int r = xread(fd, buf, SYSCALLSTATS_SZ);
+  close(fd);
+  if (r < (int)sizeof(syscallstats_info))
+    die("syscallstat: short read from /dev/syscalls");
+  return (r - sizeof(syscallstats_info)) / sizeof(syscall_stats);
+}
+
+static void
+ctl(const char *cmd)
+{
+  int fd = open("/dev/syscalls", O_WRONLY);
+  if (fd < 0)
+    die("syscallstat: open /dev/syscalls failed");
+  if (write(fd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd))
+    die("syscallstat: write %s failed", cmd);
+  close(fd);
+}
+
+// Print each system call that the after snapshot has more of than
+// before (which may be all zeroes), most time spent first.
+static void
+print_stats(const char *b, const char *a, size_t ncpus, bool percpu)
+{
+  const syscallstats_info *bi = (const syscallstats_info*)b;
+  const syscallstats_info *ai = (const syscallstats_info*)a;
+  double us = ai->cpuhz / 1e6;
+  // Too big for the stack
+  static syscall_stats d;
+
+  for (size_t c = 0; c < ncpus; c++) {
+    for (int n = 0; n < SYSCALL_STATS_MAX; n++) {
+      d.count[n] += ai->cpu[c].count[n] - bi->cpu[c].count[n];
+      d.cycles[n] += ai->cpu[c].cycles[n] - bi->cpu[c].cycles[n];
+      for (int i = 0; i < SC_HIST_BUCKETS; i++)
+        d.hist[n][i] += ai->cpu[c].hist[n][i] - bi->cpu[c].hist[n][i];
+    }
+  }
+
+  std::vector<int> nums;
+  for (int n = 0; n < SYSCALL_STATS_MAX; n++)
+    if (d.count[n])
+      nums.push_back(n);
+  std::sort(nums.begin(), nums.end(), [&](int x, int y) {
+      return d.cycles[x] > d.cycles[y];
+    });
+
+  if (!ai->enabled)
+    printf("syscall accounting is off\n");
+  printf("%-14s %10s %12s %10s  cycles histogram from 2^%d\n",
+         "syscall", "count", "total(ms)", "avg(us)", SC_HIST_SHIFT);
+  for (int n : nums) {
+    const char *name = n < (int)ai->nsyscalls ? ai->names[n] : "";
+    printf("%-14s %10lu %12.3f %10.3f ", name[0] ? name : "?",
+           d.count[n], d.cycles[n] / us / 1000,
+           d.cycles[n] / us / d.count[n]);
+    // Drop the empty buckets at the top
+    int last = SC_HIST_BUCKETS - 1;
+    while (last > 0 && !d.hist[n][last])
+      last--;
+    for (int i = 0; i <= last; i++)
+      printf(" %lu", d.hist[n][i]);
+    printf("\n");
+  }
+
+  if (!percpu)
+    return;
+  printf("\n%-5s %10s %12s\n", "cpu", "calls", "total(ms)");
+  for (size_t c = 0; c < ncpus; c++) {
+    uint64_t calls = 0, cycles = 0;
+    for (int n = 0; n < SYSCALL_STATS_MAX; n++) {
+      calls += ai->cpu[c].count[n] - bi->cpu[c].count[n];
+      cycles += ai->cpu[c].cycles[n] - bi->cpu[c].cycles[n];
+    }
+    if (calls)
+      printf("%-5zu %10lu %12.3f\n", c, calls, cycles / us / 1000);
+  }
+}
+
+static void
+usage(const char *argv0)
+{
+  printf("Usage: %s [options] [command...]\n", argv0);
+  printf("  -c  Also print the calls of each core\n"
+         "  -e  Turn accounting on (it starts on)\n"
+         "  -d  Turn accounting off\n"
+         "  -z  Clear the counts\n"
+         "With a command, print the calls made while it runs; otherwise\n"
+         "print everything since boot or the last -z.\n");
+}
+
+int
+main(int ac, char *av[])
+{
+  bool percpu = false, control = false;
+
+  int opt;
+  while ((opt = getopt(ac, av, "cedz")) != -1) {
+    switch (opt) {
+    case 'c':
+      percpu = true;
+      break;
+    case 'e':
+      ctl("on");
+      control = true;
+      break;
+    case 'd':
+      ctl("off");
+      control = true;
+      break;
+    case 'z':
+      ctl("reset");
+      control = true;
+      break;
+    default:
+      usage(av[0]);
+      return -1;
+    }
+  }
+
+  if (optind == ac) {
+    if (control)
+      return 0;
+    size_t ncpus = read_stats(after);
+    print_stats(before, after, ncpus, percpu);
+    return 0;
+  }
+
+  std::vector<const char *> args(av + optind, av + ac);
+  args.push_back(nullptr);
+
+  size_t ncpus = read_stats(before);
+  int pid = fork();
+  if (pid < 0)
+    die("syscallstat: fork failed");
+  if (pid == 0) {
+    execv(args[0], const_cast<char * const *>(args.data()));
+    die("syscallstat: exec %s failed", args[0]);
+  }
+  wait(NULL);
+
+  size_t n = read_stats(after);
+  // Our own fork, wait, and reads are counted too.
+  print_stats(before, after, n < ncpus ? n : ncpus, percpu);
+  return 0;
+}
@@ -0,0 +1,171 @@
+// Compare serial and parallel tree walks by timing cp -r, du, and
+// rm -r on a maildir tree:
+//
+//   treebench [-c cores] [-u users] [-n msgs] [-s bytes] dir
+//
+//  -c  Cores for the parallel runs (default: 2)
+//  -u  Number of mailboxes (default: 16)
+//  -n  Messages per mailbox, split between cur and new (default: 256)
+//  -s  Size of each message (default: 2048)
+//
+// Builds dir/src with a cur, new and tmp directory per mailbox, then
+// for 1 core and for cores cores copies it to dir/copy with cp -r,
+// sizes the copy with du and removes it with rm -r.  Each tool runs
+// as its own process, so the times include exec.
+
+#include "types.h"
+#include "user.h"
+#include "libutil.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <string>
+
+static int ncore = 2, nusers = 16, nmsgs = 256, msg_bytes = 2048;
+
+static void
+xmkdir(const std::string &path)
+{
+  if (mkdir(path.c_str(), 0777) < 0)
+    die("treebench: mkdir %s failed", path.c_str());
+}
+
+static void
+build(const std::string &src)
+{
+  char *msg = (char*)malloc(msg_bytes);
+  memset(msg, 'x', msg_bytes);
+  xmkdir(src);
+  for (int u = 0; u < nusers; u++) {
+    char box[256];
+    snprintf(box, sizeof box, "%s/user%d", src.c_str(), u);
+    xmkdir(box);
+    xmkdir(std::string(box) + "/cur");
+    xmkdir(std::string(box) + "/new");
+    xmkdir(std::string(box) + "/tmp");
+    for (int m = 0; m < nmsgs; m++) {
+      char path[256];
+      snprintf(path, sizeof path, "%s/%s/%d.treebench", box,
+               m % 2 ? "cur" : "new", m);
+      int fd = open(path, O_CREAT|O_WRONLY, 0666);
+      if (fd < 0)
+        die("treebench: create %s failed", path);
+      xwrite(fd, msg, msg_bytes);
+      close(fd);
+    }
+  }
+  free(msg);
+}
+
+// Run args and return its standard output.
+static std::string
+run(const char **args)
+{
+  int p[2];
+  if (pipe(p) < 0)
+    die("treebench: pipe failed");
+  int pid = fork();
+  if (pid < 0)
+    die("treebench: fork failed");
+  if (pid == 0) {
+    close(1);
+    dup(p[1]);
+    close(p[0]);
+    close(p[1]);
+    execv(args[0], const_cast<char * const *>(args));
+    die("treebench: exec %s failed", args[0]);
+  }
+  close(p[1]);
+
+  std::string out;
+  char buf[128];
+  int n;
+  while ((n = read(p[0], buf, sizeof buf)) > 0)
+    out.append(buf, n);
+  close(p[0]);
+
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || WEXITSTATUS(status) != 0)
+    die("treebench: %s failed", args[0]);
+  return out;
+}
+
+// Time a cp -r, du, and rm -r on cores cores.  Returns du's output.
+static std::string
+bench(const std::string &dir, int cores)
+{
+  std::string src = dir + "/src", copy = dir + "/copy";
+  char c[16];
+  snprintf(c, sizeof c, "%d", cores);
+
+  const char *cp[] = { "/bin/cp", "-r", "-p", c, src.c_str(),
+                       copy.c_str(), nullptr };
+  const char *du[] = { "/bin/du", "-p", c, copy.c_str(), nullptr };
+  const char *rm[] = { "/bin/rm", "-r", "-p", c, copy.c_str(),
+                       nullptr };
+
+  u64 t0 = now_usec();
+  run(cp);
+  u64 t1 = now_usec();
+  std::string size = run(du);
+  u64 t2 = now_usec();
+  run(rm);
+  u64 t3 = now_usec();
+
+  printf("%d cores: cp -r %lu us, du %lu us, rm -r %lu us\n",
+         cores, t1 - t0, t2 - t1, t3 - t2);
+  return size;
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-c cores] [-u users] [-n msgs] [-s bytes] dir\n",
+          argv0);
+  exit(2);
+}
+
+int
+main(int ac, char *av[])
+{
+  int opt;
+  while ((opt = getopt(ac, av, "c:u:n:s:")) != -1) {
+    switch (opt) {
+    case 'c':
+      ncore = atoi(optarg);
+      break;
+    case 'u':
+      nusers = atoi(optarg);
+      break;
+    case 'n':
+      nmsgs = atoi(optarg);
+      break;
+    case 's':
+      msg_bytes = atoi(optarg);
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+  if (optind != ac - 1 || ncore < 1 || nusers < 1 || nmsgs < 0 ||
+      msg_bytes < 1)
+    usage(av[0]);
+  std::string dir = av[optind];
+
+  printf("# --cores=%d --users=%d --msgs=%d --bytes=%d\n",
+         ncore, nusers, nmsgs, msg_bytes);
+  build(dir + "/src");
+
+  std::string serial = bench(dir, 1);
+  std::string parallel = bench(dir, ncore);
+  if (strcmp(serial.c_str(), parallel.c_str()) != 0)
+    die("treebench: du sizes differ: %s vs %s", serial.c_str(),
+        parallel.c_str());
+  return 0;
+}
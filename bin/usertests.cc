@@ -14,6 +14,10 @@
 #include <setjmp.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/ioring.h>
+#include <sys/syscall_batch.h>
 
 #include <utility>
 
@@ -989,6 +993,1021 @@ renametest(void)
   printf("rename ok\n");
 }
 
+// A closed file descriptor, for the bad-fd cases.
+static int
+closed_fd(void)
+{
+  int fd = dup(0);
+  if (fd < 0)
+    die("dup failed");
+  close(fd);
+  return fd;
+}
+
+void
+fdatasynctest(void)
+{
+  int pfds[2];
+  char b[64];
+
+  printf("fdatasync test\n");
+
+  int fd = open("fdsfile", O_CREAT|O_RDWR, 0666);
+  if (fd < 0)
+    die("create fdsfile failed");
+  // The first fdatasync() has no inode on the disk yet and does a full
+  // fsync(); the second only writes the data.
+  if (write(fd, "first", 5) != 5)
+    die("write fdsfile failed");
+  if (fdatasync(fd) < 0)
+    die("fdatasync of a new file failed");
+  if (write(fd, "second", 6) != 6)
+    die("write fdsfile failed");
+  if (fdatasync(fd) < 0)
+    die("fdatasync of an existing file failed");
+  close(fd);
+
+  fd = open("fdsfile", O_RDONLY);
+  if (fd < 0)
+    die("open fdsfile failed");
+  if (read(fd, b, sizeof(b)) != 11 || memcmp(b, "firstsecond", 11) != 0)
+    die("fdsfile has the wrong contents after fdatasync");
+  close(fd);
+
+  if (pipe(pfds) < 0)
+    die("pipe failed");
+  if (fdatasync(pfds[0]) == 0)
+    die("fdatasync of a pipe succeeded!");
+  close(pfds[0]);
+  close(pfds[1]);
+  if (fdatasync(closed_fd()) == 0)
+    die("fdatasync of a closed fd succeeded!");
+
+  if (unlink("fdsfile") < 0)
+    die("unlink fdsfile failed");
+  printf("fdatasync test ok\n");
+}
+
+void
+syncrangetest(void)
+{
+  const unsigned int all = SYNC_FILE_RANGE_WAIT_BEFORE |
+    SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+  static char b[3 * 4096];
+  int pfds[2];
+
+  printf("sync_file_range test\n");
+
+  int fd = open("sfrfile", O_CREAT|O_RDWR, 0666);
+  if (fd < 0)
+    die("create sfrfile failed");
+  memset(b, 'a', sizeof(b));
+  if (write(fd, b, sizeof(b)) != sizeof(b))
+    die("write sfrfile failed");
+  // A zero nbytes means through the end of the file.
+  if (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE) < 0)
+    die("sync_file_range of a new file failed");
+  memset(b, 'b', 4096);
+  if (pwrite(fd, b, 4096, 4096) != 4096)
+    die("pwrite sfrfile failed");
+  if (sync_file_range(fd, 4096, 4096, all) < 0)
+    die("sync_file_range of the middle page failed");
+  // Without SYNC_FILE_RANGE_WRITE there is nothing to do.
+  if (sync_file_range(fd, 0, 4096, 0) < 0)
+    die("sync_file_range with no flags failed");
+
+  if (sync_file_range(fd, -1, 4096, SYNC_FILE_RANGE_WRITE) == 0)
+    die("sync_file_range with a negative offset succeeded!");
+  if (sync_file_range(fd, 0, -1, SYNC_FILE_RANGE_WRITE) == 0)
+    die("sync_file_range with a negative nbytes succeeded!");
+  if (sync_file_range(fd, 0, 4096, 0x8) == 0)
+    die("sync_file_range with bad flags succeeded!");
+  close(fd);
+
+  fd = open("sfrfile", O_RDONLY);
+  if (fd < 0)
+    die("open sfrfile failed");
+  memset(b, 0, sizeof(b));
+  if (read(fd, b, sizeof(b)) != sizeof(b))
+    die("read sfrfile failed");
+  for (size_t i = 0; i < sizeof(b); i++)
+    if (b[i] != (i / 4096 == 1 ? 'b' : 'a'))
+      die("sfrfile has the wrong contents at %zu", i);
+  close(fd);
+
+  fd = open(".", O_RDONLY);
+  if (fd < 0)
+    die("open . failed");
+  if (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE) == 0)
+    die("sync_file_range of a directory succeeded!");
+  close(fd);
+  if (pipe(pfds) < 0)
+    die("pipe failed");
+  if (sync_file_range(pfds[1], 0, 0, SYNC_FILE_RANGE_WRITE) == 0)
+    die("sync_file_range of a pipe succeeded!");
+  close(pfds[0]);
+  close(pfds[1]);
+  if (sync_file_range(closed_fd(), 0, 0, SYNC_FILE_RANGE_WRITE) == 0)
+    die("sync_file_range of a closed fd succeeded!");
+
+  if (unlink("sfrfile") < 0)
+    die("unlink sfrfile failed");
+  printf("sync_file_range test ok\n");
+}
+
+void
+iovtest(void)
+{
+  static struct iovec big[UIO_MAXIOV + 1];
+  char a[4], b[8], c[16];
+  struct iovec iov[3];
+
+  printf("vectored io test\n");
+
+  int fd = open("iovfile", O_CREAT|O_RDWR, 0666);
+  if (fd < 0)
+    die("create iovfile failed");
+  // An empty buffer in the middle contributes nothing.
+  iov[0] = { (void*)"abcd", 4 };
+  iov[1] = { a, 0 };
+  iov[2] = { (void*)"efghij", 6 };
+  if (writev(fd, iov, 3) != 10)
+    die("writev iovfile failed");
+  if (writev(fd, iov, 0) != 0)
+    die("writev of no buffers failed");
+  close(fd);
+
+  fd = open("iovfile", O_RDONLY);
+  if (fd < 0)
+    die("open iovfile failed");
+  // The file ends partway through the second buffer.
+  memset(b, 'z', sizeof(b));
+  memset(c, 'z', sizeof(c));
+  iov[0] = { a, sizeof(a) };
+  iov[1] = { b, sizeof(b) };
+  iov[2] = { c, sizeof(c) };
+  if (readv(fd, iov, 3) != 10)
+    die("readv iovfile returned the wrong count");
+  if (memcmp(a, "abcd", 4) != 0 || memcmp(b, "efghijzz", 8) != 0 ||
+      c[0] != 'z')
+    die("readv iovfile scattered the wrong data");
+  if (readv(fd, iov, 3) != 0)
+    die("readv at the end of iovfile did not return 0");
+  if (readv(fd, iov, 0) != 0)
+    die("readv of no buffers failed");
+
+  if (readv(fd, iov, -1) >= 0)
+    die("readv of -1 buffers succeeded!");
+  for (auto &v : big)
+    v = { a, 1 };
+  if (readv(fd, big, UIO_MAXIOV + 1) >= 0)
+    die("readv of more than UIO_MAXIOV buffers succeeded!");
+  // The total has to fit in an ssize_t.
+  iov[0] = { a, ~0ul >> 1 };
+  iov[1] = { b, 1 };
+  if (readv(fd, iov, 2) >= 0)
+    die("readv with an ssize_t overflow succeeded!");
+  close(fd);
+
+  // pwritev and preadv work at an offset and leave the file offset alone.
+  fd = open("iovfile", O_RDWR);
+  if (fd < 0)
+    die("open iovfile failed");
+  iov[0] = { (void*)"XY", 2 };
+  iov[1] = { (void*)"Z", 1 };
+  if (pwritev(fd, iov, 2, 4) != 3)
+    die("pwritev iovfile failed");
+  memset(a, 'z', sizeof(a));
+  memset(b, 'z', sizeof(b));
+  iov[0] = { a, sizeof(a) };
+  iov[1] = { b, sizeof(b) };
+  if (preadv(fd, iov, 2, 2) != 8)
+    die("preadv iovfile returned the wrong count");
+  if (memcmp(a, "cdXY", 4) != 0 || memcmp(b, "Zhijzzzz", 8) != 0)
+    die("preadv iovfile scattered the wrong data");
+  if (preadv(fd, iov, 2, 10) != 0)
+    die("preadv at the end of iovfile did not return 0");
+  if (read(fd, c, 4) != 4 || memcmp(c, "abcd", 4) != 0)
+    die("pwritev or preadv moved the file offset");
+  if (preadv(fd, iov, -1, 0) >= 0)
+    die("preadv of -1 buffers succeeded!");
+  if (pwritev(fd, big, UIO_MAXIOV + 1, 0) >= 0)
+    die("pwritev of more than UIO_MAXIOV buffers succeeded!");
+  close(fd);
+
+  // Pipes have no offsets.
+  int pfds[2];
+  if (pipe(pfds) < 0)
+    die("pipe failed");
+  iov[0] = { a, sizeof(a) };
+  if (pwritev(pfds[1], iov, 1, 0) >= 0)
+    die("pwritev of a pipe succeeded!");
+  if (preadv(pfds[0], iov, 1, 0) >= 0)
+    die("preadv of a pipe succeeded!");
+  close(pfds[0]);
+  close(pfds[1]);
+
+  if (readv(closed_fd(), iov, 1) >= 0)
+    die("readv of a closed fd succeeded!");
+  if (writev(closed_fd(), iov, 1) >= 0)
+    die("writev of a closed fd succeeded!");
+  if (preadv(closed_fd(), iov, 1, 0) >= 0)
+    die("preadv of a closed fd succeeded!");
+  if (pwritev(closed_fd(), iov, 1, 0) >= 0)
+    die("pwritev of a closed fd succeeded!");
+
+  if (unlink("iovfile") < 0)
+    die("unlink iovfile failed");
+  printf("vectored io test ok\n");
+}
+
+// Set up ev to watch fd for events.
+static struct epoll_event *
+epoll_ev(struct epoll_event *ev, int fd, uint32_t events)
+{
+  ev->events = events;
+  ev->data.u64 = 0;
+  ev->data.fd = fd;
+  return ev;
+}
+
+void
+epolltest(void)
+{
+  struct epoll_event ev, out[4];
+  int pfds[2];
+  char c;
+
+  printf("epoll test\n");
+
+  if (epoll_create1(1) >= 0)
+    die("epoll_create1 with bad flags succeeded!");
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  if (ep < 0)
+    die("epoll_create1 failed");
+  if (pipe(pfds) < 0)
+    die("pipe failed");
+  int rfd = pfds[0], wfd = pfds[1];
+
+  if (epoll_ctl(ep, EPOLL_CTL_ADD, rfd, epoll_ev(&ev, rfd, EPOLLIN)) < 0)
+    die("epoll_ctl add failed");
+  if (epoll_wait(ep, out, 4, 0) != 0)
+    die("epoll_wait reported an empty pipe");
+
+  // Level-triggered: the pipe is reported for as long as it has data.
+  if (write(wfd, "x", 1) != 1)
+    die("write pipe failed");
+  if (epoll_wait(ep, out, 4, 0) != 1 || !(out[0].events & EPOLLIN) ||
+      out[0].data.fd != rfd)
+    die("epoll_wait did not report a readable pipe");
+  if (epoll_wait(ep, out, 4, -1) != 1 || out[0].data.fd != rfd)
+    die("epoll_wait did not report a pipe that is still readable");
+  if (read(rfd, &c, 1) != 1)
+    die("read pipe failed");
+  if (epoll_wait(ep, out, 4, 0) != 0)
+    die("epoll_wait reported a drained pipe");
+
+  // Edge-triggered: reported once per write.
+  if (epoll_ctl(ep, EPOLL_CTL_MOD, rfd,
+                epoll_ev(&ev, rfd, EPOLLIN | EPOLLET)) < 0)
+    die("epoll_ctl mod to EPOLLET failed");
+  if (write(wfd, "x", 1) != 1)
+    die("write pipe failed");
+  if (epoll_wait(ep, out, 4, 0) != 1 || out[0].data.fd != rfd)
+    die("epoll_wait did not report an EPOLLET event");
+  if (epoll_wait(ep, out, 4, 0) != 0)
+    die("epoll_wait reported an EPOLLET event twice");
+  if (read(rfd, &c, 1) != 1)
+    die("read pipe failed");
+
+  // One-shot: reported once, until EPOLL_CTL_MOD rearms it.
+  if (epoll_ctl(ep, EPOLL_CTL_MOD, rfd,
+                epoll_ev(&ev, rfd, EPOLLIN | EPOLLONESHOT)) < 0)
+    die("epoll_ctl mod to EPOLLONESHOT failed");
+  if (write(wfd, "x", 1) != 1)
+    die("write pipe failed");
+  if (epoll_wait(ep, out, 4, 0) != 1)
+    die("epoll_wait did not report an EPOLLONESHOT event");
+  if (epoll_wait(ep, out, 4, 0) != 0)
+    die("epoll_wait reported an EPOLLONESHOT event twice");
+  if (epoll_ctl(ep, EPOLL_CTL_MOD, rfd,
+                epoll_ev(&ev, rfd, EPOLLIN | EPOLLONESHOT)) < 0)
+    die("epoll_ctl rearm failed");
+  if (epoll_wait(ep, out, 4, 0) != 1)
+    die("epoll_wait did not report a rearmed EPOLLONESHOT event");
+  if (read(rfd, &c, 1) != 1)
+    die("read pipe failed");
+
+  // A file without events of its own is always ready.
+  int fd = open(".", O_RDONLY);
+  if (fd < 0)
+    die("open . failed");
+  if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, epoll_ev(&ev, fd, EPOLLIN)) < 0)
+    die("epoll_ctl add of a directory failed");
+  if (epoll_wait(ep, out, 4, 0) != 1 || out[0].data.fd != fd)
+    die("epoll_wait did not report a directory");
+  if (epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr) < 0)
+    die("epoll_ctl del of a directory failed");
+  close(fd);
+
+  if (epoll_ctl(ep, EPOLL_CTL_ADD, rfd, epoll_ev(&ev, rfd, EPOLLIN)) == 0)
+    die("epoll_ctl add of a watched fd succeeded!");
+  if (epoll_ctl(ep, EPOLL_CTL_ADD, ep, epoll_ev(&ev, ep, EPOLLIN)) == 0)
+    die("epoll_ctl add of the epoll fd itself succeeded!");
+  if (epoll_ctl(ep, EPOLL_CTL_ADD, closed_fd(), &ev) == 0)
+    die("epoll_ctl add of a closed fd succeeded!");
+  if (epoll_ctl(ep, 0, rfd, &ev) == 0)
+    die("epoll_ctl with a bad op succeeded!");
+  if (epoll_ctl(rfd, EPOLL_CTL_ADD, wfd, epoll_ev(&ev, wfd, EPOLLOUT)) == 0)
+    die("epoll_ctl on a pipe succeeded!");
+  if (epoll_ctl(closed_fd(), EPOLL_CTL_ADD, wfd, &ev) == 0)
+    die("epoll_ctl on a closed fd succeeded!");
+  if (epoll_wait(ep, out, 0, 0) >= 0)
+    die("epoll_wait for 0 events succeeded!");
+  if (epoll_wait(rfd, out, 4, 0) >= 0)
+    die("epoll_wait on a pipe succeeded!");
+  if (epoll_wait(ep, out, 4, 10) != 0)
+    die("epoll_wait with a timeout did not time out");
+
+  if (epoll_ctl(ep, EPOLL_CTL_DEL, rfd, nullptr) < 0)
+    die("epoll_ctl del failed");
+  if (epoll_ctl(ep, EPOLL_CTL_DEL, rfd, nullptr) == 0)
+    die("epoll_ctl del of an unwatched fd succeeded!");
+  if (epoll_ctl(ep, EPOLL_CTL_MOD, rfd, epoll_ev(&ev, rfd, EPOLLIN)) == 0)
+    die("epoll_ctl mod of an unwatched fd succeeded!");
+
+  close(rfd);
+  close(wfd);
+  close(ep);
+  printf("epoll test ok\n");
+}
+
+void
+attest(void)
+{
+  struct stat st, st2;
+  int bad = closed_fd();
+
+  printf("at test\n");
+
+  if (mkdir("atdir", 0777) < 0)
+    die("mkdir atdir failed");
+  int dfd = open("atdir", O_RDONLY);
+  if (dfd < 0)
+    die("open atdir failed");
+  int fd = openat(dfd, "f", O_CREAT|O_RDWR, 0666);
+  if (fd < 0)
+    die("openat atdir/f failed");
+  if (write(fd, "hello", 5) != 5)
+    die("write atdir/f failed");
+  close(fd);
+
+  // fstatat
+  if (fstatat(dfd, "f", &st) < 0 || st.st_size != 5)
+    die("fstatat atdir f failed");
+  if (fstatat(AT_FDCWD, "atdir/f", &st2) < 0 || st2.st_ino != st.st_ino)
+    die("fstatat AT_FDCWD atdir/f failed");
+  if (fstatat(dfd, "missing", &st2) == 0)
+    die("fstatat of a missing name succeeded!");
+  if (fstatat(bad, "f", &st2) == 0)
+    die("fstatat with a bad dirfd succeeded!");
+
+  // linkat
+  if (linkat(dfd, "f", AT_FDCWD, "atlink") < 0)
+    die("linkat atdir/f atlink failed");
+  if (stat("atlink", &st2) < 0 || st2.st_ino != st.st_ino ||
+      st2.st_nlink != 2)
+    die("atlink isn't a second link to atdir/f");
+  if (linkat(AT_FDCWD, "atlink", dfd, "f") == 0)
+    die("linkat over an existing name succeeded!");
+  if (linkat(dfd, "missing", dfd, "g") == 0)
+    die("linkat of a missing name succeeded!");
+  if (linkat(AT_FDCWD, "atdir", dfd, "d") == 0)
+    die("linkat of a directory succeeded!");
+  if (linkat(bad, "f", AT_FDCWD, "atlink2") == 0 ||
+      linkat(dfd, "f", bad, "atlink2") == 0)
+    die("linkat with a bad dirfd succeeded!");
+
+  // renameat
+  if (renameat(AT_FDCWD, "atlink", dfd, "g") < 0)
+    die("renameat atlink atdir/g failed");
+  if (stat("atlink", &st2) == 0)
+    die("atlink still there after renameat");
+  if (fstatat(dfd, "g", &st2) < 0 || st2.st_ino != st.st_ino)
+    die("atdir/g isn't the renamed atlink");
+  if (renameat(dfd, "missing", dfd, "h") == 0)
+    die("renameat of a missing name succeeded!");
+  if (renameat(bad, "g", dfd, "h") == 0 || renameat(dfd, "g", bad, "h") == 0)
+    die("renameat with a bad dirfd succeeded!");
+
+  // unlinkat
+  if (unlinkat(dfd, "g", AT_REMOVEDIR) == 0)
+    die("unlinkat AT_REMOVEDIR of a file succeeded!");
+  if (unlinkat(bad, "g", 0) == 0)
+    die("unlinkat with a bad dirfd succeeded!");
+  if (unlinkat(dfd, "g", 0) < 0)
+    die("unlinkat atdir/g failed");
+  if (unlinkat(dfd, "g", 0) == 0)
+    die("unlinkat of a missing name succeeded!");
+  if (fstatat(dfd, "f", &st2) < 0 || st2.st_nlink != 1)
+    die("atdir/f has the wrong link count");
+  if (mkdirat(dfd, "sub", 0777) < 0)
+    die("mkdirat atdir/sub failed");
+  if (unlinkat(dfd, "sub", AT_REMOVEDIR) < 0)
+    die("unlinkat AT_REMOVEDIR atdir/sub failed");
+  if (unlinkat(dfd, "f", 0) < 0)
+    die("unlinkat atdir/f failed");
+  close(dfd);
+  if (unlinkat(AT_FDCWD, "atdir", AT_REMOVEDIR) < 0)
+    die("unlinkat AT_FDCWD atdir failed");
+
+  printf("at test ok\n");
+}
+
+// Write everything out and drop the buffer and page caches, so that
+// what is read next comes from the disk.
+static void
+evict_caches(void)
+{
+  static const char *cmds[] = { "1", "2" };
+  sync();
+  for (const char *c : cmds) {
+    int fd = open("/dev/evict_caches", O_WRONLY);
+    if (fd < 0)
+      die("open /dev/evict_caches failed");
+    if (write(fd, c, 1) != 1)
+      die("write /dev/evict_caches failed");
+    close(fd);
+  }
+}
+
+// Check that block bn of fd holds BSIZE bytes of c.
+static void
+check_block(int fd, const char *name, int bn, char c)
+{
+  static char b[BSIZE];
+  if (pread(fd, b, BSIZE, (off_t)bn * BSIZE) != BSIZE)
+    die("pread block %d of %s failed", bn, name);
+  for (int i = 0; i < BSIZE; i++)
+    if (b[i] != c)
+      die("block %d of %s holds %d at %d, not %d", bn, name, b[i], i, c);
+}
+
+// Fill block bn of fd with c.
+static void
+write_block(int fd, const char *name, int bn, char c)
+{
+  static char b[BSIZE];
+  memset(b, c, BSIZE);
+  if (pwrite(fd, b, BSIZE, (off_t)bn * BSIZE) != BSIZE)
+    die("pwrite block %d of %s failed", bn, name);
+}
+
+void
+fallocatetest(void)
+{
+  struct stat st;
+  int pfds[2];
+
+  printf("fallocate test\n");
+
+  int fd = open("fafile", O_CREAT|O_RDWR, 0666);
+  if (fd < 0)
+    die("create fafile failed");
+  write_block(fd, "fafile", 0, 'a');
+  if (fsync(fd) < 0)
+    die("fsync fafile failed");
+
+  // Preallocate from the one written block to well past the end, which
+  // leaves the size alone.
+  if (fallocate(fd, 0, 8 * BSIZE) < 0) {
+    // Only extent-mapped file systems (mkfs -e) can preallocate.
+    if (fstat(fd, &st) < 0 || st.st_size != BSIZE)
+      die("failed fallocate changed the size of fafile");
+    check_block(fd, "fafile", 0, 'a');
+    printf("fallocate test: not supported by this file system\n");
+    goto errors;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size != BSIZE)
+    die("fallocate changed the size of fafile");
+
+  // Writes into the preallocated range stick, and what wasn't written
+  // reads back as zeroes, both from the page cache and from the disk.
+  write_block(fd, "fafile", 2, 'c');
+  write_block(fd, "fafile", 6, 'b');
+  if (fstat(fd, &st) < 0 || st.st_size != 7 * BSIZE)
+    die("fafile has the wrong size after writing past the end");
+  for (int pass = 0; pass < 2; pass++) {
+    check_block(fd, "fafile", 0, 'a');
+    check_block(fd, "fafile", 1, 0);
+    check_block(fd, "fafile", 2, 'c');
+    for (int bn = 3; bn < 6; bn++)
+      check_block(fd, "fafile", bn, 0);
+    check_block(fd, "fafile", 6, 'b');
+    close(fd);
+    evict_caches();
+    fd = open("fafile", O_RDWR);
+    if (fd < 0)
+      die("open fafile failed");
+  }
+  if (fstat(fd, &st) < 0 || st.st_size != 7 * BSIZE)
+    die("fafile has the wrong size after eviction");
+
+  // Preallocating entirely past the end doesn't change the size either.
+  if (fallocate(fd, 20 * BSIZE, 4 * BSIZE) < 0)
+    die("fallocate past the end of fafile failed");
+  if (fstat(fd, &st) < 0 || st.st_size != 7 * BSIZE)
+    die("fallocate past the end changed the size of fafile");
+
+errors:
+  if (fallocate(fd, -1, BSIZE) == 0)
+    die("fallocate at a negative offset succeeded!");
+  if (fallocate(fd, 0, 0) == 0)
+    die("fallocate of 0 bytes succeeded!");
+  if (fallocate(fd, 0, -1) == 0)
+    die("fallocate of -1 bytes succeeded!");
+  if (fallocate(fd, 0, (off_t)MAXFILE * BSIZE + 1) == 0)
+    die("fallocate past MAXFILE succeeded!");
+  close(fd);
+
+  fd = open("fafile", O_RDONLY);
+  if (fd < 0)
+    die("open fafile failed");
+  if (fallocate(fd, 0, BSIZE) == 0)
+    die("fallocate of a read-only fd succeeded!");
+  close(fd);
+  fd = open(".", O_RDONLY);
+  if (fd < 0)
+    die("open . failed");
+  if (fallocate(fd, 0, BSIZE) == 0)
+    die("fallocate of a directory succeeded!");
+  close(fd);
+  if (pipe(pfds) < 0)
+    die("pipe failed");
+  if (fallocate(pfds[1], 0, BSIZE) == 0)
+    die("fallocate of a pipe succeeded!");
+  close(pfds[0]);
+  close(pfds[1]);
+  if (fallocate(closed_fd(), 0, BSIZE) == 0)
+    die("fallocate of a closed fd succeeded!");
+
+  if (unlink("fafile") < 0)
+    die("unlink fafile failed");
+  printf("fallocate test ok\n");
+}
+
+// The number of free blocks on the root disk, from /dev/blkstats, once
+// everything has been synced.
+static long
+free_blocks(void)
+{
+  static char b[65536];
+  sync();
+  int fd = open("/dev/blkstats", O_RDONLY);
+  if (fd < 0)
+    die("open /dev/blkstats failed");
+  ssize_t n, len = 0;
+  while (len < (ssize_t)sizeof(b) - 1 &&
+         (n = read(fd, b + len, sizeof(b) - 1 - len)) > 0)
+    len += n;
+  close(fd);
+  b[len] = 0;
+  const char *key = "Total num free blocks: ";
+  char *p = strstr(b, key);
+  if (!p)
+    die("no free block count in /dev/blkstats");
+  return strtol(p + strlen(key), nullptr, 10);
+}
+
+void
+clonetest(void)
+{
+  enum { NBLKS = 16 };
+  struct stat st;
+
+  printf("clone test\n");
+
+  long free0 = free_blocks();
+  int src = open("clonesrc", O_CREAT|O_RDWR, 0666);
+  if (src < 0)
+    die("create clonesrc failed");
+  for (int bn = 0; bn < NBLKS; bn++)
+    write_block(src, "clonesrc", bn, 'a' + bn);
+  int dst = open("clonedst", O_CREAT|O_RDWR, 0666);
+  if (dst < 0)
+    die("create clonedst failed");
+
+  if (clone_file(src, dst) < 0) {
+    // Only disks with block refcounts can share blocks (not mkfs -R).
+    if (fstat(dst, &st) < 0 || st.st_size != 0)
+      die("failed clone_file changed the size of clonedst");
+    write_block(dst, "clonedst", 0, 'x');
+    check_block(dst, "clonedst", 0, 'x');
+    check_block(src, "clonesrc", 0, 'a');
+    printf("clone test: no block refcounts on this disk\n");
+    goto errors;
+  }
+  {
+    if (fstat(dst, &st) < 0 || st.st_size != NBLKS * BSIZE)
+      die("clonedst has the wrong size");
+    // The clone shares the source's blocks rather than copying them.
+    long free1 = free_blocks();
+    if (free0 - free1 >= NBLKS + NBLKS / 2)
+      die("clone_file used %ld blocks for %d", free0 - free1, NBLKS);
+
+    // Writes to either file go to a private copy of the block; the other
+    // still sees the old data.
+    write_block(src, "clonesrc", 0, 'S');
+    if (fsync(src) < 0)
+      die("fsync clonesrc failed");
+    write_block(dst, "clonedst", 1, 'C');
+    if (fsync(dst) < 0)
+      die("fsync clonedst failed");
+    for (int pass = 0; pass < 2; pass++) {
+      check_block(src, "clonesrc", 0, 'S');
+      check_block(dst, "clonedst", 0, 'a');
+      check_block(src, "clonesrc", 1, 'b');
+      check_block(dst, "clonedst", 1, 'C');
+      for (int bn = 2; bn < NBLKS; bn++) {
+        check_block(src, "clonesrc", bn, 'a' + bn);
+        check_block(dst, "clonedst", bn, 'a' + bn);
+      }
+      close(src);
+      close(dst);
+      evict_caches();
+      src = open("clonesrc", O_RDWR);
+      dst = open("clonedst", O_RDWR);
+      if (src < 0 || dst < 0)
+        die("open clonesrc or clonedst failed");
+    }
+  }
+
+errors:
+  // dst isn't empty any more.
+  if (clone_file(src, dst) == 0)
+    die("clone_file into a non-empty file succeeded!");
+  if (clone_file(src, src) == 0)
+    die("clone_file of a file onto itself succeeded!");
+  if (clone_file(closed_fd(), dst) == 0 || clone_file(src, closed_fd()) == 0)
+    die("clone_file of a closed fd succeeded!");
+  close(dst);
+  if (unlink("clonedst") < 0)
+    die("unlink clonedst failed");
+  dst = open("clonedst", O_CREAT|O_RDONLY, 0666);
+  if (dst < 0)
+    die("create clonedst failed");
+  if (clone_file(src, dst) == 0)
+    die("clone_file into a read-only fd succeeded!");
+  close(dst);
+  int dir = open(".", O_RDONLY);
+  if (dir < 0)
+    die("open . failed");
+  dst = open("clonedst", O_RDWR);
+  if (dst < 0)
+    die("open clonedst failed");
+  if (clone_file(dir, dst) == 0)
+    die("clone_file of a directory succeeded!");
+  close(dir);
+  close(dst);
+  close(src);
+
+  // Once both files are gone, so are all their blocks, shared or not.
+  if (unlink("clonesrc") < 0 || unlink("clonedst") < 0)
+    die("unlink clonesrc or clonedst failed");
+  // The frees reach the free lists when their transactions are applied,
+  // which may trail the sync a little.
+  long free2 = free_blocks();
+  for (int i = 0; i < 10 && free0 - free2 > 2; i++) {
+    sleep(1);
+    free2 = free_blocks();
+  }
+  if (free0 - free2 > 2)
+    die("%ld blocks leaked after unlinking a clone", free0 - free2);
+  printf("clone test ok\n");
+}
+
+void
+splicetest(void)
+{
+  enum { NBLKS = 3 };
+  static char b[NBLKS * BSIZE];
+  int pfds[2];
+  off_t off;
+
+  printf("splice test\n");
+
+  if (pipe(pfds) < 0)
+    die("pipe failed");
+
+  // Pipe to file: splice takes what the pipe has and stops once the pipe
+  // is drained.
+  int fd = open("splicefile", O_CREAT|O_RDWR, 0666);
+  if (fd < 0)
+    die("create splicefile failed");
+  if (write(pfds[1], "hello ", 6) != 6 || write(pfds[1], "splice", 6) != 6)
+    die("write pipe failed");
+  if (splice(pfds[0], nullptr, fd, nullptr, 100, 0) != 12)
+    die("splice pipe to splicefile failed");
+  if (write(pfds[1], "!", 1) != 1)
+    die("write pipe failed");
+  if (splice(pfds[0], nullptr, fd, nullptr, 100, 0) != 1)
+    die("second splice pipe to splicefile failed");
+  if (pread(fd, b, sizeof(b), 0) != 13 || memcmp(b, "hello splice!", 13) != 0)
+    die("splicefile has the wrong contents");
+  close(fd);
+
+  // File to pipe, at an offset and at the file offset, across pages.
+  fd = open("splicefile", O_CREAT|O_RDWR|O_TRUNC, 0666);
+  if (fd < 0)
+    die("create splicefile failed");
+  for (size_t i = 0; i < sizeof(b); i++)
+    b[i] = 'a' + i % 23;
+  if (pwrite(fd, b, sizeof(b), 0) != sizeof(b))
+    die("pwrite splicefile failed");
+  off = BSIZE - 100;
+  if (splice(fd, &off, pfds[1], nullptr, 200, 0) != 200 || off != BSIZE + 100)
+    die("splice splicefile at an offset failed");
+  memset(b, 0, sizeof(b));
+  if (read(pfds[0], b, sizeof(b)) != 200)
+    die("read pipe after splice failed");
+  for (int i = 0; i < 200; i++)
+    if (b[i] != 'a' + (BSIZE - 100 + i) % 23)
+      die("spliced data is wrong at %d", i);
+  if (splice(fd, nullptr, pfds[1], nullptr, NBLKS * BSIZE, 0) !=
+      NBLKS * BSIZE)
+    die("splice splicefile at the file offset failed");
+  if (lseek(fd, 0, SEEK_CUR) != NBLKS * BSIZE)
+    die("splice didn't advance the offset of splicefile");
+  if (splice(fd, nullptr, pfds[1], nullptr, 100, 0) != 0)
+    die("splice at the end of splicefile didn't return 0");
+
+  // And on through the pipe into a second file.
+  int fd2 = open("splicefile2", O_CREAT|O_RDWR, 0666);
+  if (fd2 < 0)
+    die("create splicefile2 failed");
+  ssize_t n, done = 0;
+  while (done < NBLKS * BSIZE &&
+         (n = splice(pfds[0], nullptr, fd2, nullptr, NBLKS * BSIZE, 0)) > 0)
+    done += n;
+  if (done != NBLKS * BSIZE)
+    die("splice pipe to splicefile2 moved %zd bytes", done);
+  for (int i = 0; i < NBLKS * BSIZE; i++) {
+    char c;
+    if (pread(fd2, &c, 1, i) != 1 || c != 'a' + i % 23)
+      die("splicefile2 is wrong at %d", i);
+  }
+
+  off = 0;
+  if (splice(fd, nullptr, pfds[1], &off, 1, 0) >= 0)
+    die("splice with an off_out succeeded!");
+  if (splice(pfds[0], &off, fd2, nullptr, 1, 0) >= 0)
+    die("splice from a pipe at an offset succeeded!");
+  if (splice(closed_fd(), nullptr, pfds[1], nullptr, 1, 0) >= 0 ||
+      splice(fd, &off, closed_fd(), nullptr, 1, 0) >= 0)
+    die("splice of a closed fd succeeded!");
+  int dir = open(".", O_RDONLY);
+  if (dir < 0)
+    die("open . failed");
+  if (splice(dir, &off, pfds[1], nullptr, 1, 0) >= 0)
+    die("splice from a directory succeeded!");
+  close(dir);
+
+  // Once the writers are gone, an empty pipe is at its end.
+  close(pfds[1]);
+  if (splice(pfds[0], nullptr, fd2, nullptr, 100, 0) != 0)
+    die("splice from a closed empty pipe didn't return 0");
+  close(pfds[0]);
+  close(fd);
+  close(fd2);
+  if (unlink("splicefile") < 0 || unlink("splicefile2") < 0)
+    die("unlink splicefile failed");
+  printf("splice test ok\n");
+}
+
+// Queue s on ring r.
+static void
+ioring_push(struct ioring *r, const struct ioring_sqe &s)
+{
+  IORING_SQES(r)[r->sq_tail % r->entries] = s;
+  r->sq_tail = r->sq_tail + 1;
+}
+
+// Submit n SQEs on ring fd and wait for them, then take their n CQEs
+// off r, indexed by user_data (which must be < n).
+static void
+ioring_run(int fd, struct ioring *r, u32 n, int64_t *res)
+{
+  if (ioring_enter(fd, n, n) != (int)n)
+    die("ioring_enter didn't submit %u SQEs", n);
+  if (r->sq_head != r->sq_tail || r->cq_tail - r->cq_head != n)
+    die("ioring has the wrong head and tail after ioring_enter");
+  for (u32 i = 0; i < n; i++) {
+    struct ioring_cqe *c = &IORING_CQES(r)[r->cq_head % (2 * r->entries)];
+    if (c->user_data >= n)
+      die("ioring CQE has a bad user_data %lu", c->user_data);
+    res[c->user_data] = c->res;
+    r->cq_head = r->cq_head + 1;
+  }
+}
+
+void
+ioringtest(void)
+{
+  enum { NENT = 8 };
+  static u64 mem[IORING_SIZE(NENT) / 8 + 1];
+  struct ioring *r = (struct ioring*)mem;
+  struct ioring_sqe s;
+  int64_t res[NENT];
+  char b[32];
+
+  printf("ioring test\n");
+
+  if (ioring_setup(r, 0) >= 0 || ioring_setup(r, NENT - 1) >= 0 ||
+      ioring_setup(r, IORING_MAX_ENTRIES * 2) >= 0)
+    die("ioring_setup with a bad size succeeded!");
+  if (ioring_setup((struct ioring*)((char*)mem + 4), NENT) >= 0)
+    die("ioring_setup of a misaligned ring succeeded!");
+  int fd = ioring_setup(r, NENT);
+  if (fd < 0)
+    die("ioring_setup failed");
+  if (r->entries != NENT)
+    die("ioring_setup set entries to %u", r->entries);
+  if (ioring_enter(fd, NENT, 0) != 0)
+    die("ioring_enter of an empty ring submitted something");
+
+  int file = open("ioringfile", O_CREAT|O_RDWR, 0666);
+  if (file < 0)
+    die("create ioringfile failed");
+
+  // Requests in one batch run concurrently, so ones that depend on
+  // each other go in separate batches.
+  memset(&s, 0, sizeof(s));
+  s.opcode = IORING_OP_NOP;
+  s.user_data = 0;
+  ioring_push(r, s);
+  s.opcode = IORING_OP_PWRITE;
+  s.fd = file;
+  s.addr = (u64)"ioring data";
+  s.len = 11;
+  s.off = 4;
+  s.user_data = 1;
+  ioring_push(r, s);
+  ioring_run(fd, r, 2, res);
+  if (res[0] != 0 || res[1] != 11)
+    die("ioring NOP or PWRITE returned %ld %ld", res[0], res[1]);
+
+  memset(&s, 0, sizeof(s));
+  s.opcode = IORING_OP_FSYNC;
+  s.fd = file;
+  s.user_data = 0;
+  ioring_push(r, s);
+  ioring_run(fd, r, 1, res);
+  if (res[0] != 0)
+    die("ioring FSYNC returned %ld", res[0]);
+
+  memset(b, 0, sizeof(b));
+  s.opcode = IORING_OP_PREAD;
+  s.addr = (u64)b;
+  s.len = sizeof(b);
+  s.off = 4;
+  s.user_data = 0;
+  ioring_push(r, s);
+  s.opcode = IORING_OP_OPENAT;
+  s.fd = AT_FDCWD;
+  s.addr = (u64)"ioringfile";
+  s.len = 0;
+  s.off = 0;
+  s.op_flags = O_RDONLY;
+  s.user_data = 1;
+  ioring_push(r, s);
+  // Failures come back in the CQE, like a system call's -1.
+  memset(&s, 0, sizeof(s));
+  s.opcode = 99;
+  s.user_data = 2;
+  ioring_push(r, s);
+  s.opcode = IORING_OP_NOP;
+  s.flags = 1;
+  s.user_data = 3;
+  ioring_push(r, s);
+  s.flags = 0;
+  s.opcode = IORING_OP_READ;
+  s.fd = closed_fd();
+  s.addr = (u64)b;
+  s.len = 1;
+  s.user_data = 4;
+  ioring_push(r, s);
+  ioring_run(fd, r, 5, res);
+  if (res[0] != 11 || memcmp(b, "ioring data", 11) != 0)
+    die("ioring PREAD returned %ld", res[0]);
+  if (res[1] < 0)
+    die("ioring OPENAT failed");
+  if (read((int)res[1], b, 4) != 4 || memcmp(b, "\0\0\0\0", 4) != 0)
+    die("fd from ioring OPENAT reads the wrong data");
+  close((int)res[1]);
+  if (res[2] != -1 || res[3] != -1 || res[4] != -1)
+    die("bad ioring requests returned %ld %ld %ld", res[2], res[3], res[4]);
+
+  // Everything queued beyond the ring's size is refused.
+  r->sq_tail = r->sq_tail + NENT + 1;
+  if (ioring_enter(fd, NENT + 1, 0) >= 0)
+    die("ioring_enter of an overfull ring succeeded!");
+  r->sq_tail = r->sq_tail - NENT - 1;
+
+  if (ioring_enter(file, 1, 0) >= 0)
+    die("ioring_enter of a file succeeded!");
+  if (ioring_enter(closed_fd(), 1, 0) >= 0)
+    die("ioring_enter of a closed fd succeeded!");
+
+  close(file);
+  close(fd);
+  if (unlink("ioringfile") < 0)
+    die("unlink ioringfile failed");
+  printf("ioring test ok\n");
+}
+
+// Set up batch entry e to make system call num.
+static void
+batch_ent(struct syscall_batch_entry *e, u64 num, u64 a0 = 0, u64 a1 = 0,
+          u64 a2 = 0, u32 flags = 0)
+{
+  *e = {};
+  e->num = num;
+  e->args[0] = a0;
+  e->args[1] = a1;
+  e->args[2] = a2;
+  e->flags = flags;
+  e->ret = 12345;
+}
+
+void
+batchtest(void)
+{
+  struct syscall_batch_entry ents[5];
+  char b[16];
+
+  printf("syscall_batch test\n");
+
+  int fd = open("batchfile", O_CREAT|O_RDWR, 0666);
+  if (fd < 0)
+    die("create batchfile failed");
+
+  // A failing entry without a barrier doesn't stop the ones after it,
+  // and neither does one that isn't allowed in a batch.
+  batch_ent(&ents[0], SYS_write, fd, (u64)"ab", 2);
+  batch_ent(&ents[1], SYS_unlinkat, AT_FDCWD, (u64)"nosuchfile", 0);
+  batch_ent(&ents[2], SYS_exit, 0);
+  batch_ent(&ents[3], SYS_write, fd, (u64)"cd", 2);
+  batch_ent(&ents[4], SYS_fsync, fd);
+  if (syscall_batch(ents, 5) != 5)
+    die("syscall_batch didn't run all 5 entries");
+  if ((ssize_t)ents[0].ret != 2 || (int)ents[1].ret != -1 ||
+      (int)ents[2].ret != -1 || (ssize_t)ents[3].ret != 2 ||
+      (int)ents[4].ret != 0)
+    die("syscall_batch returned %ld %ld %ld %ld %ld", ents[0].ret,
+        ents[1].ret, ents[2].ret, ents[3].ret, ents[4].ret);
+
+  // A failing barrier entry ends the batch.
+  batch_ent(&ents[0], SYS_write, fd, (u64)"ef", 2);
+  batch_ent(&ents[1], SYS_unlinkat, AT_FDCWD, (u64)"nosuchfile", 0,
+            SYSCALL_BATCH_BARRIER);
+  batch_ent(&ents[2], SYS_write, fd, (u64)"XX", 2);
+  if (syscall_batch(ents, 3) != 2)
+    die("syscall_batch ran past a failed barrier");
+  if ((ssize_t)ents[0].ret != 2 || (int)ents[1].ret != -1 ||
+      ents[2].ret != 12345)
+    die("syscall_batch with a barrier returned %ld %ld %ld", ents[0].ret,
+        ents[1].ret, ents[2].ret);
+  batch_ent(&ents[0], SYS_read, closed_fd(), (u64)b, 1,
+            SYSCALL_BATCH_BARRIER_LONG);
+  batch_ent(&ents[1], SYS_write, fd, (u64)"XX", 2);
+  if (syscall_batch(ents, 2) != 1 || (ssize_t)ents[0].ret != -1 ||
+      ents[1].ret != 12345)
+    die("syscall_batch ran past a failed long barrier");
+  // A barrier that succeeds doesn't.
+  batch_ent(&ents[0], SYS_write, fd, (u64)"gh", 2, SYSCALL_BATCH_BARRIER_LONG);
+  batch_ent(&ents[1], SYS_write, fd, (u64)"ij", 2);
+  if (syscall_batch(ents, 2) != 2 || (ssize_t)ents[1].ret != 2)
+    die("syscall_batch stopped at a barrier that succeeded");
+
+  if (pread(fd, b, sizeof(b), 0) != 10 || memcmp(b, "abcdefghij", 10) != 0)
+    die("batchfile has the wrong contents");
+  close(fd);
+
+  batch_ent(&ents[0], 100000);
+  if (syscall_batch(ents, 1) != 1 || (long)ents[0].ret != -1)
+    die("syscall_batch of a bad system call number didn't fail it");
+  if (syscall_batch(ents, 0) != 0)
+    die("syscall_batch of no entries didn't return 0");
+  if (syscall_batch(ents, SYSCALL_BATCH_MAX + 1) >= 0)
+    die("syscall_batch of too many entries succeeded!");
+  if (syscall_batch((struct syscall_batch_entry*)0, 1) >= 0)
+    die("syscall_batch of a null batch succeeded!");
+
+  if (unlink("batchfile") < 0)
+    die("unlink batchfile failed");
+  printf("syscall_batch test ok\n");
+}
+
 void
 bigfile(void)
 {
@@ -1036,7 +2055,7 @@ thirteen(void)
 {
   int fd;
 
-  // DIRSIZ is 14.
+  // Names one byte shorter than the old 14-byte DIRSIZ limit.
   printf("thirteen test\n");
 
   if(mkdir("1234567890123", 0777) != 0)
@@ -1060,19 +2079,153 @@ thirteen(void)
   printf("thirteen ok\n");
 }
 
+// Whether getdents() on dir returns an entry called name.
+static bool
+dir_has(const char *dir, const char *name)
+{
+  int fd = open(dir, O_RDONLY);
+  if (fd < 0)
+    die("open %s failed", dir);
+  char dbuf[4096];
+  ssize_t n;
+  bool found = false;
+  while (!found && (n = getdents(fd, dbuf, sizeof(dbuf))) > 0) {
+    for (ssize_t off = 0; off < n; ) {
+      struct xv6_dirent *de = (struct xv6_dirent*)(dbuf + off);
+      if (strcmp(de->d_name, name) == 0)
+        found = true;
+      off += de->d_reclen;
+    }
+  }
+  close(fd);
+  return found;
+}
+
+// Put in fs.img by mkfs (see FSEXTRA in the Makefile), so finding it
+// checks that long names survive mkfs and the kernel's load_dir.
+#define LONGNAME_IMG "longname-" \
+  "0123456789012345678901234567890123456789012345678901234567890123456789" \
+  "01234567890123456789012345678901234567890"
+
 void
 longname(void)
 {
   fprintf(stdout, "longname\n");
+  char name[DIRSIZ + 2];
+
+  // Names are up to 255 bytes, as on Linux; 256 is one too many.
+  static_assert(DIRSIZ == 255, "DIRSIZ");
+  memset(name, 'x', DIRSIZ + 1);
+  name[DIRSIZ + 1] = 0;
   for (int i = 0; i < 100; i++) {
-    if (open("123456789012345", O_CREAT, 0666) != -1)
-      die("open 123456789012345, O_CREAT succeeded!");
-    if (mkdir("123456789012345", 0777) != -1)
-      die("mkdir 123456789012345 succeeded!\n");
+    if (open(name, O_CREAT, 0666) != -1)
+      die("open %d-byte name, O_CREAT succeeded!", DIRSIZ + 1);
+    if (mkdir(name, 0777) != -1)
+      die("mkdir %d-byte name succeeded!", DIRSIZ + 1);
+  }
+
+  // 255 bytes and anything in between work like any other name.
+  static const int lens[] = { 100, 200, DIRSIZ };
+  for (int len : lens) {
+    memset(name, 'a' + len % 26, len);
+    name[len] = 0;
+    int fd = open(name, O_CREAT|O_RDWR, 0666);
+    if (fd < 0)
+      die("create %d-byte name failed", len);
+    if (write(fd, "long", 4) != 4)
+      die("write %d-byte name failed", len);
+    close(fd);
+    fd = open(name, O_RDONLY);
+    if (fd < 0)
+      die("open %d-byte name failed", len);
+    if (read(fd, buf, sizeof(buf)) != 4 || memcmp(buf, "long", 4) != 0)
+      die("read %d-byte name failed", len);
+    close(fd);
+    if (!dir_has(".", name))
+      die("getdents missed %d-byte name", len);
+    if (unlink(name) < 0)
+      die("unlink %d-byte name failed", len);
+    if (dir_has(".", name))
+      die("getdents still has unlinked %d-byte name", len);
   }
+
+  static_assert(sizeof(LONGNAME_IMG) - 1 == 120, "LONGNAME_IMG length");
+  int fd = open("/" LONGNAME_IMG, O_RDONLY);
+  if (fd < 0)
+    die("open /%s failed", LONGNAME_IMG);
+  if (read(fd, buf, sizeof(buf)) <= 0)
+    die("read /%s failed", LONGNAME_IMG);
+  close(fd);
+  if (!dir_has("/", LONGNAME_IMG))
+    die("getdents / missed %s", LONGNAME_IMG);
+
   fprintf(stdout, "longname ok\n");
 }
 
+// Rename files around inside a new directory, whose hash table starts
+// out with only a few buckets, so that a source and its destination
+// often share a bucket.
+void
+smallrenametest(void)
+{
+  enum { NFILES = 8, NROUNDS = 5 };
+  char from[32], to[32], c;
+
+  printf("small dir rename test\n");
+
+  if (mkdir("srdir", 0777) < 0)
+    die("mkdir srdir failed");
+  for (int i = 0; i < NFILES; i++) {
+    snprintf(from, sizeof(from), "srdir/a%d", i);
+    int fd = open(from, O_CREAT|O_RDWR, 0666);
+    if (fd < 0)
+      die("create %s failed", from);
+    c = '0' + i;
+    if (write(fd, &c, 1) != 1)
+      die("write %s failed", from);
+    close(fd);
+  }
+
+  for (int r = 0; r < NROUNDS; r++) {
+    for (int i = 0; i < NFILES; i++) {
+      snprintf(from, sizeof(from), "srdir/%c%d", 'a' + r, i);
+      snprintf(to, sizeof(to), "srdir/%c%d", 'a' + r + 1, i);
+      if (rename(from, to) < 0)
+        die("rename %s %s failed", from, to);
+      if (open(from, O_RDONLY) >= 0)
+        die("%s still exists after rename", from);
+      int fd = open(to, O_RDONLY);
+      if (fd < 0)
+        die("open %s after rename failed", to);
+      if (read(fd, &c, 1) != 1 || c != '0' + i)
+        die("%s has the wrong contents after rename", to);
+      close(fd);
+      if (dir_has("srdir", from + 6) || !dir_has("srdir", to + 6))
+        die("getdents srdir is wrong after rename %s %s", from, to);
+    }
+  }
+
+  // Renaming over an existing name in the same directory replaces it.
+  for (int i = 1; i < NFILES; i++) {
+    snprintf(from, sizeof(from), "srdir/%c%d", 'a' + NROUNDS, i);
+    snprintf(to, sizeof(to), "srdir/%c0", 'a' + NROUNDS);
+    if (rename(from, to) < 0)
+      die("rename %s over %s failed", from, to);
+    int fd = open(to, O_RDONLY);
+    if (fd < 0 || read(fd, &c, 1) != 1 || c != '0' + i)
+      die("%s has the wrong contents after rename over it", to);
+    close(fd);
+    if (dir_has("srdir", from + 6))
+      die("getdents srdir still has %s", from);
+  }
+
+  if (unlink(to) < 0)
+    die("unlink %s failed", to);
+  if (unlink("srdir") < 0)
+    die("unlink srdir failed");
+  printf("small dir rename test ok\n");
+}
+
 void
 rmdot(void)
 {
@@ -2118,6 +3271,17 @@ main(int argc, char *argv[])
   TEST(thrtest);
   TEST(ftabletest);
   TEST(renametest);
+  TEST(smallrenametest);
+  TEST(attest);
+  TEST(fdatasynctest);
+  TEST(syncrangetest);
+  TEST(iovtest);
+  TEST(epolltest);
+  TEST(fallocatetest);
+  TEST(clonetest);
+  TEST(splicetest);
+  TEST(ioringtest);
+  TEST(batchtest);
 
   TEST(floattest);
   TEST(writeprotecttest);
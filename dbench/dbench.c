@@ -235,8 +235,9 @@ static void report_latencies(void)
 	printf("Per client results:\n");
 	for (i=0;i<options.nprocs * options.clients_per_process;i++) {
 		child = &children[i];
-		printf("Client %u did %u lines and %.0f bytes\n", 
-		       i, child->line, child->bytes - child->bytes_done_warmup);
+		printf("Client %u did %u lines and %.0f bytes, max latency %.03f ms\n",
+		       i, child->line, child->bytes - child->bytes_done_warmup,
+		       child->worst_latency * 1000);
 		show_one_latency(child->ops, sum);		
 	}
 }
@@ -458,12 +459,18 @@ static void process_opts(int argc, char **argv)
 #else
 	char ch;
 
-	// dbench [-t timelimit -S -F] nprocs dir
-	while ((ch = getopt(argc, argv, "t:SF")) != -1) {
+	// dbench [-t timelimit -S -F -P -B backend] nprocs dir
+	while ((ch = getopt(argc, argv, "t:SFPB:")) != -1) {
 		switch (ch) {
 		case 't':
 			options.timelimit = atoi(optarg);
 			break;
+		case 'P':
+			options.per_client_results = 1;
+			break;
+		case 'B':
+			options.backend = optarg;
+			break;
 		case 'S':
 			options.sync_dirs = 1;
 			break;
@@ -487,6 +494,7 @@ static void process_opts(int argc, char **argv)
 	printf("options.do_fsync %d\n", options.do_fsync);
 	printf("options.nprocs %d\n", options.nprocs);
 	printf("options.directory %s\n", options.directory);
+	printf("options.per_client_results %d\n", options.per_client_results);
 
 	printf("\n\n");
 #endif
@@ -522,6 +530,11 @@ static void process_opts(int argc, char **argv)
 	if (strcmp(options.backend, "fileio") == 0) {
 		extern struct nb_operations fileio_ops;
 		nb_ops = &fileio_ops;
+#ifdef XV6_USER
+	} else if (strcmp(options.backend, "sv6") == 0) {
+		extern struct nb_operations sv6io_ops;
+		nb_ops = &sv6io_ops;
+#endif
 	} else {
 		printf("Unknown backend '%s'\n", options.backend);
 		exit(1);
@@ -0,0 +1,616 @@
+/*
+   dbench version 4
+
+   Copyright (C) 1999-2007 by Andrew Tridgell <tridge@samba.org>
+   Copyright (C) 2001 by Martin Pool <mbp@samba.org>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The sv6 backend runs the same loadfiles as the fileio backend, but
+   the way an application written for sv6 would: paths are looked up
+   relative to a directory fd for the client's working directory,
+   directories are read a batch of entries per getdents() instead of
+   one readdir() per name, deltree needs no stat() per entry, and reads
+   and writes go through preadv()/pwritev() over one small buffer
+   instead of a freshly allocated one per operation. */
+
+#include "dbench.h"
+#include <sys/uio.h>
+
+#define MAX_FILES 200
+
+/* Each iovec of a vectored read or write covers one buffer of this
+   size, so the copies of a large request all hit the same cached page. */
+#define IOV_BYTES 4096
+#define MAX_IOVS 64
+
+struct ftable {
+	char *name;
+	int fd;
+	int handle;
+};
+
+struct sv6_client {
+	int rootfd;
+	size_t rootlen;
+	struct ftable ftable[MAX_FILES];
+};
+
+/* Writes come from write_buf, which stays zero like the buffers the
+   fileio backend callocs; reads land in read_buf and are thrown away. */
+static char write_buf[IOV_BYTES];
+static char read_buf[IOV_BYTES];
+
+static int find_handle(struct child_struct *child, int handle)
+{
+	struct sv6_client *c = child->private;
+	int i;
+	for (i=0;i<MAX_FILES;i++) {
+		if (c->ftable[i].handle == handle) return i;
+	}
+	printf("(%d) ERROR: handle %d was not found\n",
+	       child->line, handle);
+	exit(1);
+}
+
+/* Return the path of fname relative to the directory fd in *dirfd.
+   Names under the client's working directory are looked up from its
+   fd; anything else from the current directory. */
+static const char *at_path(struct child_struct *child, const char *fname,
+			   int *dirfd)
+{
+	struct sv6_client *c = child->private;
+
+	if (strncmp(fname, child->directory, c->rootlen) != 0) {
+		*dirfd = AT_FDCWD;
+		return fname;
+	}
+	fname += c->rootlen;
+	while (*fname == '/')
+		fname++;
+	*dirfd = c->rootfd;
+	return *fname ? fname : ".";
+}
+
+static int expected_status(const char *status)
+{
+	if (strcmp(status, "NT_STATUS_OK") == 0) {
+		return 0;
+	}
+	if (strncmp(status, "0x", 2) == 0 &&
+	    strtoul(status, NULL, 16) == 0) {
+		return 0;
+	}
+	return -1;
+}
+
+/* Call fn on each entry of the directory open at fd, a getdents()
+   batch at a time, until it returns nonzero. */
+static void scan_dir(int fd, int (*fn)(struct xv6_dirent *, void *),
+		     void *arg)
+{
+	char buf[4096];
+	ssize_t n, off;
+
+	while ((n = getdents(fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < n; ) {
+			struct xv6_dirent *de = (struct xv6_dirent *)(buf + off);
+			off += de->d_reclen;
+			if (fn(de, arg))
+				return;
+		}
+	}
+}
+
+static int match_name(struct xv6_dirent *de, void *arg)
+{
+	return strcasecmp(de->d_name, (const char *)arg) == 0;
+}
+
+static int count_down(struct xv6_dirent *de, void *arg)
+{
+	int *left = arg;
+	(void)de;
+	return --*left <= 0;
+}
+
+/* Find the directory holding a file, and flush it to disk, as the
+   fileio backend does in -S mode. */
+static void sync_parent(struct child_struct *child, const char *fname)
+{
+	char copy_name[64];
+	const char *path;
+	int dirfd, fd;
+	char *slash;
+
+	strncpy(copy_name, fname, sizeof(copy_name));
+	copy_name[sizeof(copy_name)-1] = 0;
+	slash = strrchr(copy_name, '/');
+	if (slash)
+		*slash = '\0';
+	else
+		strncpy(copy_name, ".", sizeof(copy_name));
+
+	path = at_path(child, copy_name, &dirfd);
+	fd = openat(dirfd, path, O_RDONLY|O_DIRECTORY);
+	if (fd == -1) {
+		printf("[%d] open directory \"%s\" for sync failed\n",
+		       child->line, copy_name);
+		return;
+	}
+	if (fsync(fd) == -1) {
+		printf("[%d] datasync directory \"%s\" failed\n",
+		       child->line, copy_name);
+	}
+	close(fd);
+}
+
+/*
+  simulate pvfs_resolve_name()
+*/
+static void resolve_name(struct child_struct *child, const char *name)
+{
+	struct stat st;
+	char dname[64], *fname;
+	const char *path;
+	int dirfd, fd;
+	char *p;
+
+	if (name == NULL) return;
+
+	path = at_path(child, name, &dirfd);
+	if (fstatat(dirfd, path, &st) == 0)
+		return;
+
+	if (options.no_resolve) {
+		return;
+	}
+
+	strncpy(dname, path, sizeof(dname));
+	dname[sizeof(dname)-1] = 0;
+	p = strrchr(dname, '/');
+	if (!p) return;
+	*p = 0;
+	fname = p+1;
+
+	fd = openat(dirfd, dname, O_RDONLY|O_DIRECTORY);
+	if (fd < 0)
+		return;
+	scan_dir(fd, match_name, fname);
+	close(fd);
+}
+
+static void failed(struct child_struct *child)
+{
+	child->failed = 1;
+	printf("ERROR: child %d failed at line %d\n", child->id, child->line);
+	exit(1);
+}
+
+static void sv6_setup(struct child_struct *child)
+{
+	struct sv6_client *c;
+	c = calloc(1, sizeof(struct sv6_client));
+	c->rootfd = open(child->directory, O_RDONLY|O_DIRECTORY);
+	if (c->rootfd < 0) {
+		printf("open of directory %s failed\n", child->directory);
+		exit(1);
+	}
+	c->rootlen = strlen(child->directory);
+	child->private = c;
+	child->rate.last_time = timeval_current();
+	child->rate.last_bytes = 0;
+}
+
+static void sv6_unlink(struct dbench_op *op)
+{
+	const char *path;
+	int dirfd;
+
+	resolve_name(op->child, op->fname);
+
+	path = at_path(op->child, op->fname, &dirfd);
+	if (unlinkat(dirfd, path, 0) != expected_status(op->status)) {
+		printf("[%d] unlink %s failed - expected %s\n",
+		       op->child->line, op->fname, op->status);
+		failed(op->child);
+	}
+	if (options.sync_dirs) sync_parent(op->child, op->fname);
+}
+
+static void sv6_mkdir(struct dbench_op *op)
+{
+	struct stat st;
+	const char *path;
+	int dirfd;
+
+	resolve_name(op->child, op->fname);
+	path = at_path(op->child, op->fname, &dirfd);
+	if (options.stat_check && fstatat(dirfd, path, &st) == 0) {
+		return;
+	}
+	mkdirat(dirfd, path, 0777);
+}
+
+static void sv6_rmdir(struct dbench_op *op)
+{
+	struct stat st;
+	const char *path;
+	int dirfd;
+
+	resolve_name(op->child, op->fname);
+	path = at_path(op->child, op->fname, &dirfd);
+
+	if (options.stat_check &&
+	    (fstatat(dirfd, path, &st) != 0 || !S_ISDIR(st.st_mode))) {
+		return;
+	}
+
+	if (unlinkat(dirfd, path, AT_REMOVEDIR) != expected_status(op->status)) {
+		printf("[%d] rmdir %s failed - expected %s\n",
+		       op->child->line, op->fname, op->status);
+		failed(op->child);
+	}
+	if (options.sync_dirs) sync_parent(op->child, op->fname);
+}
+
+static void sv6_createx(struct dbench_op *op)
+{
+	uint32_t create_options = op->params[0];
+	uint32_t create_disposition = op->params[1];
+	int fnum = op->params[2];
+	int fd, i;
+	int flags = O_RDWR;
+	struct stat st;
+	struct sv6_client *c = op->child->private;
+	const char *path;
+	int dirfd;
+
+	resolve_name(op->child, op->fname);
+	path = at_path(op->child, op->fname, &dirfd);
+
+	if (create_disposition == FILE_CREATE) {
+		if (options.stat_check && fstatat(dirfd, path, &st) == 0) {
+			create_disposition = FILE_OPEN;
+		} else {
+			flags |= O_CREAT;
+		}
+	}
+
+	if (create_disposition == FILE_OVERWRITE ||
+	    create_disposition == FILE_OVERWRITE_IF) {
+		flags |= O_CREAT | O_TRUNC;
+	}
+
+	if (create_options & FILE_DIRECTORY_FILE) {
+		/* not strictly correct, but close enough */
+		if (!options.stat_check || fstatat(dirfd, path, &st) == -1) {
+			mkdirat(dirfd, path, 0700);
+		}
+	}
+
+	if (create_options & FILE_DIRECTORY_FILE) flags = O_RDONLY|O_DIRECTORY;
+
+	fd = openat(dirfd, path, flags, 0600);
+	if (fd < 0) {
+		flags = O_RDONLY|O_DIRECTORY;
+		fd = openat(dirfd, path, flags, 0600);
+	}
+	if (fd == -1) {
+		if (expected_status(op->status) == 0) {
+			printf("[%d] open %s failed for handle %d\n",
+			       op->child->line, op->fname, fnum);
+		}
+		return;
+	}
+	if (expected_status(op->status) != 0) {
+		printf("[%d] open %s succeeded for handle %d\n",
+		       op->child->line, op->fname, fnum);
+		close(fd);
+		return;
+	}
+
+	for (i=0;i<MAX_FILES;i++) {
+		if (c->ftable[i].handle == 0) break;
+	}
+	if (i == MAX_FILES) {
+		printf("file table full for %s\n", op->fname);
+		exit(1);
+	}
+
+	c->ftable[i].name = (char *)malloc(64);
+	strncpy(c->ftable[i].name, op->fname, 64);
+	c->ftable[i].handle = fnum;
+	c->ftable[i].fd = fd;
+
+	fstat(fd, &st);
+}
+
+/* Read or write size bytes at offset with one vectored call for up to
+   MAX_IOVS * IOV_BYTES bytes, every iovec pointing at the same buffer. */
+static ssize_t sv6_rw(int fd, int size, off_t offset, int writing)
+{
+	struct iovec iov[MAX_IOVS];
+	ssize_t total = 0;
+
+	while (size > 0) {
+		int n = 0;
+		ssize_t want = 0, ret;
+		while (size > 0 && n < MAX_IOVS) {
+			int len = size < IOV_BYTES ? size : IOV_BYTES;
+			iov[n].iov_base = writing ? write_buf : read_buf;
+			iov[n].iov_len = len;
+			n++;
+			want += len;
+			size -= len;
+		}
+		if (writing)
+			ret = pwritev(fd, iov, n, offset);
+		else
+			ret = preadv(fd, iov, n, offset);
+		if (ret < 0)
+			return total ? total : ret;
+		total += ret;
+		offset += ret;
+		if (ret < want)
+			break;
+	}
+	return total;
+}
+
+static void sv6_writex(struct dbench_op *op)
+{
+	int handle = op->params[0];
+	int offset = op->params[1];
+	int size = op->params[2];
+	int ret_size = op->params[3];
+	int i = find_handle(op->child, handle);
+	struct stat st;
+	struct sv6_client *c = op->child->private;
+	ssize_t ret;
+
+	if (options.fake_io) {
+		op->child->bytes += ret_size;
+		op->child->bytes_since_fsync += ret_size;
+		return;
+	}
+
+	if (options.one_byte_write_fix &&
+	    size == 1 && fstat(c->ftable[i].fd, &st) == 0) {
+		if (st.st_size > offset) {
+			unsigned char ch;
+			pread(c->ftable[i].fd, &ch, 1, offset);
+			if (ch == 0) {
+				op->child->bytes += size;
+				return;
+			}
+		}
+	}
+
+	ret = sv6_rw(c->ftable[i].fd, size, offset, 1);
+	if (ret == -1) {
+		printf("[%d] write failed on handle %d\n",
+		       op->child->line, handle);
+		exit(1);
+	}
+	if (ret != ret_size) {
+		printf("[%d] wrote %d bytes, expected to write %d bytes on handle %d\n",
+		       op->child->line, (int)ret, (int)ret_size, handle);
+		exit(1);
+	}
+
+	if (options.do_fsync) fsync(c->ftable[i].fd);
+
+	op->child->bytes += size;
+	op->child->bytes_since_fsync += size;
+}
+
+static void sv6_readx(struct dbench_op *op)
+{
+	int handle = op->params[0];
+	int offset = op->params[1];
+	int size = op->params[2];
+	int ret_size = op->params[3];
+	int i = find_handle(op->child, handle);
+	struct sv6_client *c = op->child->private;
+
+	if (options.fake_io) {
+		op->child->bytes += ret_size;
+		return;
+	}
+
+	if (sv6_rw(c->ftable[i].fd, size, offset, 0) != ret_size) {
+		printf("[%d] read failed on handle %d\n",
+		       op->child->line, handle);
+	}
+
+	op->child->bytes += size;
+}
+
+static void sv6_close(struct dbench_op *op)
+{
+	int handle = op->params[0];
+	struct sv6_client *c = op->child->private;
+	int i = find_handle(op->child, handle);
+	close(c->ftable[i].fd);
+	c->ftable[i].handle = 0;
+	if (c->ftable[i].name) free(c->ftable[i].name);
+	c->ftable[i].name = NULL;
+}
+
+static void sv6_rename(struct dbench_op *op)
+{
+	const char *old, *new;
+	int olddirfd, newdirfd;
+
+	resolve_name(op->child, op->fname);
+	resolve_name(op->child, op->fname2);
+
+	old = at_path(op->child, op->fname, &olddirfd);
+	new = at_path(op->child, op->fname2, &newdirfd);
+
+	if (options.stat_check) {
+		struct stat st;
+		if (fstatat(olddirfd, old, &st) != 0 &&
+		    expected_status(op->status) == 0) {
+			printf("[%d] rename %s %s failed - file doesn't exist\n",
+			       op->child->line, op->fname, op->fname2);
+			failed(op->child);
+			return;
+		}
+	}
+
+	if (renameat(olddirfd, old, newdirfd, new) !=
+	    expected_status(op->status)) {
+		printf("[%d] rename %s %s failed - expected %s\n",
+		       op->child->line, op->fname, op->fname2, op->status);
+		failed(op->child);
+	}
+	if (options.sync_dirs) sync_parent(op->child, op->fname2);
+}
+
+static void sv6_flush(struct dbench_op *op)
+{
+	int handle = op->params[0];
+	struct sv6_client *c = op->child->private;
+	int i = find_handle(op->child, handle);
+	fsync(c->ftable[i].fd);
+}
+
+static void sv6_qpathinfo(struct dbench_op *op)
+{
+	resolve_name(op->child, op->fname);
+}
+
+static void sv6_qfileinfo(struct dbench_op *op)
+{
+	int handle = op->params[0];
+	struct sv6_client *c = op->child->private;
+	struct stat st;
+	int i = find_handle(op->child, handle);
+	fstat(c->ftable[i].fd, &st);
+}
+
+static void sv6_findfirst(struct dbench_op *op)
+{
+	int maxcnt = op->params[1];
+	char dname[64];
+	const char *path;
+	int dirfd, fd;
+	char *p;
+
+	resolve_name(op->child, op->fname);
+
+	if (strchr(op->fname, '<') == NULL &&
+	    strchr(op->fname, '>') == NULL &&
+	    strchr(op->fname, '*') == NULL &&
+	    strchr(op->fname, '?') == NULL &&
+	    strchr(op->fname, '"') == NULL)
+		return;
+
+	strncpy(dname, op->fname, sizeof(dname));
+	dname[sizeof(dname)-1] = 0;
+	p = strrchr(dname, '/');
+	if (!p) return;
+	*p = 0;
+	if (maxcnt <= 0)
+		return;
+	path = at_path(op->child, dname, &dirfd);
+	fd = openat(dirfd, path, O_RDONLY|O_DIRECTORY);
+	if (fd < 0)
+		return;
+	scan_dir(fd, count_down, &maxcnt);
+	close(fd);
+}
+
+/* Remove everything below the directory path, relative to dirfd.
+   getdents() reports each entry's type, so only directories cost
+   more than the unlinkat(). */
+static void deltree_at(struct child_struct *child, int dirfd, const char *path)
+{
+	char buf[4096];
+	ssize_t n, off;
+	int fd;
+
+	fd = openat(dirfd, path, O_RDONLY|O_DIRECTORY);
+	if (fd < 0)
+		return;
+
+	while ((n = getdents(fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < n; ) {
+			struct xv6_dirent *de = (struct xv6_dirent *)(buf + off);
+			off += de->d_reclen;
+			if (strcmp(de->d_name, ".") == 0 ||
+			    strcmp(de->d_name, "..") == 0) {
+				continue;
+			}
+			if (de->d_type == T_DIR) {
+				deltree_at(child, fd, de->d_name);
+				if (unlinkat(fd, de->d_name, AT_REMOVEDIR) != 0) {
+					printf("[%d] rmdir '%s/%s' failed\n",
+					       child->line, path, de->d_name);
+				}
+			} else if (unlinkat(fd, de->d_name, 0) != 0) {
+				printf("[%d] unlink '%s/%s' failed\n",
+				       child->line, path, de->d_name);
+			}
+		}
+	}
+	close(fd);
+}
+
+static void sv6_deltree(struct dbench_op *op)
+{
+	const char *path;
+	int dirfd;
+
+	path = at_path(op->child, op->fname, &dirfd);
+	deltree_at(op->child, dirfd, path);
+}
+
+static void sv6_cleanup(struct child_struct *child)
+{
+	struct sv6_client *c = child->private;
+	char dname[64];
+
+	snprintf(dname, sizeof(dname), "clients/client%d", child->id);
+	deltree_at(child, c->rootfd, dname);
+	unlinkat(c->rootfd, dname, AT_REMOVEDIR);
+	unlinkat(c->rootfd, "clients", AT_REMOVEDIR);
+}
+
+static struct backend_op ops[] = {
+	{ "Deltree", sv6_deltree },
+	{ "Flush", sv6_flush },
+	{ "Close", sv6_close },
+	{ "Rmdir", sv6_rmdir },
+	{ "Mkdir", sv6_mkdir },
+	{ "Rename", sv6_rename },
+	{ "ReadX", sv6_readx },
+	{ "WriteX", sv6_writex },
+	{ "Unlink", sv6_unlink },
+	{ "FIND_FIRST", sv6_findfirst },
+	{ "QUERY_FILE_INFORMATION", sv6_qfileinfo },
+	{ "QUERY_PATH_INFORMATION", sv6_qpathinfo },
+	{ "NTCreateX", sv6_createx },
+	{ NULL, NULL}
+};
+
+struct nb_operations sv6io_ops = {
+	.backend_name = "sv6",
+	.setup 		= sv6_setup,
+	.cleanup	= sv6_cleanup,
+	.ops          = ops
+};
@@ -2,6 +2,7 @@
 
 #include "traps.h"
 #include "amd64.h"
+#include "bitset.hh"
 
 extern class abstract_lapic *lapic;
 extern class abstract_extpic *extpic;
@@ -22,6 +23,10 @@ public:
   // Send an IPI to a remote CPU
   virtual void send_ipi(struct cpu *c, int ino) = 0;
 
+  // Send the same IPI to each CPU in targets.  By default that's one
+  // send_ipi() each (see kernel/ipi.cc).
+  virtual void send_ipi_many(const bitset<NCPU> &targets, int ino);
+
   // Send a T_TLBFLUSH IPI to a remote CPU
   void send_tlbflush(struct cpu *c)
   {
@@ -37,6 +42,11 @@ public:
   // Mask or unmask PC
   virtual void mask_pc(bool mask) = 0;
 
+  // Set this CPU's timer to interrupt once, when the TSC reaches
+  // deadline (right away if it already has).  Setting it again
+  // replaces the previous deadline.
+  virtual void set_timer(u64 deadline) = 0;
+
   // Start an AP
   virtual void start_ap(struct cpu *c, u32 addr) = 0;
 
@@ -53,10 +63,22 @@ public:
 struct pci_func;
 struct irq;
 
+// Something that decides which CPU an IRQ's interrupts are delivered
+// to: the external PIC for IOAPIC pins, or the MSI or MSI-X registers
+// of a PCI function.  Whatever configures an IRQ's delivery registers
+// its router with irq::set_router() so the IRQ can be moved later with
+// irq::set_affinity() (or by writing "<irq> <cpu>" to /dev/irqaffinity).
+class irq_router
+{
+public:
+  // Deliver irq's interrupts to cpu from now on.
+  virtual void route_irq(const struct irq &irq, int cpu) = 0;
+};
+
 // Abstract base class for external programmable interrupt controllers
 // (the PIC responsible for routing hardware IRQs).  This could be a
 // dual 8259A PIC or a collection of I/O APICs.
-class abstract_extpic
+class abstract_extpic : public irq_router
 {
 public:
   // Return the IRQ for a legacy ISA IRQ.  Does not unmask it.
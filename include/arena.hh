@@ -0,0 +1,131 @@
+#pragma once
+
+// A bump-pointer arena for objects that all die together.  Allocation
+// carves memory off the end of the current chunk; individual frees are
+// no-ops (except that freeing the most recent allocation gives its
+// space back, which covers a vector growing in place), and all of the
+// arena's memory goes back to kmalloc at once when it is destroyed.
+// Chunks start small and double in size, so an arena that only ever sees
+// a few small allocations costs a single kmalloc.
+//
+// Containers use an arena through arena_allocator.  An arena is not
+// thread-safe; it belongs to whoever owns the objects allocated from it.
+
+#include "kalloc.hh"
+
+class arena
+{
+public:
+  enum {
+    // Size of the first chunk, and the largest size that doubling grows
+    // chunks to.  Bigger allocations get a chunk of their own.
+    MIN_CHUNK = 512,
+    MAX_CHUNK = 64 * 1024,
+  };
+
+  arena() : chunks_(nullptr), cur_(nullptr), end_(nullptr), last_(nullptr),
+            next_size_(MIN_CHUNK) { }
+  ~arena();
+
+  arena(const arena &o) = delete;
+  arena &operator=(const arena &o) = delete;
+
+  // Allocate size bytes aligned to align, which must be a power of two
+  // no larger than 16.  Throws bad_alloc if out of memory.
+  void *alloc(size_t size, size_t align = 16)
+  {
+    char *p = (char*)(((uptr)cur_ + align - 1) & ~(uptr)(align - 1));
+    if (!cur_ || p + size > end_)
+      return grow(size);
+    cur_ = p + size;
+    last_ = p;
+    return p;
+  }
+
+  // Release an allocation.  Only the most recent allocation's space can
+  // be reused; anything else is reclaimed when the arena goes away.
+  void free(void *p, size_t size)
+  {
+    if (p == last_ && (char*)p + size == cur_) {
+      cur_ = (char*)p;
+      last_ = nullptr;
+    }
+  }
+
+private:
+  struct chunk
+  {
+    chunk *next;
+    size_t size;
+  };
+
+  char *grow(size_t size);
+
+  chunk *chunks_;
+  char *cur_;
+  char *end_;
+  char *last_;
+  size_t next_size_;
+};
+
+// An allocator that allocates from an arena.  With no arena, it falls
+// back to kmalloc, so a container type can be shared by owners that have
+// an arena and ones that don't.
+template<class T>
+class arena_allocator : public allocator_base<T>
+{
+public:
+  template <class U> struct rebind { typedef arena_allocator<U> other; };
+
+  arena_allocator(arena *a = nullptr) noexcept : arena_(a) { }
+  arena_allocator(const arena_allocator&) = default;
+  template<class U> arena_allocator(const arena_allocator<U> &o) noexcept
+    : arena_(o.get_arena()) { }
+
+  T*
+  allocate(std::size_t n, const void *hint = 0)
+  {
+    if (arena_)
+      return (T*)arena_->alloc(n * sizeof(T),
+                               alignof(T) < 16 ? alignof(T) : 16);
+    void *p = kmalloc(n * sizeof(T), "arena_allocator");
+    if (!p)
+      throw_bad_alloc();
+    return (T*)p;
+  }
+
+  void
+  deallocate(T* p, std::size_t n)
+  {
+    if (arena_)
+      arena_->free(p, n * sizeof(T));
+    else
+      kmfree(p, n * sizeof(T));
+  }
+
+  std::size_t
+  max_size() const noexcept
+  {
+    return (std::size_t)-1 / sizeof(T);
+  }
+
+  arena *get_arena() const noexcept
+  {
+    return arena_;
+  }
+
+private:
+  arena *arena_;
+};
+
+template<class T, class U>
+bool operator==(const arena_allocator<T> &a, const arena_allocator<U> &b)
+{
+  return a.get_arena() == b.get_arena();
+}
+
+template<class T, class U>
+bool operator!=(const arena_allocator<T> &a, const arena_allocator<U> &b)
+{
+  return !(a == b);
+}
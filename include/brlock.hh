@@ -0,0 +1,151 @@
+#pragma once
+
+#include "cpu.hh"
+#include "sleeplock.hh"
+#include "condvar.hh"
+#include <atomic>
+
+/**
+ * A big-reader lock: a reader-writer lock for read-mostly data, whose
+ * readers only touch a counter of their own core's, so readers on
+ * different cores don't share any cache lines.  Writers are expensive:
+ * they exclude each other with a sleeplock, announce themselves, and
+ * sleep until the readers on every core are gone.  New readers wait
+ * while a writer holds or waits for the lock.
+ *
+ * Readers may sleep, and migrate, while they hold the lock; a reader
+ * releases the counter of the core it acquired the lock on.  Like a
+ * sleeplock, acquiring a brlock (for reading or writing) may sleep.
+ *
+ * A brlock takes NCPU cache lines, so it is meant for a few global
+ * structures, not for embedding in every object.
+ *
+ * Only the slow paths take wait_lock_, so with lockstat, the brlock's
+ * entry in /dev/lockstat counts the writers that had to wait for
+ * readers and the readers that had to wait for a writer (or wake one).
+ */
+class brlock
+{
+  struct reader_count
+  {
+    std::atomic<u64> count;
+    __padout__;
+  } __mpalign__;
+
+  reader_count readers_[NCPU];
+  std::atomic<bool> writer_;
+  sleeplock write_lock_;
+  // Protects sleeping on and waking cv_, which writers wait on for the
+  // readers, and readers wait on for the writer.
+  spinlock wait_lock_;
+  condvar cv_;
+
+public:
+  brlock(const char *name, bool lockstat = false)
+    : readers_(), writer_(false), wait_lock_(name, lockstat), cv_(name) { }
+
+  brlock(const brlock &o) = delete;
+  brlock &operator=(const brlock &o) = delete;
+
+  NEW_DELETE_OPS(brlock);
+
+  // An RAII object representing a read section.
+  class reader
+  {
+    brlock *l_;
+    int cpu_;
+
+  public:
+    constexpr reader() : l_(nullptr), cpu_(-1) { }
+    reader(brlock *l) : l_(l), cpu_(l->read_acquire()) { }
+    ~reader() { release(); }
+
+    reader(const reader &o) = delete;
+    reader &operator=(const reader &o) = delete;
+
+    reader(reader &&o) : l_(o.l_), cpu_(o.cpu_)
+    {
+      o.l_ = nullptr;
+    }
+
+    reader &operator=(reader &&o)
+    {
+      release();
+      l_ = o.l_;
+      cpu_ = o.cpu_;
+      o.l_ = nullptr;
+      return *this;
+    }
+
+    void release()
+    {
+      if (l_) {
+        l_->read_release(cpu_);
+        l_ = nullptr;
+      }
+    }
+  };
+
+  // Acquire the lock for reading.  Returns the token to pass to
+  // read_release.
+  int read_acquire()
+  {
+    for (;;) {
+      int cpu = myid();
+      // If we migrate before this, we count ourselves on another core,
+      // which is just slower.
+      readers_[cpu].count.fetch_add(1);
+      // Either the writer sees our count, or we see it.
+      if (__builtin_expect(!writer_.load(), 1))
+        return cpu;
+
+      read_release(cpu);
+      scoped_acquire l(&wait_lock_);
+      while (writer_.load())
+        cv_.sleep(&wait_lock_);
+    }
+  }
+
+  void read_release(int cpu)
+  {
+    if (readers_[cpu].count.fetch_sub(1) == 1 && writer_.load()) {
+      // We may be the last reader the writer is waiting for.
+      scoped_acquire l(&wait_lock_);
+      cv_.wake_all();
+    }
+  }
+
+  reader read_guard()
+  {
+    return reader(this);
+  }
+
+  // Acquire the lock for writing.
+  void acquire()
+  {
+    write_lock_.acquire();
+    writer_.store(true);
+    for (int i = 0; i < NCPU; i++) {
+      if (!readers_[i].count.load())
+        continue;
+      scoped_acquire l(&wait_lock_);
+      while (readers_[i].count.load())
+        cv_.sleep(&wait_lock_);
+    }
+  }
+
+  void release()
+  {
+    {
+      scoped_acquire l(&wait_lock_);
+      writer_.store(false);
+      cv_.wake_all();
+    }
+    write_lock_.release();
+  }
+
+  lock_guard<brlock> guard()
+  {
+    return lock_guard<brlock>(this);
+  }
+};
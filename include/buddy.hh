@@ -108,6 +108,17 @@ public:
     return ptr;
   }
 
+  // Like alloc_nothrow(), but returns nullptr rather than split a
+  // free block larger than max_size bytes to satisfy the request.
+  void *alloc_nothrow_nosplit(std::size_t size, std::size_t max_size)
+  {
+    std::size_t order = size_to_order(size), max_order = size_to_order(max_size);
+    for (; order <= max_order && order <= highest_avail_order; ++order)
+      if (!orders[order].blocks.empty())
+        return alloc_nothrow(size);
+    return nullptr;
+  }
+
   // Like alloc_nothrow(), but throws std::bad_alloc if out of memory.
   void *alloc(std::size_t size)
   {
@@ -124,6 +135,10 @@ public:
     free_order(ptr, size_to_order(size));
   }
 
+  // Let a region allocated with <tt>alloc(size)</tt> be freed in
+  // MIN_SIZE pieces.
+  void split(void *ptr, std::size_t size);
+
   // Return the lowest address the allocator can return.
   void *get_base() const
   {
@@ -9,6 +9,11 @@
 #include "weakcache.hh"
 #include "disk.hh"
 
+#include <algorithm>
+#include <vector>
+
+struct transaction_diskblock;
+
 class buf : public refcache::weak_referenced {
 public:
   struct bufdata {
@@ -19,6 +24,9 @@ public:
 
   static bool in_bufcache(u32 dev, u64 block);
   static sref<buf> get(u32 dev, u64 block, bool skip_disk_read = false);
+  static std::vector<sref<buf>> get_range(u32 dev, u64 start, u64 n);
+  static std::vector<sref<buf>> get_blocks(u32 dev,
+                                           const std::vector<u64> &blocks);
   static void put(u32 dev, u64 block);
   void writeback(bool sync = true);
   void writeback_async();
@@ -40,12 +48,7 @@ public:
   u64 block() { return block_; }
   bool dirty() { return dirty_; }
 
-  void cache_pin(bool flag) {
-    if (flag)
-      inc();
-    else
-      dec();
-  }
+  void cache_pin(bool flag);
 
   seq_reader<bufdata> read() {
     return seq_reader<bufdata>(data_, &seq_);
@@ -62,25 +65,36 @@ public:
     buf* b_;
   };
 
+  // Gives a transaction that shares this buf's contents (see
+  // add_to_transaction()) its own copy, before a writer modifies them. This
+  // runs with the write_lock_ held but outside the seq-lock write section, so
+  // that readers don't spin while we wait for the transaction's disk I/O.
+  class buf_cow_breaker {
+  public:
+    buf_cow_breaker(buf* b) { b->break_cow(); }
+    buf_cow_breaker(buf_cow_breaker&& o) {}
+  };
+
   class buf_writer : public ptr_wrap<bufdata>,
                      public lock_guard<sleeplock>,
+                     public buf_cow_breaker,
                      public seq_writer,
                      public buf_dirty {
   public:
-    buf_writer(bufdata* d, sleeplock* l, seqcount<u32>* s, buf* b)
-      : ptr_wrap<bufdata>(d), lock_guard<sleeplock>(l),
-        seq_writer(s), buf_dirty(b) {}
+    buf_writer(bufdata* d, sleeplock* l, seqcount<u32>* s, buf* b, bool dirty)
+      : ptr_wrap<bufdata>(d), lock_guard<sleeplock>(l), buf_cow_breaker(b),
+        seq_writer(s), buf_dirty(dirty ? b : nullptr) {}
   };
 
   buf_writer write() {
-    return buf_writer(data_, &write_lock_, &seq_, this);
+    return buf_writer(data_, &write_lock_, &seq_, this, true);
   }
 
   // Same as write(), except that the block is not marked dirty.
   // Used to get exclusive (i.e., write) access to the block without
   // disturbing the dirty flag or the reference count.
   buf_writer write_clean() {
-    return buf_writer(data_, &write_lock_, &seq_, nullptr);
+    return buf_writer(data_, &write_lock_, &seq_, this, false);
   }
 
 private:
@@ -93,14 +107,48 @@ private:
   std::atomic<bool> dirty_;
   sref<disk_completion> dc_;
 
+  // Set once the block's contents have been read from the disk. Until then,
+  // readers sleep on load_dc_, the completion of the read that loads it,
+  // which may be shared by all the blocks read by one disk request.
+  std::atomic<bool> loaded_;
+  sref<disk_completion> load_dc_;
+
+  // Whether the buffer cache holds a reference to this buf, and the CLOCK
+  // reference bit that bufcache_reclaim() uses to pick bufs to unpin.
+  std::atomic<bool> pinned_;
+  std::atomic<bool> recently_used_;
+
+  void mark_used() {
+    if (!recently_used_.load(std::memory_order_relaxed))
+      recently_used_.store(true, std::memory_order_relaxed);
+  }
+
+  bool test_and_clear_used() {
+    if (!recently_used_.load(std::memory_order_relaxed))
+      return false;
+    return recently_used_.exchange(false, std::memory_order_relaxed);
+  }
+
   bufdata *data_;
 
+  // The transaction diskblock (if any) whose contents are data_ itself, rather
+  // than a private copy. Set under write_lock_ by add_to_transaction(), and
+  // cleared by the next writer (break_cow()) or by the diskblock when it goes
+  // away first.
+  std::atomic<transaction_diskblock*> cow_block_;
+  friend transaction_diskblock;
+
+  void break_cow();
+  void wait_loaded();
+
   buf(u32 dev, u64 block)
-    : dev_(dev), block_(block), dirty_(false)
+    : dev_(dev), block_(block), dirty_(false), loaded_(false),
+      pinned_(false), recently_used_(false), cow_block_(nullptr)
   {
     data_ = (bufdata *) kmalloc(sizeof(bufdata), "bufdata");
   }
   void onzero() override;
+  friend u64 bufcache_reclaim(u64 nbufs);
   NEW_DELETE_OPS(buf);
 
   ~buf()
@@ -119,6 +167,32 @@ private:
   }
 };
 
+u64 bufcache_reclaim(u64 nbufs);
+u64 bufcache_shrink(u64 npages);
+
+// Hands out the buffers of a scan over increasing block numbers below @end,
+// reading them from the disk SCALEFS_BUF_CLUSTER blocks at a time using
+// buf::get_range(), so that metadata scans run at sequential bandwidth.
+class buf_scanner {
+public:
+  buf_scanner(u32 dev, u64 end) : dev_(dev), end_(end), first_(0) {}
+
+  sref<buf> get(u64 block) {
+    if (block < first_ || block - first_ >= bufs_.size()) {
+      first_ = block;
+      bufs_ = buf::get_range(dev_, block,
+                             std::min((u64) SCALEFS_BUF_CLUSTER, end_ - block));
+    }
+    return bufs_[block - first_];
+  }
+
+private:
+  const u32 dev_;
+  const u64 end_;
+  u64 first_;
+  std::vector<sref<buf>> bufs_;
+};
+
 template<>
 inline u64
 hash(const buf::key_t& k)
@@ -2,15 +2,21 @@
 
 /*
  * A bucket-chaining hash table.
+ *
+ * Lookups and enumeration don't lock and never write to the table: they
+ * walk the chains in a gc epoch, and updates (under the bucket lock)
+ * link items in with release stores and free them with gc_delayed.  A
+ * value that changes in place is read through the item's seqcount.
  */
 
 #include "spinlock.hh"
 #include "seqlock.hh"
 #include "lockwrap.hh"
 #include "hash.hh"
-#include "ilist.hh"
+#include "rculist.hh"
 #include "hpet.hh"
 #include "cpuid.hh"
+#include "kmcache.hh"
 
 template<class K, class V>
 class chainhash {
@@ -20,9 +26,9 @@ private:
       : rcu_freed("chainhash::item", this, sizeof(*this)),
         key(k), val(v) {}
     void do_gc() override { delete this; }
-    NEW_DELETE_OPS(item);
+    NEW_DELETE_OPS_CACHED(item);
 
-    islink<item> link;
+    rcu_slink<item> link;
     seqcount<u32> seq;
     const K key;
     V val;
@@ -30,7 +36,7 @@ private:
 
   struct bucket {
     spinlock lock __mpalign__;
-    islist<item, &item::link> chain;
+    rcu_slist<item, &item::link> chain;
 
     ~bucket() {
       while (!chain.empty()) {
@@ -34,5 +34,7 @@ struct condvar {
   void wake_one(proc *p);
 };
 
-void            timerintr(void);
+bool            timerintr(void);
+void            timer_idle(bool idle);
+void            timer_wake_tickless(void);
 u64             nsectime(void);
@@ -39,6 +39,132 @@ class strbuf {
   }
 };
 
+// A file name.  Names of up to inline_max bytes, which is nearly all of
+// them, are stored in the object itself like a strbuf, so that copying
+// and comparing them never allocates; longer names live in a heap
+// buffer owned by the fsname.  The inline buffer is zero-padded, so
+// that it can be compared and hashed a word at a time (see words()).
+class fsname {
+ public:
+  static const size_t inline_max = 23;
+  static const size_t inline_words = (inline_max + 1) / sizeof(u64);
+
+  fsname() : len_(0) {
+    clear_inline();
+  }
+
+  fsname(const char *s) {
+    assign(s, strlen(s));
+  }
+
+  fsname(const char *s, size_t len) {
+    assign(s, len);
+  }
+
+  fsname(const fsname &o) {
+    assign(o.c_str(), o.len_);
+  }
+
+  fsname(fsname &&o) {
+    take(o);
+  }
+
+  fsname& operator=(const fsname &o) {
+    if (this != &o) {
+      release();
+      assign(o.c_str(), o.len_);
+    }
+    return *this;
+  }
+
+  fsname& operator=(fsname &&o) {
+    if (this != &o) {
+      release();
+      take(o);
+    }
+    return *this;
+  }
+
+  ~fsname() {
+    release();
+  }
+
+  const char* c_str() const {
+    return len_ > inline_max ? long_ : buf_;
+  }
+
+  size_t size() const {
+    return len_;
+  }
+
+  // The inline buffer as words, or null for a long name.
+  const u64* words() const {
+    return len_ > inline_max ? nullptr : words_;
+  }
+
+  bool operator==(const fsname &other) const {
+    if (len_ != other.len_)
+      return false;
+    if (len_ > inline_max)
+      return !memcmp(long_, other.long_, len_);
+    for (size_t i = 0; i < inline_words; i++)
+      if (words_[i] != other.words_[i])
+        return false;
+    return true;
+  }
+
+  bool operator!=(const fsname &other) const {
+    return !operator==(other);
+  }
+
+  bool operator<(const fsname &other) const {
+    int c = memcmp(c_str(), other.c_str(),
+                   len_ < other.len_ ? len_ : other.len_);
+    return c < 0 || (c == 0 && len_ < other.len_);
+  }
+
+ private:
+  void clear_inline() {
+    for (size_t i = 0; i < inline_words; i++)
+      words_[i] = 0;
+  }
+
+  void assign(const char *s, size_t len) {
+    len_ = len;
+    char *dst = buf_;
+    if (len > inline_max)
+      dst = long_ = new char[len + 1];
+    else
+      clear_inline();
+    memmove(dst, s, len);
+    dst[len] = '\0';
+  }
+
+  void take(fsname &o) {
+    len_ = o.len_;
+    if (len_ > inline_max) {
+      long_ = o.long_;
+      o.len_ = 0;
+      o.clear_inline();
+    } else {
+      for (size_t i = 0; i < inline_words; i++)
+        words_[i] = o.words_[i];
+    }
+  }
+
+  void release() {
+    if (len_ > inline_max)
+      delete[] long_;
+  }
+
+  size_t len_;
+  union {
+    char buf_[inline_max + 1];
+    u64 words_[inline_words];
+    char *long_;
+  };
+};
+
 #ifdef XV6_KERNEL
 namespace std {
   struct ostream { int next_width; };
@@ -0,0 +1,24 @@
+/*
+ *	crc32c.h - CRC-32C routine
+ *
+ * Implements the CRC-32C (Castagnoli):
+ *   Width 32
+ *   Poly  0x1EDC6F41 (reflected: 0x82F63B78)
+ *   Init  ~0, final XOR ~0 (handled by crc32c())
+ *
+ * Calls can be chained: crc32c(crc32c(0, a, n), b, m) equals the CRC of the
+ * concatenation of a and b.
+ */
+
+#pragma once
+
+#include "types.h"
+
+extern u32 const crc32c_table[256];
+
+extern u32 crc32c(u32 crc, const u8 *buffer, size_t len);
+
+static inline u32 crc32c_byte(u32 crc, const u8 data)
+{
+	return (crc >> 8) ^ crc32c_table[(crc ^ data) & 0xff];
+}
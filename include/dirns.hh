@@ -5,19 +5,21 @@
 struct dir_entry_info {
   u32 inum_;
   u32 offset_;
+  u32 reclen_;  // Size of the on-disk record
 
-  dir_entry_info() : inum_(0), offset_(0) {}
-  dir_entry_info(u32 inum, u32 offset) : inum_(inum), offset_(offset) {}
+  dir_entry_info() : inum_(0), offset_(0), reclen_(0) {}
+  dir_entry_info(u32 inum, u32 offset, u32 reclen)
+    : inum_(inum), offset_(offset), reclen_(reclen) {}
   NEW_DELETE_OPS(dir_entry_info);
 
   bool operator==(const dir_entry_info &o) const
   {
-    return inum_ == o.inum_ && offset_ == o.offset_;
+    return inum_ == o.inum_ && offset_ == o.offset_ && reclen_ == o.reclen_;
   }
 
   bool operator!=(const dir_entry_info &o) const
   {
-    return inum_ != o.inum_ || offset_ != o.offset_;
+    return !(*this == o);
   }
 };
 
@@ -26,21 +28,21 @@ public:
   dir_entries(u64 size) : map_(size) {}
   NEW_DELETE_OPS(dir_entries);
 
-  bool lookup(const strbuf<DIRSIZ>& name, dir_entry_info *de_info_ptr)
+  bool lookup(const fsname& name, dir_entry_info *de_info_ptr)
   {
     return map_.lookup(name, de_info_ptr);
   }
 
-  bool insert(const strbuf<DIRSIZ>& name, const dir_entry_info& de_info)
+  bool insert(const fsname& name, const dir_entry_info& de_info)
   {
     return map_.insert(name, de_info);
   }
 
-  bool remove(const strbuf<DIRSIZ>& name)
+  bool remove(const fsname& name)
   {
     return map_.remove(name);
   }
 
 private:
-  chainhash<strbuf<DIRSIZ>, dir_entry_info> map_;
+  chainhash<fsname, dir_entry_info> map_;
 };
@@ -2,9 +2,12 @@
 
 #include "spinlock.hh"
 #include "condvar.hh"
+#include "percpu.hh"
+#include "arena.hh"
 
 #define IOV_MAX     65535    // Limited by MAX_PRD_ENTRIES
 #define SG_IO_SIZE  64*1024  // Size used for scatter-gather I/O
+#define ELEVATOR_IO_SIZE (1024*1024) // Largest write merged by the elevator
 
 struct kiovec
 {
@@ -12,14 +15,41 @@ struct kiovec
   u64 iov_len;
 };
 
+enum blkio_op { BLKIO_READ, BLKIO_WRITE, BLKIO_FLUSH, BLKIO_NOPS };
+
+// I/O priority classes, most urgent first.  Journal and commit writes,
+// which an fsync waits for, are BLKIO_PRIO_COMMIT; home-location writes of
+// applied transactions and file data writeback, which only need
+// throughput, are BLKIO_PRIO_BULK; everything else, including reads, is
+// BLKIO_PRIO_NORMAL.  A driver that has to queue commands (see ahci.cc)
+// issues the more urgent classes first.
+enum blkio_prio { BLKIO_PRIO_COMMIT, BLKIO_PRIO_NORMAL, BLKIO_PRIO_BULK,
+                  BLKIO_NPRIOS };
+
+class disk_completion;
+void blkio_complete(disk_completion *dc);
+
 class disk_completion : public referenced
 {
 public:
-  disk_completion() : done_(false) {}
+  disk_completion()
+    : blkio_dev(-1), blkio_op(0), blkio_prio(BLKIO_PRIO_NORMAL),
+      blkio_start(0), done_(false), pending_(1) {}
   NEW_DELETE_OPS(disk_completion);
 
+  // An I/O that was split into n disk commands is done once all n have
+  // notified its completion.
+  void add_pending(int n) {
+    scoped_acquire a(&lock_);
+    pending_ += n;
+  }
+
   void notify() {
     scoped_acquire a(&lock_);
+    if (--pending_ > 0)
+      return;
+    if (blkio_dev >= 0)
+      blkio_complete(this);
     done_ = true;
     cv_.wake_all();
   }
@@ -35,16 +65,24 @@ public:
     return done_;
   }
 
+  // Set when the I/O is submitted, for the block layer's statistics and
+  // the driver's dispatch order.
+  int blkio_dev;
+  int blkio_op;
+  int blkio_prio;
+  u64 blkio_start;
+
 private:
   spinlock lock_;
   condvar cv_;
   bool done_;
+  int pending_;
 };
 
 class disk
 {
 public:
-  disk() {}
+  disk() : dk_fua(false) {}
   disk(const disk &) = delete;
   disk &operator=(const disk &) = delete;
 
@@ -53,6 +91,7 @@ public:
   char dk_serial[20];
   char dk_firmware[8];
   char dk_busloc[20];
+  bool dk_fua;          // Whether awritev_fua() is native
 
   virtual void readv(kiovec *iov, int iov_cnt, u64 off) = 0;
   virtual void writev(kiovec *iov, int iov_cnt, u64 off) = 0;
@@ -73,6 +112,17 @@ public:
     dc->notify();
   }
 
+  // Write with Force Unit Access: by the time dc is notified, the data is on
+  // stable media rather than in the disk's write cache, and nothing else has
+  // had to be flushed out of that cache. Disks that can't do FUA writes set
+  // dk_fua to false, and get a write followed by a full flush instead.
+  virtual void awritev_fua(kiovec *iov, int iov_cnt, u64 off,
+                           sref<disk_completion> dc) {
+    writev(iov, iov_cnt, off);
+    flush();
+    dc->notify();
+  }
+
   void read(char* buf, u64 nbytes, u64 off) {
     kiovec iov = { (void*) buf, nbytes };
     readv(&iov, 1, off);
@@ -91,17 +141,24 @@ public:
   }
 
   void awrite(const char* buf, u64 nbytes, u64 off,
-              sref<disk_completion> dc)
+              sref<disk_completion> dc, bool fua = false)
   {
     kiovec iov = { (void*) buf, nbytes };
-    awritev(&iov, 1, off, dc);
+    if (fua)
+      awritev_fua(&iov, 1, off, dc);
+    else
+      awritev(&iov, 1, off, dc);
   }
 };
 
 
+struct superblock;
+
 u32 blknum_to_dev(u32 blknum);
 u32 remap_blknum(u32 blknum);
 u32 num_disks();
+void disk_set_layout(const superblock *sb);
+bool disk_has_fua(u32 dev);
 
 void disk_register(disk* d);
 
@@ -112,10 +169,12 @@ void disk_readv(u32 dev, kiovec *iov, int iov_cnt, u64 offset,
                 sref<disk_completion> dc = sref<disk_completion>());
 
 void disk_write(u32 dev, const char* buf, u64 nbytes, u64 offset,
-                sref<disk_completion> dc = sref<disk_completion>());
+                sref<disk_completion> dc = sref<disk_completion>(),
+                bool fua = false);
 
 void disk_writev(u32 dev, kiovec *iov, int iov_cnt, u64 offset,
-                 sref<disk_completion> dc = sref<disk_completion>());
+                 sref<disk_completion> dc = sref<disk_completion>(),
+                 bool fua = false, blkio_prio prio = BLKIO_PRIO_NORMAL);
 
 void disk_flush(u32 dev, sref<disk_completion> dc = sref<disk_completion>());
 
@@ -146,21 +205,35 @@ void disk_flush(u32 dev, sref<disk_completion> dc = sref<disk_completion>());
 // all processes/threads so as to exploit opportunities for contiguous disk I/O
 // across process boundaries. And of course, any combination of these techniques
 // can be used as well.
+//
+// A write-context that has an arena (such as a transaction) can have the block
+// queue's memory allocated from it, so that it is all freed in one go along
+// with the arena.  Its writes are file data writeback, and go out at
+// BLKIO_PRIO_BULK.
 class block_queue {
 
 public:
   NEW_DELETE_OPS(block_queue);
 
-  block_queue()
+  explicit block_queue(arena *a = nullptr) : arena_(a)
   {
-    for (int i = 0; i < num_disks(); i++)
-      dqueue[i] = new disk_queue(i);
+    for (int i = 0; i < num_disks(); i++) {
+      if (arena_)
+        dqueue[i] = new ((disk_queue *)arena_->alloc(sizeof(disk_queue)))
+          disk_queue(i, arena_);
+      else
+        dqueue[i] = new disk_queue(i, nullptr);
+    }
   }
 
   ~block_queue()
   {
-    for (int i = 0; i < num_disks(); i++)
-      delete dqueue[i];
+    for (int i = 0; i < num_disks(); i++) {
+      if (arena_)
+        dqueue[i]->~disk_queue();
+      else
+        delete dqueue[i];
+    }
   }
 
   void write(u32 dev, const char *buf, u64 nbytes, u64 offset)
@@ -180,6 +253,15 @@ public:
       dqueue[i]->flush();
   }
 
+  // Issue the writes still buffered, without waiting for any of them; the
+  // completions of all the writes in flight are appended to *pending
+  // instead, and the caller must wait for them.
+  void flush_async(std::vector<sref<disk_completion>> *pending)
+  {
+    for (int i = 0; i < num_disks(); i++)
+      dqueue[i]->flush_async(pending);
+  }
+
 private:
 
   class disk_queue {
@@ -187,10 +269,11 @@ private:
   public:
     NEW_DELETE_OPS(disk_queue);
 
-    explicit disk_queue(u32 dev) : iovec_idx(0), dev_(dev)
+    disk_queue(u32 dev, arena *a) : iovec_idx(0), dev_(dev)
     {
       for (int i = 0; i < AHCI_QUEUE_DEPTH; i++) {
         start_offset[i] = 0;
+        iovec[i] = iovec_list(a);
         iovec[i].reserve(SG_IO_SIZE/BSIZE);
       }
     }
@@ -240,7 +323,8 @@ private:
 
         dc[iovec_idx] = make_sref<disk_completion>();
         disk_writev(dev_, &iovec[iovec_idx][0], iovec[iovec_idx].size(),
-                    start_offset[iovec_idx], dc[iovec_idx]);
+                    start_offset[iovec_idx], dc[iovec_idx], false,
+                    BLKIO_PRIO_BULK);
         iovec[iovec_idx].clear();
         iovec[iovec_idx].reserve(SG_IO_SIZE/BSIZE);
       }
@@ -261,12 +345,22 @@ private:
         flush_queue(i, true);
     }
 
+    void flush_async(std::vector<sref<disk_completion>> *pending)
+    {
+      for (int i = 0; i < AHCI_QUEUE_DEPTH; i++) {
+        flush_queue(i);
+        if (dc[i].get())
+          pending->push_back(std::move(dc[i]));
+      }
+    }
+
   private:
     // Maximum number of command-slots or the NCQ queue depth, as defined in
     // the AHCI specification.
     enum { AHCI_QUEUE_DEPTH = 32 };
 
-    std::vector<kiovec> iovec[AHCI_QUEUE_DEPTH];
+    typedef std::vector<kiovec, arena_allocator<kiovec>> iovec_list;
+    iovec_list iovec[AHCI_QUEUE_DEPTH];
     sref<disk_completion> dc[AHCI_QUEUE_DEPTH];
     u64 start_offset[AHCI_QUEUE_DEPTH];
     int iovec_idx; // Indicates which iovec to add items to next.
@@ -275,4 +369,68 @@ private:
 
 private:
   disk_queue* dqueue[NDISK];
+  arena *arena_;
 };
+
+// The system-wide instance of the block layer envisioned above: a write
+// elevator shared by all the threads applying transactions to the disk.
+// Writers stage their blocks in per-core shards, and whoever dispatches the
+// staged writes sorts the blocks of all the shards by their location on the
+// disks and merges runs of adjacent blocks into writes of up to
+// ELEVATOR_IO_SIZE, so that transactions applied concurrently by different
+// cores (which often touch neighbouring inode and bitmap blocks) share disk
+// writes.
+//
+// A writer brackets its writes with begin() and finish(). finish() dispatches
+// the staged writes as soon as every other writer in between begin() and
+// finish() is ready too, or once SCALEFS_ELEVATOR_DEADLINE_US has passed,
+// which bounds the latency that waiting for other writers can add. It returns
+// once all of this writer's blocks are on the disk. The writes are home
+// location writes of applied transactions, at BLKIO_PRIO_BULK.
+class write_elevator {
+public:
+  // Tracks the blocks of one writer that are still to be written.
+  struct ticket {
+    u64 pending;
+    ticket() : pending(0) {}
+  };
+
+  write_elevator() : active_(0), ready_(0), dispatching_(false),
+                     deadline_(0) {}
+  write_elevator(const write_elevator &) = delete;
+  write_elevator &operator=(const write_elevator &) = delete;
+
+  void begin();
+  // Stage a write of the block at @blocknum. @buf must stay valid and
+  // unmodified until finish(@t) returns.
+  void write(u32 blocknum, const char *buf, ticket *t);
+  void finish(ticket *t);
+
+private:
+  struct staged_write {
+    u32 dev;
+    u32 blocknum;      // Block number on the disk dev
+    u32 fs_blocknum;   // Block number in the filesystem (striped) layout
+    const char *buf;
+    ticket *t;
+  };
+
+  struct shard {
+    spinlock lock;
+    std::vector<staged_write> writes;
+  };
+
+  void dispatch();
+
+  percpu<shard> shards_;
+
+  // Protects everything below, and the tickets' pending counts.
+  spinlock lock_;
+  condvar cv_;
+  int active_;       // Writers in between begin() and finish()
+  int ready_;        // Writers waiting in finish()
+  bool dispatching_;
+  u64 deadline_;     // When the oldest waiting writer stops waiting for others
+};
+
+extern write_elevator disk_elevator;
@@ -0,0 +1,83 @@
+#pragma once
+
+// Readiness notification for epoll (see kernel/epoll.cc).  A file
+// whose readiness for I/O changes, like a pipe end or a socket, owns a
+// poll_source.  The source can say whether the file is ready right now,
+// and the file tells it about each event as it happens.  An epoll set
+// links an epoll_watch onto the source of every file it watches.
+
+#include "spinlock.hh"
+#include "ilist.hh"
+#include <atomic>
+#include <uk/epoll.h>
+
+class poll_source;
+struct file_epoll;
+
+struct epoll_watch {
+  file_epoll *const ep;
+  const sref<poll_source> src;
+  const int fd;
+  // The events the watch is for, including EPOLLET and EPOLLONESHOT,
+  // the user's data, and whether a EPOLLONESHOT watch has fired.
+  // Protected by src's lock.
+  u32 events;
+  u64 data;
+  bool disabled;
+  // Set while the watch is on one of ep's ready lists (or about to be),
+  // so it's only queued once.
+  std::atomic<bool> queued;
+  // The core whose ready list holds it, or -1.  Protected by that
+  // list's lock.
+  int queued_on;
+  ilink<epoll_watch> src_link;
+  ilink<epoll_watch> ready_link;
+  ilink<epoll_watch> fd_link;
+
+  epoll_watch(file_epoll *ep, const sref<poll_source> &src, int fd)
+    : ep(ep), src(src), fd(fd), events(0), data(0), disabled(false),
+      queued(false), queued_on(-1) {}
+  NEW_DELETE_OPS(epoll_watch);
+};
+
+class poll_source : public referenced {
+public:
+  // Returns the owner's current readiness, as EPOLLIN, EPOLLOUT,
+  // EPOLLERR, and EPOLLHUP bits.  This is called with the source's
+  // lock held, so it mustn't sleep.
+  typedef u32 (*poll_fn)(void *arg);
+
+  poll_source(poll_fn fn, void *arg)
+    : lock_("poll_source"), fn_(fn), arg_(arg), nwatch_(0) {}
+  NEW_DELETE_OPS(poll_source);
+
+  // Tell the watchers, if there are any, that events happened.  The
+  // fence orders the owner's state change before the check, against a
+  // new watch that polls right after it's linked on.
+  void notify(u32 events) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (nwatch_.load(std::memory_order_relaxed))
+      notify_watchers(events);
+  }
+
+  bool watched() const {
+    return nwatch_.load(std::memory_order_relaxed) != 0;
+  }
+
+  // The owner is going away.  From now on the source is never ready,
+  // and watches on it stay around (silent) until they're deleted.
+  void detach() {
+    scoped_acquire l(&lock_);
+    arg_ = nullptr;
+  }
+
+private:
+  friend struct file_epoll;
+  void notify_watchers(u32 events);
+
+  spinlock lock_;
+  const poll_fn fn_;
+  void *arg_;                   // Protected by lock_
+  std::atomic<int> nwatch_;
+  ilist<epoll_watch, &epoll_watch::src_link> watchers_;
+};
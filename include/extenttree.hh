@@ -0,0 +1,66 @@
+#pragma once
+
+// A set of free disk-block extents (start, length), kept in an AVL tree
+// ordered by starting block number. Ranges that are inserted are merged with
+// their neighbours, so a mostly-unfragmented disk is described by a handful
+// of nodes no matter how large it is. Every node also records the length of
+// the longest extent in its subtree, which makes a first-fit search for a run
+// of a given length O(log n).
+//
+// Not thread-safe; the caller supplies the locking.
+class extent_tree {
+public:
+  extent_tree() : root_(nullptr), nfree_(0), nextents_(0) {}
+  ~extent_tree();
+  NEW_DELETE_OPS(extent_tree);
+
+  extent_tree(const extent_tree&) = delete;
+  extent_tree& operator=(const extent_tree&) = delete;
+
+  bool empty() const { return !root_; }
+  u64 nfree() const { return nfree_; }
+  u64 nextents() const { return nextents_; }
+
+  // Add the blocks [start, start + len) to the set. Panics if any of them is
+  // already in it.
+  void insert(u32 start, u32 len);
+
+  // Take len blocks from the front of the lowest-addressed extent that has
+  // at least that many, or the whole of the longest extent if none does.
+  // Returns the number of blocks taken (0 if the set is empty) and the first
+  // of them in *start.
+  u32 remove(u32 len, u32 *start);
+
+private:
+  struct extent {
+    u32 start;
+    u32 len;
+    u32 max_len;        // Longest extent in the subtree rooted here
+    int height;
+    extent *left;
+    extent *right;
+
+    extent(u32 s, u32 l)
+      : start(s), len(l), max_len(l), height(1), left(nullptr), right(nullptr) {}
+    NEW_DELETE_OPS(extent);
+  };
+
+  extent *root_;
+  u64 nfree_;
+  u64 nextents_;
+
+  static int height(extent *e) { return e ? e->height : 0; }
+  static u32 max_len(extent *e) { return e ? e->max_len : 0; }
+  static void update(extent *e);
+  static extent *rotate_left(extent *e);
+  static extent *rotate_right(extent *e);
+  static extent *rebalance(extent *e);
+  static extent *insert_node(extent *e, extent *n);
+  static extent *remove_min(extent *e, extent **min);
+  static extent *remove_node(extent *e, u32 start, extent **removed);
+  static void destroy(extent *e);
+
+  extent *predecessor(u32 bno) const;
+  extent *successor(u32 bno) const;
+  extent *first_fit(u32 len) const;
+};
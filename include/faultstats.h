@@ -0,0 +1,47 @@
+#pragma once
+
+// Page fault counts and latencies, by what each fault had to do.  Each
+// core and each process keeps a pagefault_stats.  A read of
+// /dev/faultstats returns a faultstats_info for the reading process,
+// followed by each core's pagefault_stats.  bin/perf -f prints the
+// faults of the command it runs.
+
+#include <stdint.h>
+
+enum {
+  // Allocated a zeroed anonymous page (4K or huge).
+  PF_ZERO,
+  // Copied a COW page on a write.
+  PF_COW,
+  // The vmap already had the page, but this core's page table didn't.
+  PF_PRESENT,
+  // Found a file page in the page cache.
+  PF_FILE_HIT,
+  // Had to read a file page in.  Covers the whole fault, including its
+  // retries.
+  PF_FILE_MISS,
+  // A blocking_io retry: one pass of reading a page in with the vmap
+  // unlocked before trying the fault again.
+  PF_RETRY,
+  PF_NTYPES,
+};
+
+// hist[type][i] counts faults that took [2^(i+PF_HIST_SHIFT),
+// 2^(i+PF_HIST_SHIFT+1)) cycles; the first and last buckets also take
+// everything below and above them.
+#define PF_HIST_SHIFT   10
+#define PF_HIST_BUCKETS 16
+
+struct pagefault_stats {
+  uint64_t count[PF_NTYPES];
+  uint64_t cycles[PF_NTYPES];
+  uint64_t hist[PF_NTYPES][PF_HIST_BUCKETS];
+};
+
+struct faultstats_info {
+  uint64_t ncpus;
+  uint64_t cpuhz;
+  struct pagefault_stats self;      // This process (thread)
+  struct pagefault_stats children;  // Its exited children, and theirs
+  struct pagefault_stats cpu[];     // ncpus entries
+};
@@ -13,9 +13,18 @@
 #include <uk/unistd.h>
 
 class dir_entries;
+class page_info;
+class poll_source;
+
+int stat_mnode(sref<mnode> m, struct stat *st, enum stat_flags flags);
 
 struct file {
   virtual int fsync() { return -1; }
+  virtual int fdatasync() { return -1; }
+  virtual int sync_range(off_t offset, off_t nbytes) { return -1; }
+  virtual int fallocate(off_t offset, off_t len) { return -1; }
+  virtual int clone_from(file *src) { return -1; }
+  virtual int set_compression(bool on) { return -1; }
   // Duplicate this file so it can be bound to a FD.
   virtual file* dup() { inc(); return this; }
 
@@ -29,10 +38,40 @@ struct file {
   virtual ssize_t write(const char *addr, size_t n) { return -1; }
   virtual ssize_t pread(char *addr, size_t n, off_t offset) { return -1; }
   virtual ssize_t pwrite(const char *addr, size_t n, off_t offset) { return -1; }
+  // read and pread straight into user memory.  By default these bounce
+  // through a kernel buffer; files with pages of their own can copy
+  // from them directly.
+  virtual ssize_t read_user(userptr<void> buf, size_t n);
+  virtual ssize_t pread_user(userptr<void> buf, size_t n, off_t offset);
+
+  // For readv, writev, preadv, and pwritev: iov is a copy of the iovcnt
+  // user buffers, which hold n bytes in all.  By default these go one
+  // buffer at a time, stopping at the first short one.
+  virtual ssize_t readv_user(const struct iovec *iov, int iovcnt, size_t n);
+  virtual ssize_t writev_user(const struct iovec *iov, int iovcnt, size_t n);
+  virtual ssize_t preadv_user(const struct iovec *iov, int iovcnt, size_t n,
+                              off_t offset);
+  virtual ssize_t pwritev_user(const struct iovec *iov, int iovcnt, size_t n,
+                               off_t offset);
+  // Write up to n bytes of this file to out, starting at *offset if
+  // offset is non-null (and advancing it), or at the file offset.
+  virtual ssize_t sendfile(file *out, off_t *offset, size_t n) { return -1; }
+  // Write len bytes of page starting at off.  Files that can hold on
+  // to the page (pipes) take a reference instead of copying; by
+  // default this is just write.  more says that the caller will write
+  // again right away, so a socket can hold back a partial segment.
+  virtual ssize_t write_page(const sref<page_info> &page, size_t off,
+                             size_t len, bool more);
 
   // Socket operations
   virtual int bind(const struct sockaddr *addr, size_t addrlen) { return -1; }
   virtual int listen(int backlog) { return -1; }
+  virtual int connect(const struct sockaddr *addr, size_t addrlen)
+  { return -1; }
+  // optval is a kernel copy of the user's optlen bytes.
+  virtual int setsockopt(int level, int optname, const void *optval,
+                         size_t optlen)
+  { return -1; }
   // Unlike the syscall, the return is only an error status.  The
   // caller will allocate an FD for *out on success.  addrlen is only
   // an out-argument.
@@ -51,9 +90,29 @@ struct file {
                            struct sockaddr_storage *src_addr,
                            size_t *addrlen)
   { return -1; }
+  // Batched sendto and recvfrom, for sendmmsg and recvmmsg.  These
+  // move up to n datagrams, the i'th to or from bufs[i], and set
+  // lens[i] (initially the buffer's size) to its length.  They return
+  // how many they moved, or -1 if none.  A sendmmsg batch all goes to
+  // dest_addr.  src_addrs and addrlens are arrays of n, or null.  By
+  // default these call sendto once per datagram and recvfrom once.
+  virtual int sendmmsg(const userptr<void> *bufs, size_t *lens,
+                       unsigned int n, int flags,
+                       const struct sockaddr *dest_addr, size_t addrlen);
+  virtual int recvmmsg(const userptr<void> *bufs, size_t *lens,
+                       unsigned int n, int flags,
+                       struct sockaddr_storage *src_addrs, size_t *addrlens);
 
   virtual sref<mnode> get_mnode() { return sref<mnode>(); }
 
+  // The poll_source that tells epoll when this file is ready for I/O,
+  // or null if it always is, like a regular file.
+  virtual poll_source *get_poll_source() { return nullptr; }
+
+  // For ioring_enter, on an I/O ring (see kernel/ioring.cc).
+  virtual int ioring_enter(unsigned int to_submit, unsigned int min_complete)
+  { return -1; }
+
   virtual void inc() = 0;
   virtual void dec() = 0;
 
@@ -64,7 +123,8 @@ protected:
 struct file_mnode : public refcache::referenced, public file {
 public:
   file_mnode(sref<mnode> m, bool r, bool w, bool a)
-    : m(m), readable(r), writable(w), append(a), off(0) {}
+    : m(m), readable(r), writable(w), append(a), off(0),
+      dir_pos_valid(false) {}
   NEW_DELETE_OPS(file_mnode);
 
   void inc() override { refcache::referenced::inc(); }
@@ -76,13 +136,31 @@ public:
   const bool append;
   u32 off;
   sleeplock off_lock;
+  // getdents() cursor: the last name returned from this directory, if
+  // dir_pos_valid.  Protected by off_lock.
+  fsname dir_pos;
+  bool dir_pos_valid;
 
   int fsync() override;
+  int fdatasync() override;
+  int sync_range(off_t offset, off_t nbytes) override;
+  int fallocate(off_t offset, off_t len) override;
+  int clone_from(file *src) override;
+  int set_compression(bool on) override;
   int stat(struct stat*, enum stat_flags) override;
   ssize_t read(char *addr, size_t n) override;
   ssize_t write(const char *addr, size_t n) override;
   ssize_t pread(char* addr, size_t n, off_t off) override;
   ssize_t pwrite(const char *addr, size_t n, off_t offset) override;
+  ssize_t read_user(userptr<void> buf, size_t n) override;
+  ssize_t pread_user(userptr<void> buf, size_t n, off_t offset) override;
+  ssize_t readv_user(const struct iovec *iov, int iovcnt, size_t n) override;
+  ssize_t writev_user(const struct iovec *iov, int iovcnt, size_t n) override;
+  ssize_t preadv_user(const struct iovec *iov, int iovcnt, size_t n,
+                      off_t offset) override;
+  ssize_t pwritev_user(const struct iovec *iov, int iovcnt, size_t n,
+                       off_t offset) override;
+  ssize_t sendfile(file *out, off_t *offset, size_t n) override;
   void onzero() override
   {
     delete this;
@@ -101,6 +179,9 @@ public:
 
   int stat(struct stat*, enum stat_flags) override;
   ssize_t read(char *addr, size_t n) override;
+  // splice: offset must be null.
+  ssize_t sendfile(file *out, off_t *offset, size_t n) override;
+  poll_source *get_poll_source() override;
   void onzero() override;
 
 private:
@@ -156,6 +237,15 @@ public:
     return inner->write(addr, n);
   }
 
+  ssize_t write_page(const sref<page_info> &page, size_t off,
+                     size_t len, bool more) override {
+    return inner->write_page(page, off, len, more);
+  }
+
+  poll_source *get_poll_source() override {
+    return inner->get_poll_source();
+  }
+
   void pre_close() override {
     // This FD is being closed.  Now we need to know the moment its
     // reference count actually drops to zero so we can immediately
@@ -201,6 +291,9 @@ public:
 
   int stat(struct stat*, enum stat_flags) override;
   ssize_t write(const char *addr, size_t n) override;
+  ssize_t write_page(const sref<page_info> &page, size_t off,
+                     size_t len, bool more) override;
+  poll_source *get_poll_source() override;
   void onzero() override;
 
 private:
@@ -228,7 +321,10 @@ struct inode : public referenced, public rcu_freed
   u32 gen;
   std::atomic<short> type;
   short major;
-  short minor;
+  union {
+    short minor;
+    short flags;        // DI_* flags (T_FILE only)
+  };
 
   std::atomic<bool> valid;
 
@@ -243,10 +339,18 @@ struct inode : public referenced, public rcu_freed
 
   u32 size;
   u32 addrs[NDIRECT+2];
+  bool addrs_dirty; // addrs[] changed since the last iupdate()
+  // Blocks set aside for delayed allocation by inode_reserve_blocks(): the
+  // current run, and how many more blocks remain to be reserved once it is
+  // used up. Protected by ilock() for write.
+  u32 resv_start;
+  u32 resv_len;
+  u32 resv_pending;
   short nlink_;
 
   dir_entries* dir;
   u32 dir_offset; // The next dir-entry gets added at this offset.
+  bool dir_indexed; // Has a dx_node root; dir only caches looked-up names.
 
   // ??? what's the concurrency control plan?
   struct localsock *localsock;
@@ -266,45 +370,52 @@ protected:
   void onzero() override;
 };
 
-typedef struct free_inum {
-  u32 inum_;
-  int cpu;
-  bool is_free;
-  ilink<free_inum> link;
-
-  free_inum(u32 inum, bool f): inum_(inum), is_free(f) {}
-  NEW_DELETE_OPS(free_inum);
-
-  free_inum& operator=(const free_inum&) = delete;
-  free_inum(const free_inum&) = delete;
-
-  free_inum& operator=(free_inum&&) = default;
-  free_inum(free_inum&&) = default;
-} free_inum;
-
 // The freeinum_bitmap in memory, used to perform inode number allocations
 // for on-disk inodes.
 struct freeinum_bitmap {
-  // We maintain the bitmap as both a vector and a linked-list so that we
-  // can perform both allocations and frees in O(1) time. The inum_vector
-  // contains entries for all inums, whereas the inum_freelist contains
-  // entries only for inums that are actually free. The allocator consumes
-  // items from the inum_freelist in O(1) time; the free code locates the
-  // free_inum data-structure corresponding to the inum being freed in O(1)
-  // time using the inum_vector and inserts it into the inum_freelist (also
-  // in O(1) time). Items are never removed from the inum_vector so as to
-  // enable the O(1) lookups.
-  std::vector<free_inum*> inum_vector;
-
+  // One bit per inum, set if the inum is free, so that each word of
+  // free_bits covers exactly one inode block. Every word is owned by one of
+  // the freelists below (word_owner gives its CPU, or NCPU for the reserve
+  // pool), which guards it with its list_lock: that's the freelist its inums
+  // are allocated from first and are returned to when freed.
+  u64 *free_bits;
+  std::atomic<u16> *word_owner;
+  u32 nwords;
+
+  // Each freelist keeps a summary of the words it owns, with one bit per
+  // word of free_bits that is set if that word has free inums, so that an
+  // allocation takes a find-first-set on the summary and one on the word.
+  // Each freelist is filled in from the inode blocks it owns the first
+  // time it is needed, rather than at boot, so that boot doesn't read every
+  // inode block on the disk.
   struct freelist {
-    ilist<free_inum, &free_inum::link> inum_freelist;
-    spinlock list_lock; // Guards modifications to the inum_freelist.
+    u64 *summary;
+    u32 hint;     // No word of summary below this one has a bit set.
+    u64 nfree;
+    spinlock list_lock; // Guards the words this freelist owns, and the above.
+    std::atomic<bool> populated;
+    sleeplock populate_lock;  // Serializes filling in the freelist.
+
+    freelist() : summary(nullptr), hint(0), nfree(0), populated(false) {}
   };
+  u32 nsummary;   // Words in each freelist's summary
 
-  // We maintain per-CPU freelists for scalability. The inum_vector is
-  // read-only after initialization, so a single one will suffice.
+  // We maintain per-CPU freelists for scalability. CPU c initially owns the
+  // inums [cpu_base + c * inums_per_cpu, cpu_base + (c+1) * inums_per_cpu),
+  // and the reserve pool owns the rest.
   percpu<struct freelist> freelists;
   struct freelist reserve_freelist; // Global reserve pool of free inums.
+  u32 ninodes;
+  u32 cpu_base;
+  u32 inums_per_cpu;
+
+  int home_cpu(u32 inum) const
+  {
+    if (inum < cpu_base || !inums_per_cpu ||
+        inum - cpu_base >= (u64)NCPU * inums_per_cpu)
+      return NCPU;
+    return (inum - cpu_base) / inums_per_cpu;
+  }
 };
 
 // device implementations
@@ -5,48 +5,271 @@
 // won't need file.hh
 #include "file.hh"
 
+// A file looked up from a FD for the length of one system call.  This
+// either holds a reference of its own or borrows the one the FD holds
+// (see filetable::getfd()).
+class fdref {
+public:
+  fdref() : f_(nullptr) { }
+  explicit fdref(file *borrowed) : f_(borrowed) { }
+  explicit fdref(sref<file> &&f) : f_(f.get()), ref_(std::move(f)) { }
+
+  explicit operator bool() const { return f_ != nullptr; }
+  file *operator->() const { return f_; }
+  file *get() const { return f_; }
+
+private:
+  file *f_;
+  sref<file> ref_;
+};
+
+// A process's file descriptors.  Threads share a filetable.  fork()
+// gives the child a new filetable, but the two share the descriptors
+// themselves (an fdstore) until one of them modifies its descriptors,
+// at which point that one makes itself a private copy.  Thus fork (and
+// exec, if no close-on-exec FDs are open) doesn't have to copy NOFILE
+// descriptors for each core.
 class filetable : public referenced {
 private:
   static const int cpushift = 16;
   static const int fdmask = (1 << cpushift) - 1;
 
+  class fdinfo
+  {
+    uintptr_t data_;
+
+    constexpr fdinfo(uintptr_t data) : data_(data) { }
+
+  public:
+    fdinfo() = default;
+
+    fdinfo(file* fp, bool cloexec, bool locked = false)
+      : data_((uintptr_t)fp | (uintptr_t)cloexec | ((uintptr_t)locked << 1)) { }
+
+    file* get_file() const
+    {
+      return (file*)(data_ & ~3);
+    }
+
+    bool get_cloexec() const
+    {
+      return data_ & 1;
+    }
+
+    bool get_locked() const
+    {
+      return data_ & 2;
+    }
+
+    fdinfo with_locked(bool locked)
+    {
+      return fdinfo((data_ & ~2) | ((uintptr_t)locked << 1));
+    }
+
+    bool operator==(const fdinfo &o) const
+    {
+      return data_ == o.data_;
+    }
+
+    bool operator!=(const fdinfo &o) const
+    {
+      return data_ != o.data_;
+    }
+  };
+
+  struct fdstore : public rcu_freed
+  {
+    // Filetables using this store.  Only a store with one sharer can be
+    // modified.
+    std::atomic<int> sharers;
+    // Modifications to this store in progress, by sharers that have
+    // found it unshared.  It is only copied once these are done.
+    std::atomic<int> writers;
+    // Open close-on-exec FDs.
+    std::atomic<int> ncloexec;
+
+    percpu<std::atomic<fdinfo>[NOFILE]> info;
+    // In addition to storing O_CLOEXEC with each fdinfo so it can be
+    // read atomically with the FD, we store it separately so we can
+    // scan for keep-exec FDs without reading from info, which would
+    // cause unnecessary sharing between the scan and creating O_CLOEXEC
+    // FDs.  To avoid unnecessary sharing on this array itself, the
+    // *default* state of this array for closed FDs must be 'true', so
+    // we only have to write to it when opening a keep-exec FD.
+    // Modifications to this array are protected by the fdinfo lock.
+    // Lock-free readers should double-check the O_CLOEXEC bit in
+    // fdinfo.
+    percpu<std::atomic<bool>[NOFILE]> cloexec;
+
+    fdstore(bool clear = true)
+      : rcu_freed("filetable::fdstore", this, sizeof(*this)),
+        sharers(1), writers(0), ncloexec(0)
+    {
+      if (!clear)
+        return;
+      fdinfo none(nullptr, false);
+      for(int cpu = 0; cpu < NCPU; cpu++) {
+        for(int fd = 0; fd < NOFILE; fd++) {
+          info[cpu][fd].store(none, std::memory_order_relaxed);
+          cloexec[cpu][fd].store(true, std::memory_order_relaxed);
+        }
+      }
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    // Return a private copy of this store, optionally without its
+    // close-on-exec FDs.
+    fdstore *copy(bool close_cloexec)
+    {
+      fdstore* t = new fdstore(false);
+      int ncloexec = 0;
+
+      fdinfo init(nullptr, false);
+      for(int cpu = 0; cpu < NCPU; cpu++) {
+        for(int fd = 0; fd < NOFILE; fd++) {
+          // XXX Relaxed load?
+          fdinfo fi;
+          // Avoid reading info altogether if we're closing cloexec FDs
+          // and this is a cloexec FD.
+          if (close_cloexec && cloexec[cpu][fd])
+            fi = init;
+          else
+            fi = info[cpu][fd].load();
+          file *f = fi.get_file();
+          if (f && (!close_cloexec || !fi.get_cloexec())) {
+            // XXX f's refcount could have dropped to zero between the
+            // load and here
+            file* newf = f->dup();
+            fdinfo newinfo(newf, fi.get_cloexec());
+
+            t->info[cpu][fd].store(newinfo, std::memory_order_relaxed);
+            t->cloexec[cpu][fd].store(
+              fi.get_cloexec(), std::memory_order_relaxed);
+            if (fi.get_cloexec())
+              ncloexec++;
+          } else {
+            t->info[cpu][fd].store(init, std::memory_order_relaxed);
+            t->cloexec[cpu][fd].store(true, std::memory_order_relaxed);
+          }
+        }
+      }
+      t->ncloexec.store(ncloexec, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      return t;
+    }
+
+    // Drop a sharer's reference.  The last one closes the FDs right
+    // away, but frees the store only once lock-free readers that may
+    // still be looking at it are done.
+    void put()
+    {
+      if (--sharers > 0)
+        return;
+      fdinfo none(nullptr, false);
+      for(int cpu = 0; cpu < NCPU; cpu++){
+        for(int fd = 0; fd < NOFILE; fd++){
+          fdinfo fi = info[cpu][fd].exchange(none);
+          if (fi.get_file()) {
+            fi.get_file()->pre_close();
+            fi.get_file()->dec();
+          }
+        }
+      }
+      gc_delayed(this);
+    }
+
+    void do_gc() override { delete this; }
+    NEW_DELETE_OPS(fdstore);
+  };
+
+  std::atomic<fdstore*> store_;
+  // Serializes copying store_ for fork and replacing it with a private
+  // copy.
+  spinlock cow_lock_;
+  // Set once a thread shares this table.  FDs are then allocated from
+  // the allocating core's range by default, so that threads opening
+  // and closing files don't all contend for the lowest free FD.
+  std::atomic<bool> threaded_;
+
+  // Return this table's store, ready to be modified.  The caller must
+  // be in a GC epoch and must call end_write() when done.
+  fdstore *begin_write()
+  {
+    for (;;) {
+      fdstore *s = store_.load(std::memory_order_acquire);
+      s->writers++;
+      if (s->sharers.load() == 1 && store_.load() == s)
+        return s;
+      s->writers--;
+      unshare(s);
+    }
+  }
+
+  void end_write(fdstore *s)
+  {
+    s->writers--;
+  }
+
+  // Replace store_ with a private copy if it's still s and shared.
+  void unshare(fdstore *s)
+  {
+    scoped_acquire l(&cow_lock_);
+    if (store_.load(std::memory_order_relaxed) != s || s->sharers.load() == 1)
+      return;
+    // s is shared, so nobody can start modifying it, but someone who
+    // had found it unshared may still be.  Wait for them.
+    while (s->writers.load())
+      nop_pause();
+    store_.store(s->copy(false), std::memory_order_release);
+    s->put();
+  }
+
 public:
   static sref<filetable> alloc() {
-    return sref<filetable>::transfer(new filetable());
+    return sref<filetable>::transfer(new filetable(new fdstore()));
   }
 
   sref<filetable> copy(bool close_cloexec = false) {
-    filetable* t = new filetable(false);
-
-    fdinfo init(nullptr, false);
-    for(int cpu = 0; cpu < NCPU; cpu++) {
-      for(int fd = 0; fd < NOFILE; fd++) {
-        // XXX Relaxed load?
-        fdinfo info;
-        // Avoid reading info_ altogether if we're closing cloexec FDs
-        // and this is a cloexec FD.
-        if (close_cloexec && cloexec_[cpu][fd])
-          info = init;
-        else
-          info = info_[cpu][fd].load();
-        file *f = info.get_file();
-        if (f && (!close_cloexec || !info.get_cloexec())) {
-          // XXX f's refcount could have dropped to zero between the
-          // load and here
-          file* newf = f->dup();
-          fdinfo newinfo(newf, info.get_cloexec());
-
-          t->info_[cpu][fd].store(newinfo, std::memory_order_relaxed);
-          t->cloexec_[cpu][fd].store(
-            info.get_cloexec(), std::memory_order_relaxed);
-        } else {
-          t->info_[cpu][fd].store(init, std::memory_order_relaxed);
-          t->cloexec_[cpu][fd].store(true, std::memory_order_relaxed);
-        }
-      }
+    scoped_gc_epoch e;
+    scoped_acquire l(&cow_lock_);
+    fdstore *s = store_.load(std::memory_order_relaxed);
+    if (!close_cloexec || s->ncloexec.load() == 0) {
+      // Share s.  Once we've published the new sharer, nobody else
+      // starts modifying s; wait for anyone who already has.
+      s->sharers++;
+      while (s->writers.load())
+        nop_pause();
+      return sref<filetable>::transfer(new filetable(s));
     }
-    std::atomic_thread_fence(std::memory_order_release);
-    return sref<filetable>::transfer(t);
+    return sref<filetable>::transfer(new filetable(s->copy(true)));
+  }
+
+  // Note that another thread is about to share this table.
+  void set_threaded() {
+    if (!threaded_.load(std::memory_order_relaxed))
+      threaded_.store(true, std::memory_order_relaxed);
+  }
+
+  bool threaded() const {
+    return threaded_.load(std::memory_order_relaxed);
+  }
+
+  // Like getfile(), for the duration of a system call by a thread using
+  // this table.  If nothing but that thread holds the table, nothing
+  // can close fd, replace the store, or modify its entries until the
+  // call returns (a forked child that shares the store copies it before
+  // changing anything), so this borrows the FD's reference instead of
+  // taking one, and needs no GC epoch.  Otherwise it's getfile().
+  fdref getfd(int fd) {
+    if (get_consistent() != 1)
+      return fdref(getfile(fd));
+
+    int cpu = fd >> cpushift;
+    fd = fd & fdmask;
+    if (cpu < 0 || cpu >= NCPU || fd < 0 || fd >= NOFILE)
+      return fdref();
+    fdstore *s = store_.load(std::memory_order_relaxed);
+    return fdref(s->info[cpu][fd].load(std::memory_order_relaxed).get_file());
   }
 
   // Return the file referenced by FD fd.  If fd is not open, returns
@@ -61,9 +284,11 @@ public:
     if (fd < 0 || fd >= NOFILE)
       return sref<file>();
 
+    scoped_gc_epoch e;
+    fdstore *s = store_.load(std::memory_order_acquire);
     // XXX This isn't safe: there could be a concurrent close that
     // drops the reference count to zero.
-    file* f = info_[cpu][fd].load().get_file();
+    file* f = s->info[cpu][fd].load().get_file();
     return sref<file>::newref(f);
   }
 
@@ -76,21 +301,27 @@ public:
     // sref's in the info table.
     file *fptr = f->dup();
     fdinfo newinfo(fptr, cloexec, true);
+    scoped_gc_epoch e;
+    fdstore *s = begin_write();
     for (int fd = 0; fd < NOFILE; fd++) {
       // Note that we skip over locked FDs because that means they're
       // either non-null or about to be.
-      if (info_[cpu][fd].load(std::memory_order_relaxed) == none &&
-          cmpxch(&info_[cpu][fd], none, newinfo)) {
-        // The default state of cloexec_ is 'true', so we only need to
+      if (s->info[cpu][fd].load(std::memory_order_relaxed) == none &&
+          cmpxch(&s->info[cpu][fd], none, newinfo)) {
+        // The default state of cloexec is 'true', so we only need to
         // write to it if this is a keep-exec FD.
         if (!cloexec)
-          cloexec_[cpu][fd] = cloexec;
+          s->cloexec[cpu][fd] = cloexec;
+        else
+          s->ncloexec++;
         // Unlock FD
-        info_[cpu][fd].store(newinfo.with_locked(false),
-                             std::memory_order_release);
+        s->info[cpu][fd].store(newinfo.with_locked(false),
+                               std::memory_order_release);
+        end_write(s);
         return (cpu << cpushift) | fd;
       }
     }
+    end_write(s);
     cprintf("filetable::allocfd: failed\n");
     // The "dup" call told f that we're binding it to a FD.  That
     // ultimately failed, but we have to tell it that we're "closing"
@@ -117,17 +348,23 @@ public:
       return;
     }
 
+    scoped_gc_epoch e;
+    fdstore *s = begin_write();
+
     // Lock the FD to prevent concurrent modifications
-    std::atomic<fdinfo> *infop = &info_[cpu][fd];
+    std::atomic<fdinfo> *infop = &s->info[cpu][fd];
     fdinfo info = lock_fdinfo(infop);
 
-    // Clear cloexec_ back to default state of 'true'
-    if (!cloexec_[cpu][fd])
-      cloexec_[cpu][fd] = true;
+    // Clear cloexec back to default state of 'true'
+    if (!s->cloexec[cpu][fd])
+      s->cloexec[cpu][fd] = true;
+    if (info.get_file() && info.get_cloexec())
+      s->ncloexec--;
 
     // Update and unlock the FD
     fdinfo newinfo(nullptr, false);
     infop->store(newinfo, std::memory_order_release);
+    end_write(s);
 
     // Close old file
     if (info.get_file()) {
@@ -154,18 +391,26 @@ public:
       return false;
     }
 
+    scoped_gc_epoch e;
+    fdstore *s = begin_write();
+
     // Lock the FD to prevent concurrent modifications
-    std::atomic<fdinfo> *infop = &info_[cpu][fd];
+    std::atomic<fdinfo> *infop = &s->info[cpu][fd];
     fdinfo oldinfo = lock_fdinfo(infop);
 
-    // Update to new info and unlock.  It's safe to update cloexec_
+    // Update to new info and unlock.  It's safe to update cloexec
     // non-atomically with info even with concurrent lock-free readers
     // because any that care will double-check the fdinfo bit.
     file *newfptr = newf->dup();
     fdinfo newinfo(newfptr, cloexec);
-    if (cloexec != cloexec_[cpu][fd])
-      cloexec_[cpu][fd] = cloexec;
+    if (cloexec != s->cloexec[cpu][fd])
+      s->cloexec[cpu][fd] = cloexec;
+    if (oldinfo.get_file() && oldinfo.get_cloexec())
+      s->ncloexec--;
+    if (cloexec)
+      s->ncloexec++;
     infop->store(newinfo, std::memory_order_release);
+    end_write(s);
 
     // Close the old FD
     if (oldinfo.get_file() && oldinfo.get_file() != newfptr) {
@@ -176,30 +421,11 @@ public:
   }
 
 private:
-  filetable(bool clear = true) {
-    if (!clear)
-      return;
-    fdinfo none(nullptr, false);
-    for(int cpu = 0; cpu < NCPU; cpu++) {
-      for(int fd = 0; fd < NOFILE; fd++) {
-        info_[cpu][fd].store(none, std::memory_order_relaxed);
-        cloexec_[cpu][fd].store(true, std::memory_order_relaxed);
-      }
-    }
-    std::atomic_thread_fence(std::memory_order_release);
-  }
+  filetable(fdstore *s)
+    : store_(s), cow_lock_("filetable::cow_lock"), threaded_(false) { }
 
   ~filetable() {
-    // Close all FDs
-    for(int cpu = 0; cpu < NCPU; cpu++){
-      for(int fd = 0; fd < NOFILE; fd++){
-        fdinfo info = info_[cpu][fd].load();
-        if (info.get_file()) {
-          info.get_file()->pre_close();
-          info.get_file()->dec();
-        }
-      }
-    }
+    store_.load()->put();
   }
 
   filetable& operator=(const filetable&) = delete;
@@ -208,52 +434,9 @@ private:
   filetable(filetable &&) = delete;
   NEW_DELETE_OPS(filetable);  
 
-  class fdinfo
-  {
-    uintptr_t data_;
-
-    constexpr fdinfo(uintptr_t data) : data_(data) { }
-
-  public:
-    fdinfo() = default;
-
-    fdinfo(file* fp, bool cloexec, bool locked = false)
-      : data_((uintptr_t)fp | (uintptr_t)cloexec | ((uintptr_t)locked << 1)) { }
-
-    file* get_file() const
-    {
-      return (file*)(data_ & ~3);
-    }
-
-    bool get_cloexec() const
-    {
-      return data_ & 1;
-    }
-
-    bool get_locked() const
-    {
-      return data_ & 2;
-    }
-
-    fdinfo with_locked(bool locked)
-    {
-      return fdinfo((data_ & ~2) | ((uintptr_t)locked << 1));
-    }
-
-    bool operator==(const fdinfo &o) const
-    {
-      return data_ == o.data_;
-    }
-
-    bool operator!=(const fdinfo &o) const
-    {
-      return data_ != o.data_;
-    }
-  };
-
   fdinfo lock_fdinfo(std::atomic<fdinfo> *infop)
   {
-    fdinfo info, newinfo;
+    fdinfo info;
     while (true) {
       info = infop->load(std::memory_order_relaxed);
     retry:
@@ -266,17 +449,4 @@ private:
       goto retry;
     return info;
   }
-
-  percpu<std::atomic<fdinfo>[NOFILE]> info_;
-  // In addition to storing O_CLOEXEC with each fdinfo so it can be
-  // read atomically with the FD, we store it separately so we can
-  // scan for keep-exec FDs without reading from info_, which would
-  // cause unnecessary sharing between the scan and creating O_CLOEXEC
-  // FDs.  To avoid unnecessary sharing on this array itself, the
-  // *default* state of this array for closed FDs must be 'true', so
-  // we only have to write to it when opening a keep-exec FD.
-  // Modifications to this array are protected by the fdinfo lock.
-  // Lock-free readers should double-check the O_CLOEXEC bit in
-  // fdinfo.
-  percpu<std::atomic<bool>[NOFILE]> cloexec_;
 };
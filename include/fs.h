@@ -21,6 +21,20 @@
 #endif
 
 
+// The allocation summary in the superblock splits the inode blocks and the
+// bitmap blocks into SB_NGROUPS groups each, and records how many inodes and
+// blocks each group has free. mkfs writes it, and so does the kernel when it
+// halts; the kernel invalidates it at mount (see kernel/fs.cc), so that it is
+// only ever trusted after a clean shutdown. Groups that are entirely free or
+// entirely in use then don't have to be read at mount.
+#define SB_NGROUPS 128
+
+// Inodes that have been unlinked while still open are recorded in the
+// superblock's orphan list, so that a crash before they are closed doesn't
+// leak them: the next mount frees the inodes on the list. Updates to the
+// list are journaled along with the unlink and the final delete.
+#define SB_NORPHANS 64
+
 // File system super block
 // assert(sizeof(superblock) <= BSIZE)
 
@@ -32,15 +46,36 @@ struct superblock {
     u32 start_blknum;
     u32 end_blknum; // Inclusive
   } journal_blknums[NCPU];
+  u32 features;     // SB_FEATURE_* flags
+  struct disk_layout {
+    u32 stripe_blks;  // Blocks per disk in each stripe; 0 for the default
+    u32 journal_dev;  // Disk holding the journals with SB_FEATURE_JOURNAL_DEV
+  } layout;
+  struct alloc_summary {
+    u32 clean;               // The counts match the inodes and bitmap on disk
+    u32 ifree[SB_NGROUPS];   // Free inodes in each inode group
+    u32 bfree[SB_NGROUPS];   // Free blocks in each bitmap group
+  } summary;
+  u32 orphans[SB_NORPHANS]; // Unlinked but still open inodes; 0 if unused
 };
 
+// Superblock feature flags
+#define SB_FEATURE_EXTENTS 0x1 // Inodes map their blocks with extents
+#define SB_FEATURE_JOURNAL_DEV 0x2 // Journals live on layout.journal_dev
+#define SB_FEATURE_REFCOUNTS 0x4 // Block refcounts follow the bitmap
+#define SB_FEATURE_INLINE_DATA 0x8 // Small files may keep data in the inode
+
 
 #define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(u32))
 #define MAXFILE (NDIRECT + NINDIRECT + NINDIRECT*NINDIRECT)
 
-// Size of the physical journal file - /sv6journal
+// Default size of each per-core physical journal file - /sv6journalN. mkfs can
+// be asked for a different size (mkfs -j <blocks>, or JOURNAL_BLOCKS=<blocks>
+// when building), and the kernel sizes every journal from its file at boot.
+// Journal offsets are 32-bit, which caps the size of a journal.
 #define PHYS_JOURNAL_SIZE ((NDIRECT + NINDIRECT) * BSIZE)
+#define MAX_PHYS_JOURNAL_SIZE (0x80000000UL)
 
 // Considerations in determining the value of PHYS_JOURNAL_SIZE:
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -74,7 +109,8 @@ struct superblock {
 // 4112 + 1027 * (16 + 4096) + 4112 = 4231248 bytes (~ 1034 blocks)
 //
 // So if you are about to surpass transactions of this size, remember to enlarge
-// the physical journal!
+// the physical journal! Larger journals also let more transactions be merged
+// into a single group commit.
 
 
 // On-disk inode structure
@@ -82,13 +118,56 @@ struct superblock {
 struct dinode {
   short type;           // File type
   short major;          // Major device number (T_DEV only)
-  short minor;          // Minor device number (T_DEV only)
+  union {
+    short minor;        // Minor device number (T_DEV only)
+    short flags;        // DI_* flags (T_FILE only)
+  };
   short nlink;          // Number of links to inode in file system
   u32 size;             // Size of file (bytes)
   u32 gen;              // Generation # (to check name cache)
   u32 addrs[NDIRECT+2]; // Data block addresses
 };
 
+// An extent-mapped inode (SB_FEATURE_EXTENTS) describes its contents as a
+// list of extents, sorted by file block, instead of one address per block.
+// Its addrs[] holds the first NINLINE_EXTENTS extents, followed by the address
+// of an extent block holding the next NEXTENTS_PER_BLOCK, the address of an
+// index block listing further extent blocks, and the number of extents.
+//
+// An unwritten extent holds blocks preallocated by fallocate() that haven't
+// been written yet. They read as zeroes, and turn into an ordinary extent as
+// they are written, so the data needs no further block allocation.
+struct dextent {
+  u32 lblk;             // First file block
+  u32 pblk;             // First disk block
+  u32 len : 31;         // Number of blocks
+  u32 unwritten : 1;    // Preallocated and not yet written
+};
+
+#define NINLINE_EXTENTS 3
+#define NEXTENTS_PER_BLOCK ((u32)(BSIZE / sizeof(struct dextent)))
+#define EXTENT_BLOCK (NINLINE_EXTENTS * 3) // addrs[] index of the extent block
+#define EXTENT_INDEX (EXTENT_BLOCK + 1)    // addrs[] index of the index block
+#define EXTENT_COUNT (EXTENT_BLOCK + 2)    // addrs[] index of the extent count
+#define MAXEXTENTS \
+  (NINLINE_EXTENTS + NEXTENTS_PER_BLOCK + NINDIRECT * NEXTENTS_PER_BLOCK)
+
+#define DI_COMPRESSED 0x1   // Data stored in compressed chunks
+#define DI_INLINE     0x2   // Data stored in addrs[] itself
+
+// With SB_FEATURE_INLINE_DATA, a file of at most INLINE_MAX bytes that has no
+// blocks can keep its data in its addrs[] (DI_INLINE), zero-padded, so that
+// it takes no block, bitmap update, or data write of its own.
+#define INLINE_MAX    ((u32)sizeof(((struct dinode *)0)->addrs))
+
+// A compressed file (extent-mapped file systems only) stores each run of
+// ZCHUNK_PAGES blocks of its data as a zlib stream, in the first blocks of
+// ZCHUNK_BLKS file blocks of its own; the rest of them are holes. A chunk
+// with no blocks reads as zeroes.
+#define ZCHUNK_PAGES  15
+#define ZCHUNK_BLKS   16
+#define ZCHUNK_BYTES  (ZCHUNK_PAGES * BSIZE)
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -98,9 +177,23 @@ struct dinode {
 // Bitmap bits per block
 #define BPB           (BSIZE*8)
 
+// Inode blocks, and bitmap blocks, in each group of the allocation summary
+#define SB_IGROUP_BLKS(ninodes) \
+  (((ninodes) / IPB + SB_NGROUPS) / SB_NGROUPS)
+#define SB_BGROUP_BLKS(size) \
+  (((size) / BPB + SB_NGROUPS) / SB_NGROUPS)
+
 // Block containing bit for block b
 #define BBLOCK(b, ninodes) ((b)/BPB + (ninodes)/IPB + 3)
 
+// With SB_FEATURE_REFCOUNTS, data blocks can be shared between files (see
+// iclone() in kernel/fs.cc). The bitmap blocks are then followed by one byte
+// per block, counting the references to the block beyond the first.
+#define RPB           BSIZE
+
+// Block containing the refcount of block b
+#define RBLOCK(b, ninodes, size) ((b)/RPB + BBLOCK((size) - 1, ninodes) + 1)
+
 // Number of inodes to create in the filesystem. Consumed by tools/mkfs.c
 // as well as kernel/scalefs.cc (to decide the size of the inum<->mnode
 // lookup tables). If you change this number, remember to update NINODES_PRIME
@@ -126,14 +219,50 @@ struct dinode {
 #define NINODEBITMAP_BLKS_PRIME	30011
 #endif
 
-// Directory is a file containing a sequence of dirent structures.
-#define DIRSIZ 14
+// Longest file name.
+#define DIRSIZ 255
 
+// Directory is a file containing a sequence of variable-length dirent
+// records.  reclen is the size of the whole record, rounded up to 8
+// bytes, and a record never crosses a block boundary.  Records with a
+// zero inum are unused.  The name is not NUL-terminated.
 struct dirent {
-  u16 inum;
-  char name[DIRSIZ];
+  u32 inum;
+  u16 reclen;
+  u8 namelen;
+  u8 pad;
+  char name[];
+};
+
+#define DIRENT_RECLEN(namelen) \
+  ((sizeof(struct dirent) + (namelen) + 7) & ~7UL)
+
+// Directories of more than one block may be indexed by a hash of the
+// names.  Block 0 of an indexed directory is then a dx_node root, which
+// starts with an unused dirent covering the whole block so that code
+// reading the directory linearly skips it.  Entries point to leaf blocks
+// of ordinary dirent records or, if the root's levels is 1, to more
+// dx_nodes; each covers the hashes from its own up to the next entry's.
+#define DX_MAGIC 0x78646978
+
+struct dx_entry {
+  u32 hash;
+  u32 block;
 };
 
+struct dx_node {
+  u32 fake_inum;                // 0
+  u16 fake_reclen;              // BSIZE
+  u8 fake_namelen;
+  u8 fake_pad;
+  u32 magic;                    // DX_MAGIC in the root
+  u16 levels;                   // root only
+  u16 count;
+  struct dx_entry entries[];
+};
+
+#define DX_ENTRIES ((BSIZE - sizeof(struct dx_node)) / sizeof(struct dx_entry))
+
 // XXX(Austin) PATH_MAX sucks.  It would be nice if we didn't need it
 // to size kernel copy buffers.
 #define PATH_MAX 256
@@ -0,0 +1,58 @@
+#pragma once
+
+// Always-on ScaleFS journal counters, per core, read as text through
+// /dev/fsstats.  Commit and apply counters are kept on the core that
+// did the work, which isn't necessarily the journal's core.  Like
+// kstats, they're only approximately per core.
+
+#include "percpu.hh"
+
+#define FSSTATS_ALL(X)                                                  \
+  X(txns_enqueued)              /* Added to a commit queue */           \
+  X(txns_merged)                /* Committed along with an earlier one */ \
+  X(commits)                    /* Group commits written to a journal */ \
+  X(commit_blocks)              /* Blocks logged by those commits */    \
+  X(journal_bytes)              /* Written to the journal, incl. headers */ \
+  X(home_bytes)                 /* Written back to home locations */    \
+  X(absorbed_ops)               /* Dropped before reaching the disk */  \
+  X(journal_full)               /* Waits for the checkpointer to apply */ \
+  X(merge_full)                 /* Group commits cut short by space */  \
+  X(commit_dep_waits)           /* Waits on another journal's commit */ \
+  X(apply_dep_waits)            /* Applies of another journal first */  \
+  X(fsyncs)                                                             \
+  X(fsync_ns)                   /* Total time spent in fsync */         \
+
+// fsync latencies, in power-of-two buckets of microseconds: bucket i
+// counts the ones that took [2^(i-1), 2^i) us, and the last bucket
+// everything slower.
+#define FSSTATS_FSYNC_BUCKETS 24
+
+struct fsstats
+{
+#define X(name) u64 name;
+  FSSTATS_ALL(X)
+#undef X
+  u64 fsync_hist[FSSTATS_FSYNC_BUCKETS];
+};
+
+DECLARE_PERCPU(struct fsstats, myfsstats, NO_CRITICAL);
+
+static inline void
+fsstat_inc(u64 fsstats::* field, u64 delta = 1)
+{
+  (*myfsstats).*field += delta;
+}
+
+static inline void
+fsstat_fsync(u64 ns)
+{
+  u64 us = ns / 1000;
+  int b = 0;
+  while (us && b < FSSTATS_FSYNC_BUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+  myfsstats->fsyncs++;
+  myfsstats->fsync_ns += ns;
+  myfsstats->fsync_hist[b]++;
+}
@@ -1,2 +1,33 @@
 #define FUTEX_WAIT 0
 #define FUTEX_WAKE 1
+// Wake val waiters on addr and move up to val2 of the rest to addr2,
+// without waking them.  CMP_REQUEUE first checks that *addr == val3.
+#define FUTEX_REQUEUE     2
+#define FUTEX_CMP_REQUEUE 3
+// Atomically apply the operation encoded in val3 to *addr2, wake val
+// waiters on addr and, if the old *addr2 passes val3's comparison, val2
+// waiters on addr2.
+#define FUTEX_WAKE_OP     4
+
+// FUTEX_WAKE_OP operations: *addr2 = old <op> oparg, or 1 << oparg if
+// FUTEX_OP_OPARG_SHIFT is set.
+#define FUTEX_OP_SET  0
+#define FUTEX_OP_ADD  1
+#define FUTEX_OP_OR   2
+#define FUTEX_OP_ANDN 3
+#define FUTEX_OP_XOR  4
+#define FUTEX_OP_OPARG_SHIFT 8
+
+// FUTEX_WAKE_OP comparisons: old <cmp> cmparg.
+#define FUTEX_OP_CMP_EQ 0
+#define FUTEX_OP_CMP_NE 1
+#define FUTEX_OP_CMP_LT 2
+#define FUTEX_OP_CMP_LE 3
+#define FUTEX_OP_CMP_GT 4
+#define FUTEX_OP_CMP_GE 5
+
+// Like Linux's, but with 28-bit oparg and cmparg, since futexes are 64
+// bits.
+#define FUTEX_OP(op, oparg, cmp, cmparg)                        \
+  (((u64)(op) & 0xf) << 60 | ((u64)(cmp) & 0xf) << 56 |         \
+   ((u64)(oparg) & 0xfffffff) << 28 | ((u64)(cmparg) & 0xfffffff))
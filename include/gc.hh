@@ -24,10 +24,13 @@ class rcu_freed {
 #if RCU_TYPE_DEBUG
   const char *_rcu_type;
 #endif
+  u64 _rcu_size;                // for the delayed-free byte counts
 
   rcu_freed(const char *debug_type, void* objbase, uint64_t objsize)
 #if RCU_TYPE_DEBUG
-    : _rcu_next(nullptr), _rcu_type(debug_type)
+    : _rcu_next(nullptr), _rcu_type(debug_type), _rcu_size(objsize)
+#else
+    : _rcu_size(objsize)
 #endif
   {
     mtgcregister(objbase, objsize, debug_type);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "cpputil.hh"
+#include "cpuid.hh"
 #include "fs.h"
 
 template<class T>
@@ -22,15 +23,43 @@ hash(const u32& v)
   return hash((u64)v);
 }
 
+// Folds the word w into the name hash h, with the crc32 instruction if the
+// CPU has it.  The kernel is built without SSE, but crc32 only touches
+// general-purpose registers, so it is used through asm.
+static inline u64
+hash_name_word(u64 h, u64 w, bool crc)
+{
+  if (crc) {
+    __asm__("crc32q %1, %0" : "+r" (h) : "rm" (w));
+    return h;
+  }
+  h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+  return h ^ (h >> 29);
+}
+
 template<>
 inline u64
-hash(const strbuf<DIRSIZ>& v)
+hash(const fsname& v)
 {
-  u64 h = 0;
-  for (int i = 0; i < DIRSIZ && v.buf_[i]; i++) {
-    u64 c = v.buf_[i];
-    // Lifted from dcache.h in Linux v3.3
-    h = (h + (c << 4) + (c >> 4)) * 11;
+  bool crc = cpuid::features().sse4_2;
+  u64 h = v.size();
+  if (const u64 *w = v.words()) {
+    for (size_t i = 0; i < fsname::inline_words; i++)
+      h = hash_name_word(h, w[i], crc);
+    return h;
+  }
+
+  const char *s = v.c_str();
+  size_t i = 0;
+  for (; i + sizeof(u64) <= v.size(); i += sizeof(u64)) {
+    u64 w;
+    memcpy(&w, s + i, sizeof(w));
+    h = hash_name_word(h, w, crc);
+  }
+  if (i < v.size()) {
+    u64 w = 0;
+    memcpy(&w, s + i, v.size() - i);
+    h = hash_name_word(h, w, crc);
   }
   return h;
 }
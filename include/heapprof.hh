@@ -5,7 +5,10 @@
 enum heap_profile_arena {
   HEAP_PROFILE_KALLOC,
   HEAP_PROFILE_KMALLOC,
-  HEAP_PROFILE_NEWARRAY
+  HEAP_PROFILE_NEWARRAY,
+  // Only sampled (see heap_sample_alloc()).
+  HEAP_PROFILE_KMCACHE,
+  HEAP_PROFILE_NARENAS
 };
 
 class print_stream;
@@ -21,3 +24,26 @@ heap_profile_update(heap_profile_arena arena, const void *rip, ssize_t bytes)
 }
 #endif
 void heap_profile_print(print_stream *s);
+
+// The sampling heap profiler.  Unlike KERNEL_HEAP_PROFILE, this is cheap
+// enough to leave on: allocations are sampled as a Poisson process with
+// one sample per KERNEL_HEAP_SAMPLE bytes on average, and each sample
+// stands for that many bytes at its call site.  /dev/heapprof reports
+// the estimated live and peak bytes and the allocation rate of each
+// site.
+#if KERNEL_HEAP_SAMPLE
+void heap_sample_alloc(heap_profile_arena arena, const void *rip, void *p,
+                       size_t bytes);
+void heap_sample_free(heap_profile_arena arena, void *p);
+#else
+static inline void
+heap_sample_alloc(heap_profile_arena arena, const void *rip, void *p,
+                  size_t bytes)
+{
+}
+
+static inline void
+heap_sample_free(heap_profile_arena arena, void *p)
+{
+}
+#endif
@@ -103,6 +103,8 @@ namespace mmu_shared_page_table {
     struct pgmap * const pml4;
 
     void __insert(uintptr_t va, pme_t pte);
+    bool __insert_huge(uintptr_t va, pme_t pte);
+    void __insert_batch(uintptr_t va, const pme_t *ptes, size_t n);
     void __invalidate(uintptr_t start, uintptr_t len, shootdown *sd);
 
   public:
@@ -125,6 +127,30 @@ namespace mmu_shared_page_table {
       __insert(va, pte);
     }
 
+    // Like insert, but load a huge page mapping for the HUGE_PGSIZE
+    // aligned va.  @c tracker_it must be a forward iterator over the
+    // page trackers of the huge page's pages, as for invalidate.
+    // Returns false, having done nothing, if this part of the cache
+    // already holds 4K mappings, in which case the caller should fall
+    // back to them.  Invalidating any part of a huge mapping drops
+    // all of it.
+    template<class ForwardIterator>
+    bool insert_huge(uintptr_t va, ForwardIterator tracker_it, pme_t pte)
+    {
+      return __insert_huge(va, pte);
+    }
+
+    // Like insert, for the n pages from va, which must all lie in the
+    // same page table, in one page table walk.  ptes[i] is the PTE
+    // for page i, or 0 to leave it alone.  @c tracker_it is a forward
+    // iterator over the pages' trackers, as for invalidate.
+    template<class ForwardIterator>
+    void insert_batch(uintptr_t va, ForwardIterator tracker_it,
+                      const pme_t *ptes, size_t n)
+    {
+      __insert_batch(va, ptes, n);
+    }
+
     // Invalidate all mappings from virtual address @c va to
     // <tt>start+len</tt>.  This should be called whenever a page
     // mapping's permissions become more strict or the mapped page
@@ -142,6 +168,18 @@ namespace mmu_shared_page_table {
       __invalidate(start, len, sd);
     }
 
+    // These page tables are shared by all cores, so there's no
+    // deferring their invalidation: defer performs sd right away.
+    // See mmu_per_core_page_table::page_map_cache::defer.
+    u64 defer(const shootdown &sd)
+    {
+      sd.perform();
+      return 0;
+    }
+    u64 lazy_horizon() const { return ~0ull; }
+    bool lazy_overlaps(uintptr_t start, uintptr_t end) const { return false; }
+    void flush_lazy() { }
+
     // Switch to this page_map_cache on this CPU.
     void switch_to() const;
 
@@ -203,15 +241,39 @@ namespace mmu_per_core_page_table {
     percpu<struct pgmap*> pml4;
     friend class shootdown;
 
+    // Names this cache in each core's table of PCID owners.  Never
+    // reused.
+    const u64 id_;
+
+    // The clears that defer() left for each core to do, as one range
+    // covering all of them.  first_gen is the generation of the
+    // earliest.  Protected by lazy_lock_, except that each core checks
+    // its own pending flag without it.
+    struct lazy_clear
+    {
+      std::atomic<bool> pending;
+      uintptr_t start, end;
+      u64 first_gen;
+    };
+    percpu<lazy_clear> lazy_;
+    mutable spinlock lazy_lock_;
+    u64 lazy_gen_;
+
     // Clear and TLB flush a region of this core's page table.
-    void clear(uintptr_t start, uintptr_t end);
+    void clear(uintptr_t start, uintptr_t end) const;
+
+    // Do this core's deferred clear, if it has one.
+    void do_lazy() const;
+
+    // The PCID this core has tagged this cache's TLB entries with, or
+    // 0 if it has none.
+    u64 pcid() const;
+
+    bool __insert_huge(uintptr_t va, pme_t pte);
+    void __insert_batch(uintptr_t va, const pme_t *ptes, size_t n);
 
   public:
-    page_map_cache()
-    {
-      for (size_t i = 0; i < NCPU; ++i)
-        pml4[i] = nullptr;
-    }
+    page_map_cache();
     page_map_cache(const page_map_cache&) = delete;
     page_map_cache(page_map_cache&&) = delete;
     page_map_cache &operator=(const page_map_cache&) = delete;
@@ -220,6 +282,31 @@ namespace mmu_per_core_page_table {
 
     void insert(uintptr_t va, page_tracker *t, pme_t pte);
 
+    template<class ForwardIterator>
+    bool insert_huge(uintptr_t va, ForwardIterator tracker_it, pme_t pte)
+    {
+      scoped_cli cli;
+      if (!__insert_huge(va, pte))
+        return false;
+      // Any of the huge page's pages may later be invalidated on its
+      // own, so they all need to know we have it.
+      auto end = tracker_it + HUGE_PGSIZE / PGSIZE;
+      for (; tracker_it < end; tracker_it += tracker_it.span())
+        tracker_it->tracker_cores.set(myid());
+      return true;
+    }
+
+    template<class ForwardIterator>
+    void insert_batch(uintptr_t va, ForwardIterator tracker_it,
+                      const pme_t *ptes, size_t n)
+    {
+      scoped_cli cli;
+      __insert_batch(va, ptes, n);
+      for (size_t i = 0; i < n; ++i, ++tracker_it)
+        if (ptes[i])
+          tracker_it->tracker_cores.set(myid());
+    }
+
     template<class ForwardIterator>
     void invalidate(uintptr_t start, uintptr_t len,
                     ForwardIterator tracker_it, shootdown *sd)
@@ -260,8 +347,29 @@ namespace mmu_per_core_page_table {
       }
     }
 
+    // Rather than clearing the target cores' page tables now, leave
+    // sd's clears for each of them to do at its next switch to or
+    // from this page_map_cache (or flush_lazy).  Until then, they may
+    // still reach the pages that were mapped there, so the caller
+    // must hold on to those pages until lazy_horizon() passes the
+    // returned generation, and must not map the range again until
+    // lazy_overlaps() says it's clear.  Returns 0 if sd had no
+    // targets.
+    u64 defer(const shootdown &sd);
+
+    // Every clear deferred with a generation below this is done.
+    u64 lazy_horizon() const;
+
+    // Whether a deferred clear that isn't done yet may cover part of
+    // [start, end).
+    bool lazy_overlaps(uintptr_t start, uintptr_t end) const;
+
+    // Make the cores that have deferred clears do them now, by IPI.
+    // The caller must not hold any spinlocks.
+    void flush_lazy();
+
     void switch_to() const;
-    void switch_from() const {}
+    void switch_from() const { do_lazy(); }
 
     u64 internal_pages() const;
   };
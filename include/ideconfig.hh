@@ -15,3 +15,6 @@
 #ifndef AHCIIDE
 #define AHCIIDE 0
 #endif
+#ifndef NVMEIDE
+#define NVMEIDE 0
+#endif
@@ -2,6 +2,7 @@
 
 // Device register bits
 #define IDE_DEV_LBA     0x40
+#define IDE_DEV_FUA     0x80    // Force Unit Access, in FPDMA commands
 
 // Device control register (write to control block register) bits
 #define IDE_CTL_LBA48   0x80
@@ -36,6 +37,7 @@
 #define IDE_CMD_WRITE_DMA             0xca
 #define IDE_CMD_WRITE_DMA_EXT         0x35
 #define IDE_CMD_WRITE_FPDMA_QUEUED    0x61
+#define IDE_CMD_WRITE_DMA_FUA_EXT     0x3d
 #define IDE_CMD_FLUSH_CACHE           0xe7
 #define IDE_CMD_FLUSH_CACHE_EXT       0xea
 #define IDE_CMD_IDENTIFY              0xec
@@ -64,7 +66,9 @@ struct identify_device {
   u16 pad3[13];           // Words 62-74
   u16 queue_depth;        // Word 75
   u16 sata_caps;          // Word 76
-  u16 pad4[9];            // Words 77-85
+  u16 pad4[7];            // Words 77-83
+  u16 features84;         // Word 84
+  u16 features85;         // Word 85
   u16 features86;         // Word 86
   u16 features87;         // Word 87
   u16 udma_mode;          // Word 88
@@ -77,6 +81,8 @@ struct identify_device {
 #define IDE_SATA_NCQ_SUPPORTED          (1 << 8)
 #define IDE_SATA_NCQ_QUEUE_DEPTH        0x1f
 
+#define IDE_FEATURE84_VALID     0x4000  // Bits 15:14 of word 84 are 01b
+#define IDE_FEATURE84_FUA       (1 << 6)  // WRITE DMA FUA EXT and FPDMA FUA
 #define IDE_FEATURE86_LBA48     (1 << 10)
 #define IDE_HWRESET_CBLID       0x2000
 
@@ -0,0 +1,87 @@
+#pragma once
+
+// Registers of the Intel 82576 (igb) that differ from, or aren't in,
+// the older e1000 parts (see e1000reg.hh, which covers the rest).
+// [82576 8.x] refers to the 82576 datasheet.
+
+#include "e1000reg.hh"
+
+// Per-queue receive registers [82576 8.10].  The first four queues
+// are at their e1000 addresses.
+#define IGB_RXQ(q, r)   ((q) < 4 ? 0x2800 + (q) * 0x100 + (r) : \
+                         0xc000 + (q) * 0x40 + (r))
+#define IGB_RDBAL(q)    IGB_RXQ(q, 0x00)
+#define IGB_RDBAH(q)    IGB_RXQ(q, 0x04)
+#define IGB_RDLEN(q)    IGB_RXQ(q, 0x08)
+#define IGB_SRRCTL(q)   IGB_RXQ(q, 0x0c)
+#define IGB_RDH(q)      IGB_RXQ(q, 0x10)
+#define IGB_RDT(q)      IGB_RXQ(q, 0x18)
+#define IGB_RXDCTL(q)   IGB_RXQ(q, 0x28)
+
+#define SRRCTL_BSIZEPKT(kb)     (kb)            // Buffer size, in KB
+#define SRRCTL_DESCTYPE_ADV_ONEBUF (1U << 25)   // Advanced, one buffer
+#define RXDCTL_WTHRESH(x)       ((x) << 16)     // Write-back threshold
+#define RXDCTL_ENABLE           (1U << 25)
+
+// Per-queue transmit registers [82576 8.12].
+#define IGB_TXQ(q, r)   ((q) < 4 ? 0x3800 + (q) * 0x100 + (r) : \
+                         0xe000 + (q) * 0x40 + (r))
+#define IGB_TDBAL(q)    IGB_TXQ(q, 0x00)
+#define IGB_TDBAH(q)    IGB_TXQ(q, 0x04)
+#define IGB_TDLEN(q)    IGB_TXQ(q, 0x08)
+#define IGB_TDH(q)      IGB_TXQ(q, 0x10)
+#define IGB_TDT(q)      IGB_TXQ(q, 0x18)
+#define IGB_TXDCTL(q)   IGB_TXQ(q, 0x28)
+
+#define TXDCTL_ENABLE           (1U << 25)
+
+// Extended interrupts, one cause bit per MSI-X vector [82576 8.8].
+#define IGB_EICS        0x1520          // Cause set
+#define IGB_EIMS        0x1524          // Mask set
+#define IGB_EIMC        0x1528          // Mask clear
+#define IGB_EIAC        0x152c          // Auto-clear
+#define IGB_EIAM        0x1530          // Auto-mask
+#define IGB_EICR        0x1580          // Cause read
+
+#define IGB_GPIE        0x1514          // General purpose interrupt enable
+#define GPIE_NSICR      (1U << 0)       // Non-selective ICR clear on read
+#define GPIE_MSIX_MODE  (1U << 4)
+#define GPIE_EIAME      (1U << 30)      // Use EIAM
+#define GPIE_PBA        (1U << 31)      // PBA support
+
+// Interrupt vector allocation [82576 8.8.15].  IVAR(q & 7) holds the
+// vectors of RX queue q in byte 0 (byte 2 if q >= 8) and of TX queue q
+// in byte 1 (byte 3 if q >= 8).
+#define IGB_IVAR(n)     (0x1700 + (n) * 4)
+#define IVAR_RX_SHIFT(q) (((q) & 8) << 1)
+#define IVAR_TX_SHIFT(q) ((((q) & 8) << 1) + 8)
+#define IVAR_VALID      0x80
+
+// Receive side scaling [82576 7.1.2.8].
+#define IGB_MRQC        0x5818          // Multiple receive queues command
+#define MRQC_ENABLE_RSS (2U << 0)
+#define MRQC_RSS_IPV4_TCP (1U << 16)
+#define MRQC_RSS_IPV4   (1U << 17)
+#define MRQC_RSS_IPV6   (1U << 20)
+#define MRQC_RSS_IPV6_TCP (1U << 21)
+#define MRQC_RSS_IPV4_UDP (1U << 22)
+#define MRQC_RSS_IPV6_UDP (1U << 23)
+#define IGB_RETA(n)     (0x5c00 + (n) * 4) // Redirection table, 4 per reg
+#define IGB_RETA_SIZE   128
+#define IGB_RSSRK(n)    (0x5c80 + (n) * 4) // Hash key, 4 bytes per reg
+#define IGB_RSSRK_SIZE  40
+
+#define RXCSUM_PCSD     (1U << 13)      // Report RSS hash, not checksum
+
+// The advanced receive descriptor [82576 7.1.5].  The driver fills in
+// the read format; the device writes back over it, putting the RSS
+// hash in addr and the status and length in hdr_addr.
+struct igb_rxdesc {
+  u64 addr;                     // Packet buffer
+  u64 hdr_addr;                 // Header buffer (unused)
+} __attribute__((__packed__));
+
+#define IGB_RXD_STATUS(hdr)     ((u32)(hdr))
+#define IGB_RXD_LENGTH(hdr)     ((u16)((hdr) >> 32))
+#define IGB_RXD_STAT_DD         (1U << 0)
+#define IGB_RXD_STAT_EOP        (1U << 1)
@@ -15,6 +15,9 @@ public:
   // should be used to form the appropriate IOAPIC entry or MSI
   // message.
   virtual int allocate_int(struct irq irq, struct cpu *dest) = 0;
+
+  // Redirect the interrupts of remapping entry index to dest.
+  virtual void set_int_dest(int index, struct cpu *dest) = 0;
 };
 
 extern abstract_iommu *iommu;
@@ -7,16 +7,23 @@
 struct ipi_call
 {
   void run_on(const bitset<NCPU> &);
+  // Like run_on, but return once the call is queued.  Whichever CPU
+  // finishes with it last calls done().
+  void run_on_async(const bitset<NCPU> &);
 
 protected:
   virtual void run() = 0;
+  virtual void done() { }
 
 private:
-  void start(unsigned cpu);
+  bool start(unsigned cpu);
+  bool post(const bitset<NCPU> &, int extra);
+  void finish();
 
   // next[i] must be valid before this call is linked in to the
   // myipi[i] queue and must not change until the call is done.
   struct ipi_call* next[NCPU];
+  bool async;
   __mpalign__ atomic<int> waiting;
   __padout__;
 
@@ -39,6 +46,28 @@ protected:
   }
 };
 
+template<class CB>
+struct ipi_call_async : public ipi_call
+{
+private:
+  CB cb;
+
+public:
+  ipi_call_async(CB &&cb) : cb(std::move(cb)) { }
+  NEW_DELETE_OPS(ipi_call_async);
+
+protected:
+  void run() override
+  {
+    cb();
+  }
+
+  void done() override
+  {
+    delete this;
+  }
+};
+
 // Invoke @c cb ASAP on all CPUs in @c cpu_set.  @c cb will be called
 // from the IPI interrupt handler with interrupts disabled, so it
 // should be lightweight.
@@ -49,4 +78,15 @@ void run_on_cpus(const bitset<NCPU> &cpu_set, CB cb)
   call.run_on(cpu_set);
 }
 
+// Like run_on_cpus, but don't wait for the CPUs to call @c cb.  @c cb
+// is moved into a heap-allocated call, so it must not refer to the
+// caller's stack.
+template<class CB>
+void run_on_cpus_async(const bitset<NCPU> &cpu_set, CB cb)
+{
+  auto call = new ipi_call_async<CB>(std::move(cb));
+  call->run_on_async(cpu_set);
+}
+
 void poke_cpu(int cpu);
+void poke_cpus(const bitset<NCPU> &cpu_set);
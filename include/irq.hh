@@ -70,11 +70,8 @@ public:
     return gsi != -1;
   }
 
-  // Mask or unmask this IRQ
-  void enable(bool enable = true)
-  {
-    extpic->enable_irq(*this, enable);
-  }
+  // Mask or unmask this IRQ.  This makes the external PIC its router.
+  void enable(bool enable = true);
 
   // Acknowledge this IRQ
   void eoi()
@@ -91,6 +88,20 @@ public:
   {
     register_handler(new irq_handler_cb<CB>(cb));
   }
+
+  // The CPU this IRQ is delivered to.  Until something routes it,
+  // that's CPU 0.
+  int affinity() const;
+
+  // Record that router delivers this IRQ, currently to cpu.
+  void set_router(irq_router *router, int cpu);
+
+  // Move this IRQ to cpu.  Fails if nothing has routed the IRQ yet.
+  bool set_affinity(int cpu);
 };
 
+// A CPU for the next device interrupt that can go anywhere, so that
+// single-vector devices don't all land on CPU 0.
+int irq_spread_cpu(void);
+
 void to_stream(class print_stream *s, const struct irq &irq);
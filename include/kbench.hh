@@ -0,0 +1,26 @@
+#pragma once
+
+// In-kernel microbenchmarks, for timing kernel primitives without the
+// noise of system calls.  A benchmark is a static kbench object; its
+// constructor registers it.  Benchmarks are run on cores 0 to ncores-1
+// by writing to /dev/kbench, or at boot with kbench= on the kernel
+// command line (see kernel/kbench.cc).
+
+class kbench
+{
+public:
+  kbench(const char *name);
+
+  // Called before each run on ncores cores, and after it.
+  virtual void setup(int ncores) { }
+  virtual void teardown(void) { }
+
+  // Do iters operations as core id (0 to ncores-1) of the run.
+  virtual void run(int id, u64 iters) = 0;
+
+  const char *const name;
+  kbench *next;
+
+  kbench(const kbench &) = delete;
+  kbench &operator=(const kbench &) = delete;
+};
@@ -45,6 +45,8 @@ struct dwork;
 struct irq;
 class print_stream;
 class mnode;
+class page_info;
+class poll_source;
 class inode;
 class buf;
 class transaction;
@@ -100,12 +102,16 @@ int             load_image(proc *p, const char *path, const char * const *argv,
                            sref<vmap> *oldvmap_out);
 
 // fs.c
-sref<inode>     dirlookup(sref<inode>, char*);
+sref<inode>     dirlookup(sref<inode>, const char*);
 sref<inode>     ialloc(u32, short);
 void            free_inode_number(u32 inum);
 void            free_inode(sref<inode>, transaction *trans = NULL);
+bool            add_orphan_inode(u32 inum, transaction *trans);
+void            remove_orphan_inode(u32 inum, transaction *trans);
+u32             get_orphan_inodes(u32 *inums);
 sref<inode>     namei(sref<inode> cwd, const char*);
 sref<inode>     iget(u32 dev, u32 inum);
+void            iprefetch(u32 dev, const std::vector<u32> &inums);
 #define		READLOCK	0
 #define		WRITELOCK	1
 void            ilock(sref<inode>, int lock_type);
@@ -113,7 +119,20 @@ void            iupdate(sref<inode>, transaction *trans);
 void            iunlock(sref<inode>);
 void            drop_bufcache(sref<inode> ip);
 void            itrunc(sref<inode>, u32 offset = 0, transaction *trans = NULL);
+int             ifallocate(sref<inode>, u32 bn, u32 nblocks, transaction *trans);
+int             iclone(sref<inode> src, sref<inode> dst, transaction *trans);
+bool            inode_compressed(sref<inode>);
+int             iset_compressed(sref<inode>, bool on);
+bool            inode_inline(sref<inode>);
+int             iwrite_inline(sref<inode>, const char *src, u32 n);
+void            zread_pages(sref<inode>, u32 pageidx, u32 npages, char **pages);
+void            zwrite_chunk(sref<inode>, u32 chunk, char **pages, u32 npages,
+                             transaction *trans);
 int             readi(sref<inode>, char*, u32, u32);
+u32             inode_blocknum(sref<inode>, u32 bn);
+u32             inode_lookup_block(sref<inode>, u32 bn);
+void            inode_reserve_blocks(sref<inode>, u32 nblocks);
+void            inode_release_reserved_blocks(sref<inode>);
 void            stati(sref<inode>, struct stat*);
 int             writei(sref<inode>, const char*, u32, u32, transaction *trans = NULL,
                        bool writeback = false, bool lazy_trans_update = false,
@@ -127,17 +146,29 @@ void            dir_flush(sref<inode> dp, transaction *trans = NULL);
 void            dir_remove_entries(sref<inode> dp, std::vector<char*> names_vec);
 void            dir_remove_entry(sref<inode> dp, char *entry_name);
 void            get_superblock(struct superblock *sb);
-void		balloc_free_on_disk(std::vector<u32>& blocks, transaction *trans, bool alloc);
-#define 	balloc_on_disk(blocks, trans)	balloc_free_on_disk(blocks, trans, true)
-#define 	bfree_on_disk(blocks, trans)	balloc_free_on_disk(blocks, trans, false)
+const u32*      get_bfree_summary(void);
+void            unmount_rootfs(void);
+void		balloc_free_on_disk(const u32 *blocks, size_t nblocks, transaction *trans, bool alloc);
+#define 	balloc_on_disk(blocks, trans)	balloc_free_on_disk(blocks.data(), blocks.size(), trans, true)
+#define 	bfree_on_disk(blocks, trans)	balloc_free_on_disk(blocks.data(), blocks.size(), trans, false)
+void		block_refs_on_disk(const u32 *blocks, size_t nblocks, transaction *trans, int delta);
 
 // futex.cc
 typedef u64* futexkey_t;
-int             futexkey(const u64* useraddr, vmap* vmap, futexkey_t* key);
+int             futexkey(const u64* useraddr, vmap* vmap, futexkey_t* key,
+                         bool write = false);
 long            futexwait(futexkey_t key, u64 val, u64 timer);
 long            futexwake(futexkey_t key, u64 nwake);
+long            futexrequeue(futexkey_t key, u64 nwake, u64 nrequeue,
+                             futexkey_t key2, const u64 *cmpval);
+long            futexwakeop(futexkey_t key, u64 nwake, futexkey_t key2,
+                            u64 nwake2, u64 op);
+
+// condvar.cc
+void            inittimer(void);
 
 // hz.c
+extern u64      cpuhz;
 void            microdelay(u64);
 void            inithz(void);
 
@@ -150,8 +181,28 @@ struct proc *   idleproc(void);
 void            idlezombie(struct proc*);
 
 // kalloc.c
+// Kernel caches register shrinkers, which kalloc calls in priority order
+// when it runs out of memory.  A shrinker tries to free about npages pages
+// and returns the number of pages it freed.
+enum shrink_priority {
+  // Return the free pages held by this CPU's allocator caches.  Must not
+  // sleep.
+  SHRINK_CPU_CACHES,
+  // Free caches of unused objects.  Must not sleep.
+  SHRINK_OBJECT_CACHES,
+  // Evict cached data.  May sleep, and the pages may only come back to the
+  // allocator after the next refcache epochs.
+  SHRINK_DATA_CACHES,
+};
 char*           kalloc(const char *name, size_t size = PGSIZE, int cpu = -1);
 void            kfree(void*, size_t size = PGSIZE);
+size_t          kalloc_batch(const char *name, size_t n, void **pages,
+                             int cpu = -1);
+void            kfree_batch(void **pages, size_t n);
+void            register_shrinker(const char *name, shrink_priority prio,
+                                  u64 (*fn)(u64 npages));
+u64             kalloc_total_pages(void);
+u64             kalloc_free_pages(void);
 void*           ksalloc(int slabtype);
 void            ksfree(int slabtype, void*);
 void*           early_kalloc(size_t size, size_t align);
@@ -177,7 +228,11 @@ extern int      ncpu;
 void            netfree(void *va);
 void*           netalloc(void);
 void            netrx(void *va, u16 len);
-int             nettx(void *va, u16 len);
+void            netrx_batch(void *const *va, const u16 *len, int n);
+int             nettx(void *va, u16 len, u16 csum_start = 0,
+                      u16 csum_off = 0);
+void            nettx_flush(void);
+bool            nettx_csum_offload(void);
 void            nethwaddr(u8 *hwaddr);
 
 // picirq.c
@@ -190,8 +245,14 @@ int             pipealloc(sref<file>*, sref<file>*, int flags);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, const char*, int);
-struct pipe*    pipesockalloc();
-void            pipesockclose(struct pipe *);
+int             pipewrite_page(struct pipe*, const sref<page_info>&,
+                               size_t off, size_t len);
+ssize_t         pipesplice(struct pipe*, struct file*, size_t);
+u32             pipepoll(struct pipe*, int);
+poll_source*    pipepollsrc(struct pipe*, int);
+struct pipe*    pipesockalloc(const sref<poll_source>&,
+                              const sref<poll_source>&, int, int);
+void            pipesockclose(struct pipe*);
 
 // proc.c
 enum clone_flags
@@ -221,8 +282,24 @@ void            sampstart(void);
 int             sampintr(struct trapframe*);
 void            sampconf(void);
 void            sampidle(bool);
+u64             offcpu_begin(void);
+void            offcpu_end(u64 start);
+bool            sampregions(bool enable);
 void            wdpoke(void);
 
+// schedtrace.cc
+void            schedtrace_record(int type, struct proc *p, int arg);
+
+// timepage.cc
+void            timepage_update(u64 realtime_nsec0);
+int             timepage_map(struct vmap *vmp);
+
+// faultstats.cc
+struct pagefault_stats;
+void            pagefault_record(int type, u64 cycles);
+void            pagefault_stats_fold(struct pagefault_stats *dst,
+                                     const struct pagefault_stats &src);
+
 // scalefs.cc
 void            kfreeblockprint(print_stream *s);
 
@@ -232,6 +309,8 @@ void            sched(void);
 void            post_swtch(void);
 void            scheddump(void);
 int             steal(void);
+void            sched_idle_wait(void);
+int             sched_pick_cpu(void);
 void            addrun(struct proc*);
 int             dwork_push(struct dwork*, int);
 
@@ -242,6 +321,10 @@ int             fetchmem(void*, const void*, u64);
 int             putmem(void*, const void*, u64);
 u64             syscall(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num);
 
+// syscallstats.cc
+extern bool     syscallstats_enabled;
+void            syscallstats_record(u64 num, u64 cycles);
+
 // sysfile.cc
 #include "userptr.hh"
 #include "ref.hh"
@@ -268,7 +351,7 @@ void            uartintr(void);
 // vm.c
 void            switchvm(struct proc*);
 int             pagefault(struct vmap*, uptr, u32);
-void*           pagelookup(struct vmap*, uptr);
+void*           pagelookup(struct vmap*, uptr, bool write = false);
 // Slowly but carefully read @c n bytes from virtual address @c src
 // into @c dst, without any page faults.  Return the number of bytes
 // successfully read.  These are meant for debugging purposes.
@@ -281,6 +364,7 @@ size_t          safe_read_vm(void *dst, uintptr_t src, size_t n);
 // zalloc.cc
 char*           zalloc(const char* name);
 void            zfree(void* p);
+bool            zalloc_idle(void);
 
 // other exported/imported functions
 void cmain(u64 mbmagic, u64 mbaddr);
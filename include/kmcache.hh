@@ -0,0 +1,143 @@
+#pragma once
+
+// Typed object caches.  A kmem_cache hands out objects of one fixed size
+// using per-CPU magazines backed by a shared depot (Bonwick and Adams,
+// "Magazines and Vmem", USENIX 2001).  Allocation and free touch only the
+// current CPU's magazines, with interrupts disabled but no lock; only when
+// both of a CPU's magazines are empty (or full) does it trade one with the
+// depot, under the depot's lock.  Objects freed on a CPU other than the
+// one that allocated them simply go into the freeing CPU's magazines, so
+// they move between CPUs a magazine at a time.
+//
+// Unlike kmalloc, objects are not rounded up to a power of two, and
+// memory is never returned to kalloc.
+//
+// A class uses a kmem_cache for operator new and delete with
+// NEW_DELETE_OPS_CACHED(classname) in place of NEW_DELETE_OPS.
+
+#include "percpu.hh"
+#include "spinlock.hh"
+
+class print_stream;
+
+class kmem_cache
+{
+public:
+  enum {
+    // Objects per magazine.  This makes a magazine 256 bytes.
+    MAGAZINE_SIZE = 30,
+  };
+
+  constexpr kmem_cache(const char *name, size_t size, size_t align)
+    : name_(name),
+      size_(round_size(size, align)),
+      slab_size_(slab_size(round_size(size, align))), cpus_(),
+      lock_("kmem_cache"), full_(nullptr), empty_(nullptr),
+      free_objs_(nullptr), nslabs_(0), next_(nullptr) { }
+
+  kmem_cache(const kmem_cache &o) = delete;
+  kmem_cache &operator=(const kmem_cache &o) = delete;
+
+  // Allocate an object.  Returns nullptr if out of memory.
+  void *alloc();
+
+  // Free an object allocated from this cache.
+  void free(void *p);
+
+  // Print statistics for every cache that has allocated memory.
+  static void print_all(print_stream *s);
+
+private:
+  struct magazine
+  {
+    magazine *next;
+    size_t n;
+    void *objs[MAGAZINE_SIZE];
+  };
+
+  // The magazines of one CPU.  loaded is where objects are taken from
+  // and freed to; prev is always either full or empty.
+  struct cpu_magazines
+  {
+    magazine *loaded;
+    magazine *prev;
+  };
+
+  // A free object that isn't in any magazine.
+  struct free_obj
+  {
+    free_obj *next;
+  };
+
+  static constexpr size_t round_size(size_t size, size_t align)
+  {
+    return size < sizeof(free_obj) ? sizeof(free_obj) :
+      (size + align - 1) / align * align;
+  }
+
+  // Carve objects out of at least one page, or enough for 8 objects.
+  static constexpr size_t slab_size(size_t size)
+  {
+    return size * 8 <= PGSIZE ? PGSIZE : pow2_at_least(size * 8);
+  }
+
+  static constexpr size_t pow2_at_least(size_t x, size_t p = PGSIZE)
+  {
+    return p >= x ? p : pow2_at_least(x, p * 2);
+  }
+
+  magazine *get_full();
+  magazine *get_empty();
+  void put_magazine(magazine *m);
+  bool grow();
+
+  const char *name_;
+  const size_t size_;
+  const size_t slab_size_;
+
+  percpu<cpu_magazines, NO_INT> cpus_;
+
+  // The depot, protected by lock_.
+  spinlock lock_;
+  magazine *full_;
+  magazine *empty_;
+  free_obj *free_objs_;
+  size_t nslabs_;
+
+  // Link in the list of caches, once the cache has grown.
+  kmem_cache *next_;
+};
+
+#define NEW_DELETE_OPS_CACHED(classname)                            \
+  static kmem_cache &object_cache() {                               \
+    static kmem_cache cache(#classname, sizeof(classname),          \
+                            alignof(classname));                    \
+    return cache;                                                   \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes,                   \
+                            const std::nothrow_t&) noexcept {       \
+    assert(nbytes == sizeof(classname));                            \
+    return object_cache().alloc();                                  \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes) {                 \
+    void *p = classname::operator new(nbytes, std::nothrow);        \
+    if (p == nullptr)                                               \
+      throw_bad_alloc();                                            \
+    return p;                                                       \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes, classname *buf) { \
+    assert(nbytes == sizeof(classname));                            \
+    return buf;                                                     \
+  }                                                                 \
+                                                                    \
+  static void operator delete(void *p,                              \
+                              const std::nothrow_t&) noexcept {     \
+    object_cache().free(p);                                         \
+  }                                                                 \
+                                                                    \
+  static void operator delete(void *p) {                            \
+    classname::operator delete(p, std::nothrow);                    \
+  }
@@ -24,6 +24,18 @@
   X(uint64_t, tlb_shootdown_targets)                                   \
   /* Total number of cycles spent in TLB shootdown operations. */      \
   X(uint64_t, tlb_shootdown_cycles)                                    \
+  /* # of shootdowns that munmap left for the target cores to do at    \
+   * their next context switch. */                                     \
+  X(uint64_t, tlb_lazy_count)                                          \
+  /* # of switches to a user page table that kept its TLB entries     \
+   * because this core still had a PCID for it, and # that took a new  \
+   * PCID and flushed it. */                                           \
+  X(uint64_t, tlb_pcid_hit_count)                                      \
+  X(uint64_t, tlb_pcid_miss_count)                                     \
+  /* # of global TLB flushes that released freed vmalloc memory, and   \
+   * # of vmalloc'd ranges that reused freed KVMALLOC space. */        \
+  X(uint64_t, vmalloc_flush_count)                                     \
+  X(uint64_t, vmalloc_reuse_count)                                     \
 
 #define KSTATS_VM(X)                            \
   X(uint64_t, page_fault_count)                 \
@@ -32,6 +44,9 @@
   X(uint64_t, page_fault_alloc_cycles)                \
   X(uint64_t, page_fault_fill_count)                  \
   X(uint64_t, page_fault_fill_cycles)                 \
+  X(uint64_t, page_fault_huge_count)                  \
+  X(uint64_t, page_fault_huge_alloc_count)            \
+  X(uint64_t, page_fault_around_count)                \
                                                 \
   X(uint64_t, mmap_count)                       \
   X(uint64_t, mmap_cycles)                      \
@@ -62,6 +77,9 @@
   X(uint64_t, refcache_dirtied_count)           \
   X(uint64_t, refcache_conflict_count)          \
   X(uint64_t, refcache_weakref_break_failed)    \
+  X(uint64_t, refcache_hurry_count)             \
+  X(uint64_t, refcache_hurry_flush_count)       \
+  X(uint64_t, refcache_local_freed_count)       \
 
 #define KSTATS_SOCKET(X)\
   X(uint64_t, socket_load_balance) \
@@ -78,6 +96,32 @@
   X(uint64_t, write_count)                      \
   X(uint64_t, mnode_alloc)                      \
   X(uint64_t, mnode_free)                       \
+  X(uint64_t, exec_image_hit)                   \
+  X(uint64_t, exec_image_miss)                  \
+
+#define KSTATS_FS(X)                                                   \
+  /* Buffer-cache lookups that found the block, and that had to read   \
+   * it from the disk.  disk_read_cycles is the time spent waiting for \
+   * those reads. */                                                   \
+  X(uint64_t, bufcache_hit_count)                                      \
+  X(uint64_t, bufcache_miss_count)                                     \
+  X(uint64_t, disk_read_cycles)                                        \
+  /* Blocks written by transactions (to the journal or to their home   \
+   * locations), and the time spent waiting for those writes. */      \
+  X(uint64_t, disk_write_count)                                        \
+  X(uint64_t, disk_write_cycles)                                       \
+  /* Journal flushes (committing everything queued) and transaction    \
+   * applies, and the time they took. */                               \
+  X(uint64_t, journal_commit_count)                                    \
+  X(uint64_t, journal_commit_cycles)                                   \
+  X(uint64_t, journal_apply_count)                                     \
+  X(uint64_t, journal_apply_cycles)                                    \
+  /* Metadata-log processing (turning logged operations into           \
+   * transactions), and oplog synchronizations that had work to do. */ \
+  X(uint64_t, metadata_log_count)                                      \
+  X(uint64_t, metadata_log_cycles)                                     \
+  X(uint64_t, oplog_sync_count)                                        \
+  X(uint64_t, oplog_sync_cycles)                                       \
 
 #define KSTATS_SCHED(X)                         \
   X(uint64_t, sched_tick_count)                 \
@@ -92,6 +136,7 @@
   KSTATS_SOCKET(X)                              \
   KSTATS_SCHED(X)                               \
   KSTATS_FILE(X)                                \
+  KSTATS_FS(X)                                  \
 
 struct kstats;
 #ifdef XV6_KERNEL
@@ -0,0 +1,107 @@
+#pragma once
+
+// Pools of kernel worker threads for deferred work that may sleep.
+// Unlike dwork (see work.hh), kwork runs in a thread of its own, so it
+// may block on locks, disk I/O, or memory allocation.  Each core has a
+// pool of KWORKERS_PER_CPU threads pinned to it, which run the work
+// queued on that core in FIFO order.
+//
+// Subsystems that need to run something asynchronously, or to spread
+// work over several cores, should submit it here rather than creating
+// threads of their own with threadalloc.
+
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "ref.hh"
+#include "ilist.hh"
+#include <utility>
+
+struct kwork {
+  kwork() {}
+  virtual ~kwork() {}
+  // Called once by a worker thread.  Responsible for freeing the
+  // kwork, if necessary.
+  virtual void run() = 0;
+  islink<kwork> link_;
+};
+
+// Signals the completion of one or more pieces of submitted work.
+class kcompletion : public referenced
+{
+public:
+  kcompletion(int pending = 1) : done_(pending == 0), pending_(pending) {}
+  NEW_DELETE_OPS(kcompletion);
+
+  void add_pending(int n) {
+    scoped_acquire a(&lock_);
+    pending_ += n;
+    done_ = (pending_ == 0);
+  }
+
+  void complete() {
+    scoped_acquire a(&lock_);
+    if (--pending_ > 0)
+      return;
+    done_ = true;
+    cv_.wake_all();
+  }
+
+  void wait() {
+    scoped_acquire a(&lock_);
+    while (!done_)
+      cv_.sleep(&lock_);
+  }
+
+  bool done() {
+    scoped_acquire a(&lock_);
+    return done_;
+  }
+
+private:
+  spinlock lock_;
+  condvar cv_;
+  bool done_;
+  int pending_;
+};
+
+// Queue w on the worker pool of core cpu, or of the current core if
+// cpu is -1.
+void kwork_push(kwork *w, int cpu = -1);
+
+template<class F>
+struct kwork_closure : public kwork
+{
+  kwork_closure(F &&f, const sref<kcompletion> &done)
+    : f_(std::move(f)), done_(done) {}
+  NEW_DELETE_OPS(kwork_closure);
+
+  void run() override {
+    f_();
+    if (done_)
+      done_->complete();
+    delete this;
+  }
+
+private:
+  F f_;
+  sref<kcompletion> done_;
+};
+
+// Run f() in a worker thread of core cpu (-1 for the current core).
+// If done is non-null, its complete() is called once f returns.
+template<class F>
+void
+kwork_submit(F f, int cpu = -1, const sref<kcompletion> &done = sref<kcompletion>())
+{
+  kwork_push(new kwork_closure<F>(std::move(f), done), cpu);
+}
+
+// Like kwork_submit, but returns a new completion handle to wait on.
+template<class F>
+sref<kcompletion>
+kwork_async(F f, int cpu = -1)
+{
+  sref<kcompletion> done = make_sref<kcompletion>();
+  kwork_submit(std::move(f), cpu, done);
+  return done;
+}
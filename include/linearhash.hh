@@ -1,95 +1,306 @@
 #pragma once
 
 /*
- * A linear-probing hash table.
+ * A resizable linear-probing hash table.
+ *
+ * Keys and values are packed into one flat array.  The slots are grouped
+ * into stripes of STRIPE slots that share a lock, a seqcount, and the
+ * bitmaps saying which slots are in use, so a slot costs two bits of
+ * bookkeeping instead of a lock of its own.  Lookups don't lock: they
+ * read optimistically and check the seqcounts of the stripes they
+ * probed.  Inserts and removes lock the stripes of the probe sequence in
+ * ascending order.  Probe sequences never wrap around (the table has
+ * MAX_PROBE spare slots at the end), so that order is global.
+ *
+ * No probe sequence is longer than MAX_PROBE slots.  When an insert
+ * can't find a free slot within that many, the table doubles: the
+ * inserter freezes the stripes one at a time, rehashes them into a new
+ * table, and publishes it, and the old table is freed once RCU readers
+ * are done with it.  Writers that run into a frozen stripe wait for the
+ * new table.
  */
 
 #include "spinlock.hh"
 #include "seqlock.hh"
-#include "lockwrap.hh"
 #include "hash.hh"
+#include "gc.hh"
+#include <atomic>
 
 template<class K, class V>
 class linearhash {
 private:
-  struct slotdata {
-    slotdata() : used(false), valid(false) {}
+  enum {
+    // Slots per stripe (the width of the bitmaps).
+    STRIPE = 64,
+    // The longest possible probe sequence.
+    MAX_PROBE = 2 * STRIPE,
+    // The most stripes one probe sequence can touch.
+    PROBE_STRIPES = MAX_PROBE / STRIPE + 1,
+  };
 
-    bool used;
-    bool valid;
+  struct entry {
     K key;
     V val;
   };
 
-  struct slot {
+  struct stripe {
+    stripe() : used(0), valid(0), frozen(false) {}
+
     spinlock lock;
     seqcount<u32> seq;
-    slotdata data;
+    // The slots that have held an entry since the table was built
+    // (probe sequences end at the first slot that hasn't), and the
+    // slots that hold one now.
+    u64 used;
+    u64 valid;
+    // This stripe has been copied into a new table.
+    bool frozen;
+  } __mpalign__;
+
+  struct table : public rcu_freed {
+    table(u64 nslots)
+      : rcu_freed("linearhash::table", this, sizeof(*this)),
+        nslots(nslots),
+        nstripes((nslots + MAX_PROBE + STRIPE - 1) / STRIPE),
+        stripes(new stripe[nstripes]),
+        entries(new entry[nstripes * STRIPE]),
+        resizing(false) {}
+
+    ~table() {
+      delete[] stripes;
+      delete[] entries;
+    }
+
+    void do_gc() override { delete this; }
+    NEW_DELETE_OPS(table);
+
+    // Probe sequences start in the first nslots slots.
+    const u64 nslots;
+    const u64 nstripes;
+    stripe* const stripes;
+    entry* const entries;
+    std::atomic<bool> resizing;
   };
 
-  u64 nslots_;
-  slot* slots_;
+  enum class result { OK, FAILED, FULL, FROZEN };
 
-public:
-  linearhash(u64 nslots) : nslots_(nslots) {
-    slots_ = new slot[nslots_];
-    assert(slots_);
+  std::atomic<table*> table_;
+
+  // Insert into a table that nobody else can see yet.
+  static bool insert_private(table* t, const K& k, const V& v) {
+    u64 h = hash(k) % t->nslots;
+    for (u64 idx = h; idx < h + MAX_PROBE; idx++) {
+      stripe* s = &t->stripes[idx / STRIPE];
+      u64 bit = 1ull << (idx % STRIPE);
+      if (s->used & bit)
+        continue;
+      s->used |= bit;
+      s->valid |= bit;
+      t->entries[idx].key = k;
+      t->entries[idx].val = v;
+      return true;
+    }
+    return false;
   }
 
-  ~linearhash() {
-    delete[] slots_;
+  result try_insert(table* t, const K& k, const V& v) {
+    scoped_acquire lk[PROBE_STRIPES];
+    int nlocked = 0;
+    u64 h = hash(k) % t->nslots;
+    u64 free = h + MAX_PROBE;
+    for (u64 idx = h; idx < h + MAX_PROBE; idx++) {
+      stripe* s = &t->stripes[idx / STRIPE];
+      u64 bit = 1ull << (idx % STRIPE);
+      if (idx == h || idx % STRIPE == 0) {
+        lk[nlocked++] = s->lock.guard();
+        if (s->frozen)
+          return result::FROZEN;
+      }
+      if (!(s->used & bit)) {
+        if (free == h + MAX_PROBE)
+          free = idx;
+        break;
+      }
+      if (!(s->valid & bit)) {
+        // Reuse the first removed slot, once we know k isn't further
+        // along.
+        if (free == h + MAX_PROBE)
+          free = idx;
+      } else if (t->entries[idx].key == k) {
+        return result::FAILED;
+      }
+    }
+    if (free == h + MAX_PROBE)
+      return result::FULL;
+
+    stripe* s = &t->stripes[free / STRIPE];
+    u64 bit = 1ull << (free % STRIPE);
+    auto w = s->seq.write_begin();
+    t->entries[free].key = k;
+    t->entries[free].val = v;
+    s->used |= bit;
+    s->valid |= bit;
+    return result::OK;
   }
 
-  NEW_DELETE_OPS(linearhash);
+  result try_remove(table* t, const K& k) {
+    scoped_acquire lk[PROBE_STRIPES];
+    int nlocked = 0;
+    u64 h = hash(k) % t->nslots;
+    for (u64 idx = h; idx < h + MAX_PROBE; idx++) {
+      stripe* s = &t->stripes[idx / STRIPE];
+      u64 bit = 1ull << (idx % STRIPE);
+      if (idx == h || idx % STRIPE == 0) {
+        lk[nlocked++] = s->lock.guard();
+        if (s->frozen)
+          return result::FROZEN;
+      }
+      if (!(s->used & bit))
+        break;
+      if ((s->valid & bit) && t->entries[idx].key == k) {
+        auto w = s->seq.write_begin();
+        s->valid &= ~bit;
+        t->entries[idx].val = V();
+        return result::OK;
+      }
+    }
+    return result::FAILED;
+  }
 
-  void insert(const K& k, const V& v) {
-    u64 h = hash(k);
-    for (u64 i = 0; i < nslots_; i++) {
-      slot* s = &slots_[(h + i) % nslots_];
-      scoped_acquire l(&s->lock);
-      if (s->data.valid)
-        continue;
+  // Wait for whoever froze t to publish its replacement.
+  void wait_for_resize(table* t) const {
+    while (table_.load() == t)
+      nop_pause();
+  }
 
-      auto w = s->seq.write_begin();
-      s->data.used = true;
-      s->data.valid = true;
-      s->data.key = k;
-      s->data.val = v;
+  // Replace t with a table at least twice as big, unless someone else
+  // already is.
+  void grow(table* t) {
+    bool expected = false;
+    if (!t->resizing.compare_exchange_strong(expected, true)) {
+      wait_for_resize(t);
       return;
     }
 
-    panic("insert: out of slots");
+    for (u64 i = 0; i < t->nstripes; i++) {
+      auto l = t->stripes[i].lock.guard();
+      t->stripes[i].frozen = true;
+    }
+
+    // The frozen table can't change, so copy it without locks.
+    for (u64 nslots = t->nslots * 2; ; nslots *= 2) {
+      table* nt = new table(nslots);
+      bool ok = true;
+      for (u64 idx = 0; ok && idx < t->nstripes * STRIPE; idx++)
+        if (t->stripes[idx / STRIPE].valid & (1ull << (idx % STRIPE)))
+          ok = insert_private(nt, t->entries[idx].key, t->entries[idx].val);
+      if (ok) {
+        table_.store(nt);
+        break;
+      }
+      delete nt;
+    }
+    gc_delayed(t);
   }
 
-  bool remove(const K& k) {
-    u64 h = hash(k);
-    for (u64 i = 0; i < nslots_; i++) {
-      slot* s = &slots_[(h + i) % nslots_];
-      scoped_acquire l(&s->lock);
-      if (!s->data.used)
+public:
+  linearhash(u64 nslots = 1024) : table_(new table(nslots ? nslots : 1)) {}
+
+  ~linearhash() {
+    delete table_.load();
+  }
+
+  NEW_DELETE_OPS(linearhash);
+
+  // Add k -> v.  Returns false if k is already in the table.
+  bool insert(const K& k, const V& v) {
+    scoped_gc_epoch rcu_read;
+    for (;;) {
+      table* t = table_.load();
+      switch (try_insert(t, k, v)) {
+      case result::OK:
+        return true;
+      case result::FAILED:
+        return false;
+      case result::FULL:
+        grow(t);
         break;
-      if (s->data.key == k) {
-        auto w = s->seq.write_begin();
-        s->data.valid = false;
-        s->data.val = V();
+      case result::FROZEN:
+        wait_for_resize(t);
+        break;
+      }
+    }
+  }
+
+  bool remove(const K& k) {
+    scoped_gc_epoch rcu_read;
+    for (;;) {
+      table* t = table_.load();
+      switch (try_remove(t, k)) {
+      case result::OK:
         return true;
+      case result::FAILED:
+        return false;
+      default:
+        wait_for_resize(t);
+        break;
       }
     }
-    return false;
   }
 
-  bool lookup(const K& k, V* vptr) const {
-    u64 h = hash(k);
-    for (u64 i = 0; i < nslots_; i++) {
-      const slot* s = &slots_[(h + i) % nslots_];
-      auto copy = seq_reader<slotdata>(&s->data, &s->seq);
-      if (!copy->used)
+  bool lookup(const K& k, V* vptr = nullptr) const {
+    scoped_gc_epoch rcu_read;
+  retry:
+    table* t = table_.load();
+    typename seqcount<u32>::reader rd[PROBE_STRIPES];
+    int nread = 0;
+    bool found = false;
+    entry e;
+    u64 h = hash(k) % t->nslots;
+    for (u64 idx = h; idx < h + MAX_PROBE; idx++) {
+      const stripe* s = &t->stripes[idx / STRIPE];
+      u64 bit = 1ull << (idx % STRIPE);
+      if (idx == h || idx % STRIPE == 0)
+        rd[nread++] = s->seq.read_begin();
+      if (!(s->used & bit))
+        break;
+      if ((s->valid & bit) && t->entries[idx].key == k) {
+        e = t->entries[idx];
+        found = true;
         break;
-      if (copy->valid && copy->key == k) {
-        *vptr = copy->val;
-        return true;
       }
     }
-    return false;
+    for (int i = 0; i < nread; i++)
+      if (rd[i].need_retry())
+        goto retry;
+    // A stale table may not reflect writes to its replacement.
+    if (table_.load() != t)
+      goto retry;
+    if (found && vptr)
+      *vptr = e.val;
+    return found;
+  }
+
+  // Call cb(key, value) on each entry until it returns true.  Entries
+  // added or removed during the enumeration may or may not be seen.
+  template<class CB>
+  void enumerate(CB cb) const {
+    scoped_gc_epoch rcu_read;
+    table* t = table_.load();
+    for (u64 i = 0; i < t->nstripes; i++) {
+      const stripe* s = &t->stripes[i];
+      for (u64 j = 0; j < STRIPE; j++) {
+        entry e;
+        bool valid;
+        auto rd = s->seq.read_begin();
+        do {
+          valid = s->valid & (1ull << j);
+          if (valid)
+            e = t->entries[i * STRIPE + j];
+        } while (rd.do_retry());
+        if (valid && cb(e.key, e.val))
+          return;
+      }
+    }
   }
 };
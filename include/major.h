@@ -11,3 +11,18 @@
 #define MAJ_MFSSTATS 11
 #define MAJ_BLKSTATS 12
 #define MAJ_EVICTCACHES 13
+#define MAJ_BUFCACHE 14
+#define MAJ_MEMDISK  15
+#define MAJ_BLKIO    16
+#define MAJ_HEAPPROF 17
+#define MAJ_RCUSTATS 18
+#define MAJ_SCHEDTRACE 19
+#define MAJ_FAULTSTATS 20
+#define MAJ_NETSTAT  21
+#define MAJ_FSSTATS  22
+#define MAJ_LOCKPROF 23
+#define MAJ_PERFREGIONS 24
+#define MAJ_SYSCALLS 25
+#define MAJ_TRACEPOINTS 26
+#define MAJ_KBENCH   27
+#define MAJ_IRQAFFINITY 28
@@ -2,16 +2,31 @@
 
 #include "mnode.hh"
 #include "spinlock.hh"
+#include "userptr.hh"
+#include <uk/uio.h>
 
 extern u64 root_mnum;
 extern mfs* root_fs;
 extern mfs* anon_fs;
 
+// Copy the next element of *path into name and advance *path past it;
+// returns 1, or 0 at the end of the path, or -1 if the name is too long.
+int skipelem(const char **path, fsname *name);
 sref<mnode> namei(sref<mnode> cwd, const char* path);
-sref<mnode> nameiparent(sref<mnode> cwd, const char* path, strbuf<DIRSIZ>* buf);
+sref<mnode> nameiparent(sref<mnode> cwd, const char* path, fsname* buf);
 s64 readm(sref<mnode> m, char* buf, u64 start, u64 nbytes);
+// Like readm, but copy straight from the page-cache into user memory.
+s64 readm_user(sref<mnode> m, userptr<void> buf, u64 start, u64 nbytes);
 s64 writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
            mfile::resizer* resize = nullptr);
+// Vectored readm_user and writem, between the page cache and the
+// iovcnt user buffers in iov, which hold nbytes in all.  writem_userv
+// starts iovoff bytes into the buffers.
+s64 readm_userv(sref<mnode> m, const struct iovec *iov, int iovcnt, u64 start,
+                u64 nbytes);
+s64 writem_userv(sref<mnode> m, const struct iovec *iov, int iovcnt, u64 start,
+                 u64 nbytes, mfile::resizer* resize = nullptr,
+                 u64 iovoff = 0);
 
 class print_stream;
 void mfsprint(print_stream *s);
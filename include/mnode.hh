@@ -2,7 +2,9 @@
 
 #include "kernel.hh"
 #include "refcache.hh"
+#include "snzi.hh"
 #include "chainhash.hh"
+#include "splithash.hh"
 #include "radix_array.hh"
 #include "page_info.hh"
 #include "kalloc.hh"
@@ -17,6 +19,8 @@ class mdev;
 class msock;
 class mlinkref;
 class mfs;
+struct exec_image;
+struct vmap;
 class mfs_interface;
 
 extern mfs *root_fs;
@@ -58,8 +62,11 @@ public:
   void cache_pin(bool flag);
   void dirty(bool flag);
   bool is_dirty();
+  void add_to_dirty_list();
+  void removed_from_dirty_list() { on_dirty_list_ = false; }
   void mark_inode_for_deletion();
   u8 type() const { return mnumber(mnum_).type(); }
+  static u8 type_of(u64 mnum) { return mnumber(mnum).type(); }
   void initialized(bool flag) { initialized_ = flag; }
   bool is_initialized() { return initialized_; }
 
@@ -92,6 +99,7 @@ private:
 
   std::atomic<bool> cache_pin_;
   std::atomic<bool> dirty_;
+  std::atomic<bool> on_dirty_list_; // In mfs_interface::dirty_mnums.
   std::atomic<bool> valid_;
   bool delete_inode_;
 };
@@ -160,27 +168,96 @@ public:
   sleeplock dir_rename_lock __mpalign__;
 };
 
+// Evict up to npages clean page-cache pages that haven't been used recently.
+// Returns the number of pages evicted.  Installed as kalloc's reclaim hook.
+u64 pagecache_reclaim(u64 npages);
+
+// Append up to max (mnum, pageidx) pairs of the clean page-cache pages that
+// are still cached to *out, those used since the CLOCK hand last went by
+// first.
+void pagecache_hot_pages(std::vector<pair<u64, u64>> *out, size_t max);
+
+// Save the pages that are cached now to the warmup list, and read in the ones
+// on the list (see kernel/warmlist.cc).
+void warmlist_save();
+void warmlist_load();
+
+// Number of dirty page-cache pages, and whether that exceeds the given
+// percentage of memory.
+u64 pagecache_dirty_pages();
+bool pagecache_dirty_exceeds(u64 ratio);
+
+// Where new page-cache pages are allocated (see SCALEFS_PAGE_PLACEMENT).
+enum class page_placement { first_touch, interleave, owner };
+void pagecache_set_placement(page_placement p);
+void pagecache_print_placement(print_stream *s);
+
+// Invalidate the path-prefix lookup cache in mfs.cc.  Called after a
+// directory is unlinked or moved, which is the only way a cached path
+// prefix can start resolving to a different directory.
+void dcache_invalidate();
+
+// Hooks that let an active snapshot (see kernel/snapshot.cc) save what a
+// change is about to overwrite.  They return right away if there is none.
+// The mdir splithash observer, called as an entry of mdir dir changes:
+void snapshot_dir_observer(void *dir, const fsname& name, const u64 *old);
+// After m lost a name, to keep it in memory while the snapshot needs it:
+void snapshot_unlinked(sref<mnode> m);
+// Before page pageidx of mf, whose page is pi, is written to:
+void snapshot_page_write(mfile *mf, u64 pageidx, page_info *pi);
+// Before mf's size changes from oldsize to newsize, under mf's resizer:
+void snapshot_resize(mfile *mf, u64 oldsize, u64 newsize);
+
 
 class mdir : public mnode {
 private:
-  // ~32K cache
   mdir(mfs* fs, u64 mnum, u64 parent_mnum) : mnode(fs, mnum),
-      parent_mnum_(parent_mnum), map_(1367) {}
+      parent_mnum_(parent_mnum), map_(4), probed_(4) {
+    map_.set_observer(snapshot_dir_observer, this);
+  }
   NEW_DELETE_OPS(mdir);
   friend class mnode;
   friend class mfs;
+  friend class mfs_interface;
+  friend class snapshot;
   u64 parent_mnum_;
 
-  // XXX We should deal with varying directory sizes better.  One way
-  // would be to make this a resizable hash table.  Linux uses a
-  // unified directory cache hash table, but that would make
+  // Grows and shrinks with the number of entries, so that small
+  // directories stay small and large ones keep short chains.  Linux
+  // uses a unified directory cache hash table, but that would make
   // serializing a directory much harder for us.
-  chainhash<strbuf<DIRSIZ>, u64> map_;
+  splithash<fsname, u64> map_;
+
+  // A directory on the root file system is read from the disk lazily.  A
+  // name that misses in map_ is looked up on disk and loaded, along with
+  // its mnode, and then recorded in probed_; map_ is authoritative for
+  // the names in probed_, and for all names once initialized_ is set (by
+  // load_all(), which reads in the rest of the directory).  load_lock_
+  // serializes the loads.
+  mutable splithash<fsname, bool> probed_;
+  mutable sleeplock load_lock_;
+
+  void probe(const fsname& name) const;
+  void load_all() const;
+
+  // Add an entry read from the disk.
+  bool load(const fsname& name, mlinkref* mlink) {
+    if (!map_.insert(name, mlink->mn()->mnum_, nullptr, true))
+      return false;
+    assert(mlink->held());
+    mlink->mn()->nlink_.inc();
+    // A directory's ".." is never read from its own on-disk entries
+    // (except for the root); it is loaded along with the directory.
+    if (name == "..")
+      probed_.insert(name, true);
+    return true;
+  }
 
 public:
-  bool insert(const strbuf<DIRSIZ>& name, mlinkref* mlink, u64 *tsc = NULL) {
+  bool insert(const fsname& name, mlinkref* mlink, u64 *tsc = NULL) {
     if (name == ".")
       return false;
+    probe(name);
     if (!map_.insert(name, mlink->mn()->mnum_, tsc))
       return false;
     assert(mlink->held());
@@ -189,34 +266,45 @@ public:
     return true;
   }
 
-  bool remove(const strbuf<DIRSIZ>& name, sref<mnode> m, u64 *tsc = NULL) {
+  bool remove(const fsname& name, sref<mnode> m, u64 *tsc = NULL) {
     if (!map_.remove(name, m->mnum_, tsc))
       return false;
+    if (m->type() == types::dir)
+      dcache_invalidate();
+    snapshot_unlinked(m);
     m->nlink_.dec();
     dirty(true);
     return true;
   }
 
-  bool replace_from(const strbuf<DIRSIZ>& dstname, sref<mnode> mdst,
-                    sref<mnode> srcparent, const strbuf<DIRSIZ>& srcname,
+  bool replace_from(const fsname& dstname, sref<mnode> mdst,
+                    sref<mnode> srcparent, const fsname& srcname,
                     sref<mnode> msrc, mdir* subdir, u64 *tsc = NULL) {
 
     u64 dstmnum = mdst ? mdst->mnum_ : 0;
 
+    probe(dstname);
+    srcparent->as_dir()->probe(srcname);
+
     if (subdir)
       mnode::nlink_.inc();
 
     if (!map_.replace_from(dstname, mdst ? &dstmnum : nullptr,
                            &srcparent->as_dir()->map_, srcname, msrc->mnum_,
                            subdir ? &subdir->map_ : nullptr,
-                           strbuf<DIRSIZ>(".."), mnode::mnum_, tsc)) {
+                           fsname(".."), mnode::mnum_, tsc)) {
       if (subdir)
         mnode::nlink_.dec();
       return false;
     }
 
-    if (mdst)
+    if (msrc->type() == types::dir || (mdst && mdst->type() == types::dir))
+      dcache_invalidate();
+
+    if (mdst) {
+      snapshot_unlinked(mdst);
       mdst->nlink_.dec();
+    }
 
     if (subdir)
       srcparent->nlink_.dec();
@@ -232,22 +320,28 @@ public:
     return true;
   }
 
-  bool exists(const strbuf<DIRSIZ>& name) const {
+  bool exists(const fsname& name) const {
     if (name == ".")
       return true;
 
+    if (map_.lookup(name))
+      return true;
+    probe(name);
     return map_.lookup(name);
   }
 
-  sref<mnode> lookup(const strbuf<DIRSIZ>& name) const {
+  sref<mnode> lookup(const fsname& name) const {
     if (name == ".")
       return fs_->mget(mnum_);
 
     u64 mprev = -1;
     for (;;) {
       u64 mnum = 0;
-      if (!map_.lookup(name, &mnum))
-        return sref<mnode>();
+      if (!map_.lookup(name, &mnum)) {
+        probe(name);
+        if (!map_.lookup(name, &mnum))
+          return sref<mnode>();
+      }
 
       sref<mnode> m = fs_->mget(mnum);
       if (m)
@@ -263,7 +357,7 @@ public:
     }
   }
 
-  mlinkref lookup_link(const strbuf<DIRSIZ>& name) const {
+  mlinkref lookup_link(const fsname& name) const {
     if (name == ".")
       /*
        * We cannot convert the name "." to a link count on the mnode,
@@ -309,7 +403,7 @@ public:
       /*
        * Mild POSIX violation: an mnode can appear to have a
        * link count, according to fstat, that is higher than
-       * the number of all its names.  For instance, sys_link()
+       * the number of all its names.  For instance, sys_linkat()
        * first grabs a mlinkref on the existing name, and then
        * drops it if the new name already exists.
        */
@@ -318,19 +412,24 @@ public:
     }
   }
 
-  bool enumerate(const strbuf<DIRSIZ>* prev, strbuf<DIRSIZ>* name) const {
+  bool enumerate(const fsname* prev, fsname* name,
+                 u64* mnum = nullptr) const {
     if (!prev) {
       *name = ".";
+      if (mnum)
+        *mnum = mnum_;
       return true;
     }
 
     if (*prev == ".")
       prev = nullptr;
 
-    return map_.enumerate(prev, name);
+    load_all();
+    return map_.enumerate(prev, name, mnum);
   }
 
   bool kill(sref<mnode> parent) {
+    load_all();
     if (!map_.remove_and_kill("..", parent->mnum_))
       return false;
 
@@ -350,12 +449,7 @@ inline mdir*
 mnode::as_dir()
 {
   assert(type() == types::dir);
-  auto md = static_cast<mdir*>(this);
-  if (!initialized_ && fs_ == root_fs) {
-    initialized_ = true;
-    rootfs_interface->initialize_dir(root_fs->mget(mnum_));
-  }
-  return md;
+  return static_cast<mdir*>(this);
 }
 
 inline const mdir*
@@ -368,11 +462,11 @@ mnode::as_dir() const
 
 class mfile : public mnode {
 private:
-  mfile(mfs* fs, u64 mnum, u64 parent_mnum) : mnode(fs, mnum),
-        parent_mnum_(parent_mnum), size_(0) {}
+  mfile(mfs* fs, u64 mnum, u64 parent_mnum);
   NEW_DELETE_OPS(mfile);
   friend class mnode;
   friend class mfs;
+  friend class snapshot;
   u64 parent_mnum_;
 
 public:
@@ -463,6 +557,12 @@ public:
       return sref<page_info>::newref(get_page_info_raw());
     }
 
+    void mark_used() const {
+      page_info* pi = get_page_info_raw();
+      if (pi)
+        pi->mark_used();
+    }
+
     void reset_page_info() {
       value_ = value_ & 0xF;
     }
@@ -507,6 +607,13 @@ public:
       else
         locked_reset_bit(FLAG_DIRTY_PAGE_BIT, &value_);
     }
+
+    // Like set_dirty_bit(), but return whether the page was already dirty.
+    bool test_and_set_dirty_bit(bool flag) {
+      if (flag)
+        return locked_test_and_set_bit(FLAG_DIRTY_PAGE_BIT, &value_);
+      return locked_test_and_reset_bit(FLAG_DIRTY_PAGE_BIT, &value_);
+    }
   };
 
 private:
@@ -518,9 +625,95 @@ private:
   seqcount<u32> size_seq_;
   u64 size_;
 
+  // The end of the ranges that O_APPEND writes have reserved, which may be
+  // ahead of size_ while they are being written.  Only a shrink (under the
+  // resizer) moves it back.
+  std::atomic<u64> append_end_;
+
   // Only one fsync can execute on the mnode at a time
   sleeplock fsync_lock_;
 
+  // The data writes of the last sync, which may still be in flight; the next
+  // sync waits for them before it writes any pages. Protected by fsync_lock_.
+  sref<data_writeback> data_wb_;
+
+  // Indices of the pages that became dirty since they were last synced, so
+  // that sync_file() doesn't have to scan the whole file. An index is added
+  // when a page's dirty bit goes from clear to set; it may be stale (the page
+  // was since truncated) or appear more than once, which the sync filters out.
+  spinlock dirty_pages_lock_;
+  std::vector<u64> dirty_pages_;
+
+  // nsectime() at which the oldest page in dirty_pages_ was dirtied, or 0 if
+  // there are none. The writeback flushers use this to age files.
+  std::atomic<u64> dirtied_at_;
+
+  // Number of pages appended since the last sync. Their disk blocks are not
+  // chosen at write time; the next sync reserves one contiguous run for all
+  // of them, so that sequentially written files end up contiguous on disk.
+  std::atomic<u64> delalloc_pages_;
+
+  // Readahead state, protected by ra_lock_. A demand miss on page ra_next_
+  // continues a sequential stream, which makes get_page() read the next
+  // ra_size_ pages ahead asynchronously. Those pages, [ra_start_,
+  // ra_start_ + ra_pages_.size()), are put into pages_ once the reader gets
+  // to them, at which point the following window is issued, twice as large.
+  sleeplock ra_lock_;
+  u64 ra_next_;
+  u64 ra_size_;
+  u64 ra_start_;
+  std::vector<sref<page_info>> ra_pages_;
+  std::vector<sref<disk_completion>> ra_dcs_;
+
+  // NUMA node of the core that created this mfile, for the owner placement
+  // policy, and the number of this file's pages that were allocated on a
+  // node other than that of the core that asked for them.
+  int owner_node_;
+  std::atomic<u64> remote_pages_;
+
+  // Incremented whenever the file's contents or size change.  exec
+  // caches the file's parsed ELF headers in exec_image_, which is stale
+  // once content_gen_ moves past the generation it was parsed at.
+  std::atomic<u64> content_gen_;
+  std::atomic<exec_image*> exec_image_;
+
+  // Per-node copies of the pages of an exec'd binary, for read-only mappings
+  // on nodes other than that of the page-cache page (see replica_page()).
+  // Any change to the file's contents drops them all, and unmaps them,
+  // through collapse_replicas().  has_replicas_ is set before a copy is
+  // added, so that a change that doesn't see it also doesn't need to.
+  struct replica {
+    u64 pageidx;
+    int node;
+    sref<page_info> page;
+  };
+  spinlock replica_lock_;
+  std::vector<replica> replicas_;
+  std::atomic<bool> has_replicas_;
+
+  // Reverse map: the address ranges of the vmaps that map this file, so
+  // that evicting or truncating pages costs a visit to each mapping of
+  // the file, rather than a list of (vmap, va) pairs kept for every
+  // page.  A vmap adds its ranges as it maps them and removes them as
+  // it unmaps them or is destroyed, so every vm here is still allocated,
+  // though its reference count may already have reached zero.
+  struct mapping {
+    vmap *vm;
+    uptr start, end;            // The mapped range of vm
+    intptr_t base;              // Virtual address of the file's byte 0
+  };
+  spinlock rmap_lock_;
+  std::vector<mapping> rmap_;
+
+  template<class F> void for_each_mapping(u64 start_pg, u64 end_pg, F f);
+
+  void add_dirty_page(u64 pageidx);
+  void track_page(u64 pageidx, const sref<page_info> &pi);
+  void readahead(u64 start, u64 npages);
+  void finish_readahead();
+  void sync_pages(int cpu, u64 start_pg, u64 end_pg, bool datasync,
+                  bool whole_file);
+
 public:
   class resizer : public lock_guard<sleeplock>,
                   public seq_writer {
@@ -538,6 +731,7 @@ public:
     void resize_nogrow(u64 size);
     void resize_append(u64 size, sref<page_info> pi);
     void initialize_from_disk(u64 size);
+    void reload_from_disk(u64 size);
   };
 
   resizer write_size() {
@@ -548,12 +742,48 @@ public:
     return seq_reader<u64>(&size_, &size_seq_);
   }
 
-  page_state get_page(u64 pageidx);
+  // Reserve n bytes at the end of the file for an O_APPEND write and
+  // return the offset they start at, so that appenders can write their
+  // ranges concurrently without holding the resizer throughout.  Once
+  // the write is done, unreserve_append() gives back what it didn't use.
+  u64 reserve_append(u64 n);
+  void unreserve_append(u64 pos, u64 n, u64 written);
+
+  char *alloc_page(u64 pageidx);
+  sref<page_info> replica_page(u64 pageidx, sref<page_info> pi);
+  void collapse_replicas();
+  u64 remote_pages() const { return remote_pages_; }
+  // allow_readahead = false reads only pageidx on a miss, and leaves the
+  // sequential readahead state alone.
+  page_state get_page(u64 pageidx, bool allow_readahead = true);
+  // How a mapping expects to be accessed, from madvise().
+  enum class fault_hint { normal, sequential, random };
+  void fault_in_page(u64 pageidx, fault_hint hint = fault_hint::normal);
+  bool page_resident(u64 pageidx, bool *used = nullptr);
+  void prefetch(u64 start, u64 npages);
+  void finish_prefetch();
   void put_page(u64 pageidx);
+  enum class reclaim_result { gone, kept, evicted };
+  reclaim_result reclaim_page(u64 pageidx);
+  void drop_readahead();
   void set_page_dirty(u64 pageidx);
-  void sync_file(int cpu);
+  void sync_file(int cpu, bool datasync = false);
+  void sync_file_range(int cpu, u64 offset, u64 nbytes);
+  u64 dirtied_at() const { return dirtied_at_; }
+  bool writeback(int cpu);
+  void balance_dirty_pages();
+  void discard_dirty_pages();
   void remove_pgtable_mappings(u64 start_offset);
+  // Record that vm maps this file between virtual addresses start and
+  // end, with the file's byte 0 at base; or forget whatever part of
+  // vm's mappings of this file lies between start and end.
+  void add_mapping(vmap *vm, uptr start, uptr end, intptr_t base);
+  void remove_mapping(vmap *vm, uptr start, uptr end);
   void drop_pagecache();
+  u64 content_gen() const { return content_gen_; }
+  // Defined in exec.cc.
+  exec_image *get_exec_image();
+  void set_exec_image(exec_image *img);
 };
 
 inline mfile*
@@ -662,9 +892,9 @@ public:
       panic("blocking_io not retried or aborted");
   }
 
-  void retry()
+  void retry(mfile::fault_hint hint = mfile::fault_hint::normal)
   {
-    mf_->get_page(pageidx_);
+    mf_->fault_in_page(pageidx_, hint);
     mf_.reset();
   }
 
@@ -1,9 +1,36 @@
 #pragma once
 
+// A packet for transmit_batch.  If csum_start isn't 0, the device
+// computes the TCP or UDP checksum: it sums the packet from byte
+// csum_start to the end and stores the complement at byte csum_off.
+// The checksum field holds the pseudo-header sum to start with.
+struct netpkt
+{
+  void *buf;
+  uint32_t len;
+  uint16_t csum_start;
+  uint16_t csum_off;
+};
+
 class netdev
 {
 public:
   virtual int transmit(void *buf, uint32_t len) = 0;
+
+  // Transmit n packets at once, telling the device about them together.
+  // Returns how many were taken, stopping at the first that doesn't fit.
+  // Packets only ask for checksums if csum_offload() says so.
+  virtual int transmit_batch(const struct netpkt *pkts, int n)
+  {
+    for (int i = 0; i < n; i++)
+      if (transmit(pkts[i].buf, pkts[i].len) < 0)
+        return i;
+    return n;
+  }
+
+  // Can the device compute transmitted TCP checksums?
+  virtual bool csum_offload() { return false; }
+
   virtual void get_hwaddr(uint8_t *hwaddr) = 0;
 };
 
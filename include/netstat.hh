@@ -0,0 +1,34 @@
+#pragma once
+
+// Always-on network counters, per core, read as text through
+// /dev/netstat.  Receive counters are kept on the core that received,
+// which with a multi-queue NIC is the RX queue's core.  Like kstats,
+// they're only approximately per core.
+
+#include "percpu.hh"
+
+#define NETSTATS_ALL(X)                                                 \
+  X(rx_packets)                 /* Handed to the stack */               \
+  X(rx_bytes)                                                           \
+  X(tx_packets)                 /* Taken by the device */               \
+  X(tx_bytes)                                                           \
+  X(rx_overrun)                 /* The NIC ran out of RX descriptors */ \
+  X(rx_nobuf)                   /* Dropped: no pbuf for the packet */   \
+  X(rx_bad)                     /* Dropped: not IP or ARP, or bad */    \
+  X(tx_ring_full)               /* Dropped: the TX ring was full */     \
+  X(tx_nobuf)                   /* Dropped: no buffer to send from */   \
+
+struct netstats
+{
+#define X(name) u64 name;
+  NETSTATS_ALL(X)
+#undef X
+};
+
+DECLARE_PERCPU(struct netstats, mynetstats, NO_CRITICAL);
+
+static inline void
+netstat_inc(u64 netstats::* field, u64 delta = 1)
+{
+  (*mynetstats).*field += delta;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+/*
+ * NVM Express 1.2 controller registers, queue entries and commands.
+ */
+
+struct nvme_reg {
+  u64 cap;		/* controller capabilities */
+  u32 vs;		/* version */
+  u32 intms;		/* interrupt mask set */
+  u32 intmc;		/* interrupt mask clear */
+  u32 cc;		/* controller configuration */
+  u32 reserved0;
+  u32 csts;		/* controller status */
+  u32 nssr;		/* NVM subsystem reset */
+  u32 aqa;		/* admin queue attributes */
+  u64 asq;		/* admin submission queue base address */
+  u64 acq;		/* admin completion queue base address */
+};
+
+#define NVME_CAP_MQES(cap)	(((cap) >> 0) & 0xffff)	/* max entries - 1 */
+#define NVME_CAP_TO(cap)	(((cap) >> 24) & 0xff)	/* in 500ms units */
+#define NVME_CAP_DSTRD(cap)	(((cap) >> 32) & 0xf)	/* doorbell stride */
+#define NVME_CAP_MPSMIN(cap)	(((cap) >> 48) & 0xf)
+
+#define NVME_CC_EN		(1 << 0)
+#define NVME_CC_CSS_NVM		(0 << 4)
+#define NVME_CC_MPS(shift)	(((shift) - 12) << 7)
+#define NVME_CC_AMS_RR		(0 << 11)
+#define NVME_CC_IOSQES(n)	((n) << 16)	/* log2 of SQ entry size */
+#define NVME_CC_IOCQES(n)	((n) << 20)	/* log2 of CQ entry size */
+
+#define NVME_CSTS_RDY		(1 << 0)
+#define NVME_CSTS_CFS		(1 << 1)	/* controller fatal status */
+
+/* Doorbells start at this offset into BAR 0 */
+#define NVME_DOORBELL_BASE	0x1000
+
+struct nvme_sqe {
+  u8 opcode;
+  u8 flags;
+  u16 cid;		/* command identifier */
+  u32 nsid;		/* namespace */
+  u64 reserved0;
+  u64 mptr;		/* metadata pointer */
+  u64 prp1;		/* data pointers */
+  u64 prp2;
+  u32 cdw10;
+  u32 cdw11;
+  u32 cdw12;
+  u32 cdw13;
+  u32 cdw14;
+  u32 cdw15;
+};
+
+struct nvme_cqe {
+  u32 dw0;		/* command specific */
+  u32 reserved0;
+  u16 sq_head;
+  u16 sq_id;
+  u16 cid;
+  u16 status;		/* bit 0 is the phase tag */
+};
+
+#define NVME_CQE_PHASE(status)	((status) & 0x1)
+#define NVME_CQE_SC(status)	(((status) >> 1) & 0x7fff)
+
+/* Admin command set */
+enum {
+  NVME_ADMIN_CREATE_SQ       = 0x01,
+  NVME_ADMIN_CREATE_CQ       = 0x05,
+  NVME_ADMIN_IDENTIFY        = 0x06,
+  NVME_ADMIN_SET_FEATURES    = 0x09,
+};
+
+#define NVME_IDENTIFY_NS	0
+#define NVME_IDENTIFY_CTRL	1
+
+#define NVME_FEAT_NUM_QUEUES	0x07
+
+#define NVME_QUEUE_PHYS_CONTIG	(1 << 0)
+#define NVME_CQ_IRQ_ENABLED	(1 << 1)
+
+/* NVM command set */
+enum {
+  NVME_CMD_FLUSH             = 0x00,
+  NVME_CMD_WRITE             = 0x01,
+  NVME_CMD_READ              = 0x02,
+};
+
+#define NVME_RW_FUA		(1 << 30)	/* in cdw12 */
+
+struct nvme_id_ctrl {
+  u16 vid;
+  u16 ssvid;
+  char sn[20];
+  char mn[40];
+  char fr[8];
+  u8 rab;
+  u8 ieee[3];
+  u8 cmic;
+  u8 mdts;		/* max transfer size, log2 of min page size units */
+  u8 reserved0[438];
+  u32 nn;		/* number of namespaces */
+  u8 reserved1[3576];
+};
+
+struct nvme_lbaf {
+  u16 ms;		/* metadata size */
+  u8 lbads;		/* log2 of the LBA data size */
+  u8 rp;
+};
+
+struct nvme_id_ns {
+  u64 nsze;		/* namespace size, in LBAs */
+  u64 ncap;
+  u64 nuse;
+  u8 nsfeat;
+  u8 nlbaf;
+  u8 flbas;		/* formatted LBA size: bits 3:0 index lbaf[] */
+  u8 reserved0[101];
+  nvme_lbaf lbaf[16];
+  u8 reserved1[3904];
+};
+
+static_assert(sizeof(nvme_reg) == 0x38, "bad nvme_reg");
+static_assert(sizeof(nvme_sqe) == 64, "bad nvme_sqe");
+static_assert(sizeof(nvme_cqe) == 16, "bad nvme_cqe");
+static_assert(sizeof(nvme_id_ctrl) == 4096, "bad nvme_id_ctrl");
+static_assert(sizeof(nvme_id_ns) == 4096, "bad nvme_id_ns");
@@ -8,9 +8,12 @@
 #include "cpuid.hh"
 #include "sleeplock.hh"
 #include "lockwrap.hh"
+#include "kstats.hh"
 
 #include <atomic>
 #include <cstdint>
+#include <new>
+#include <type_traits>
 #include <utility>
 #include <vector>
 #include <algorithm>
@@ -273,56 +276,160 @@ namespace oplog {
   percpu<typename logged_object<Logger>::cache, NO_CRITICAL> logged_object<Logger>::cache_; 
 
   // The logger class used by tsc_logged_object.
+  //
+  // Logged operations are stored by value in the logger, along with a
+  // pair of function pointers to run and print them, rather than as
+  // heap-allocated virtual objects.  Logging an operation therefore
+  // costs no allocation beyond the (amortized) growth of the logger's
+  // op array.
+  //
+  // Since ordered loggers keep all of their operations around until
+  // someone synchronizes the object, every core keeps a count of the
+  // bytes of operations it has logged that are still pending.  When a
+  // core's count crosses OPLOG_PENDING_BYTES, the pressure handler set
+  // with set_pressure_handler() is called, so that the owner of the
+  // logged objects can synchronize them in the background.
   class tsc_logger
   {
   public:
-    class op
-    {
-    public:
-      NEW_DELETE_OPS(op);
-      const uint64_t tsc;
-      op(uint64_t tsc) : tsc(tsc) { }
-      virtual ~op() { }
-      virtual void run() = 0;
-      virtual void print() = 0;
+    enum {
+      // The largest callable that can be logged.
+      MAX_OP_SIZE = 32
     };
 
-  private:
-    template<class CB>
-    class op_inst : public op
+    class op
     {
-      CB cb_;
     public:
-      NEW_DELETE_OPS(op_inst);
-      op_inst(uint64_t tsc, CB &&cb) : op(tsc), cb_(cb) { }
-      ~op_inst() { }
+      uint64_t tsc;
 
-      void run() override
+      void run()
       {
-        cb_();
+        run_(cb_);
       }
-      void print() override
+
+      void print()
       {
-        cb_.print();
+        print_(cb_);
       }
+
+    private:
+      void (*run_)(void *cb);
+      void (*print_)(void *cb);
+      // The core whose pending count this operation is charged to.
+      uint16_t cpu_;
+      alignas(8) char cb_[MAX_OP_SIZE];
+
+      template<class CB>
+      static void run_cb(void *cb)
+      {
+        (*(CB*)cb)();
+      }
+
+      template<class CB>
+      static void print_cb(void *cb)
+      {
+        ((CB*)cb)->print();
+      }
+
+      friend class tsc_logger;
     };
 
+    // Set the function to call when a core's pending operations exceed
+    // OPLOG_PENDING_BYTES.  It is called with the core's number, from
+    // within push, while holding the logger's lock; it must not block.
+    static void set_pressure_handler(void (*fn)(int cpu))
+    {
+      pressure_fn_ = fn;
+    }
+
+  private:
+    struct pending_bytes
+    {
+      std::atomic<size_t> bytes;
+      constexpr pending_bytes() : bytes(0) { }
+    };
+
+    static percpu<pending_bytes, NO_CRITICAL> pending_bytes_;
+    static void (*pressure_fn_)(int cpu);
+
     // Logged operations in TSC order
-    std::vector<std::unique_ptr<op> > ops_;
+    std::vector<op> ops_;
     typedef decltype(ops_)::iterator op_iter;
 
+    template<class CB>
+    void emplace(uint64_t tsc, CB &&cb)
+    {
+      typedef typename std::decay<CB>::type cb_type;
+      static_assert(sizeof(cb_type) <= MAX_OP_SIZE &&
+                    alignof(cb_type) <= 8, "tsc_logger: callable too large");
+      // Ops are moved around and dropped as raw bytes.
+      static_assert(std::is_trivially_destructible<cb_type>::value,
+                    "tsc_logger: callable must be trivially destructible");
+
+      ops_.emplace_back();
+      op &o = ops_.back();
+      o.tsc = tsc;
+      o.run_ = &op::run_cb<cb_type>;
+      o.print_ = &op::print_cb<cb_type>;
+      new (o.cb_) cb_type(std::forward<CB>(cb));
+
+      // Charge this op to the core logging it.  Only the push that
+      // crosses the limit calls the pressure handler.
+      size_t cpu = myid();
+      o.cpu_ = cpu;
+      size_t old = pending_bytes_[cpu].bytes.fetch_add(
+        sizeof(op), std::memory_order_relaxed);
+      if (old < OPLOG_PENDING_BYTES &&
+          old + sizeof(op) >= OPLOG_PENDING_BYTES && pressure_fn_)
+        pressure_fn_(cpu);
+    }
+
+    // Return the ops in [it, end) to the pending counts of the cores
+    // that logged them.  A logger's ops mostly come from one core, so
+    // we batch runs of ops from the same core.
+    static void uncharge(op_iter it, op_iter end)
+    {
+      while (it != end) {
+        int cpu = it->cpu_;
+        size_t n = 0;
+        for (; it != end && it->cpu_ == cpu; ++it)
+          n += sizeof(op);
+        pending_bytes_[cpu].bytes.fetch_sub(n, std::memory_order_relaxed);
+      }
+    }
+
     void reset()
     {
+      uncharge(ops_.begin(), ops_.end());
       ops_.clear();
     }
 
+    // Drop the operations in [ops_.begin(), end).
+    void erase_ops_before(op_iter end)
+    {
+      uncharge(ops_.begin(), end);
+      ops_.erase(ops_.begin(), end);
+    }
+
     friend class tsc_logged_object;
     friend class mfs_logged_object;
 
   public:
     tsc_logger() = default;
     tsc_logger(tsc_logger &&o) = default;
-    tsc_logger &operator=(tsc_logger &&o) = default;
+
+    tsc_logger &operator=(tsc_logger &&o)
+    {
+      reset();
+      ops_ = std::move(o.ops_);
+      o.ops_.clear();
+      return *this;
+    }
+
+    ~tsc_logger()
+    {
+      reset();
+    }
 
     // Log the operation cb, which must be a callable.  cb will be
     // called with no arguments when the logs need to be
@@ -341,8 +448,7 @@ namespace oplog {
       // and the lock release also writes to memory, which
       // introduces a TSO dependency from the TSC memory write to
       // the lock release.
-      ops_.push_back(std::make_unique<op_inst<CB> >(
-                       get_tsc(), std::forward<CB>(cb)));
+      emplace(get_tsc(), std::forward<CB>(cb));
     }
 
     // Same as push<CB>, the only difference being that the tsc value is passed
@@ -352,11 +458,15 @@ namespace oplog {
     template<typename CB>
     void push_with_tsc(CB &&cb)
     {
-      ops_.push_back(std::make_unique<op_inst<CB> >(
-                       cb.get_timestamp(), std::forward<CB>(cb)));
+      uint64_t tsc = cb.get_timestamp();
+      emplace(tsc, std::forward<CB>(cb));
     }
 
-    static bool compare_tsc(const std::unique_ptr<op> &op1, const std::unique_ptr<op> &op2) {
+    static bool compare_tsc(const op &op1, const op &op2) {
+      return (op1.tsc < op2.tsc);
+    }
+
+    static bool compare_tsc_ptr(const op *op1, const op *op2) {
       return (op1->tsc < op2->tsc);
     }
 
@@ -366,7 +476,7 @@ namespace oplog {
     
     void print_ops() {
       for (auto it = ops_.begin(); it != ops_.end(); it++)
-        (*it)->print();
+        it->print();
     }
 
     // Returns an iterator 'it' where all operations in [ops_.begin(),
@@ -374,7 +484,7 @@ namespace oplog {
     op_iter ops_before_max_tsc(u64 max_tsc) {
       auto it = ops_.begin(), end = ops_.end();
       for (; it != end; it++)
-        if ((*it)->tsc > max_tsc)
+        if (it->tsc > max_tsc)
           break;
       return it;
     }
@@ -450,7 +560,7 @@ namespace oplog {
 
       struct pos { tsc_logger::op_iter next, end; };
       std::vector<pos> posns;
-      std::vector<std::unique_ptr<tsc_logger::op> > merged_ops;
+      std::vector<tsc_logger::op*> merged_ops;
       for(auto &logger : pending_) {
         if (logger.ops_.empty())
           continue;
@@ -462,20 +572,20 @@ namespace oplog {
 
       // Merge the operations using a heap of indices into posns
       auto compare = [&](size_t a, size_t b) -> bool {
-        return (*posns[a].next)->tsc > (*posns[b].next)->tsc;
+        return posns[a].next->tsc > posns[b].next->tsc;
       };
       std::priority_queue<size_t, std::vector<size_t>, decltype(compare)> heap(
         compare, seq_vector(posns.size()));
       while (!heap.empty()) {
         auto top = heap.top();
-        merged_ops.push_back(std::move(*posns[top].next));
+        merged_ops.push_back(&*posns[top].next);
         ++posns[top].next;
         heap.pop();
         if (posns[top].next != posns[top].end)
           heap.push(top);
       }
       assert(std::is_sorted(merged_ops.begin(), merged_ops.end(),
-                            tsc_logger::compare_tsc));
+                            tsc_logger::compare_tsc_ptr));
  
       for(auto &op : merged_ops)
         op->run();
@@ -525,7 +635,7 @@ namespace oplog {
         tsc_logger *logger;
       };
       std::vector<pos> posns;
-      std::vector<std::unique_ptr<tsc_logger::op> > merged_ops;
+      std::vector<tsc_logger::op*> merged_ops;
       for(auto &logger : pending_) {
         logger.sort_ops();
         auto end = logger.ops_before_max_tsc(max_tsc);
@@ -538,27 +648,27 @@ namespace oplog {
 
       // Merge the operations using a heap of indices into posns
       auto compare = [&](size_t a, size_t b) -> bool {
-        return (*posns[a].next)->tsc > (*posns[b].next)->tsc;
+        return posns[a].next->tsc > posns[b].next->tsc;
       };
       std::priority_queue<size_t, std::vector<size_t>, decltype(compare)> heap(
         compare, seq_vector(posns.size()));
       while (!heap.empty()) {
         auto top = heap.top();
-        merged_ops.push_back(std::move(*posns[top].next));
+        merged_ops.push_back(&*posns[top].next);
         ++posns[top].next;
         heap.pop();
         if (posns[top].next != posns[top].end)
           heap.push(top);
       }
       assert(std::is_sorted(merged_ops.begin(), merged_ops.end(),
-                            tsc_logger::compare_tsc));
+                            tsc_logger::compare_tsc_ptr));
 
       assert(merged_ops.front()->tsc >= synced_upto_tsc);
 
       for(auto &op : merged_ops)
         op->run();
       for(auto &pos : posns)
-        pos.logger->ops_.erase(pos.logger->ops_.begin(), pos.end);
+        pos.logger->erase_ops_before(pos.end);
 
       // Remove empty loggers from pending
       auto dst = pending_.begin();
@@ -609,6 +719,9 @@ namespace oplog {
       if (max_tsc <= synced_upto_tsc)
         return std::move(sync_spinlock_.guard());
 
+      kstats::inc(&kstats::oplog_sync_count);
+      kstats::timer timer(&kstats::oplog_sync_cycles);
+
       for (int i = 0; i < NCPU; i++) {
         // end_tsc <= start_tsc indicates that the core in question is executing
         // an operation that might not have been logged yet. We can only be sure
@@ -6,6 +6,7 @@
 #include "gc.hh"
 #include "types.h"
 #include "oplog.hh"
+#include "mmu.h"
 
 #include <cstddef>
 #include <vector>
@@ -65,97 +66,28 @@ class page_info : public PAGE_REFCOUNT referenced, public alloc_debug_info
 protected:
   void onzero()
   {
+    page_info *head = huge_head_;
     this->~page_info();
-    kfree(va());
+    if (!head)
+      kfree(va());
+    else if (head == this)
+      kfree(va(), HUGE_PGSIZE);
+    else
+      head->dec();
   }
 
 public:
-  typedef std::pair<vmap*, uptr> rmap_entry;
-  // rmap is a reverse map of the vmaps that contain a mapping for the page
-  // corresponding to this page_info. Rmap is implemented using oplog and is
-  // used when a file page is no longer valid and the vmaps mapping it need to
-  // be informed of the change.
-  #define MAX_OPS 1000000
-  class rmap: public tsc_logged_object {
-    public:
-      rmap(bool use_sleeplock) : tsc_logged_object(use_sleeplock) {}
-
-      NEW_DELETE_OPS(rmap);
-      // Oplog operation that implements adding a <vmap*,va> pair to the rmap
-      struct add_op {
-        add_op(rmap *p, rmap_entry map): parent(p), mapping(map) {
-          assert(p);
-        }
-        void operator()() {
-          std::vector<rmap_entry>::iterator it;
-          it = std::find(parent->rmap_vec.begin(), parent->rmap_vec.end(), mapping);
-          if(it == parent->rmap_vec.end())
-            parent->rmap_vec.push_back(std::move(mapping));
-        }
-        void print() {
-          cprintf("Rmap::add_op rmap:%016lX vmap:%016lX va:%016lX\n", 
-                      (u64)parent, (u64)mapping.first, mapping.second); 
-        }
-        private:
-        rmap *parent;
-        rmap_entry mapping;
-      };
-
-      // Oplog operation that implements removing a <vmap*,va> pair from the rmap
-      struct rem_op {
-        rem_op(rmap *p, rmap_entry map): parent(p), mapping(map) {
-          assert(p);
-        }
-        void operator()() {
-          if (parent->rmap_vec.size() == 0) return;
-          std::vector<rmap_entry>::iterator it;
-          it = std::find(parent->rmap_vec.begin(), parent->rmap_vec.end(), mapping);
-          if(it != parent->rmap_vec.end()) {
-            it->first = parent->rmap_vec.back().first;
-            it->second = parent->rmap_vec.back().second;
-            parent->rmap_vec.pop_back();
-          }
-        }
-        void print() {
-          cprintf("Rmap::rem_op rmap:%016lX vmap:%016lX va:%016lX\n", 
-                      (u64)parent, (u64)mapping.first, mapping.second);
-        }
-        private:
-        rmap *parent;
-        rmap_entry mapping;
-      };
-
-      void add_mapping(rmap_entry map) {
-        get_logger(myid())->push<add_op>(add_op(this, map));
-      }
-
-      void remove_mapping(rmap_entry map) {
-        get_logger(myid())->push<rem_op>(rem_op(this, map));
-      }
-
-      void sync(std::vector<rmap_entry> &vec) {
-        auto guard = synchronize_with_spinlock();
-        for (auto it = rmap_vec.begin(); it != rmap_vec.end(); it++)
-          vec.emplace_back(*it);
-        rmap_vec.clear();
-      }
-
-      void sync() {
-        auto guard = synchronize_with_spinlock();
-      }
-
-    protected:
-      std::vector<rmap_entry> rmap_vec;
-  };
-
-  page_info() {
-    rmap_pte = new rmap(false); // use_sleeplock = false.
-    for (int cpu = 0; cpu < NCPU; cpu++)
-      outstanding_ops[cpu] = 0;
-  }
-
-  ~page_info() {
-    delete rmap_pte;
+  // If huge_head is non-null, this is one of the pages of a huge
+  // (HUGE_PGSIZE) allocation whose first page's page_info is
+  // huge_head, which may be this page_info itself.  Each page of a
+  // huge allocation is reference counted on its own, but the other
+  // pages hold a reference to the head, so the allocation is freed
+  // as a whole once none of its pages are referenced.
+  page_info(page_info *huge_head = nullptr)
+    : huge_head_(huge_head), recently_used_(false), on_clock_(false),
+      writeback_(false) {
+    if (huge_head && huge_head != this)
+      huge_head->inc();
   }
 
   // Only placement new is allowed, because page_info must only be
@@ -200,42 +132,54 @@ public:
     return p2v(pa());
   }
 
-  // Add an entry to the rmap for this page
-  void add_pte(rmap_entry map) {
-    assert(rmap_pte);
-    int cpu = myid();
-    if (outstanding_ops[cpu] > MAX_OPS) {
-      rmap_pte->sync();
-      outstanding_ops[cpu] = 0;
-    }
-    rmap_pte->add_mapping(map);
-    outstanding_ops[cpu]++;
+  // The head page of the huge allocation this page belongs to, or
+  // null if it is an ordinary page.
+  page_info *huge_head() const
+  {
+    return huge_head_;
+  }
+
+  // CLOCK reference bit for page-cache pages (see pagecache_reclaim()).
+  // Set on every page-cache hit; only written when it changes, so that hot
+  // pages shared by many cores don't bounce the cache line.
+  void mark_used() {
+    if (!recently_used_.load(std::memory_order_relaxed))
+      recently_used_.store(true, std::memory_order_relaxed);
+  }
+
+  bool recently_used() const {
+    return recently_used_.load(std::memory_order_relaxed);
+  }
+
+  bool test_and_clear_used() {
+    if (!recently_used_.load(std::memory_order_relaxed))
+      return false;
+    return recently_used_.exchange(false, std::memory_order_relaxed);
+  }
+
+  // Whether the page is on a CLOCK list.  Returns the old value.
+  bool set_on_clock() {
+    if (on_clock_.load(std::memory_order_relaxed))
+      return true;
+    return on_clock_.exchange(true);
   }
 
-  // Remove an entry from the rmap for this page
-  void remove_pte(rmap_entry map) {
-    assert(rmap_pte);
-    int cpu = myid();
-    if (outstanding_ops[cpu] > MAX_OPS) {
-      rmap_pte->sync();
-      outstanding_ops[cpu] = 0;
-    }
-    rmap_pte->remove_mapping(map);
-    outstanding_ops[cpu]++;
+  // Set while a page-cache page is being written to its blocks on the disk
+  // (see data_writeback), so that it isn't evicted and read back from blocks
+  // that are still being written.
+  void set_writeback(bool wb) {
+    writeback_.store(wb, std::memory_order_release);
   }
 
-  // Synchronizes the oplog-maintained rmap and returns the <vmap, vaddr> pairs
-  // that have this page mapped.
-  void get_rmap_vector(std::vector<rmap_entry> &vec) {
-    assert(rmap_pte);
-    int cpu = myid();
-    rmap_pte->sync(vec);
-    outstanding_ops[cpu] = 0;
+  bool under_writeback() const {
+    return writeback_.load(std::memory_order_acquire);
   }
 
 private:
-  rmap *rmap_pte;
-  percpu<u64> outstanding_ops;
+  page_info *huge_head_;
+  std::atomic<bool> recently_used_;
+  std::atomic<bool> on_clock_;
+  std::atomic<bool> writeback_;
 
 } __attribute__((aligned(16)));
 
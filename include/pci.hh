@@ -23,6 +23,7 @@ struct pci_func {
   // Interrupt pin.  0=none, 1=INTA, .. 4=INTB
   u8 int_pin;
   u8 msi_capreg;
+  u8 msix_capreg;
 };
 
 struct pci_bus {
@@ -37,7 +38,12 @@ void pci_register_class_driver(u32 class_id, u32 subclass_id,
                                int (*attachfn)(struct pci_func *pcif));
 
 void pci_func_enable(struct pci_func *f);
-irq pci_map_msi_irq(struct pci_func *f);
+// Route @f's MSI to a fresh IRQ delivered to @cpu, or, if @cpu is -1,
+// to whichever CPU irq_spread_cpu() picks.
+irq pci_map_msi_irq(struct pci_func *f, int cpu = -1);
+int pci_msix_vectors(struct pci_func *f);
+irq pci_map_msix_irq(struct pci_func *f, int entry, int cpu);
+void pci_enable_msix(struct pci_func *f);
 
 u32 pci_conf_read(u32 seg, u32 bus, u32 dev, u32 func, u32 offset, int width);
 void pci_conf_write(u32 seg, u32 bus, u32 dev, u32 func, u32 offset,
@@ -169,6 +169,7 @@ typedef u8 pci_revision_t;
 #define	PCI_SUBCLASS_MASS_STORAGE_RAID		0x04
 #define	PCI_SUBCLASS_MASS_STORAGE_ATA		0x05
 #define	PCI_SUBCLASS_MASS_STORAGE_SATA		0x06
+#define	PCI_SUBCLASS_MASS_STORAGE_NVM		0x08
 #define	PCI_SUBCLASS_MASS_STORAGE_MISC		0x80
 
 /* 0x02 network subclasses */
@@ -446,6 +447,19 @@ typedef u8 pci_revision_t;
 #define PCI_MSI_MCR_MMC(cr)     (((cr) >> 17) & 0x7)
 #define PCI_MSI_MCR_64BIT       0x00800000
 
+/*
+ * MSI-X Capability; access via capability pointer.  The message control
+ * register is in the upper half of the first dword; the second dword locates
+ * the vector table in one of the function's BARs.
+ */
+#define PCI_MSIX_MCR_TBLSIZE(cr) ((((cr) >> 16) & 0x7ff) + 1)
+#define PCI_MSIX_MCR_MASK       0x40000000
+#define PCI_MSIX_MCR_ENABLE     0x80000000
+#define PCI_MSIX_TBL_BIR(r)     ((r) & 0x7)
+#define PCI_MSIX_TBL_OFFSET(r)  ((r) & ~0x7)
+#define PCI_MSIX_ENTRY_SIZE     16
+#define PCI_MSIX_ENTRY_MASKED   0x1
+
 /*
  * Power Management Capability; access via capability pointer.
  */
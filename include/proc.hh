@@ -9,6 +9,7 @@
 #include "ilist.hh"
 #include <stdexcept>
 #include "vmalloc.hh"
+#include "faultstats.h"
 
 struct pgmap;
 struct gc_handle;
@@ -48,6 +49,15 @@ struct mtrace_stacks {
 };
 #endif
 
+// Scheduling classes, in priority order: each core runs its runnable
+// kernel worker threads (those created by threadalloc) before its user
+// processes.
+enum sched_class : u8 {
+  SCHED_CLASS_KERNEL = 0,
+  SCHED_CLASS_NORMAL,
+  NSCHED_CLASS
+};
+
 typedef enum procstate { 
   EMBRYO,
   SLEEPING,
@@ -62,7 +72,6 @@ typedef enum procstate {
 struct proc {
   sref<vmap> vmap;             // va -> vma
   char *kstack;                // Bottom of kernel stack for this process
-  vmalloc_ptr<char[]> kstack_vm; // vmalloc'd kstack, if using vmalloc
   volatile int pid;            // Process ID
   struct proc *parent;         // Parent process
   int status;                  // exit's returns status
@@ -75,6 +84,9 @@ struct proc {
   char name[16];               // Process name (debugging)
   u64 tsc;
   u64 curcycles;
+  u64 cputime;                 // Total cycles run
+  struct pagefault_stats faults; // Page faults taken by this process
+  struct pagefault_stats child_faults; // By exited children; under lock
   unsigned cpuid;
   void *fpu_state;             // FXSAVE state, lazily allocated
   struct spinlock lock;
@@ -90,9 +102,15 @@ struct proc {
 #endif
   struct condvar *oncv;        // Where it is sleeping, for kill()
   u64 cv_wakeup;               // Wakeup time for this process
+  int cv_wheel;                // Core whose timer wheel has cv_wakeup
   ilink<proc> cv_waiters;      // Linked list of processes waiting for oncv
   ilink<proc> cv_sleep;        // Linked list of processes sleeping on a cv
   struct spinlock futex_lock;
+  // The futex this process waits on, which it holds a reference to,
+  // and whether it's still queued there (rather than woken).  A
+  // requeue moves it to another futex.  Protected by futex_lock.
+  struct futexaddr *futex_fa;
+  bool futex_queued;
   u64 user_fs_;
   u64 unmap_tlbreq_;
   int data_cpuid;              // Where vmap and kstack is likely to be cached
@@ -100,6 +118,9 @@ struct proc {
   int in_exec_;
   int uaccess_;
   bool yield_;                 // yield cpu up when returning to user space
+  u8 sched_class;              // enum sched_class
+  u32 slice_ticks;             // Timer ticks since last scheduled
+  u64 enq_tsc;                 // When last put on a run queue
 
   userptr_str upath;
   userptr<userptr_str> uargv;
@@ -118,6 +139,11 @@ struct proc {
   int          set_cpu_pin(int cpu);
   static int   kill(int pid);
   int          kill();
+  // Timer ticks this proc runs before it is preempted.
+  u32          slice() const {
+    return sched_class == SCHED_CLASS_KERNEL ? SCHED_KERNEL_TICKS :
+      SCHED_NORMAL_TICKS;
+  }
   bool         cansteal(bool nonexec) {
     return (get_state() == RUNNABLE && !cpu_pin && 
           (in_exec_ || nonexec) &&
@@ -883,6 +883,46 @@ public:
     return true;
   }
 
+  /**
+   * A run of consecutive set elements, starting at index #index.  If
+   * #compressed, the run is (part of) a range-compressed region and
+   * every element is <tt>*values</tt>; otherwise the elements are
+   * <tt>values[0..count)</tt>, which lie in a single leaf node.
+   */
+  struct run
+  {
+    key_type index;
+    size_type count;
+    value_type *values;
+    bool compressed;
+
+    value_type &operator[](size_type i) const
+    {
+      return compressed ? values[0] : values[i];
+    }
+  };
+
+  /**
+   * Call <tt>cb(const run&)</tt> for each run of set elements in
+   * <tt>[low, high)</tt>, in index order, until it returns true.
+   * Runs never span more than one node.
+   *
+   * This walks the tree directly instead of re-descending it from an
+   * iterator, skips unset subtrees without visiting them, and
+   * prefetches the nodes it's about to visit.  It takes no locks:
+   * like dereferencing an iterator, it can race with modifications,
+   * which may or may not be seen.  The callback may modify the array
+   * (nodes are never freed while the array exists).
+   */
+  template<class CB>
+  void for_each_run(key_type low, key_type high, CB cb)
+  {
+    if (high > N)
+      high = N;
+    if (low < high)
+      walk_runs(get_root_ptr().as_upper_node(), LEVELS, 0, low, high, cb);
+  }
+
   /**
    * Copy-assign all values in the range <tt>[low, high)</tt> to @c x.
    *
@@ -1084,6 +1124,85 @@ public:
     return l;
   }
 
+private:
+  /** How many child slots ahead #walk_runs() prefetches. */
+  static constexpr unsigned RUN_PREFETCH = 4;
+
+  static void prefetch_node(node_ptr p)
+  {
+    if (!p.is_null())
+      __builtin_prefetch(reinterpret_cast<void*>(p.v & ~node_ptr::mask));
+  }
+
+  /**
+   * Visit the children of @c unode, a node at @c level that starts at
+   * key @c base, for #for_each_run().  Returns true if @c cb did.
+   */
+  template<class CB>
+  bool walk_runs(upper_node *unode, unsigned level, key_type base,
+                 key_type low, key_type high, CB &cb)
+  {
+    key_type span = level_span(level);
+    unsigned fanout = level == LEVELS ? 1 : UPPER_FANOUT;
+    unsigned i = low > base ? subkey(low, level) : 0;
+
+    for (unsigned j = i; j < i + RUN_PREFETCH && j < fanout; ++j)
+      prefetch_node(unode->child[j].load(std::memory_order_relaxed));
+
+    for (; i < fanout; ++i) {
+      key_type k = base + i * span;
+      if (k >= high)
+        break;
+      if (i + RUN_PREFETCH < fanout)
+        prefetch_node(unode->child[i + RUN_PREFETCH].load(
+                        std::memory_order_relaxed));
+
+      node_ptr child(unode->child[i]);
+      switch (child.get_type()) {
+      case node_ptr::NONE:
+        break;
+      case node_ptr::EXTERNAL: {
+        key_type start = k < low ? low : k;
+        key_type end = k + span > high ? high : k + span;
+        run r{start, end - start, child.as_external(), true};
+        if (cb(r))
+          return true;
+        break;
+      }
+      case node_ptr::UPPER:
+        if (walk_runs(child.as_upper_node(), level - 1, k, low, high, cb))
+          return true;
+        break;
+      case node_ptr::LEAF:
+        if (walk_leaf_runs(child.as_leaf_node(), k, low, high, cb))
+          return true;
+        break;
+      }
+    }
+    return false;
+  }
+
+  template<class CB>
+  bool walk_leaf_runs(leaf_node *leaf, key_type base,
+                      key_type low, key_type high, CB &cb)
+  {
+    unsigned i = low > base ? subkey(low, 0) : 0;
+    unsigned end = high - base < LEAF_FANOUT ? high - base : LEAF_FANOUT;
+    while (i < end) {
+      if (!leaf->child[i].is_set()) {
+        ++i;
+        continue;
+      }
+      unsigned start = i;
+      while (i < end && leaf->child[i].is_set())
+        ++i;
+      run r{base + start, i - start, &leaf->child[start], false};
+      if (cb(r))
+        return true;
+    }
+    return false;
+  }
+
 private:
   typename ZAllocator::template rebind<upper_node>::other upper_node_alloc_;
   typename ZAllocator::template rebind<leaf_node>::other leaf_node_alloc_;
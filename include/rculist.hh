@@ -0,0 +1,147 @@
+#pragma once
+
+/**
+ * An intrusive singly-linked list that can be traversed by readers
+ * that don't hold the lock protecting its modifications.  It has the
+ * same API as islist, but every store that links an element into the
+ * list is a release store, so a reader that follows a link sees the
+ * element fully constructed, and every link is read with an acquire
+ * load.  Erasing an element leaves its own link intact, so readers
+ * that are already on it move on to the rest of the list as usual;
+ * the caller must not free erased elements until those readers are
+ * done (e.g., with gc_delayed, with readers in a scoped_gc_epoch).
+ *
+ * Writers must still exclude each other, typically with a lock.
+ */
+
+#include "ilist.hh"
+#include <atomic>
+
+template<typename T>
+struct rcu_slink
+{
+  std::atomic<T*> next;
+
+  constexpr rcu_slink() : next(nullptr) { }
+};
+
+template<typename T, rcu_slink<T> T::* L>
+struct rcu_sliterator
+{
+  T* elem;
+
+  constexpr rcu_sliterator() : elem(nullptr) { }
+  constexpr rcu_sliterator(T* e) : elem(e) { }
+
+  T& operator*() const noexcept
+  {
+    return *elem;
+  }
+
+  T* operator->() const noexcept
+  {
+    return elem;
+  }
+
+  bool operator==(const rcu_sliterator &o) const noexcept
+  {
+    return o.elem == elem;
+  }
+
+  bool operator!=(const rcu_sliterator &o) const noexcept
+  {
+    return o.elem != elem;
+  }
+
+  rcu_sliterator &operator++() noexcept
+  {
+    elem = (elem->*L).next.load(std::memory_order_acquire);
+    return *this;
+  }
+
+  rcu_sliterator operator++(int) noexcept
+  {
+    rcu_sliterator cur = *this;
+    ++(*this);
+    return cur;
+  }
+};
+
+template<typename T, rcu_slink<T> T::* L>
+struct rcu_slist
+{
+  typedef rcu_sliterator<T, L> iterator;
+
+  rcu_slink<T> head;
+
+  constexpr rcu_slist() { }
+
+  rcu_slist(const rcu_slist &o) = delete;
+  rcu_slist &operator=(const rcu_slist &o) = delete;
+
+  iterator
+  before_begin() noexcept
+  {
+    return iterator(container_from_member(&head, L));
+  }
+
+  iterator
+  begin() const noexcept
+  {
+    return iterator(head.next.load(std::memory_order_acquire));
+  }
+
+  iterator
+  end() const noexcept
+  {
+    return iterator(nullptr);
+  }
+
+  bool
+  empty() const noexcept
+  {
+    return head.next.load(std::memory_order_relaxed) == nullptr;
+  }
+
+  T&
+  front() const noexcept
+  {
+    return *head.next.load(std::memory_order_acquire);
+  }
+
+  void
+  push_front(T *x) noexcept
+  {
+    (x->*L).next.store(head.next.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+    head.next.store(x, std::memory_order_release);
+  }
+
+  void
+  pop_front() noexcept
+  {
+    T *x = head.next.load(std::memory_order_relaxed);
+    head.next.store((x->*L).next.load(std::memory_order_relaxed),
+                    std::memory_order_release);
+  }
+
+  iterator
+  insert_after(iterator pos, T* x) noexcept
+  {
+    auto &prev = (pos.elem->*L).next;
+    (x->*L).next.store(prev.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+    prev.store(x, std::memory_order_release);
+    return iterator(x);
+  }
+
+  iterator
+  erase_after(iterator pos) noexcept
+  {
+    auto &prev = (pos.elem->*L).next;
+    T *x = prev.load(std::memory_order_relaxed);
+    T *next = (x->*L).next.load(std::memory_order_relaxed);
+    prev.store(next, std::memory_order_release);
+    return iterator(next);
+  }
+};
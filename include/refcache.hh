@@ -147,6 +147,18 @@
 // scalable schemes are possible, such as the tree-based quiescent
 // state detection scheme used by Linux's hierarchical RCU
 // implementation [http://lwn.net/Articles/305782/].
+//
+// Epochs normally end every tick or so, since each core flushes from
+// its timer interrupt.  When a core's review list grows past
+// REFCACHE_HURRY_OBJECTS (say, during fork/exec or create/unlink
+// churn), that core asks the others to hurry, and while any core is
+// hurried, cores also flush on the way out of system calls and in the
+// idle loop, once per epoch, so epochs (and hence frees) come as fast
+// as cores pass through those points.
+//
+// Finally, an object whose count has only ever been changed by one
+// core doesn't need any of this: that core sees its true count, so
+// referenced::dec_local() frees it as soon as it drops to zero.
 
 #pragma once
 
@@ -162,6 +174,8 @@
 #include <stdexcept>
 #include <limits.h>
 
+class print_stream;
+
 #ifndef REFCACHE_DEBUG
 #define REFCACHE_DEBUG 1
 #endif
@@ -173,6 +187,10 @@ namespace refcache {
 
   template<class T> class weakref;
 
+  // The number of cores whose review lists are long enough that they
+  // want epochs to end sooner.
+  extern std::atomic<int> hurried_cores;
+
   // Base class for an object that's reference counted using the
   // refcaching scheme.
   class referenced
@@ -233,6 +251,18 @@ namespace refcache {
     void inc();
     void dec();
     u64 get_consistent();
+    // The global count plus this core's delta, without looking at any
+    // other core's cache.  Changes that other cores have yet to flush
+    // (which they do within an epoch or so) are missing from it.
+    u64 get_approx();
+
+    // Like dec(), for an object whose reference count only the current
+    // core has ever changed (for example, one that was never
+    // published).  If this drops the last reference, the object is
+    // handed to this core's reaper right away rather than after two
+    // epochs.  The caller must not migrate between taking and dropping
+    // its references.
+    void dec_local();
 
   protected:
     // We could eliminate these virtual methods and the vtable
@@ -422,6 +452,17 @@ namespace refcache {
     // The last global epoch number observed by this core.
     uint64_t local_epoch;
 
+    // The length of review_, and whether this core counts itself in
+    // hurried_cores because of it.
+    size_t nreview_ = 0;
+    bool hurried_ = false;
+
+    // Statistics for print_stats: objects reviewed, dirty zeros among
+    // them, and capacity evictions.
+    uint64_t nreviewed_ = 0;
+    uint64_t ndirty_zero_ = 0;
+    uint64_t nconflict_ = 0;
+
     // Return the way in which a particular object's delta could be stored.
     way *hash_way(referenced *obj)
     {
@@ -451,6 +492,7 @@ namespace refcache {
           // global_epoch.
           evict(way, false);
           kstats::inc(&kstats::refcache_conflict_count);
+          ++nconflict_;
         }
         // Take this entry
         auto w = way->seq.write_begin();
@@ -480,6 +522,13 @@ namespace refcache {
     // call may be active at a time per core.
     void review();
 
+    // Join or leave hurried_cores depending on the length of the
+    // review list.
+    void update_hurry();
+
+    // Hand obj to the reaper.
+    void reap(referenced *obj);
+
   public:
     cache() = default;
     cache(const cache &o) = delete;
@@ -492,17 +541,39 @@ namespace refcache {
     // three times the delay between calls to tic.
     void tick();
 
+    // Flush and review early because some core is hurried, unless this
+    // core has already flushed in the current epoch.  Interrupts must
+    // be disabled.
+    void hurry();
+
     // Reap dead objects.  This is done in a dedicated thread to
     // avoid deadlock with threads preempted by the timer interrupt.
     void reaper() __attribute__((noreturn));
+
+    friend void print_stats(print_stream *s);
   };
 
+  // Print each core's review list length, how many of its reviews
+  // found a dirty zero, and its cache conflicts.
+  void print_stats(print_stream *s);
+
   // Per-CPU reference delta cache.  In general this has to be
   // accessed with interrupts disabled or by a pinned process to
   // prevent migration.  Some fields of cache specifically require
   // interrupts to be disabled to prevent concurrent access.
   DECLARE_PERCPU(cache, mycache);
 
+  // Called where a core holds no locks and can afford a refcache flush,
+  // such as on return from a system call.
+  inline void
+  maybe_flush()
+  {
+    if (__builtin_expect(hurried_cores.load(std::memory_order_relaxed), 0)) {
+      scoped_cli cli;
+      mycache->hurry();
+    }
+  }
+
   inline void
   referenced::inc()
   {
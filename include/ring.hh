@@ -0,0 +1,204 @@
+#pragma once
+
+/*
+ * Bounded ring buffers for passing small values (typically pointers)
+ * between cores without locks.
+ *
+ * spsc_ring has one producer and one consumer; both push and pop are
+ * wait-free.  mpsc_ring has any number of producers and one consumer:
+ * producers claim slots with a compare-and-swap on the tail (so pushes
+ * are lock-free, not wait-free), and each slot carries a sequence
+ * number that says whether it is empty or full in the current lap, so
+ * the consumer is wait-free and never touches the producers' cache
+ * line.  In both, the producer and consumer indices live on separate
+ * cache lines.
+ *
+ * Push fails when the ring is full; callers decide what to do about
+ * that (for example, fall back to a locked list).  N must be a power of
+ * two and T must be cheap to copy.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+
+template<class T, std::size_t N>
+class spsc_ring
+{
+  static_assert(N && (N & (N - 1)) == 0, "N must be a power of 2");
+
+  struct {
+    std::atomic<std::size_t> tail;
+    // The producer's copy of head, refreshed when the ring looks full.
+    std::size_t head_cache;
+  } prod_ __mpalign__;
+
+  struct {
+    std::atomic<std::size_t> head;
+    // The consumer's copy of tail, refreshed when the ring looks empty.
+    std::size_t tail_cache;
+  } cons_ __mpalign__;
+
+  T slots_[N] __mpalign__;
+
+public:
+  spsc_ring() : prod_{{0}, 0}, cons_{{0}, 0} { }
+
+  spsc_ring(const spsc_ring &o) = delete;
+  spsc_ring &operator=(const spsc_ring &o) = delete;
+
+  // Push up to n values.  Returns the number pushed.  Producer only.
+  std::size_t push(const T *v, std::size_t n)
+  {
+    std::size_t tail = prod_.tail.load(std::memory_order_relaxed);
+    if (N - (tail - prod_.head_cache) < n)
+      prod_.head_cache = cons_.head.load(std::memory_order_acquire);
+    std::size_t room = N - (tail - prod_.head_cache);
+    if (n > room)
+      n = room;
+    for (std::size_t i = 0; i < n; i++)
+      slots_[(tail + i) & (N - 1)] = v[i];
+    prod_.tail.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+  bool push(const T &v)
+  {
+    return push(&v, 1) == 1;
+  }
+
+  // Pop up to n values into v.  Returns the number popped.  Consumer
+  // only.
+  std::size_t pop(T *v, std::size_t n)
+  {
+    std::size_t head = cons_.head.load(std::memory_order_relaxed);
+    if (cons_.tail_cache - head < n)
+      cons_.tail_cache = prod_.tail.load(std::memory_order_acquire);
+    std::size_t avail = cons_.tail_cache - head;
+    if (n > avail)
+      n = avail;
+    for (std::size_t i = 0; i < n; i++)
+      v[i] = slots_[(head + i) & (N - 1)];
+    cons_.head.store(head + n, std::memory_order_release);
+    return n;
+  }
+
+  bool pop(T *v)
+  {
+    return pop(v, 1) == 1;
+  }
+
+  // May be stale by the time it returns, unless called by the
+  // consumer, in which case a false answer stays false.
+  bool empty() const
+  {
+    return prod_.tail.load(std::memory_order_acquire) ==
+      cons_.head.load(std::memory_order_relaxed);
+  }
+};
+
+template<class T, std::size_t N>
+class mpsc_ring
+{
+  static_assert(N && (N & (N - 1)) == 0, "N must be a power of 2");
+
+  // A slot is free for the push that claims position p when seq == p,
+  // and holds that push's value when seq == p + 1.
+  struct slot
+  {
+    std::atomic<std::size_t> seq;
+    T val;
+  };
+
+  std::atomic<std::size_t> tail_ __mpalign__;
+  std::size_t head_ __mpalign__;
+  slot slots_[N] __mpalign__;
+
+  // Claim positions [pos, pos + n), shrinking n to what's free.
+  // Returns false if nothing is free.
+  bool claim(std::size_t *pos, std::size_t *n)
+  {
+    std::size_t p = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      // The consumer frees slots in order, so if the first slot is
+      // free, find how many after it are.
+      std::size_t k = 0;
+      while (k < *n &&
+             slots_[(p + k) & (N - 1)].seq.load(std::memory_order_acquire)
+             == p + k)
+        k++;
+      if (k == 0) {
+        std::size_t seq =
+          slots_[p & (N - 1)].seq.load(std::memory_order_acquire);
+        if ((std::ptrdiff_t)(seq - p) < 0)
+          return false;
+        // Another producer got p first.
+        p = tail_.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (tail_.compare_exchange_weak(p, p + k, std::memory_order_relaxed)) {
+        *pos = p;
+        *n = k;
+        return true;
+      }
+    }
+  }
+
+public:
+  mpsc_ring() : tail_(0), head_(0)
+  {
+    for (std::size_t i = 0; i < N; i++)
+      slots_[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  mpsc_ring(const mpsc_ring &o) = delete;
+  mpsc_ring &operator=(const mpsc_ring &o) = delete;
+
+  // Push up to n values.  Returns the number pushed; the values pushed
+  // by one call are popped consecutively.  Any core.
+  std::size_t push(const T *v, std::size_t n)
+  {
+    std::size_t pos;
+    if (n == 0 || !claim(&pos, &n))
+      return 0;
+    for (std::size_t i = 0; i < n; i++) {
+      slot *s = &slots_[(pos + i) & (N - 1)];
+      s->val = v[i];
+      s->seq.store(pos + i + 1, std::memory_order_release);
+    }
+    return n;
+  }
+
+  bool push(const T &v)
+  {
+    return push(&v, 1) == 1;
+  }
+
+  // Pop up to n values into v.  Returns the number popped.  A claimed
+  // slot whose push hasn't finished ends the batch.  Consumer only.
+  std::size_t pop(T *v, std::size_t n)
+  {
+    std::size_t i = 0;
+    for (; i < n; i++) {
+      slot *s = &slots_[head_ & (N - 1)];
+      if (s->seq.load(std::memory_order_acquire) != head_ + 1)
+        break;
+      v[i] = s->val;
+      s->seq.store(head_ + N, std::memory_order_release);
+      head_++;
+    }
+    return i;
+  }
+
+  bool pop(T *v)
+  {
+    return pop(v, 1) == 1;
+  }
+
+  // Consumer only.
+  bool empty() const
+  {
+    return slots_[head_ & (N - 1)].seq.load(std::memory_order_acquire)
+      != head_ + 1;
+  }
+};
@@ -24,14 +24,21 @@ struct perf_selector
   // If non-zero, record the current instruction pointer every
   // 'period' events.
   uint64_t period;
+  // Instead of sampling events, record every time a thread sleeps, with
+  // the call chain it slept in and how long it was off the CPU, in
+  // microseconds, as the count.
+  bool offcpu;
 };
 
-#define NTRACE 4
+// Return addresses of the callers of rip, innermost first, found by
+// following frame pointers (user ones too, for user-mode samples).
+#define NTRACE 8
 
 struct pmuevent {
   u8 idle:1;
   u8 ints_disabled:1;
   u8 kernel:1;
+  u8 offcpu:1;
   u32 count;
   u64 rip;
   uptr trace[NTRACE];
@@ -6,6 +6,10 @@
 #include "oplog.hh"
 #include "bitset.hh"
 #include "disk.hh"
+#include "extenttree.hh"
+#include "kmcache.hh"
+#include "arena.hh"
+#include "page_info.hh"
 #include <vector>
 #include <algorithm>
 
@@ -53,9 +57,129 @@ struct tx_queue_info {
   tx_queue_info(tx_queue_info&&) = default;
 };
 
+// An open-addressing hash table that maps disk block numbers to small integers
+// (positions in one of a transaction's vectors). A transaction is only ever
+// built up by one thread at a time, so unlike linearhash this needs no locks,
+// and it grows as required, which keeps per-block bookkeeping O(1) even for the
+// very large transactions formed by group commit.
+class blocknum_index {
+  public:
+    explicit blocknum_index(arena *a = nullptr)
+      : alloc_(a), slots_(nullptr), nslots_(0), count_(0) {}
+    ~blocknum_index() { free_slots(slots_, nslots_); }
+
+    blocknum_index(const blocknum_index&) = delete;
+    blocknum_index& operator=(const blocknum_index&) = delete;
+
+    bool lookup(u32 bno, u32 *valptr) const
+    {
+      if (!nslots_)
+        return false;
+
+      for (u32 i = hash(bno); ; i = (i + 1) & (nslots_ - 1)) {
+        if (!slots_[i].used)
+          return false;
+        if (slots_[i].bno == bno) {
+          *valptr = slots_[i].val;
+          return true;
+        }
+      }
+    }
+
+    // Insert or overwrite the value for bno.
+    void insert(u32 bno, u32 val)
+    {
+      // Keep the load factor under 1/2.
+      if (2 * (count_ + 1) > nslots_)
+        grow();
+
+      u32 i = hash(bno);
+      for ( ; slots_[i].used; i = (i + 1) & (nslots_ - 1)) {
+        if (slots_[i].bno == bno) {
+          slots_[i].val = val;
+          return;
+        }
+      }
+      slots_[i].used = true;
+      slots_[i].bno = bno;
+      slots_[i].val = val;
+      count_++;
+    }
+
+    void clear()
+    {
+      for (u32 i = 0; i < nslots_; i++)
+        slots_[i].used = false;
+      count_ = 0;
+    }
+
+  private:
+    struct slot {
+      slot() : used(false) {}
+      bool used;
+      u32 bno;
+      u32 val;
+    };
+
+    u32 hash(u32 bno) const
+    {
+      // Fibonacci hashing; the table size is always a power of two.
+      return (u32)(bno * 2654435761U) & (nslots_ - 1);
+    }
+
+    void grow()
+    {
+      slot *old_slots = slots_;
+      u32 old_nslots = nslots_;
+
+      nslots_ = old_nslots ? 2 * old_nslots : 64;
+      slots_ = alloc_.allocate(nslots_);
+      for (u32 i = 0; i < nslots_; i++)
+        alloc_.construct(&slots_[i]);
+      count_ = 0;
+      for (u32 i = 0; i < old_nslots; i++)
+        if (old_slots[i].used)
+          insert(old_slots[i].bno, old_slots[i].val);
+      free_slots(old_slots, old_nslots);
+    }
+
+    void free_slots(slot *slots, u32 nslots)
+    {
+      if (slots)
+        alloc_.deallocate(slots, nslots);
+    }
+
+    arena_allocator<slot> alloc_;
+    slot *slots_;
+    u32 nslots_;
+    u32 count_;
+};
+
+// Sort a vector of block or inode numbers and drop the duplicates, in place.
+template<class Vec>
+static inline void
+sort_unique(Vec &vec)
+{
+  std::sort(vec.begin(), vec.end());
+
+  auto out = vec.begin();
+  for (auto in = vec.begin(); in != vec.end(); in++) {
+    if (out == vec.begin() || *in != *(out - 1))
+      *out++ = *in;
+  }
+  vec.erase(out, vec.end());
+}
+
 // A single disk block that was updated as the result of a transaction. All
 // diskblocks that were written to during the transaction are stored as a linked
 // list in the transaction object.
+//
+// A diskblock added from the bufcache (buf::add_to_transaction()) doesn't copy
+// the block: it shares the buf's contents until the buf is written to again,
+// at which point the writer first hands the diskblock a private copy (see
+// unshare()). Anyone reading blockdata after the diskblock has been added to a
+// transaction must do so under pin(), which makes such a writer wait until the
+// read (or the disk write) is over.
 struct transaction_diskblock {
   u32 blocknum;           // The disk block number
   char *blockdata;        // Disk block contents
@@ -66,9 +190,9 @@ struct transaction_diskblock {
 
   sref<disk_completion> dc;
 
-  NEW_DELETE_OPS(transaction_diskblock);
+  NEW_DELETE_OPS_CACHED(transaction_diskblock);
 
-  transaction_diskblock(u32 n, char buf[BSIZE])
+  transaction_diskblock(u32 n, char buf[BSIZE]) : shared(false)
   {
     blockdata = (char *) kmalloc(BSIZE, "transaction_diskblock");
     blocknum = n;
@@ -77,6 +201,7 @@ struct transaction_diskblock {
   }
 
   transaction_diskblock(u32 n, char buf[BSIZE], u64 blk_timestamp)
+    : shared(false)
   {
     blockdata = (char *) kmalloc(BSIZE, "transaction_diskblock");
     blocknum = n;
@@ -84,28 +209,63 @@ struct transaction_diskblock {
     timestamp = blk_timestamp;
   }
 
+  // Share the contents of bp, whose write_lock_ the caller holds.
+  explicit transaction_diskblock(sref<buf> bp)
+    : blocknum(bp->block()), blockdata(bp->data_->data),
+      timestamp(get_tsc()), cow_buf(bp), shared(true)
+  {
+    assert(!bp->cow_block_.load());
+    bp->cow_block_ = this;
+  }
+
   ~transaction_diskblock()
   {
-    kmfree(blockdata, BSIZE);
+    if (shared) {
+      transaction_diskblock *self = this;
+      if (!cow_buf->cow_block_.compare_exchange_strong(self, nullptr)) {
+        // A writer beat us to it and is making our private copy.
+        while (shared)
+          nop_pause();
+      }
+    }
+
+    if (!shared)
+      kmfree(blockdata, BSIZE);
   }
 
   transaction_diskblock(const transaction_diskblock&) = delete;
   transaction_diskblock& operator=(const transaction_diskblock&) = delete;
 
-  transaction_diskblock(transaction_diskblock&& db) = default;
-  transaction_diskblock& operator=(transaction_diskblock&& db) = default;
+  // Called by the buf's next writer, with the write_lock_ held, before it
+  // modifies the buf's contents.
+  void unshare(const char *data)
+  {
+    char *copy = (char *) kmalloc(BSIZE, "transaction_diskblock");
+    memmove(copy, data, BSIZE);
+
+    auto l = io_lock.guard();
+    blockdata = copy;
+    shared = false;
+  }
+
+  lock_guard<sleeplock> pin()
+  {
+    return io_lock.guard();
+  }
 
   // Write out the block contents to disk block # blocknum.
   void writeback()
   {
+      auto l = pin();
       disk_write(1, blockdata, BSIZE, blocknum * BSIZE);
   }
 
   // Write out the block contents to disk block # blocknum,
-  // using asynchronous disk I/O.
+  // using asynchronous disk I/O. The block stays pinned until async_iowait().
   void writeback_async()
   {
       dc = make_sref<disk_completion>();
+      io_lock.acquire();
       disk_write(1, blockdata, BSIZE, blocknum * BSIZE, dc);
   }
 
@@ -114,54 +274,134 @@ struct transaction_diskblock {
   {
     dc->wait();
     dc.reset();
+    io_lock.release();
   }
 
-  void writeback_through_bufcache()
+  // Copy the block contents into the bufcache.
+  void update_bufcache()
   {
     sref<buf> bp = buf::get(1, blocknum, true);
-    {
-      auto locked = bp->write();
-      memmove(locked->data, blockdata, BSIZE);
-    }
+    // If we share bp's contents, write() unshares them first, so there is
+    // no need to pin the block for this copy.
+    auto locked = bp->write();
+    memmove(locked->data, blockdata, BSIZE);
+  }
+
+  void writeback_through_bufcache()
+  {
+    update_bufcache();
     // Can't use async I/O here (which uses sleep) because this is called during
     // early boot, before the process is fully setup for scheduling.
     writeback();
   }
 
+  sref<buf> cow_buf;           // The buf whose contents we share, if any.
+  std::atomic<bool> shared;    // Whether blockdata still points into cow_buf.
+  sleeplock io_lock;           // Held while blockdata is being read.
+};
+
+// The in-place writes of a file's data pages made by one sync of the file
+// (see mfile::sync_pages()). They are issued without being waited for, so
+// that they overlap with the rest of the sync and with building the journal
+// transaction, and the commit waits for them before it flushes the disks for
+// the commit block: the data is on the disk before the metadata that points
+// at it, but the data itself never goes through the journal. Until then the
+// pages stay referenced and marked as under writeback.
+class data_writeback : public referenced {
+  public:
+    NEW_DELETE_OPS(data_writeback);
+
+    void add_page(sref<page_info> pi)
+    {
+      pi->set_writeback(true);
+      pages_.push_back(std::move(pi));
+    }
+
+    std::vector<sref<disk_completion>> *completions()
+    {
+      return &dcs_;
+    }
+
+    // Wait for the writes to complete. Can be called more than once, and by
+    // more than one thread.
+    void wait()
+    {
+      auto l = lock_.guard();
+      for (auto &dc : dcs_)
+        dc->wait();
+      dcs_.clear();
+      for (auto &pi : pages_)
+        pi->set_writeback(false);
+      pages_.clear();
+    }
+
+  private:
+    sleeplock lock_;
+    std::vector<sref<disk_completion>> dcs_;
+    std::vector<sref<page_info>> pages_;
 };
 
 // A transaction represents all related updates that take place as the result of a
 // filesystem operation.
 class transaction {
   friend mfs_interface;
+
+  // The transaction's bookkeeping (its vectors and indexes, and its block
+  // queue) is allocated from this arena and freed in one go along with the
+  // transaction. It is declared first so that it outlives all of them. The
+  // diskblocks themselves are not in the arena, since group commit moves them
+  // from one transaction to another.
+  arena arena_;
+
   public:
+    template<class T>
+    using tx_vector = std::vector<T, arena_allocator<T>>;
+
     NEW_DELETE_OPS(transaction);
-    explicit transaction(u64 t) : timestamp_(t), htable_initialized(false),
+    explicit transaction(u64 t) : timestamp_(t), dependent_txq(&arena_),
+                                  jrnl_end_off(0), jrnl_nbytes(0),
+                                  jrnl_checksum(0), blocks(&arena_),
+                                  block_index(&arena_), blocks_sorted(true),
+                                  jrnl_blocks(&arena_), jrnl_bufs(&arena_),
+                                  dirty_blocknums(&arena_),
+                                  dirty_blocknum_index(&arena_),
+                                  allocated_block_list(&arena_),
+                                  free_block_list(&arena_),
+                                  free_inum_list(&arena_),
+                                  ref_block_list(&arena_),
+                                  unref_block_list(&arena_),
+                                  inodebitmap_blk_list(&arena_),
+                                  inodebitmap_locks(&arena_),
+                                  fua_dcs(&arena_), data_writes(&arena_),
                                   bqueue_initialized(false) {}
 
-    transaction() : timestamp_(get_tsc()), htable_initialized(false),
-                    bqueue_initialized(false) {}
+    transaction() : transaction(get_tsc()) {}
 
     ~transaction()
     {
-      if (htable_initialized)
-        delete trans_blocks;
-
+      wait_for_data_writes();
       if (bqueue_initialized)
-        delete bqueue;
+        bqueue->~block_queue();
 
       for (auto &b : blocks)
         delete b;
+
+      for (auto p : jrnl_bufs)
+        kmfree(p, BSIZE);
     }
 
     void add_dirty_blocknum(u32 bno)
     {
+      u32 unused;
+      if (dirty_blocknum_index.lookup(bno, &unused))
+        return;
+      dirty_blocknum_index.insert(bno, 0);
       dirty_blocknums.push_back(bno);
     }
 
     // Add a diskblock to the transaction. These diskblocks are not necessarily
-    // added in timestamp order. They should be sorted before actually flushing
-    // out the changes to disk.
+    // added in timestamp order, so if the transaction already holds a version
+    // of the same disk block, keep whichever of the two is more recent.
     void add_block(u32 bno, char buf[BSIZE])
     {
       auto b = new transaction_diskblock(bno, buf);
@@ -170,26 +410,53 @@ class transaction {
 
     void add_block(transaction_diskblock *b)
     {
+      u32 idx;
+      if (block_index.lookup(b->blocknum, &idx)) {
+        if (blocks[idx]->timestamp <= b->timestamp)
+          std::swap(blocks[idx], b);
+        delete b;
+        return;
+      }
+
+      block_index.insert(b->blocknum, blocks.size());
+      if (!blocks.empty() && blocks.back()->blocknum > b->blocknum)
+        blocks_sorted = false;
       blocks.push_back(std::move(b));
     }
 
-    // Add multiple disk blocks to a transaction.
-    void add_blocks(std::vector<transaction_diskblock*> bvec)
+    // Move multiple disk blocks (e.g., those of another transaction) into
+    // this transaction.
+    void add_blocks(tx_vector<transaction_diskblock*> &&bvec)
     {
       for (auto &b : bvec)
-        blocks.push_back(std::move(b));
+        add_block(b);
+      bvec.clear();
     }
 
-    void add_free_blocks(std::vector<u32> free_list)
+    // The number of distinct disk blocks this transaction would hold after
+    // merging in the blocks of 'other'.
+    size_t merged_block_count(const transaction *other) const
+    {
+      size_t count = blocks.size();
+      u32 idx;
+      for (auto &b : other->blocks)
+        if (!block_index.lookup(b->blocknum, &idx))
+          count++;
+      return count;
+    }
+
+    void add_free_blocks(tx_vector<u32> &&free_list)
     {
       for (auto &f : free_list)
-        free_block_list.push_back(std::move(f));
+        free_block_list.push_back(f);
+      free_list.clear();
     }
 
-    void add_free_inums(std::vector<u32> free_list)
+    void add_free_inums(tx_vector<u32> &&free_list)
     {
       for (auto &f : free_list)
-        free_inum_list.push_back(std::move(f));
+        free_inum_list.push_back(f);
+      free_list.clear();
     }
 
     void add_allocated_block(u32 bno)
@@ -197,6 +464,22 @@ class transaction {
       allocated_block_list.push_back(bno);
     }
 
+    // Record that this transaction must not be committed (or applied) before
+    // the given transaction in another queue. Only the latest transaction per
+    // queue needs to be remembered, since each queue is processed in order; so
+    // the dependencies form a vector clock with one entry per queue.
+    void add_dependency(const tx_queue_info &txq)
+    {
+      for (auto &dep : dependent_txq) {
+        if (dep.id_ == txq.id_) {
+          if (dep.timestamp_ < txq.timestamp_)
+            dep.timestamp_ = txq.timestamp_;
+          return;
+        }
+      }
+      dependent_txq.push_back(txq);
+    }
+
     void add_free_block(u32 bno)
     {
       free_block_list.push_back(bno);
@@ -207,112 +490,67 @@ class transaction {
       free_inum_list.push_back(inum);
     }
 
+    void add_block_ref(u32 bno)
+    {
+      ref_block_list.push_back(bno);
+    }
+
+    void add_block_unref(u32 bno)
+    {
+      unref_block_list.push_back(bno);
+    }
+
     void add_dirty_blocks_lazy()
     {
       deduplicate_dirty_blocknums();
 
       for (auto &bno : dirty_blocknums) {
         sref<buf> bp = buf::get(1, bno);
+        auto locked = bp->write_clean();
         bp->add_to_transaction(this);
       }
 
       dirty_blocknums.clear();
+      dirty_blocknum_index.clear();
     }
 
+    // Block numbers are deduplicated as they are added; sort them so that
+    // the bufcache blocks are added (and later written) in disk order.
     void deduplicate_dirty_blocknums()
     {
-      // Sort the diskblocks in increasing timestamp order.
       std::sort(dirty_blocknums.begin(), dirty_blocknums.end());
-
-      // Make a list of the most current version of the diskblocks. For each
-      // block number pick the diskblock with the highest timestamp and
-      // discard the rest.
-
-      std::vector<unsigned long> erase_indices;
-      for (auto b = dirty_blocknums.begin(); b != dirty_blocknums.end(); b++) {
-        if ((b+1) != dirty_blocknums.end() && (*b) == (*(b+1))) {
-          erase_indices.push_back(b - dirty_blocknums.begin());
-        }
-      }
-
-      std::sort(erase_indices.begin(), erase_indices.end(),
-                std::greater<unsigned long>());
-
-      for (auto &idx : erase_indices)
-        dirty_blocknums.erase(dirty_blocknums.begin() + idx);
     }
 
     void deduplicate_freeblock_list()
     {
-      std::sort(free_block_list.begin(), free_block_list.end());
-
-      std::vector<unsigned long> erase_indices;
-      for (auto b = free_block_list.begin(); b != free_block_list.end(); b++) {
-        if ((b+1) != free_block_list.end() && (*b) == (*(b+1))) {
-          erase_indices.push_back(b - free_block_list.begin());
-        }
-      }
-
-      std::sort(erase_indices.begin(), erase_indices.end(),
-                std::greater<unsigned long>());
-
-      for (auto &idx : erase_indices)
-        free_block_list.erase(free_block_list.begin() + idx);
+      sort_unique(free_block_list);
     }
 
     void deduplicate_freeinum_list()
     {
-      std::sort(free_inum_list.begin(), free_inum_list.end());
-
-      std::vector<unsigned long> erase_indices;
-      for (auto b = free_inum_list.begin(); b != free_inum_list.end(); b++) {
-        if ((b+1) != free_inum_list.end() && (*b) == (*(b+1))) {
-          erase_indices.push_back(b - free_inum_list.begin());
-        }
-      }
-
-      std::sort(erase_indices.begin(), erase_indices.end(),
-                std::greater<unsigned long>());
-
-      for (auto &idx : erase_indices)
-        free_inum_list.erase(free_inum_list.begin() + idx);
+      sort_unique(free_inum_list);
     }
 
+    // add_block() already keeps just the most current version of each disk
+    // block, so all that is left to do here is to order the diskblocks by
+    // block number, which lets the block layer issue contiguous I/O.
     void deduplicate_blocks()
     {
-      // Sort the diskblocks in increasing timestamp order.
-      std::sort(blocks.begin(), blocks.end(), compare_transaction_db);
-
-      // Make a list of the most current version of the diskblocks. For each
-      // block number pick the diskblock with the highest timestamp and
-      // discard the rest.
+      if (blocks_sorted)
+        return;
 
-      std::vector<unsigned long> erase_indices;
-      for (auto b = blocks.begin(); b != blocks.end(); b++) {
-        if ((b+1) != blocks.end() && (*b)->blocknum == (*(b+1))->blocknum) {
-          erase_indices.push_back(b - blocks.begin());
-        }
-      }
-
-      std::sort(erase_indices.begin(), erase_indices.end(),
-                std::greater<unsigned long>());
-
-      for (auto &idx : erase_indices) {
-        delete blocks[idx];
-        blocks.erase(blocks.begin() + idx);
-      }
+      std::sort(blocks.begin(), blocks.end(), compare_transaction_db);
+      block_index.clear();
+      for (size_t i = 0; i < blocks.size(); i++)
+        block_index.insert(blocks[i]->blocknum, i);
+      blocks_sorted = true;
     }
 
-    // Comparison function to order diskblock updates. Diskblocks are ordered in
-    // increasing order of (blocknum, timestamp). This ensures that all diskblocks
-    // with the same blocknum are present in the list in sequence and ordered in
-    // increasing order of their timestamps. So while writing out the transaction
-    // to the journal, for each block number just the block with the highest
-    // timestamp needs to be written to disk. Gets rid of unnecessary I/O.
+    // Comparison function to order diskblock updates. Diskblocks are ordered
+    // in increasing order of block numbers, which are unique within a
+    // transaction.
     static bool compare_transaction_db(const transaction_diskblock *b1,
                                        const transaction_diskblock *b2) {
-      if (b1->blocknum == b2->blocknum)
-        return (b1->timestamp < b2->timestamp);
       return (b1->blocknum < b2->blocknum);
     }
 
@@ -320,7 +558,8 @@ class transaction {
     void write_block(u32 dev, const char *buf, u64 blocknum)
     {
       if (!bqueue_initialized) {
-        bqueue = new block_queue();
+        bqueue = new ((block_queue *)arena_.alloc(sizeof(block_queue)))
+          block_queue(&arena_);
         bqueue_initialized = true;
       }
 
@@ -328,25 +567,106 @@ class transaction {
       disks_written.set(blknum_to_dev(blocknum));
     }
 
-    // Write the blocks in this transaction to disk. Used to write the journal.
-    void write_to_disk()
+    // Allocate a buffer for a journal block that lives as long as the
+    // transaction, for blocks that are written asynchronously.
+    char *alloc_journal_buf()
     {
-      deduplicate_blocks();
+      char *p = (char *) kmalloc(BSIZE, "journal_buf");
+      jrnl_bufs.push_back(p);
+      return p;
+    }
 
-      if (!bqueue_initialized) {
-        bqueue = new block_queue();
-        bqueue_initialized = true;
+    // Record a block of the on-disk journal to be written out by
+    // write_to_disk() (or write_to_disk_raw()). The buffer must remain valid,
+    // and unmodified, until then.
+    void add_journal_block(u32 blocknum, const char *data)
+    {
+      journal_block jb = { blocknum, data };
+      jrnl_blocks.push_back(jb);
+    }
+
+    // Write out the journal blocks, which mostly land on consecutive disk
+    // blocks, with one scatter-gather I/O per contiguous run (a single one for
+    // a transaction, unless the journal file is fragmented or wraps around).
+    // With fua set, the runs on disks that support Force Unit Access are
+    // durable once written, so only the other disks are left in disks_written
+    // to be flushed. With pending set, the writes are not waited for; their
+    // completions are added to *pending instead. The journal is what a commit
+    // waits for, so it goes out ahead of background writes, at
+    // BLKIO_PRIO_COMMIT.
+    void write_journal_blocks(bool use_async_io = true, bool fua = false,
+                              tx_vector<sref<disk_completion>> *pending =
+                              nullptr)
+    {
+      if (jrnl_blocks.empty())
+        return;
+      kstats::inc(&kstats::disk_write_count, (uint64_t)jrnl_blocks.size());
+
+      std::vector<kiovec> iov;
+      std::vector<sref<disk_completion>> dcs;
+      iov.reserve(jrnl_blocks.size());
+      for (auto &jb : jrnl_blocks) {
+        kiovec kiov = { (void *)jb.data, BSIZE };
+        iov.push_back(kiov);
       }
 
+      for (size_t i = 0; i < jrnl_blocks.size(); ) {
+        u32 first = jrnl_blocks[i].blocknum;
+        u32 dev = blknum_to_dev(first);
+        size_t j = i + 1;
+        while (j < jrnl_blocks.size() && j - i < IOV_MAX &&
+               blknum_to_dev(jrnl_blocks[j].blocknum) == dev &&
+               remap_blknum(jrnl_blocks[j].blocknum) ==
+               remap_blknum(first) + (j - i))
+          j++;
+
+        sref<disk_completion> dc;
+        if (use_async_io) {
+          dc = make_sref<disk_completion>();
+          dcs.push_back(dc);
+        }
+        bool run_fua = fua && disk_has_fua(dev);
+        disk_writev(dev, &iov[i], j - i, (u64)first * BSIZE, dc, run_fua,
+                    BLKIO_PRIO_COMMIT);
+        if (!run_fua)
+          disks_written.set(dev);
+        i = j;
+      }
+
+      if (pending) {
+        for (auto &dc : dcs)
+          pending->push_back(dc);
+      } else {
+        for (auto &dc : dcs)
+          dc->wait();
+      }
+
+      jrnl_blocks.clear();
+    }
+
+    // Write the blocks in this transaction to disk. Used to write the journal.
+    void write_to_disk(bool fua = false)
+    {
+      kstats::timer timer(&kstats::disk_write_cycles);
+      write_journal_blocks(true, fua);
+      deduplicate_blocks();
+      kstats::inc(&kstats::disk_write_count, (uint64_t)blocks.size());
+
+      // Go through the shared write elevator, so that the writes of the
+      // transactions being applied concurrently by other cores get merged
+      // with ours. Keep the blocks pinned until their writes complete.
+      write_elevator::ticket t;
+      disk_elevator.begin();
       for (auto b = blocks.begin(); b != blocks.end(); b++) {
-        bqueue->write(1, (*b)->blockdata, BSIZE, (*b)->blocknum * BSIZE);
+        (*b)->io_lock.acquire();
+        disk_elevator.write((*b)->blocknum, (*b)->blockdata, &t);
         disks_written.set(blknum_to_dev((*b)->blocknum));
       }
 
       // Make sure all the block-writes complete.
-      bqueue->flush();
-      delete bqueue;
-      bqueue_initialized = false;
+      disk_elevator.finish(&t);
+      for (auto b = blocks.begin(); b != blocks.end(); b++)
+        (*b)->io_lock.release();
     }
 
     // Same as write_to_disk_and_flush(), except that this uses synchronous I/O,
@@ -381,11 +701,46 @@ class transaction {
       disks_written.reset();
     }
 
+    // Same as write_to_disk_and_flush(), except that this only issues the
+    // disk flushes and returns without waiting for them to complete. The
+    // caller must invoke wait_for_flush() before relying on the durability
+    // of the blocks written by this transaction. With fua set, the journal
+    // blocks are written with Force Unit Access (where the disks support it)
+    // instead of being flushed, and aren't waited for either.
+    void write_to_disk_and_flush_async(bool fua = false)
+    {
+      if (fua)
+        write_journal_blocks(true, true, &fua_dcs);
+      write_to_disk();
+
+      for (auto d : disks_written) {
+        flush_dc[d] = make_sref<disk_completion>();
+        disk_flush(d, flush_dc[d]);
+      }
+    }
+
+    // Wait for the disk flushes (and FUA writes) issued by
+    // write_to_disk_and_flush_async().
+    void wait_for_flush()
+    {
+      for (auto &dc : fua_dcs)
+        dc->wait();
+      fua_dcs.clear();
+
+      for (auto d : disks_written) {
+        flush_dc[d]->wait();
+        flush_dc[d].reset();
+      }
+
+      disks_written.reset();
+    }
+
     // Same as write_to_disk(), except that this uses synchronous disk I/O,
     // and does not make the process sleep/wait (which can be troublesome at
     // early boot before the process is fully setup for scheduling).
     void write_to_disk_raw()
     {
+      write_journal_blocks(false);
       deduplicate_blocks();
 
       for (auto b = blocks.begin(); b != blocks.end(); b++) {
@@ -396,13 +751,62 @@ class transaction {
 
     // Writes the blocks in the transaction to disk, and updates the
     // corresponding bufcache entries too. Used on crash recovery to avoid
-    // rebooting after the changes have been applied.
+    // rebooting after the changes have been applied. This runs before the
+    // scheduler is up, so it can't sleep on async I/O; instead, runs of
+    // blocks that are contiguous on a disk go out as a single synchronous
+    // scatter-gather write, and the disks are flushed at the end.
     void write_to_disk_update_bufcache()
     {
       deduplicate_blocks();
 
       for (auto b = blocks.begin(); b != blocks.end(); b++)
-        (*b)->writeback_through_bufcache();
+        (*b)->update_bufcache();
+
+      std::vector<kiovec> iov;
+      iov.reserve(SG_IO_SIZE/BSIZE);
+      for (size_t i = 0; i < blocks.size(); ) {
+        u32 first = blocks[i]->blocknum;
+        u32 dev = blknum_to_dev(first);
+        size_t j = i;
+
+        iov.clear();
+        do {
+          kiovec kiov = { (void *)blocks[j]->blockdata, BSIZE };
+          iov.push_back(kiov);
+          j++;
+        } while (j < blocks.size() && iov.size() < SG_IO_SIZE/BSIZE &&
+                 blknum_to_dev(blocks[j]->blocknum) == dev &&
+                 remap_blknum(blocks[j]->blocknum) ==
+                 remap_blknum(first) + (j - i));
+
+        disk_writev(dev, &iov[0], iov.size(), (u64)first * BSIZE);
+        disks_written.set(dev);
+        i = j;
+      }
+
+      for (auto d : disks_written)
+        disk_flush(d);
+      disks_written.reset();
+    }
+
+    // Move the blocks of a transaction recovered from the journal into this
+    // one, as updates made at its commit timestamp. Folding the recovered
+    // transactions in commit order this way leaves just the latest version
+    // of every block to write out.
+    void absorb_recovered(transaction *tr)
+    {
+      for (auto &b : tr->blocks) {
+        b->timestamp = tr->commit_tsc;
+        add_block(b);
+      }
+      tr->blocks.clear();
+      tr->block_index.clear();
+      tr->blocks_sorted = true;
+    }
+
+    size_t num_blocks()
+    {
+      return blocks.size();
     }
 
     void flush_block_queue()
@@ -411,6 +815,22 @@ class transaction {
         bqueue->flush();
     }
 
+    // Issue the writes in the block queue without waiting for them; wb
+    // tracks them, and wait_for_data_writes() waits for them.
+    void flush_block_queue_async(sref<data_writeback> wb)
+    {
+      if (bqueue_initialized)
+        bqueue->flush_async(wb->completions());
+      data_writes.push_back(std::move(wb));
+    }
+
+    void wait_for_data_writes()
+    {
+      for (auto &wb : data_writes)
+        wb->wait();
+      data_writes.clear();
+    }
+
     // Transactions need to be applied in timestamp order too. They might not
     // have been logged in the journal in timestamp order.
     const u64 timestamp_;
@@ -423,56 +843,97 @@ class transaction {
     // List of transaction queues and the transaction timestamps that this
     // transaction depends on. Applying this transaction to the disk must be
     // postponed until all these dependent transactions are applied.
-    std::vector<tx_queue_info> dependent_txq;
+    tx_vector<tx_queue_info> dependent_txq;
 
     u64 last_group_txn_tsc;
     u64 commit_tsc;
 
+    // Where this transaction lives in the on-disk journal: the offset just
+    // past its commit block, and the number of journal bytes it occupies
+    // (including any space skipped at the end of the log when it wrapped
+    // around). Used to reclaim its journal space once it has been applied.
+    u32 jrnl_end_off;
+    u64 jrnl_nbytes;
+
+    // CRC32C of the journal blocks (start, address and data blocks) of this
+    // transaction, which is recorded in its commit block.
+    u32 jrnl_checksum;
+
   private:
-    // List of updated diskblocks
-    std::vector<transaction_diskblock*> blocks;
+    // List of updated diskblocks, at most one per disk block number.
+    tx_vector<transaction_diskblock*> blocks;
 
-    std::vector<u32> dirty_blocknums;
+    // Position of each disk block in 'blocks', used to ensure that we don't
+    // log the same block repeatedly in the transaction.
+    blocknum_index block_index;
 
-    // Hash-table of blocks updated within the transaction. Used to ensure that
-    // we don't log the same blocks repeatedly in the transaction.
-    linearhash<u64, transaction_diskblock *> *trans_blocks;
+    // Whether 'blocks' is in increasing block number order.
+    bool blocks_sorted;
+
+    // Blocks of the on-disk journal, in the order they are laid out in it.
+    struct journal_block {
+      u32 blocknum;
+      const char *data;
+    };
+    tx_vector<journal_block> jrnl_blocks;
+    tx_vector<char *> jrnl_bufs;   // Owned by the transaction
 
-    // Notes whether the trans_blocks hash table has been initialized. Used
-    // to allocate memory for the hash table on-demand.
-    bool htable_initialized;
+    // Blocks to be added from the bufcache by add_dirty_blocks_lazy(), and
+    // the set of those block numbers (the index values are unused).
+    tx_vector<u32> dirty_blocknums;
+    blocknum_index dirty_blocknum_index;
 
     // Block numbers of newly allocated blocks within this transaction. These
     // blocks have not been marked as allocated on the disk yet.
-    std::vector<u32> allocated_block_list;
+    tx_vector<u32> allocated_block_list;
 
     // Block numbers of blocks freed within this transaction. These blocks have
     // not been marked as free on the disk yet.
-    std::vector<u32> free_block_list;
+    tx_vector<u32> free_block_list;
 
     // Inode numbers of inodes freed by this transaction. They will be made
     // available for reuse only after this transaction commits successfully.
-    std::vector<u32> free_inum_list;
+    tx_vector<u32> free_inum_list;
+
+    // Block numbers of shared data blocks that this transaction took another
+    // reference to, or dropped one of (once per reference). Their on-disk
+    // refcounts have not been updated yet.
+    tx_vector<u32> ref_block_list;
+    tx_vector<u32> unref_block_list;
 
     // Set of inode-block and bitmap-block locks that this transaction owns.
-    std::vector<u32> inodebitmap_blk_list;
-    std::vector<sleeplock*> inodebitmap_locks;
+    tx_vector<u32> inodebitmap_blk_list;
+    tx_vector<sleeplock*> inodebitmap_locks;
 
     // A bitmap of disks written to by this transaction, which is used to call
     // disk_flush() on exactly those set of disks.
     bitset<NDISK> disks_written;
+    sref<disk_completion> flush_dc[NDISK]; // Outstanding async disk flushes.
+    tx_vector<sref<disk_completion>> fua_dcs; // Outstanding FUA writes.
+    tx_vector<sref<data_writeback>> data_writes; // File data being written.
     block_queue *bqueue; // Access to the block layer.
     bool bqueue_initialized;
 };
 
 // The "physical" journal is made up of transactions, which in turn are made up of
 // updated diskblocks.
+//
+// The on-disk journal is a circular log that occupies the journal file past the
+// skip block at offset 0. Transactions are appended at the tail (current_off),
+// wrapping around to the start of the log when a transaction doesn't fit before
+// the end of the file. Space is reclaimed from the head as transactions are
+// applied to the disk, so the journal never has to be drained as a whole before
+// it can be reused. The head is recorded in the skip block, which serves as the
+// journal's superblock during crash-recovery.
 class journal {
   friend mfs_interface;
   public:
     NEW_DELETE_OPS(journal);
-    journal() : last_applied_commit_tsc(0), current_off(0),
-                committed_trans_tsc(0), applied_trans_tsc(0)
+    journal() : last_applied_commit_tsc(0),
+                journal_lock("journal", LOCKSTAT_FS), current_off(0),
+                head_off(LOG_START), used_bytes(0),
+                log_end(PHYS_JOURNAL_SIZE), committed_trans_tsc(0),
+                applied_trans_tsc(0), apply_work_(false), checkpoint_gen_(0)
     {
       apply_dedup_trans = new transaction();
     }
@@ -501,15 +962,118 @@ class journal {
     }
 
     void update_offset(u32 new_off) {
-      assert(new_off <= PHYS_JOURNAL_SIZE);
       scoped_acquire l(&offset_lock);
+      assert(new_off <= log_end);
       current_off = new_off;
     }
 
-    void wait_for_commit(u64 upto_enq_tsc) {
+    // The circular log starts right after the skip block, and extends upto
+    // the end of the journal file.
+    enum : u32 { LOG_START = BSIZE };
+
+    // Sizes the journal to match its on-disk journal file, whose size is
+    // chosen by mkfs (and can differ from one per-core journal to another).
+    void set_size(u32 journal_size) {
+      assert(journal_size % BSIZE == 0 && journal_size > 2 * LOG_START);
+      scoped_acquire l(&offset_lock);
+      log_end = journal_size;
+    }
+
+    u32 log_end_offset() {
+      scoped_acquire l(&offset_lock);
+      return log_end;
+    }
+
+    // Disk block number of the journal block at offset off. Journal blocks
+    // are written straight to the disk rather than through the bufcache, so
+    // the journal file's block map is read once, at mount time.
+    u32 disk_blocknum(u32 off) {
+      return blkmap[off / BSIZE];
+    }
+
+    // Capacity of the circular log, in bytes.
+    u64 log_size() {
+      scoped_acquire l(&offset_lock);
+      return log_end - LOG_START;
+    }
+
+    u32 head_offset() {
+      scoped_acquire l(&offset_lock);
+      return head_off;
+    }
+
+    // Number of journal bytes holding transactions that are yet to be applied.
+    u64 used_space() {
+      scoped_acquire l(&offset_lock);
+      return used_bytes;
+    }
+
+    // Returns true if a transaction of trans_size bytes can be appended to the
+    // log without overwriting any transaction that is yet to be applied.
+    bool has_room(u64 trans_size) {
+      scoped_acquire l(&offset_lock);
+      return used_bytes + wrap_gap(trans_size) + trans_size <=
+             log_end - LOG_START;
+    }
+
+    // Prepares to append a transaction of trans_size bytes, by wrapping the
+    // tail around to the start of the log if the transaction doesn't fit
+    // before its end. Returns the number of bytes skipped at the end.
+    u32 begin_append(u64 trans_size) {
+      scoped_acquire l(&offset_lock);
+      u32 gap = wrap_gap(trans_size);
+      if (current_off + trans_size > log_end) {
+        current_off = LOG_START;
+        used_bytes += gap;
+      }
+      return gap;
+    }
+
+    // Advances the tail past size bytes that were just written to the log.
+    void advance_tail(u32 size) {
+      scoped_acquire l(&offset_lock);
+      current_off += size;
+      used_bytes += size;
+      assert(current_off <= log_end && used_bytes <= log_end - LOG_START);
+    }
+
+    // Reclaims the space of applied transactions that occupied nbytes of the
+    // log, moving the head up to new_head.
+    void release_space(u32 new_head, u64 nbytes) {
+      scoped_acquire l(&offset_lock);
+      assert(used_bytes >= nbytes);
+      head_off = new_head;
+      used_bytes -= nbytes;
+    }
+
+    // Empties the log.
+    void reset_log() {
+      scoped_acquire l(&offset_lock);
+      current_off = head_off = LOG_START;
+      used_bytes = 0;
+    }
+
+    // Waits until the transactions upto upto_enq_tsc have been committed, or
+    // until the (absolute, nsectime()) deadline, if one is given.
+    void wait_for_commit(u64 upto_enq_tsc, u64 deadline = 0) {
       scoped_acquire a(&commit_cv_lock_);
-      while (committed_trans_tsc < upto_enq_tsc)
-        commit_cv_.sleep(&commit_cv_lock_);
+      while (committed_trans_tsc < upto_enq_tsc) {
+        if (deadline && nsectime() >= deadline)
+          break;
+        commit_cv_.sleep_to(&commit_cv_lock_, deadline);
+      }
+    }
+
+    // Returns true if this journal has no transactions to commit or apply,
+    // and nobody is committing transactions to it at the moment.
+    bool is_idle() {
+      auto journal_guard = journal_lock.try_guard();
+      if (!journal_guard)
+        return false;
+
+      auto cq_guard = tx_commit_queue_lock.guard();
+      auto aq_guard = tx_apply_queue_lock.guard();
+      return tx_commit_queue.empty() && tx_apply_queue.empty();
     }
 
     void wait_for_apply(u64 upto_enq_tsc) {
@@ -542,6 +1106,41 @@ class journal {
       return applied_trans_tsc;
     }
 
+    // Wake up the checkpointer of this journal, to apply the transactions
+    // sitting in the apply queue.
+    void kick_apply_worker() {
+      scoped_acquire a(&apply_work_lock_);
+      apply_work_ = true;
+      apply_work_cv_.wake_all();
+    }
+
+    // Called by the checkpointer to wait for more work.
+    void wait_for_apply_work() {
+      scoped_acquire a(&apply_work_lock_);
+      while (!apply_work_)
+        apply_work_cv_.sleep(&apply_work_lock_);
+      apply_work_ = false;
+    }
+
+    // Checkpoint generations: incremented every time journal space is
+    // reclaimed, so that committers can wait for the checkpointer to make room.
+    u64 get_checkpoint_gen() {
+      scoped_acquire a(&apply_work_lock_);
+      return checkpoint_gen_;
+    }
+
+    void wait_for_checkpoint(u64 gen) {
+      scoped_acquire a(&apply_work_lock_);
+      while (checkpoint_gen_ == gen)
+        checkpoint_cv_.sleep(&apply_work_lock_);
+    }
+
+    void notify_checkpoint() {
+      scoped_acquire a(&apply_work_lock_);
+      checkpoint_gen_++;
+      checkpoint_cv_.wake_all();
+    }
+
   private:
     std::vector<transaction*> tx_commit_queue;
     std::vector<transaction*> tx_apply_queue;
@@ -573,9 +1172,21 @@ class journal {
     // path.
     sleeplock journal_lock;
 
-    // Current size of flushed out transactions on the disk.
+    // Number of bytes that a transaction of trans_size bytes would leave
+    // unused at the end of the log. Caller must hold offset_lock.
+    u32 wrap_gap(u64 trans_size) {
+      return current_off + trans_size > log_end ? log_end - current_off : 0;
+    }
+
+    // Tail and head of the circular log, and the number of bytes in between.
     u32 current_off;
-    spinlock offset_lock; // Protects access to current_off.
+    u32 head_off;
+    u64 used_bytes;
+    u32 log_end; // Size of the journal file.
+    spinlock offset_lock; // Protects access to the above.
+
+    // Disk block numbers of the journal file's blocks, set up at mount time.
+    std::vector<u32> blkmap;
 
     // The timestamp of the last transaction that was committed to the on-disk
     // filesystem via this journal.
@@ -585,6 +1196,12 @@ class journal {
     u64 applied_trans_tsc;
     spinlock commit_cv_lock_, apply_cv_lock_;
     condvar commit_cv_, apply_cv_;
+
+    // Used to hand off committed transactions to the checkpointer.
+    bool apply_work_;
+    u64 checkpoint_gen_;
+    spinlock apply_work_lock_;
+    condvar apply_work_cv_, checkpoint_cv_;
 };
 
 
@@ -607,7 +1224,16 @@ class mfs_interface
       // The following fields are used only if this is a start block.
       u8 num_addr_blocks; // No. of address-blocks that follow the start block.
       u8 padding[2];
-      u32 blocknums[1021]; // Block numbers of the data blocks in the transaction.
+
+      // Used only if this is a commit block: CRC32C of all the journal blocks
+      // of the transaction that precede the commit block. This lets the journal
+      // blocks and the commit block be flushed to the disk together, since a
+      // torn transaction fails the check during crash-recovery.
+      u32 checksum;
+
+      u32 blocknums[1020]; // Block numbers of the data blocks in the transaction.
+                           // (In a skip block, blocknums[0] holds the offset of
+                           // the head of the circular log.)
 
     } journal_header;
 
@@ -626,8 +1252,15 @@ class mfs_interface
     static_assert(sizeof(journal_addr_block) == BSIZE,
                   "Journal address block size should be equal to BSIZE\n");
 
-    static_assert((PHYS_JOURNAL_SIZE/BSIZE) <= 1021 + 1024,
-                   "Add more address blocks in the transaction commit code\n");
+    // A start block can be followed by upto 255 address blocks, which caps the
+    // number of data blocks in any given transaction.
+    enum : u32 {
+      JOURNAL_STARTBLK_SLOTS = sizeof(journal_header_block::blocknums) / sizeof(u32),
+      JOURNAL_ADDRBLK_SLOTS = sizeof(journal_addr_block::blocknums) / sizeof(u32),
+      JOURNAL_MAX_ADDR_BLOCKS = 255,
+      JOURNAL_MAX_TRANS_BLOCKS = JOURNAL_STARTBLK_SLOTS +
+                                 JOURNAL_MAX_ADDR_BLOCKS * JOURNAL_ADDRBLK_SLOTS,
+    };
 
     // Types of journal headers
     enum : u8 {
@@ -657,51 +1290,53 @@ class mfs_interface
       u64 timestamp;
     };
 
-    // Keeps track of free and allocated blocks on the disk. Transactions that
-    // modify the block free bitmap on the disk go through a list of free_bit
-    // structs in memory first.
-    typedef struct free_bit {
-      u32 bno_;
-      int cpu;
-      bool is_free;
-      ilink<free_bit> link;
-
-      free_bit(u32 bno, bool f): bno_(bno), is_free(f) {}
-      NEW_DELETE_OPS(free_bit);
-
-      free_bit& operator=(const free_bit&) = delete;
-      free_bit(const free_bit&) = delete;
-
-      free_bit& operator=(free_bit&&) = default;
-      free_bit(free_bit&&) = default;
-    } free_bit;
-
-    // The free block bitmap in memory. All block allocations (in transactions)
+    // The free block map in memory. All block allocations (in transactions)
     // are performed using this in-memory data-structure. Blocks freed by a
-    // transaction are freed in this bitmap *after* the transaction commits.
+    // transaction are freed in this map *after* the transaction commits.
     // This helps us guarantee that the blocks freed by a transaction are not
     // reused until it successfully commits to disk.
     struct freeblock_bitmap {
-      // We maintain the bitmap as both a vector and a linked-list so that we
-      // can perform both allocations and frees in O(1) time. The bit_vector
-      // contains entries for all blocks, whereas the bit_freelist contains
-      // entries only for blocks that are actually free. The allocator consumes
-      // items from the bit_freelist in O(1) time; the free code locates the
-      // free_bit data-structure corresponding to the block being freed in O(1)
-      // time using the bit_vector and inserts it into the bit_freelist (also
-      // in O(1) time). Items are never removed from the bit_vector so as to
-      // enable the O(1) lookups.
-      std::vector<free_bit*> bit_vector;
-
+      // Free space is kept as extents rather than as one entry per block, so
+      // the memory used (and the time taken to build it) depends on how
+      // fragmented the free space is, not on the size of the disk. Each
+      // freelist is filled in from the bitmap blocks it owns the first time
+      // it is needed, rather than at boot.
       struct freelist {
-        ilist<free_bit, &free_bit::link> bit_freelist;
-        spinlock list_lock; // Guards modifications to the bit_freelist
+        extent_tree extents;
+        spinlock list_lock; // Guards modifications to the extents
+        std::atomic<bool> populated;
+        sleeplock populate_lock;  // Serializes filling in the freelist
+
+        freelist() : populated(false) {}
       };
 
-      // We maintain per-CPU freelists for scalability. The bit_vector is
-      // read-only after initialization, so a single one will suffice.
+      // We maintain per-CPU freelists for scalability. Every block has a home
+      // freelist, which it returns to when it is freed: CPU c owns the blocks
+      // [cpu_base + c * blocks_per_cpu, cpu_base + (c+1) * blocks_per_cpu),
+      // and the reserve pool owns the rest.
       percpu<struct freelist> freelists;
       struct freelist reserve_freelist; // Global reserve pool of free blocks.
+      u32 nblocks;
+      u32 cpu_base;
+      u32 blocks_per_cpu;
+
+      int home_cpu(u32 bno) const
+      {
+        if (bno < cpu_base || !blocks_per_cpu ||
+            bno - cpu_base >= (u64)NCPU * blocks_per_cpu)
+          return NCPU;
+        return (bno - cpu_base) / blocks_per_cpu;
+      }
+
+      struct freelist &cpu_freelist(int cpu)
+      {
+        return cpu < NCPU ? freelists[cpu] : reserve_freelist;
+      }
+
+      struct freelist &home_freelist(u32 bno)
+      {
+        return cpu_freelist(home_cpu(bno));
+      }
     } freeblock_bitmap;
 
     NEW_DELETE_OPS(mfs_interface);
@@ -709,20 +1344,34 @@ class mfs_interface
 
     // File functions
     u64 get_file_size(u64 mfile_mnum);
-    void update_file_size(u64 mfile_mnum, u32 size, transaction *tr);
+    void update_file_size(u64 mfile_mnum, u32 size, transaction *tr,
+                          bool datasync = false);
     void initialize_file(sref<mnode> m);
     int load_file_page(u64 mfile_mnum, char *p, size_t pos, size_t nbytes);
-    sref<inode> prepare_sync_file_pages(u64 mfile_mnum, transaction *tr);
+    void sync_file_chunk(sref<inode> ip, u32 chunk, char **pages, u32 npages,
+                         transaction *tr);
+    void load_file_pages(u64 mfile_mnum, u64 pageidx, u32 npages,
+                         char **pages,
+                         std::vector<sref<disk_completion>> *dcs);
+    sref<inode> prepare_sync_file_pages(u64 mfile_mnum, transaction *tr,
+                                        u32 delalloc_blocks = 0);
+    int sync_file_inline(sref<inode> ip, const char *p, size_t n);
     int sync_file_page(sref<inode> ip, char *p, size_t pos, size_t nbytes,
                        transaction *tr);
-    void finish_sync_file_pages(sref<inode> ip, transaction *tr);
+    void finish_sync_file_pages(sref<inode> ip, transaction *tr,
+                                sref<data_writeback> wb = sref<data_writeback>());
     sref<inode> alloc_inode_for_mnode(u64 mnum, u8 type);
     void create_file(u64 mnum, u8 type, transaction *tr);
     void create_dir(u64 mnum, u64 parent_mnum, u8 type, transaction *tr);
     void truncate_file(u64 mfile_mnum, u32 offset, transaction *tr);
+    int fallocate_file(u64 mfile_mnum, u64 offset, u64 len, transaction *tr);
+    int clone_file(u64 src_mnum, u64 dst_mnum, transaction *tr);
+    int set_file_compression(u64 mfile_mnum, bool on, transaction *tr);
+    bool file_compressed(u64 mfile_mnum);
 
     // Directory functions
     void initialize_dir(sref<mnode> m);
+    void load_dir_name(sref<mnode> m, const fsname& name);
     void add_dir_entry(u64 mdir_mnum, char *name, u64 dirent_mnum, u8 type,
                        transaction *tr, bool rename_link = false);
     void remove_dir_entry(u64 mdir_mnum, char* name, transaction *tr,
@@ -731,11 +1380,17 @@ class mfs_interface
                                 bool acquire_locks = false,
                                 bool mnode_dying = false);
     void __delete_mnum_inode(u64 mnum, transaction *tr);
+    bool has_deleted_inodes(int cpu);
+    void queue_deleted_inodes(int cpu);
+    void reclaim_deleted_inodes(int cpu);
+    void kick_inode_reclaim(int cpu);
 
-    bool mnum_name_insert(u64 mnum, const strbuf<DIRSIZ>& name);
-    bool mnum_name_lookup(u64 mnum, strbuf<DIRSIZ> *nameptr);
+    bool mnum_name_insert(u64 mnum, const fsname& name);
+    bool mnum_name_lookup(u64 mnum, fsname *nameptr);
     bool inum_lookup(u64 mnum, u64 *inumptr);
     sref<mnode> mnode_lookup(u64 inum, u64 *mnumptr);
+    bool file_identity(u64 mnum, u64 *inum, u32 *gen);
+    sref<mnode> load_file(u64 inum, u32 gen);
 
     // Initializes the root directory. Called during boot.
     sref<mnode> load_root();
@@ -746,33 +1401,34 @@ class mfs_interface
     void post_process_transaction(transaction *tr);
     void apply_trans_on_disk(transaction *tr);
     void commit_transaction_to_disk(int cpu, transaction *trans);
+    transaction *commit_transaction_to_disk_async(int cpu, transaction *trans);
+    void finish_commit_transaction(int cpu, transaction *trans,
+                                   transaction *commit_trans);
     void apply_transaction_to_disk(int cpu, transaction *trans);
-    void commit_all_transactions(int cpu);
+    bool commit_all_transactions(int cpu, bool wait_for_deps = true);
     void apply_all_transactions(int cpu);
     void flush_transaction_queue(int cpu, bool apply_transactions = false);
     void print_txq_stats();
+    static u32 journal_addr_blocks(size_t num_trans_blocks);
+    static u64 journal_trans_size(size_t num_trans_blocks);
     bool fits_in_journal(size_t num_trans_blocks, int cpu);
-    void write_journal(char *buf, size_t size, transaction *tr, int cpu);
-    void write_journal_transaction_blocks(const
-           std::vector<transaction_diskblock*> &vec, const u64 timestamp,
-           bitset<NDISK> &disks_written, int cpu);
-    void write_journal_commit_block(u64 timestamp, int cpu);
-    void write_journal_skip_block(u64 timestamp, int cpu,
+    void write_journal(const char *buf, size_t size, transaction *tr, int cpu);
+    void write_journal_transaction_blocks(transaction *trans, int cpu);
+    void write_journal_commit_block(transaction *trans, int cpu);
+    transaction *write_journal_commit_block_async(transaction *trans, int cpu);
+    void write_journal_skip_block(u64 timestamp, u32 head, int cpu,
                                   bool use_async_io = true);
 
-    bool get_txn_skip_block(int cpu, u64 *skip_upto_tsc);
+    bool get_txn_skip_block(int cpu, u64 *skip_upto_tsc, u32 *head);
     journal_header *get_txn_start_block(int cpu);
     bool get_txn_data_blocks(int cpu, journal_header *hdstartptr,
-                             transaction *trans);
-    bool get_txn_commit_block(int cpu, transaction *trans);
+                             transaction *trans, u32 *checksum);
+    bool get_txn_commit_block(int cpu, transaction *trans, u32 checksum);
     void recover_journal(int cpu, std::vector<transaction*> &trans_vec);
-    void reset_journal(int cpu);
     void init_journal(int cpu);
 
     // Metadata functions
-    void alloc_mnode_lock(u64 mnum);
-    void free_mnode_lock(u64 mnum);
-    void alloc_metadata_log(u64 mnum);
+    mfs_logical_log *metadata_log(u64 mnum);
     void free_metadata_log(u64 mnum);
     lock_guard<sleeplock> metadata_op_lockguard(u64 mnum, int cpu);
     void metadata_op_start(u64 mnum, int cpu, u64 tsc_val);
@@ -782,9 +1438,15 @@ class mfs_interface
     void dec_mfslog_linkcount(u64 mnum);
     u64  get_mfslog_linkcount(u64 mnum);
     void sync_dirty_files_and_dirs(int cpu, std::vector<u64> &mnum_list);
+    bool wait_for_writeback_work(int cpu);
+    void wakeup_flushers();
+    void kick_metadata_sync(int cpu);
+    void writeback_dirty_files(int cpu);
     void evict_bufcache();
     void evict_pagecache();
     void process_metadata_log_and_flush(int cpu);
+    void process_dirty_mnums(std::vector<u64> &mnum_list, int cpu);
+    void process_metadata_sync_work(int cpu);
     void process_metadata_log(u64 max_tsc, u64 mnode_mnum, int cpu);
     void add_op_to_transaction_queue(mfs_operation *op, int cpu,
                                      transaction *tr = nullptr,
@@ -793,8 +1455,12 @@ class mfs_interface
                                  std::vector<u64> &absorb_mnum_list);
     void absorb_delete_inode(mfs_logical_log *mfs_log, u64 mnum, int cpu,
                              std::vector<u64> &unlink_mnum_list);
+    void absorb_transient_files(u64 mnum, u64 max_tsc,
+                                std::vector<u64> &unlink_mnum_list);
+    bool absorb_transient_file(u64 mnum, u64 max_tsc);
+    static u64 file_op_mnum(mfs_operation *op);
     int  process_ops_from_oplog(mfs_logical_log *mfs_log, u64 max_tsc, int count,
-                  int cpu,
+                  int cpu, u64 slow_rename_tsc,
                   std::vector<pending_metadata> &pending_stack,
                   std::vector<u64> &unlink_mnum_list,
                   std::vector<dirunlink_metadata> &dirunlink_stack,
@@ -802,22 +1468,33 @@ class mfs_interface
                   std::vector<rename_barrier_metadata> &rename_barrier_stack,
                   std::vector<u64> &absorb_mnum_list);
     void apply_rename_pair(std::vector<rename_metadata> &rename_stack, int cpu);
+    static bool rename_commutes(mfs_operation *op, u64 mnum,
+                                const char *newname);
+    bool apply_file_rename(const rename_metadata &rm, int cpu);
     void mfs_create(mfs_operation_create *op, transaction *tr);
     void mfs_link(mfs_operation_link *op, transaction *tr);
     void mfs_unlink(mfs_operation_unlink *op, transaction *tr);
     void mfs_rename_link(mfs_operation_rename_link *op, transaction *tr);
     void mfs_rename_unlink(mfs_operation_rename_unlink *op, transaction *tr);
-    void reclaim_unreachable_inodes();
+    void reclaim_orphan_inodes();
 
     // Block allocator functionality
     void initialize_freeblock_bitmap();
+    void populate_freelist(int cpu);
+    void populate_home_freelist(u32 bno);
+    void scan_free_blocks(u32 start, u32 end);
+    void add_free_extent(u32 start, u32 len);
     u32  alloc_block();
+    u32  alloc_blocks(u32 nblocks, u32 *start);
+    u32  try_alloc_blocks(u32 nblocks, u32 *start);
     void free_block(u32 bno);
     void print_free_blocks(print_stream *s);
 
     enum {
       INODE_BLOCK = 1,
       BITMAP_BLOCK,
+      SUPER_BLOCK,
+      REFCOUNT_BLOCK,
     };
 
     void alloc_inodebitmap_locks();
@@ -829,15 +1506,20 @@ class mfs_interface
 
   private:
     void load_dir(sref<inode> i, sref<mnode> m);
+    void load_dir_link(sref<inode> i, sref<mnode> m, const fsname& name,
+                       u64 inum);
     sref<mnode> load_dir_entry(u64 inum, sref<mnode> parent);
     sref<mnode> mnode_alloc(u64 inum, u8 mtype);
     sref<inode> get_inode(u64 mnum, const char *str);
     // Mapping from disk inode numbers to the corresponding mnode numbers
-    chainhash<u64, u64> *inum_to_mnum;
+    linearhash<u64, u64> *inum_to_mnum;
     // Mapping from in-memory mnode numbers to disk inode numbers
-    chainhash<u64, u64> *mnum_to_inum;
-    chainhash<u64, sleeplock*> *mnum_to_lock;
-    chainhash<u64, strbuf<DIRSIZ>> *mnum_to_name;
+    linearhash<u64, u64> *mnum_to_inum;
+    // Serializes allocating the inode of an mnode. Locks are picked by hashing
+    // the mnode number, rather than allocated for every mnode.
+    enum { NMNODE_LOCKS = 1024 };
+    sleeplock mnode_locks[NMNODE_LOCKS];
+    chainhash<u64, fsname> *mnum_to_name;
 
     typedef struct mfs_op_idx {
       int create_index;
@@ -860,11 +1542,6 @@ class mfs_interface
     percpu<journal*> fs_journal;
     percpu<sref<inode> > sv6_journal;
 
-    // A hash-table to track the last transaction(*) that modified a given
-    // inode-block or bitmap-block. (* = specifically, which journal's
-    // transaction-queue that transaction went into and at what timestamp).
-    chainhash<u32, tx_queue_info> *blocknum_to_queue;
-
     // List of mnums whose mnodes have hit mnode::onzero() and hence their
     // corresponding on-disk inodes can be deleted.
     struct delete_inums {
@@ -873,18 +1550,69 @@ class mfs_interface
     };
     percpu<delete_inums> delete_inums;
 
+    // List of mnums whose mnodes were dirtied since the last sync, on the
+    // core that dirtied them. This way, sync only has to look at the mnodes
+    // that were actually dirtied, instead of the entire mnode cache.
+    struct dirty_mnums {
+      std::vector<u64> mnum_list;
+      spinlock lock;
+    };
+    percpu<dirty_mnums> dirty_mnums;
+
+    // Per-core writeback flushers (see writeback_dirty_files()) sleep here
+    // between rounds. Writers that hit the dirty limit kick them early, and
+    // cores with too many pending metadata operations ask them to sync.
+    struct flusher {
+      spinlock lock;
+      condvar cv;
+      bool kicked;
+      bool sync_metadata;
+      flusher() : kicked(false), sync_metadata(false) {}
+    };
+    percpu<flusher> flushers;
 
-  private:
-    chainhash<u64, mfs_logical_log*> *metadata_log_htab; // The logical log
+    // sync() hands the mnodes dirtied on each core to that core's metadata
+    // syncer, which processes their metadata logs into its own journal (see
+    // process_metadata_log_and_flush()). A sync_batch tracks the partitions
+    // of one sync that are still being processed.
+    struct sync_batch {
+      spinlock lock;
+      condvar cv;
+      int remaining;
+      sync_batch() : remaining(0) {}
+    };
+    struct sync_work {
+      sync_batch *batch;
+      std::vector<u64> mnum_list;
+    };
+    struct metadata_syncer {
+      spinlock lock;
+      condvar cv;
+      std::vector<sync_work> work;
+    };
+    percpu<metadata_syncer> metadata_syncers;
 
-    // Set of locks, one per inode-block and one per bitmap-block.
-    std::vector<sleeplock*> inodebitmap_locks;
+
+  private:
+    linearhash<u64, mfs_logical_log*> *metadata_log_htab; // The logical log
+
+    // One per inode-block and one per bitmap-block: the 2-Phase lock, and
+    // the last transaction that modified the block (specifically, which
+    // journal's transaction-queue that transaction went into and at what
+    // timestamp; a timestamp of 0 means none has yet). The last writer is
+    // protected by the lock, and is kept next to it so that looking it up
+    // touches no shared state beyond what locking the block already did.
+    struct inodebitmap_block {
+      sleeplock lock;
+      tx_queue_info last_writer;
+    };
+    std::vector<inodebitmap_block*> inodebitmap_blocks;
 };
 
 class mfs_operation
 {
   public:
-    NEW_DELETE_OPS(mfs_operation);
+    NEW_DELETE_OPS_CACHED(mfs_operation);
 
     mfs_operation(mfs_interface *p, u64 t, int op_type)
       : parent_mfs(p), timestamp(t), operation_type(op_type)
@@ -907,16 +1635,16 @@ class mfs_operation_create: public mfs_operation
 {
   friend mfs_interface;
   public:
-    NEW_DELETE_OPS(mfs_operation_create);
+    NEW_DELETE_OPS_CACHED(mfs_operation_create);
 
-    mfs_operation_create(mfs_interface *p, u64 t, u64 mnum, u64 pt, char nm[],
-                         short m_type)
+    mfs_operation_create(mfs_interface *p, u64 t, u64 mnum, u64 pt,
+                         const char nm[], short m_type)
       : mfs_operation(p, t, (m_type == T_DIR) ?
                             MFS_OP_CREATE_DIR : MFS_OP_CREATE_FILE),
         mnode_mnum(mnum), parent_mnum(pt), mnode_type(m_type)
     {
-      name = new char[DIRSIZ];
-      strncpy(name, nm, DIRSIZ);
+      name = new char[strlen(nm) + 1];
+      strcpy(name, nm);
     }
 
     ~mfs_operation_create()
@@ -951,16 +1679,16 @@ class mfs_operation_link: public mfs_operation
 {
   friend mfs_interface;
   public:
-    NEW_DELETE_OPS(mfs_operation_link);
+    NEW_DELETE_OPS_CACHED(mfs_operation_link);
 
-    mfs_operation_link(mfs_interface *p, u64 t, u64 mnum, u64 pt, char nm[],
-                       short m_type)
+    mfs_operation_link(mfs_interface *p, u64 t, u64 mnum, u64 pt,
+                       const char nm[], short m_type)
       : mfs_operation(p, t, (m_type == T_DIR) ?
                             MFS_OP_LINK_DIR : MFS_OP_LINK_FILE),
         mnode_mnum(mnum), parent_mnum(pt), mnode_type(m_type)
     {
-      name = new char[DIRSIZ];
-      strncpy(name, nm, DIRSIZ);
+      name = new char[strlen(nm) + 1];
+      strcpy(name, nm);
     }
 
     ~mfs_operation_link()
@@ -995,16 +1723,16 @@ class mfs_operation_unlink: public mfs_operation
 {
   friend mfs_interface;
   public:
-    NEW_DELETE_OPS(mfs_operation_unlink);
+    NEW_DELETE_OPS_CACHED(mfs_operation_unlink);
 
-    mfs_operation_unlink(mfs_interface *p, u64 t, u64 mnum, u64 pt, char nm[],
-                         short m_type)
+    mfs_operation_unlink(mfs_interface *p, u64 t, u64 mnum, u64 pt,
+                         const char nm[], short m_type)
       : mfs_operation(p, t, (m_type == T_DIR) ?
                             MFS_OP_UNLINK_DIR : MFS_OP_UNLINK_FILE),
         mnode_mnum(mnum), parent_mnum(pt), mnode_type(m_type)
     {
-      name = new char[DIRSIZ];
-      strncpy(name, nm, DIRSIZ);
+      name = new char[strlen(nm) + 1];
+      strcpy(name, nm);
     }
 
     ~mfs_operation_unlink()
@@ -1039,19 +1767,20 @@ class mfs_operation_rename_link: public mfs_operation
 {
   friend mfs_interface;
   public:
-    NEW_DELETE_OPS(mfs_operation_rename_link);
+    NEW_DELETE_OPS_CACHED(mfs_operation_rename_link);
 
-    mfs_operation_rename_link(mfs_interface *p, u64 t, char oldnm[], u64 mnum,
-                              u64 src_pt, char newnm[], u64 dst_pt, u8 m_type)
+    mfs_operation_rename_link(mfs_interface *p, u64 t, const char oldnm[],
+                              u64 mnum, u64 src_pt, const char newnm[],
+                              u64 dst_pt, u8 m_type, bool repl = false)
       : mfs_operation(p, t, (m_type == T_DIR) ?
                             MFS_OP_RENAME_LINK_DIR : MFS_OP_RENAME_LINK_FILE),
         mnode_mnum(mnum), src_parent_mnum(src_pt), dst_parent_mnum(dst_pt),
-        mnode_type(m_type)
+        mnode_type(m_type), replaced(repl)
     {
-      name = new char[DIRSIZ];
-      newname = new char[DIRSIZ];
-      strncpy(name, oldnm, DIRSIZ);
-      strncpy(newname, newnm, DIRSIZ);
+      name = new char[strlen(oldnm) + 1];
+      newname = new char[strlen(newnm) + 1];
+      strcpy(name, oldnm);
+      strcpy(newname, newnm);
     }
 
     ~mfs_operation_rename_link()
@@ -1076,6 +1805,7 @@ class mfs_operation_rename_link: public mfs_operation
       cprintf("New Name: %s\n", newname);
       cprintf("Dst Parent Mnode Num: %ld\n", dst_parent_mnum);
       cprintf("Mnode type: %d\n", mnode_type);
+      cprintf("Replaced: %d\n", replaced);
     }
 
   private:
@@ -1083,6 +1813,7 @@ class mfs_operation_rename_link: public mfs_operation
     u64 src_parent_mnum;   // mnode number of the source directory
     u64 dst_parent_mnum;   // mnode number of the destination directory
     short mnode_type;      // type of the mnode
+    bool replaced;         // whether newname named another mnode before
     char *name;            // source name
     char *newname;         // destination name
 };
@@ -1091,19 +1822,20 @@ class mfs_operation_rename_unlink: public mfs_operation
 {
   friend mfs_interface;
   public:
-    NEW_DELETE_OPS(mfs_operation_rename_unlink);
+    NEW_DELETE_OPS_CACHED(mfs_operation_rename_unlink);
 
-    mfs_operation_rename_unlink(mfs_interface *p, u64 t, char oldnm[], u64 mnum,
-                                u64 src_pt, char newnm[], u64 dst_pt, u8 m_type)
+    mfs_operation_rename_unlink(mfs_interface *p, u64 t, const char oldnm[],
+                                u64 mnum, u64 src_pt, const char newnm[],
+                                u64 dst_pt, u8 m_type)
       : mfs_operation(p, t, (m_type == T_DIR) ?
                             MFS_OP_RENAME_UNLINK_DIR : MFS_OP_RENAME_UNLINK_FILE),
         mnode_mnum(mnum), src_parent_mnum(src_pt), dst_parent_mnum(dst_pt),
         mnode_type(m_type)
     {
-      name = new char[DIRSIZ];
-      newname = new char[DIRSIZ];
-      strncpy(name, oldnm, DIRSIZ);
-      strncpy(newname, newnm, DIRSIZ);
+      name = new char[strlen(oldnm) + 1];
+      newname = new char[strlen(newnm) + 1];
+      strcpy(name, oldnm);
+      strcpy(newname, newnm);
     }
 
     ~mfs_operation_rename_unlink()
@@ -1145,7 +1877,7 @@ class mfs_operation_rename_barrier: public mfs_operation
 {
   friend mfs_interface;
   public:
-    NEW_DELETE_OPS(mfs_operation_rename_barrier);
+    NEW_DELETE_OPS_CACHED(mfs_operation_rename_barrier);
 
     mfs_operation_rename_barrier(mfs_interface *p, u64 t, u64 mnum,
                                 u64 parent, u8 m_type)
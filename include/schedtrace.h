@@ -0,0 +1,39 @@
+#pragma once
+
+// Scheduling trace records, kept by the kernel in a ring per core and
+// read from /dev/schedtrace.  Writing "1" to /dev/schedtrace clears the
+// rings and starts tracing; writing "0" stops it.  Stop tracing before
+// reading, or the rings may change between reads.  A read returns a
+// schedtrace_header followed by each core's events, oldest first, at
+// the offsets the header gives.  tools/sched-report decodes this.
+
+#include <stdint.h>
+
+enum {
+  // pid stopped running on cpu; state is its procstate afterwards
+  // (RUNNABLE if it was preempted or yielded).
+  SCHEDTRACE_SWITCH_OUT = 1,
+  // pid started running on cpu.
+  SCHEDTRACE_SWITCH_IN,
+  // pid was made runnable on core arg, by whatever was running on cpu.
+  SCHEDTRACE_WAKEUP,
+};
+
+struct schedtrace_event {
+  uint64_t tsc;
+  uint32_t pid;
+  uint16_t arg;
+  uint8_t type;
+  uint8_t state;
+  char name[16];
+};
+
+struct schedtrace_header {
+  uint64_t ncpus;
+  uint64_t cpuhz;
+  struct {
+    uint64_t offset;            // Of this core's first event
+    uint64_t count;             // Events in the trace
+    uint64_t dropped;           // Older events the ring overwrote
+  } cpu[];                      // ncpus entries
+} __attribute__((packed));
@@ -288,6 +288,8 @@ class perfsum_base {
   virtual void print(int w0, int w) const = 0;
   virtual void reset() = 0;
 
+  const char *get_name() const { return name; }
+
  protected:
   template<class Row, class Callback>
   static void print_row(const char *rowname, const Row &r,
@@ -384,6 +386,15 @@ class perfsum_ctr : public perfsum_tmpl<Enabler, Counters...> {
     stat[cpuid].count++;
   }
 
+  // totals across all CPUs, for callers that do their own printing
+  uint64_t get_count() const {
+    return this->addcpus(stat, [](const stats *s) { return s->count; });
+  }
+
+  uint64_t get_sum(uint i) const {
+    return this->addcpus(stat, [i](const stats *s) { return s->sum[i]; });
+  }
+
   void print(int w0, int w) const /* override */ {
     if (!Enabler::enabled())
       return;
@@ -590,6 +601,7 @@ class pmc_ctr : public namedctr<CounterWidth> {
  public:
   pmc_ctr(int n) : namedctr<CounterWidth>(mkname(n)), cn(n) {}
   pmc_ctr(const char *nm) : namedctr<CounterWidth>(nm), cn(-1) {}
+  pmc_ctr(int n, const char *nm) : namedctr<CounterWidth>(nm), cn(n) {}
 
   uint64_t sample() const {
     uint64_t a, d;
@@ -679,9 +691,11 @@ class base_perf_region {
   }
 
   // invoke lap multiple times to precisely measure iterations
-  // (use same measurement for end of one & start of next round)
+  // (use same measurement for end of one & start of next round).
+  // a region that migrated would subtract one CPU's counters from
+  // another's, so it records nothing.
   void lap() {
-    if (enabled)
+    if (enabled && sched_getcpu() == (int) cpuid)
       ps->record(cpuid, s);
   }
 
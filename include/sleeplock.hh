@@ -3,10 +3,21 @@
 #include "spinlock.hh"
 #include "condvar.hh"
 
+// A sleeplock is built from a spinlock and a condvar, but a contended
+// acquire first spins for a while (up to SLEEPLOCK_SPIN pauses) as long
+// as the lock's owner is running on another core, since critical sections
+// are often short enough that the owner releases the lock sooner than a
+// sleep and wakeup would take.  If the owner isn't running or the spin
+// runs out, acquire sleeps on the condvar.
 class sleeplock {
  public:
   NEW_DELETE_OPS(sleeplock);
-  sleeplock() : held_(false) {}
+  sleeplock() : held_(false), owner_(nullptr), owner_cpu_(-1) {}
+
+  // Spin and sleep counts for contended acquires go to this lockstat.
+  sleeplock(const char *name, bool lockstat = false)
+    : spinlock_(name, lockstat), held_(false), owner_(nullptr),
+      owner_cpu_(-1) {}
 
   void check_locking_context_is_safe() {
     if (mycpu()->ncli != 0)
@@ -15,10 +26,14 @@ class sleeplock {
 
   void acquire() {
     check_locking_context_is_safe();
-    scoped_acquire x(&spinlock_);
-    while (held_)
-      cv_.sleep(&spinlock_);
-    held_ = true;
+    {
+      scoped_acquire x(&spinlock_);
+      if (!held_) {
+        take();
+        return;
+      }
+    }
+    acquire_contended();
   }
 
   bool try_acquire() {
@@ -28,14 +43,15 @@ class sleeplock {
     scoped_acquire x(&spinlock_);
     if (held_)
       return false;
-    held_ = true;
+    take();
     return true;
   }
 
   void release() {
     scoped_acquire x(&spinlock_);
     assert(held_);
-    held_ = false;
+    owner_.store(nullptr, std::memory_order_relaxed);
+    held_.store(false, std::memory_order_release);
     cv_.wake_all();
   }
 
@@ -51,12 +67,36 @@ class sleeplock {
   sleeplock(const sleeplock &o) = delete;
   sleeplock &operator=(const sleeplock &o) = delete;
 
-  // Sleeplocks can be moved.
-  sleeplock(sleeplock &&o) = default;
-  sleeplock &operator=(sleeplock &&o) = default;
+  // Sleeplocks can be moved (but not while held).
+  sleeplock(sleeplock &&o)
+    : spinlock_(std::move(o.spinlock_)), cv_(std::move(o.cv_)),
+      held_(o.held_.load()), owner_(nullptr), owner_cpu_(-1) {}
+
+  sleeplock &operator=(sleeplock &&o) {
+    spinlock_ = std::move(o.spinlock_);
+    cv_ = std::move(o.cv_);
+    held_ = o.held_.load();
+    owner_ = nullptr;
+    owner_cpu_ = -1;
+    return *this;
+  }
 
  private:
+  // Caller must hold spinlock_.
+  void take() {
+    held_.store(true, std::memory_order_relaxed);
+    owner_.store(myproc(), std::memory_order_relaxed);
+    owner_cpu_.store(myid(), std::memory_order_relaxed);
+  }
+
+  void acquire_contended();
+  bool owner_running();
+
   spinlock spinlock_;
   condvar cv_;
-  bool held_;
+  // Written under spinlock_, but read without it while spinning.  owner_
+  // and owner_cpu_ are only a hint of where the holder is running.
+  std::atomic<bool> held_;
+  std::atomic<proc*> owner_;
+  std::atomic<int> owner_cpu_;
 };
@@ -0,0 +1,50 @@
+#pragma once
+
+// A read-only view of the in-memory file system as it was at one instant,
+// so that a backup can copy a consistent tree while everything else keeps
+// changing it (see kernel/snapshot.cc).  There is at most one snapshot at
+// a time.
+
+#include "file.hh"
+
+#include <utility>
+#include <vector>
+
+class snapshot;
+
+// Start a snapshot of the file system as of now, or discard the current one.
+int snapshot_create(void);
+int snapshot_drop(void);
+
+// Open path, relative to cwd, as it was when the current snapshot was taken.
+sref<file> snapshot_open(sref<mnode> cwd, const char *path);
+
+// A file or directory of a snapshot.  It can only be read, and a directory
+// only with getdents(), which goes through fill_dirents().
+struct file_snapshot : public refcache::referenced, public file {
+public:
+  file_snapshot(sref<snapshot> s, sref<mnode> m);
+  NEW_DELETE_OPS(file_snapshot);
+
+  void inc() override { refcache::referenced::inc(); }
+  void dec() override { refcache::referenced::dec(); }
+
+  int stat(struct stat*, enum stat_flags) override;
+  ssize_t read(char *addr, size_t n) override;
+  ssize_t pread(char *addr, size_t n, off_t offset) override;
+  void onzero() override;
+
+  // Fill b with as many of the remaining struct xv6_dirent's as fit in len
+  // bytes, like sys_getdents().
+  ssize_t fill_dirents(char *b, size_t len);
+
+private:
+  const sref<snapshot> snap_;
+  const sref<mnode> m_;
+  sleeplock off_lock_;
+  u64 off_;
+  // A directory's entries as of the snapshot, read in on the first
+  // fill_dirents().
+  bool have_entries_;
+  std::vector<std::pair<fsname, u64>> entries_;
+};
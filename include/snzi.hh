@@ -3,6 +3,7 @@
 #include "spinlock.hh"
 #include "log2.hh"
 
+#include <atomic>
 #include <cstddef>
 #include <type_traits>
 
@@ -134,6 +135,161 @@ namespace locked_snzi
   };
 }
 
+// A SNZI whose departures don't have to happen where the matching
+// arrivals did, for counts like link counts, where a link made on one
+// core is often removed on another.  Like ::referenced, it starts out
+// with one reference and needs no cookies, so it works with a plain
+// sref.  dec() departs from the current core's leaf if it is non-zero
+// and otherwise from the nearest non-zero leaf, which it finds by
+// following the non-zero interior nodes down from the closest
+// ancestor.  The exact count is the sum of the leaves.
+namespace snzi
+{
+  class referenced
+  {
+    enum {
+      LEVELS = ceil_log2_const(NCPU) + 1,
+      FIRST_LEAF = (1 << (LEVELS - 1)) - 1,
+      NNODES = FIRST_LEAF + NCPU
+    };
+
+    // The same tree as locked_snzi::referenced.  val is only modified
+    // with lock held, but dec() reads it without the lock to look for
+    // a leaf to depart from.
+    struct node
+    {
+      spinlock lock;
+      std::atomic<uint64_t> val;
+
+      constexpr node() : lock("snzi::referenced::node"), val(0) {}
+    } nodes[NNODES];
+
+    static inline std::size_t parent(std::size_t n)
+    {
+      return (n - 1)/2;
+    }
+
+    static inline std::size_t first_child(std::size_t n)
+    {
+      return 2*n + 1;
+    }
+
+    static inline std::size_t sibling(std::size_t n)
+    {
+      return ((n + 1) ^ 1) - 1;
+    }
+
+    // Return a non-zero leaf in the subtree rooted at n, locked, or
+    // NNODES if it looks empty.
+    std::size_t lock_leaf_below(std::size_t n)
+    {
+      while (n < FIRST_LEAF) {
+        std::size_t c = first_child(n);
+        if (c < NNODES && nodes[c].val.load(std::memory_order_relaxed))
+          n = c;
+        else if (c + 1 < NNODES &&
+                 nodes[c + 1].val.load(std::memory_order_relaxed))
+          n = c + 1;
+        else
+          return NNODES;
+      }
+      if (n >= NNODES)
+        return NNODES;
+      nodes[n].lock.acquire();
+      if (nodes[n].val.load(std::memory_order_relaxed))
+        return n;
+      nodes[n].lock.release();
+      return NNODES;
+    }
+
+    // Return a non-zero leaf, locked, preferring ours.
+    std::size_t lock_departure_leaf()
+    {
+      std::size_t leaf = myid() + FIRST_LEAF;
+      while (true) {
+        std::size_t found = lock_leaf_below(leaf);
+        for (std::size_t n = leaf; found == NNODES && n != 0; n = parent(n))
+          found = lock_leaf_below(sibling(n));
+        if (found != NNODES)
+          return found;
+        // All we saw were leaves that emptied under us.  The count
+        // can't be zero, since our caller holds a reference.
+        assert(nodes[0].val.load(std::memory_order_relaxed));
+      }
+    }
+
+  public:
+    referenced()
+    {
+      for (std::size_t n = myid() + FIRST_LEAF; ; n = parent(n)) {
+        nodes[n].val.store(1, std::memory_order_relaxed);
+        if (n == 0)
+          break;
+      }
+    }
+
+    referenced(const referenced &o) = delete;
+    referenced(referenced &&o) = delete;
+    referenced &operator=(const referenced &o) = delete;
+    referenced &operator=(referenced &&o) = delete;
+
+    void inc()
+    {
+      std::size_t node = myid() + FIRST_LEAF;
+      nodes[node].lock.acquire();
+      while (true) {
+        if (nodes[node].val.fetch_add(1, std::memory_order_relaxed) ||
+            node == 0) {
+          nodes[node].lock.release();
+          return;
+        }
+        std::size_t next = parent(node);
+        nodes[next].lock.acquire();
+        nodes[node].lock.release();
+        node = next;
+      }
+    }
+
+    void dec()
+    {
+      std::size_t node = lock_departure_leaf();
+      while (true) {
+        assert(nodes[node].val.load(std::memory_order_relaxed));
+        if (nodes[node].val.fetch_sub(1, std::memory_order_relaxed) != 1) {
+          nodes[node].lock.release();
+          return;
+        } else if (node == 0) {
+          nodes[node].lock.release();
+          onzero();
+          return;
+        }
+        std::size_t next = parent(node);
+        nodes[next].lock.acquire();
+        nodes[node].lock.release();
+        node = next;
+      }
+    }
+
+    // Like refcache's get_consistent(), but only a snapshot.
+    u64 get_consistent() const
+    {
+      u64 sum = 0;
+      for (std::size_t n = FIRST_LEAF; n < NNODES; n++)
+        sum += nodes[n].val.load(std::memory_order_relaxed);
+      return sum;
+    }
+
+    u64 get_approx() const
+    {
+      return get_consistent();
+    }
+
+  protected:
+    virtual ~referenced() { }
+    virtual void onzero() { delete this; }
+  };
+}
+
 #if 0
 // XXX This specialization is unfortunate because it means that,
 // unlike a regular pointer, sref cannot be applied to an incomplete
@@ -4,3 +4,46 @@
 #include "scopedperf.hh"
 
 extern scopedperf::ctrgroup_chain<scopedperf::tsc_ctr> perfgroup;
+
+// Named scopedperf regions on hot kernel paths.  Each counts calls,
+// cycles, retired kernel instructions, and last-level cache misses
+// per region, but only while turned on through /dev/perfregions; off,
+// a region costs a load and a branch.  Calls that migrate aren't
+// counted, and calls that sleep include whatever ran meanwhile.
+
+extern bool sperf_regions_on;
+extern bool sperf_regions_pmcs;
+
+class sperf_enabler {
+ public:
+  bool enabled() const { return sperf_regions_on; }
+};
+
+// Reads the counters sampregions() programs, or 0 if the PMU doesn't
+// have them (rdpmc of a counter that doesn't exist faults).
+class sperf_pmc_ctr : public scopedperf::pmc_ctr<48> {
+ public:
+  sperf_pmc_ctr(int n, const char *nm) : scopedperf::pmc_ctr<48>(n, nm) {}
+  uint64_t sample() const {
+    return sperf_regions_pmcs ? scopedperf::pmc_ctr<48>::sample() : 0;
+  }
+};
+
+typedef scopedperf::perfsum_ctr<sperf_enabler, scopedperf::tsc_ctr,
+                                sperf_pmc_ctr, sperf_pmc_ctr> sperf_sum;
+
+#define SPERF_REGIONS(X)                                                \
+  X(syscall)                                                            \
+  X(namex)                                                              \
+  X(get_page)                                                           \
+  X(commit)                                                             \
+  X(apply)                                                              \
+  X(pagefault)                                                          \
+
+#define X(name) extern sperf_sum sperf_##name;
+SPERF_REGIONS(X)
+#undef X
+
+// Count the rest of the enclosing scope in region name.
+#define SPERF_REGION(name) \
+  auto __PERF_ANON = scopedperf::perf_region(&sperf_##name)
@@ -84,8 +84,24 @@ public:
 #define USE_CODEX_IMPL CODEX
 
 // Mutual exclusion lock.
+//
+// By default this is a test-and-set lock, which is the cheapest when
+// uncontended, but whose waiters all hammer the lock's cache line.  A
+// lock constructed with queued = true is instead a queued (MCS-style)
+// lock: it is taken the same way when it is free, but waiters queue up
+// in per-CPU nodes, each spinning on its own cache line, and get the
+// lock in FIFO order.  Use that for global locks that many cores contend
+// for.
 struct spinlock {
 
+  enum : u32 {
+    // Bits of locked: whether the lock is held, whether it is queued,
+    // and (for queued locks) the last waiter in the queue.
+    LOCKED = 1,
+    QUEUED = 2,
+    TAIL_SHIFT = 8,
+  };
+
 // Is the lock held?
 #if !USE_CODEX_IMPL
   std::atomic<u32> locked;
@@ -123,8 +139,9 @@ struct spinlock {
 
   // Create a spinlock.  This is constexpr, so it can be used for
   // global spinlocks without incurring a static constructor.
-  constexpr spinlock(const char *name, bool lockstat = false)
-    : locked(0)
+  constexpr spinlock(const char *name, bool lockstat = false,
+                     bool queued = false)
+    : locked(queued && !USE_CODEX_IMPL ? QUEUED : 0)
 #if SPINLOCK_DEBUG
     , name(name), cpu(nullptr), pcs{}
 #endif
@@ -166,6 +183,9 @@ struct spinlock {
 #if SPINLOCK_DEBUG
   bool holding();
 #endif
+
+private:
+  u64 acquire_queued();
 };
 
 #if SPINLOCK_DEBUG
@@ -174,6 +194,10 @@ struct spinlock {
 #define lockname(s) ("unknown")
 #endif
 
+// Count a contended sleeplock acquire in the lockstat of the sleeplock's
+// spinlock lk.
+void lockstat_sleeplock(struct spinlock *lk, bool slept);
+
 // Deprecated aliases for spinlock methods
 
 static inline void
@@ -0,0 +1,634 @@
+#pragma once
+
+/*
+ * A bucket-chaining hash table that grows and shrinks with the number of
+ * entries, one bucket at a time, by linear hashing: the table has n buckets,
+ * between base_ << L and base_ << (L + 1) for some level L; buckets below
+ * the split pointer n - (base_ << L) have been split and are
+ * indexed by one more bit of the hash than the others.  Growing splits the
+ * next bucket, moving the entries whose extra hash bit is set to a new bucket
+ * at the end; shrinking merges the last bucket back into its buddy.
+ *
+ * Lookups are lock-free as in chainhash.  A split first adds copies of the
+ * moving entries to the new bucket, then publishes the new geometry, then
+ * unlinks the originals (merges work the same way), so a reader that misses
+ * an entry always sees that the geometry changed and retries.  A key only
+ * changes buckets while its bucket is locked, so updates lock the bucket and
+ * then check that the key still maps to it.  Bucket segments that shrinking
+ * frees are RCU-freed, so updaters run in a gc epoch too.
+ *
+ * Enumeration is in order of the bit-reversed hash, where every bucket covers
+ * one contiguous range, so that a (prev, out) cursor stays valid across
+ * resizes.
+ */
+
+#include "spinlock.hh"
+#include "seqlock.hh"
+#include "lockwrap.hh"
+#include "hash.hh"
+#include "rculist.hh"
+#include "hpet.hh"
+#include "cpuid.hh"
+
+#include <algorithm>
+
+template<class K, class V>
+class splithash {
+public:
+  // See set_observer().
+  typedef void (*observer)(void *arg, const K& k, const V* old);
+
+private:
+  struct item : public rcu_freed {
+    item(const K& k, const V& v, u64 h)
+      : rcu_freed("splithash::item", this, sizeof(*this)),
+        key(k), val(v), hash(h) {}
+    void do_gc() override { delete this; }
+    NEW_DELETE_OPS(item);
+
+    rcu_slink<item> link;
+    seqcount<u32> seq;
+    const K key;
+    V val;
+    const u64 hash;
+  };
+
+  struct bucket {
+    spinlock lock __mpalign__;
+    rcu_slist<item, &item::link> chain;
+
+    ~bucket() {
+      while (!chain.empty()) {
+        item *i = &chain.front();
+        chain.pop_front();
+        gc_delayed(i);
+      }
+    }
+  };
+
+  // Buckets [base_ << (s - 1), base_ << s) live in segment s, and buckets
+  // [0, base_) in segment 0, so that buckets never move as the table grows.
+  struct segment : public rcu_freed {
+    segment(u64 n)
+      : rcu_freed("splithash::segment", this, sizeof(*this)),
+        buckets(new bucket[n]) {}
+    ~segment() { delete[] buckets; }
+    void do_gc() override { delete this; }
+    NEW_DELETE_OPS(segment);
+
+    bucket *buckets;
+  };
+
+  enum { max_segments = 48 };
+
+  u64 base_;
+  bool dead_;
+  observer observer_;
+  void *observer_arg_;
+  // The number of buckets in the low 32 bits, and the number of resizes so
+  // far above them, so that readers notice any resize, even one that was
+  // undone in the meantime.
+  std::atomic<u64> geom_;
+  std::atomic<u64> nitems_;
+  spinlock resize_lock_;
+  std::atomic<segment*> segments_[max_segments];
+
+  // Scramble the key's hash, since linear hashing uses its low bits.
+  static u64 hash_key(const K& k) {
+    u64 h = hash(k);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+  }
+
+  static u64 bitrev(u64 x) {
+    x = ((x >> 1) & 0x5555555555555555ull) | ((x & 0x5555555555555555ull) << 1);
+    x = ((x >> 2) & 0x3333333333333333ull) | ((x & 0x3333333333333333ull) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f0f0f0f0full) | ((x & 0x0f0f0f0f0f0f0f0full) << 4);
+    return __builtin_bswap64(x);
+  }
+
+  static u64 nbuckets(u64 geom) {
+    return geom & 0xffffffff;
+  }
+
+  void set_nbuckets(u64 n) {
+    geom_ = (((geom_ >> 32) + 1) << 32) | n;
+  }
+
+  static int log2(u64 x) {
+    return 63 - __builtin_clzl(x);
+  }
+
+  // base_ << L, for the level L of a table with n buckets.
+  u64 level_size(u64 n) const {
+    return base_ << (log2(n) - log2(base_));
+  }
+
+  u64 index(u64 h, u64 n) const {
+    u64 m = level_size(n);
+    u64 idx = h & (2 * m - 1);
+    return idx < n ? idx : h & (m - 1);
+  }
+
+  // Number of low hash bits that select bucket idx of a table with n buckets.
+  int depth(u64 idx, u64 n) const {
+    u64 m = level_size(n);
+    return log2(m) + (idx < n - m || idx >= m);
+  }
+
+  static int segment_of(u64 idx, u64 base) {
+    return idx < base ? 0 : log2(idx / base) + 1;
+  }
+
+  // Returns nullptr if a concurrent shrink just freed the bucket's segment.
+  bucket* get_bucket(u64 idx) const {
+    int s = segment_of(idx, base_);
+    u64 first = s ? base_ << (s - 1) : 0;
+    segment *seg = segments_[s].load();
+    return seg ? &seg->buckets[idx - first] : nullptr;
+  }
+
+  bucket* bucket_for(u64 h) const {
+    return get_bucket(index(h, nbuckets(geom_)));
+  }
+
+  // Lock the bucket that key hash h maps to.  Caller must be in a gc epoch.
+  bucket* lock_bucket(u64 h, scoped_acquire *l) {
+    for (;;) {
+      bucket *b = bucket_for(h);
+      if (!b)
+        continue;
+      *l = b->lock.guard();
+      if (bucket_for(h) == b)
+        return b;
+      l->release();
+    }
+  }
+
+  // Lock two distinct buckets in address order, like replace_from() does.
+  static void lock_pair(bucket *a, bucket *b, scoped_acquire *la,
+                        scoped_acquire *lb) {
+    if (a < b) {
+      *la = a->lock.guard();
+      *lb = b->lock.guard();
+    } else {
+      *lb = b->lock.guard();
+      *la = a->lock.guard();
+    }
+  }
+
+  void maybe_resize() {
+    u64 n = nbuckets(geom_), items = nitems_;
+    if (items <= 2 * n && (n == base_ || 2 * items >= n))
+      return;
+
+    auto l = resize_lock_.try_guard();
+    if (!l || dead_)
+      return;
+
+    // A stream of inserts needs one split per two inserts, but a stream of
+    // removes needs up to two merges per remove to catch up.
+    for (int step = 0; step < 2; step++) {
+      n = nbuckets(geom_);
+      items = nitems_;
+      if (items > 2 * n)
+        split(n);
+      else if (n > base_ && 2 * items < n)
+        merge(n);
+      else
+        break;
+    }
+  }
+
+  // Split bucket n - level_size(n) into itself and new bucket n.
+  // Caller must hold resize_lock_.
+  void split(u64 n) {
+    int s = segment_of(n, base_);
+    if (s >= max_segments || n >= 0xffffffff)
+      return;
+    if (!segments_[s].load())
+      segments_[s] = new segment(base_ << (s - 1));
+
+    u64 from = n - level_size(n);
+    bucket *bfrom = get_bucket(from), *bto = get_bucket(n);
+    scoped_acquire lfrom, lto;
+    lock_pair(bfrom, bto, &lfrom, &lto);
+
+    for (const item& i: bfrom->chain)
+      if (index(i.hash, n + 1) == n)
+        bto->chain.push_front(new item(i.key, *seq_reader<V>(&i.val, &i.seq),
+                                       i.hash));
+    set_nbuckets(n + 1);
+
+    auto i = bfrom->chain.before_begin();
+    for (;;) {
+      auto prev = i;
+      ++i;
+      if (i == bfrom->chain.end())
+        break;
+      if (index(i->hash, n + 1) == n) {
+        bfrom->chain.erase_after(prev);
+        gc_delayed(&*i);
+        i = prev;
+      }
+    }
+  }
+
+  // Merge the last bucket, n - 1, back into the bucket it was split from.
+  // Caller must hold resize_lock_.
+  void merge(u64 n) {
+    u64 last = n - 1;
+    u64 into = last - level_size(last);
+    bucket *binto = get_bucket(into), *blast = get_bucket(last);
+    {
+      scoped_acquire linto, llast;
+      lock_pair(binto, blast, &linto, &llast);
+
+      for (const item& i: blast->chain)
+        binto->chain.push_front(new item(i.key,
+                                         *seq_reader<V>(&i.val, &i.seq),
+                                         i.hash));
+      set_nbuckets(last);
+
+      while (!blast->chain.empty()) {
+        item *i = &blast->chain.front();
+        blast->chain.pop_front();
+        gc_delayed(i);
+      }
+    }
+
+    // Give back the segment once its first bucket is gone.
+    int s = segment_of(last, base_);
+    if (s && last == base_ << (s - 1)) {
+      segment *seg = segments_[s].exchange(nullptr);
+      gc_delayed(seg);
+    }
+  }
+
+public:
+  // The table never shrinks below minbuckets (rounded up to a power of two).
+  splithash(u64 minbuckets)
+    : dead_(false), observer_(nullptr), observer_arg_(nullptr), nitems_(0) {
+    base_ = 1;
+    while (base_ < minbuckets)
+      base_ <<= 1;
+    geom_ = base_;
+    for (int s = 0; s < max_segments; s++)
+      segments_[s] = nullptr;
+    segments_[0] = new segment(base_);
+  }
+
+  ~splithash() {
+    for (int s = 0; s < max_segments; s++)
+      delete segments_[s].load();
+  }
+
+  NEW_DELETE_OPS(splithash);
+
+  // Call fn(arg, k, old) with the bucket lock held just before an update
+  // changes the value of k (or adds k, when old is null), so that it can
+  // see the value k had before.  Inserts with quiet set are not reported.
+  void set_observer(observer fn, void *arg) {
+    observer_ = fn;
+    observer_arg_ = arg;
+  }
+
+  bool insert(const K& k, const V& v, u64 *tsc = NULL, bool quiet = false) {
+    if (dead_ || lookup(k))
+      return false;
+
+    u64 h = hash_key(k);
+    {
+      scoped_gc_epoch rcu_read;
+      scoped_acquire l;
+      bucket* b = lock_bucket(h, &l);
+
+      if (dead_)
+        return false;
+
+      for (const item& i: b->chain)
+        if (i.key == k)
+          return false;
+
+      if (observer_ && !quiet)
+        observer_(observer_arg_, k, nullptr);
+      b->chain.push_front(new item(k, v, h));
+      nitems_++;
+      if (tsc)
+        *tsc = get_tsc();
+    }
+    maybe_resize();
+    return true;
+  }
+
+  bool remove(const K& k, const V& v, u64 *tsc = NULL) {
+    if (!lookup(k))
+      return false;
+
+    {
+      scoped_gc_epoch rcu_read;
+      scoped_acquire l;
+      bucket* b = lock_bucket(hash_key(k), &l);
+
+      auto i = b->chain.before_begin();
+      auto end = b->chain.end();
+      for (;;) {
+        auto prev = i;
+        ++i;
+        if (i == end)
+          return false;
+        if (i->key == k && i->val == v) {
+          if (observer_)
+            observer_(observer_arg_, k, &i->val);
+          b->chain.erase_after(prev);
+          gc_delayed(&*i);
+          nitems_--;
+          if (tsc)
+            *tsc = get_tsc();
+          break;
+        }
+      }
+    }
+    maybe_resize();
+    return true;
+  }
+
+  bool remove(const K& k, u64 *tsc = NULL) {
+    if (!lookup(k))
+      return false;
+
+    {
+      scoped_gc_epoch rcu_read;
+      scoped_acquire l;
+      bucket* b = lock_bucket(hash_key(k), &l);
+
+      auto i = b->chain.before_begin();
+      auto end = b->chain.end();
+      for (;;) {
+        auto prev = i;
+        ++i;
+        if (i == end)
+          return false;
+        if (i->key == k) {
+          if (observer_)
+            observer_(observer_arg_, k, &i->val);
+          b->chain.erase_after(prev);
+          gc_delayed(&*i);
+          nitems_--;
+          if (tsc)
+            *tsc = get_tsc();
+          break;
+        }
+      }
+    }
+    maybe_resize();
+    return true;
+  }
+
+  // The rename API of chainhash::replace_from(); see there.
+  bool replace_from(const K& kdst, const V* vpdst, splithash* src,
+                    const K& ksrc, const V& vsrc, splithash *subdir,
+                    const K& ksubdir, const V& vsubdir, u64 *tsc = NULL)
+  {
+    u64 hdst = hash_key(kdst), hsrc = hash_key(ksrc);
+    u64 hsubdir = subdir ? hash_key(ksubdir) : 0;
+    bool moved = false;
+
+    {
+      scoped_gc_epoch rcu_read;
+      bucket *bdst, *bsrc, *bsubdir;
+      scoped_acquire lk[3];
+
+      // Lock the source, destination and subdir buckets in the order of
+      // increasing addresses, and start over if any of the tables was
+      // resized under us.
+      for (;;) {
+        bdst = bucket_for(hdst);
+        bsrc = src->bucket_for(hsrc);
+        bsubdir = subdir ? subdir->bucket_for(hsubdir) : nullptr;
+        if (!bdst || !bsrc || (subdir && !bsubdir))
+          continue;
+
+        bucket *buckets[3];
+        int nb = 0;
+        if (bsubdir != nullptr && bsubdir != bsrc && bsubdir != bdst)
+          buckets[nb++] = bsubdir;
+        if (bsrc != bdst)
+          buckets[nb++] = bsrc;
+        buckets[nb++] = bdst;
+        std::sort(buckets, buckets + nb);
+        for (int i = 0; i < nb; i++)
+          lk[i] = buckets[i]->lock.guard();
+
+        if (bucket_for(hdst) == bdst && src->bucket_for(hsrc) == bsrc &&
+            (!subdir || subdir->bucket_for(hsubdir) == bsubdir))
+          break;
+
+        for (int i = 0; i < nb; i++)
+          lk[i].release();
+      }
+
+      /*
+       * Abort the rename if the destination directory's hash table has been
+       * killed by a concurrent unlink.
+       */
+      if (killed())
+        return false;
+
+      if (subdir && subdir->killed())
+        return false;
+
+      auto srci = bsrc->chain.before_begin();
+      auto srcend = bsrc->chain.end();
+      auto srcprev = srci;
+      for (;;) {
+        ++srci;
+        if (srci == srcend)
+          return false;
+        if (srci->key != ksrc) {
+          srcprev = srci;
+          continue;
+        }
+        if (srci->val != vsrc)
+          return false;
+        break;
+      }
+
+      item *idst = nullptr;
+      for (item& i: bdst->chain) {
+        if (i.key == kdst) {
+          idst = &i;
+          break;
+        }
+      }
+
+      if (idst ? vpdst == nullptr || idst->val != *vpdst : vpdst != nullptr)
+        return false;
+
+      if (observer_)
+        observer_(observer_arg_, kdst, idst ? &idst->val : nullptr);
+      if (src->observer_)
+        src->observer_(src->observer_arg_, ksrc, &srci->val);
+
+      // Unlink the source before inserting the destination: if they
+      // share a bucket and the source is first, srcprev's successor
+      // would otherwise be the new item.
+      item *inew = idst ? nullptr : new item(kdst, vsrc, hdst);
+      bsrc->chain.erase_after(srcprev);
+      gc_delayed(&*srci);
+      src->nitems_--;
+      if (idst) {
+        auto w = idst->seq.write_begin();
+        idst->val = vsrc;
+      } else {
+        bdst->chain.push_front(inew);
+        nitems_++;
+        moved = true;
+      }
+
+      if (bsubdir != nullptr) {
+        for (item& isubdir : bsubdir->chain) {
+          if (isubdir.key == ksubdir) {
+            if (subdir->observer_)
+              subdir->observer_(subdir->observer_arg_, ksubdir, &isubdir.val);
+            auto wsubdir = isubdir.seq.write_begin();
+            isubdir.val = vsubdir;
+          }
+        }
+      }
+
+      if (tsc)
+        *tsc = get_tsc();
+    }
+
+    if (moved)
+      maybe_resize();
+    src->maybe_resize();
+    return true;
+  }
+
+  bool enumerate(const K* prev, K* out, V* vout = nullptr) const {
+    scoped_gc_epoch rcu_read;
+
+    u64 rprev = prev ? bitrev(hash_key(*prev)) : 0;
+    u64 r = rprev;
+    for (;;) {
+      u64 geom = geom_, n = nbuckets(geom);
+      u64 idx = index(bitrev(r), n);
+      bucket* b = get_bucket(idx);
+      if (!b)
+        continue;
+      bool found = false;
+      u64 rout = 0;
+      for (const item& i: b->chain) {
+        u64 ri = bitrev(i.hash);
+        if (prev && (ri < rprev || (ri == rprev && !(*prev < i.key))))
+          continue;
+        if (!found || ri < rout || (ri == rout && i.key < *out)) {
+          *out = i.key;
+          if (vout)
+            *vout = *seq_reader<V>(&i.val, &i.seq);
+          rout = ri;
+          found = true;
+        }
+      }
+      if (geom_ != geom)
+        continue;
+      if (found)
+        return true;
+
+      // Move on to the range of hashes covered by the next bucket.
+      int d = depth(idx, n);
+      if (d == 0)
+        return false;
+      r = ((r >> (64 - d)) + 1) << (64 - d);
+      if (r == 0)
+        return false;
+    }
+  }
+
+  // Like chainhash::enumerate(), this is not a snapshot: entries that are
+  // added, removed or moved by a resize while it runs may be missed or
+  // reported twice.
+  template<class CB>
+  void enumerate(CB cb) const {
+    scoped_gc_epoch rcu_read;
+
+    u64 n = nbuckets(geom_);
+    for (u64 idx = 0; idx < n; idx++) {
+      bucket* b = get_bucket(idx);
+      if (!b)
+        continue;
+
+      for (const item& i: b->chain) {
+        if (index(i.hash, n) != idx)
+          continue;
+        V val = *seq_reader<V>(&i.val, &i.seq);
+        if (cb(i.key, val))
+          return;
+      }
+    }
+  }
+
+  bool lookup(const K& k, V* vptr = nullptr) const {
+    scoped_gc_epoch rcu_read;
+
+    u64 h = hash_key(k);
+    for (;;) {
+      u64 geom = geom_;
+      bucket* b = get_bucket(index(h, nbuckets(geom)));
+      if (!b)
+        continue;
+      for (const item& i: b->chain) {
+        if (i.key != k)
+          continue;
+        if (vptr)
+          *vptr = *seq_reader<V>(&i.val, &i.seq);
+        return true;
+      }
+      if (geom_ == geom)
+        return false;
+    }
+  }
+
+  bool remove_and_kill(const K& k, const V& v) {
+    if (dead_ || nitems_ != 1 || !lookup(k))
+      return false;
+
+    // Holding resize_lock_ keeps the set of buckets stable.
+    auto rl = resize_lock_.guard();
+    u64 n = nbuckets(geom_);
+    for (u64 i = 0; i < n; i++)
+      get_bucket(i)->lock.acquire();
+
+    bool killed = !dead_ && nitems_ == 1;
+    bucket* b = get_bucket(index(hash_key(k), n));
+    if (killed) {
+      item* i = b->chain.empty() ? nullptr : &b->chain.front();
+      killed = i && i->key == k && i->val == v;
+    }
+
+    if (killed) {
+      dead_ = true;
+      item* i = &b->chain.front();
+      if (observer_)
+        observer_(observer_arg_, k, &i->val);
+      b->chain.pop_front();
+      gc_delayed(i);
+      nitems_--;
+    }
+
+    for (u64 i = 0; i < n; i++)
+      get_bucket(i)->lock.release();
+
+    return killed;
+  }
+
+  bool killed() const {
+    return dead_;
+  }
+};
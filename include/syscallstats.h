@@ -0,0 +1,34 @@
+#pragma once
+
+// Per-core system call counts and latencies, by system call.  A read
+// of /dev/syscalls returns a syscallstats_info followed by each core's
+// syscall_stats.  Writing "on", "off", or "reset" to it turns the
+// accounting on (the default) or off, or clears it.  bin/syscallstat
+// prints them.
+
+#include <stdint.h>
+
+// Slots for this many system call numbers; higher ones aren't counted.
+#define SYSCALL_STATS_MAX 128
+#define SYSCALL_NAME_MAX  24
+
+// hist[num][i] counts calls that took [2^(i+SC_HIST_SHIFT),
+// 2^(i+SC_HIST_SHIFT+1)) cycles; the first and last buckets also take
+// everything below and above them.
+#define SC_HIST_SHIFT   8
+#define SC_HIST_BUCKETS 20
+
+struct syscall_stats {
+  uint64_t count[SYSCALL_STATS_MAX];
+  uint64_t cycles[SYSCALL_STATS_MAX];
+  uint64_t hist[SYSCALL_STATS_MAX][SC_HIST_BUCKETS];
+};
+
+struct syscallstats_info {
+  uint64_t ncpus;
+  uint64_t cpuhz;
+  uint64_t enabled;
+  uint64_t nsyscalls;               // Valid entries of names
+  char names[SYSCALL_STATS_MAX][SYSCALL_NAME_MAX]; // Without the sys_
+  struct syscall_stats cpu[];       // ncpus entries
+};
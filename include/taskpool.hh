@@ -0,0 +1,171 @@
+#pragma once
+
+// A work-stealing task pool for user programs.  A pool has one worker
+// per core, each pinned with setaffinity(): the thread that creates
+// the pool is worker 0 and the pool starts a thread for each of the
+// others.  Each worker pushes the tasks it spawns on its own deque and
+// runs them newest first; a worker with nothing to do steals the
+// oldest task from a random other worker, and after a while of finding
+// nothing it sleeps on a futex until more work is spawned.
+//
+// parallel_for() and parallel_reduce() split a range in halves until
+// the pieces are no bigger than grain, so the work spreads out by
+// stealing rather than by a fixed partition.  They should be called
+// from worker 0 or from inside a task; from any other thread they run
+// the whole range on that thread.  See lib/taskpool.cc.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <sys/types.h>
+
+class task_pool
+{
+public:
+  class task
+  {
+  public:
+    virtual void run() = 0;
+    virtual ~task() { }
+
+  private:
+    friend class task_pool;
+    std::atomic<long> *pending_;
+  };
+
+  // Pin the calling thread to first_core and start nworkers-1 more
+  // workers on the following cores.
+  task_pool(int nworkers, int first_core = 0);
+  ~task_pool();
+
+  task_pool(const task_pool &) = delete;
+  task_pool &operator=(const task_pool &) = delete;
+
+  int workers() const
+  {
+    return nworkers_;
+  }
+
+  // Run t (which must come from new) on some worker and then delete
+  // it.  Each spawn counts against *pending until t finishes.
+  void spawn(task *t, std::atomic<long> *pending);
+
+  // Run tasks until *pending drops to zero.
+  void wait(std::atomic<long> *pending);
+
+  // Call fn(i) for each i in [begin, end), in pieces of at most grain.
+  template<class Fn>
+  void parallel_for(size_t begin, size_t end, size_t grain, Fn fn)
+  {
+    if (grain == 0)
+      grain = 1;
+    if (current() != this) {
+      for (size_t i = begin; i < end; i++)
+        fn(i);
+      return;
+    }
+    std::atomic<long> pending(0);
+    for_range(begin, end, grain, fn, &pending);
+    wait(&pending);
+  }
+
+  // Reduce [begin, end) in pieces of at most grain.  map(b, e) reduces
+  // [b, e) and combine(x, y) merges two results.  Pieces are combined
+  // in order starting with identity, so combine need not commute.
+  template<class T, class Map, class Combine>
+  T parallel_reduce(size_t begin, size_t end, size_t grain, T identity,
+                    Map map, Combine combine)
+  {
+    if (grain == 0)
+      grain = 1;
+    if (begin >= end)
+      return identity;
+    size_t npieces = (end - begin + grain - 1) / grain;
+    std::vector<T> parts(npieces, identity);
+    parallel_for(0, npieces, 1, [&](size_t p) {
+        size_t b = begin + p * grain;
+        parts[p] = map(b, std::min(end, b + grain));
+      });
+    T res = identity;
+    for (auto &part : parts)
+      res = combine(res, part);
+    return res;
+  }
+
+private:
+  // A per-worker Chase-Lev deque.  The owner pushes and pops at the
+  // bottom; thieves take from the top.
+  struct deque
+  {
+    enum { CAPACITY = 4096 };
+    std::atomic<long> top;
+    // Thieves write top and the owner writes bottom.
+    char pad_[64 - sizeof(std::atomic<long>)];
+    std::atomic<long> bottom;
+    std::atomic<task*> slots[CAPACITY];
+
+    deque() : top(0), bottom(0) { }
+    bool push(task *t);
+    task *pop();
+    task *steal();
+  };
+
+  struct worker
+  {
+    task_pool *pool;
+    int id;
+    int core;
+    pid_t tid;
+    uint64_t rand;
+    deque q;
+  };
+
+  template<class Fn>
+  class range_task : public task
+  {
+    task_pool *pool_;
+    size_t begin_, end_, grain_;
+    Fn &fn_;
+
+  public:
+    range_task(task_pool *pool, size_t begin, size_t end, size_t grain,
+               Fn &fn)
+      : pool_(pool), begin_(begin), end_(end), grain_(grain), fn_(fn) { }
+
+    void run() override
+    {
+      pool_->for_range(begin_, end_, grain_, fn_, pending_);
+    }
+  };
+
+  // Hand off the upper halves of [begin, end) as tasks and run the
+  // rest here.
+  template<class Fn>
+  void for_range(size_t begin, size_t end, size_t grain, Fn &fn,
+                 std::atomic<long> *pending)
+  {
+    while (end - begin > grain) {
+      size_t mid = begin + (end - begin) / 2;
+      spawn(new range_task<Fn>(this, mid, end, grain, fn), pending);
+      end = mid;
+    }
+    for (size_t i = begin; i < end; i++)
+      fn(i);
+  }
+
+  static task_pool *current();
+  static void *worker_main(void *arg);
+  void execute(task *t);
+  task *find_task(worker *w);
+  bool has_work() const;
+  void idle(worker *w);
+
+  int nworkers_;
+  worker *workers_;
+  std::atomic<bool> stop_;
+  // Bumped by spawn() when workers are asleep; they wait on it.
+  std::atomic<uint64_t> epoch_;
+  std::atomic<int> sleepers_;
+};
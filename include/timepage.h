@@ -0,0 +1,28 @@
+#pragma once
+
+// The time page: a read-only page the kernel maps at TIMEPAGE_VA in
+// every address space, from which user space can compute the time
+// without a system call.  The time is extrapolated from the TSC, which
+// is assumed to run at the same constant rate on every core:
+//
+//   nsec = base + ((rdtsc() - tsc_base) * mult) >> 32
+//
+// where base is uptime_base for time since boot and realtime_base for
+// time since the UNIX epoch.  The kernel brackets updates with seq,
+// which is odd while an update is in progress; readers retry if seq
+// was odd or changed while they read.  cpuhz is 0 until the kernel has
+// filled the page in.  lib/timepage.c reads it.
+
+#include <stdint.h>
+
+#define TIMEPAGE_VA 0x00007fff00000000ull  // 4GB below USERTOP
+
+struct timepage {
+  uint32_t seq;
+  uint32_t pad;
+  uint64_t cpuhz;               // TSC ticks per second
+  uint64_t mult;                // Nanoseconds per TSC tick, << 32
+  uint64_t tsc_base;
+  uint64_t uptime_base;         // Nanoseconds since boot at tsc_base
+  uint64_t realtime_base;       // Nanoseconds since the epoch at tsc_base
+};
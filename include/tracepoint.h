@@ -0,0 +1,50 @@
+#pragma once
+
+// Kernel tracepoint records, kept by the kernel in a ring per core and
+// read from /dev/tracepoints.  Writing a mask of TP_* bits (decimal or
+// 0x hex), or "all", to /dev/tracepoints clears the rings and enables
+// those tracepoints; writing "0" disables them all.  As with
+// /dev/schedtrace, stop tracing before reading.  A read returns a
+// tracepoint_header followed by each core's records, oldest first, at
+// the offsets the header gives.  tools/trace-report decodes this.
+
+#include <stdint.h>
+
+// X(id, name, arg0, arg1, arg2), where the args describe what the
+// tracepoint records in arg[0..2] ("" if nothing).
+#define TRACEPOINTS(X)                                                  \
+  X(FS_FSYNC,      "fs_fsync",      "mnum", "", "")                     \
+  X(FS_COMMIT,     "fs_commit",     "journal", "apply", "")             \
+  X(FS_READPAGE,   "fs_readpage",   "mnum", "page", "")                 \
+  X(VM_PAGEFAULT,  "vm_pagefault",  "va", "err", "")                    \
+  X(VM_MMAP,       "vm_mmap",       "start", "len", "")                 \
+  X(VM_MUNMAP,     "vm_munmap",     "start", "len", "")                 \
+  X(SCHED_SWITCH,  "sched_switch",  "prev", "next", "")                 \
+  X(SCHED_WAKEUP,  "sched_wakeup",  "pid", "cpu", "")                   \
+  X(NET_RX,        "net_rx",        "packets", "bytes", "")             \
+  X(NET_TX,        "net_tx",        "bytes", "", "")                    \
+
+enum {
+#define X(id, name, a0, a1, a2) TP_##id,
+  TRACEPOINTS(X)
+#undef X
+  TP_NTYPES,
+};
+
+struct tracepoint_event {
+  uint64_t tsc;
+  uint32_t pid;                 // Of the running process, or 0
+  uint16_t id;                  // TP_*
+  uint16_t pad;
+  uint64_t arg[3];
+};
+
+struct tracepoint_header {
+  uint64_t ncpus;
+  uint64_t cpuhz;
+  struct {
+    uint64_t offset;            // Of this core's first record
+    uint64_t count;             // Records in the trace
+    uint64_t dropped;           // Older records the ring overwrote
+  } cpu[];                      // ncpus entries
+} __attribute__((packed));
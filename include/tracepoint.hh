@@ -0,0 +1,19 @@
+#pragma once
+
+// Static tracepoints (see tracepoint.h).  A disabled tracepoint costs a
+// load of tracepoint_mask and a branch; its arguments aren't evaluated.
+
+#include "tracepoint.h"
+#include <atomic>
+
+extern std::atomic<u64> tracepoint_mask;
+
+void tracepoint_record(int id, u64 a0 = 0, u64 a1 = 0, u64 a2 = 0);
+
+// TRACEPOINT(FS_FSYNC, mnum) records a TP_FS_FSYNC if it's enabled.
+#define TRACEPOINT(id, ...)                                             \
+  do {                                                                  \
+    if (__builtin_expect(tracepoint_mask.load(std::memory_order_relaxed) \
+                         & (1ull << TP_##id), 0))                       \
+      tracepoint_record(TP_##id, ##__VA_ARGS__);                        \
+  } while (0)
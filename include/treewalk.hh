@@ -0,0 +1,62 @@
+#pragma once
+
+// Parallel directory tree walks on a task_pool.  For each directory,
+// the walk calls enter(), reads all of its entries with getdents_stat(),
+// passes the ones that aren't directories to files(), walks the
+// subdirectories as tasks of their own so that idle workers can steal
+// them, and calls leave() once they are all done.  Directories are
+// opened relative to their parent's fd, so no path is looked up twice.
+//
+// Callbacks for different directories run concurrently on any of the
+// pool's workers, so subclasses must do their own locking.  A callback
+// may itself use the pool, say to spread a large directory's files
+// with parallel_for().  See lib/treewalk.cc.
+
+#include "taskpool.hh"
+
+#include <string>
+
+struct xv6_direntstat;
+
+class tree_walk
+{
+public:
+  explicit tree_walk(task_pool *pool) : pool_(pool) { }
+  virtual ~tree_walk() { }
+
+  // Walk the tree at root, which should be called from worker 0 of the
+  // pool.  Returns -1 if root can't be opened or isn't a directory.
+  int walk(const char *root);
+
+protected:
+  // Called with fd open on the directory at path, before any of its
+  // entries.  Returning false skips the directory.
+  virtual bool enter(const std::string &path, int fd)
+  {
+    return true;
+  }
+
+  // Called with the n entries of path other than subdirectories, "."
+  // and "..".  ents is only valid during the call.
+  virtual void files(const std::string &path, int fd,
+                     struct xv6_direntstat *const *ents, size_t n) { }
+
+  // Called once path's subdirectories have all been walked and its fd
+  // closed.
+  virtual void leave(const std::string &path) { }
+
+  // Called if the directory at path can't be opened or read.
+  virtual void error(const std::string &path) { }
+
+  task_pool *pool() const
+  {
+    return pool_;
+  }
+
+private:
+  class dir_task;
+
+  void walk_dir(const std::string &path, int fd);
+
+  task_pool *pool_;
+};
@@ -10,6 +10,17 @@ struct sockaddr;
 
 // ulib.c
 char* gets(char*, int max);
+// AT_FDCWD wrappers for the *at syscalls, which used to be syscalls
+// themselves (also declared in <unistd.h> and <stdio.h>).
+int link(const char *oldpath, const char *newpath);
+int unlink(const char *pathname);
+int rename(const char *oldpath, const char *newpath);
+
+// timepage.c
+// Nanoseconds since boot and since the UNIX epoch, computed from the
+// kernel's time page without a system call (see timepage.h).
+u64 uptime_nsec(void);
+u64 realtime_nsec(void);
 
 // uthread.S
 int forkt(void *sp, void *pc, void *arg, int forkflags);
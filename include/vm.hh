@@ -48,6 +48,12 @@ struct vmdesc : public mmu::page_tracker
 
     // Set if the page should be shared across fork().
     FLAG_SHARED = 1<<5,
+
+    // File readahead hints from madvise().  At most one is set.
+    // FLAG_SEQUENTIAL makes faults read well ahead of the faulting
+    // page; FLAG_RANDOM makes them read only the faulting page.
+    FLAG_SEQUENTIAL = 1<<6,
+    FLAG_RANDOM = 1<<7,
   };
 
   // Flags
@@ -85,6 +91,13 @@ struct vmdesc : public mmu::page_tracker
   // A memory descriptor for writable anonymous memory.
   static struct vmdesc anon_desc;
 
+  // A memory descriptor that maps page read-only.  It's COW, so if the
+  // mapping is made writable, writes go to a private copy.
+  static vmdesc readonly_page(const sref<class page_info> &page)
+  {
+    return vmdesc(FLAG_MAPPED | FLAG_ANON | FLAG_COW, page, sref<mnode>(), 0);
+  }
+
   // Radix_array element methods
 
   bit_spinlock get_lock()
@@ -138,17 +151,32 @@ struct vmap : public referenced {
   // Unmap from virtual addresses start to start+len.
   int remove(uptr start, uptr len);
 
-  // Unmap a single virtual page. Called when the mapped file page has been
-  // truncated (or swapped out). The entry is unset from vpfs_ as well.
-  void delete_mapping(uptr addr);
+  // Unmap the pages of file m between virtual addresses start and end,
+  // unsetting them from vpfs_.  Called when those pages of the file
+  // have been truncated.
+  void delete_file_range(mnode *m, uptr start, uptr end);
 
-  // Unmap a single virtual page, but don't unset it from vpfs_. Clear the
-  // mapping from vmdesc. Used while evicting pages from the page-cache.
-  void clear_mapping(uptr addr);
+  // If the virtual page at addr maps page pi, unmap it, but don't unset
+  // it from vpfs_: clear the page from its vmdesc, so the next fault
+  // reads the file again.  Used while evicting pages from the page-cache.
+  void clear_mapping(uptr addr, const page_info *pi);
 
   // Populate vmdesc's.
   int willneed(uptr start, uptr len);
 
+  // Like willneed, but map whole huge pages of anonymous memory with
+  // huge pages (for MAP_POPULATE and MADV_WILLNEED).
+  int populate(uptr start, uptr len);
+
+  // Drop the pages of private mappings in a range (MADV_DONTNEED).
+  // Anonymous memory reads as zeros afterwards, and private file
+  // mappings as the file.  Shared mappings keep their pages.
+  int dontneed(uptr start, uptr len);
+
+  // Set the readahead hint of a range.  hint must be 0,
+  // FLAG_SEQUENTIAL, or FLAG_RANDOM.
+  int advise(uptr start, uptr len, uint64_t hint);
+
   // Invalidate page caches.
   int invalidate_cache(uptr start, uptr len);
 
@@ -162,10 +190,10 @@ struct vmap : public referenced {
   int pagefault(uptr va, u32 err);
 
   // Map virtual address va in this address space to a kernel virtual
-  // address, performing the equivalent of a read page fault if
-  // necessary.  Returns nullptr if va is not mapped.  Needless to
+  // address, performing the equivalent of a read (or write) page fault
+  // if necessary.  Returns nullptr if va is not mapped.  Needless to
   // say, this mapping is only valid within the returned page.
-  void* pagelookup(uptr va);
+  void* pagelookup(uptr va, bool write = false);
 
   // Copy len bytes from p to user address va in vmap.  Most useful
   // when vmap is not the current page table.
@@ -205,6 +233,16 @@ private:
 
   struct spinlock brklock_;
 
+  // Anonymous pages that remove() unmapped while other cores may still
+  // reach them through stale mappings (see page_map_cache::defer),
+  // each with the generation it waits for.
+  spinlock lazy_lock_;
+  std::vector<std::pair<u64, sref<page_info> > > lazy_pages_;
+
+  // Free the pages in lazy_pages_ that are unreachable now.  If too
+  // many remain, make the cores that hold them up catch up first.
+  void reap_lazy();
+
   enum class access_type
   {
     READ, WRITE
@@ -213,7 +251,20 @@ private:
   // Ensure there is a backing page at @c it.  The caller is
   // responsible for ensuring that there is a mapping at @c it and for
   // locking vpfs_ at @c it.  This throws bad_alloc if a page must be
-  // allocated and cannot be.
+  // allocated and cannot be.  If @c fresh points to a page, that page
+  // is used (and *fresh cleared) if one must be allocated.
   page_info *ensure_page(const vpf_array::iterator &it, access_type type,
-                         bool *allocated = nullptr);
+                         bool *allocated = nullptr, void **fresh = nullptr);
+
+  // Try to handle a fault at va by mapping the whole HUGE_PGSIZE
+  // aligned region around it with a huge page, allocating one if the
+  // region is untouched anonymous memory.  Returns false if the
+  // region can't be mapped this way, in which case the caller should
+  // handle the fault one page at a time.
+  bool huge_fault(uptr va, access_type type, bool *allocated);
+
+  // After a read fault at va on a file mapping, map the pages around
+  // it, in its FAULT_AROUND_PAGES aligned window, whose file pages
+  // are already in the page cache.
+  void fault_around(uptr va);
 };
@@ -5,6 +5,7 @@
 #include "refcache.hh"
 #include "hash.hh"
 #include "log2.hh"
+#include "kmcache.hh"
 
 template<class K, class V>
 class weakcache
@@ -32,7 +33,7 @@ private:
       : rcu_freed("weakcache::item", this, sizeof(*this)),
         key_(k), weakref_(v), parent_(b) {}
     void do_gc() override { delete this; }
-    NEW_DELETE_OPS(item)
+    NEW_DELETE_OPS_CACHED(item)
   };
 
   class bucket
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "types.h"
+
+u64 zlib_compress_blocks(const char *const *src, u32 nsrc, char *const *dst,
+                         u32 ndst);
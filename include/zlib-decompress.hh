@@ -2,5 +2,8 @@
 
 #include "types.h"
 
+void *zlib_alloc(void *opaque, unsigned count, unsigned nbytes);
+void zlib_free(void *opaque, void *p);
 int zlib_decompress(unsigned char *src, u64 srclen, u64 dstlen,
                     void (*copy_output)(const char *buf, u64 offset, u64 size));
+s64 zlib_decompress_buf(const void *src, u64 srclen, void *dst, u64 dstlen);
@@ -12,9 +12,14 @@
 #include "spinlock.hh"
 #include "condvar.hh"
 #include "cpu.hh"
+#include "percpu.hh"
 
 enum { fis_debug = 0 };
 
+// ahci_hba::handle_irq() keeps servicing ports until the HBA's interrupt
+// status stays clear, up to this many passes per interrupt.
+enum { irq_coalesce_passes = 8 };
+
 static struct {
   char model[40];
   char serial[20];
@@ -56,6 +61,8 @@ public:
   void awritev(kiovec *iov, int iov_cnt, u64 off,
               sref<disk_completion> dc) override;
   void aflush(sref<disk_completion> dc) override;
+  void awritev_fua(kiovec *iov, int iov_cnt, u64 off,
+                   sref<disk_completion> dc) override;
 
   void handle_port_irq();
   void handle_error();
@@ -78,16 +85,66 @@ private:
   int wait();
 
   void issue(int cmdslot, kiovec* iov, int iov_cnt, u64 off, int cmd,
-             bool cmd_is_ncq = false);
+             bool cmd_is_ncq = false, bool poll = true, bool fua = false);
 
   // For the disk read/write interface..
-  u32 cmds_issued;
-  int last_cmdslot;
+  //
+  // Command slots are allocated lock-free from the free_cmdslots bitmap. A
+  // slot is marked in cmds_issued once its command has been handed to the
+  // port, and whoever sees it done (the interrupt handler or a submitter
+  // polling right after issuing) claims it by clearing that bit, so each
+  // completion is reaped exactly once. cmdslot_claim[s] is the set of slots
+  // to free when the command in slot s completes: just s, or all of them for
+  // a non-NCQ FLUSH that must not overlap NCQ commands.
+  std::atomic<u32> free_cmdslots;
+  std::atomic<u32> cmds_issued;
+  u32 cmdslot_claim[32];
+  sref<disk_completion> cmdslot_dc[32];
+
+  // Submitters that find every slot busy stage their command on a per-core
+  // queue instead of sleeping; completions hand freed slots to the staged
+  // commands, which keeps the device's queue full. There is a set of queues
+  // for each priority class (see blkio_prio), and freed slots go to the most
+  // urgent class with staged commands, so that journal commits don't wait
+  // behind a backlog of bulk writes.
+  struct staged_cmd {
+    staged_cmd *next;
+    std::vector<kiovec> iov;
+    u64 off;
+    int cmd;
+    bool cmd_is_ncq;
+    bool fua;
+    int prio;
+    sref<disk_completion> dc;
+
+    NEW_DELETE_OPS(staged_cmd);
+  };
+  struct staging_queue {
+    spinlock lock;
+    staged_cmd *head, *tail;
+    staging_queue() : lock("ahci_port::staging_queue"), head(nullptr),
+                      tail(nullptr) {}
+  };
+  percpu<staging_queue> staged[BLKIO_NPRIOS];
+  std::atomic<int> nstaged;
+  std::atomic<int> nstaged_prio[BLKIO_NPRIOS];
+  std::atomic<int> next_drain;
+
+  // FLUSH waits for all slots to drain; new commands are staged until it has
+  // claimed them.
+  std::atomic<int> flush_waiters;
+  std::atomic<int> cmdslot_sleepers;
   spinlock cmdslot_alloc_lock;
   condvar cmdslot_alloc_cv;
-  sref<disk_completion> cmdslot_dc[32];
 
+  int try_alloc_cmdslot();
   int alloc_cmdslot(sref<disk_completion> dc, bool no_pending_ncq = false);
+  void release_cmdslots(u32 mask);
+  void submit(kiovec* iov, int iov_cnt, u64 off, int cmd, bool cmd_is_ncq,
+              sref<disk_completion> dc, bool fua = false);
+  staged_cmd* pop_staged();
+  void drain_staged(bool poll);
+  void reap_cmdslots();
 
   void blocking_wait(sref<disk_completion> dc) {
     while (!dc->done()) {
@@ -182,14 +239,22 @@ ahci_hba::ahci_hba(struct pci_func *pcif)
 void
 ahci_hba::handle_irq()
 {
-  for (int i = 0; i < 32; i++) {
-    if (!(reg->g.is & (1 << i)))
-      continue;
-
-    if (port[i]) {
-      port[i]->handle_port_irq();
-    } else {
-      cprintf("AHCI: stray irq for port %d, clearing\n", i);
+  // Service every port with a pending interrupt per pass, and keep going
+  // while completions keep arriving, so that a burst of completions across
+  // the ports (and of commands within a port) costs one interrupt.
+  for (int pass = 0; pass < irq_coalesce_passes; pass++) {
+    u32 is = reg->g.is;
+    if (!is)
+      break;
+
+    for (u32 pending = is; pending; pending &= pending - 1) {
+      int i = __builtin_ctz(pending);
+      if (port[i]) {
+        port[i]->handle_port_irq();
+      } else {
+        cprintf("AHCI: stray irq for port %d, clearing\n", i);
+        reg->port[i].p.is = ~0;
+      }
     }
 
     /* AHCI 1.3, section 10.7.2.1 says we need to first clear the
@@ -197,7 +262,7 @@ ahci_hba::handle_irq()
      * status.  It's fine to do this even after we've processed the
      * port interrupt: if any port interrupts happened in the mean
      * time, the host interrupt bit will just get set again. */
-    reg->g.is = (1 << i);
+    reg->g.is = is;
   }
 }
 
@@ -214,7 +279,11 @@ ata_byteswap(char* buf, u64 len)
 
 
 ahci_port::ahci_port(ahci_hba *h, int p, volatile ahci_reg_port* reg)
-  : hba(h), pid(p), preg(reg), num_cmdslots(0), cmds_issued(0), last_cmdslot(-1)
+  : hba(h), pid(p), preg(reg), num_cmdslots(0), free_cmdslots(0),
+    cmds_issued(0), nstaged(0), nstaged_prio(), next_drain(0),
+    flush_waiters(0), cmdslot_sleepers(0),
+    cmdslot_alloc_lock("ahci_port::cmdslot_alloc_lock"),
+    cmdslot_alloc_cv("ahci_port::cmdslot_alloc_cv")
 {
   // Round up the size to make it an integral multiple of PGSIZE.
   // Crashes on boot otherwise.
@@ -325,6 +394,9 @@ ahci_port::ahci_port(ahci_hba *h, int p, volatile ahci_reg_port* reg)
   }
 
   num_cmdslots = 1 + (id_buf.id.queue_depth & IDE_SATA_NCQ_QUEUE_DEPTH);
+
+  dk_fua = (id_buf.id.features84 & 0xc000) == IDE_FEATURE84_VALID &&
+           (id_buf.id.features84 & IDE_FEATURE84_FUA);
   if (num_cmdslots < hba->ncs)
     cprintf("AHCI: port %d: NCQ queue depth limited to %d (out of %d)\n",
             pid, num_cmdslots, hba->ncs);
@@ -404,46 +476,186 @@ ahci_port::ahci_port(ahci_hba *h, int p, volatile ahci_reg_port* reg)
   preg->ie = AHCI_PORT_INTR_DEFAULT;
 #endif
 
+  free_cmdslots = num_cmdslots == 32 ? ~0u : (1u << num_cmdslots) - 1;
   disk_register(this);
 }
 
+// Take a free command slot without blocking, preferring the slots at or after
+// this core's, so that cores don't all contend on the lowest free bit.
+// Returns -1 if every slot is busy.
 int
-ahci_port::alloc_cmdslot(sref<disk_completion> dc, bool no_pending_ncq)
+ahci_port::try_alloc_cmdslot()
 {
-  scoped_acquire a(&cmdslot_alloc_lock);
+  u32 hint = myid() % num_cmdslots;
+  u32 free = free_cmdslots.load(std::memory_order_relaxed);
+  while (free) {
+    u32 above = free & ~((1u << hint) - 1);
+    int cmdslot = __builtin_ctz(above ? above : free);
+    if (free_cmdslots.compare_exchange_weak(free, free & ~(1u << cmdslot))) {
+      cmdslot_claim[cmdslot] = 1u << cmdslot;
+      return cmdslot;
+    }
+  }
+  return -1;
+}
 
-  if (no_pending_ncq) {
-    // Make sure that no NCQ commands are still in flight. This is primarily
-    // used so that FLUSH CACHE (EXT) commands (which are not NCQ commands) are
-    // not mixed with NCQ commands such as READ/WRITE FPDMA QUEUED. (The spec
-    // mandates that non-NCQ commands must not be issued while any NCQ command
-    // is still outstanding).
+int
+ahci_port::alloc_cmdslot(sref<disk_completion> dc, bool no_pending_ncq)
+{
+  if (!no_pending_ncq) {
+    int cmdslot;
+    while ((cmdslot = try_alloc_cmdslot()) < 0) {
+      ++cmdslot_sleepers;
+      {
+        scoped_acquire a(&cmdslot_alloc_lock);
+        if (!free_cmdslots.load())
+          cmdslot_alloc_cv.sleep(&cmdslot_alloc_lock);
+      }
+      --cmdslot_sleepers;
+    }
+    cmdslot_dc[cmdslot] = dc;
+    return cmdslot;
+  }
 
-    while (preg->ci || preg->sact)
+  // Make sure that no NCQ commands are still in flight. This is primarily
+  // used so that FLUSH CACHE (EXT) commands (which are not NCQ commands) are
+  // not mixed with NCQ commands such as READ/WRITE FPDMA QUEUED. (The spec
+  // mandates that non-NCQ commands must not be issued while any NCQ command
+  // is still outstanding). Claiming every slot at once also keeps new NCQ
+  // commands from being issued until the flush completes; they are staged
+  // in the meantime.
+  u32 all = num_cmdslots == 32 ? ~0u : (1u << num_cmdslots) - 1;
+  ++flush_waiters;
+  ++cmdslot_sleepers;
+  {
+    scoped_acquire a(&cmdslot_alloc_lock);
+    for (;;) {
+      u32 expected = all;
+      if (free_cmdslots.compare_exchange_strong(expected, 0))
+        break;
       cmdslot_alloc_cv.sleep(&cmdslot_alloc_lock);
+    }
   }
+  --cmdslot_sleepers;
+  --flush_waiters;
+  cmdslot_claim[0] = all;
+  cmdslot_dc[0] = dc;
+  return 0;
+}
 
-  for (;;) {
+void
+ahci_port::release_cmdslots(u32 mask)
+{
+  free_cmdslots.fetch_or(mask);
+  if (cmdslot_sleepers.load()) {
+    scoped_acquire a(&cmdslot_alloc_lock);
+    cmdslot_alloc_cv.wake_all();
+  }
+  if (nstaged.load())
+    drain_staged(false);
+}
 
-    bool all_scanned = false;
-    for (int cmdslot = (last_cmdslot + 1) % num_cmdslots; cmdslot < num_cmdslots;
-         cmdslot++) {
+// Issue a read or write right away if a slot is free, and stage it on this
+// core's queue otherwise.
+void
+ahci_port::submit(kiovec* iov, int iov_cnt, u64 off, int cmd, bool cmd_is_ncq,
+                  sref<disk_completion> dc, bool fua)
+{
+  int prio = dc ? dc->blkio_prio : BLKIO_PRIO_NORMAL;
+  bool ahead = false;
+  for (int p = 0; p <= prio; p++)
+    if (nstaged_prio[p].load(std::memory_order_relaxed))
+      ahead = true;
+
+  // Don't overtake commands of the same or a more urgent class that are
+  // already staged, or a waiting flush.
+  if (!ahead && !flush_waiters.load()) {
+    int cmdslot = try_alloc_cmdslot();
+    if (cmdslot >= 0) {
+      cmdslot_dc[cmdslot] = dc;
+      issue(cmdslot, iov, iov_cnt, off, cmd, cmd_is_ncq, true, fua);
+      return;
+    }
+  }
 
-      if (!cmdslot_dc[cmdslot] && !(preg->ci & (1 << cmdslot)) &&
-          !(preg->sact & (1 << cmdslot))) {
+  staged_cmd *sc = new staged_cmd();
+  sc->next = nullptr;
+  sc->iov = std::vector<kiovec>(iov, iov + iov_cnt);
+  sc->off = off;
+  sc->cmd = cmd;
+  sc->cmd_is_ncq = cmd_is_ncq;
+  sc->fua = fua;
+  sc->prio = prio;
+  sc->dc = dc;
+  {
+    staging_queue *q = staged[prio].get_unchecked();
+    scoped_acquire a(&q->lock);
+    if (q->tail)
+      q->tail->next = sc;
+    else
+      q->head = sc;
+    q->tail = sc;
+  }
+  ++nstaged_prio[prio];
+  ++nstaged;
 
-        cmdslot_dc[cmdslot] = dc;
-        last_cmdslot = cmdslot;
-        return cmdslot;
-      }
+  // The slots may all have been freed before we staged the command, in which
+  // case nobody else will come along to issue it.
+  drain_staged(true);
+}
 
-      if (cmdslot == num_cmdslots - 1 && !all_scanned) {
-        cmdslot = -1;
-        all_scanned = true;
+// Dequeue a staged command of the most urgent class that has any, going
+// round the cores' queues of that class in turn.
+ahci_port::staged_cmd*
+ahci_port::pop_staged()
+{
+  int start = next_drain.load(std::memory_order_relaxed);
+  for (int prio = 0; prio < BLKIO_NPRIOS; prio++) {
+    if (!nstaged_prio[prio].load(std::memory_order_relaxed))
+      continue;
+    for (int i = 0; i < ncpu; i++) {
+      int c = (start + i) % ncpu;
+      staging_queue *q = &staged[prio][c];
+      if (!q->head)
         continue;
-      }
+      scoped_acquire a(&q->lock);
+      staged_cmd *sc = q->head;
+      if (!sc)
+        continue;
+      q->head = sc->next;
+      if (!q->head)
+        q->tail = nullptr;
+      --nstaged_prio[prio];
+      --nstaged;
+      next_drain.store((c + 1) % ncpu, std::memory_order_relaxed);
+      return sc;
+    }
+  }
+  return nullptr;
+}
+
+// Issue staged commands as long as there are free slots. Commands stay staged
+// while a flush is waiting for the slots to drain.
+void
+ahci_port::drain_staged(bool poll)
+{
+  while (nstaged.load() && !flush_waiters.load()) {
+    int cmdslot = try_alloc_cmdslot();
+    if (cmdslot < 0)
+      return;
+
+    staged_cmd *sc = pop_staged();
+    if (!sc) {
+      // Another drainer got there first. Give the slot back and re-check, in
+      // case a command was staged meanwhile.
+      free_cmdslots.fetch_or(1u << cmdslot);
+      continue;
     }
-    cmdslot_alloc_cv.sleep(&cmdslot_alloc_lock);
+
+    cmdslot_dc[cmdslot] = std::move(sc->dc);
+    issue(cmdslot, sc->iov.data(), sc->iov.size(), sc->off, sc->cmd,
+          sc->cmd_is_ncq, poll, sc->fua);
+    delete sc;
   }
 }
 
@@ -595,25 +807,37 @@ ahci_port::handle_error()
 void
 ahci_port::handle_port_irq()
 {
-  scoped_acquire a(&cmdslot_alloc_lock);
-
 #if 0
   if (preg->is & AHCI_PORT_INTR_ERROR)
     handle_error(); // Does not return!
 #endif
 
   preg->is = ~0;
+  reap_cmdslots();
+}
 
-  for (int cmdslot = 0; cmdslot < 32; cmdslot++) {
-
-    if (cmdslot_dc[cmdslot] && (cmds_issued & (1 << cmdslot)) &&
-        !(preg->ci & (1 << cmdslot)) && !(preg->sact & (1 << cmdslot))) {
+// Complete every issued command that the port has finished, in as many passes
+// as it takes for no new completions to show up.
+void
+ahci_port::reap_cmdslots()
+{
+  for (;;) {
+    // Read CI before SACT: an NCQ command leaves CI when the device accepts
+    // it but stays in SACT until it completes.
+    u32 busy = preg->ci;
+    busy |= preg->sact;
+    u32 done = cmds_issued.load() & ~busy;
+    if (!done)
+      return;
 
-      cmdslot_dc[cmdslot]->notify();
-      cmdslot_dc[cmdslot].reset();
-      cmds_issued &= ~(1 << cmdslot);
+    // Claim the completions, in case someone else is reaping concurrently.
+    done &= cmds_issued.fetch_and(~done);
 
-      cmdslot_alloc_cv.wake_all();
+    for (; done; done &= done - 1) {
+      int cmdslot = __builtin_ctz(done);
+      sref<disk_completion> dc = std::move(cmdslot_dc[cmdslot]);
+      release_cmdslots(cmdslot_claim[cmdslot]);
+      dc->notify();
     }
   }
 }
@@ -630,11 +854,10 @@ void
 ahci_port::areadv(kiovec* iov, int iov_cnt, u64 off,
                   sref<disk_completion> dc)
 {
-  int cmdslot = alloc_cmdslot(dc);
 #if USE_SATA_NCQ
-  issue(cmdslot, iov, iov_cnt, off, IDE_CMD_READ_FPDMA_QUEUED, true);
+  submit(iov, iov_cnt, off, IDE_CMD_READ_FPDMA_QUEUED, true, dc);
 #else
-  issue(cmdslot, iov, iov_cnt, off, IDE_CMD_READ_DMA_EXT);
+  submit(iov, iov_cnt, off, IDE_CMD_READ_DMA_EXT, false, dc);
 #endif
 }
 
@@ -650,11 +873,25 @@ void
 ahci_port::awritev(kiovec* iov, int iov_cnt, u64 off,
                    sref<disk_completion> dc)
 {
-  int cmdslot = alloc_cmdslot(dc);
 #if USE_SATA_NCQ
-  issue(cmdslot, iov, iov_cnt, off, IDE_CMD_WRITE_FPDMA_QUEUED, true);
+  submit(iov, iov_cnt, off, IDE_CMD_WRITE_FPDMA_QUEUED, true, dc);
+#else
+  submit(iov, iov_cnt, off, IDE_CMD_WRITE_DMA_EXT, false, dc);
+#endif
+}
+
+void
+ahci_port::awritev_fua(kiovec* iov, int iov_cnt, u64 off,
+                       sref<disk_completion> dc)
+{
+  if (!dk_fua) {
+    disk::awritev_fua(iov, iov_cnt, off, dc);
+    return;
+  }
+#if USE_SATA_NCQ
+  submit(iov, iov_cnt, off, IDE_CMD_WRITE_FPDMA_QUEUED, true, dc, true);
 #else
-  issue(cmdslot, iov, iov_cnt, off, IDE_CMD_WRITE_DMA_EXT);
+  submit(iov, iov_cnt, off, IDE_CMD_WRITE_DMA_FUA_EXT, false, dc);
 #endif
 }
 
@@ -682,7 +919,7 @@ ahci_port::aflush(sref<disk_completion> dc)
 
 void
 ahci_port::issue(int cmdslot, kiovec* iov, int iov_cnt, u64 off, int cmd,
-                 bool cmd_is_ncq)
+                 bool cmd_is_ncq, bool poll, bool fua)
 {
   assert((off % 512) == 0);
 
@@ -700,6 +937,8 @@ ahci_port::issue(int cmdslot, kiovec* iov, int iov_cnt, u64 off, int cmd,
 
   if (len) {
     fis.dev_head = IDE_DEV_LBA;
+    if (fua)
+      fis.dev_head |= IDE_DEV_FUA;
     fis.control = IDE_CTL_LBA48;
 
     u64 sector_off = off / 512;
@@ -726,16 +965,22 @@ ahci_port::issue(int cmdslot, kiovec* iov, int iov_cnt, u64 off, int cmd,
   // Update the Write bit in the flags *after* invoking fill_fis(), to ensure
   // that it remains set (and hence allow the disk write to go through).
   // Otherwise, disk writes never complete on ben.
-  if (cmd == IDE_CMD_WRITE_DMA_EXT || cmd == IDE_CMD_WRITE_FPDMA_QUEUED)
+  if (cmd == IDE_CMD_WRITE_DMA_EXT || cmd == IDE_CMD_WRITE_FPDMA_QUEUED ||
+      cmd == IDE_CMD_WRITE_DMA_FUA_EXT)
     portmem->cmdh[cmdslot].flags |= AHCI_CMD_FLAGS_WRITE;
 
-  // Mark the command as issued, for the interrupt handler's benefit.
-  // The cmdslot_alloc_lock protects 'cmds_issued' as well.
-  scoped_acquire a(&cmdslot_alloc_lock);
-  cmds_issued |= (1 << cmdslot);
-
+  // Writing 1s to SACT and CI sets just those bits, so concurrent issuers
+  // don't need to serialize.
   if (cmd_is_ncq)
     preg->sact = (1 << cmdslot);
 
   preg->ci = (1 << cmdslot);
+
+  // Mark the command as issued only now, so that the interrupt handler doesn't
+  // mistake a slot that isn't in CI yet for a completed one. The port may
+  // have finished the command (and raised its interrupt) before this, so
+  // check for that ourselves unless our caller is about to.
+  cmds_issued.fetch_or(1u << cmdslot);
+  if (poll && !((preg->ci | preg->sact) & (1u << cmdslot)))
+    reap_cmdslots();
 }
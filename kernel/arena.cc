@@ -0,0 +1,46 @@
+//
+// Bump-pointer arenas.
+//
+
+#include "types.h"
+#include "kernel.hh"
+#include "arena.hh"
+
+arena::~arena()
+{
+  while (chunks_) {
+    chunk *c = chunks_;
+    chunks_ = c->next;
+    kmfree(c, c->size);
+  }
+}
+
+// Allocate size bytes from a new chunk.  kmalloc rounds up to a power of
+// two anyway, so chunks are powers of two.  The arena then keeps
+// allocating from whichever of the old and the new chunk has more room
+// left.
+char *
+arena::grow(size_t size)
+{
+  size_t csize = next_size_;
+  while (csize < sizeof(chunk) + size)
+    csize *= 2;
+  if (next_size_ < MAX_CHUNK)
+    next_size_ *= 2;
+
+  chunk *c = (chunk*)kmalloc(csize, "arena");
+  if (!c)
+    throw_bad_alloc();
+  c->next = chunks_;
+  c->size = csize;
+  chunks_ = c;
+
+  char *p = (char*)(c + 1);
+  char *end = (char*)c + csize;
+  if (!cur_ || end - (p + size) >= end_ - cur_) {
+    cur_ = p + size;
+    end_ = end;
+    last_ = p;
+  }
+  return p;
+}
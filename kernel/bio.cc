@@ -4,10 +4,194 @@
 #include "weakcache.hh"
 #include "mfs.hh"
 #include "scalefs.hh"
+#include "percpu.hh"
+#include "kstream.hh"
+#include "major.h"
+#include "file.hh"
+#include "kstats.hh"
 
 
 static weakcache<buf::key_t, buf> bufcache(64 << 20);
 
+namespace {
+  // Per-core CLOCK lists of the blocks pinned in the buffer cache, which
+  // bufcache_reclaim() unpins once they take up more than bufcache_budget.
+  // Like the page-cache CLOCK lists, entries are keys rather than references,
+  // and the entries of bufs that have gone away are dropped when the hand gets
+  // to them. The entries in [hand, bufs.size()) are live.
+  struct clock_list {
+    std::vector<buf::key_t> bufs;
+    size_t hand;
+    size_t prune_at;
+    spinlock lock;
+    clock_list() : hand(0), prune_at(SCALEFS_CLOCK_PRUNE_MIN) {}
+  };
+  percpu<clock_list> clock_lists;
+
+  std::atomic<u64> bufcache_budget(SCALEFS_BUFCACHE_MAX);
+  std::atomic<s64> npinned;
+  std::atomic<u64> nevicted;
+  std::atomic<bool> reclaiming;
+}
+
+// Pin a buf in the buffer cache (or unpin it). Pinned bufs are counted against
+// the buffer cache's budget and put on this core's CLOCK list.
+void
+buf::cache_pin(bool flag)
+{
+  if (pinned_.exchange(flag) == flag)
+    return;
+
+  if (!flag) {
+    npinned--;
+    dec();
+    return;
+  }
+
+  inc();
+  npinned++;
+  mark_used();
+
+  buf::key_t k = { dev_, block_ };
+  auto &cl = clock_lists[myid()];
+  {
+    auto l = cl.lock.guard();
+    cl.bufs.push_back(k);
+    if (cl.bufs.size() - cl.hand >= cl.prune_at) {
+      // Drop the entries of bufs that were unpinned since the last time, so
+      // that the list stays proportional to the buffer cache.
+      size_t live = 0;
+      for (size_t i = cl.hand; i < cl.bufs.size(); i++) {
+        sref<buf> b = bufcache.lookup(cl.bufs[i]);
+        if (b && b->pinned_)
+          cl.bufs[live++] = cl.bufs[i];
+      }
+      cl.bufs.erase(cl.bufs.begin() + live, cl.bufs.end());
+      cl.hand = 0;
+      cl.prune_at = std::max((size_t)SCALEFS_CLOCK_PRUNE_MIN, 2 * live);
+    }
+  }
+
+  u64 budget = bufcache_budget.load(std::memory_order_relaxed) / BSIZE;
+  s64 over = npinned.load(std::memory_order_relaxed) - (s64) budget;
+  if (over > 0 && !reclaiming.exchange(true)) {
+    bufcache_reclaim(over + 32);
+    reclaiming = false;
+  }
+}
+
+// Unpin up to @nbufs bufs from the buffer cache, going around the CLOCK lists.
+// Bufs that are dirty, that share their contents with a transaction that
+// hasn't been written out yet, or that were used since the hand last went by
+// stay. An unpinned buf goes away once its last user drops it. Returns the
+// number of bufs unpinned.
+u64
+bufcache_reclaim(u64 nbufs)
+{
+  const size_t batch = 32;
+  u64 nreclaimed = 0;
+
+  for (int i = 0; i < ncpu && nreclaimed < nbufs; i++) {
+    auto &cl = clock_lists[(myid() + i) % ncpu];
+
+    // Go around the list at most twice: once to clear the reference bits and
+    // once more to unpin the bufs that weren't used in between.
+    size_t budget;
+    {
+      auto l = cl.lock.guard();
+      budget = 2 * (cl.bufs.size() - cl.hand);
+    }
+
+    while (budget && nreclaimed < nbufs) {
+      buf::key_t entries[batch];
+      size_t n = 0;
+      {
+        auto l = cl.lock.guard();
+        while (n < batch && n < budget && cl.hand < cl.bufs.size())
+          entries[n++] = cl.bufs[cl.hand++];
+        if (cl.hand > batch && cl.hand * 2 >= cl.bufs.size()) {
+          cl.bufs.erase(cl.bufs.begin(), cl.bufs.begin() + cl.hand);
+          cl.hand = 0;
+        }
+      }
+      if (!n)
+        break;
+      budget -= n;
+
+      size_t nkept = 0;
+      for (size_t j = 0; j < n; j++) {
+        sref<buf> b = bufcache.lookup(entries[j]);
+        if (!b || !b->pinned_)
+          continue;
+        if (b->dirty() || b->cow_block_.load() || b->test_and_clear_used()) {
+          entries[nkept++] = entries[j];
+          continue;
+        }
+        b->cache_pin(false);
+        nreclaimed++;
+      }
+
+      if (nkept) {
+        auto l = cl.lock.guard();
+        for (size_t j = 0; j < nkept; j++)
+          cl.bufs.push_back(entries[j]);
+      }
+    }
+  }
+
+  nevicted += nreclaimed;
+  return nreclaimed;
+}
+
+// Shrinker for the buffer cache: unpin enough bufs to free about @npages
+// pages.
+u64
+bufcache_shrink(u64 npages)
+{
+  return bufcache_reclaim(npages * PGSIZE / BSIZE) * BSIZE / PGSIZE;
+}
+
+static int
+bufcachestatsread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  u64 pinned = std::max(npinned.load(), (s64) 0);
+  s.println("Buffer cache budget: ", bufcache_budget.load(), " bytes");
+  s.println("Pinned blocks: ", pinned, " (", pinned * BSIZE, " bytes)");
+  s.println("Unpinned by reclaim: ", nevicted.load());
+  return s.get_used();
+}
+
+// Usage:
+// To set the buffer cache's memory budget to 16MB, do:
+// $ echo 16777216 > /dev/bufcache
+static int
+bufcachestatswrite(mdev*, const char *buf, u32 n)
+{
+  u64 budget = 0;
+  u32 i;
+
+  for (i = 0; i < n && buf[i] >= '0' && buf[i] <= '9'; i++)
+    budget = budget * 10 + (buf[i] - '0');
+  if (i == 0 || (i < n && buf[i] != '\n')) {
+    cprintf("bufcache: invalid budget\n");
+    return n;
+  }
+
+  bufcache_budget = budget;
+  s64 over = npinned.load() - (s64) (budget / BSIZE);
+  if (over > 0)
+    bufcache_reclaim(over);
+  return n;
+}
+
+void
+binit(void)
+{
+  devsw[MAJ_BUFCACHE].pread = bufcachestatsread;
+  devsw[MAJ_BUFCACHE].write = bufcachestatswrite;
+}
+
 
 // Returns true if the specified block is cached in the buffer-cache, false
 // otherwise.
@@ -19,8 +203,23 @@ buf::in_bufcache(u32 dev, u64 block)
   return (b ? true : false);
 }
 
+// Waits for the block's contents to be read from the disk, if they haven't
+// been already.
+void
+buf::wait_loaded()
+{
+  if (loaded_.load(std::memory_order_acquire))
+    return;
+  load_dc_->wait();
+  loaded_.store(true, std::memory_order_release);
+}
+
 // The caller sets @skip_disk_read to true if it is going to overwrite the
 // entire block shortly.
+//
+// The thread that inserts a missing block reads it asynchronously, and it and
+// any concurrent readers of the block sleep on the read's completion, rather
+// than spinning on the buffer's seqlock for the duration of the disk I/O.
 sref<buf>
 buf::get(u32 dev, u64 block, bool skip_disk_read)
 {
@@ -28,24 +227,113 @@ buf::get(u32 dev, u64 block, bool skip_disk_read)
   for (;;) {
     sref<buf> b = bufcache.lookup(k);
     if (b.get() != nullptr) {
-      // Wait for buffer to load, by getting a read seqlock,
-      // which waits for the write seqlock bit to be cleared.
-      b->seq_.read_begin();
+      kstats::inc(&kstats::bufcache_hit_count);
+      b->wait_loaded();
+      b->mark_used();
+      // A buf that was unpinned but is still in use rejoins the cache.
+      if (!b->pinned_.load(std::memory_order_relaxed))
+        b->cache_pin(true);
       return b;
     }
 
     sref<buf> nb = sref<buf>::transfer(new buf(dev, block));
-    auto locked = nb->write(); // marks the block as dirty automatically
+    if (skip_disk_read)
+      nb->loaded_.store(true, std::memory_order_relaxed);
+    else
+      nb->load_dc_ = make_sref<disk_completion>();
+
     if (bufcache.insert(k, nb.get())) {
       nb->cache_pin(true); // keep it in the cache
-      if (!skip_disk_read)
-        disk_read(dev, locked->data, BSIZE, block * BSIZE);
-      nb->mark_clean(); // we just loaded the contents from the disk!
+      kstats::inc(&kstats::bufcache_miss_count);
+      if (!skip_disk_read) {
+        kstats::timer timer(&kstats::disk_read_cycles);
+        disk_read(dev, nb->data_->data, BSIZE, block * BSIZE, nb->load_dc_);
+        nb->wait_loaded();
+      }
       return nb;
     }
   }
 }
 
+// Returns the buffers of the @n blocks starting at @start. The blocks that
+// aren't cached yet are read from the disk with as few requests as possible:
+// each run of missing blocks within an SG_IO_SIZE-aligned chunk is read using
+// a single vectored request, and all of these requests are in flight at once.
+// Concurrent readers of a block wait for its run to be read, as in get().
+std::vector<sref<buf>>
+buf::get_range(u32 dev, u64 start, u64 n)
+{
+  std::vector<u64> blocks;
+  blocks.reserve(n);
+  for (u64 block = start; block < start + n; block++)
+    blocks.push_back(block);
+  return get_blocks(dev, blocks);
+}
+
+// Like get_range(), but for the blocks in @blocks, which must be sorted and
+// need not be contiguous.
+std::vector<sref<buf>>
+buf::get_blocks(u32 dev, const std::vector<u64> &blocks)
+{
+  struct run {
+    u64 block;
+    std::vector<kiovec> iov;
+    sref<disk_completion> dc;
+  };
+
+  std::vector<sref<buf>> bufs;
+  std::vector<run> runs;
+  bufs.reserve(blocks.size());
+
+  for (u64 block : blocks) {
+    buf::key_t k = { dev, block };
+    for (;;) {
+      sref<buf> b = bufcache.lookup(k);
+      if (b.get() != nullptr) {
+        kstats::inc(&kstats::bufcache_hit_count);
+        b->mark_used();
+        if (!b->pinned_.load(std::memory_order_relaxed))
+          b->cache_pin(true);
+        bufs.push_back(std::move(b));
+        break;
+      }
+
+      if (runs.empty() ||
+          runs.back().block + runs.back().iov.size() != block ||
+          block % (SG_IO_SIZE/BSIZE) == 0) {
+        runs.emplace_back();
+        runs.back().block = block;
+        runs.back().dc = make_sref<disk_completion>();
+      }
+      run &r = runs.back();
+
+      sref<buf> nb = sref<buf>::transfer(new buf(dev, block));
+      nb->load_dc_ = r.dc;
+      if (bufcache.insert(k, nb.get())) {
+        nb->cache_pin(true); // keep it in the cache
+        kstats::inc(&kstats::bufcache_miss_count);
+        r.iov.push_back({ nb->data_->data, BSIZE });
+        bufs.push_back(std::move(nb));
+        break;
+      }
+    }
+  }
+
+  kstats::timer timer(&kstats::disk_read_cycles);
+  for (auto &r : runs) {
+    // A run whose placeholders all lost their insert races stays empty.
+    if (!r.iov.empty())
+      disk_readv(dev, &r.iov[0], r.iov.size(), r.block * BSIZE, r.dc);
+    else
+      r.dc->notify();
+  }
+
+  for (auto &b : bufs)
+    b->wait_loaded();
+
+  return bufs;
+}
+
 // Evict a (clean) block from the buffer-cache
 void
 buf::put(u32 dev, u64 block)
@@ -108,10 +396,18 @@ buf::add_to_transaction(transaction *trans)
   // ->writeback().
   mark_clean();
 
-  // We can't issue a read() to read the contents of the buf because we are
-  // already holding the seq-lock for write (hence we'll end up in a self-
-  // deadlock if we do so). So read directly from data_ instead.
-  trans->add_block(block_, data_->data);
+  // Rather than copying the contents, share data_ with the transaction until
+  // the next writer comes along (see break_cow()).
+  trans->add_block(new transaction_diskblock(sref<buf>::newref(this)));
+}
+
+// Called with the write_lock_ held, before the contents are modified.
+void
+buf::break_cow()
+{
+  transaction_diskblock *db = cow_block_.exchange(nullptr);
+  if (db)
+    db->unshare(data_->data);
 }
 
 void
@@ -155,6 +155,17 @@ buddy_allocator::alloc_order(size_t order)
   }
 }
 
+void
+buddy_allocator::split(void *ptr, std::size_t size)
+{
+  // Every buddy pair inside an allocated block is allocated.
+  size_t order = size_to_order(size);
+  for (size_t o = 0; o < order; o++)
+    for (uintptr_t p = (uintptr_t)ptr; p < (uintptr_t)ptr + size;
+         p += (uintptr_t)MIN_SIZE << (o + 1))
+      mark_allocated((void*)p, o, true);
+}
+
 void
 buddy_allocator::free_order(void *ptr, size_t order)
 {
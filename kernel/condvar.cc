@@ -6,13 +6,147 @@
 #include "condvar.hh"
 #include "proc.hh"
 #include "cpu.hh"
-#include "hpet.hh"
 #include "ipi.hh"
+#include "percpu.hh"
+#include "apic.hh"
+#include "refcache.hh"
 
-static u64 ticks __mpalign__;
+// nsectime() counts TSC cycles since inittimer(), converted with these
+// 32.32 fixed-point factors.  This assumes the cores' TSCs are in sync
+// and tick at a constant rate, as invariant TSCs do.
+static u64 boot_tsc, ns_per_tsc, tsc_per_ns;
 
-ilist<proc,&proc::cv_sleep> sleepers  __mpalign__;   // XXX one per core?
-struct spinlock sleepers_lock;
+// Each core keeps the timeouts of the processes that slept on it in a
+// hierarchical timer wheel, the way BSD and Linux do for callouts.
+// Level 0 has a slot for each of the next WHEEL_SIZE units of
+// 2^WHEEL_UNIT_SHIFT ns; a slot of level n covers WHEEL_SIZE^n units
+// and is cascaded into the levels below when the wheel reaches it.
+// Inserting, cancelling and expiring a timeout are O(1), and an
+// interrupt only touches the slots that come due rather than every
+// sleeper in the system.  Another core cancels a timeout
+// (condvar::wake_one()) by taking the owning wheel's lock.
+//
+// The LAPIC timer is one-shot, set for whichever comes first of the
+// core's next scheduler tick and its earliest timeout, so timeouts
+// expire when they are due rather than on the next tick.  An idle core
+// skips its ticks altogether (see timer_idle()).
+namespace {
+  enum {
+    WHEEL_UNIT_SHIFT = 20,      // About a millisecond
+    WHEEL_BITS = 6,
+    WHEEL_SIZE = 1 << WHEEL_BITS,
+    WHEEL_LEVELS = 4,
+  };
+
+  typedef ilist<proc,&proc::cv_sleep> sleeper_list;
+
+  struct timer_wheel {
+    spinlock lock;
+    // The next level 0 slot to expire.  Nothing in the slots is due
+    // before it.
+    u64 next;
+    // Sleepers in slots or soon, or expired but not yet woken.
+    u64 nsleepers;
+    sleeper_list slots[WHEEL_LEVELS][WHEEL_SIZE];
+    // Sleepers whose slot has come up but whose timeout hasn't, which
+    // is at most a unit away.
+    sleeper_list soon;
+    // When the next scheduler tick is due and when the LAPIC timer
+    // will go off, in nsectime() time.  armed is 0 while timerintr()
+    // runs.
+    u64 tick_at;
+    u64 armed;
+    // This core is idle and not taking ticks.
+    std::atomic<bool> tickless;
+
+    timer_wheel() : lock("timer_wheel", LOCKSTAT_CONDVAR), next(0),
+                    nsleepers(0), tick_at(0), armed(~0ull),
+                    tickless(false) { }
+  };
+
+  percpu<timer_wheel> wheels;
+}
+
+static u64
+tsc_to_nsec(u64 tsc)
+{
+  if (tsc < boot_tsc)
+    return 0;
+  return ((u128)(tsc - boot_tsc) * ns_per_tsc) >> 32;
+}
+
+static u64
+nsec_to_tsc(u64 nsec)
+{
+  return boot_tsc + (((u128)nsec * tsc_per_ns) >> 32);
+}
+
+void
+inittimer(void)
+{
+  boot_tsc = rdtsc();
+  tsc_per_ns = ((cpuhz / 1000000000) << 32) +
+    ((cpuhz % 1000000000) << 32) / 1000000000;
+  ns_per_tsc = (1000000000ull << 32) / cpuhz;
+}
+
+// File p in the slot for its timeout.  w->lock must be held.  A timeout
+// past the last level's reach goes in its furthest slot for now and is
+// filed again when that is cascaded.
+static void
+wheel_insert(timer_wheel *w, proc *p)
+{
+  u64 due = p->cv_wakeup >> WHEEL_UNIT_SHIFT;
+  if (due < w->next) {
+    w->soon.push_back(p);
+    return;
+  }
+  u64 delta = due - w->next;
+  if (delta >= (1ull << (WHEEL_BITS * WHEEL_LEVELS)))
+    due = w->next + (1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         delta >= (1ull << (WHEEL_BITS * (level + 1))))
+    level++;
+  w->slots[level][(due >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)]
+    .push_back(p);
+}
+
+// Take p out of whichever of w's lists, or which timerintr()'s list
+// of expired sleepers, it is on.  w->lock must be held.  ilist::erase()
+// only touches p's neighbours, so any list will do to call it.
+static void
+wheel_remove(timer_wheel *w, proc *p)
+{
+  w->soon.erase(sleeper_list::iterator_to(p));
+  w->nsleepers--;
+}
+
+// Set this core's LAPIC timer for its next tick or the next time its
+// wheel needs looking at, whichever is first.  A tickless core wakes
+// for its timeouts, and otherwise every IDLE_TICKLESS_MS.  w->lock
+// must be held.
+static void
+timer_arm(timer_wheel *w, u64 now)
+{
+  u64 deadline = w->tickless ? now + IDLE_TICKLESS_MS * 1000000ull
+                             : w->tick_at;
+  if (w->nsleepers) {
+    for (const proc &p : w->soon)
+      deadline = std::min(deadline, p.cv_wakeup);
+    // The first level 0 slot with anything in it, or the next cascade,
+    // which may bring some.
+    u64 cascade = (w->next + WHEEL_SIZE - 1) & ~(u64)(WHEEL_SIZE - 1);
+    u64 t = w->next;
+    while (t < cascade && w->slots[0][t & (WHEEL_SIZE - 1)].empty())
+      t++;
+    deadline = std::min(deadline, t << WHEEL_UNIT_SHIFT);
+  }
+  if (deadline != w->armed) {
+    w->armed = deadline;
+    lapic->set_timer(nsec_to_tsc(deadline));
+  }
+}
 
 static void
 wakeup(struct proc *p)
@@ -28,54 +162,118 @@ wakeup(struct proc *p)
 u64
 nsectime(void)
 {
-#if 0 // HPET temporarily unused, as it kills dbench performance.
-  static bool used_ticks;
-  if (the_hpet) {
-    assert(!used_ticks);
-    return the_hpet->read_nsec();
-  }
-#endif
-  // XXX Ticks don't happen when interrupts are disabled, which means
-  // we lose track of wall-clock time, but if we don't have a HPET,
-  // this is the best we can do.
-  //used_ticks = true;
-  u64 msec = ticks*QUANTUM;
-  return msec*1000000;
+  if (!ns_per_tsc)
+    return 0;
+  return tsc_to_nsec(rdtsc());
 }
 
-void
+// Called on every core's timer interrupt.  Wakes the sleepers on this
+// core's wheel whose timeouts have passed, sets the timer for the next
+// event, and returns whether this was a scheduler tick.
+bool
 timerintr(void)
 {
-  struct condvar *cv;
-  int again;
-  u64 now;
-  
-  ticks++;
-
-  now = nsectime();
-  again = 0;
-  do {
-    scoped_acquire l(&sleepers_lock);
-    for (auto it = sleepers.begin(); it != sleepers.end(); it++) {
+  timer_wheel *w = &wheels[myid()];
+  u64 now = nsectime();
+  bool tick = false;
+  sleeper_list expired;
+  {
+    scoped_acquire l(&w->lock);
+    w->armed = 0;
+    if (now >= w->tick_at) {
+      tick = true;
+      w->tick_at = now + QUANTUM * 1000000ull;
+    }
+    if (w->nsleepers == 0)
+      w->next = (now >> WHEEL_UNIT_SHIFT) + 1;
+    for (; (w->next << WHEEL_UNIT_SHIFT) <= now; w->next++) {
+      u64 t = w->next;
+      for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if (t & ((1ull << (WHEEL_BITS * level)) - 1))
+          break;
+        sleeper_list &slot =
+          w->slots[level][(t >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+        sleeper_list cascade(std::move(slot));
+        while (!cascade.empty()) {
+          proc *p = &cascade.front();
+          cascade.pop_front();
+          wheel_insert(w, p);
+        }
+      }
+      sleeper_list &slot = w->slots[0][t & (WHEEL_SIZE - 1)];
+      while (!slot.empty()) {
+        proc *p = &slot.front();
+        slot.pop_front();
+        w->soon.push_back(p);
+      }
+    }
+    for (auto it = w->soon.begin(); it != w->soon.end(); ) {
+      proc *p = &*it;
+      ++it;
+      if (p->cv_wakeup <= now) {
+        w->soon.erase(sleeper_list::iterator_to(p));
+        expired.push_back(p);
+      }
+    }
+    timer_arm(w, now);
+  }
+
+  // The lock order is cv, proc, wheel, so only try for the other two,
+  // and drop the wheel lock between attempts.  Until they are woken,
+  // the expired sleepers can still be cancelled through w->lock.
+  while (!expired.empty()) {
+    scoped_acquire l(&w->lock);
+    for (auto it = expired.begin(); it != expired.end(); ) {
       struct proc &p = *it;
-      if (p.cv_wakeup <= now) {
-        if (tryacquire(&p.lock)) {
-          if (tryacquire(&p.oncv->lock)) {
-            sleepers.erase(it);
-            cv = p.oncv;
-            p.cv_wakeup = 0;
-            wakeup(&p);
-            release(&p.lock);
-            release(&cv->lock);
-            continue;
-          } else {
-            release(&p.lock);
-          }
+      if (tryacquire(&p.lock)) {
+        struct condvar *cv = p.oncv;
+        if (tryacquire(&cv->lock)) {
+          ++it;
+          wheel_remove(w, &p);
+          p.cv_wakeup = 0;
+          wakeup(&p);
+          release(&p.lock);
+          release(&cv->lock);
+          continue;
         }
-        again = 1;
+        release(&p.lock);
       }
+      ++it;
     }
-  } while (again);
+  }
+  return tick;
+}
+
+// Called by an idle core just before it sleeps (idle is true) and once
+// it wakes.  While it sleeps, it takes no scheduler ticks, only timer
+// interrupts for its timeouts.  refcache epochs wait for every core's
+// tick, though, so it keeps ticking while some core is hurrying them,
+// and otherwise still ticks every IDLE_TICKLESS_MS.
+void
+timer_idle(bool idle)
+{
+  if (!IDLE_TICKLESS_MS)
+    return;
+  timer_wheel *w = &wheels[myid()];
+  scoped_acquire l(&w->lock);
+  if (idle && refcache::hurried_cores.load(std::memory_order_relaxed))
+    idle = false;
+  if (w->tickless == idle)
+    return;
+  w->tickless = idle;
+  timer_arm(w, nsectime());
+}
+
+// Get the tickless cores ticking again, because refcache is in a hurry.
+void
+timer_wake_tickless(void)
+{
+  bitset<NCPU> targets;
+  for (int c = 0; c < ncpu; c++)
+    if (c != myid() && wheels[c].tickless.load(std::memory_order_relaxed))
+      targets.set(c);
+  if (targets.any())
+    poke_cpus(targets);
 }
 
 void
@@ -104,13 +302,22 @@ condvar::sleep_to(struct spinlock *lk, u64 timeout, struct spinlock *lk2)
   myproc()->set_state(SLEEPING);
 
   if (timeout) {
-    scoped_acquire l(&sleepers_lock);
+    timer_wheel *w = &wheels[myid()];
+    scoped_acquire l(&w->lock);
     myproc()->cv_wakeup = timeout;
-    sleepers.push_back(myproc());
- }
+    myproc()->cv_wheel = myid();
+    wheel_insert(w, myproc());
+    w->nsleepers++;
+    if (timeout < w->armed) {
+      w->armed = timeout;
+      lapic->set_timer(nsec_to_tsc(timeout));
+    }
+  }
 
   lock.release();
+  u64 offcpu = offcpu_begin();
   sched();
+  offcpu_end(offcpu);
   // Reacquire original lock.
   lk->acquire();
   if (lk2)
@@ -139,9 +346,9 @@ condvar::wake_one(proc *p)
     panic("condvar::wake_all: pid %u name %s p->cv %p cv %p",
           p->pid, p->name, p->oncv, this);
   if (p->cv_wakeup) {
-    scoped_acquire s_l(&sleepers_lock);
-    auto it = sleepers.iterator_to(p);
-    sleepers.erase(it);
+    timer_wheel *w = &wheels[p->cv_wheel];
+    scoped_acquire w_l(&w->lock);
+    wheel_remove(w, p);
     p->cv_wakeup = 0;
   }
   wakeup(p);
@@ -1,10 +1,17 @@
 #include "types.h"
 #include "kernel.hh"
 #include "disk.hh"
+#include "fs.h"
 #include "ideconfig.hh"
 #include "vector.hh"
 #include "amd64.h"
+#include "percpu.hh"
+#include "kstream.hh"
+#include "major.h"
+#include "file.hh"
+#include <atomic>
 #include <cstring>
+#include <algorithm>
 #include <sys/time.h>
 
 #if AHCIIDE
@@ -37,6 +44,10 @@ write_output(const char *buf, u64 offset, u64 size)
    // to the disk below, but its correctness heavily depends on the assumption
    // that all the writes are going to be sequential/contiguous (which holds
    // good for zlib_decompress(), the way it is implemented).
+   // The image's superblock says how to lay the rest of it out on the disks.
+   if (offset == BSIZE)
+     disk_set_layout((const superblock *) buf);
+
    memcpy(write_buffer + wb_offset, buf, size);
    wb_offset += size;
 
@@ -83,6 +94,188 @@ disk_register(disk* d)
   disks.push_back(d);
 }
 
+extern u64 cpuhz;
+
+// Block-layer I/O statistics, read through /dev/blkio.  A request is what a
+// caller of disk_readv()/disk_writev()/disk_flush() asked for, and may take
+// more than one disk command (see map_io()).  Latencies, from submission to
+// completion, are histogrammed by log2 of microseconds; queue depths, the
+// requests already in flight on a disk when another is submitted, by log2.
+// Request latencies are also kept per priority class (see blkio_prio).
+#define BLKIO_LAT_BUCKETS   24
+#define BLKIO_DEPTH_BUCKETS 10
+
+struct blkio_op_stats {
+  u64 commands;
+  u64 blocks;
+  u64 merged;           // Commands that gathered more than one buffer
+  u64 requests;         // Completed requests
+  u64 cycles;           // Total latency of the completed requests
+  u64 lat_hist[BLKIO_LAT_BUCKETS];
+  u64 depth_hist[BLKIO_DEPTH_BUCKETS];
+};
+
+struct blkio_prio_stats {
+  u64 requests;
+  u64 cycles;
+  u64 lat_hist[BLKIO_LAT_BUCKETS];
+};
+
+struct blkio_stats {
+  blkio_op_stats op[BLKIO_NOPS];
+  blkio_prio_stats prio[BLKIO_NPRIOS];
+};
+
+// Completions may be accounted for from interrupt handlers.
+static percpu<blkio_stats, NO_INT> blkio[NDISK];
+static std::atomic<s64> blkio_inflight[NDISK];
+
+static int
+log2_bucket(u64 v, int nbuckets)
+{
+  int b = v ? 64 - __builtin_clzll(v) : 0;
+  return std::min(b, nbuckets - 1);
+}
+
+// Account for a command of op being submitted to dev.  The first command
+// submitted with a given dc starts its request.
+static void
+blkio_submit(u32 dev, int op, int prio, const kiovec *iov, int iov_cnt,
+             disk_completion *dc)
+{
+  u64 nbytes = 0;
+  for (int i = 0; i < iov_cnt; i++)
+    nbytes += iov[i].iov_len;
+
+  bool first = !dc || dc->blkio_dev < 0;
+  s64 depth = 0;
+  if (first) {
+    depth = blkio_inflight[dev]++;
+    if (dc) {
+      dc->blkio_dev = dev;
+      dc->blkio_op = op;
+      dc->blkio_prio = prio;
+      dc->blkio_start = rdtsc();
+    }
+  }
+
+  scoped_critical c(NO_INT);
+  auto &st = blkio[dev]->op[op];
+  st.commands++;
+  st.blocks += nbytes / BSIZE;
+  if (iov_cnt > 1)
+    st.merged++;
+  if (first)
+    st.depth_hist[log2_bucket(depth, BLKIO_DEPTH_BUCKETS)]++;
+}
+
+static void
+blkio_account(u32 dev, int op, int prio, u64 start)
+{
+  u64 cycles = rdtsc() - start;
+  int bucket = log2_bucket(cycles / (cpuhz / 1000000), BLKIO_LAT_BUCKETS);
+  blkio_inflight[dev]--;
+
+  scoped_critical c(NO_INT);
+  auto &st = blkio[dev]->op[op];
+  st.requests++;
+  st.cycles += cycles;
+  st.lat_hist[bucket]++;
+  auto &pst = blkio[dev]->prio[prio];
+  pst.requests++;
+  pst.cycles += cycles;
+  pst.lat_hist[bucket]++;
+}
+
+void
+blkio_complete(disk_completion *dc)
+{
+  blkio_account(dc->blkio_dev, dc->blkio_op, dc->blkio_prio, dc->blkio_start);
+}
+
+static void
+print_hist(print_stream *s, const char *what, const u64 *hist, int nbuckets)
+{
+  s->print("    ", what, ":");
+  for (int b = 0; b < nbuckets; b++) {
+    if (!hist[b])
+      continue;
+    if (b == nbuckets - 1)
+      s->print(" >=", 1ull << (b - 1), ":", hist[b]);
+    else
+      s->print(" <", 1ull << b, ":", hist[b]);
+  }
+  s->println();
+}
+
+static int
+blkioread(mdev*, char *dst, u32 off, u32 n)
+{
+  static const char *names[BLKIO_NOPS] = { "read", "write", "flush" };
+  static const char *prio_names[BLKIO_NPRIOS] = { "commit", "normal", "bulk" };
+  window_stream s(dst, off, n);
+
+  for (u32 d = 0; d < disks.size(); d++) {
+    s.println("disk ", d, " (", disks[d]->dk_busloc, "): ",
+              blkio_inflight[d].load(), " requests in flight");
+    for (int op = 0; op < BLKIO_NOPS; op++) {
+      blkio_op_stats t = {};
+      for (int c = 0; c < ncpu; c++) {
+        const blkio_op_stats &st = blkio[d][c].op[op];
+        t.commands += st.commands;
+        t.blocks += st.blocks;
+        t.merged += st.merged;
+        t.requests += st.requests;
+        t.cycles += st.cycles;
+        for (int b = 0; b < BLKIO_LAT_BUCKETS; b++)
+          t.lat_hist[b] += st.lat_hist[b];
+        for (int b = 0; b < BLKIO_DEPTH_BUCKETS; b++)
+          t.depth_hist[b] += st.depth_hist[b];
+      }
+      if (!t.commands)
+        continue;
+
+      s.print("  ", names[op], ": ", t.commands, " commands");
+      if (op != BLKIO_FLUSH)
+        s.print(", ", t.blocks, " blocks, ", t.merged, " merged");
+      u64 mean = t.requests ? t.cycles / t.requests / (cpuhz / 1000000) : 0;
+      s.println("; ", t.requests, " requests done, mean latency ", mean, " us");
+      print_hist(&s, "latency (us)", t.lat_hist, BLKIO_LAT_BUCKETS);
+      print_hist(&s, "queue depth", t.depth_hist, BLKIO_DEPTH_BUCKETS);
+    }
+    for (int prio = 0; prio < BLKIO_NPRIOS; prio++) {
+      blkio_prio_stats t = {};
+      for (int c = 0; c < ncpu; c++) {
+        const blkio_prio_stats &st = blkio[d][c].prio[prio];
+        t.requests += st.requests;
+        t.cycles += st.cycles;
+        for (int b = 0; b < BLKIO_LAT_BUCKETS; b++)
+          t.lat_hist[b] += st.lat_hist[b];
+      }
+      if (!t.requests)
+        continue;
+
+      u64 mean = t.cycles / t.requests / (cpuhz / 1000000);
+      s.println("  ", prio_names[prio], " priority: ", t.requests,
+                " requests done, mean latency ", mean, " us");
+      print_hist(&s, "latency (us)", t.lat_hist, BLKIO_LAT_BUCKETS);
+    }
+  }
+  return s.get_used();
+}
+
+// Usage:
+// To reset the statistics, do:
+// $ echo > /dev/blkio
+static int
+blkiowrite(mdev*, const char *buf, u32 n)
+{
+  for (u32 d = 0; d < NDISK; d++)
+    for (int c = 0; c < ncpu; c++)
+      blkio[d][c] = blkio_stats();
+  return n;
+}
+
 static void
 disk_test(disk *d)
 {
@@ -123,19 +316,78 @@ sys_disktest(void)
   disk_test_all();
 }
 
-// Stripe across all the (four) disks, with a stripe size of 64KB.
+// By default, stripe across all the disks, with a stripe size of 64KB.
 #define STRIPE_SIZE_BLKS		(64 * 1024 / BSIZE)
 
+// How the file system's block numbers map onto the disks (see
+// disk_set_layout()).  Data blocks are striped across every disk but
+// journal_dev, stripe_blks blocks per disk at a time.  If there is a
+// journal_dev, the journal extents are packed onto it instead, in block order,
+// and the data blocks between them are numbered as if the extents weren't
+// there.
+static struct {
+  u32 stripe_blks = STRIPE_SIZE_BLKS;
+  int journal_dev = -1;
+  struct extent {
+    u32 start;
+    u32 end;    // Inclusive
+    u32 devblk; // Where the extent starts on journal_dev
+  } journals[NCPU];
+  int njournals = 0;
+} layout;
+
+// Map blknum to a disk and a block on that disk.  *contig is set to the number
+// of blocks starting at blknum that are contiguous on that disk.
+static void
+map_blknum(u32 blknum, u32 *dev, u32 *devblk, u32 *contig)
+{
+  u32 ndata = num_disks();
+  u32 limit = ~0u;
+
+  if (layout.journal_dev >= 0) {
+    auto *first = layout.journals, *last = first + layout.njournals;
+    auto *j = std::upper_bound(first, last, blknum,
+                               [](u32 b, const decltype(layout)::extent &e) {
+                                 return b < e.start;
+                               });
+    if (j != last)
+      limit = j->start - blknum;
+    if (j != first) {
+      --j;
+      if (blknum <= j->end) {
+        *dev = layout.journal_dev;
+        *devblk = j->devblk + (blknum - j->start);
+        *contig = j->end - blknum + 1;
+        return;
+      }
+      // j->devblk counts the journal blocks that come before j.
+      blknum -= j->devblk + (j->end - j->start + 1);
+    }
+    ndata--;
+  }
+
+  u32 stripe = layout.stripe_blks;
+  u32 d = (blknum / stripe) % ndata;
+  if (layout.journal_dev >= 0 && d >= (u32)layout.journal_dev)
+    d++;
+  *dev = d;
+  *devblk = stripe * ((blknum / stripe) / ndata) + (blknum % stripe);
+  *contig = std::min(stripe - (blknum % stripe), limit);
+}
+
 // Given a block offset as argument, return the disk number that hosts that block.
 u32 blknum_to_dev(u32 blknum)
 {
-  return (blknum / STRIPE_SIZE_BLKS) % num_disks();
+  u32 dev, devblk, contig;
+  map_blknum(blknum, &dev, &devblk, &contig);
+  return dev;
 }
 
 u32 remap_blknum(u32 blknum)
 {
-  return STRIPE_SIZE_BLKS * ((blknum / STRIPE_SIZE_BLKS) / num_disks())
-         + (blknum % STRIPE_SIZE_BLKS);
+  u32 dev, devblk, contig;
+  map_blknum(blknum, &dev, &devblk, &contig);
+  return devblk;
 }
 
 u32 num_disks()
@@ -143,19 +395,130 @@ u32 num_disks()
   return (u32) disks.size();
 }
 
+// Switch to the disk layout described by sb.  The superblock itself (block 1)
+// is on disk 0 under every layout that is accepted here, so it can be read
+// before the layout is known.
+void
+disk_set_layout(const superblock *sb)
+{
+  u32 stripe = sb->layout.stripe_blks ? sb->layout.stripe_blks
+                                      : STRIPE_SIZE_BLKS;
+  if (stripe < 2) {
+    cprintf("disk_set_layout: bad stripe size %u, using %u blocks\n",
+            stripe, STRIPE_SIZE_BLKS);
+    stripe = STRIPE_SIZE_BLKS;
+  }
+  layout.stripe_blks = stripe;
+  layout.journal_dev = -1;
+  layout.njournals = 0;
+
+  if (!(sb->features & SB_FEATURE_JOURNAL_DEV))
+    return;
+  u32 jdev = sb->layout.journal_dev;
+  if (jdev == 0 || jdev >= num_disks()) {
+    cprintf("disk_set_layout: no journal disk %u (of %u), striping journals\n",
+            jdev, num_disks());
+    return;
+  }
+
+  auto *js = layout.journals;
+  int n = 0;
+  for (int i = 0; i < NCPU; i++) {
+    auto &jb = sb->journal_blknums[i];
+    if (!jb.start_blknum || jb.end_blknum < jb.start_blknum)
+      continue;
+    js[n].start = jb.start_blknum;
+    js[n].end = jb.end_blknum;
+    n++;
+  }
+  std::sort(js, js + n, [](const decltype(layout)::extent &a,
+                           const decltype(layout)::extent &b) {
+      return a.start < b.start;
+    });
+  u32 devblk = 0;
+  for (int i = 0; i < n; i++) {
+    js[i].devblk = devblk;
+    devblk += js[i].end - js[i].start + 1;
+  }
+  layout.njournals = n;
+  layout.journal_dev = jdev;
+}
+
+// Issue the I/O of iov at a file system byte offset, through io(dev, iov,
+// iov_cnt, disk offset, dc), split into one command per run of blocks that is
+// contiguous on a disk.
+template<class F>
+static void
+map_io(kiovec *iov, int iov_cnt, u64 offset, sref<disk_completion> dc, F io)
+{
+  u64 nbytes = 0;
+  for (int i = 0; i < iov_cnt; i++)
+    nbytes += iov[i].iov_len;
+
+  u32 dev, devblk, contig;
+  map_blknum(offset/BSIZE, &dev, &devblk, &contig);
+  if (nbytes <= (u64)contig * BSIZE - offset % BSIZE) {
+    io(dev, iov, iov_cnt, (u64)devblk * BSIZE + offset % BSIZE, dc);
+    return;
+  }
+
+  // Runs across block boundaries are only ever whole blocks.
+  assert(offset % BSIZE == 0 && nbytes % BSIZE == 0);
+  if (dc) {
+    int nruns = 0;
+    for (u64 blk = offset/BSIZE, left = nbytes/BSIZE; left; nruns++) {
+      u32 d, b, c;
+      map_blknum(blk, &d, &b, &c);
+      c = std::min((u64)c, left);
+      blk += c;
+      left -= c;
+    }
+    dc->add_pending(nruns - 1);
+  }
+
+  std::vector<kiovec> run;
+  int i = 0;
+  u64 used = 0; // Bytes of iov[i] that earlier runs took
+  for (u64 blk = offset/BSIZE, left = nbytes/BSIZE; left; ) {
+    map_blknum(blk, &dev, &devblk, &contig);
+    u64 len = std::min((u64)contig, left) * BSIZE;
+    blk += len / BSIZE;
+    left -= len / BSIZE;
+
+    run.clear();
+    while (len) {
+      u64 n = std::min(len, iov[i].iov_len - used);
+      run.push_back({ (char *)iov[i].iov_base + used, n });
+      used += n;
+      len -= n;
+      if (used == iov[i].iov_len) {
+        i++;
+        used = 0;
+      }
+    }
+    io(dev, &run[0], run.size(), (u64)devblk * BSIZE, dc);
+  }
+}
+
 void
 disk_readv(u32 dev, kiovec *iov, int iov_cnt, u64 offset,
            sref<disk_completion> dc)
 {
   assert(disks.size() > 0);
   assert(iov_cnt <= IOV_MAX);
-  dev = blknum_to_dev(offset/BSIZE);
-  offset = (u64)remap_blknum(offset/BSIZE) * BSIZE;
-
-  if (dc) // Asynchronous
-    disks[dev]->areadv(iov, iov_cnt, offset, dc);
-  else
-    disks[dev]->readv(iov, iov_cnt, offset);
+  map_io(iov, iov_cnt, offset, dc,
+         [](u32 dev, kiovec *iov, int iov_cnt, u64 offset,
+            sref<disk_completion> dc) {
+           blkio_submit(dev, BLKIO_READ, BLKIO_PRIO_NORMAL, iov, iov_cnt,
+                        dc.get());
+           if (dc) { // Asynchronous
+             disks[dev]->areadv(iov, iov_cnt, offset, dc);
+           } else {
+             u64 start = rdtsc();
+             disks[dev]->readv(iov, iov_cnt, offset);
+             blkio_account(dev, BLKIO_READ, BLKIO_PRIO_NORMAL, start);
+           }
+         });
 }
 
 void
@@ -166,36 +529,176 @@ disk_read(u32 dev, char* buf, u64 nbytes, u64 offset,
   disk_readv(dev, &iov, 1, offset, dc);
 }
 
+// With fua set, the write is on stable media once it completes (see
+// disk::awritev_fua()).  prio is the write's priority class, which an
+// asynchronous write carries to the driver in dc.
 void
 disk_writev(u32 dev, kiovec *iov, int iov_cnt, u64 offset,
-            sref<disk_completion> dc)
+            sref<disk_completion> dc, bool fua, blkio_prio prio)
 {
   assert(disks.size() > 0);
   assert(iov_cnt <= IOV_MAX);
-  dev = blknum_to_dev(offset/BSIZE);
-  offset = (u64)remap_blknum(offset/BSIZE) * BSIZE;
-
-  if (dc) // Asynchronous
-    disks[dev]->awritev(iov, iov_cnt, offset, dc);
-  else
-    disks[dev]->writev(iov, iov_cnt, offset);
+  map_io(iov, iov_cnt, offset, dc,
+         [fua, prio](u32 dev, kiovec *iov, int iov_cnt, u64 offset,
+                     sref<disk_completion> dc) {
+           blkio_submit(dev, BLKIO_WRITE, prio, iov, iov_cnt, dc.get());
+           if (dc) { // Asynchronous
+             if (fua)
+               disks[dev]->awritev_fua(iov, iov_cnt, offset, dc);
+             else
+               disks[dev]->awritev(iov, iov_cnt, offset, dc);
+           } else {
+             u64 start = rdtsc();
+             disks[dev]->writev(iov, iov_cnt, offset);
+             if (fua)
+               disks[dev]->flush();
+             blkio_account(dev, BLKIO_WRITE, prio, start);
+           }
+         });
 }
 
 void
 disk_write(u32 dev, const char* buf, u64 nbytes, u64 offset,
-           sref<disk_completion> dc)
+           sref<disk_completion> dc, bool fua)
 {
   kiovec iov = { (void*) buf, nbytes };
-  disk_writev(dev, &iov, 1, offset, dc);
+  disk_writev(dev, &iov, 1, offset, dc, fua);
+}
+
+bool
+disk_has_fua(u32 dev)
+{
+  assert(dev < disks.size());
+  return disks[dev]->dk_fua;
 }
 
 void
 disk_flush(u32 dev, sref<disk_completion> dc)
 {
   assert(dev < disks.size());
-  if (dc) // Asynchronous
+  blkio_submit(dev, BLKIO_FLUSH, BLKIO_PRIO_NORMAL, nullptr, 0, dc.get());
+  if (dc) { // Asynchronous
     disks[dev]->aflush(dc);
-  else
+  } else {
+    u64 start = rdtsc();
     disks[dev]->flush();
+    blkio_account(dev, BLKIO_FLUSH, BLKIO_PRIO_NORMAL, start);
+  }
 }
 
+void
+initblkio(void)
+{
+  devsw[MAJ_BLKIO].pread = blkioread;
+  devsw[MAJ_BLKIO].write = blkiowrite;
+}
+
+write_elevator disk_elevator;
+
+void
+write_elevator::begin()
+{
+  scoped_acquire l(&lock_);
+  active_++;
+}
+
+void
+write_elevator::write(u32 blocknum, const char *buf, ticket *t)
+{
+  staged_write w = { blknum_to_dev(blocknum), remap_blknum(blocknum),
+                     blocknum, buf, t };
+  {
+    scoped_acquire l(&lock_);
+    t->pending++;
+  }
+  auto &s = shards_[myid()];
+  scoped_acquire l(&s.lock);
+  s.writes.push_back(w);
+}
+
+void
+write_elevator::finish(ticket *t)
+{
+  lock_.acquire();
+  if (!ready_++)
+    deadline_ = nsectime() + SCALEFS_ELEVATOR_DEADLINE_US * 1000ull;
+
+  while (t->pending) {
+    if (!dispatching_ && (ready_ == active_ || nsectime() >= deadline_)) {
+      dispatching_ = true;
+      lock_.release();
+      dispatch();
+      lock_.acquire();
+      dispatching_ = false;
+      cv_.wake_all();
+      continue;
+    }
+    if (dispatching_)
+      cv_.sleep(&lock_);
+    else
+      cv_.sleep_to(&lock_, deadline_);
+  }
+
+  active_--;
+  if (--ready_)
+    // Give the writers still waiting a fresh deadline, since they may have
+    // been waiting for this one.
+    deadline_ = nsectime() + SCALEFS_ELEVATOR_DEADLINE_US * 1000ull;
+  cv_.wake_all();
+  lock_.release();
+}
+
+// Write out everything staged so far, in as few disk writes as possible.
+void
+write_elevator::dispatch()
+{
+  std::vector<staged_write> writes;
+  for (int i = 0; i < NCPU; i++) {
+    auto &s = shards_[i];
+    scoped_acquire l(&s.lock);
+    for (auto &w : s.writes)
+      writes.push_back(w);
+    s.writes.clear();
+  }
+  if (writes.empty())
+    return;
+
+  // Blocks from different writers never overlap: a transaction that writes a
+  // block another one wrote first depends on it, and is only applied once the
+  // first one has been.
+  std::sort(writes.begin(), writes.end(),
+            [](const staged_write &a, const staged_write &b) {
+              return a.dev < b.dev ||
+                     (a.dev == b.dev && a.blocknum < b.blocknum);
+            });
+
+  std::vector<kiovec> iov;
+  std::vector<sref<disk_completion>> dcs;
+  iov.reserve(writes.size());
+  for (auto &w : writes) {
+    kiovec kiov = { (void *) w.buf, BSIZE };
+    iov.push_back(kiov);
+  }
+
+  for (size_t i = 0; i < writes.size(); ) {
+    size_t j = i + 1;
+    while (j < writes.size() && (j - i) < ELEVATOR_IO_SIZE/BSIZE &&
+           writes[j].dev == writes[i].dev &&
+           writes[j].blocknum == writes[i].blocknum + (j - i))
+      j++;
+
+    sref<disk_completion> dc = make_sref<disk_completion>();
+    dcs.push_back(dc);
+    disk_writev(writes[i].dev, &iov[i], j - i,
+                (u64) writes[i].fs_blocknum * BSIZE, dc, false,
+                BLKIO_PRIO_BULK);
+    i = j;
+  }
+
+  for (auto &dc : dcs)
+    dc->wait();
+
+  scoped_acquire l(&lock_);
+  for (auto &w : writes)
+    w.t->pending--;
+}
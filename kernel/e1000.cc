@@ -1,6 +1,7 @@
 #include "types.h"
 #include "amd64.h"
 #include "kernel.hh"
+#include "cpu.hh"
 #include "pci.hh"
 #include "pcireg.hh"
 #include "spinlock.hh"
@@ -9,25 +10,52 @@
 #include "e1000reg.hh"
 #include "kstream.hh"
 #include "netdev.hh"
+#include "kworker.hh"
+#include "netstat.hh"
+#include <atomic>
 
 #define TX_RING_SIZE 64
 #define RX_RING_SIZE 64
+// Packets the RX poll handles before it lets other work on its core run.
+#define RX_POLL_BUDGET 32
+// Most interrupts per second the device raises.
+#define IRQ_RATE 20000
 
 static console_stream verbose(false);
 
 struct e1000_model;
 
+class e1000;
+
+// Polls for received packets in a kernel worker (see e1000::poll).
+struct e1000_poll : public kwork
+{
+  e1000 *dev_;
+  void run() override;
+};
+
 class e1000 : public netdev, irq_handler
 {
+  friend struct e1000_poll;
+
   const struct e1000_model * const model_;
   const u32 membase_;
   const u32 iobase_;
 
   volatile u32 txclean_;
   volatile u32 txinuse_;
+  u32 txtail_;                  // Our copy of WMREG_TDT
+  void *txbuf_[TX_RING_SIZE];   // Buffer of each descriptor, if any
+  // The checksum offsets of the last context descriptor we queued, or
+  // 0 if none.  The device uses them for every packet until the next.
+  u16 ctx_start_, ctx_off_;
 
   volatile u32 rxclean_;
-  volatile u32 rxuse_;
+  u32 rxtail_;                  // Our copy of WMREG_RDT
+
+  // While a poll is queued or running, RX interrupts are masked.
+  e1000_poll poll_;
+  std::atomic<bool> polling_;
 
   u8 hwaddr_[6];
 
@@ -46,10 +74,14 @@ class e1000 : public netdev, irq_handler
   int eeprom_read_16(u16 off);
   int eeprom_read(u16 *buf, int off, int count);
 
+  bool queuetx(void *buf, u32 len, u16 csum_start = 0, u16 csum_off = 0);
+  void cleantx_locked();
   void cleantx();
   void allocrx();
 
-  void cleanrx();
+  int cleanrx(int budget);
+  bool rxpending();
+  void poll();
 
   void reset();
 public:                         // Meh, e1000_models points to these
@@ -77,6 +109,8 @@ public:
   }
 
   int transmit(void *buf, uint32_t len);
+  int transmit_batch(const struct netpkt *pkts, int n);
+  bool csum_offload() { return true; }
   void get_hwaddr(uint8_t *hwaddr);
 };
 
@@ -206,105 +240,213 @@ e1000::eeprom_read(u16 *buf, int off, int count)
   return 0;
 }
 
-int
-e1000::transmit(void *buf, u32 len)
+// Put buf on the TX ring, without telling the device, with a TCP/UDP
+// checksum if csum_start isn't 0 (see netpkt).  Caller holds lk_.
+bool
+e1000::queuetx(void *buf, u32 len, u16 csum_start, u16 csum_off)
 {
   struct wiseman_txdesc *desc;
-  u32 tail;
 
-  scoped_acquire l(&lk_);
+  // A different checksum layout takes a context descriptor first.
+  u32 need = 1;
+  if (csum_start && (csum_start != ctx_start_ || csum_off != ctx_off_))
+    need = 2;
+
   // WMREG_TDT should only equal WMREG_TDH when we have
   // nothing to transmit.  Therefore, we can accomodate
-  // TX_RING_SIZE-1 buffers.
-  if (txinuse_ == TX_RING_SIZE-1) {
+  // TX_RING_SIZE-1 buffers.  If the ring looks full, the
+  // interrupt may just not have reaped it yet.
+  if (txinuse_ + need > TX_RING_SIZE-1)
+    cleantx_locked();
+  if (txinuse_ + need > TX_RING_SIZE-1) {
     cprintf("TX ring overflow\n");
-    return -1;
+    return false;
   }
 
-  tail = erd(WMREG_TDT);
-  desc = &txd_[tail];
+  if (need == 2) {
+    // [E1000 3.3] Sum from csum_start to the end of the packet.
+    struct livengood_tcpip_ctxdesc *ctx =
+      (struct livengood_tcpip_ctxdesc*) &txd_[txtail_];
+    if (!(txd_[txtail_].wtx_fields.wtxu_status & WTX_ST_DD))
+      panic("e1000tx");
+    ctx->tcpip_ipcs = 0;
+    ctx->tcpip_tucs = WTX_TCPIP_TUCSS(csum_start) | WTX_TCPIP_TUCSO(csum_off);
+    ctx->tcpip_cmdlen = WTX_CMD_DEXT | WTX_DTYP_C | WTX_CMD_RS;
+    ctx->tcpip_seg = 0;
+    txbuf_[txtail_] = nullptr;
+    txtail_ = (txtail_+1) % TX_RING_SIZE;
+    txinuse_++;
+    ctx_start_ = csum_start;
+    ctx_off_ = csum_off;
+  }
+
+  desc = &txd_[txtail_];
   if (!(desc->wtx_fields.wtxu_status & WTX_ST_DD))
     panic("e1000tx");
 
   desc->wtx_addr = v2p(buf);
   desc->wtx_cmdlen = len | WTX_CMD_RS | WTX_CMD_EOP | WTX_CMD_IFCS;
   memset(&desc->wtx_fields, 0, sizeof(desc->wtx_fields));
-  ewr(WMREG_TDT, (tail+1) % TX_RING_SIZE);
+  if (csum_start) {
+    // An extended data descriptor, to use the context.
+    desc->wtx_cmdlen |= WTX_CMD_DEXT | WTX_DTYP_D;
+    desc->wtx_fields.wtxu_options = WTX_TXSM;
+  }
+  txbuf_[txtail_] = buf;
+  txtail_ = (txtail_+1) % TX_RING_SIZE;
   txinuse_++;
 
   if (0) console.print("Transmit ", shexdump(buf, len));
 
+  return true;
+}
+
+int
+e1000::transmit(void *buf, u32 len)
+{
+  scoped_acquire l(&lk_);
+  if (!queuetx(buf, len))
+    return -1;
+  ewr(WMREG_TDT, txtail_);
   return 0;
 }
 
+int
+e1000::transmit_batch(const struct netpkt *pkts, int n)
+{
+  scoped_acquire l(&lk_);
+  int i;
+  for (i = 0; i < n; i++)
+    if (!queuetx(pkts[i].buf, pkts[i].len, pkts[i].csum_start,
+                 pkts[i].csum_off))
+      break;
+  // One MMIO write for the whole batch.
+  if (i)
+    ewr(WMREG_TDT, txtail_);
+  return i;
+}
+
+// Free the buffers of packets the device has sent.  Caller holds lk_.
 void
-e1000::cleantx()
+e1000::cleantx_locked()
 {
   struct wiseman_txdesc *desc;
-  void *va;
 
-  scoped_acquire l(&lk_);
   while (txinuse_) {
     desc = &txd_[txclean_];
     if (!(desc->wtx_fields.wtxu_status & WTX_ST_DD))
       break;
 
-    va = p2v(desc->wtx_addr);
-    netfree(va);
+    // Context descriptors have no buffer.
+    if (txbuf_[txclean_])
+      netfree(txbuf_[txclean_]);
+    txbuf_[txclean_] = nullptr;
     desc->wtx_fields.wtxu_status = WTX_ST_DD;
 
     txclean_ = (txclean_+1) % TX_RING_SIZE;
-    desc = &txd_[txclean_];
     txinuse_--;
   }
 }
 
+void
+e1000::cleantx()
+{
+  scoped_acquire l(&lk_);
+  cleantx_locked();
+}
+
+// Post a fresh buffer at the tail, without telling the device.
+// Caller holds lk_.
 void
 e1000::allocrx()
 {
   struct wiseman_rxdesc *desc;
   void *buf;
-  u32 i;
 
-  i = erd(WMREG_RDT);
-  desc = &rxd_[i];
+  desc = &rxd_[rxtail_];
   if (desc->wrx_status & WRX_ST_DD)
     panic("allocrx");
   buf = netalloc();
   if (buf == nullptr)
     panic("Oops");
   desc->wrx_addr = v2p(buf);
-
-  ewr(WMREG_RDT, (i+1) % RX_RING_SIZE);
+  rxtail_ = (rxtail_+1) % RX_RING_SIZE;
 }
 
-void
-e1000::cleanrx()
+// Receive up to budget packets and hand them to the stack together.
+// The descriptors they used are refilled in bulk, with one write of
+// WMREG_RDT.  Returns how many packets there were.
+int
+e1000::cleanrx(int budget)
 {
   struct wiseman_rxdesc *desc;
-  void *va;
-  u16 len;
+  void *va[RX_POLL_BUDGET];
+  u16 len[RX_POLL_BUDGET];
+  int n = 0;
 
-  acquire(&lk_);
-  desc = &rxd_[rxclean_];
-  while (desc->wrx_status & WRX_ST_DD) {
-    va = p2v(desc->wrx_addr);
-    len = desc->wrx_len;
+  if (budget > RX_POLL_BUDGET)
+    budget = RX_POLL_BUDGET;
 
-    desc->wrx_status = 0;
-    allocrx();
+  {
+    scoped_acquire l(&lk_);
+    desc = &rxd_[rxclean_];
+    while (n < budget && (desc->wrx_status & WRX_ST_DD)) {
+      va[n] = p2v(desc->wrx_addr);
+      len[n] = desc->wrx_len;
+      desc->wrx_status = 0;
 
-    rxclean_ = (rxclean_+1) % RX_RING_SIZE;
+      if (0) console.print("Receive ", shexdump(va[n], len[n]));
 
-    if (0) console.print("Receive ", shexdump(va, len));
+      n++;
+      rxclean_ = (rxclean_+1) % RX_RING_SIZE;
+      desc = &rxd_[rxclean_];
+    }
+    for (int i = 0; i < n; i++)
+      allocrx();
+    if (n)
+      ewr(WMREG_RDT, rxtail_);
+  }
 
-    release(&lk_);
-    netrx(va, len);
-    acquire(&lk_);
+  if (n)
+    netrx_batch(va, len, n);
+  return n;
+}
 
-    desc = &rxd_[rxclean_];
+bool
+e1000::rxpending()
+{
+  scoped_acquire l(&lk_);
+  return rxd_[rxclean_].wrx_status & WRX_ST_DD;
+}
+
+void
+e1000_poll::run()
+{
+  dev_->poll();
+}
+
+// NAPI-style receive.  The RX interrupt masks itself and queues this
+// on its core's workers, which takes packets off the ring a budget at
+// a time until it's empty, and only then turns the interrupt back on.
+// At high packet rates the device stays masked and is just polled.
+void
+e1000::poll()
+{
+  for (;;) {
+    if (cleanrx(RX_POLL_BUDGET) == RX_POLL_BUDGET) {
+      // There may be more.  Go to the back of the queue.
+      kwork_push(&poll_, myid());
+      return;
+    }
+
+    polling_ = false;
+    ewr(WMREG_IMS, ICR_RXO | ICR_RXT0);
+    // A packet that arrived before the unmask may not have raised
+    // an interrupt.
+    if (!rxpending() || polling_.exchange(true))
+      return;
+    ewr(WMREG_IMC, ICR_RXO | ICR_RXT0);
   }
-  release(&lk_);
 }
 
 void
@@ -316,15 +458,21 @@ e1000::handle_irq()
     if (icr & ICR_TXDW)
       cleantx();
 
-    if (icr & ICR_RXT0)
-      cleanrx();
+    if ((icr & (ICR_RXT0|ICR_RXO)) && !polling_.exchange(true)) {
+      ewr(WMREG_IMC, ICR_RXO | ICR_RXT0);
+      kwork_push(&poll_, myid());
+    }
 
     if (icr & ICR_RXO) {
       //panic("ICR_RXO");
+      netstat_inc(&netstats::rx_overrun);
       cprintf("e1000: handle_irq(): ICR_RXO (RX buffer overflow)\n");
     }
 
+    // RX causes are the poll's business while it's queued.
     icr = erd(WMREG_ICR);
+    if (polling_)
+      icr &= ~(ICR_RXO|ICR_RXT0);
   }
 }
 
@@ -371,9 +519,11 @@ e1000::attach(struct pci_func *pcif)
 
 e1000::e1000(const struct e1000_model *model, struct pci_func *pcif)
   : model_(model), membase_(pcif->reg_base[0]), iobase_(pcif->reg_base[2]),
-    txclean_(0), txinuse_(0), rxclean_(0), rxuse_(0), txd_{}, rxd_{},
-    lk_("e1000", true), valid_(false)
+    txclean_(0), txinuse_(0), txtail_(0), txbuf_{},
+    ctx_start_(0), ctx_off_(0), rxclean_(0), rxtail_(0),
+    polling_(false), txd_{}, rxd_{}, lk_("e1000", true), valid_(false)
 {
+  poll_.dev_ = this;
   verbose.println("e1000: Initializing");
 
   // [E1000e 14.3]
@@ -563,9 +713,13 @@ e1000::init_rx()
   ewr(WMREG_RDBAL, rpa & 0xffffffff);
   ewr(WMREG_RDLEN, sizeof(rxd_));
   ewr(WMREG_RDH, 0);
-  ewr(WMREG_RDT, RX_RING_SIZE>>1);
+  rxtail_ = RX_RING_SIZE>>1;
+  ewr(WMREG_RDT, rxtail_);
   ewr(WMREG_RDTR, 0);
   ewr(WMREG_RADV, 0);
+  // Throttle interrupts to IRQ_RATE a second.  The interval is in
+  // units of 256 ns.
+  ewr(WMREG_ITR, 1000000000 / (IRQ_RATE * 256));
   ewr(WMREG_RCTL,
       RCTL_EN | RCTL_RDMTS_1_2 | RCTL_DPF | RCTL_BAM | RCTL_2k);
 }
@@ -0,0 +1,351 @@
+// epoll: readiness notification for pipes, sockets, and other files.
+//
+// A watched file's poll_source queues the watch on its epoll set when an
+// event happens.  Each epoll set has a ready list per core and an event
+// goes on the notifying core's, so files that become ready on different
+// cores don't contend, and a set only used on one core stays there.
+// epoll_wait takes watches off the ready lists and asks each source
+// whether its file is still ready, so it never reports a file that
+// isn't.  A level-triggered watch that was ready goes back on the list
+// to be checked again next time, as in Linux; an EPOLLET one waits for
+// the next event.
+//
+// Unlike Linux, a watch is for an FD number rather than the open file,
+// and closing the FD doesn't remove it.  It stays until EPOLL_CTL_DEL,
+// or until the FD is added again, and is silent once the file is gone.
+
+#include "types.h"
+#include "kernel.hh"
+#include "cpu.hh"
+#include "proc.hh"
+#include "file.hh"
+#include "epoll.hh"
+#include <uk/fcntl.h>
+
+struct file_epoll : public referenced, public file {
+  enum { NBUCKETS = 64 };
+
+  struct ready_list {
+    spinlock lock;
+    ilist<epoll_watch, &epoll_watch::ready_link> list;
+    __padout__;
+  } __mpalign__;
+
+  ready_list ready[NCPU];
+  // How many watches are on the ready lists, so epoll_wait can tell
+  // without looking at every core's list.
+  std::atomic<long> nqueued __mpalign__;
+
+  // epoll_wait sleeps on cv under wait_lock, and nwaiting tells
+  // notifiers whether anyone needs waking.
+  spinlock wait_lock;
+  condvar cv;
+  std::atomic<int> nwaiting;
+
+  // Serializes epoll_ctl and taking events off the ready lists, so
+  // a watch isn't deleted while epoll_wait looks at it.  Not held while
+  // epoll_wait sleeps.
+  sleeplock ctl_lock;
+  // Watches by FD.  Protected by ctl_lock.
+  ilist<epoll_watch, &epoll_watch::fd_link> fds[NBUCKETS];
+
+  // Identifies epoll files to epoll_ctl, which doesn't nest them.
+  sref<poll_source> self;
+
+  file_epoll()
+    : nqueued(0), wait_lock("epoll"), cv("epoll"), nwaiting(0),
+      ctl_lock("epoll:ctl"),
+      self(make_sref<poll_source>(poll_self, this))
+  {
+    for (ready_list &r : ready)
+      r.lock = spinlock("epoll:ready");
+  }
+
+  ~file_epoll()
+  {
+    for (auto &b : fds)
+      while (!b.empty())
+        remove(&b.front());
+    self->detach();
+  }
+  NEW_DELETE_OPS(file_epoll);
+
+  void inc() override { referenced::inc(); }
+  void dec() override { referenced::dec(); }
+
+  poll_source *get_poll_source() override { return self.get(); }
+
+  static u32 poll_self(void *arg) { return 0; }
+
+  // f as an epoll set, or null if it isn't one.
+  static file_epoll *of(file *f)
+  {
+    poll_source *src = f->get_poll_source();
+    if (!src || src->fn_ != poll_self)
+      return nullptr;
+    return static_cast<file_epoll*>(f);
+  }
+
+  // For files without a poll_source of their own.
+  static u32 poll_always(void *arg) { return EPOLLIN | EPOLLOUT; }
+
+  // Put w on this core's ready list, unless it's already queued,
+  // and wake epoll_wait.
+  void queue(epoll_watch *w)
+  {
+    if (w->queued.exchange(true))
+      return;
+    int c = myid();
+    {
+      scoped_acquire l(&ready[c].lock);
+      ready[c].list.push_back(w);
+      w->queued_on = c;
+    }
+    nqueued++;
+    if (nwaiting) {
+      scoped_acquire l(&wait_lock);
+      cv.wake_all();
+    }
+  }
+
+  // The events of w to report now, given the source's readiness.
+  // Caller holds w->src->lock_.
+  static u32 pending(epoll_watch *w)
+  {
+    if (w->disabled || !w->src->arg_)
+      return 0;
+    u32 mask = w->src->fn_(w->src->arg_);
+    return mask & ((w->events & ~(EPOLLET | EPOLLONESHOT)) |
+                   EPOLLERR | EPOLLHUP);
+  }
+
+  ilist<epoll_watch, &epoll_watch::fd_link> &bucket(int fd)
+  {
+    return fds[(unsigned)fd % NBUCKETS];
+  }
+
+  epoll_watch *lookup(int fd)
+  {
+    for (epoll_watch &w : bucket(fd))
+      if (w.fd == fd)
+        return &w;
+    return nullptr;
+  }
+
+  // Unlink w from everything and free it.  Caller holds ctl_lock (or
+  // has the last reference to the set).
+  void remove(epoll_watch *w)
+  {
+    {
+      scoped_acquire l(&w->src->lock_);
+      w->src->watchers_.erase(w->src->watchers_.iterator_to(w));
+      w->src->nwatch_--;
+    }
+    // The source can't queue w any more, and epoll_wait only takes it
+    // off under ctl_lock, so queued_on is stable.
+    if (w->queued_on >= 0) {
+      scoped_acquire l(&ready[w->queued_on].lock);
+      ready[w->queued_on].list.erase(
+        ready[w->queued_on].list.iterator_to(w));
+      nqueued--;
+    }
+    bucket(w->fd).erase(bucket(w->fd).iterator_to(w));
+    delete w;
+  }
+
+  int ctl(int op, int fd, u32 events, u64 data)
+  {
+    auto l = ctl_lock.guard();
+    epoll_watch *w = lookup(fd);
+
+    if (op == EPOLL_CTL_DEL || op == EPOLL_CTL_MOD) {
+      if (!w)
+        return -1;
+      if (op == EPOLL_CTL_DEL) {
+        remove(w);
+        return 0;
+      }
+      scoped_acquire sl(&w->src->lock_);
+      w->events = events;
+      w->data = data;
+      w->disabled = false;
+      if (pending(w))
+        queue(w);
+      return 0;
+    }
+
+    if (op != EPOLL_CTL_ADD)
+      return -1;
+    sref<file> f = getfile(fd);
+    if (!f)
+      return -1;
+    sref<poll_source> src = sref<poll_source>::newref(f->get_poll_source());
+    if (src && src->fn_ == poll_self)
+      return -1;
+    if (w) {
+      // A watch for a file the FD no longer refers to is stale.
+      if (!src || w->src != src)
+        remove(w);
+      else
+        return -1;
+    }
+
+    try {
+      if (!src)
+        src = make_sref<poll_source>(poll_always, this);
+      w = new epoll_watch(this, src, fd);
+    } catch (std::bad_alloc &e) {
+      return -1;
+    }
+    w->events = events;
+    w->data = data;
+    bucket(fd).push_back(w);
+    scoped_acquire sl(&src->lock_);
+    src->watchers_.push_back(w);
+    src->nwatch_++;
+    if (pending(w))
+      queue(w);
+    return 0;
+  }
+
+  // Take up to n events off the ready lists.  Caller holds ctl_lock.
+  int harvest(struct epoll_event *out, int n)
+  {
+    int got = 0;
+    // Level-triggered watches that were ready, to queue again once
+    // we're done, so this pass doesn't see them twice.
+    ilist<epoll_watch, &epoll_watch::ready_link> again;
+    int start = myid();
+    for (int i = 0; i < ncpu && got < n; i++) {
+      ready_list &r = ready[(start + i) % ncpu];
+      while (got < n) {
+        epoll_watch *w;
+        {
+          scoped_acquire l(&r.lock);
+          if (r.list.empty())
+            break;
+          w = &r.list.front();
+          r.list.pop_front();
+          w->queued_on = -1;
+        }
+        nqueued--;
+        // An event from here on queues it again.
+        w->queued = false;
+
+        scoped_acquire sl(&w->src->lock_);
+        u32 mask = pending(w);
+        if (!mask)
+          continue;
+        out[got].events = mask;
+        out[got].data.u64 = w->data;
+        got++;
+        if (w->events & EPOLLONESHOT)
+          w->disabled = true;
+        else if (!(w->events & EPOLLET) && !w->queued.exchange(true))
+          again.push_back(w);
+      }
+    }
+
+    while (!again.empty()) {
+      epoll_watch *w = &again.front();
+      again.pop_front();
+      ready_list &r = ready[start];
+      scoped_acquire l(&r.lock);
+      r.list.push_back(w);
+      w->queued_on = start;
+      nqueued++;
+    }
+    return got;
+  }
+
+  // Wait until deadline (in nsectime, or forever if 0) for events,
+  // unless nonblock.  Returns how many there were in out, or -1 if the
+  // caller was killed.
+  int wait(struct epoll_event *out, int n, u64 deadline, bool nonblock)
+  {
+    for (;;) {
+      int got;
+      {
+        auto l = ctl_lock.guard();
+        got = harvest(out, n);
+      }
+      if (got || nonblock)
+        return got;
+      if (myproc()->killed)
+        return -1;
+
+      scoped_acquire l(&wait_lock);
+      nwaiting++;
+      if (nqueued <= 0) {
+        if (deadline && nsectime() >= deadline) {
+          nwaiting--;
+          return 0;
+        }
+        cv.sleep_to(&wait_lock, deadline);
+      }
+      nwaiting--;
+    }
+  }
+};
+
+void
+poll_source::notify_watchers(u32 events)
+{
+  scoped_acquire l(&lock_);
+  for (epoll_watch &w : watchers_) {
+    if (w.disabled)
+      continue;
+    if (events & (w.events | EPOLLERR | EPOLLHUP))
+      w.ep->queue(&w);
+  }
+}
+
+//SYSCALL
+int
+sys_epoll_create1(int flags)
+{
+  if (flags & ~EPOLL_CLOEXEC)
+    return -1;
+  sref<file> f;
+  try {
+    f = make_sref<file_epoll>();
+  } catch (std::bad_alloc &e) {
+    return -1;
+  }
+  return fdalloc(std::move(f), flags & EPOLL_CLOEXEC ? O_CLOEXEC : 0);
+}
+
+//SYSCALL
+int
+sys_epoll_ctl(int epfd, int op, int fd, userptr<struct epoll_event> event)
+{
+  sref<file> f = getfile(epfd);
+  file_epoll *ep = f ? file_epoll::of(f.get()) : nullptr;
+  if (!ep)
+    return -1;
+
+  struct epoll_event ev = {};
+  if (op != EPOLL_CTL_DEL && !event.load(&ev, 1))
+    return -1;
+  return ep->ctl(op, fd, ev.events, ev.data.u64);
+}
+
+//SYSCALL
+int
+sys_epoll_wait(int epfd, userptr<struct epoll_event> events, int maxevents,
+               int timeout)
+{
+  sref<file> f = getfile(epfd);
+  file_epoll *ep = f ? file_epoll::of(f.get()) : nullptr;
+  if (!ep || maxevents <= 0)
+    return -1;
+
+  struct epoll_event out[EPOLL_MAX_EVENTS];
+  if (maxevents > EPOLL_MAX_EVENTS)
+    maxevents = EPOLL_MAX_EVENTS;
+  u64 deadline = timeout > 0 ? nsectime() + (u64)timeout * 1000000 : 0;
+  int n = ep->wait(out, maxevents, deadline, timeout == 0);
+  if (n > 0 && !events.store(out, n))
+    return -1;
+  return n;
+}
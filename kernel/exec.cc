@@ -15,17 +15,68 @@
 #include "mfs.hh"
 #include "work.hh"
 #include "filetable.hh"
+#include "kstats.hh"
+#include <memory>
+#include <vector>
 
 #define BRK (USERTOP >> 1)
 
+// The ELF header and loadable program headers of an executable,
+// parsed by the first exec of its current contents and kept with its
+// mfile, so that later execs of the same binary don't re-read and
+// re-parse them.  Segment contents are never copied into it: dosegment
+// maps them straight from the file's page cache.
+struct exec_image : public rcu_freed
+{
+  u64 gen;                      // mfile::content_gen() when parsed
+  elfhdr elf;
+  std::vector<proghdr> load;    // The ELF_PROG_LOAD headers
+
+  exec_image(u64 g) : rcu_freed("exec_image", this, sizeof(*this)), gen(g) { }
+  void do_gc() override { delete this; }
+  NEW_DELETE_OPS(exec_image);
+};
+
+// Return this file's cached exec_image, or nullptr if there is none or
+// the file has changed since it was parsed.  The caller must be in a
+// gc epoch.
+exec_image*
+mfile::get_exec_image()
+{
+  exec_image *img = exec_image_.load(std::memory_order_acquire);
+  if (img && img->gen != content_gen_.load())
+    return nullptr;
+  return img;
+}
+
+void
+mfile::set_exec_image(exec_image *img)
+{
+  exec_image *old = exec_image_.exchange(img);
+  if (old)
+    gc_delayed(old);
+}
+
+// Read the program headers of the ELF file m, whose header is elf.
+// gen must be m's content_gen() from before elf was read.
+static exec_image*
+parse_image(sref<mnode> m, const elfhdr &elf, u64 gen)
+{
+  std::unique_ptr<exec_image> img(new exec_image(gen));
+  img->elf = elf;
+  for (size_t i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(proghdr)){
+    proghdr ph;
+    if (readm(m, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
+      return nullptr;
+    if (ph.type == ELF_PROG_LOAD)
+      img->load.push_back(ph);
+  }
+  return img.release();
+}
+
 static int
-dosegment(sref<mnode> m, vmap* vmp, u64 off, u64 *load_addr)
+dosegment(sref<mnode> m, vmap* vmp, const proghdr &ph, u64 *load_addr)
 {
-  struct proghdr ph;
-  if(readm(m, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
-    return -1;
-  if(ph.type != ELF_PROG_LOAD)
-    return -1;
   if(ph.memsz < ph.filesz)
     return -1;
   if (ph.offset < PGOFFSET(ph.vaddr))
@@ -213,62 +264,70 @@ load_image(proc *p, const char *path, const char * const *argv,
 
   scoped_gc_epoch rcu;
 
-  // Check header
-  char buf[1024];
   if (m->type() != mnode::types::file)
     return -1;
-  size_t sz = readm(m, buf, 0, sizeof(buf));
-  if (sz < 0)
-    return -1;
+  mfile *mf = m->as_file();
+
+  exec_image *img = mf->get_exec_image();
+  if (img) {
+    kstats::inc(&kstats::exec_image_hit);
+  } else {
+    kstats::inc(&kstats::exec_image_miss);
+    u64 gen = mf->content_gen();
+
+    // Check header
+    char buf[1024];
+    s64 sz = readm(m, buf, 0, sizeof(buf));
+    if (sz < 0)
+      return -1;
 
-  // Script?
-  if (strncmp(buf, "#!", 2) == 0) {
-    int i;
-    for (i = 2; i < sz; ++i) {
-      if (buf[i] == '\n') {
-        buf[i] = 0;
-        break;
+    // Script?
+    if (strncmp(buf, "#!", 2) == 0) {
+      int i;
+      for (i = 2; i < sz; ++i) {
+        if (buf[i] == '\n') {
+          buf[i] = 0;
+          break;
+        }
       }
+      if (i == sz)
+        return -1;
+      const char *argv[] = {&buf[2], path, NULL};
+      return load_image(p, argv[0], argv, oldvmap_out);
     }
-    if (i == sz)
+
+    // ELF?
+    struct elfhdr *elf = reinterpret_cast<elfhdr*>(&buf);
+    static_assert(sizeof(*elf) <= sizeof(buf), "buf too small for ELF header");
+    if (sz < sizeof(*elf))
+      return -1;
+    if(elf->magic != ELF_MAGIC)
       return -1;
-    const char *argv[] = {&buf[2], path, NULL};
-    return load_image(p, argv[0], argv, oldvmap_out);
-  }
 
-  // ELF?
-  struct elfhdr *elf = reinterpret_cast<elfhdr*>(&buf);
-  static_assert(sizeof(elf) <= sizeof(buf), "buf too small for ELF header");
-  if (sz < sizeof(elf))
-    return -1;
-  if(elf->magic != ELF_MAGIC)
-    return -1;
+    img = parse_image(m, *elf, gen);
+    if (!img)
+      return -1;
+    // Even if another exec replaces img right away, it stays valid
+    // until our gc epoch ends.
+    mf->set_exec_image(img);
+  }
 
+  const elfhdr *elf = &img->elf;
   sref<vmap> vmp = vmap::alloc();
   if (!vmp)
     return -1;
 
   u64 load_addr = -1;
-  for (size_t i=0, off=elf->phoff; i<elf->phnum; i++, off+=sizeof(proghdr)){
-    Elf64_Word type;
-    if(readm(m, (char*)&type, 
-             off+__offsetof(struct proghdr, type), 
-             sizeof(type)) != sizeof(type))
+  for (const proghdr &ph : img->load)
+    if (dosegment(m, vmp.get(), ph, &load_addr) < 0)
       return -1;
 
-    switch (type) {
-    case ELF_PROG_LOAD:
-      if (dosegment(m, vmp.get(), off, &load_addr) < 0)
-        return -1;
-      break;
-    default:
-      continue;
-    }
-  }
-
   if (doheap(vmp.get()) < 0)
     return -1;
 
+  if (timepage_map(vmp.get()) < 0)
+    return -1;
+
   // dostack reads from the user vm space. 
   long sp = dostack(vmp.get(), argv, path);
   if (sp < 0)
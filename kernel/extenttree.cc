@@ -0,0 +1,229 @@
+#include "types.h"
+#include "kernel.hh"
+#include "extenttree.hh"
+#include <algorithm>
+
+extent_tree::~extent_tree()
+{
+  destroy(root_);
+}
+
+void
+extent_tree::destroy(extent *e)
+{
+  if (!e)
+    return;
+  destroy(e->left);
+  destroy(e->right);
+  delete e;
+}
+
+void
+extent_tree::update(extent *e)
+{
+  e->height = 1 + std::max(height(e->left), height(e->right));
+  e->max_len = std::max(e->len, std::max(max_len(e->left), max_len(e->right)));
+}
+
+extent_tree::extent *
+extent_tree::rotate_left(extent *e)
+{
+  extent *r = e->right;
+  e->right = r->left;
+  r->left = e;
+  update(e);
+  update(r);
+  return r;
+}
+
+extent_tree::extent *
+extent_tree::rotate_right(extent *e)
+{
+  extent *l = e->left;
+  e->left = l->right;
+  l->right = e;
+  update(e);
+  update(l);
+  return l;
+}
+
+extent_tree::extent *
+extent_tree::rebalance(extent *e)
+{
+  update(e);
+  int balance = height(e->left) - height(e->right);
+  if (balance > 1) {
+    if (height(e->left->left) < height(e->left->right))
+      e->left = rotate_left(e->left);
+    return rotate_right(e);
+  }
+  if (balance < -1) {
+    if (height(e->right->right) < height(e->right->left))
+      e->right = rotate_right(e->right);
+    return rotate_left(e);
+  }
+  return e;
+}
+
+extent_tree::extent *
+extent_tree::insert_node(extent *e, extent *n)
+{
+  if (!e)
+    return n;
+  if (n->start < e->start)
+    e->left = insert_node(e->left, n);
+  else
+    e->right = insert_node(e->right, n);
+  return rebalance(e);
+}
+
+extent_tree::extent *
+extent_tree::remove_min(extent *e, extent **min)
+{
+  if (!e->left) {
+    *min = e;
+    return e->right;
+  }
+  e->left = remove_min(e->left, min);
+  return rebalance(e);
+}
+
+extent_tree::extent *
+extent_tree::remove_node(extent *e, u32 start, extent **removed)
+{
+  assert(e);
+  if (start < e->start) {
+    e->left = remove_node(e->left, start, removed);
+  } else if (start > e->start) {
+    e->right = remove_node(e->right, start, removed);
+  } else {
+    *removed = e;
+    if (!e->left || !e->right)
+      return e->left ? e->left : e->right;
+    extent *min;
+    extent *right = remove_min(e->right, &min);
+    min->left = e->left;
+    min->right = right;
+    e = min;
+  }
+  return rebalance(e);
+}
+
+// Returns the extent with the largest start <= bno, if any.
+extent_tree::extent *
+extent_tree::predecessor(u32 bno) const
+{
+  extent *best = nullptr;
+  for (extent *e = root_; e; ) {
+    if (e->start <= bno) {
+      best = e;
+      e = e->right;
+    } else {
+      e = e->left;
+    }
+  }
+  return best;
+}
+
+// Returns the extent with the smallest start > bno, if any.
+extent_tree::extent *
+extent_tree::successor(u32 bno) const
+{
+  extent *best = nullptr;
+  for (extent *e = root_; e; ) {
+    if (e->start > bno) {
+      best = e;
+      e = e->left;
+    } else {
+      e = e->right;
+    }
+  }
+  return best;
+}
+
+// Returns the lowest-addressed extent of at least len blocks, if any.
+extent_tree::extent *
+extent_tree::first_fit(u32 len) const
+{
+  extent *e = root_;
+  if (max_len(e) < len)
+    return nullptr;
+
+  for (;;) {
+    if (max_len(e->left) >= len)
+      e = e->left;
+    else if (e->len >= len)
+      return e;
+    else
+      e = e->right;
+  }
+}
+
+void
+extent_tree::insert(u32 start, u32 len)
+{
+  assert(len > 0 && start + len > start);
+
+  extent *pred = predecessor(start);
+  extent *succ = successor(start);
+  if (pred && pred->start + pred->len > start)
+    panic("extent_tree::insert: block %u already free", start);
+  if (succ && start + len > succ->start)
+    panic("extent_tree::insert: block %u already free", succ->start);
+
+  nfree_ += len;
+
+  // Coalesce with the neighbouring extents. The merged extent is inserted
+  // afresh, which keeps the max_len of its ancestors up to date.
+  extent *removed;
+  if (pred && pred->start + pred->len == start) {
+    root_ = remove_node(root_, pred->start, &removed);
+    start = pred->start;
+    len += pred->len;
+    delete pred;
+    nextents_--;
+  }
+  if (succ && start + len == succ->start) {
+    root_ = remove_node(root_, succ->start, &removed);
+    len += succ->len;
+    delete succ;
+    nextents_--;
+  }
+
+  root_ = insert_node(root_, new extent(start, len));
+  nextents_++;
+}
+
+u32
+extent_tree::remove(u32 len, u32 *start)
+{
+  assert(len > 0);
+  if (!root_)
+    return 0;
+
+  extent *e = first_fit(len);
+  if (!e)
+    e = first_fit(root_->max_len);
+
+  extent *removed;
+  root_ = remove_node(root_, e->start, &removed);
+  assert(removed == e);
+
+  u32 n = std::min(len, e->len);
+  *start = e->start;
+  nfree_ -= n;
+
+  if (n < e->len) {
+    // The rest of the extent keeps its place in the order.
+    e->start += n;
+    e->len -= n;
+    e->left = e->right = nullptr;
+    e->height = 1;
+    e->max_len = e->len;
+    root_ = insert_node(root_, e);
+  } else {
+    delete e;
+    nextents_--;
+  }
+  return n;
+}
@@ -0,0 +1,83 @@
+// Page fault statistics by fault type, per core and per process, read
+// through /dev/faultstats (see faultstats.h).
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include "cpu.hh"
+#include "proc.hh"
+#include "percpu.hh"
+#include "file.hh"
+#include "major.h"
+#include "kalloc.hh"
+#include "faultstats.h"
+
+extern u64 cpuhz;
+
+// Like kstats, these are only approximately per core: a process that
+// migrates in the middle of an update may race with the next one.
+DEFINE_PERCPU(pagefault_stats, cpu_faults, NO_CRITICAL);
+
+static void
+add_fault(pagefault_stats *s, int type, u64 cycles)
+{
+  s->count[type]++;
+  s->cycles[type] += cycles;
+  int b = 63 - __builtin_clzll(cycles | 1) - PF_HIST_SHIFT;
+  if (b < 0)
+    b = 0;
+  else if (b >= PF_HIST_BUCKETS)
+    b = PF_HIST_BUCKETS - 1;
+  s->hist[type][b]++;
+}
+
+void
+pagefault_record(int type, u64 cycles)
+{
+  add_fault(cpu_faults.get_unchecked(), type, cycles);
+  add_fault(&myproc()->faults, type, cycles);
+}
+
+void
+pagefault_stats_fold(pagefault_stats *dst, const pagefault_stats &src)
+{
+  for (int t = 0; t < PF_NTYPES; t++) {
+    dst->count[t] += src.count[t];
+    dst->cycles[t] += src.cycles[t];
+    for (int b = 0; b < PF_HIST_BUCKETS; b++)
+      dst->hist[t][b] += src.hist[t][b];
+  }
+}
+
+static int
+faultstatsread(mdev*, char *dst, u32 off, u32 n)
+{
+  size_t sz = sizeof(faultstats_info) + ncpu * sizeof(pagefault_stats);
+  if (off >= sz)
+    return 0;
+  char *buf = (char*) kmalloc(sz, "faultstats");
+  if (!buf)
+    return -1;
+  faultstats_info *info = (faultstats_info*) buf;
+  info->ncpus = ncpu;
+  info->cpuhz = cpuhz;
+  info->self = myproc()->faults;
+  {
+    scoped_acquire l(&myproc()->lock);
+    info->children = myproc()->child_faults;
+  }
+  for (int c = 0; c < ncpu; c++)
+    info->cpu[c] = cpu_faults[c];
+
+  if (n > sz - off)
+    n = sz - off;
+  memmove(dst, buf + off, n);
+  kmfree(buf, sz);
+  return n;
+}
+
+void
+initfaultstats(void)
+{
+  devsw[MAJ_FAULTSTATS].pread = faultstatsread;
+}
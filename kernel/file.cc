@@ -6,16 +6,158 @@
 #include "file.hh"
 #include <uk/stat.h>
 #include "net.hh"
+#include "fsstats.hh"
+#include "tracepoint.hh"
 
 struct devsw __mpalign__ devsw[NDEV];
 
+ssize_t
+file::read_user(userptr<void> buf, size_t n)
+{
+  char *b = kalloc("readbuf");
+  if (!b)
+    return -1;
+  auto cleanup = scoped_cleanup([b](){kfree(b);});
+  // XXX(Austin) Too bad
+  if (n > PGSIZE)
+    n = PGSIZE;
+  ssize_t res = read(b, n);
+  if (res < 0)
+    return -1;
+  if (!buf.store_bytes(b, res))
+    return -1;
+  return res;
+}
+
+ssize_t
+file::pread_user(userptr<void> buf, size_t n, off_t offset)
+{
+  if (n > 4*1024*1024)
+    n = 4*1024*1024;
+
+  char* b = (char*) kmalloc(n, "preadbuf");
+  if (!b)
+    return -1;
+  auto cleanup = scoped_cleanup([&](){kmfree(b, n);});
+  ssize_t r = pread(b, n, offset);
+  if (r > 0 && putmem(buf.unsafe_get(), b, r) < 0)
+    return -1;
+  return r;
+}
+
+// Call io(buf, len, done) on each of the iovcnt buffers in turn, where
+// done is how much the ones before it moved, until one fails or comes
+// up short.
+template<class IO>
+static ssize_t
+for_each_iov(const struct iovec *iov, int iovcnt, IO io)
+{
+  size_t done = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t r = io(userptr<void>(iov[i].iov_base), iov[i].iov_len, done);
+    if (r < 0)
+      return done ? done : -1;
+    done += r;
+    if ((size_t)r < iov[i].iov_len)
+      break;
+  }
+  return done;
+}
+
+ssize_t
+file::readv_user(const struct iovec *iov, int iovcnt, size_t n)
+{
+  return for_each_iov(iov, iovcnt,
+                      [this](userptr<void> buf, size_t len, size_t done) {
+                        return read_user(buf, len);
+                      });
+}
+
+ssize_t
+file::preadv_user(const struct iovec *iov, int iovcnt, size_t n, off_t offset)
+{
+  return for_each_iov(iov, iovcnt,
+                      [&](userptr<void> buf, size_t len, size_t done) {
+                        return pread_user(buf, len, offset + done);
+                      });
+}
+
+ssize_t
+file::writev_user(const struct iovec *iov, int iovcnt, size_t n)
+{
+  char *b = kalloc("writebuf");
+  if (!b)
+    return -1;
+  auto cleanup = scoped_cleanup([b](){kfree(b);});
+  // Like write, a page at a time.
+  return for_each_iov(iov, iovcnt,
+                      [&](userptr<void> buf, size_t len, size_t done) {
+                        len = MIN(len, PGSIZE);
+                        if (!buf.load_bytes(b, len))
+                          return (ssize_t)-1;
+                        return write(b, len);
+                      });
+}
+
+ssize_t
+file::pwritev_user(const struct iovec *iov, int iovcnt, size_t n, off_t offset)
+{
+  char *b = kalloc("pwritebuf");
+  if (!b)
+    return -1;
+  auto cleanup = scoped_cleanup([b](){kfree(b);});
+  return for_each_iov(iov, iovcnt,
+                      [&](userptr<void> buf, size_t len, size_t done) {
+                        len = MIN(len, PGSIZE);
+                        if (!buf.load_bytes(b, len))
+                          return (ssize_t)-1;
+                        return pwrite(b, len, offset + done);
+                      });
+}
+
+int
+file::sendmmsg(const userptr<void> *bufs, size_t *lens, unsigned int n,
+               int flags, const struct sockaddr *dest_addr, size_t addrlen)
+{
+  unsigned int i;
+  for (i = 0; i < n; i++) {
+    ssize_t r = sendto(bufs[i], lens[i], flags, dest_addr, addrlen);
+    if (r < 0)
+      break;
+    lens[i] = r;
+  }
+  return i ? i : -1;
+}
+
+int
+file::recvmmsg(const userptr<void> *bufs, size_t *lens, unsigned int n,
+               int flags, struct sockaddr_storage *src_addrs, size_t *addrlens)
+{
+  if (n == 0)
+    return 0;
+  ssize_t r = recvfrom(bufs[0], lens[0], flags, src_addrs, addrlens);
+  if (r < 0)
+    return -1;
+  lens[0] = r;
+  return 1;
+}
+
+ssize_t
+file::write_page(const sref<page_info> &page, size_t off, size_t len,
+                 bool more)
+{
+  return write((const char*) page->va() + off, len);
+}
+
 int
 file_mnode::fsync() {
 
   if (!m)
     return -1;
 
+  TRACEPOINT(FS_FSYNC, m->mnum_);
   int cpu = myid();
+  u64 start = nsectime();
   u64 fsync_tsc = get_tsc();
   rootfs_interface->process_metadata_log(fsync_tsc, m->mnum_, cpu);
 
@@ -24,12 +166,166 @@ file_mnode::fsync() {
   else if (m->type() == mnode::types::dir)
     m->as_dir()->sync_dir(cpu);
 
+  rootfs_interface->flush_transaction_queue(cpu);
+  fsstat_fsync(nsectime() - start);
+  return 0;
+}
+
+// fdatasync() on a file whose inode already exists on the disk only needs to
+// flush the dirty pages (and the inode, if the size or block map changed).
+// Metadata operations pending in the logical log concern the file's names and
+// link count, not its data, so they are left for a later fsync() or sync().
+// If the file's creation has not been applied to the disk yet, there is no
+// inode to write the data to, so fall back to a full fsync().
+int
+file_mnode::fdatasync() {
+
+  if (!m)
+    return -1;
+
+  u64 inum;
+  if (m->type() != mnode::types::file ||
+      !rootfs_interface->inum_lookup(m->mnum_, &inum))
+    return fsync();
+
+  int cpu = myid();
+  m->as_file()->sync_file(cpu, true);
+  rootfs_interface->flush_transaction_queue(cpu);
+  return 0;
+}
+
+// Like fdatasync(), but only flushes the dirty pages in the given range.
+int
+file_mnode::sync_range(off_t offset, off_t nbytes) {
+
+  if (!m)
+    return -1;
+
+  u64 inum;
+  if (m->type() != mnode::types::file)
+    return -1;
+  if (!rootfs_interface->inum_lookup(m->mnum_, &inum))
+    return fsync();
+
+  int cpu = myid();
+  m->as_file()->sync_file_range(cpu, offset, nbytes);
   rootfs_interface->flush_transaction_queue(cpu);
   return 0;
 }
 
+// Preallocate the disk blocks for [offset, offset + len) and commit them
+// right away, so that syncing writes to the range later has only data to
+// write. If the file's creation hasn't reached the disk yet, fsync() it
+// first, so that there is an inode to allocate the blocks to.
+int
+file_mnode::fallocate(off_t offset, off_t len)
+{
+  if (!m || !writable || m->type() != mnode::types::file || m->fs_ != root_fs)
+    return -1;
+
+  u64 inum;
+  if (!rootfs_interface->inum_lookup(m->mnum_, &inum)) {
+    fsync();
+    if (!rootfs_interface->inum_lookup(m->mnum_, &inum))
+      return -1;
+  }
+
+  int cpu = myid();
+  int r;
+  {
+    auto guard =
+      rootfs_interface->fs_journal[cpu]->commitq_insert_lock.guard();
+    transaction *trans = new transaction();
+    r = rootfs_interface->fallocate_file(m->mnum_, offset, len, trans);
+    rootfs_interface->add_transaction_to_queue(trans, cpu);
+  }
+  rootfs_interface->flush_transaction_queue(cpu);
+  return r;
+}
+
+// Make this file, which must be empty, a copy of src that shares src's disk
+// blocks until either of them writes to them. Both files are fsync()ed first,
+// so that src's blocks hold its current contents and this file has an inode.
+// The copy's pages are read in from the shared blocks as they are needed.
+int
+file_mnode::clone_from(file *src)
+{
+  if (!m || !writable || m->type() != mnode::types::file || m->fs_ != root_fs)
+    return -1;
+  sref<mnode> sm = src->get_mnode();
+  if (!sm || sm == m || sm->type() != mnode::types::file ||
+      sm->fs_ != root_fs || *m->as_file()->read_size() != 0)
+    return -1;
+
+  if (src->fsync() < 0 || fsync() < 0)
+    return -1;
+  u64 inum;
+  if (!rootfs_interface->inum_lookup(sm->mnum_, &inum) ||
+      !rootfs_interface->inum_lookup(m->mnum_, &inum))
+    return -1;
+
+  // Keep writers out of this file until its pages can be read back.
+  auto resize = m->as_file()->write_size();
+  if (resize.read_size() != 0)
+    return -1;
+
+  int cpu = myid();
+  int r;
+  {
+    auto guard =
+      rootfs_interface->fs_journal[cpu]->commitq_insert_lock.guard();
+    transaction *trans = new transaction();
+    r = rootfs_interface->clone_file(sm->mnum_, m->mnum_, trans);
+    rootfs_interface->add_transaction_to_queue(trans, cpu);
+  }
+  rootfs_interface->flush_transaction_queue(cpu);
+  if (r == 0)
+    resize.reload_from_disk(*sm->as_file()->read_size());
+  return r;
+}
+
+// Store this file's data compressed (or not) from now on. Only an empty file
+// can change, so that all of its chunks are in the same format; if its
+// creation hasn't reached the disk yet, fsync() it first.
+int
+file_mnode::set_compression(bool on)
+{
+  if (!m || !writable || m->type() != mnode::types::file || m->fs_ != root_fs)
+    return -1;
+
+  u64 inum;
+  if (!rootfs_interface->inum_lookup(m->mnum_, &inum)) {
+    fsync();
+    if (!rootfs_interface->inum_lookup(m->mnum_, &inum))
+      return -1;
+  }
+
+  // Keep writers out until the change is on the disk.
+  auto resize = m->as_file()->write_size();
+  if (resize.read_size() != 0)
+    return -1;
+
+  int cpu = myid();
+  int r;
+  {
+    auto guard =
+      rootfs_interface->fs_journal[cpu]->commitq_insert_lock.guard();
+    transaction *trans = new transaction();
+    r = rootfs_interface->set_file_compression(m->mnum_, on, trans);
+    rootfs_interface->add_transaction_to_queue(trans, cpu);
+  }
+  rootfs_interface->flush_transaction_queue(cpu);
+  return r;
+}
+
 int
 file_mnode::stat(struct stat *st, enum stat_flags flags)
+{
+  return stat_mnode(m, st, flags);
+}
+
+int
+stat_mnode(sref<mnode> m, struct stat *st, enum stat_flags flags)
 {
   u8 stattype = 0;
   switch (m->type()) {
@@ -43,7 +339,9 @@ file_mnode::stat(struct stat *st, enum stat_flags flags)
   st->st_mode = stattype << __S_IFMT_SHIFT;
   st->st_dev = (uintptr_t) m->fs_;
   st->st_ino = m->mnum_;
-  if (!(flags & STAT_OMIT_NLINK))
+  if (flags & STAT_APPROX_NLINK)
+    st->st_nlink = m->nlink_.get_approx();
+  else if (!(flags & STAT_OMIT_NLINK))
     st->st_nlink = m->nlink_.get_consistent();
   st->st_size = 0;
   if (m->type() == mnode::types::file)
@@ -114,20 +412,45 @@ file_mnode::write(const char *addr, size_t n)
       return -1;
     }
   } else if (m->type() == mnode::types::file) {
-    l = off_lock.guard();
-    mfile::resizer resize;
     if (append) {
-      resize = m->as_file()->write_size();
-      off = resize.read_size();
+      // Appenders each reserve their own range at the end of the file
+      // and copy into it in parallel, rather than holding the offset
+      // lock and the resizer for the whole write.  A reader may see
+      // zeroes in a range that has been reserved but not yet written.
+      // If the write comes up short, finish it under the resizer, so
+      // that it doesn't race other appenders for the pages it lacks.
+      mfile *mf = m->as_file();
+      u64 pos = mf->reserve_append(n);
+      r = writem(m, addr, pos, n);
+      if (r < (ssize_t)n) {
+        u64 done = r > 0 ? r : 0;
+        mfile::resizer resize = mf->write_size();
+        ssize_t rr = writem(m, addr + done, pos + done, n - done, &resize);
+        if (rr > 0)
+          r = done + rr;
+      }
+      mf->unreserve_append(pos, n, r > 0 ? r : 0);
+      if (r > 0) {
+        {
+          auto ol = off_lock.guard();
+          off = pos + r;
+        }
+        mf->balance_dirty_pages();
+      }
+      return r;
     }
 
-    r = writem(m, addr, off, n, append ? &resize : nullptr);
+    l = off_lock.guard();
+    r = writem(m, addr, off, n);
   } else {
     return -1;
   }
 
-  if (r > 0)
+  if (r > 0) {
     off += r;
+    if (m->type() == mnode::types::file)
+      m->as_file()->balance_dirty_pages();
+  }
   return r;
 }
 
@@ -145,6 +468,183 @@ file_mnode::pread(char *addr, size_t n, off_t off)
   return readm(m, addr, off, n);
 }
 
+ssize_t
+file_mnode::read_user(userptr<void> buf, size_t n)
+{
+  if (!readable)
+    return -1;
+  if (m->type() != mnode::types::file)
+    return file::read_user(buf, n);
+
+  mfile::page_state ps = m->as_file()->get_page(off / PGSIZE);
+  if (!ps.get_page_info())
+    return 0;
+
+  if (ps.is_partial_page() && off >= *m->as_file()->read_size())
+    return 0;
+
+  auto l = off_lock.guard();
+  ssize_t r = readm_user(m, buf, off, n);
+  if (r > 0)
+    off += r;
+  return r;
+}
+
+ssize_t
+file_mnode::pread_user(userptr<void> buf, size_t n, off_t off)
+{
+  if (!readable)
+    return -1;
+  if (m->type() != mnode::types::file)
+    return file::pread_user(buf, n, off);
+  return readm_user(m, buf, off, n);
+}
+
+ssize_t
+file_mnode::readv_user(const struct iovec *iov, int iovcnt, size_t n)
+{
+  if (!readable)
+    return -1;
+  if (m->type() != mnode::types::file)
+    return file::readv_user(iov, iovcnt, n);
+
+  auto l = off_lock.guard();
+  ssize_t r = readm_userv(m, iov, iovcnt, off, n);
+  if (r > 0)
+    off += r;
+  return r;
+}
+
+ssize_t
+file_mnode::preadv_user(const struct iovec *iov, int iovcnt, size_t n,
+                        off_t off)
+{
+  if (!readable)
+    return -1;
+  if (m->type() != mnode::types::file)
+    return file::preadv_user(iov, iovcnt, n, off);
+  return readm_userv(m, iov, iovcnt, off, n);
+}
+
+// Gather iov into m at *pos, or at the end if append, and advance *pos.
+// If that's going to grow the file, take the resizer once for the
+// whole vector rather than for each page past the end.  Appends
+// reserve their range instead, and finish a short one under the
+// resizer, like file_mnode::write().
+static ssize_t
+writev_mfile(sref<mnode> m, const struct iovec *iov, int iovcnt, size_t n,
+             u64 *pos, bool append)
+{
+  ssize_t r;
+  if (append) {
+    mfile *mf = m->as_file();
+    *pos = mf->reserve_append(n);
+    r = writem_userv(m, iov, iovcnt, *pos, n);
+    if (r < (ssize_t)n) {
+      u64 done = r > 0 ? r : 0;
+      mfile::resizer resize = mf->write_size();
+      ssize_t rr = writem_userv(m, iov, iovcnt, *pos + done, n - done,
+                                &resize, done);
+      if (rr > 0)
+        r = done + rr;
+    }
+    mf->unreserve_append(*pos, n, r > 0 ? r : 0);
+  } else {
+    mfile::resizer resize;
+    if (*pos + n > *m->as_file()->read_size())
+      resize = m->as_file()->write_size();
+    r = writem_userv(m, iov, iovcnt, *pos, n, resize ? &resize : nullptr);
+  }
+  if (r > 0) {
+    *pos += r;
+    m->as_file()->balance_dirty_pages();
+  }
+  return r;
+}
+
+ssize_t
+file_mnode::writev_user(const struct iovec *iov, int iovcnt, size_t n)
+{
+  if (!writable)
+    return -1;
+  if (m->type() != mnode::types::file)
+    return file::writev_user(iov, iovcnt, n);
+
+  if (append) {
+    u64 pos;
+    ssize_t r = writev_mfile(m, iov, iovcnt, n, &pos, true);
+    auto l = off_lock.guard();
+    off = pos;
+    return r;
+  }
+
+  auto l = off_lock.guard();
+  u64 pos = off;
+  ssize_t r = writev_mfile(m, iov, iovcnt, n, &pos, false);
+  off = pos;
+  return r;
+}
+
+ssize_t
+file_mnode::pwritev_user(const struct iovec *iov, int iovcnt, size_t n,
+                         off_t off)
+{
+  if (!writable)
+    return -1;
+  if (m->type() != mnode::types::file)
+    return file::pwritev_user(iov, iovcnt, n, off);
+  u64 pos = off;
+  return writev_mfile(m, iov, iovcnt, n, &pos, false);
+}
+
+ssize_t
+file_mnode::sendfile(file *out, off_t *offset, size_t n)
+{
+  if (!readable || m->type() != mnode::types::file)
+    return -1;
+
+  lock_guard<sleeplock> l;
+  u64 pos;
+  if (offset) {
+    pos = *offset;
+  } else {
+    l = off_lock.guard();
+    pos = off;
+  }
+
+  // Hand the page-cache pages to out directly, rather than copying
+  // them to a buffer first.  A pipe keeps a reference to them.
+  size_t done = 0;
+  while (done < n) {
+    u64 size = *m->as_file()->read_size();
+    if (pos >= size)
+      break;
+    sref<page_info> pi = m->as_file()->get_page(pos / PGSIZE).get_page_info();
+    if (!pi)
+      break;
+    u64 pgoff = pos % PGSIZE;
+    u64 len = MIN(MIN(PGSIZE - pgoff, n - done), size - pos);
+    // The last piece goes out without more, so that a socket pushes it.
+    bool more = done + len < n && pos + len < size;
+    ssize_t r = out->write_page(pi, pgoff, len, more);
+    if (r <= 0) {
+      if (!done)
+        return -1;
+      break;
+    }
+    done += r;
+    pos += r;
+    if ((u64)r < len)
+      break;
+  }
+
+  if (offset)
+    *offset = pos;
+  else
+    off = pos;
+  return done;
+}
+
 ssize_t
 file_mnode::pwrite(const char *addr, size_t n, off_t off)
 {
@@ -156,7 +656,10 @@ file_mnode::pwrite(const char *addr, size_t n, off_t off)
       return -1;
     return devsw[major].pwrite(m->as_dev(), addr, off, n);
   }
-  return writem(m, addr, off, n);
+  ssize_t r = writem(m, addr, off, n);
+  if (r > 0 && m->type() == mnode::types::file)
+    m->as_file()->balance_dirty_pages();
+  return r;
 }
 
 
@@ -177,6 +680,20 @@ file_pipe_reader::read(char *addr, size_t n)
   return piperead(pipe, addr, n);
 }
 
+ssize_t
+file_pipe_reader::sendfile(file *out, off_t *offset, size_t n)
+{
+  if (offset)
+    return -1;
+  return pipesplice(pipe, out, n);
+}
+
+poll_source *
+file_pipe_reader::get_poll_source()
+{
+  return pipepollsrc(pipe, false);
+}
+
 void
 file_pipe_reader::onzero(void)
 {
@@ -202,6 +719,19 @@ file_pipe_writer::write(const char *addr, size_t n)
   return pipewrite(pipe, addr, n);
 }
 
+ssize_t
+file_pipe_writer::write_page(const sref<page_info> &page, size_t off,
+                             size_t len, bool more)
+{
+  return pipewrite_page(pipe, page, off, len);
+}
+
+poll_source *
+file_pipe_writer::get_poll_source()
+{
+  return pipepollsrc(pipe, true);
+}
+
 void
 file_pipe_writer::onzero(void)
 {
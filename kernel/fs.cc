@@ -4,7 +4,8 @@
 //   + Directories: inode with special contents (list of other inodes!)
 //   + Names: paths like /usr/rtm/xv6/fs.c for convenient naming.
 //
-// Disk layout is: superblock, inodes, block in-use bitmap, data blocks.
+// Disk layout is: superblock, inodes, block in-use bitmap, block refcounts
+// (with SB_FEATURE_REFCOUNTS), data blocks.
 //
 // This file contains the low-level file system manipulation
 // routines.  The (higher-level) system call implementations
@@ -40,6 +41,10 @@
 #include "dirns.hh"
 #include "kstream.hh"
 #include "scalefs.hh"
+#include "kworker.hh"
+#include "zlib-compress.hh"
+#include "zlib-decompress.hh"
+#include <algorithm>
 
 #define BLOCKROUNDUP(off) (((off)%BSIZE) ? (off)/BSIZE+1 : (off)/BSIZE)
 
@@ -51,6 +56,19 @@ static struct freeinum_bitmap freeinum_bitmap;
 static sref<inode> the_root;
 static struct superblock sb_root;
 
+// Whether sb_root.summary describes the disk as it was at mount, and which
+// of its inode groups have had inodes allocated or freed since.
+static bool summary_clean;
+static std::atomic<bool> igroup_changed[SB_NGROUPS];
+
+static void
+mark_igroup_changed(u32 inum)
+{
+  u32 g = inum / (SB_IGROUP_BLKS(sb_root.ninodes) * IPB);
+  if (!igroup_changed[g].load(std::memory_order_relaxed))
+    igroup_changed[g].store(true, std::memory_order_relaxed);
+}
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -66,6 +84,35 @@ get_superblock(struct superblock *sb)
   sb->size = sb_root.size;
   sb->ninodes = sb_root.ninodes;
   sb->nblocks = sb_root.nblocks;
+  sb->features = sb_root.features;
+  sb->layout = sb_root.layout;
+}
+
+// Returns the free block counts of the allocation summary, or null if the
+// summary wasn't written by a clean shutdown.
+const u32 *
+get_bfree_summary(void)
+{
+  return summary_clean ? sb_root.summary.bfree : nullptr;
+}
+
+// Write out s as the allocation summary in the superblock on the disk.
+static void
+write_summary(const superblock::alloc_summary &s)
+{
+  sref<buf> bp = buf::get(ROOTDEV, 1);
+  {
+    auto locked = bp->write();
+    ((superblock*)locked->data)->summary = s;
+  }
+  bp->writeback();
+}
+
+// Returns true if the inodes of the root filesystem are extent-mapped.
+static inline bool
+extent_mapped()
+{
+  return sb_root.features & SB_FEATURE_EXTENTS;
 }
 
 // Zero the in-memory buffer-cache block corresponding to a disk block.
@@ -125,6 +172,144 @@ balloc(u32 dev, transaction *trans = NULL, bool zero_on_alloc = false)
   return 0;
 }
 
+// Allocate a data block for ip, taking it from the blocks reserved by
+// inode_reserve_blocks() if there are any left, so that consecutive file
+// blocks land on consecutive disk blocks. The caller must hold ilock().
+static u32
+balloc_data(sref<inode> ip, transaction *trans, bool zero_on_alloc)
+{
+  if (!ip->resv_len && ip->resv_pending) {
+    ip->resv_len = rootfs_interface->alloc_blocks(ip->resv_pending,
+                                                  &ip->resv_start);
+    ip->resv_pending -= ip->resv_len;
+  }
+
+  if (!ip->resv_len)
+    return balloc(ip->dev, trans, zero_on_alloc);
+
+  u32 b = ip->resv_start++;
+  ip->resv_len--;
+  if (trans)
+    trans->add_allocated_block(b);
+  if (zero_on_alloc)
+    bzero(ip->dev, b);
+  return b;
+}
+
+// Data blocks shared between files by iclone(). Each block has one byte on
+// the disk counting its references beyond the first; block_refs mirrors
+// those counts, a refcount block at a time, as they are first needed. The
+// in-memory counts change as references are taken and dropped, and the
+// transaction doing so carries the change over to the disk when it is
+// queued (see block_refs_on_disk()), the way the free bitmap is updated.
+static std::atomic<u8> *block_refs;
+static std::atomic<bool> *refblock_loaded;
+static sleeplock refblock_load_lock;
+
+static void
+init_block_refs(void)
+{
+  if (!(sb_root.features & SB_FEATURE_REFCOUNTS))
+    return;
+
+  u32 nrefblocks = (sb_root.size + RPB - 1) / RPB;
+  block_refs = (std::atomic<u8>*) kmalloc(sb_root.size, "block_refs");
+  refblock_loaded = (std::atomic<bool>*)
+    kmalloc(nrefblocks * sizeof(std::atomic<bool>), "refblock_loaded");
+  if (!block_refs || !refblock_loaded)
+    panic("init_block_refs: out of memory");
+  for (u32 rb = 0; rb < nrefblocks; rb++)
+    refblock_loaded[rb].store(false, std::memory_order_relaxed);
+}
+
+// Returns the in-memory refcount of block b, reading in its refcount block
+// if need be. The on-disk counts of a refcount block only change after its
+// in-memory ones have been read, so they can't change under us here.
+static std::atomic<u8> &
+block_ref(u32 b)
+{
+  u32 rb = b / RPB;
+  if (!refblock_loaded[rb].load(std::memory_order_acquire)) {
+    auto l = refblock_load_lock.guard();
+    if (!refblock_loaded[rb].load(std::memory_order_relaxed)) {
+      sref<buf> bp = buf::get(ROOTDEV, RBLOCK(b, sb_root.ninodes,
+                                              sb_root.size));
+      auto copy = bp->read();
+      u32 end = std::min(sb_root.size, (rb + 1) * RPB);
+      for (u32 i = rb * RPB; i < end; i++)
+        block_refs[i].store(copy->data[i % RPB], std::memory_order_relaxed);
+      refblock_loaded[rb].store(true, std::memory_order_release);
+    }
+  }
+  return block_refs[b];
+}
+
+// Returns true if block b is shared with another file.
+static bool
+block_shared(u32 b)
+{
+  return block_refs && block_ref(b).load(std::memory_order_relaxed);
+}
+
+// Take another reference to block b, in trans. Returns false if b already
+// has as many as its count can hold.
+static bool
+share_block(u32 b, transaction *trans)
+{
+  std::atomic<u8> &r = block_ref(b);
+  u8 v = r.load(std::memory_order_relaxed);
+  do {
+    if (v == 0xff)
+      return false;
+  } while (!r.compare_exchange_weak(v, v + 1));
+  trans->add_block_ref(b);
+  return true;
+}
+
+// Drop a reference to block b in trans, if it is shared. Returns false if
+// it isn't, in which case the caller's reference is the last one and the
+// block is the caller's to free.
+static bool
+drop_block_ref(u32 b, transaction *trans)
+{
+  if (!block_refs)
+    return false;
+  std::atomic<u8> &r = block_ref(b);
+  u8 v = r.load(std::memory_order_relaxed);
+  do {
+    if (v == 0)
+      return false;
+  } while (!r.compare_exchange_weak(v, v - 1));
+  if (!trans)
+    panic("drop_block_ref: shared block %u freed outside a transaction", b);
+  trans->add_block_unref(b);
+  return true;
+}
+
+// Add delta to the on-disk refcounts of blocks, as part of trans. The caller
+// must provide a sorted block list, and hold the locks of their refcount
+// blocks in trans.
+void
+block_refs_on_disk(const u32 *blocks, size_t nblocks, transaction *trans,
+                   int delta)
+{
+  const u32 *end = blocks + nblocks;
+
+  while (blocks != end) {
+    u32 rblock = RBLOCK(*blocks, sb_root.ninodes, sb_root.size);
+    sref<buf> bp = buf::get(ROOTDEV, rblock);
+    auto locked = bp->write();
+    do {
+      u8 *r = (u8 *)&locked->data[*blocks % RPB];
+      if ((delta < 0 && *r == 0) || (delta > 0 && *r == 0xff))
+        panic("block_refs_on_disk: bad refcount %u for block %u", *r, *blocks);
+      *r += delta;
+    } while (++blocks != end &&
+             RBLOCK(*blocks, sb_root.ninodes, sb_root.size) == rblock);
+    bp->add_to_transaction(trans);
+  }
+}
+
 // Free a disk block. We never zero out blocks during free (we do that only
 // during allocation, if desired).
 //
@@ -141,6 +326,10 @@ bfree(int dev, u64 x, transaction *trans = NULL, bool delayed_free = false)
   u32 b = x;
 
   if (dev == 1) {
+    // A shared block only loses a reference.
+    if (drop_block_ref(b, trans))
+      return;
+    rootfs_interface->populate_home_freelist(b);
     if (!delayed_free)
       rootfs_interface->free_block(b);
     if (trans)
@@ -153,11 +342,14 @@ bfree(int dev, u64 x, transaction *trans = NULL, bool delayed_free = false)
 // Allocate if @alloc == true, free otherwise.
 // The caller must provide a sorted block list.
 void
-balloc_free_on_disk(std::vector<u32>& blocks, transaction *trans, bool alloc)
+balloc_free_on_disk(const u32 *blocks, size_t nblocks, transaction *trans,
+                    bool alloc)
 {
+  const u32 *end = blocks + nblocks;
+
   // Aggregate all updates to the same free bitmap block and write it out
   // just once, using a single transaction_diskblock.
-  for (auto bno = blocks.begin(); bno != blocks.end(); ) {
+  for (auto bno = blocks; bno != end; ) {
     u32 blocknum = BBLOCK(*bno, sb_root.ninodes);
     sref<buf> bp = buf::get(1, blocknum);
     auto locked = bp->write();
@@ -178,7 +370,7 @@ balloc_free_on_disk(std::vector<u32>& blocks, transaction *trans, bool alloc)
           panic("balloc_free_on_disk: block %d already free", *bno);
         locked->data[bi/8] &= ~m;
       }
-    } while (++bno && bno != blocks.end() && *bno <= max_bno);
+    } while (++bno != end && *bno <= max_bno);
 
     bp->add_to_transaction(trans);
   }
@@ -216,47 +408,223 @@ balloc_free_on_disk(std::vector<u32>& blocks, transaction *trans, bool alloc)
 // A non-zero ip->ref keeps these unlocked inodes in the cache.
 
 
-// Initialize the freeinum_bitmap from the disk when the system boots.
+static struct freeinum_bitmap::freelist &
+inum_freelist(int cpu)
+{
+  return cpu < NCPU ? freeinum_bitmap.freelists[cpu]
+                    : freeinum_bitmap.reserve_freelist;
+}
+
+// Mark the inums in bits of word w of the bitmap free. The caller must hold
+// the list_lock of fl, which owns the word.
 static void
-initialize_freeinum_bitmap(void)
+add_free_bits(struct freeinum_bitmap::freelist &fl, u32 w, u64 bits)
 {
-  sref<buf> bp;
-  superblock sb;
-  int ninums;
-  u32 first_free_inodeblock_inum = 0;
+  u64 old = freeinum_bitmap.free_bits[w];
+  if (!bits)
+    return;
+  if (!old) {
+    fl.summary[w / 64] |= 1ull << (w % 64);
+    if (w / 64 < fl.hint)
+      fl.hint = w / 64;
+  }
+  freeinum_bitmap.free_bits[w] = old | bits;
+  fl.nfree += popcnt64(bits & ~old);
+}
 
-  get_superblock(&sb);
+// Mark the inums in bits of word w of the bitmap allocated. The caller must
+// hold the list_lock of fl, which owns the word.
+static void
+remove_free_bits(struct freeinum_bitmap::freelist &fl, u32 w, u64 bits)
+{
+  u64 old = freeinum_bitmap.free_bits[w];
+  freeinum_bitmap.free_bits[w] = old & ~bits;
+  if (old && !(old & ~bits))
+    fl.summary[w / 64] &= ~(1ull << (w % 64));
+  fl.nfree -= popcnt64(bits & old);
+}
+
+// Returns the lowest (or the highest) word of the bitmap that fl owns and
+// that has free inums, or -1 if there is none. The caller must hold
+// fl.list_lock.
+static int
+find_free_word(struct freeinum_bitmap::freelist &fl, bool highest)
+{
+  if (!highest) {
+    for (; fl.hint < freeinum_bitmap.nsummary; fl.hint++)
+      if (fl.summary[fl.hint])
+        return fl.hint * 64 + __builtin_ctzll(fl.summary[fl.hint]);
+    return -1;
+  }
 
-  // Allocate the memory for the inum_vector in one shot, instead of doing it
-  // piecemeal using .push_back() in a loop.
-  freeinum_bitmap.inum_vector.reserve(sb.ninodes);
+  for (u32 s = freeinum_bitmap.nsummary; s-- > fl.hint; )
+    if (fl.summary[s])
+      return s * 64 + 63 - __builtin_clzll(fl.summary[s]);
+  return -1;
+}
 
-  for (u32 inum = 0; inum < sb.ninodes; inum += IPB) {
-    bp = buf::get(1, IBLOCK(inum));
-    auto copy = bp->read();
+// Allocate the lowest (or the highest) free inum that fl owns. Returns 0 if
+// there is none. The caller must hold fl.list_lock.
+static u32
+take_free_inum(struct freeinum_bitmap::freelist &fl, bool highest)
+{
+  int w = find_free_word(fl, highest);
+  if (w < 0)
+    return 0;
+
+  u64 word = freeinum_bitmap.free_bits[w];
+  u32 bit = highest ? 63 - __builtin_clzll(word) : __builtin_ctzll(word);
+  remove_free_bits(fl, w, 1ull << bit);
+  return w * 64 + bit;
+}
+
+// Whether the allocation summary says the inode block holding inum is
+// entirely in use (0), entirely free (1), or may well be neither (-1).
+static int
+inode_group_state(u32 inum)
+{
+  if (!summary_clean)
+    return -1;
+
+  u32 igroup = SB_IGROUP_BLKS(sb_root.ninodes) * IPB;
+  u32 g = inum / igroup;
+  u32 ngroup = std::min(sb_root.ninodes, (g+1) * igroup) - g * igroup;
+  if (sb_root.summary.ifree[g] == 0)
+    return 0;
+  if (sb_root.summary.ifree[g] == ngroup)
+    return 1;
+  return -1;
+}
+
+// Mark the free inums among [start, end), which begins an inode block, free
+// in the bitmap, on behalf of fl, which owns them.
+static void
+scan_inums(struct freeinum_bitmap::freelist &fl, u32 start, u32 end)
+{
+  if (start >= end)
+    return;
+
+  buf_scanner scan(ROOTDEV, IBLOCK(end - 1) + 1);
+
+  for (u32 inum = start; inum < end; inum += 64) {
+    u32 ninums = std::min((u32)64, end - inum);
+    int state = inode_group_state(inum);
+    u64 bits = 0;
+
+    if (state < 0) {
+      sref<buf> bp = scan.get(IBLOCK(inum));
+      auto copy = bp->read();
+      const dinode *dip = (const struct dinode*)copy->data + inum % IPB;
+      for (u32 i = 0; i < ninums; i++)
+        if (!dip[i].type)
+          bits |= 1ull << i;
+    } else if (state) {
+      bits = ninums == 64 ? ~0ull : (1ull << ninums) - 1;
+    }
+
+    if (!inum)
+      bits &= ~1ull; // inum 0 is not used, so never hand it out.
 
-    ninums = std::min((u32)IPB, sb.ninodes - inum);
+    auto list_lock = fl.list_lock.guard();
+    add_free_bits(fl, inum / 64, bits);
+  }
+}
+
+// Fill in cpu's freelist (the reserve pool's, if cpu is NCPU) from the inode
+// blocks it owns, unless that has been done already. This has to happen
+// before any of its inums is allocated or freed.
+static void
+populate_inum_freelist(int cpu)
+{
+  auto &fl = inum_freelist(cpu);
+  if (fl.populated.load(std::memory_order_acquire))
+    return;
+
+  scoped_gc_epoch e;
+  auto populate_lock = fl.populate_lock.guard();
+  if (fl.populated.load(std::memory_order_relaxed))
+    return;
+
+  u32 base = freeinum_bitmap.cpu_base;
+  u32 inums_per_cpu = freeinum_bitmap.inums_per_cpu;
+  if (cpu < NCPU) {
+    scan_inums(fl, base + cpu * inums_per_cpu, base + (cpu+1) * inums_per_cpu);
+  } else {
+    scan_inums(fl, 0, base);
+    scan_inums(fl, base + NCPU * inums_per_cpu, freeinum_bitmap.ninodes);
+  }
+  fl.populated.store(true, std::memory_order_release);
+}
+
+// Initialize the freeinum_bitmap from the disk when the system boots. Only
+// the split of the inums among the CPUs is decided here; each CPU's freelist
+// is then filled in by a kworker on that CPU, in parallel once the other
+// CPUs are up, or by whoever needs it first.
+static void
+initialize_freeinum_bitmap(void)
+{
+  superblock sb;
+  u32 first_free_inodeblock_inum = 0;
 
-    for (int i = 0; i < ninums; i++) {
-      const dinode *dip = (const struct dinode*)copy->data + (inum + i)%IPB;
+  static_assert(IPB % 64 == 0, "Bitmap words straddle inode blocks");
 
-      // Maintain a vector as well as a linked-list representation of the free
-      // inums, to speed up freeing and allocation of blocks, respectively.
-      free_inum *finum = new free_inum(inum + i, !dip->type);
-      freeinum_bitmap.inum_vector.push_back(finum);
+  get_superblock(&sb);
+
+  // Every CPU falls back to the reserve pool, so queue its waiters.
+  freeinum_bitmap.reserve_freelist.list_lock =
+    spinlock("inum reserve", LOCKSTAT_FS, true);
+
+  // The bitmap starts out with every inum in use; filling in a freelist
+  // marks its free inums free.
+  u32 nwords = (sb.ninodes + 63) / 64;
+  u32 nsummary = (nwords + 63) / 64;
+  freeinum_bitmap.nwords = nwords;
+  freeinum_bitmap.nsummary = nsummary;
+  freeinum_bitmap.free_bits = (u64*) kmalloc(nwords * sizeof(u64), "free_bits");
+  freeinum_bitmap.word_owner =
+    (std::atomic<u16>*) kmalloc(nwords * sizeof(std::atomic<u16>), "word_owner");
+  if (!freeinum_bitmap.free_bits || !freeinum_bitmap.word_owner)
+    panic("initialize_freeinum_bitmap: out of memory");
+  memset(freeinum_bitmap.free_bits, 0, nwords * sizeof(u64));
+  for (int cpu = 0; cpu <= NCPU; cpu++) {
+    auto &fl = inum_freelist(cpu);
+    fl.summary = (u64*) kmalloc(nsummary * sizeof(u64), "inum summary");
+    if (!fl.summary)
+      panic("initialize_freeinum_bitmap: out of memory");
+    memset(fl.summary, 0, nsummary * sizeof(u64));
+  }
 
-      // Make note of the first inode block (inum) that starts with a free inum
-      // (which is an approximation that, that entire inode block (and all
-      // the subsequent ones) contains only free inums). That's where we'll
-      // start allocating per-CPU resources from (further down in the code),
-      // in order to avoid initializing CPU0 with nearly no free inums.
-      if (!first_free_inodeblock_inum && !dip->type && i == 0)
-        first_free_inodeblock_inum = inum;
+  // Find the first inode block (inum) that starts with a free inum (which is
+  // an approximation that, that entire inode block (and all the subsequent
+  // ones) contains only free inums). That's where we'll start allocating
+  // per-CPU resources from, in order to avoid initializing CPU0 with nearly
+  // no free inums. The allocation summary lets us skip over the groups that
+  // are entirely in use.
+  {
+    scoped_gc_epoch e;
+    u32 igroup = SB_IGROUP_BLKS(sb.ninodes) * IPB;
+    buf_scanner scan(ROOTDEV, IBLOCK(sb.ninodes - 1) + 1);
+
+    for (u32 inum = IPB; inum < sb.ninodes; inum += IPB) {
+      int state = inode_group_state(inum);
+      if (state == 0) {
+        inum = (inum / igroup + 1) * igroup - IPB;
+        continue;
+      }
+      if (state < 0) {
+        sref<buf> bp = scan.get(IBLOCK(inum));
+        auto copy = bp->read();
+        if (((const struct dinode*)copy->data)->type)
+          continue;
+      }
+      first_free_inodeblock_inum = inum;
+      break;
     }
   }
 
-  // Distribute the inums among the CPUs and add the free inums to the per-CPU
-  // freelists.
+  // Distribute the inums among the CPUs. Whatever is left over at either end
+  // forms a global reserve pool of free inums, to be used when a per-CPU
+  // freelist runs out, before stealing free inums from other CPUs' freelists.
 
   // TODO: Remove this assert and handle cases where multiple CPUs have to share
   // the same inode blocks.
@@ -264,58 +632,56 @@ initialize_freeinum_bitmap(void)
 
   u32 ninodeblocks = sb.ninodes/IPB - first_free_inodeblock_inum/IPB;
   u32 inodeblocks_per_cpu = ninodeblocks/NCPU;
-  u32 inums_per_cpu = inodeblocks_per_cpu * IPB;
 
-  for (int cpu = 0; cpu < NCPU; cpu++) {
-    auto list_lock = freeinum_bitmap.freelists[cpu].list_lock.guard();
+  freeinum_bitmap.ninodes = sb.ninodes;
+  freeinum_bitmap.cpu_base = first_free_inodeblock_inum;
+  freeinum_bitmap.inums_per_cpu = inodeblocks_per_cpu * IPB;
+
+  for (u32 w = 0; w < nwords; w++)
+    freeinum_bitmap.word_owner[w].store(freeinum_bitmap.home_cpu(w * 64),
+                                        std::memory_order_relaxed);
 
-    if (VERBOSE)
+  if (VERBOSE) {
+    for (int cpu = 0; cpu < NCPU; cpu++)
       cprintf("Per-CPU inode allocator: CPU %d   inodes [%u - %u]\n",
-              cpu, first_free_inodeblock_inum + cpu * inums_per_cpu,
-              first_free_inodeblock_inum + ((cpu+1) * inums_per_cpu) - 1);
-
-    for (u32 inum = cpu * inums_per_cpu; inum < (cpu+1) * inums_per_cpu; inum++) {
-      if (!inum)
-        continue; // inum 0 is not used, so don't add it to any freelist.
-
-      auto finum = freeinum_bitmap.inum_vector.at(inum +
-                                                  first_free_inodeblock_inum);
-      finum->cpu = cpu;
-      if (finum->is_free)
-        freeinum_bitmap.freelists[cpu].inum_freelist.push_back(finum);
-    }
+              cpu, first_free_inodeblock_inum +
+              cpu * freeinum_bitmap.inums_per_cpu,
+              first_free_inodeblock_inum +
+              (cpu+1) * freeinum_bitmap.inums_per_cpu - 1);
   }
 
-  // Build a global reserve pool of free inums using whatever is remaining,
-  // to be used when a per-CPU freelist runs out, before stealing free inums
-  // from other CPUs' freelists.
-  if (NCPU * inodeblocks_per_cpu < ninodeblocks) {
-    auto list_lock = freeinum_bitmap.reserve_freelist.list_lock.guard();
-    for (u32 inum = NCPU * inums_per_cpu;
-         inum + first_free_inodeblock_inum < sb.ninodes; inum++) {
-      if (!inum)
-        continue; // inum 0 is not used, so don't add it to any freelist.
-
-      auto finum = freeinum_bitmap.inum_vector.at(inum +
-                                                  first_free_inodeblock_inum);
-      finum->cpu = NCPU; // Invalid CPU number to denote reserve pool.
-      if (finum->is_free)
-        freeinum_bitmap.reserve_freelist.inum_freelist.push_back(finum);
-    }
-  }
+  for (int cpu = 0; cpu < NCPU; cpu++)
+    kwork_submit([cpu]() { populate_inum_freelist(cpu); }, cpu % ncpu);
+  kwork_submit([]() { populate_inum_freelist(NCPU); }, 0);
+}
 
-  // Any other leftover free inums from [1 to first_free_inodeblock_inum) also
-  // go to the reserve pool. Also make sure to set the CPU number for those
-  // free-inums irrespective of whether they are free.
-  {
-    auto list_lock = freeinum_bitmap.reserve_freelist.list_lock.guard();
-    for (u32 inum = 1; inum < first_free_inodeblock_inum; inum++) {
-      auto finum = freeinum_bitmap.inum_vector.at(inum);
-      finum->cpu = NCPU; // Invalid CPU number to denote reserve pool.
-      if (finum->is_free)
-        freeinum_bitmap.reserve_freelist.inum_freelist.push_back(finum);
-    }
-  }
+// Move the lowest inode block with free inums in the global reserve pool to
+// cpu's freelist, for good: when they are freed, they go back to cpu. Inodes
+// that are allocated together are then updated together, by the cpu that
+// allocated them, instead of every CPU that runs dry of inums competing for
+// the inode-block locks at the head of the reserve pool. Returns one of the
+// inums, already allocated, or 0 if the reserve pool is empty.
+static u32
+adopt_reserve_inums(int cpu)
+{
+  auto &reserve = freeinum_bitmap.reserve_freelist;
+  auto &fl = freeinum_bitmap.freelists[cpu];
+
+  populate_inum_freelist(NCPU);
+  if (!reserve.nfree)
+    return 0;
+
+  auto reserve_lock = reserve.list_lock.guard();
+  int w = find_free_word(reserve, false);
+  if (w < 0)
+    return 0;
+
+  auto list_lock = fl.list_lock.guard();
+  u64 bits = freeinum_bitmap.free_bits[w];
+  remove_free_bits(reserve, w, bits);
+  freeinum_bitmap.word_owner[w].store(cpu, std::memory_order_relaxed);
+  add_free_bits(fl, w, bits);
+  return take_free_inum(fl, false);
 }
 
 // Allocate an inode number from the freeinum_bitmap.
@@ -326,21 +692,12 @@ alloc_inode_number(void)
   int cpu = myid();
   static bool warned_once = false;
 
-  // Use the linked-list representation of the free-inums to perform inum
-  // allocation in O(1) time. This list only contains the inums that are
-  // actually free, so we can allocate any one of them.
-
+  populate_inum_freelist(cpu);
   {
-    auto list_lock = freeinum_bitmap.freelists[cpu].list_lock.guard();
-
-    if (!freeinum_bitmap.freelists[cpu].inum_freelist.empty()) {
-      auto it = freeinum_bitmap.freelists[cpu].inum_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      inum = it->inum_;
-      freeinum_bitmap.freelists[cpu].inum_freelist.erase(it);
+    auto &fl = freeinum_bitmap.freelists[cpu];
+    auto list_lock = fl.list_lock.guard();
+    if ((inum = take_free_inum(fl, false)))
       return inum;
-    }
   }
 
   // If we run out of inums in our local CPU's freelist, tap into the global
@@ -352,46 +709,27 @@ alloc_inode_number(void)
     warned_once = true;
   }
 
-  // TODO: Allocate from the reserve pool in bulk in order to reduce the
-  // chances of contention even further.
-  {
-    if (freeinum_bitmap.reserve_freelist.inum_freelist.empty())
-      goto try_neighbor;
-
-    auto list_lock = freeinum_bitmap.reserve_freelist.list_lock.guard();
-
-    if (!freeinum_bitmap.reserve_freelist.inum_freelist.empty()) {
-      auto it = freeinum_bitmap.reserve_freelist.inum_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      inum = it->inum_;
-      freeinum_bitmap.reserve_freelist.inum_freelist.erase(it);
-      return inum;
-    }
-  }
+  if ((inum = adopt_reserve_inums(cpu)))
+    return inum;
 
   // We failed to allocate even from the reserve pool. So steal free inums
   // from other CPUs. Each CPU starts its fallback-search at a different
-  // point, in order to avoid hotspots. Note that these inums are only
+  // point, in order to avoid hotspots. We take them from the far end of the
+  // other CPU's freelist, which it allocates from last, so that we don't end
+  // up in the same inode blocks as that CPU. Note that these inums are only
   // borrowed temporarily and are prompty returned to the original CPU's
   // freelists upon being freed.
-try_neighbor:
   for (int fallback_cpu = cpu + 1; fallback_cpu % NCPU != cpu; fallback_cpu++) {
     int fcpu = fallback_cpu % NCPU;
+    auto &fl = freeinum_bitmap.freelists[fcpu];
 
-    if (freeinum_bitmap.freelists[fcpu].inum_freelist.empty())
+    populate_inum_freelist(fcpu);
+    if (!fl.nfree)
       continue;
 
-    auto list_lock = freeinum_bitmap.freelists[fcpu].list_lock.guard();
-
-    if (!freeinum_bitmap.freelists[fcpu].inum_freelist.empty()) {
-      auto it = freeinum_bitmap.freelists[fcpu].inum_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      inum = it->inum_;
-      freeinum_bitmap.freelists[fcpu].inum_freelist.erase(it);
+    auto list_lock = fl.list_lock.guard();
+    if ((inum = take_free_inum(fl, true)))
       return inum;
-    }
   }
 
   panic("alloc_inum(): Out of inums on CPU %d\n", cpu);
@@ -402,22 +740,21 @@ try_neighbor:
 void
 free_inode_number(u32 inum)
 {
-  // Use the vector representation of the free-inums to free the inum in
-  // O(1) time (by optimizing the blocknumber-to-free_inum lookup).
-  free_inum *finum = freeinum_bitmap.inum_vector.at(inum);
+  u32 w = inum / 64;
 
-  int cpu = finum->cpu;
-  if (cpu < NCPU) {
-    auto list_lock = freeinum_bitmap.freelists[cpu].list_lock.guard();
-    assert(!finum->is_free);
-    finum->is_free = true;
-    freeinum_bitmap.freelists[cpu].inum_freelist.push_front(finum);
-  } else {
-    // This inum belongs to the global reserve pool.
-    auto list_lock = freeinum_bitmap.reserve_freelist.list_lock.guard();
-    assert(!finum->is_free);
-    finum->is_free = true;
-    freeinum_bitmap.reserve_freelist.inum_freelist.push_front(finum);
+  // The inum goes back to the freelist that owns its word, which only
+  // changes when the reserve pool hands the word to a CPU.
+  for (;;) {
+    int owner = freeinum_bitmap.word_owner[w].load(std::memory_order_relaxed);
+    auto &fl = inum_freelist(owner);
+    assert(fl.populated);  // See free_inode().
+
+    auto list_lock = fl.list_lock.guard();
+    if (freeinum_bitmap.word_owner[w].load(std::memory_order_relaxed) != owner)
+      continue;
+    assert(!(freeinum_bitmap.free_bits[w] & (1ull << (inum % 64))));
+    add_free_bits(fl, w, 1ull << (inum % 64));
+    return;
   }
 }
 
@@ -428,6 +765,17 @@ initinode_early(void)
   scoped_gc_epoch e;
 
   readsb(ROOTDEV, &sb_root); // Initialize sb_root by reading the superblock.
+  disk_set_layout(&sb_root);
+
+  // The allocation summary stops describing the disk once it changes, so
+  // invalidate it on the disk before anything (crash-recovery included)
+  // gets a chance to change it. unmount_rootfs() writes it back.
+  summary_clean = sb_root.summary.clean;
+  if (summary_clean) {
+    superblock::alloc_summary s = sb_root.summary;
+    s.clean = 0;
+    write_summary(s);
+  }
   ins = new chainhash<pair<u32, u32>, inode*>(NINODES_PRIME);
 
   the_root = inode::alloc(ROOTDEV, ROOTINO);
@@ -445,6 +793,57 @@ initinode_late(void)
   // most up-to-date state.
   the_root->init();
   initialize_freeinum_bitmap();
+  init_block_refs();
+}
+
+// Sync the file system and write out its allocation summary, so that the
+// next boot doesn't have to read the inode and bitmap groups that are
+// entirely free or entirely in use. Called when halting, once nothing else
+// is changing the file system.
+void
+unmount_rootfs(void)
+{
+  scoped_gc_epoch e;
+  superblock::alloc_summary s;
+  u32 igroup = SB_IGROUP_BLKS(sb_root.ninodes) * IPB;
+  u32 bgroup = SB_BGROUP_BLKS(sb_root.size) * BPB;
+
+  rootfs_interface->process_metadata_log_and_flush(myid());
+
+  // The counts of the inode groups that haven't changed since mount still
+  // hold, if they did then.
+  buf_scanner iscan(ROOTDEV, IBLOCK(sb_root.ninodes - 1) + 1);
+  for (u32 g = 0; g < SB_NGROUPS; g++) {
+    u32 start = g * igroup, end = std::min(sb_root.ninodes, (g+1) * igroup);
+    s.ifree[g] = 0;
+    if (summary_clean && !igroup_changed[g]) {
+      s.ifree[g] = sb_root.summary.ifree[g];
+      continue;
+    }
+    for (u32 inum = start; inum < end; inum += IPB) {
+      sref<buf> bp = iscan.get(IBLOCK(inum));
+      auto copy = bp->read();
+      for (u32 i = 0; i < std::min((u32)IPB, end - inum); i++)
+        if (!((const struct dinode*)copy->data + i)->type)
+          s.ifree[g]++;
+    }
+  }
+
+  buf_scanner bscan(ROOTDEV, BBLOCK(sb_root.size - 1, sb_root.ninodes) + 1);
+  for (u32 g = 0; g < SB_NGROUPS; g++) {
+    u32 start = g * bgroup, end = std::min(sb_root.size, (g+1) * bgroup);
+    s.bfree[g] = 0;
+    for (u32 b = start; b < end; b += BPB) {
+      sref<buf> bp = bscan.get(BBLOCK(b, sb_root.ninodes));
+      auto copy = bp->read();
+      for (u32 bi = 0; bi < std::min((u32)BPB, end - b); bi++)
+        if (!(copy->data[bi/8] & (1 << (bi % 8))))
+          s.bfree[g]++;
+    }
+  }
+
+  s.clean = 1;
+  write_summary(s);
 }
 
 // Returns an inode locked for write, on success.
@@ -457,7 +856,8 @@ try_ialloc(u32 inum, u32 dev, short type)
 
   ilock(ip, WRITELOCK);
   ip->gen += 1;
-  if (ip->nlink() || ip->size || ip->addrs[0])
+  if (ip->nlink() || ip->size ||
+      ip->addrs[extent_mapped() ? EXTENT_COUNT : 0])
     panic("try_ialloc: inode not zeroed\n");
   return ip;
 }
@@ -470,8 +870,11 @@ ialloc(u32 dev, short type)
   scoped_gc_epoch e;
   sref<inode> ip;
 
-  u32 inum = alloc_inode_number();
-  if (inum) {
+  // An inum can only turn out to be in use if the allocation summary was
+  // wrong about its group, in which case we just leave it allocated.
+  u32 inum;
+  while ((inum = alloc_inode_number())) {
+    mark_igroup_changed(inum);
     ip = try_ialloc(inum, dev, type);
     if (ip)
       return ip;
@@ -488,6 +891,10 @@ free_inode(sref<inode> ip, transaction *tr)
   assert(ip->nlink() == 0);
   // Postpone reusing this inode number until transaction commit.
   tr->add_free_inum(ip->inum);
+  // The inum's freelist has to be filled in before the inode is released,
+  // or it would be found free (and added to the freelist) twice.
+  populate_inum_freelist(freeinum_bitmap.home_cpu(ip->inum));
+  mark_igroup_changed(ip->inum);
   // Release the inode on the disk.
   ip->type = 0;
   iupdate(ip, tr);
@@ -498,6 +905,62 @@ free_inode(sref<inode> ip, transaction *tr)
   iunlock(ip);
 }
 
+// Record inum in the orphan list in the superblock, as part of trans.
+// Returns false if the list is full, in which case the inode is only freed
+// once it is closed, and leaked if we crash before that. The caller must
+// hold the superblock's lock in trans.
+bool
+add_orphan_inode(u32 inum, transaction *trans)
+{
+  sref<buf> bp = buf::get(ROOTDEV, 1);
+  auto locked = bp->write();
+  u32 *orphans = ((superblock*)locked->data)->orphans;
+  u32 *slot = nullptr;
+  for (u32 i = 0; i < SB_NORPHANS; i++) {
+    if (orphans[i] == inum)
+      return true;
+    if (!orphans[i] && !slot)
+      slot = &orphans[i];
+  }
+  if (!slot)
+    return false;
+  *slot = inum;
+  bp->add_to_transaction(trans);
+  return true;
+}
+
+// Drop inum from the orphan list, if it is there, as part of trans. The
+// caller must hold the superblock's lock in trans.
+void
+remove_orphan_inode(u32 inum, transaction *trans)
+{
+  sref<buf> bp = buf::get(ROOTDEV, 1);
+  auto locked = bp->write();
+  u32 *orphans = ((superblock*)locked->data)->orphans;
+  for (u32 i = 0; i < SB_NORPHANS; i++) {
+    if (orphans[i] == inum) {
+      orphans[i] = 0;
+      bp->add_to_transaction(trans);
+      return;
+    }
+  }
+}
+
+// Copy the orphan list into inums, which must have room for SB_NORPHANS
+// entries; returns the number of orphans.
+u32
+get_orphan_inodes(u32 *inums)
+{
+  sref<buf> bp = buf::get(ROOTDEV, 1);
+  auto copy = bp->read();
+  const u32 *orphans = ((const superblock*)copy->data)->orphans;
+  u32 n = 0;
+  for (u32 i = 0; i < SB_NORPHANS; i++)
+    if (orphans[i])
+      inums[n++] = orphans[i];
+  return n;
+}
+
 // Propagate the changes made to the in-memory inode metadata, to the disk.
 // As far as possible, don't invoke iupdate() on every little change to the
 // inode; batch the updates and call iupdate() once at the end, to avoid the
@@ -523,20 +986,23 @@ iupdate(sref<inode> ip, transaction *trans)
   dip->size = ip->size;
   dip->gen = ip->gen;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  ip->addrs_dirty = false;
   bp->add_to_transaction(trans);
 }
 
 inode::inode(u32 d, u32 i)
   : rcu_freed("inode", this, sizeof(*this)), dev(d), inum(i),
-    valid(false), busy(false), readbusy(0), dir(nullptr), dir_offset(0)
+    valid(false), busy(false), readbusy(0), addrs_dirty(false), resv_start(0),
+    resv_len(0), resv_pending(0), dir(nullptr), dir_offset(0),
+    dir_indexed(false)
 {
 }
 
 inode::~inode()
 {
   if (dir) {
-    dir->remove(strbuf<DIRSIZ>("."));
-    dir->remove(strbuf<DIRSIZ>(".."));
+    dir->remove(fsname("."));
+    dir->remove(fsname(".."));
     delete dir;
   }
 }
@@ -583,6 +1049,32 @@ iget(u32 dev, u32 inum)
   return ip;
 }
 
+// Reads the inode blocks of those of inums that aren't cached yet, all at
+// once, so that iget()ing them afterwards doesn't wait for the disk one inode
+// block at a time. Loading a directory that nobody has looked at yet does
+// this for each of its blocks' worth of entries.
+void
+iprefetch(u32 dev, const std::vector<u32> &inums)
+{
+  std::vector<u64> missing;
+  for (u32 inum : inums) {
+    if (ins->lookup(make_pair(dev, inum)))
+      continue;
+    u64 block = IBLOCK(inum);
+    if (!buf::in_bufcache(dev, block))
+      missing.push_back(block);
+  }
+  if (missing.size() < 2)
+    return;
+
+  std::sort(missing.begin(), missing.end());
+  std::vector<u64> blocks;
+  for (u64 block : missing)
+    if (blocks.empty() || blocks.back() != block)
+      blocks.push_back(block);
+  buf::get_blocks(dev, blocks);
+}
+
 sref<inode>
 inode::alloc(u32 dev, u32 inum)
 {
@@ -720,59 +1212,399 @@ iunlock(sref<inode> ip)
 // blocks on the disk.  The first NDIRECT blocks are listed in ip->addrs[].
 // The next NINDIRECT blocks are listed in the block ip->addrs[NDIRECT].
 // The next NINDIRECT^2 blocks are doubly-indirect from ip->addrs[NDIRECT+1].
+//
+// On a filesystem with SB_FEATURE_EXTENTS, ip->addrs[] instead holds a sorted
+// list of extents (see struct dextent), so that a lookup maps a whole run of
+// blocks at once. Extent number i lives in the inode itself when
+// i < NINLINE_EXTENTS, in the extent block ip->addrs[EXTENT_BLOCK] when it is
+// among the next NEXTENTS_PER_BLOCK, and otherwise in one of the extent blocks
+// listed by the index block ip->addrs[EXTENT_INDEX].
 
-// Return the disk block address of the nth block in inode ip. If there is no
-// such block, bmap allocates one. The caller must hold ilock() for write if
-// invoking bmap() from writei().
-static u32
-bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = false,
-     bool lazy_trans_update = false)
+static void
+log_block(sref<buf> bp, transaction *trans, bool lazy_trans_update)
 {
-  scoped_gc_epoch e;
-  bool skip_disk_read = false;
-  u32* ap;
+  if (lazy_trans_update)
+    bp->add_blocknum_to_transaction(trans);
+  else
+    bp->add_to_transaction(trans);
+}
 
-  if (bn < NDIRECT) {
-    if (ip->addrs[bn] == 0)
-      ip->addrs[bn] = balloc(ip->dev, trans, zero_on_alloc);
+// Return the buf holding extent number i (which must not be an inline
+// extent) and the position of the extent within it in *pos. Missing extent
+// blocks are allocated if trans is given; otherwise a null sref is returned.
+static sref<buf>
+extent_buf(sref<inode> ip, u32 i, u32 *pos, transaction *trans = NULL,
+           bool lazy_trans_update = false)
+{
+  assert(i >= NINLINE_EXTENTS);
+  i -= NINLINE_EXTENTS;
+
+  if (i < NEXTENTS_PER_BLOCK) {
+    *pos = i;
+    if (ip->addrs[EXTENT_BLOCK])
+      return buf::get(ip->dev, ip->addrs[EXTENT_BLOCK]);
+    if (!trans)
+      return sref<buf>();
+    ip->addrs[EXTENT_BLOCK] = balloc(ip->dev, trans, true);
+    ip->addrs_dirty = true;
+    // We allocated the block just now. So need to read it from the disk.
+    return buf::get(ip->dev, ip->addrs[EXTENT_BLOCK], true);
+  }
+  i -= NEXTENTS_PER_BLOCK;
 
-    return ip->addrs[bn];
+  u32 slot = i / NEXTENTS_PER_BLOCK;
+  if (slot >= NINDIRECT)
+    panic("extent_buf: %d out of range", i);
+  *pos = i % NEXTENTS_PER_BLOCK;
+
+  bool skip_disk_read = false;
+  if (!ip->addrs[EXTENT_INDEX]) {
+    if (!trans)
+      return sref<buf>();
+    ip->addrs[EXTENT_INDEX] = balloc(ip->dev, trans, true);
+    ip->addrs_dirty = true;
+    skip_disk_read = true;
   }
-  bn -= NDIRECT;
 
-  if (bn < NINDIRECT) {
-    if (ip->addrs[NDIRECT] == 0) {
-      ip->addrs[NDIRECT] = balloc(ip->dev, trans, true);
-      // We allocated the block just now. So need to read it from the disk.
-      skip_disk_read = true;
-    }
+  sref<buf> bp = buf::get(ip->dev, ip->addrs[EXTENT_INDEX], skip_disk_read);
+  {
+    auto copy = bp->read();
+    u32 bno = ((const u32 *)copy->data)[slot];
+    if (bno)
+      return buf::get(ip->dev, bno);
+    if (!trans)
+      return sref<buf>();
+  }
 
-    sref<buf> bp = buf::get(ip->dev, ip->addrs[NDIRECT], skip_disk_read);
-    skip_disk_read = false;
-    auto locked = bp->write();
-    ap = (u32 *)locked->data;
+  auto locked = bp->write();
+  u32 *ap = (u32 *)locked->data;
+  ap[slot] = balloc(ip->dev, trans, true);
+  log_block(bp, trans, lazy_trans_update);
+  return buf::get(ip->dev, ap[slot], true);
+}
 
-    if (ap[bn] == 0) {
-      ap[bn] = balloc(ip->dev, trans, zero_on_alloc);
-      if (trans) {
-        if (lazy_trans_update)
-          bp->add_blocknum_to_transaction(trans);
-        else
-          bp->add_to_transaction(trans);
-      }
-    }
+static dextent
+extent_get(sref<inode> ip, u32 i)
+{
+  if (i < NINLINE_EXTENTS)
+    return ((const dextent *)ip->addrs)[i];
 
-    return ap[bn];
+  u32 pos;
+  sref<buf> bp = extent_buf(ip, i, &pos);
+  assert(bp);
+  auto copy = bp->read();
+  return ((const dextent *)copy->data)[pos];
+}
+
+static void
+extent_put(sref<inode> ip, u32 i, const dextent &ex, transaction *trans,
+           bool lazy_trans_update)
+{
+  if (i < NINLINE_EXTENTS) {
+    ((dextent *)ip->addrs)[i] = ex;
+    ip->addrs_dirty = true;
+    return;
   }
-  bn -= NINDIRECT;
 
-  if (bn >= NINDIRECT * NINDIRECT)
-    panic("bmap: %d out of range", bn);
+  u32 pos;
+  sref<buf> bp = extent_buf(ip, i, &pos, trans, lazy_trans_update);
+  assert(bp);
+  auto locked = bp->write();
+  ((dextent *)locked->data)[pos] = ex;
+  if (trans)
+    log_block(bp, trans, lazy_trans_update);
+}
 
-  if (ip->addrs[NDIRECT+1] == 0) {
-    ip->addrs[NDIRECT+1] = balloc(ip->dev, trans, true);
-    // We allocated the block just now. So need to read it from the disk.
-    skip_disk_read = true;
+// Return the number of extents that start at or before file block bn. Only
+// the last of them can contain bn.
+static u32
+extent_search(sref<inode> ip, u32 bn)
+{
+  u32 lo = 0, hi = ip->addrs[EXTENT_COUNT];
+
+  while (lo < hi) {
+    u32 mid = lo + (hi - lo) / 2;
+    if (extent_get(ip, mid).lblk <= bn)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Insert ex as extent number i.
+static void
+extent_insert(sref<inode> ip, u32 i, const dextent &ex, transaction *trans,
+              bool lazy_trans_update)
+{
+  u32 n = ip->addrs[EXTENT_COUNT];
+  if (n >= MAXEXTENTS)
+    panic("bmap: inode %u has too many extents", ip->inum);
+
+  // Make room for the new extent by shifting the ones after it, starting at
+  // the end so that unlocked readers never miss an extent.
+  for (u32 j = n; j > i; j--)
+    extent_put(ip, j, extent_get(ip, j - 1), trans, lazy_trans_update);
+
+  extent_put(ip, i, ex, trans, lazy_trans_update);
+  ip->addrs[EXTENT_COUNT] = n + 1;
+  ip->addrs_dirty = true;
+}
+
+// Remove extent number i, which must be empty.
+static void
+extent_remove(sref<inode> ip, u32 i, transaction *trans,
+              bool lazy_trans_update)
+{
+  u32 n = ip->addrs[EXTENT_COUNT];
+  for (u32 j = i; j + 1 < n; j++)
+    extent_put(ip, j, extent_get(ip, j + 1), trans, lazy_trans_update);
+  ip->addrs[EXTENT_COUNT] = n - 1;
+  if (n - 1 < NINLINE_EXTENTS)
+    memset((dextent *)ip->addrs + n - 1, 0, sizeof(dextent));
+  ip->addrs_dirty = true;
+}
+
+// Map block bn of extent number i to the disk block pblk, as an ordinary
+// (written) block, splitting the extent around it. A writer going through a
+// region in order just moves the boundary between the written extent before
+// it and the rest, so it only ever rewrites those two extents.
+static void
+extent_remap(sref<inode> ip, u32 i, u32 bn, u32 pblk, transaction *trans,
+             bool lazy_trans_update)
+{
+  dextent ex = extent_get(ip, i);
+  u32 off = bn - ex.lblk;
+  dextent done = { bn, pblk, 1 };
+  dextent before = ex, after = ex;
+  before.len = off;
+  after.lblk = bn + 1;
+  after.pblk = ex.pblk + off + 1;
+  after.len = ex.len - off - 1;
+
+  if (off == 0 && i) {
+    dextent left = extent_get(ip, i - 1);
+    if (!left.unwritten && left.lblk + left.len == bn &&
+        left.pblk + left.len == done.pblk) {
+      left.len++;
+      extent_put(ip, i - 1, left, trans, lazy_trans_update);
+      if (after.len)
+        extent_put(ip, i, after, trans, lazy_trans_update);
+      else
+        extent_remove(ip, i, trans, lazy_trans_update);
+      return;
+    }
+  }
+
+  // Otherwise split the extent in up to three.
+  if (before.len) {
+    extent_put(ip, i++, before, trans, lazy_trans_update);
+    extent_insert(ip, i++, done, trans, lazy_trans_update);
+  } else {
+    extent_put(ip, i++, done, trans, lazy_trans_update);
+  }
+  if (after.len)
+    extent_insert(ip, i, after, trans, lazy_trans_update);
+}
+
+// Turn block bn of the unwritten extent number i into an ordinary one, for a
+// writer that is about to fill it in.
+static void
+extent_convert(sref<inode> ip, u32 i, u32 bn, transaction *trans,
+               bool lazy_trans_update)
+{
+  dextent ex = extent_get(ip, i);
+  extent_remap(ip, i, bn, ex.pblk + (bn - ex.lblk), trans, lazy_trans_update);
+}
+
+// Unmap file block bn of ip, if it is mapped, and free its disk block. This
+// leaves a hole, which only extent-mapped inodes can have.
+static void
+extent_punch(sref<inode> ip, u32 bn, transaction *trans,
+             bool lazy_trans_update)
+{
+  u32 i = extent_search(ip, bn);
+  if (!i)
+    return;
+  dextent ex = extent_get(ip, --i);
+  if (bn >= ex.lblk + ex.len)
+    return;
+
+  u32 off = bn - ex.lblk;
+  dextent before = ex, after = ex;
+  before.len = off;
+  after.lblk = bn + 1;
+  after.pblk = ex.pblk + off + 1;
+  after.len = ex.len - off - 1;
+  bfree(ip->dev, ex.pblk + off, trans, true);
+
+  if (before.len) {
+    extent_put(ip, i, before, trans, lazy_trans_update);
+    if (after.len)
+      extent_insert(ip, i + 1, after, trans, lazy_trans_update);
+  } else if (after.len) {
+    extent_put(ip, i, after, trans, lazy_trans_update);
+  } else {
+    extent_remove(ip, i, trans, lazy_trans_update);
+  }
+}
+
+// Give ip a private copy of the shared data block b, for a writer about to
+// fill it in (copy-on-write), and drop ip's reference to b. The old contents
+// are only copied if the writer is not overwriting the whole block, which is
+// what zero_on_alloc tells bmap().
+static u32
+unshare_block(sref<inode> ip, u32 b, transaction *trans, bool copy)
+{
+  u32 nb = balloc_data(ip, trans, false);
+  if (copy) {
+    sref<buf> from = buf::get(ip->dev, b);
+    sref<buf> to = buf::get(ip->dev, nb, true);
+    {
+      auto src = from->read();
+      auto dst = to->write();
+      memmove(dst->data, src->data, BSIZE);
+    }
+    to->add_to_transaction(trans);
+  }
+  bfree(ip->dev, b, trans, true);
+  return nb;
+}
+
+// bmap() for extent-mapped inodes. Holes are only filled in by writers (that
+// is, when trans is given); readers get 0 and treat the block as zeroed. The
+// same goes for unwritten blocks, except that a writer gets the block that
+// was preallocated for it.
+static u32
+bmap_extent(sref<inode> ip, u32 bn, transaction *trans, bool zero_on_alloc,
+            bool lazy_trans_update, u32 share)
+{
+  u32 n = ip->addrs[EXTENT_COUNT];
+  dextent prev = { 0, 0, 0 };
+  u32 i;
+
+  // Appends and sequential reads almost always hit the last extent, so try
+  // that before searching.
+  if (n && (prev = extent_get(ip, n - 1)).lblk <= bn) {
+    i = n;
+  } else {
+    i = extent_search(ip, bn);
+    if (i)
+      prev = extent_get(ip, i - 1);
+  }
+
+  if (i && bn < prev.lblk + prev.len) {
+    u32 b = prev.pblk + (bn - prev.lblk);
+    if (!prev.unwritten) {
+      if (trans && !share && block_shared(b)) {
+        b = unshare_block(ip, b, trans, zero_on_alloc);
+        extent_remap(ip, i - 1, bn, b, trans, lazy_trans_update);
+      }
+      return b;
+    }
+    if (!trans)
+      return 0;
+    extent_convert(ip, i - 1, bn, trans, lazy_trans_update);
+    if (zero_on_alloc)
+      bzero(ip->dev, b);
+    return b;
+  }
+
+  if (!trans)
+    return 0;
+
+  u32 b = share ? share : balloc_data(ip, trans, zero_on_alloc);
+
+  // Grow the previous extent if the new block continues it both in the file
+  // and on the disk, which is the common case with delayed allocation.
+  if (i && !prev.unwritten && bn == prev.lblk + prev.len &&
+      b == prev.pblk + prev.len) {
+    prev.len++;
+    extent_put(ip, i - 1, prev, trans, lazy_trans_update);
+    return b;
+  }
+
+  dextent ex = { bn, b, 1 };
+  extent_insert(ip, i, ex, trans, lazy_trans_update);
+  return b;
+}
+
+// Fill in the data block pointer *ap for bmap(): allocate a block if there
+// is none (or use share), or copy a shared block a writer is about to write.
+// Returns true if *ap changed.
+static bool
+bmap_data(sref<inode> ip, u32 *ap, transaction *trans, bool zero_on_alloc,
+          u32 share)
+{
+  if (*ap == 0) {
+    *ap = share ? share : balloc_data(ip, trans, zero_on_alloc);
+    return true;
+  }
+  if (trans && !share && block_shared(*ap)) {
+    *ap = unshare_block(ip, *ap, trans, zero_on_alloc);
+    return true;
+  }
+  return false;
+}
+
+// Return the disk block address of the nth block in inode ip. If there is no
+// such block, bmap allocates one, or maps it to the disk block share (taking
+// a reference to it is the caller's job). Writers get a private copy of
+// blocks shared with other files. The caller must hold ilock() for write if
+// invoking bmap() from writei().
+static u32
+bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = false,
+     bool lazy_trans_update = false, u32 share = 0)
+{
+  scoped_gc_epoch e;
+  bool skip_disk_read = false;
+  u32* ap;
+
+  if (extent_mapped())
+    return bmap_extent(ip, bn, trans, zero_on_alloc, lazy_trans_update, share);
+
+  if (bn < NDIRECT) {
+    if (bmap_data(ip, &ip->addrs[bn], trans, zero_on_alloc, share))
+      ip->addrs_dirty = true;
+
+    return ip->addrs[bn];
+  }
+  bn -= NDIRECT;
+
+  if (bn < NINDIRECT) {
+    if (ip->addrs[NDIRECT] == 0) {
+      ip->addrs[NDIRECT] = balloc(ip->dev, trans, true);
+      ip->addrs_dirty = true;
+      // We allocated the block just now. So need to read it from the disk.
+      skip_disk_read = true;
+    }
+
+    sref<buf> bp = buf::get(ip->dev, ip->addrs[NDIRECT], skip_disk_read);
+    skip_disk_read = false;
+    auto locked = bp->write();
+    ap = (u32 *)locked->data;
+
+    if (bmap_data(ip, &ap[bn], trans, zero_on_alloc, share)) {
+      if (trans) {
+        if (lazy_trans_update)
+          bp->add_blocknum_to_transaction(trans);
+        else
+          bp->add_to_transaction(trans);
+      }
+    }
+
+    return ap[bn];
+  }
+  bn -= NINDIRECT;
+
+  if (bn >= NINDIRECT * NINDIRECT)
+    panic("bmap: %d out of range", bn);
+
+  if (ip->addrs[NDIRECT+1] == 0) {
+    ip->addrs[NDIRECT+1] = balloc(ip->dev, trans, true);
+    ip->addrs_dirty = true;
+    // We allocated the block just now. So need to read it from the disk.
+    skip_disk_read = true;
   }
 
   // First-level doubly-indirect block
@@ -800,8 +1632,7 @@ bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = fal
   auto slocked = sp->write();
   ap = (u32 *)slocked->data;
 
-  if (ap[bn % NINDIRECT] == 0) {
-    ap[bn % NINDIRECT] = balloc(ip->dev, trans, zero_on_alloc);
+  if (bmap_data(ip, &ap[bn % NINDIRECT], trans, zero_on_alloc, share)) {
     if (trans) {
       if (lazy_trans_update)
         sp->add_blocknum_to_transaction(trans);
@@ -813,6 +1644,430 @@ bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = fal
   return ap[bn % NINDIRECT];
 }
 
+// Return the disk block number of the bn-th block of inode ip, which must
+// already have been allocated. The caller must hold ilock.
+u32
+inode_blocknum(sref<inode> ip, u32 bn)
+{
+  assert(bn < MAXFILE && (u64)bn * BSIZE < ip->size);
+  u32 blocknum = bmap(ip, bn);
+  assert(blocknum);
+  return blocknum;
+}
+
+// Return the disk block number of the bn-th block of inode ip for reading, or
+// 0 if it is a hole in an extent-mapped file. Like readi(), this needs no
+// ilock.
+u32
+inode_lookup_block(sref<inode> ip, u32 bn)
+{
+  try {
+    return bmap(ip, bn, NULL, true);
+  } catch (out_of_blocks& e) {
+    // Read operations should never cause out-of-blocks conditions
+    panic("inode_lookup_block: out of blocks");
+  }
+}
+
+// Set aside nblocks disk blocks for the data blocks that bmap() is about to
+// allocate for ip (delayed allocation). The blocks are taken from the
+// allocator in contiguous runs as bmap() consumes them, and whatever is left
+// over goes back via inode_release_reserved_blocks(). The caller must hold
+// ilock() for write across both calls.
+void
+inode_reserve_blocks(sref<inode> ip, u32 nblocks)
+{
+  assert(!ip->resv_len && !ip->resv_pending);
+  ip->resv_pending = nblocks;
+}
+
+void
+inode_release_reserved_blocks(sref<inode> ip)
+{
+  // These blocks were never handed to a transaction, so they can be freed
+  // right away.
+  for (; ip->resv_len; ip->resv_len--)
+    rootfs_interface->free_block(ip->resv_start++);
+  ip->resv_pending = 0;
+}
+
+bool
+inode_inline(sref<inode> ip)
+{
+  return ip->type == T_FILE && (ip->flags & DI_INLINE);
+}
+
+// Whether ip's addrs[] map no blocks at all.
+static bool
+inode_has_no_blocks(sref<inode> ip)
+{
+  if (extent_mapped())
+    return ip->addrs[EXTENT_COUNT] == 0;
+  for (u32 i = 0; i < NDIRECT + 2; i++)
+    if (ip->addrs[i])
+      return false;
+  return true;
+}
+
+// Store the n bytes at src, all of file ip's data, in its inode (see
+// DI_INLINE). Returns 0, or -1 if ip can't keep its data inline, in which case
+// nothing changed. The caller must hold ilock() for write and arrange for
+// iupdate().
+int
+iwrite_inline(sref<inode> ip, const char *src, u32 n)
+{
+  if (!(sb_root.features & SB_FEATURE_INLINE_DATA) || ip->type != T_FILE ||
+      n == 0 || n > INLINE_MAX || inode_compressed(ip))
+    return -1;
+  if (!inode_inline(ip) && !inode_has_no_blocks(ip))
+    return -1;
+
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  memmove(ip->addrs, src, n);
+  ip->flags |= DI_INLINE;
+  ip->addrs_dirty = true;
+  return 0;
+}
+
+// Turn inline file ip back into one that maps blocks. With keep set, its data
+// is written out to file block 0 through the transaction's block queue;
+// otherwise the caller is about to overwrite all of it. The caller must hold
+// ilock() for write.
+static void
+iinline_expand(sref<inode> ip, transaction *trans, bool keep,
+               bool lazy_trans_update)
+{
+  char data[INLINE_MAX];
+  memmove(data, ip->addrs, sizeof(data));
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  ip->flags &= ~DI_INLINE;
+  ip->addrs_dirty = true;
+  if (!keep || !ip->size)
+    return;
+
+  u32 b = bmap(ip, 0, trans, false, lazy_trans_update);
+  char *buf = trans->alloc_journal_buf();
+  memset(buf, 0, BSIZE);
+  memmove(buf, data, std::min(ip->size, INLINE_MAX));
+  trans->write_block(ip->dev, buf, b);
+}
+
+// Preallocate disk blocks for the holes in file blocks [bn, bn + nblocks) of
+// ip, as unwritten extents. Each hole gets the longest contiguous runs the
+// allocator has. Only extent-mapped inodes can do this. Returns 0, or -1 if
+// the disk or the inode's extent list fills up first. The caller must hold
+// ilock() for write and arrange for iupdate().
+int
+ifallocate(sref<inode> ip, u32 bn, u32 nblocks, transaction *trans)
+{
+  scoped_gc_epoch e;
+
+  if (!extent_mapped())
+    return -1;
+  if (inode_inline(ip))
+    iinline_expand(ip, trans, true, false);
+
+  u32 end = bn + nblocks;
+  while (bn < end) {
+    u32 n = ip->addrs[EXTENT_COUNT];
+    u32 i = extent_search(ip, bn);
+    dextent prev = { 0, 0, 0 };
+    if (i) {
+      prev = extent_get(ip, i - 1);
+      if (bn < prev.lblk + prev.len) {
+        bn = prev.lblk + prev.len;
+        continue;
+      }
+    }
+
+    u32 hole_end = end;
+    if (i < n)
+      hole_end = std::min(end, extent_get(ip, i).lblk);
+    if (n >= MAXEXTENTS)
+      return -1;
+
+    u32 start;
+    u32 len = rootfs_interface->try_alloc_blocks(hole_end - bn, &start);
+    if (!len)
+      return -1;
+    for (u32 b = 0; b < len; b++)
+      trans->add_allocated_block(start + b);
+
+    if (i && prev.unwritten && prev.lblk + prev.len == bn &&
+        prev.pblk + prev.len == start) {
+      prev.len += len;
+      extent_put(ip, i - 1, prev, trans, false);
+    } else {
+      dextent ex = { bn, start, len, 1 };
+      extent_insert(ip, i, ex, trans, false);
+    }
+    bn += len;
+  }
+  return 0;
+}
+
+// Make dst, an empty file, a copy of src that shares src's data blocks.
+// Blocks that can't take another reference are copied instead. Returns 0,
+// or -1 if the disk doesn't keep block refcounts or fills up, in which case
+// dst is left empty. The caller must hold ilock() on both, for write on
+// dst, and arrange for iupdate(dst).
+int
+iclone(sref<inode> src, sref<inode> dst, transaction *trans)
+{
+  scoped_gc_epoch e;
+
+  if (!block_refs || src->type != T_FILE || dst->type != T_FILE ||
+      dst->size != 0)
+    return -1;
+
+  itrunc(dst, 0, trans);
+  if (inode_inline(src)) {
+    memmove(dst->addrs, src->addrs, sizeof(dst->addrs));
+    dst->flags |= DI_INLINE;
+    dst->size = src->size;
+    dst->addrs_dirty = true;
+    return 0;
+  }
+
+  u32 nblocks = (src->size + BSIZE - 1) / BSIZE;
+  if (inode_compressed(src)) {
+    nblocks = (src->size + ZCHUNK_BYTES - 1) / ZCHUNK_BYTES * ZCHUNK_BLKS;
+    dst->flags = src->flags;
+  }
+  try {
+    for (u32 bn = 0; bn < nblocks; bn++) {
+      u32 b = inode_lookup_block(src, bn);
+      if (!b)
+        continue;
+      if (share_block(b, trans)) {
+        bmap(dst, bn, trans, false, false, b);
+        continue;
+      }
+
+      sref<buf> from = buf::get(src->dev, b);
+      sref<buf> to = buf::get(dst->dev, bmap(dst, bn, trans), true);
+      {
+        auto copy = from->read();
+        auto locked = to->write();
+        memmove(locked->data, copy->data, BSIZE);
+      }
+      to->add_to_transaction(trans);
+    }
+  } catch (out_of_blocks& e) {
+    itrunc(dst, 0, trans);
+    return -1;
+  }
+
+  dst->size = src->size;
+  return 0;
+}
+
+bool
+inode_compressed(sref<inode> ip)
+{
+  return ip->type == T_FILE && (ip->flags & DI_COMPRESSED);
+}
+
+// Turn compression on or off for ip, which must be an empty file. Returns 0,
+// or -1 if ip can't be compressed. The caller must hold ilock() for write and
+// arrange for iupdate().
+int
+iset_compressed(sref<inode> ip, bool on)
+{
+  if (!extent_mapped() || ip->type != T_FILE || ip->size != 0 ||
+      ip->addrs[EXTENT_COUNT] != 0)
+    return -1;
+  if (on)
+    ip->flags |= DI_COMPRESSED;
+  else
+    ip->flags &= ~DI_COMPRESSED;
+  return 0;
+}
+
+// Read compressed chunk number c of ip into out, which has room for
+// ZCHUNK_BYTES.
+static void
+zchunk_read(sref<inode> ip, u32 c, char *out)
+{
+  char *in = (char *)kmalloc(ZCHUNK_BLKS * BSIZE, "zchunk");
+  if (!in)
+    panic("zchunk_read: out of memory");
+
+  // The stream's blocks are the ones at the start of the chunk, and mostly
+  // lie in a single run on the disk.
+  u32 n = 0;
+  while (n < ZCHUNK_BLKS) {
+    u32 first = inode_lookup_block(ip, c * ZCHUNK_BLKS + n);
+    if (!first)
+      break;
+    u32 dev = blknum_to_dev(first);
+    u32 j = n + 1;
+    while (j < ZCHUNK_BLKS) {
+      u32 b = inode_lookup_block(ip, c * ZCHUNK_BLKS + j);
+      if (!b || blknum_to_dev(b) != dev ||
+          remap_blknum(b) != remap_blknum(first) + (j - n))
+        break;
+      j++;
+    }
+    disk_read(dev, in + n * BSIZE, (j - n) * BSIZE, (u64)first * BSIZE);
+    n = j;
+  }
+
+  s64 len = 0;
+  if (n) {
+    len = zlib_decompress_buf(in, n * BSIZE, out, ZCHUNK_BYTES);
+    if (len < 0)
+      panic("zchunk_read: inode %u chunk %u is corrupt", ip->inum, c);
+  }
+  memset(out + len, 0, ZCHUNK_BYTES - len);
+  kmfree(in, ZCHUNK_BLKS * BSIZE);
+}
+
+// readi() for compressed files. This holds ilock() for read, so that the
+// chunks aren't rewritten under it.
+static int
+zreadi(sref<inode> ip, char *dst, u32 off, u32 n)
+{
+  char *chunk = (char *)kmalloc(ZCHUNK_BYTES, "zchunk");
+  if (!chunk)
+    panic("zreadi: out of memory");
+
+  ilock(ip, READLOCK);
+  u32 m;
+  for (u32 tot = 0; tot < n; tot += m, off += m, dst += m) {
+    zchunk_read(ip, off / ZCHUNK_BYTES, chunk);
+    m = std::min(n - tot, ZCHUNK_BYTES - off % ZCHUNK_BYTES);
+    memmove(dst, chunk + off % ZCHUNK_BYTES, m);
+  }
+  iunlock(ip);
+  kmfree(chunk, ZCHUNK_BYTES);
+  return n;
+}
+
+// Read the file pages [pageidx, pageidx + npages) of the compressed file ip
+// into pages, decompressing each chunk once.
+void
+zread_pages(sref<inode> ip, u32 pageidx, u32 npages, char **pages)
+{
+  static_assert(PGSIZE == BSIZE, "file pages must map onto disk blocks");
+  char *chunk = (char *)kmalloc(ZCHUNK_BYTES, "zchunk");
+  if (!chunk)
+    panic("zread_pages: out of memory");
+
+  ilock(ip, READLOCK);
+  for (u32 i = 0; i < npages; ) {
+    u32 c = (pageidx + i) / ZCHUNK_PAGES;
+    zchunk_read(ip, c, chunk);
+    for (; i < npages && (pageidx + i) / ZCHUNK_PAGES == c; i++)
+      memmove(pages[i], chunk + (pageidx + i) % ZCHUNK_PAGES * PGSIZE,
+              PGSIZE);
+  }
+  iunlock(ip);
+  kmfree(chunk, ZCHUNK_BYTES);
+}
+
+// Write the npages file pages of compressed chunk number c of ip, as a
+// single zlib stream, and unmap the chunk's blocks that the stream doesn't
+// need. Like writei() in the fsync() path, the blocks are written directly
+// through the transaction's block queue. The caller must hold ilock() for
+// write.
+void
+zwrite_chunk(sref<inode> ip, u32 c, char **pages, u32 npages,
+             transaction *trans)
+{
+  scoped_gc_epoch e;
+  assert(npages && npages <= ZCHUNK_PAGES);
+
+  char *out[ZCHUNK_BLKS];
+  for (u32 j = 0; j < ZCHUNK_BLKS; j++)
+    out[j] = trans->alloc_journal_buf();
+  u64 len = zlib_compress_blocks(pages, npages, out, ZCHUNK_BLKS);
+  if (!len)
+    panic("zwrite_chunk: chunk %u of inode %u doesn't fit", c, ip->inum);
+
+  u32 nblocks = (len + BSIZE - 1) / BSIZE;
+  if (len % BSIZE)
+    memset(out[nblocks - 1] + len % BSIZE, 0, BSIZE - len % BSIZE);
+  for (u32 j = 0; j < nblocks; j++) {
+    u32 b = bmap(ip, c * ZCHUNK_BLKS + j, trans, false, true);
+    trans->write_block(ip->dev, out[j], b);
+  }
+  for (u32 j = nblocks; j < ZCHUNK_BLKS; j++)
+    extent_punch(ip, c * ZCHUNK_BLKS + j, trans, true);
+}
+
+// itrunc() for extent-mapped inodes: free every block from bn onwards, and
+// the extent blocks that are no longer needed.
+static void
+itrunc_extent(sref<inode> ip, u32 bn, transaction *trans)
+{
+  u32 n = ip->addrs[EXTENT_COUNT];
+  u32 i = extent_search(ip, bn);
+  u32 keep = i;
+
+  if (i) {
+    dextent ex = extent_get(ip, i - 1);
+    if (bn < ex.lblk + ex.len) {
+      for (u32 b = bn; b < ex.lblk + ex.len; b++)
+        bfree(ip->dev, ex.pblk + (b - ex.lblk), trans, true);
+      ex.len = bn - ex.lblk;
+      if (ex.len)
+        extent_put(ip, i - 1, ex, trans, false);
+      else
+        keep--;
+    }
+  }
+
+  for (u32 j = i; j < n; j++) {
+    dextent ex = extent_get(ip, j);
+    for (u32 b = 0; b < ex.len; b++)
+      bfree(ip->dev, ex.pblk + b, trans, true);
+  }
+
+  for (u32 j = keep; j < NINLINE_EXTENTS; j++)
+    memset((dextent *)ip->addrs + j, 0, sizeof(dextent));
+
+  if (ip->addrs[EXTENT_INDEX]) {
+    // The index block lists the extent blocks from this one onwards.
+    u32 first = 0;
+    if (keep > NINLINE_EXTENTS + NEXTENTS_PER_BLOCK)
+      first = (keep - NINLINE_EXTENTS - 1) / NEXTENTS_PER_BLOCK;
+
+    {
+      sref<buf> bp = buf::get(ip->dev, ip->addrs[EXTENT_INDEX]);
+      auto locked = bp->write();
+      u32 *ap = (u32 *)locked->data;
+
+      for (u32 k = first; k < NINDIRECT; k++) {
+        if (!ap[k])
+          break;
+        bfree(ip->dev, ap[k], trans, true);
+        ap[k] = 0;
+      }
+
+      if (first != 0)
+        bp->add_to_transaction(trans);
+    }
+
+    if (first == 0) {
+      bfree(ip->dev, ip->addrs[EXTENT_INDEX], trans, true);
+      ip->addrs[EXTENT_INDEX] = 0;
+    }
+  }
+
+  if (keep <= NINLINE_EXTENTS && ip->addrs[EXTENT_BLOCK]) {
+    bfree(ip->dev, ip->addrs[EXTENT_BLOCK], trans, true);
+    ip->addrs[EXTENT_BLOCK] = 0;
+  }
+
+  ip->addrs[EXTENT_COUNT] = keep;
+
+  if (bn == 0) {
+    for (u32 j = 0; j < NDIRECT + 2; j++)
+      assert(ip->addrs[j] == 0);
+  }
+}
+
 // Caller must hold ilock for write. The caller must also arrange to invoke
 // iupdate() when suitable, to flush the new inode size to the disk.
 void
@@ -820,12 +2075,49 @@ itrunc(sref<inode> ip, u32 offset, transaction *trans)
 {
   scoped_gc_epoch e;
 
+  if (inode_inline(ip)) {
+    if (ip->size <= offset)
+      return;
+    memset((char *)ip->addrs + offset, 0, ip->size - offset);
+    if (offset == 0)
+      ip->flags &= ~DI_INLINE;
+    ip->size = offset;
+    ip->addrs_dirty = true;
+    return;
+  }
+
+  // Blocks preallocated by ifallocate() can lie past the end of an
+  // extent-mapped file, so those are worth a look even if the file is no
+  // longer than offset.
+  // A compressed file keeps the whole chunk that offset falls in.
+  u32 bn = BLOCKROUNDUP(offset);
+  if (inode_compressed(ip))
+    bn = (offset + ZCHUNK_BYTES - 1) / ZCHUNK_BYTES * ZCHUNK_BLKS;
+
+  if (extent_mapped() && ip->size <= offset) {
+    u32 n = ip->addrs[EXTENT_COUNT];
+    if (!n || offset >= MAXFILE*BSIZE)
+      return;
+    dextent last = extent_get(ip, n - 1);
+    if (last.lblk + last.len <= bn)
+      return;
+    itrunc_extent(ip, bn, trans);
+    ip->addrs_dirty = true;
+    return;
+  }
+
   if (ip->size <= offset || offset >= MAXFILE*BSIZE)
     return;
 
   // Wipe out everything from bn (inclusive) till the end of the file.
   // After itrunc() returns, appends will occur at 'offset'.
-  u32 bn = BLOCKROUNDUP(offset);
+
+  if (extent_mapped()) {
+    itrunc_extent(ip, bn, trans);
+    ip->size = offset;
+    ip->addrs_dirty = true;
+    return;
+  }
 
   enum {
     DIRECT_BLOCKS = 1,
@@ -945,6 +2237,67 @@ itrunc(sref<inode> ip, u32 offset, transaction *trans)
   }
 
   ip->size = offset;
+  ip->addrs_dirty = true;
+}
+
+static void
+drop_extents(u32 dev, const dextent *ex, u32 count)
+{
+  for (u32 i = 0; i < count; i++) {
+    for (u32 b = 0; b < ex[i].len; b++)
+      buf::put(dev, ex[i].pblk + b);
+  }
+}
+
+// Drop the extent block bno, and the data blocks of the first count extents
+// that it holds.
+static void
+drop_extent_block(u32 dev, u32 bno, u32 count)
+{
+  // As with indirect blocks, the data blocks can only be in the bufcache if
+  // the extent block that maps them is.
+  if (!bno || !buf::in_bufcache(dev, bno))
+    return;
+
+  {
+    sref<buf> bp = buf::get(dev, bno);
+    auto copy = bp->read();
+    drop_extents(dev, (const dextent *)copy->data, count);
+  }
+  buf::put(dev, bno);
+}
+
+static void
+drop_bufcache_extent(sref<inode> ip)
+{
+  u32 n = ip->addrs[EXTENT_COUNT];
+
+  drop_extents(ip->dev, (const dextent *)ip->addrs,
+               std::min(n, (u32)NINLINE_EXTENTS));
+  if (n <= NINLINE_EXTENTS)
+    return;
+  n -= NINLINE_EXTENTS;
+
+  drop_extent_block(ip->dev, ip->addrs[EXTENT_BLOCK],
+                    std::min(n, NEXTENTS_PER_BLOCK));
+  if (n <= NEXTENTS_PER_BLOCK)
+    return;
+  n -= NEXTENTS_PER_BLOCK;
+
+  u32 idx = ip->addrs[EXTENT_INDEX];
+  if (idx && buf::in_bufcache(ip->dev, idx)) {
+    {
+      sref<buf> bp = buf::get(ip->dev, idx);
+      auto copy = bp->read();
+      const u32 *a = (const u32 *)copy->data;
+      for (u32 k = 0; k * NEXTENTS_PER_BLOCK < n; k++)
+        drop_extent_block(ip->dev, a[k],
+                          std::min(n - k * NEXTENTS_PER_BLOCK,
+                                   NEXTENTS_PER_BLOCK));
+    }
+    // Drop the index block.
+    buf::put(ip->dev, idx);
+  }
 }
 
 // Drop the (clean) buffer-cache blocks associated with this file.
@@ -954,6 +2307,14 @@ drop_bufcache(sref<inode> ip)
 {
   scoped_gc_epoch e;
 
+  if (inode_inline(ip))
+    return;
+
+  if (extent_mapped()) {
+    drop_bufcache_extent(ip);
+    return;
+  }
+
   for (int i = 0; i < NDIRECT; i++) {
     if (ip->addrs[i])
       buf::put(ip->dev, ip->addrs[i]);
@@ -1032,15 +2393,31 @@ readi(sref<inode> ip, char *dst, u32 off, u32 n)
   if (off + n > ip->size)
     n = ip->size - off;
 
+  if (inode_compressed(ip))
+    return zreadi(ip, dst, off, n);
+
+  if (inode_inline(ip)) {
+    memmove(dst, (char *)ip->addrs + off, n);
+    return n;
+  }
+
   for (tot=0; tot<n; tot+=m, off+=m, dst+=m) {
+    u32 blocknum = 0;
     try {
-      bp = buf::get(ip->dev, bmap(ip, off/BSIZE, NULL, true));
+      blocknum = bmap(ip, off/BSIZE, NULL, true);
     } catch (out_of_blocks& e) {
       // Read operations should never cause out-of-blocks conditions
       panic("readi: out of blocks");
     }
     m = std::min(n - tot, BSIZE - off%BSIZE);
 
+    // A hole in an extent-mapped file.
+    if (!blocknum) {
+      memset(dst, 0, m);
+      continue;
+    }
+    bp = buf::get(ip->dev, blocknum);
+
     auto copy = bp->read();
     memmove(dst, copy->data + off%BSIZE, m);
   }
@@ -1080,6 +2457,11 @@ writei(sref<inode> ip, const char *src, u32 off, u32 n, transaction *trans,
   if (off + n > MAXFILE*BSIZE)
     n = MAXFILE*BSIZE - off;
 
+  // An inline file gets its blocks back; unless this write covers all of its
+  // data, that data is written to block 0 first.
+  if (inode_inline(ip))
+    iinline_expand(ip, trans, off != 0 || n < ip->size, lazy_trans_update);
+
   for (tot=0; tot<n; tot+=m, off+=m, src+=m) {
 
     bool skip_disk_read = false;
@@ -1142,6 +2524,395 @@ update_size(sref<inode> ip, u32 size, transaction *trans)
 
 // Directories
 
+// A directory that outgrows its first block is converted to a hashed
+// index, in the style of ext3's htree (see struct dx_node).  Looking up,
+// adding or removing a name in an indexed directory touches at most three
+// blocks, and dp->dir only caches the names that have been looked up
+// rather than holding the whole directory.
+
+struct dx_path {
+  u32 rootpos;                  // Entry in the root
+  u32 node;                     // Index node, if the root has levels 1
+  u32 nodepos;                  // Entry in node
+  u32 leaf;
+};
+
+struct dx_rec {
+  u32 hash;
+  u32 inum;
+  u32 namelen;
+  const char *name;
+};
+
+// Scratch blocks for the index code.
+enum { DX_ROOT, DX_NODE, DX_LEAF, DX_OUT1, DX_OUT2, DX_NBUF };
+
+struct dx_bufs {
+  char *b[DX_NBUF];
+
+  dx_bufs() {
+    for (auto &p : b)
+      p = kalloc("dxbuf");
+  }
+
+  ~dx_bufs() {
+    for (auto p : b)
+      if (p)
+        kfree(p);
+  }
+
+  bool ok() const {
+    for (auto p : b)
+      if (!p)
+        return false;
+    return true;
+  }
+
+  dx_node *root() { return (dx_node *) b[DX_ROOT]; }
+  dx_node *node() { return (dx_node *) b[DX_NODE]; }
+};
+
+static u32
+dx_hash(const char *name, u32 len)
+{
+  // FNV-1a
+  u32 h = 2166136261u;
+  for (u32 i = 0; i < len; i++)
+    h = (h ^ (u8) name[i]) * 16777619u;
+  return h;
+}
+
+static void
+dx_read(sref<inode> dp, u32 blk, char *buf)
+{
+  if (readi(dp, buf, blk * BSIZE, BSIZE) != BSIZE)
+    panic("dx_read");
+}
+
+static void
+dx_write(sref<inode> dp, u32 blk, const char *buf, transaction *trans)
+{
+  if (writei(dp, buf, blk * BSIZE, BSIZE, trans) != BSIZE)
+    panic("dx_write");
+  if (dp->size < (blk + 1) * BSIZE) {
+    dp->size = (blk + 1) * BSIZE;
+    iupdate(dp, trans);
+  }
+}
+
+static void
+dx_init_node(dx_node *n)
+{
+  memset(n, 0, BSIZE);
+  n->fake_reclen = BSIZE;
+}
+
+// Return the last entry of n whose hash is <= hash.  The first entry
+// of the root and of anything the search led to always is.
+static u32
+dx_search(const dx_node *n, u32 hash)
+{
+  u32 lo = 0, hi = n->count;
+  while (hi - lo > 1) {
+    u32 mid = (lo + hi) / 2;
+    if (n->entries[mid].hash <= hash)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Insert (hash, blk) into n just after entry pos.
+static void
+dx_insert_entry(dx_node *n, u32 pos, u32 hash, u32 blk)
+{
+  memmove(&n->entries[pos + 2], &n->entries[pos + 1],
+          (n->count - pos - 1) * sizeof(n->entries[0]));
+  n->entries[pos + 1].hash = hash;
+  n->entries[pos + 1].block = blk;
+  n->count++;
+}
+
+// Move the upper half of the full index node a to the fresh node b, and
+// add (hash, blk) after what was entry pos of a.
+static void
+dx_split_node(dx_node *a, dx_node *b, u32 pos, u32 hash, u32 blk)
+{
+  u32 half = a->count / 2;
+  dx_init_node(b);
+  b->count = a->count - half;
+  memmove(b->entries, &a->entries[half], b->count * sizeof(a->entries[0]));
+  a->count = half;
+  if (pos >= half)
+    dx_insert_entry(b, pos - half, hash, blk);
+  else
+    dx_insert_entry(a, pos, hash, blk);
+}
+
+// Read the index blocks on the way to the leaf that covers hash.
+static void
+dx_probe(sref<inode> dp, u32 hash, dx_bufs *bufs, dx_path *p)
+{
+  dx_read(dp, 0, bufs->b[DX_ROOT]);
+  dx_node *root = bufs->root();
+  if (root->magic != DX_MAGIC || root->count == 0)
+    panic("dx_probe: bad index root");
+
+  p->rootpos = dx_search(root, hash);
+  p->leaf = root->entries[p->rootpos].block;
+  if (root->levels == 0)
+    return;
+
+  p->node = p->leaf;
+  dx_read(dp, p->node, bufs->b[DX_NODE]);
+  p->nodepos = dx_search(bufs->node(), hash);
+  p->leaf = bufs->node()->entries[p->nodepos].block;
+}
+
+// Collect the live records in the first end bytes of blk.
+static void
+dx_collect(const char *blk, u32 end, std::vector<dx_rec> *v)
+{
+  u32 off = 0;
+  while (off + sizeof(struct dirent) <= end) {
+    const struct dirent *de = (const struct dirent *) (blk + off);
+    if (de->reclen == 0)
+      break;
+    if (de->inum)
+      v->push_back({dx_hash(de->name, de->namelen), de->inum,
+                    de->namelen, de->name});
+    off += de->reclen;
+  }
+}
+
+// Pack n records into a fresh leaf block blkno, whose contents go in
+// blk, and move any of them that are cached in dp->dir.  The records'
+// names must not point into blk.
+static void
+dx_fill_leaf(sref<inode> dp, u32 blkno, char *blk, const dx_rec *v, size_t n)
+{
+  memset(blk, 0, BSIZE);
+  u32 off = 0;
+  for (size_t i = 0; i < n; i++) {
+    struct dirent *de = (struct dirent *) (blk + off);
+    u32 reclen = DIRENT_RECLEN(v[i].namelen);
+    de->inum = v[i].inum;
+    de->reclen = reclen;
+    de->namelen = v[i].namelen;
+    memmove(de->name, v[i].name, v[i].namelen);
+
+    fsname name(v[i].name, v[i].namelen);
+    dir_entry_info de_info;
+    if (dp->dir->lookup(name, &de_info)) {
+      dp->dir->remove(name);
+      dp->dir->insert(name, dir_entry_info(v[i].inum, blkno * BSIZE + off,
+                                           reclen));
+    }
+    off += reclen;
+  }
+}
+
+// Find a record in leaf with room for need bytes.
+static bool
+dx_leaf_slot(const char *leaf, u32 need, u32 *offp, u32 *reclenp)
+{
+  u32 off = 0;
+  while (off + sizeof(struct dirent) <= BSIZE) {
+    const struct dirent *de = (const struct dirent *) (leaf + off);
+    if (de->reclen == 0) {
+      if (BSIZE - off < need)
+        return false;
+      *offp = off;
+      *reclenp = need;
+      return true;
+    }
+    if (!de->inum && de->reclen >= need) {
+      *offp = off;
+      *reclenp = de->reclen;
+      return true;
+    }
+    off += de->reclen;
+  }
+  return false;
+}
+
+// Add an index entry for the new block blk, which covers the hashes from
+// hash up, next to the entry that p followed.
+static void
+dx_add_index(sref<inode> dp, dx_path *p, dx_bufs *bufs, u32 hash, u32 blk,
+             transaction *trans)
+{
+  dx_node *root = bufs->root();
+
+  if (root->levels == 0) {
+    if (root->count < DX_ENTRIES) {
+      dx_insert_entry(root, p->rootpos, hash, blk);
+      dx_write(dp, 0, bufs->b[DX_ROOT], trans);
+      return;
+    }
+
+    // The root is full: move its entries to two index nodes below it.
+    dx_node *n = bufs->node();
+    dx_node *m = (dx_node *) bufs->b[DX_OUT1];
+    u32 nblk = dp->size / BSIZE;
+    dx_init_node(n);
+    n->count = root->count;
+    memmove(n->entries, root->entries, root->count * sizeof(root->entries[0]));
+    dx_split_node(n, m, p->rootpos, hash, blk);
+    dx_write(dp, nblk, bufs->b[DX_NODE], trans);
+    dx_write(dp, nblk + 1, bufs->b[DX_OUT1], trans);
+
+    root->levels = 1;
+    root->count = 2;
+    root->entries[0].hash = 0;
+    root->entries[0].block = nblk;
+    root->entries[1].hash = m->entries[0].hash;
+    root->entries[1].block = nblk + 1;
+    dx_write(dp, 0, bufs->b[DX_ROOT], trans);
+    return;
+  }
+
+  dx_node *n = bufs->node();
+  if (n->count < DX_ENTRIES) {
+    dx_insert_entry(n, p->nodepos, hash, blk);
+    dx_write(dp, p->node, bufs->b[DX_NODE], trans);
+    return;
+  }
+
+  // Split the index node; dx_split_leaf checked that the root has room.
+  dx_node *m = (dx_node *) bufs->b[DX_OUT1];
+  u32 mblk = dp->size / BSIZE;
+  dx_split_node(n, m, p->nodepos, hash, blk);
+  dx_write(dp, mblk, bufs->b[DX_OUT1], trans);
+  dx_write(dp, p->node, bufs->b[DX_NODE], trans);
+
+  dx_insert_entry(root, p->rootpos, m->entries[0].hash, mblk);
+  dx_write(dp, 0, bufs->b[DX_ROOT], trans);
+}
+
+// Move the upper half of the hash range of the full leaf that p led to,
+// whose contents are in bufs, to a new block.  Fails if the leaf's
+// records can't be split or the index is full.
+static bool
+dx_split_leaf(sref<inode> dp, dx_path *p, dx_bufs *bufs, transaction *trans)
+{
+  dx_node *root = bufs->root();
+  if (root->levels == 1 && bufs->node()->count == DX_ENTRIES &&
+      root->count == DX_ENTRIES)
+    return false;
+
+  std::vector<dx_rec> v;
+  dx_collect(bufs->b[DX_LEAF], BSIZE, &v);
+  std::sort(v.begin(), v.end(),
+            [](const dx_rec &a, const dx_rec &b) { return a.hash < b.hash; });
+
+  // Split at the change of hash nearest the middle, so that all the
+  // records with a given hash stay in one leaf.
+  size_t n = v.size(), split = 0;
+  auto dist = [n](size_t i) { return i < n / 2 ? n / 2 - i : i - n / 2; };
+  for (size_t i = 1; i < n; i++)
+    if (v[i].hash != v[i - 1].hash && (!split || dist(i) < dist(split)))
+      split = i;
+  if (!split)
+    return false;
+
+  u32 newblk = dp->size / BSIZE;
+  dx_fill_leaf(dp, p->leaf, bufs->b[DX_OUT1], &v[0], split);
+  dx_fill_leaf(dp, newblk, bufs->b[DX_OUT2], &v[split], n - split);
+  dx_write(dp, newblk, bufs->b[DX_OUT2], trans);
+  dx_write(dp, p->leaf, bufs->b[DX_OUT1], trans);
+  dx_add_index(dp, p, bufs, v[split].hash, newblk, trans);
+  return true;
+}
+
+// Look up name on disk in the indexed directory dp.
+static bool
+dx_find(sref<inode> dp, const char *name, dir_entry_info *de_info)
+{
+  dx_bufs bufs;
+  if (!bufs.ok())
+    panic("dx_find: out of memory");
+
+  u32 len = strlen(name);
+  dx_path p;
+  dx_probe(dp, dx_hash(name, len), &bufs, &p);
+  dx_read(dp, p.leaf, bufs.b[DX_LEAF]);
+
+  u32 off = 0;
+  while (off + sizeof(struct dirent) <= BSIZE) {
+    const struct dirent *de = (const struct dirent *) (bufs.b[DX_LEAF] + off);
+    if (de->reclen == 0)
+      break;
+    if (de->inum && de->namelen == len && memcmp(de->name, name, len) == 0) {
+      *de_info = dir_entry_info(de->inum, p.leaf * BSIZE + off, de->reclen);
+      return true;
+    }
+    off += de->reclen;
+  }
+  return false;
+}
+
+// Find a place for a new entry name in the indexed directory dp,
+// splitting its leaf if it's full.
+static bool
+dx_add(sref<inode> dp, const char *name, u32 inum, dir_entry_info *de_info,
+       transaction *trans)
+{
+  dx_bufs bufs;
+  if (!bufs.ok())
+    return false;
+
+  u32 len = strlen(name);
+  u32 hash = dx_hash(name, len);
+  u32 need = DIRENT_RECLEN(len);
+  for (;;) {
+    dx_path p;
+    dx_probe(dp, hash, &bufs, &p);
+    dx_read(dp, p.leaf, bufs.b[DX_LEAF]);
+
+    u32 off, reclen;
+    if (dx_leaf_slot(bufs.b[DX_LEAF], need, &off, &reclen)) {
+      *de_info = dir_entry_info(inum, p.leaf * BSIZE + off, reclen);
+      return true;
+    }
+    if (!dx_split_leaf(dp, &p, &bufs, trans))
+      return false;
+  }
+}
+
+// Convert the single-block directory dp to an indexed one, moving its
+// entries to a leaf in block 1.  dp->dir must hold all of its entries.
+static bool
+dx_convert(sref<inode> dp, transaction *trans)
+{
+  dx_bufs bufs;
+  if (!bufs.ok())
+    return false;
+
+  char *old = bufs.b[DX_LEAF];
+  memset(old, 0, BSIZE);
+  if (readi(dp, old, 0, dp->size) != (int) dp->size)
+    panic("dx_convert");
+
+  std::vector<dx_rec> v;
+  dx_collect(old, dp->size, &v);
+  dx_fill_leaf(dp, 1, bufs.b[DX_OUT1], v.data(), v.size());
+  dx_write(dp, 1, bufs.b[DX_OUT1], trans);
+
+  dx_node *root = bufs.root();
+  dx_init_node(root);
+  root->magic = DX_MAGIC;
+  root->levels = 0;
+  root->count = 1;
+  root->entries[0].hash = 0;
+  root->entries[0].block = 1;
+  dx_write(dp, 0, bufs.b[DX_ROOT], trans);
+
+  dp->dir_indexed = true;
+  return true;
+}
+
 void
 dir_init(sref<inode> dp)
 {
@@ -1154,10 +2925,20 @@ dir_init(sref<inode> dp)
     panic("dir_init: inode is not a directory\n");
 
   dp->dir = new dir_entries(NDIR_ENTRIES_PRIME);
-  u32 dir_offset = 0;
+
+  if (dp->size >= 2 * BSIZE) {
+    struct dx_node root;
+    if (readi(dp, (char *) &root, 0, sizeof(root)) == (int) sizeof(root) &&
+        root.fake_inum == 0 && root.fake_reclen == BSIZE &&
+        root.magic == DX_MAGIC) {
+      // Entries are read in as they are looked up.
+      dp->dir_indexed = true;
+      dp->dir_offset = dp->size;
+      return;
+    }
+  }
 
   for (u32 off = 0; off < dp->size; off += BSIZE) {
-    assert(dir_offset == off);
     sref<buf> bp;
     try {
       bp = buf::get(dp->dev, bmap(dp, off / BSIZE, NULL, true));
@@ -1167,20 +2948,23 @@ dir_init(sref<inode> dp)
     }
 
     auto copy = bp->read();
-    for (const struct dirent *de = (const struct dirent *) copy->data;
-	 de < (const struct dirent *) (copy->data + BSIZE);
-	 de++) {
+    u32 end = dp->size - off < BSIZE ? dp->size - off : BSIZE;
+    u32 boff = 0;
+    while (boff + sizeof(struct dirent) <= end) {
+      const struct dirent *de = (const struct dirent *) (copy->data + boff);
+      if (de->reclen == 0)
+        break;
 
       if (de->inum) {
-        dir_entry_info de_info(de->inum, dir_offset);
-        dp->dir->insert(strbuf<DIRSIZ>(de->name), de_info);
+        dir_entry_info de_info(de->inum, off + boff, de->reclen);
+        dp->dir->insert(fsname(de->name, de->namelen), de_info);
       }
 
-      dir_offset += sizeof(*de);
+      boff += de->reclen;
     }
   }
 
-  dp->dir_offset = dir_offset;
+  dp->dir_offset = dp->size;
 }
 
 // Caller must hold ilock for write.
@@ -1191,17 +2975,24 @@ dir_flush_entry(sref<inode> dp, const char *name, transaction *trans)
     return;
 
   dir_entry_info de_info;
-  dp->dir->lookup(strbuf<DIRSIZ>(name), &de_info);
-
-  struct dirent de;
-  strncpy(de.name, name, DIRSIZ);
-  de.inum = de_info.inum_;
-
-  if (writei(dp, (char *)&de, de_info.offset_, sizeof(de), trans) != sizeof(de))
+  dp->dir->lookup(fsname(name), &de_info);
+
+  char buf[DIRENT_RECLEN(DIRSIZ)];
+  struct dirent *de = (struct dirent *) buf;
+  u32 namelen = strlen(name);
+  u32 reclen = DIRENT_RECLEN(namelen);
+  memset(buf, 0, reclen);
+  de->inum = de_info.inum_;
+  // The record may be a reused larger one.
+  de->reclen = de_info.reclen_ ? de_info.reclen_ : reclen;
+  de->namelen = namelen;
+  memmove(de->name, name, namelen);
+
+  if (writei(dp, buf, de_info.offset_, reclen, trans) != reclen)
     panic("dir_flush_entry");
 
-  if (dp->size < de_info.offset_ + sizeof(de)) {
-    dp->size = de_info.offset_ + sizeof(de);
+  if (dp->size < de_info.offset_ + reclen) {
+    dp->size = de_info.offset_ + reclen;
   }
 
   iupdate(dp, trans);
@@ -1209,12 +3000,15 @@ dir_flush_entry(sref<inode> dp, const char *name, transaction *trans)
 
 // Look for a directory entry in a directory.
 sref<inode>
-dirlookup(sref<inode> dp, char *name)
+dirlookup(sref<inode> dp, const char *name)
 {
   dir_init(dp);
 
+  fsname fname(name);
   dir_entry_info de_info;
-  dp->dir->lookup(strbuf<DIRSIZ>(name), &de_info);
+  if (!dp->dir->lookup(fname, &de_info) && dp->dir_indexed &&
+      dx_find(dp, name, &de_info))
+    dp->dir->insert(fname, de_info);
 
   if (de_info.inum_ == 0)
     return sref<inode>();
@@ -1230,12 +3024,47 @@ dirlink(sref<inode> dp, const char *name, u32 inum, bool inc_link,
   sref<inode> ip;
   dir_init(dp);
 
-  dir_entry_info de_info(inum, dp->dir_offset);
-
-  if (!dp->dir->insert(strbuf<DIRSIZ>(name), de_info))
-    return -1;
-
-  dp->dir_offset += sizeof(struct dirent);
+  fsname fname(name);
+  u32 off = dp->dir_offset;
+  u32 reclen = DIRENT_RECLEN(strlen(name));
+
+  // Index the directory once it no longer fits in one block.
+  // Directories that grew past that before indexing existed are left
+  // as they are.
+  if (!dp->dir_indexed && dp->size <= BSIZE && off + reclen > BSIZE)
+    dx_convert(dp, trans);
+
+  if (dp->dir_indexed) {
+    dir_entry_info de_info;
+    if (dp->dir->lookup(fname, &de_info) || dx_find(dp, name, &de_info))
+      return -1;
+    if (!dx_add(dp, name, inum, &de_info, trans))
+      return -1;
+    if (!dp->dir->insert(fname, de_info))
+      return -1;
+  } else {
+    // Start a new block if the entry doesn't fit in what's left of the
+    // last one.
+    u32 pad = 0;
+    if (off % BSIZE + reclen > BSIZE)
+      pad = BSIZE - off % BSIZE;
+
+    dir_entry_info de_info(inum, off + pad, reclen);
+
+    if (!dp->dir->insert(fname, de_info))
+      return -1;
+
+    dp->dir_offset = off + pad + reclen;
+
+    if (pad) {
+      // Cover the rest of the block with an unused record.
+      struct dirent de;
+      memset(&de, 0, sizeof(de));
+      de.reclen = pad;
+      if (writei(dp, (char *)&de, off, sizeof(de), trans) != sizeof(de))
+        panic("dirlink");
+    }
+  }
 
   // If adding the ".." link in a directory, don't change *any* link counts.
   if (strncmp(name, "..", DIRSIZ) != 0) {
@@ -1266,14 +3095,17 @@ dirunlink(sref<inode> dp, const char *name, u32 inum, bool dec_link,
   sref<inode> ip;
   dir_init(dp);
 
+  fsname fname(name);
   dir_entry_info de_info;
-  dp->dir->lookup(strbuf<DIRSIZ>(name), &de_info);
-
-  if (!dp->dir->remove(strbuf<DIRSIZ>(name)))
+  if (!dp->dir->lookup(fname, &de_info)) {
+    if (!dp->dir_indexed || !dx_find(dp, name, &de_info))
+      return -1;
+  } else if (!dp->dir->remove(fname)) {
     return -1;
+  }
 
   de_info.inum_ = 0;
-  if (!dp->dir->insert(strbuf<DIRSIZ>(name), de_info))
+  if (!dp->dir->insert(fname, de_info))
     return -1;
 
   // If removing the ".." link in a directory, don't change *any* link counts.
@@ -1289,7 +3121,7 @@ dirunlink(sref<inode> dp, const char *name, u32 inum, bool dec_link,
   }
 
   dir_flush_entry(dp, name, trans);
-  dp->dir->remove(strbuf<DIRSIZ>(name));
+  dp->dir->remove(fname);
 
   // Update the on-disk link count of the inode being unlinked.
   if (ip_updated)
@@ -1335,8 +3167,7 @@ skipelem(const char **rpath, char *name)
     return -1;
   } else {
     memmove(name, s, len);
-    if (len < DIRSIZ)
-      name[len] = 0;
+    name[len] = 0;
   }
   while (*path == '/')
     path++;
@@ -1346,7 +3177,7 @@ skipelem(const char **rpath, char *name)
 
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
-// path element into name, which must have room for DIRSIZ bytes.
+// path element into name, which must have room for DIRSIZ+1 bytes.
 static sref<inode>
 namex(sref<inode> cwd, const char *path, int nameiparent, char *name)
 {
@@ -1396,7 +3227,7 @@ sref<inode>
 namei(sref<inode> cwd, const char *path)
 {
   // Assumes caller is holding a gc_epoch
-  char name[DIRSIZ];
+  char name[DIRSIZ+1];
   return namex(cwd, path, 0, name);
 }
 
@@ -9,6 +9,7 @@
 #include "cpu.hh"
 #include "spercpu.hh"
 #include "kmtrace.hh"
+#include "futex.h"
 
 //
 // futexkey
@@ -33,11 +34,11 @@ futexkey_val(futexkey_t const& key)
 }
 
 int
-futexkey(const u64* useraddr, vmap* vmap, futexkey_t* key)
+futexkey(const u64* useraddr, vmap* vmap, futexkey_t* key, bool write)
 {
   u64* kaddr;
 
-  kaddr = (u64*)pagelookup(vmap, (uptr)useraddr);
+  kaddr = (u64*)pagelookup(vmap, (uptr)useraddr, write);
   if (kaddr == nullptr) {
     cprintf("futexkey: pagelookup failed\n");
     return -1;
@@ -58,6 +59,7 @@ struct nscache {
   nscache();
   xns<u32, proc*, proc::hash>* alloc();
   bool cache(xns<u32, proc*, proc::hash>* ns);
+  size_t drain(void);
 
   NEW_DELETE_OPS(nscache);
 };
@@ -102,6 +104,28 @@ nscache::cache(xns<u32, proc*, proc::hash>* ns)
   return cached;
 }
 
+// Free all of the cached namespaces.  Returns the number freed.
+size_t
+nscache::drain(void)
+{
+  size_t n = 0;
+  while (auto ns = alloc()) {
+    delete ns;
+    ++n;
+  }
+  return n;
+}
+
+// Shrinker that frees the cached namespaces of every CPU.
+static u64
+nscache_shrink(u64 npages)
+{
+  size_t n = 0;
+  for (int cpu = 0; cpu < ncpu; cpu++)
+    n += nscache_[cpu].drain();
+  return (n * sizeof(xns<u32, proc*, proc::hash>) + PGSIZE - 1) / PGSIZE;
+}
+
 //
 // futexaddr
 //
@@ -121,7 +145,17 @@ private:
   NEW_DELETE_OPS(futexaddr);
 };
 
-xns<futexkey_t, futexaddr*, futexkey_hash> *nsfutex __mpalign__;
+// nsfutex is split into shards by key, so unrelated futexes don't
+// share hash chains or a shard's per-core lists.
+enum { FUTEX_SHARDS = 16 };
+typedef xns<futexkey_t, futexaddr*, futexkey_hash> futexns;
+static futexns *nsfutex[FUTEX_SHARDS] __mpalign__;
+
+static futexns*
+futex_ns(futexkey_t key)
+{
+  return nsfutex[((u64)key / sizeof(u64)) % FUTEX_SHARDS];
+}
 
 futexaddr*
 futexaddr::alloc(futexkey_t key)
@@ -160,7 +194,7 @@ void
 futexaddr::onzero(void)
 {
   if (inserted_)
-    assert(nsfutex->remove(key_, nullptr));
+    assert(futex_ns(key_)->remove(key_, nullptr));
   // Normally deallocate members in the destructor, but in this case
   // we don't want to wait for the gc to fill the cache
   if (!nscache_->cache(nspid_))
@@ -168,101 +202,255 @@ futexaddr::onzero(void)
   gc_delayed((futexaddr*)this);
 }
 
-long
-futexwait(futexkey_t key, u64 val, u64 timer)
+// Return a referenced futexaddr for key, creating it if create is
+// set, or nullptr.
+static futexaddr*
+futexaddr_get(futexkey_t key, bool create)
 {
+  futexns *ns = futex_ns(key);
   futexaddr* fa;
 
   mtreadavar("futex:ns:%p", key);
-  {
-    scoped_gc_epoch gc;
-  again:
-    fa = nsfutex->lookup(key);
+  scoped_gc_epoch gc;
+  for (;;) {
+    fa = ns->lookup(key);
+    if (fa != nullptr) {
+      if (fa->tryinc())
+        return fa;
+      continue;
+    }
+    if (!create)
+      return nullptr;
+    fa = futexaddr::alloc(key);
     if (fa == nullptr) {
-      fa = futexaddr::alloc(key);
-      if (fa == nullptr) {
-        cprintf("futexwait futexaddr::alloc failed\n");
-        return -1;
-      }
-      if (!nsfutex->insert(key, fa)) {
-        fa->dec();
-        goto again;
-      }
-      mtwriteavar("futex:ns:%p", key);
-      fa->inserted_ = true;
-    } else {
-      if (!fa->tryinc()) {
-        goto again;
-      }
+      cprintf("futexaddr_get futexaddr::alloc failed\n");
+      return nullptr;
+    }
+    if (!ns->insert(key, fa)) {
+      fa->dec();
+      continue;
     }
+    mtwriteavar("futex:ns:%p", key);
+    fa->inserted_ = true;
+    return fa;
   }
+}
+
+long
+futexwait(futexkey_t key, u64 val, u64 timer)
+{
+  proc *p = myproc();
+  futexaddr* fa = futexaddr_get(key, true);
+  if (fa == nullptr)
+    return -1;
   assert(fa->key_ == key);
   mtwriteavar("futex:%p.%p", key, fa);
 
-  acquire(&myproc()->futex_lock);  
-  auto cleanup = scoped_cleanup([&fa](){
-    release(&myproc()->futex_lock);
-    fa->dec();
+  acquire(&p->futex_lock);
+  // Whoever wakes us dequeues us, but a requeue may have moved us (and
+  // our reference) to another futexaddr.
+  p->futex_fa = fa;
+  auto cleanup = scoped_cleanup([p](){
+    futexaddr *cur = p->futex_fa;
+    p->futex_fa = nullptr;
+    release(&p->futex_lock);
+    cur->dec();
   });
 
   // This first check is an optimization
   if (futexkey_val(fa->key_) != val)
     return -EWOULDBLOCK;
 
-  if (!fa->nspid_->insert(myproc()->pid, myproc()))
+  if (!fa->nspid_->insert(p->pid, p))
     return -1;
 
   if (futexkey_val(fa->key_) != val) {
-    fa->nspid_->remove(myproc()->pid, nullptr);
+    fa->nspid_->remove(p->pid, nullptr);
     return -EWOULDBLOCK;
   }
+  p->futex_queued = true;
 
   u64 nsecto = timer == 0 ? 0 : timer+nsectime();
-  myproc()->cv->sleep_to(&myproc()->futex_lock, nsecto);
+  p->cv->sleep_to(&p->futex_lock, nsecto);
 
-  assert(fa->nspid_->remove(myproc()->pid, nullptr));
+  // Timed out or woken spuriously.
+  if (p->futex_queued) {
+    assert(p->futex_fa->nspid_->remove(p->pid, nullptr));
+    p->futex_queued = false;
+  }
   return 0;
 }
 
-long
-futexwake(futexkey_t key, u64 nwake)
+// Dequeue and wake p if it's still waiting on fa.  Called with
+// p->futex_lock held.
+static bool
+futex_dequeue(futexaddr *fa, u32 pid, proc *p)
+{
+  if (!p->futex_queued || p->futex_fa != fa)
+    return false;
+  assert(fa->nspid_->remove(pid, nullptr));
+  p->futex_queued = false;
+  p->cv->wake_all();
+  return true;
+}
+
+// Wake up to nwake of fa's waiters.  Returns how many were woken.
+static u64
+futexaddr_wake(futexaddr *fa, u64 nwake)
 {
-  futexaddr* fa;
   u64 nwoke = 0;
 
   if (nwake == 0)
-    return -1;
+    return 0;
+  fa->nspid_->enumerate([&](u32 pid, proc* p) {
+    scoped_acquire l(&p->futex_lock);
+    if (futex_dequeue(fa, pid, p))
+      ++nwoke;
+    return nwoke >= nwake;
+  });
+  return nwoke;
+}
 
-  mtreadavar("futex:ns:%p", key);
-  {
-    scoped_gc_epoch gc;
-    fa = nsfutex->lookup(key);
-    if (fa == nullptr || !fa->tryinc())
-      return 0;
-  }
+long
+futexwake(futexkey_t key, u64 nwake)
+{
+  if (nwake == 0)
+    return -1;
 
+  futexaddr* fa = futexaddr_get(key, false);
+  if (fa == nullptr)
+    return 0;
   auto cleanup = scoped_cleanup([&fa](){
     fa->dec();
   });
   mtwriteavar("futex:%p.%p", key, fa);
 
-  fa->nspid_->enumerate([&nwoke, &nwake](u32 pid, proc* p) {
-    acquire(&p->futex_lock);
-    p->cv->wake_all();
-    release(&p->futex_lock);
-    ++nwoke;
-    if (nwoke >= nwake)
-      return 1;
+  return futexaddr_wake(fa, nwake);
+}
+
+// Wake nwake waiters on key and move up to nrequeue of the rest to
+// key2 without waking them, so a condition variable broadcast wakes
+// one waiter instead of a herd that all go for the same mutex.  If
+// cmpval is non-null, first check that key's value is *cmpval.
+// Returns how many waiters were woken or moved.
+long
+futexrequeue(futexkey_t key, u64 nwake, u64 nrequeue, futexkey_t key2,
+             const u64 *cmpval)
+{
+  if (cmpval && futexkey_val(key) != *cmpval)
+    return -EWOULDBLOCK;
+
+  futexaddr* fa = futexaddr_get(key, false);
+  if (fa == nullptr)
     return 0;
+  futexaddr* fa2 = nullptr;
+  auto cleanup = scoped_cleanup([&](){
+    fa->dec();
+    if (fa2)
+      fa2->dec();
   });
+  mtwriteavar("futex:%p.%p", key, fa);
 
-  return 0;
+  u64 nwoke = 0, nmoved = 0;
+  if (key2 == key)
+    nrequeue = 0;
+  fa->nspid_->enumerate([&](u32 pid, proc* p) {
+    if (nwoke >= nwake && nmoved >= nrequeue)
+      return true;
+    if (nwoke < nwake) {
+      scoped_acquire l(&p->futex_lock);
+      if (futex_dequeue(fa, pid, p))
+        ++nwoke;
+      return false;
+    }
+    if (fa2 == nullptr && (fa2 = futexaddr_get(key2, true)) == nullptr)
+      return true;
+    scoped_acquire l(&p->futex_lock);
+    if (!p->futex_queued || p->futex_fa != fa)
+      return false;
+    if (!fa2->nspid_->insert(pid, p))
+      return true;
+    assert(fa->nspid_->remove(pid, nullptr));
+    // Move p's reference with it.  We hold our own reference to fa, so
+    // this can't be its last.
+    fa2->inc();
+    p->futex_fa = fa2;
+    fa->dec();
+    ++nmoved;
+    return false;
+  });
+  return nwoke + nmoved;
+}
+
+// Apply op (see FUTEX_OP) to *key2 atomically and return its old value
+// in *old.  Returns false if op is invalid.
+static bool
+futex_apply_op(futexkey_t key2, u64 op, u64 *old)
+{
+  int opcode = (op >> 60) & 0xf;
+  u64 oparg = (op >> 28) & 0xfffffff;
+  if (opcode & FUTEX_OP_OPARG_SHIFT) {
+    if (oparg >= 64)
+      return false;
+    oparg = 1ull << oparg;
+    opcode &= ~FUTEX_OP_OPARG_SHIFT;
+  }
+
+  std::atomic<u64> *word = (std::atomic<u64>*)key2;
+  u64 v = word->load(), nv;
+  do {
+    switch (opcode) {
+    case FUTEX_OP_SET:  nv = oparg; break;
+    case FUTEX_OP_ADD:  nv = v + oparg; break;
+    case FUTEX_OP_OR:   nv = v | oparg; break;
+    case FUTEX_OP_ANDN: nv = v & ~oparg; break;
+    case FUTEX_OP_XOR:  nv = v ^ oparg; break;
+    default:
+      return false;
+    }
+  } while (!word->compare_exchange_weak(v, nv));
+  *old = v;
+  return true;
+}
+
+// Update key2 and wake waiters on key, and on key2 if its old value
+// passes op's comparison, in one call.  This lets a thread release
+// one lock and signal another without a second system call.
+long
+futexwakeop(futexkey_t key, u64 nwake, futexkey_t key2, u64 nwake2, u64 op)
+{
+  u64 old;
+  if (!futex_apply_op(key2, op, &old))
+    return -1;
+
+  u64 cmparg = op & 0xfffffff;
+  bool pass;
+  switch ((op >> 56) & 0xf) {
+  case FUTEX_OP_CMP_EQ: pass = old == cmparg; break;
+  case FUTEX_OP_CMP_NE: pass = old != cmparg; break;
+  case FUTEX_OP_CMP_LT: pass = old < cmparg; break;
+  case FUTEX_OP_CMP_LE: pass = old <= cmparg; break;
+  case FUTEX_OP_CMP_GT: pass = old > cmparg; break;
+  case FUTEX_OP_CMP_GE: pass = old >= cmparg; break;
+  default:
+    return -1;
+  }
+
+  long n = 0;
+  if (nwake)
+    n += futexwake(key, nwake);
+  if (pass && nwake2)
+    n += futexwake(key2, nwake2);
+  return n;
 }
 
 void
 initfutex(void)
 {
-  nsfutex = new xns<futexkey_t, futexaddr*, futexkey_hash>(false);
-  if (nsfutex == 0)
-    panic("initfutex");
+  for (int i = 0; i < FUTEX_SHARDS; i++) {
+    nsfutex[i] = new futexns(false);
+    if (nsfutex[i] == 0)
+      panic("initfutex");
+  }
+  register_shrinker("futex nscache", SHRINK_OBJECT_CACHES, nscache_shrink);
 }
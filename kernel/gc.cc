@@ -12,6 +12,10 @@
 #include "mtrace.h"
 #include "file.hh"
 #include "uk/gcstat.h"
+#include "kstream.hh"
+#include "refcache.hh"
+#include "numa.hh"
+#include <algorithm>
 
 using std::atomic;
 
@@ -31,7 +35,10 @@ using std::atomic;
 // 1. in parallel gc threads free the elements on the delayed-free lists
 //   (costs linear in the number of elements to be freed, but a local operation)
 // 2a (global scheme). one gcc thread perform step 1: updates global_epoch
-//   (costs linear in the number of cores, but a global operation)
+//   (costs linear in the number of core groups, but a global operation).
+//   Cores are grouped by NUMA node, at most GC_FANOUT to a group, and each
+//   core folds its nexttofree_epoch and min_epoch into its group's after
+//   it runs do_gc, so that the global step reads one cache line per group.
 // 2b (local scheme). each core reads the global_min and cur_epoch from its
 //   neighbor. it updates its global_min by computing the min(global_min read from
 //   neighbor and its min_epoch). it sets its cur_epoch to the
@@ -44,6 +51,12 @@ using std::atomic;
 // variable nexttofree_epoch, which <= min_epoch. cur_epoch isn't increased
 // unless nexttofree_epoch >= cur_epoch-2, implicitly also ensuring the
 // constraint that cur_epoch is only increases when min_epoch >= cur_epoch-2.
+//
+// The gc threads normally run every GCINTERVAL, so an object can wait
+// several GCINTERVALs to be freed.  When a core has delayed gc_batchsize
+// frees, or memory runs low, gc_wakeup() starts an expedited grace period:
+// until the epoch has advanced far enough that everything delayed before
+// it is freed, every gc thread runs once a tick.
 
 enum { gc_debug = 0, gc_global = GC_GLOBAL };
 
@@ -51,6 +64,8 @@ enum { gc_debug = 0, gc_global = GC_GLOBAL };
 struct headinfo {
   rcu_freed* head;
   u64 epoch;
+  u64 nbytes;                   // bytes of the objects on the list
+  u64 first_ns;                 // when the first object was added
 };
 
 // nexttofree_epoch << min_epoch << global_epoch (or cur_epoch)
@@ -63,13 +78,15 @@ struct gc_state {
   struct condvar cv;
   headinfo delayed[NEPOCH];     // NEPOCH delayed-free lists
   gc_handle proclist;           // list of process in an epoch on this core
+  int group;                    // index of this core's gc_group
 public:
   gc_state();
   void dequeue(gc_handle *h);
   void enqueue(gc_handle *h);
-  int gc_free(rcu_freed *r, u64 epoch);
+  int gc_free(rcu_freed *r, u64 epoch, u64 *nbytes);
   void do_gc(void);
   void inc_cur_epoch(void);
+  void update_group(void);
 };
 
 DEFINE_PERCPU(gc_state, gc_states, NO_MIGRATE);
@@ -85,6 +102,22 @@ static struct gc_lock {
 } gc_lock;
 atomic<u64> global_epoch __mpalign__;
 
+// A group of cores in scheme 2a.  Its epochs are lower bounds: each member
+// that updates them computes them from the other members' latest values,
+// which only grow.
+struct gc_group {
+  atomic<u64> nexttofree_epoch; // <= nexttofree_epoch of all members
+  atomic<u64> min_epoch;        // <= min_epoch of all members
+  int mincpu;                   // lowest member ID
+  int ncpu;
+  int cpus[GC_FANOUT];
+} __mpalign__;
+static gc_group gc_groups[NCPU];
+static int ngc_groups;
+
+// gc threads run every tick until the epoch reaches expedite_epoch.
+static atomic<u64> expedite_epoch __mpalign__;
+
 // Sceheme 2a: Increment global_epoch if (1) each core has freed all epochs <=
 // global-2 and (2) each core has no processes in an epoch <= global - 2 This
 // operation is the only global operation.
@@ -98,14 +131,11 @@ gc_inc_global_epoch(void)
   u64 global = global_epoch;  // make "local" copy
   u64 minfree = global;
   u64 minepoch = global;
-  for (int c = 0; c < ngc_cpu; c++) {
-    // is reading nexttofree_epoch and min_epoch a single cache miss?
-    if (gc_states[c].nexttofree_epoch < minfree) {
-      minfree = gc_states[c].nexttofree_epoch;
-    }
-    if (gc_states[c].min_epoch < minepoch) {
-      minepoch = gc_states[c].min_epoch;
-    }
+  for (int g = 0; g < ngc_groups; g++) {
+    if (gc_groups[g].mincpu >= ngc_cpu)
+      continue;
+    minfree = std::min(minfree, gc_groups[g].nexttofree_epoch.load());
+    minepoch = std::min(minepoch, gc_groups[g].min_epoch.load());
   }
   if ((minfree < global-2) || (minepoch < global-2))
     goto done;
@@ -149,6 +179,30 @@ gc_state::inc_cur_epoch(void)
   stat[mycpu()->id].nop++;
 }
 
+// Fold this core's epochs into its group's.  Raise the group's epochs
+// only, so that a racing member with older values can't lower them.
+void
+gc_state::update_group(void)
+{
+  gc_group *g = &gc_groups[group];
+  u64 minfree = nexttofree_epoch;
+  u64 minepoch = min_epoch;
+  for (int i = 0; i < g->ncpu; i++) {
+    int c = g->cpus[i];
+    if (c >= ngc_cpu)
+      continue;
+    minfree = std::min(minfree, gc_states[c].nexttofree_epoch.load());
+    minepoch = std::min(minepoch, gc_states[c].min_epoch.load());
+  }
+
+  u64 cur = g->nexttofree_epoch;
+  while (cur < minfree && !g->nexttofree_epoch.compare_exchange_weak(cur, minfree))
+    ;
+  cur = g->min_epoch;
+  while (cur < minepoch && !g->min_epoch.compare_exchange_weak(cur, minepoch))
+    ;
+}
+
 gc_state::gc_state() :
   lock_("gc_state", LOCKSTAT_GC), cv(condvar("gc_cv"))
 {
@@ -156,6 +210,7 @@ gc_state::gc_state() :
   proclist.prev = &proclist;
   for (int i = 0; i < NEPOCH; i++) {
     delayed[i].epoch = i;
+    delayed[i].nbytes = 0;
   }
   cur_epoch = NEPOCH-2;
 }
@@ -193,7 +248,7 @@ gc_state::dequeue(gc_handle *h)
 // Free the elements in delayed-free list r (from epoch epoch).
 // Runs without holding _lock
 int
-gc_state::gc_free(rcu_freed *r, u64 epoch)
+gc_state::gc_free(rcu_freed *r, u64 epoch, u64 *nbytes)
 {
   int nfree = 0;
   rcu_freed *nr;
@@ -206,6 +261,7 @@ gc_state::gc_free(rcu_freed *r, u64 epoch)
       assert(0);
     }
     nr = r->_rcu_next;
+    *nbytes += r->_rcu_size;
     r->do_gc();
     nfree++;
   }
@@ -224,16 +280,22 @@ gc_state::do_gc(void)
   // free all delayed-free lists until min_epoch
   for (i = nexttofree_epoch; i < min_epoch; i++) {
     rcu_freed *head = delayed[i%NEPOCH].head;
+    if (head)
+      stat->max_latency_ns = std::max(stat->max_latency_ns,
+                                      nsectime() - delayed[i%NEPOCH].first_ns);
 
     // give up lock during free; gc_free() may call gc_begin/end_epoch
     release(&lock_);
 
-    int nfree = gc_free(head,i);
+    u64 nbytes = 0;
+    int nfree = gc_free(head, i, &nbytes);
 
     acquire(&lock_);
     delayed[i%NEPOCH].head = nullptr;
+    delayed[i%NEPOCH].nbytes = 0;
     delayed[i%NEPOCH].epoch += NEPOCH;
     stat->nfree += nfree;
+    stat->nbytes_free += nbytes;
     if (gc_debug && nfree > 0) {
       cprintf("%d: epoch %lu freed %d\n", mycpu()->id, i, nfree);
     }
@@ -242,8 +304,46 @@ gc_state::do_gc(void)
   nexttofree_epoch = i;
 
   // try to increment global_epoch
-  if (gc_global) gc_inc_global_epoch();
-  else inc_cur_epoch();
+  if (gc_global) {
+    update_group();
+    gc_inc_global_epoch();
+  } else {
+    inc_cur_epoch();
+  }
+}
+
+// Start an expedited grace period, unless one already covers everything
+// delayed so far.  An object delayed in epoch e is freed once every core's
+// nexttofree_epoch passes e, which the epoch can only advance to e+4 after.
+static void
+gc_expedite(void)
+{
+  u64 target = (gc_global ? global_epoch : gc_states[0].cur_epoch) + 4;
+  u64 cur = expedite_epoch;
+  do {
+    if (cur >= target)
+      return;
+  } while (!expedite_epoch.compare_exchange_weak(cur, target));
+
+  stat[myid()].nexpedite++;
+  for (int i = 0; i < ncpu; i++)
+    gc_states[i].cv.wake_all();
+}
+
+// Under memory pressure, start freeing the delayed objects now rather than
+// at the next GCINTERVAL.  They aren't pages, but most are at least
+// partially backed by pages that will come back within a few ticks.
+static u64
+gc_shrink(u64 npages)
+{
+  u64 pending = 0;
+  for (int c = 0; c < ncpu; c++)
+    if (stat[c].ndelay > stat[c].nfree)
+      pending += stat[c].ndelay - stat[c].nfree;
+  if (!pending)
+    return 0;
+  gc_expedite();
+  return std::min(pending, npages);
 }
 
 static void
@@ -254,8 +354,10 @@ gc_worker(void *x)
 
   acquire(&gc_states->lock_);
   for (;;) {
+    u64 epoch = gc_global ? global_epoch : gc_states->cur_epoch;
+    u64 interval = epoch < expedite_epoch ? QUANTUM : GCINTERVAL;
     gc_states->cv.sleep_to(&gc_states->lock_,
-                          nsectime() + ((u64)GCINTERVAL)*1000000ull);
+                          nsectime() + interval*1000000ull);
 
     // if no processes are running on this core, update min_epoch
     if (gc_states->proclist.next == &gc_states->proclist) {
@@ -288,6 +390,47 @@ readstat(mdev*, char *dst, u32 off, u32 n)
   return n;
 }
 
+// A text summary of the delayed frees and of refcache's review lists,
+// for telling whether memory is going to objects waiting to be freed.
+// For each core, /dev/rcustats shows the bytes waiting on each of its
+// delayed-free lists (by epoch) and how long the oldest has waited, the
+// totals so far, and the longest any list waited to be freed.
+static int
+rcustatsread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  u64 now = nsectime();
+
+  s.println("gc epoch ", gc_global ? global_epoch.load() : gc_states[0].cur_epoch.load(),
+            ", expedite to ", expedite_epoch.load(),
+            ", GCINTERVAL ", GCINTERVAL, " ms, batch ", gc_batchsize);
+  s.println("cpu pending-bytes-by-epoch oldest-ms delayed freed delayed-bytes"
+            " freed-bytes max-latency-ms expedited");
+  for (int c = 0; c < ncpu; c++) {
+    gc_state *gs = &gc_states[c];
+    s.print(c);
+    u64 oldest = 0;
+    {
+      scoped_acquire l(&gs->lock_);
+      for (u64 e = gs->nexttofree_epoch; e < gs->nexttofree_epoch + NEPOCH; e++) {
+        headinfo *h = &gs->delayed[e % NEPOCH];
+        if (h->epoch != e)
+          continue;
+        s.print(" ", h->nbytes, "@", e);
+        if (h->head && !oldest)
+          oldest = now - h->first_ns;
+      }
+    }
+    s.println(" ", oldest / 1000000, " ", stat[c].ndelay, " ", stat[c].nfree,
+              " ", stat[c].nbytes_delay, " ", stat[c].nbytes_free,
+              " ", stat[c].max_latency_ns / 1000000, " ", stat[c].nexpedite);
+  }
+
+  s.println();
+  refcache::print_stats(&s);
+  return s.get_used();
+}
+
 static int
 writectrl(mdev*, const char *buf, u32 n)
 {
@@ -309,16 +452,54 @@ initgc(void)
 {
   ngc_cpu = ncpu;
   global_epoch = NEPOCH-2;
-  gc_batchsize = 100000000;
+  expedite_epoch = 0;
+  gc_batchsize = GC_BATCH;
+
+  // Build the scheme 2a groups, NUMA node by NUMA node.
+  for (int c = 0; c < ncpu; c++)
+    gc_states[c].group = -1;
+  for (auto &node : numa_nodes) {
+    gc_group *g = nullptr;
+    for (int c : node.cpuids) {
+      if (c >= ncpu)
+        continue;
+      if (!g || g->ncpu == GC_FANOUT) {
+        g = &gc_groups[ngc_groups++];
+        g->mincpu = c;
+      }
+      g->mincpu = std::min(g->mincpu, c);
+      g->cpus[g->ncpu++] = c;
+      gc_states[c].group = g - gc_groups;
+    }
+  }
+  for (int c = 0; c < ncpu; c++) {
+    if (gc_states[c].group != -1)
+      continue;
+    gc_group *g = ngc_groups ? &gc_groups[ngc_groups - 1] : nullptr;
+    if (!g || g->ncpu == GC_FANOUT) {
+      g = &gc_groups[ngc_groups++];
+      g->mincpu = c;
+    }
+    g->mincpu = std::min(g->mincpu, c);
+    g->cpus[g->ncpu++] = c;
+    gc_states[c].group = g - gc_groups;
+  }
+  for (int g = 0; g < ngc_groups; g++) {
+    gc_groups[g].nexttofree_epoch = 0;
+    gc_groups[g].min_epoch = 0;
+  }
 
   devsw[MAJ_GC].write = writectrl;
   devsw[MAJ_GC].pread = readstat;
+  devsw[MAJ_RCUSTATS].pread = rcustatsread;
 
   for (int c = 0; c < ncpu; c++) {
     char namebuf[32];
     snprintf(namebuf, sizeof(namebuf), "gc_%u", c);
     threadpin(gc_worker, 0, namebuf, c);
   }
+
+  register_shrinker("gc delayed frees", SHRINK_DATA_CACHES, gc_shrink);
 }
 
 void
@@ -349,10 +530,15 @@ gc_delayed(rcu_freed *e)
     if (c >= ngc_cpu) return;
     panic("gc_delayed");
   }
+  headinfo *h = &gs->delayed[epoch % NEPOCH];
   stat[c].ndelay++;
+  stat[c].nbytes_delay += e->_rcu_size;
+  if (!h->head)
+    h->first_ns = nsectime();
+  h->nbytes += e->_rcu_size;
   e->_rcu_epoch = epoch;
-  e->_rcu_next = gs->delayed[epoch % NEPOCH].head;
-  gs->delayed[epoch % NEPOCH].head = e;
+  e->_rcu_next = h->head;
+  h->head = e;
 }
 
 void
@@ -389,26 +575,24 @@ gc_end_epoch(void)
   assert (c >= 0 && c < ncpu);
   struct gc_state *gs = &gc_states[c];
 
-  scoped_acquire x(&gs->lock_);
+  {
+    scoped_acquire x(&gs->lock_);
 
-  mtrcuend();
-  gc_states[c].dequeue(myproc()->gc);
-  myproc()->gc->core = -1;
+    mtrcuend();
+    gc_states[c].dequeue(myproc()->gc);
+    myproc()->gc->core = -1;
 
-  if (stat[c].ndelay - stat[c].lastwake >= gc_batchsize) {
+    if (stat[c].ndelay - stat[c].lastwake < gc_batchsize)
+      return;
     stat[c].lastwake = stat[c].ndelay;
-    // calling gs->do_gc() works for gcbench, because gcbench threads are pinned
-    // to a core.  do_gc is correct when it uses one core's gc_state, so better
-    // to wakeup this core's gc thread, and yield the core to it.
-    gs->cv.wake_all(true);
   }
+  // This core's gc thread can only free the batch once every core has
+  // passed through enough epochs, so get all of them going.
+  gc_expedite();
 }
 
 void
 gc_wakeup(void)
 {
-  // cprintf("%d: wakeup gcc thread\n", mycpu()->id);
-  for (int i = 0; i < ncpu; i++) {
-    gc_states[i].cv.wake_all();
-  }
+  gc_expedite();
 }
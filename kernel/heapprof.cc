@@ -1,7 +1,15 @@
+#include "types.h"
+#include "kernel.hh"
 #include "heapprof.hh"
 #include "ilist.hh"
 #include "kstream.hh"
 #include "percpu.hh"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "log2.hh"
+#include "file.hh"
+#include "major.h"
+#include "rnd.hh"
 
 #include <algorithm>
 #include <vector>
@@ -70,7 +78,7 @@ struct heap_profile
 struct heap_profile_array
 {
 #if KERNEL_HEAP_PROFILE
-  heap_profile arena[3];
+  heap_profile arena[HEAP_PROFILE_NEWARRAY + 1];
 #else
   heap_profile arena[0];
 #endif
@@ -172,3 +180,286 @@ heap_profile_print(print_stream *s)
     s->println("KERNEL_HEAP_PROFILE is not set");
   }
 }
+
+//
+// Sampling heap profiler
+//
+
+#if KERNEL_HEAP_SAMPLE
+
+static const char *const arena_names[HEAP_PROFILE_NARENAS] = {
+  "kalloc", "kmalloc", "new[]", "kmem_cache"
+};
+
+namespace {
+  enum {
+    // Number of call sites that can be tracked, and of sampled
+    // allocations that can be live at once.  Both are powers of two.
+    NSITES = 1024,
+    NSAMPLES = 8192,
+    // A sampled allocation lives in one of the slots of the cache-line
+    // sized group its address hashes to.
+    GROUP = 8,
+  };
+
+  struct site
+  {
+    const void *rip;
+    heap_profile_arena arena;
+    // Estimated bytes: live now, the most that were live at once, and
+    // allocated in all since the last reset.
+    std::atomic<s64> live;
+    std::atomic<s64> peak;
+    std::atomic<u64> allocated;
+  };
+
+  struct sample
+  {
+    site *s;
+    heap_profile_arena arena;
+    u64 weight;
+  };
+
+  // Bytes to allocate on a CPU before taking the next sample.
+  struct sample_countdown
+  {
+    s64 left;
+  };
+
+  site sites[NSITES];
+  spinlock sites_lock("heap_sample sites");
+
+  std::atomic<uptr> sample_keys[NSAMPLES] __mpalign__;
+  sample samples[NSAMPLES];
+  std::atomic<u64> nsamples, ndropped;
+
+  std::atomic<u64> sample_interval(KERNEL_HEAP_SAMPLE);
+  std::atomic<u64> reset_time;
+}
+
+DEFINE_PERCPU(sample_countdown, sample_countdowns, NO_INT);
+
+// Return -ln(v / 2^32) in 16.16 fixed point, for 0 < v < 2^32.  (The
+// kernel can't use floating point.)
+static u64
+neg_ln(u32 v)
+{
+  int ip = floor_log2(v);
+  // Normalize v to [1, 2) in 1.31 fixed point and square it repeatedly
+  // to get the bits of the fractional part of log2(v).
+  u64 x = (u64)v << (31 - ip);
+  u64 frac = 0;
+  for (int i = 0; i < 16; i++) {
+    x = (x * x) >> 31;
+    frac <<= 1;
+    if (x >= (1ull << 32)) {
+      x >>= 1;
+      frac |= 1;
+    }
+  }
+  u64 neg_log2 = ((u64)(32 - ip) << 16) - frac;
+  // ln(2) in 16.16 fixed point.
+  return (neg_log2 * 45426) >> 16;
+}
+
+// The number of bytes until the next sample: exponentially distributed,
+// so that samples form a Poisson process over the bytes allocated.
+static s64
+next_interval(u64 interval)
+{
+  u32 v = (u32)(rnd() >> 32);
+  if (v == 0)
+    v = 1;
+  return std::max((s64)((interval * neg_ln(v)) >> 16), (s64)1);
+}
+
+static site *
+find_site(heap_profile_arena arena, const void *rip)
+{
+  u64 h = ((uptr)rip * 0x9e3779b97f4a7c15ull + arena) >> 32;
+  for (u64 i = 0; i < NSITES; i++) {
+    site *s = &sites[(h + i) % NSITES];
+    // rip is set last, under sites_lock, so a non-null rip means the
+    // site is complete.
+    const void *srip = __atomic_load_n(&s->rip, __ATOMIC_ACQUIRE);
+    if (srip == rip && s->arena == arena)
+      return s;
+    if (srip == nullptr) {
+      auto l = sites_lock.guard();
+      if (s->rip == nullptr) {
+        s->arena = arena;
+        __atomic_store_n(&s->rip, rip, __ATOMIC_RELEASE);
+        return s;
+      }
+      if (s->rip == rip && s->arena == arena)
+        return s;
+    }
+  }
+  return nullptr;
+}
+
+static u64
+sample_group(void *p)
+{
+  return ((((uptr)p >> 3) * 0x9e3779b97f4a7c15ull) >> 32) % (NSAMPLES / GROUP)
+    * GROUP;
+}
+
+void
+heap_sample_alloc(heap_profile_arena arena, const void *rip, void *p,
+                  size_t bytes)
+{
+  u64 interval = sample_interval.load(std::memory_order_relaxed);
+  if (!interval)
+    return;
+
+  // Count the sample points that fall in this allocation.  Each stands
+  // for interval bytes, which makes the estimates unbiased.
+  u64 npoints = 0;
+  {
+    scoped_cli cli;
+    s64 &left = sample_countdowns->left;
+    left -= bytes;
+    if (left > 0)
+      return;
+    while (left <= 0) {
+      left += next_interval(interval);
+      npoints++;
+    }
+  }
+  u64 weight = npoints * interval;
+
+  site *s = find_site(arena, rip);
+  if (!s) {
+    ndropped++;
+    return;
+  }
+
+  u64 g = sample_group(p);
+  for (u64 i = g; i < g + GROUP; i++) {
+    uptr expected = 0;
+    if (sample_keys[i].compare_exchange_strong(expected, (uptr)p)) {
+      samples[i].s = s;
+      samples[i].arena = arena;
+      samples[i].weight = weight;
+      nsamples++;
+
+      s->allocated += weight;
+      s64 live = (s->live += weight);
+      s64 peak = s->peak.load(std::memory_order_relaxed);
+      while (live > peak && !s->peak.compare_exchange_weak(peak, live))
+        ;
+      return;
+    }
+  }
+  ndropped++;
+}
+
+void
+heap_sample_free(heap_profile_arena arena, void *p)
+{
+  if (nsamples.load(std::memory_order_relaxed) == 0)
+    return;
+
+  u64 g = sample_group(p);
+  for (u64 i = g; i < g + GROUP; i++) {
+    if (sample_keys[i].load(std::memory_order_relaxed) != (uptr)p ||
+        samples[i].arena != arena)
+      continue;
+    samples[i].s->live -= samples[i].weight;
+    nsamples--;
+    sample_keys[i].store(0, std::memory_order_release);
+    return;
+  }
+}
+
+static int
+heapprofread(mdev*, char *dst, u32 off, u32 n)
+{
+  static spinlock print_lock("heapprofread");
+  static site *sorted[NSITES];
+
+  window_stream s(dst, off, n);
+  auto l = print_lock.guard();
+
+  u64 secs = std::max((nsectime() - reset_time.load()) / 1000000000, 1ul);
+  s.println("Sample interval: ", sample_interval.load(), " bytes");
+  s.println("Live samples: ", nsamples.load(), ", dropped: ", ndropped.load());
+
+  for (int arena = 0; arena < HEAP_PROFILE_NARENAS; arena++) {
+    size_t nsorted = 0;
+    for (auto &site : sites)
+      if (__atomic_load_n(&site.rip, __ATOMIC_ACQUIRE) && site.arena == arena)
+        sorted[nsorted++] = &site;
+    if (!nsorted)
+      continue;
+    std::sort(sorted, sorted + nsorted, [](site *a, site *b) {
+        return a->live.load() > b->live.load();
+      });
+
+    s.println();
+    s.println(arena_names[arena], " (live bytes, peak bytes, bytes/sec):");
+    s64 total = 0;
+    for (size_t i = 0; i < nsorted; i++) {
+      site *st = sorted[i];
+      total += st->live.load();
+      if (i < 20)
+        s.println("  ", st->rip, " ", st->live.load(), " ", st->peak.load(),
+                  " ", st->allocated.load() / secs);
+    }
+    s.println("  Total: ", total, " bytes live in ", nsorted, " sites");
+  }
+
+  if (KERNEL_HEAP_PROFILE) {
+    s.println();
+    heap_profile_print(&s);
+  }
+  return s.get_used();
+}
+
+// Usage:
+// To sample once every 64KB allocated on average, do:
+// $ echo 65536 > /dev/heapprof
+//
+// To stop sampling, do:
+// $ echo 0 > /dev/heapprof
+//
+// To restart the peak and allocation rate statistics, do:
+// $ echo reset > /dev/heapprof
+static int
+heapprofwrite(mdev*, const char *buf, u32 n)
+{
+  if (n >= 5 && strncmp(buf, "reset", 5) == 0) {
+    for (auto &site : sites) {
+      site.peak = site.live.load();
+      site.allocated = 0;
+    }
+    reset_time = nsectime();
+    return n;
+  }
+
+  u64 interval = 0;
+  u32 i;
+  for (i = 0; i < n && buf[i] >= '0' && buf[i] <= '9'; i++)
+    interval = interval * 10 + (buf[i] - '0');
+  if (i == 0 || (i < n && buf[i] != '\n')) {
+    cprintf("heapprof: invalid sample interval\n");
+    return n;
+  }
+  sample_interval = interval;
+  return n;
+}
+
+void
+initheapprof(void)
+{
+  reset_time = nsectime();
+  devsw[MAJ_HEAPPROF].pread = heapprofread;
+  devsw[MAJ_HEAPPROF].write = heapprofwrite;
+}
+#else
+void
+initheapprof(void)
+{
+}
+#endif
@@ -15,6 +15,9 @@
 #include "kstats.hh"
 #include "cpuid.hh"
 #include "vmalloc.hh"
+#include "percpu.hh"
+
+#include <algorithm>
 
 using namespace std;
 
@@ -58,7 +61,7 @@ private:
     if (level != 0) {
       for (int i = 0; i < end; i++) {
         pme_t entry = e[i].load(memory_order_relaxed);
-        if (entry & PTE_P)
+        if ((entry & PTE_P) && !(entry & PTE_PS))
           ((pgmap*) p2v(PTE_ADDR(entry)))->free(level - 1);
       }
     }
@@ -74,7 +77,7 @@ private:
     if (level != 0) {
       for (int i = 0; i < end; i++) {
         pme_t entry = e[i].load(memory_order_relaxed);
-        if (entry & PTE_P)
+        if ((entry & PTE_P) && !(entry & PTE_PS))
           count += ((pgmap*) p2v(PTE_ADDR(entry)))->internal_pages(level - 1);
       }
     }
@@ -112,13 +115,15 @@ public:
     return pml4;
   }
 
-  // Make this page table active on this CPU.
-  void switch_to()
+  // Make this page table active on this CPU, under PCID pcid (which
+  // may include CR3_NOFLUSH).
+  void switch_to(u64 pcid = 0)
   {
     auto nreq = tlbflush_req.load();
     u64 cr3 = v2p(this);
-    lcr3(cr3);
-    mycpu()->tlbflush_done = nreq;
+    lcr3(cr3 | pcid);
+    if (!(pcid & CR3_NOFLUSH))
+      mycpu()->tlbflush_done = nreq;
     mycpu()->tlb_cr3 = cr3;
   }
 
@@ -140,11 +145,13 @@ public:
     int level;
 
     // The actual level resolve() was able to reach.  If <tt>reached
-    // > level<tt> then @c cur will be null.  If <tt>reached ==
-    // level</tt>, then @c cur will be non-null.
+    // > level<tt> then @c cur will be null, unless the walk ended at a
+    // large page (PTE_PS) entry on level @c reached, in which case @c
+    // cur is the pgmap containing it.  If <tt>reached == level</tt>,
+    // then @c cur will be non-null.
     int reached;
 
-    // The pgmap containing @c va on level @c level.  As long as the
+    // The pgmap containing @c va on level @c reached.  As long as the
     // iterator moves within this pgmap, we don't have to re-walk the
     // page structure tree.
     struct pgmap *cur;
@@ -168,7 +175,11 @@ public:
         atomic<pme_t> *entryp = &cur->e[PX(reached, va)];
         pme_t entry = entryp->load(memory_order_relaxed);
       retry:
-        if (entry & PTE_P) {
+        if ((entry & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+          // A large page maps va on this level; there's nothing
+          // below it.
+          break;
+        } else if (entry & PTE_P) {
           cur = (pgmap*) p2v(PTE_ADDR(entry));
         } else if (!create) {
           cur = nullptr;
@@ -230,9 +241,11 @@ public:
     // Create this entry if it doesn't already exist.  Any created
     // directory entries will have flags <tt>flags|PTE_P|PTE_W</tt>.
     // After this, exists() will be true (though is_set() will only be
-    // set if is_set() was already true).
+    // set if is_set() was already true).  This must not be called if
+    // is_large() is true.
     iterator &create(pme_t flags)
     {
+      assert(!is_large());
       if (!cur)
         resolve(flags | PTE_P | PTE_W);
       return *this;
@@ -245,6 +258,14 @@ public:
       return cur;
     }
 
+    // Return true if va is mapped by a large page entry above this
+    // iterator's level.  In this case, operator* returns that entry
+    // and span() covers the rest of the large page.
+    bool is_large() const
+    {
+      return cur && reached > level;
+    }
+
     // Return true if this entry both exists and is marked present.
     bool is_set() const
     {
@@ -255,12 +276,12 @@ public:
     // operation is only legal if exists() is true.
     atomic<pme_t> &operator*() const
     {
-      return cur->e[PX(level, va)];
+      return cur->e[PX(reached, va)];
     }
 
     atomic<pme_t> *operator->() const
     {
-      return &cur->e[PX(level, va)];
+      return &cur->e[PX(reached, va)];
     }
 
     // Increment the iterator by @c x.
@@ -288,6 +309,11 @@ static_assert(sizeof(pgmap) == PGSIZE, "!(sizeof(pgmap) == PGSIZE)");
 
 extern pgmap kpml4;
 static atomic<uintptr_t> kvmallocpos;
+// Whether the per-core page tables get PCIDs (see
+// mmu_per_core_page_table::pcid_table), and whether their entries can
+// be shot down with INVPCID when they aren't loaded.  Everything else
+// runs as PCID 0.
+static bool use_pcid, use_invpcid;
 
 // Create a direct mapping starting at PA 0 to VA KBASE up to
 // KBASEEND.  This augments the KCODE mapping created by the
@@ -329,10 +355,15 @@ initpg(void)
       assert(!it.is_set());
     }
     kvmallocpos = KVMALLOC;
+
+    use_pcid = VM_PCIDS && cpuid::features().pcid;
+    use_invpcid = use_pcid && cpuid::features().invpcid;
   }
 
   // Enable global pages.  This has to happen on every core.
   lcr4(rcr4() | CR4_PGE);
+  if (use_pcid)
+    lcr4(rcr4() | CR4_PCIDE);
 }
 
 // Clean up mappings that were only required during early boot.
@@ -351,7 +382,7 @@ safe_read_hw(void *dst, uintptr_t src, size_t n)
   struct mypgmap
   {
     pme_t e[PGSIZE / sizeof(pme_t)];
-  } *pml4 = (struct mypgmap*)p2v(rcr3());
+  } *pml4 = (struct mypgmap*)p2v(rcr3() & ~CR3_PCID_MASK);
   for (size_t i = 0; i < n; ++i) {
     uintptr_t va = src + i;
     void *obj = pml4;
@@ -412,6 +443,99 @@ inittls(struct cpu *c)
   c->proc = nullptr;
 }
 
+// vmalloc_free() can't reuse the KVMALLOC space or the pages it unmaps
+// until the stale (global) TLB entries for them are gone from every core.
+// Rather than a shootdown per free, each core puts what it frees on a lazy
+// list, and once the lazy lists hold enough pages, one global TLB flush
+// releases all of them: the pages go back to kalloc and the ranges to the
+// freeing cores' caches, from which vmalloc_raw() reuses ranges of the
+// same size.
+namespace {
+  // A range of KVMALLOC space, with at least a page of unmapped guard
+  // space on either side.
+  struct vmalloc_range
+  {
+    uintptr_t base;
+    size_t bytes;
+  };
+
+  struct vmalloc_cache
+  {
+    spinlock lock;
+    vmalloc_range clean[VMALLOC_CACHE_RANGES];
+    size_t nclean;
+
+    // Freed but maybe still in some TLB.  Entries are only appended, so a
+    // flush releases a prefix of these.
+    vmalloc_range lazy[VMALLOC_LAZY_PAGES];
+    size_t nlazy;
+    void *lazy_pages[VMALLOC_LAZY_PAGES];
+    size_t nlazy_pages;
+
+    vmalloc_cache()
+      : lock("vmalloc_cache"), nclean(0), nlazy(0), nlazy_pages(0) { }
+  };
+
+  percpu<vmalloc_cache> vmalloc_caches;
+  spinlock vmalloc_flush_lock("vmalloc_flush");
+}
+
+// Flush every core's TLB, including global entries, and release the
+// pages and ranges that were on the lazy lists before the flush started.
+// The caller must not hold any spinlocks or have interrupts disabled,
+// since other cores must be able to take the flush IPI.
+static void
+vmalloc_flush_lazy(void)
+{
+  auto fl = vmalloc_flush_lock.guard();
+
+  size_t nranges[NCPU], npages[NCPU];
+  for (int i = 0; i < ncpu; i++) {
+    auto l = vmalloc_caches[i].lock.guard();
+    nranges[i] = vmalloc_caches[i].nlazy;
+    npages[i] = vmalloc_caches[i].nlazy_pages;
+  }
+  fl.release();
+
+  bitset<NCPU> targets;
+  for (int i = 0; i < ncpu; i++)
+    targets.set(i);
+  kstats::inc(&kstats::vmalloc_flush_count);
+  kstats::inc(&kstats::tlb_shootdown_count);
+  kstats::inc(&kstats::tlb_shootdown_targets, (u64)ncpu);
+  {
+    kstats::timer timer(&kstats::tlb_shootdown_cycles);
+    run_on_cpus(targets, []() {
+        u64 cr4 = rcr4();
+        lcr4(cr4 & ~CR4_PGE);
+        lcr4(cr4);
+      });
+  }
+
+  void *pages[VMALLOC_LAZY_PAGES];
+  for (int i = 0; i < ncpu; i++) {
+    auto &c = vmalloc_caches[i];
+    size_t n;
+    {
+      auto l = c.lock.guard();
+      // Someone else's flush may have released some of these already.
+      size_t nr = std::min(nranges[i], c.nlazy);
+      for (size_t j = 0; j < nr && c.nclean < VMALLOC_CACHE_RANGES; j++)
+        c.clean[c.nclean++] = c.lazy[j];
+      c.nlazy -= nr;
+      memmove(c.lazy, c.lazy + nr, c.nlazy * sizeof(c.lazy[0]));
+
+      n = std::min(npages[i], c.nlazy_pages);
+      memmove(pages, c.lazy_pages, n * sizeof(pages[0]));
+      c.nlazy_pages -= n;
+      memmove(c.lazy_pages, c.lazy_pages + n,
+              c.nlazy_pages * sizeof(c.lazy_pages[0]));
+    }
+    for (size_t j = 0; j < n; j++)
+      kfree(pages[j]);
+  }
+}
+
 // Allocate 'bytes' bytes in the KVMALLOC area, surrounded by at least
 // 'guard' bytes of unmapped memory.  This memory must be freed with
 // vmalloc_free.
@@ -427,12 +551,30 @@ vmalloc_raw(size_t bytes, size_t guard, const char *name)
   if (guard < PGSIZE)
     guard = PGSIZE;
 
-  uintptr_t base = guard + kvmallocpos.fetch_add(bytes + guard * 2);
-  if (base + bytes + guard >= KVMALLOCEND)
-    // Egads, we ran out of KVMALLOC space?!  Ideally, we would
-    // recycle KVMALLOC space and perform a TLB shootdown, but other
-    // things will surely break long before this does.
-    panic("vmalloc: out of KVMALLOC space (recycling not implemented)");
+  // Freed ranges are only known to have a page of guard space, so
+  // they can only be reused by allocations that ask for no more.
+  uintptr_t base = 0;
+  if (guard == PGSIZE) {
+    auto &c = *vmalloc_caches.get_unchecked();
+    auto l = c.lock.guard();
+    for (size_t i = 0; i < c.nclean; i++) {
+      if (c.clean[i].bytes == bytes) {
+        base = c.clean[i].base;
+        c.clean[i] = c.clean[--c.nclean];
+        kstats::inc(&kstats::vmalloc_reuse_count);
+        break;
+      }
+    }
+  }
+
+  if (!base) {
+    base = guard + kvmallocpos.fetch_add(bytes + guard * 2);
+    if (base + bytes + guard >= KVMALLOCEND)
+      // Egads, we ran out of KVMALLOC space?!  Only ranges that match
+      // the size of a freed range are reused, but other things will
+      // surely break long before this does.
+      panic("vmalloc: out of KVMALLOC space");
+  }
 
   for (auto it = kpml4.find(base); it.index() < base + bytes; it += it.span()) {
     void *page = kalloc(name);
@@ -447,7 +589,8 @@ vmalloc_raw(size_t bytes, size_t guard, const char *name)
 
 // Free vmalloc'd memory at ptr.  Note that this *lazily* unmaps this
 // area from KVMALLOC space, so this area may remain effectively
-// mapped until some indeterminate point in the future.
+// mapped until the next global TLB flush, which this triggers once
+// this core's lazy list is full.
 void
 vmalloc_free(void *ptr)
 {
@@ -456,16 +599,55 @@ vmalloc_free(void *ptr)
   if ((uintptr_t)ptr < KVMALLOC || (uintptr_t)ptr >= KVMALLOCEND)
     panic("vmalloc_free: ptr %p is not in KVMALLOC space", ptr);
 
-  // Free and unmap until we reach the guard space.
+  // We can only send the flush IPI if other cores can take it while we
+  // wait, and we can't wait with interrupts disabled.
+  bool can_flush = mycpu()->ncli == 0;
+
+  // Unmap until we reach the guard space, putting the pages on the lazy
+  // list.
+  size_t bytes = 0;
   for (auto it = kpml4.find((uintptr_t)ptr); it.is_set(); it += it.span()) {
-    kfree(p2v(PTE_ADDR(*it)));
+    void *page = p2v(PTE_ADDR(*it));
     *it = 0;
+    bytes += PGSIZE;
+
+    bool full;
+    {
+      auto &c = *vmalloc_caches.get_unchecked();
+      auto l = c.lock.guard();
+      full = c.nlazy_pages == VMALLOC_LAZY_PAGES;
+      if (!full)
+        c.lazy_pages[c.nlazy_pages++] = page;
+    }
+    if (full) {
+      if (can_flush) {
+        vmalloc_flush_lazy();
+      } else {
+        // Give up on deferring this page.  Nothing should still be using
+        // it, although a stale TLB entry may remain.
+        kfree(page);
+        continue;
+      }
+      auto &c = *vmalloc_caches.get_unchecked();
+      auto l = c.lock.guard();
+      c.lazy_pages[c.nlazy_pages++] = page;
+    }
   }
   mtunlabel(mtrace_label_heap, ptr);
 
-  // XXX Should release unused page table pages.  This requires a
-  // global TLB shootdown, so we should only do it in large-ish
-  // batches.
+  bool flush;
+  {
+    auto &c = *vmalloc_caches.get_unchecked();
+    auto l = c.lock.guard();
+    if (c.nlazy < VMALLOC_LAZY_PAGES)
+      c.lazy[c.nlazy++] = vmalloc_range{(uintptr_t)ptr, bytes};
+    flush = c.nlazy_pages >= VMALLOC_LAZY_PAGES || c.nlazy == VMALLOC_LAZY_PAGES;
+  }
+  if (flush && can_flush)
+    vmalloc_flush_lazy();
+
+  // XXX Should release unused page table pages.  This would be a good
+  // time to do it, right after a global TLB flush.
 }
 
 void
@@ -475,7 +657,7 @@ batched_shootdown::perform() const
     return;
 
   u64 myreq = ++tlbflush_req;
-  u64 cr3 = rcr3();
+  u64 cr3 = rcr3() & ~CR3_PCID_MASK;
 
   // the caller may not hold any spinlock, because other CPUs might
   // be spinning waiting for that spinlock, with interrupts disabled,
@@ -485,12 +667,12 @@ batched_shootdown::perform() const
   kstats::inc(&kstats::tlb_shootdown_count);
   kstats::timer timer(&kstats::tlb_shootdown_cycles);
 
-  for (int i = 0; i < ncpu; i++) {
-    if (cpus[i].tlb_cr3 == cr3 && cpus[i].tlbflush_done < myreq) {
-      lapic->send_tlbflush(&cpus[i]);
-      kstats::inc(&kstats::tlb_shootdown_targets);
-    }
-  }
+  bitset<NCPU> targets;
+  for (int i = 0; i < ncpu; i++)
+    if (cpus[i].tlb_cr3 == cr3 && cpus[i].tlbflush_done < myreq)
+      targets.set(i);
+  kstats::inc(&kstats::tlb_shootdown_targets, targets.count());
+  lapic->send_ipi_many(targets, T_TLBFLUSH);
 
   for (int i = 0; i < ncpu; i++)
     while (cpus[i].tlb_cr3 == cr3 && cpus[i].tlbflush_done < myreq)
@@ -563,6 +745,55 @@ core_tracking_shootdown::perform() const
   run_on_cpus(targets, [this]() { clear_tlb(); });
 }
 
+// Map the 4K page at va in pml4 to pte.  If va is covered by a huge
+// page mapping, that gets dropped first, so the rest of the huge page
+// will fault back in.  This only happens when the pages behind the
+// huge mapping haven't changed (otherwise it would have been
+// invalidated), so other cores' TLB entries for it remain correct.
+static void
+insert_pte(pgmap *pml4, uintptr_t va, pme_t pte)
+{
+  auto it = pml4->find(va);
+  if (it.is_large()) {
+    it->store(0, memory_order_relaxed);
+    invlpg((void*)va);
+    it = pml4->find(va);
+  }
+  it.create(PTE_U)->store(pte, memory_order_relaxed);
+}
+
+// Map the huge page at va (which must be HUGE_PGSIZE aligned) in pml4
+// to pte.  This fails if a page table already covers va (say, because
+// the huge page was split), since its PTEs may still be in use or
+// cached by other cores.
+static bool
+insert_huge_pte(pgmap *pml4, uintptr_t va, pme_t pte)
+{
+  assert(va % HUGE_PGSIZE == 0);
+  auto it = pml4->find(va, pgmap::L_2M).create(PTE_U);
+  pme_t old = it->load(memory_order_relaxed);
+  if ((old & PTE_P) && !(old & PTE_PS))
+    return false;
+  it->store(pte | PTE_PS, memory_order_relaxed);
+  return true;
+}
+
+// Map the n pages from va in pml4 to ptes[0..n), skipping zero
+// entries.  The pages must all lie in the same page table, so this
+// walks the page table tree only once.  Pages covered by a huge page
+// mapping are left alone.
+static void
+insert_pte_batch(pgmap *pml4, uintptr_t va, const pme_t *ptes, size_t n)
+{
+  assert(PX(1, va) == PX(1, va + (n - 1) * PGSIZE));
+  auto it = pml4->find(va);
+  if (it.is_large())
+    return;
+  for (size_t i = 0; i < n; ++i, it += PGSIZE)
+    if (ptes[i])
+      it.create(PTE_U)->store(ptes[i], memory_order_relaxed);
+}
+
 namespace mmu_shared_page_table {
   page_map_cache::page_map_cache() : pml4(kpml4.kclone())
   {
@@ -580,7 +811,19 @@ namespace mmu_shared_page_table {
   void
   page_map_cache::__insert(uintptr_t va, pme_t pte)
   {
-    pml4->find(va).create(PTE_U)->store(pte, memory_order_relaxed);
+    insert_pte(pml4, va, pte);
+  }
+
+  bool
+  page_map_cache::__insert_huge(uintptr_t va, pme_t pte)
+  {
+    return insert_huge_pte(pml4, va, pte);
+  }
+
+  void
+  page_map_cache::__insert_batch(uintptr_t va, const pme_t *ptes, size_t n)
+  {
+    insert_pte_batch(pml4, va, ptes, n);
   }
 
   void
@@ -612,6 +855,33 @@ namespace mmu_shared_page_table {
 }
 
 namespace mmu_per_core_page_table {
+  static atomic<u64> next_cache_id(1);
+
+  // Each core tags the TLB entries of the last VM_PCIDS page_map_caches
+  // it switched to with PCIDs 1 to VM_PCIDS, so that switching back to
+  // one of them doesn't flush its entries.  owner[i] is the id_ of the
+  // cache that has PCID i + 1 on this core, or 0.  clear() keeps a
+  // PCID's entries in step with its page table even while it isn't
+  // loaded, or gives the PCID up.  Handing a PCID to a new owner
+  // flushes it, so the entries of an owner that has since been
+  // destroyed are never used.
+  struct pcid_table
+  {
+    u64 owner[VM_PCIDS];
+    unsigned next;
+  };
+  DEFINE_PERCPU(pcid_table, pcid_tables);
+
+  page_map_cache::page_map_cache()
+    : id_(next_cache_id++), lazy_lock_("page_map_cache::lazy", LOCKSTAT_VM),
+      lazy_gen_(0)
+  {
+    for (size_t i = 0; i < NCPU; ++i) {
+      pml4[i] = nullptr;
+      lazy_[i].pending = false;
+    }
+  }
+
   page_map_cache::~page_map_cache()
   {
     for (size_t i = 0; i < ncpu; ++i) {
@@ -625,17 +895,64 @@ namespace mmu_per_core_page_table {
     scoped_cli cli;
     auto mypml4 = *pml4;
     assert(mypml4);
-    mypml4->find(va).create(PTE_U)->store(pte, memory_order_relaxed);
+    insert_pte(mypml4, va, pte);
     t->tracker_cores.set(myid());
   }
 
+  bool
+  page_map_cache::__insert_huge(uintptr_t va, pme_t pte)
+  {
+    assert(check_critical(NO_SCHED));
+    auto mypml4 = *pml4;
+    assert(mypml4);
+    return insert_huge_pte(mypml4, va, pte);
+  }
+
+  void
+  page_map_cache::__insert_batch(uintptr_t va, const pme_t *ptes, size_t n)
+  {
+    assert(check_critical(NO_SCHED));
+    auto mypml4 = *pml4;
+    assert(mypml4);
+    insert_pte_batch(mypml4, va, ptes, n);
+  }
+
   void
   page_map_cache::switch_to() const
   {
     auto &mypml4 = *pml4;
     if (!mypml4)
       mypml4 = kpml4.kclone();
-    mypml4->switch_to();
+    else
+      do_lazy();
+    if (!use_pcid) {
+      mypml4->switch_to();
+      return;
+    }
+
+    if (u64 p = pcid()) {
+      kstats::inc(&kstats::tlb_pcid_hit_count);
+      mypml4->switch_to(p | CR3_NOFLUSH);
+      return;
+    }
+    pcid_table &t = *pcid_tables;
+    unsigned i = t.next;
+    t.next = (i + 1) % VM_PCIDS;
+    t.owner[i] = id_;
+    kstats::inc(&kstats::tlb_pcid_miss_count);
+    mypml4->switch_to(i + 1);
+  }
+
+  u64
+  page_map_cache::pcid() const
+  {
+    if (!use_pcid)
+      return 0;
+    const pcid_table &t = *pcid_tables;
+    for (int i = 0; i < VM_PCIDS; i++)
+      if (t.owner[i] == id_)
+        return i + 1;
+    return 0;
   }
 
   u64
@@ -654,7 +971,7 @@ namespace mmu_per_core_page_table {
   }
 
   void
-  page_map_cache::clear(uintptr_t start, uintptr_t end)
+  page_map_cache::clear(uintptr_t start, uintptr_t end) const
   {
     // Are we the current page_map_cache on this core?  (Depending on
     // MMU_SCHEME, *cur_page_map_cache may not be this type of
@@ -662,6 +979,9 @@ namespace mmu_per_core_page_table {
     // path.)
     bool current =
       (reinterpret_cast<const page_map_cache*>(*cur_page_map_cache) == this);
+    // If not, this core's TLB may still hold entries for us under our
+    // PCID.
+    u64 p = current ? 0 : pcid();
     pgmap *mypml4 = *pml4;
     // If we're clearing this CPU's page map cache, then we must have
     // inserted something into it previously.  (Note that this may
@@ -672,8 +992,101 @@ namespace mmu_per_core_page_table {
         it->store(0, memory_order_relaxed);
         if (current)
           invlpg((void*)it.index());
+        else if (p && use_invpcid)
+          invpcid(INVPCID_ADDR, p, (void*)it.index());
+      }
+    }
+    // Without INVPCID, the only way to reach those entries is to load
+    // the PCID, so give it up instead and let our next switch_to flush
+    // a new one.
+    if (p && !use_invpcid)
+      pcid_tables->owner[p - 1] = 0;
+  }
+
+  void
+  page_map_cache::do_lazy() const
+  {
+    lazy_clear &lc = lazy_[myid()];
+    if (!lc.pending.load(memory_order_relaxed))
+      return;
+    auto l = lazy_lock_.guard();
+    if (!lc.pending.load(memory_order_relaxed))
+      return;
+    clear(lc.start, lc.end);
+    lc.pending.store(false, memory_order_relaxed);
+  }
+
+  u64
+  page_map_cache::defer(const shootdown &sd)
+  {
+    if (sd.targets.none())
+      return 0;
+    assert(sd.cache == this);
+
+    auto l = lazy_lock_.guard();
+    u64 gen = ++lazy_gen_;
+    for (auto c : sd.targets) {
+      lazy_clear &lc = lazy_[c];
+      if (!lc.pending.load(memory_order_relaxed)) {
+        lc.start = sd.start;
+        lc.end = sd.end;
+        lc.first_gen = gen;
+        lc.pending.store(true, memory_order_relaxed);
+      } else {
+        lc.start = std::min(lc.start, sd.start);
+        lc.end = std::max(lc.end, sd.end);
       }
     }
+    kstats::inc(&kstats::tlb_lazy_count);
+    return gen;
+  }
+
+  u64
+  page_map_cache::lazy_horizon() const
+  {
+    auto l = lazy_lock_.guard();
+    u64 horizon = ~0ull;
+    for (int c = 0; c < ncpu; c++)
+      if (lazy_[c].pending.load(memory_order_relaxed))
+        horizon = std::min(horizon, lazy_[c].first_gen);
+    return horizon;
+  }
+
+  bool
+  page_map_cache::lazy_overlaps(uintptr_t start, uintptr_t end) const
+  {
+    auto l = lazy_lock_.guard();
+    for (int c = 0; c < ncpu; c++)
+      if (lazy_[c].pending.load(memory_order_relaxed) &&
+          lazy_[c].start < end && start < lazy_[c].end)
+        return true;
+    return false;
+  }
+
+  void
+  page_map_cache::flush_lazy()
+  {
+    bitset<NCPU> targets;
+    {
+      auto l = lazy_lock_.guard();
+      for (int c = 0; c < ncpu; c++)
+        if (lazy_[c].pending.load(memory_order_relaxed))
+          targets.set(c);
+    }
+    {
+      scoped_cli cli;
+      if (targets[myid()]) {
+        do_lazy();
+        targets.reset(myid());
+      }
+    }
+    if (targets.none())
+      return;
+
+    kstats::inc(&kstats::tlb_shootdown_count);
+    kstats::inc(&kstats::tlb_shootdown_targets, targets.count());
+    kstats::timer timer(&kstats::tlb_shootdown_cycles);
+    run_on_cpus(targets, [this]() { do_lazy(); });
   }
 
   void
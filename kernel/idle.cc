@@ -12,6 +12,7 @@
 #include "benchcodex.hh"
 #include "cpuid.hh"
 #include "ilist.hh"
+#include "refcache.hh"
 
 struct idle {
   struct proc *cur;
@@ -77,12 +78,9 @@ idleloop(void)
     myproc()->set_state(RUNNABLE);
     sched();
     finishzombies();
-    if (steal() == 0) {
-        // XXX(Austin) This will prevent us from immediately picking
-        // up work that's trying to push itself to this core (pinned
-        // thread).  Use an IPI to poke idle cores.
-        asm volatile("hlt");
-    }
+    refcache::maybe_flush();
+    if (steal() == 0 && !zalloc_idle())
+      sched_idle_wait();
   }
 }
 
@@ -0,0 +1,543 @@
+// Driver for the Intel 82576 (igb), a multi-queue gigabit NIC.
+//
+// Unlike e1000.cc, this gives each core its own pair of RX and TX
+// rings, up to the number of queues the device has.  Receive side
+// scaling hashes each incoming flow to one RX queue, and with MSI-X
+// each queue's interrupt goes to its own core, so a flow's packets are
+// received on the same core every time and different flows are spread
+// over all of them.  A core transmits on its own TX queue.  Each ring
+// has its own lock, and the driver keeps the tail pointers itself
+// instead of reading them back from the device.
+
+#include "types.h"
+#include "amd64.h"
+#include "kernel.hh"
+#include "cpu.hh"
+#include "pci.hh"
+#include "pcireg.hh"
+#include "spinlock.hh"
+#include "apic.hh"
+#include "irq.hh"
+#include "igbreg.hh"
+#include "kstream.hh"
+#include "netdev.hh"
+#include "netstat.hh"
+
+#define IGB_MAX_QUEUES 8
+#define TX_RING_SIZE 256
+#define RX_RING_SIZE 256
+
+static console_stream verbose(false);
+
+// The key from Microsoft's RSS specification, which spreads typical
+// addresses and ports well.
+static const u8 rss_key[IGB_RSSRK_SIZE] = {
+  0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+  0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+  0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+  0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+  0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+static const int igb_devids[] = {
+  0x10c9,                       // 82576 (copper), QEMU's igb model
+  0x10e6,                       // 82576 (fiber)
+  0x10e7,                       // 82576 (serdes)
+  0x10e8,                       // 82576 (quad copper)
+};
+
+class igb;
+
+// One RX ring and one TX ring, used by one core.
+struct igb_queue
+{
+  igb * const dev_;
+  const int id_;
+
+  struct spinlock rxlk_;
+  volatile struct igb_rxdesc *rxd_;
+  void *rxbuf_[RX_RING_SIZE];   // Buffer of each descriptor
+  u32 rxclean_;                 // Next descriptor to receive into
+  u32 rxtail_;                  // Our copy of RDT
+
+  struct spinlock txlk_ __mpalign__;
+  volatile struct wiseman_txdesc *txd_;
+  u32 txclean_;                 // Oldest descriptor not yet sent
+  u32 txtail_;                  // Our copy of TDT
+  u32 txinuse_;
+
+  igb_queue(igb *dev, int id);
+  igb_queue(const igb_queue &) = delete;
+  igb_queue &operator=(const igb_queue &) = delete;
+  NEW_DELETE_OPS(igb_queue);
+
+  void init_rx();
+  void init_tx();
+  void allocrx();
+  void cleanrx();
+  void cleantx_locked();
+  void cleantx();
+  bool queuetx(void *buf, u32 len);
+  int transmit(void *buf, u32 len);
+  int transmit_batch(const struct netpkt *pkts, int n);
+};
+
+class igb : public netdev
+{
+  friend struct igb_queue;
+
+  struct pci_func * const pcif_;
+  const u32 membase_;
+  int nq_;
+  igb_queue *q_[IGB_MAX_QUEUES];
+  u8 hwaddr_[6];
+
+  NEW_DELETE_OPS(igb);
+
+  u32 erd(u32 reg);
+  void ewr(u32 reg, u32 val);
+
+  void reset();
+  void init_link();
+  void init_rx();
+  void init_rss();
+  void init_tx();
+  void setup_irqs(bool msix);
+
+public:
+  igb(struct pci_func *pcif);
+  igb(const igb &) = delete;
+  igb &operator=(const igb &) = delete;
+
+  static int attach(struct pci_func *pcif);
+
+  int transmit(void *buf, uint32_t len);
+  int transmit_batch(const struct netpkt *pkts, int n);
+  void get_hwaddr(uint8_t *hwaddr);
+};
+
+u32
+igb::erd(u32 reg)
+{
+  paddr pa = membase_ + reg;
+  volatile u32 *ptr = (u32*) p2v(pa);
+  return *ptr;
+}
+
+void
+igb::ewr(u32 reg, u32 val)
+{
+  paddr pa = membase_ + reg;
+  volatile u32 *ptr = (u32*) p2v(pa);
+  *ptr = val;
+}
+
+igb_queue::igb_queue(igb *dev, int id)
+  : dev_(dev), id_(id), rxlk_("igb:rx", true), rxbuf_{}, rxclean_(0),
+    rxtail_(0), txlk_("igb:tx", true), txclean_(0), txtail_(0), txinuse_(0)
+{
+  // The rings are a page each, on the memory of the core that uses them.
+  static_assert(RX_RING_SIZE * sizeof(struct igb_rxdesc) == PGSIZE, "rxd");
+  static_assert(TX_RING_SIZE * sizeof(struct wiseman_txdesc) == PGSIZE, "txd");
+  char *rx = kalloc("igb:rxd", PGSIZE, id % ncpu);
+  char *tx = kalloc("igb:txd", PGSIZE, id % ncpu);
+  if (!rx || !tx)
+    panic("igb: out of memory for rings");
+  memset(rx, 0, PGSIZE);
+  memset(tx, 0, PGSIZE);
+  rxd_ = (struct igb_rxdesc*) rx;
+  txd_ = (struct wiseman_txdesc*) tx;
+}
+
+void
+igb_queue::init_rx()
+{
+  // [82576 4.5.9] Receive initialization, per queue
+  for (int i = 0; i < RX_RING_SIZE - 1; i++) {
+    rxbuf_[i] = netalloc();
+    if (!rxbuf_[i])
+      panic("igb: out of memory for RX buffers");
+    rxd_[i].addr = v2p(rxbuf_[i]);
+    rxd_[i].hdr_addr = 0;
+  }
+  rxtail_ = RX_RING_SIZE - 1;
+
+  paddr rpa = v2p((void*) rxd_);
+  dev_->ewr(IGB_RDBAH(id_), rpa >> 32);
+  dev_->ewr(IGB_RDBAL(id_), rpa & 0xffffffff);
+  dev_->ewr(IGB_RDLEN(id_), RX_RING_SIZE * sizeof(struct igb_rxdesc));
+  dev_->ewr(IGB_SRRCTL(id_),
+            SRRCTL_BSIZEPKT(2) | SRRCTL_DESCTYPE_ADV_ONEBUF);
+  dev_->ewr(IGB_RDH(id_), 0);
+  dev_->ewr(IGB_RDT(id_), 0);
+  dev_->ewr(IGB_RXDCTL(id_), RXDCTL_ENABLE | RXDCTL_WTHRESH(1));
+  for (int i = 0; i < 10 && !(dev_->erd(IGB_RXDCTL(id_)) & RXDCTL_ENABLE); i++)
+    microdelay(1000);
+  // The tail only takes once the queue is enabled.
+  dev_->ewr(IGB_RDT(id_), rxtail_);
+}
+
+void
+igb_queue::init_tx()
+{
+  // [82576 4.5.10] Transmit initialization, per queue
+  for (int i = 0; i < TX_RING_SIZE; i++)
+    txd_[i].wtx_fields.wtxu_status = WTX_ST_DD;
+
+  paddr tpa = v2p((void*) txd_);
+  dev_->ewr(IGB_TDBAH(id_), tpa >> 32);
+  dev_->ewr(IGB_TDBAL(id_), tpa & 0xffffffff);
+  dev_->ewr(IGB_TDLEN(id_), TX_RING_SIZE * sizeof(struct wiseman_txdesc));
+  dev_->ewr(IGB_TDH(id_), 0);
+  dev_->ewr(IGB_TDT(id_), 0);
+  dev_->ewr(IGB_TXDCTL(id_), TXDCTL_ENABLE);
+}
+
+// Post a fresh buffer at the tail.  Caller holds rxlk_.
+void
+igb_queue::allocrx()
+{
+  u32 i = rxtail_;
+  void *buf = netalloc();
+  if (buf == nullptr)
+    panic("igb: out of memory for RX buffers");
+  rxbuf_[i] = buf;
+  rxd_[i].addr = v2p(buf);
+  // Clears the status the device wrote back.
+  rxd_[i].hdr_addr = 0;
+  rxtail_ = (i + 1) % RX_RING_SIZE;
+}
+
+void
+igb_queue::cleanrx()
+{
+  acquire(&rxlk_);
+  for (;;) {
+    u64 wb = rxd_[rxclean_].hdr_addr;
+    if (!(IGB_RXD_STATUS(wb) & IGB_RXD_STAT_DD))
+      break;
+    void *va = rxbuf_[rxclean_];
+    u16 len = IGB_RXD_LENGTH(wb);
+    rxbuf_[rxclean_] = nullptr;
+    rxclean_ = (rxclean_ + 1) % RX_RING_SIZE;
+    allocrx();
+    dev_->ewr(IGB_RDT(id_), rxtail_);
+
+    if (0) console.print("Receive ", shexdump(va, len));
+
+    release(&rxlk_);
+    netrx(va, len);
+    acquire(&rxlk_);
+  }
+  release(&rxlk_);
+}
+
+// Free the buffers of packets the device has sent.  Caller holds txlk_.
+void
+igb_queue::cleantx_locked()
+{
+  while (txinuse_) {
+    volatile struct wiseman_txdesc *desc = &txd_[txclean_];
+    if (!(desc->wtx_fields.wtxu_status & WTX_ST_DD))
+      break;
+    netfree(p2v(desc->wtx_addr));
+    txclean_ = (txclean_ + 1) % TX_RING_SIZE;
+    txinuse_--;
+  }
+}
+
+void
+igb_queue::cleantx()
+{
+  scoped_acquire l(&txlk_);
+  cleantx_locked();
+}
+
+// Put buf on the ring, without telling the device.  Caller holds txlk_.
+bool
+igb_queue::queuetx(void *buf, u32 len)
+{
+  // TDT only equals TDH when there's nothing to transmit, so we can
+  // hold TX_RING_SIZE-1 buffers.  If the ring looks full, the
+  // interrupt may just not have reaped it yet.
+  if (txinuse_ == TX_RING_SIZE-1)
+    cleantx_locked();
+  if (txinuse_ == TX_RING_SIZE-1) {
+    cprintf("igb: TX ring %d overflow\n", id_);
+    return false;
+  }
+
+  volatile struct wiseman_txdesc *desc = &txd_[txtail_];
+  if (!(desc->wtx_fields.wtxu_status & WTX_ST_DD))
+    panic("igbtx");
+  desc->wtx_addr = v2p(buf);
+  desc->wtx_cmdlen = len | WTX_CMD_RS | WTX_CMD_EOP | WTX_CMD_IFCS;
+  desc->wtx_fields.wtxu_status = 0;
+  desc->wtx_fields.wtxu_options = 0;
+  desc->wtx_fields.wtxu_vlan = 0;
+  txtail_ = (txtail_ + 1) % TX_RING_SIZE;
+  txinuse_++;
+
+  if (0) console.print("Transmit ", shexdump(buf, len));
+
+  return true;
+}
+
+int
+igb_queue::transmit(void *buf, u32 len)
+{
+  scoped_acquire l(&txlk_);
+  if (!queuetx(buf, len))
+    return -1;
+  dev_->ewr(IGB_TDT(id_), txtail_);
+  return 0;
+}
+
+int
+igb_queue::transmit_batch(const struct netpkt *pkts, int n)
+{
+  scoped_acquire l(&txlk_);
+  int i;
+  for (i = 0; i < n; i++)
+    if (!queuetx(pkts[i].buf, pkts[i].len))
+      break;
+  if (i)
+    dev_->ewr(IGB_TDT(id_), txtail_);
+  return i;
+}
+
+int
+igb::transmit(void *buf, u32 len)
+{
+  return q_[myid() % nq_]->transmit(buf, len);
+}
+
+int
+igb::transmit_batch(const struct netpkt *pkts, int n)
+{
+  return q_[myid() % nq_]->transmit_batch(pkts, n);
+}
+
+void
+igb::get_hwaddr(uint8_t *hwaddr)
+{
+  memmove(hwaddr, hwaddr_, sizeof(hwaddr_));
+}
+
+int
+igb::attach(struct pci_func *pcif)
+{
+  if (the_netdev)
+    return 0;
+
+  console.println("igb: Found 82576 (", *pcif, ")");
+  pci_func_enable(pcif);
+  the_netdev = new igb(pcif);
+  return 1;
+}
+
+igb::igb(struct pci_func *pcif)
+  : pcif_(pcif), membase_(pcif->reg_base[0]), q_{}
+{
+  verbose.println("igb: Initializing");
+
+  // One queue per core, as far as the device and its MSI-X vectors go.
+  int nvec = pci_msix_vectors(pcif);
+  nq_ = ncpu < IGB_MAX_QUEUES ? ncpu : IGB_MAX_QUEUES;
+  if (nvec && nvec < nq_)
+    nq_ = nvec;
+  for (int q = 0; q < nq_; q++)
+    q_[q] = new igb_queue(this, q);
+
+  reset();
+  init_link();
+  init_rx();
+  init_tx();
+  setup_irqs(nvec != 0);
+  console.println("igb: ", nq_, " queue", nq_ == 1 ? "" : "s",
+                  nvec ? " with MSI-X" : "");
+}
+
+void
+igb::reset()
+{
+  verbose.println("igb: Global reset");
+
+  // [82576 4.5.1] Disable interrupts, reset, and disable them again
+  ewr(IGB_EIMC, ~0);
+  ewr(WMREG_IMC, ~0);
+  ewr(WMREG_CTRL, erd(WMREG_CTRL) | CTRL_RST);
+  // [82576 4.2.1.7] Wait for the reset and the EEPROM reload
+  microdelay(10000);
+  ewr(IGB_EIMC, ~0);
+  ewr(WMREG_IMC, ~0);
+  erd(WMREG_ICR);
+}
+
+void
+igb::init_link()
+{
+  // [82576 4.5.7] Copper link setup, with auto-negotiation
+  u32 ctrl = erd(WMREG_CTRL);
+  ctrl &= ~(CTRL_FRCSPD | CTRL_FRCFDX);
+  ctrl |= CTRL_SLU;
+  ewr(WMREG_CTRL, ctrl);
+
+  console.println("igb: Waiting for link to come up");
+  for (int i = 0; i < 50; i++) {
+    u32 status = erd(WMREG_STATUS);
+    u32 speed = status & STATUS_SPEED_MASK;
+    if (status & STATUS_LU) {
+      console.println("igb: Link up at ",
+                      speed == STATUS_SPEED_10 ? "10" :
+                      speed == STATUS_SPEED_100 ? "100" : "1000",
+                      " Mb/s",
+                      status & STATUS_FD ? " full-duplex" : " half-duplex");
+      return;
+    }
+    microdelay(100000);
+  }
+  console.println("igb: Link did not come up");
+}
+
+void
+igb::init_rx()
+{
+  verbose.println("igb: Initialize receive");
+
+  // The device loads its MAC address from the EEPROM into the first
+  // receive address register when it resets.
+  u32 ralow = erd(WMREG_RAL_LO(WMREG_CORDOVA_RAL_BASE, 0));
+  u32 rahigh = erd(WMREG_RAL_HI(WMREG_CORDOVA_RAL_BASE, 0));
+  for (int i = 0; i < 4; i++)
+    hwaddr_[i] = ralow >> (8 * i);
+  hwaddr_[4] = rahigh;
+  hwaddr_[5] = rahigh >> 8;
+
+  auto h2 = [](uint8_t x) { return sfmt(x).base(16).width(2).pad(); };
+  verbose.println("igb: MAC address is ",
+                  h2(hwaddr_[0]), ':', h2(hwaddr_[1]), ':',
+                  h2(hwaddr_[2]), ':', h2(hwaddr_[3]), ':',
+                  h2(hwaddr_[4]), ':', h2(hwaddr_[5]));
+
+  ewr(WMREG_RAL_HI(WMREG_CORDOVA_RAL_BASE, 0), (rahigh & 0xffff) | RAL_AV);
+  for (int i = 1; i < WM_RAL_TABSIZE; ++i)
+    ewr(WMREG_RAL_HI(WMREG_CORDOVA_RAL_BASE, i), 0);
+  for (int i = 0; i < WMREG_MTA; i+=4)
+    ewr(WMREG_CORDOVA_MTA+i, 0);
+
+  for (int q = 0; q < nq_; q++)
+    q_[q]->init_rx();
+  init_rss();
+  ewr(WMREG_RCTL,
+      RCTL_EN | RCTL_DPF | RCTL_BAM | RCTL_SECRC | RCTL_2k);
+}
+
+void
+igb::init_rss()
+{
+  if (nq_ == 1) {
+    ewr(IGB_MRQC, 0);
+    return;
+  }
+
+  // [82576 7.1.2.8] Hash TCP and UDP flows by addresses and ports, and
+  // other IP packets by addresses, and spread the hash values evenly
+  // over the queues.
+  for (int i = 0; i < IGB_RSSRK_SIZE; i += 4)
+    ewr(IGB_RSSRK(i / 4), rss_key[i] | (rss_key[i+1] << 8) |
+        (rss_key[i+2] << 16) | ((u32)rss_key[i+3] << 24));
+  for (int i = 0; i < IGB_RETA_SIZE; i += 4) {
+    u32 reta = 0;
+    for (int j = 0; j < 4; j++)
+      reta |= ((i + j) % nq_) << (8 * j);
+    ewr(IGB_RETA(i / 4), reta);
+  }
+  // The descriptors carry the hash instead of the packet checksum.
+  ewr(WMREG_RXCSUM, erd(WMREG_RXCSUM) | RXCSUM_PCSD);
+  ewr(IGB_MRQC, MRQC_ENABLE_RSS |
+      MRQC_RSS_IPV4 | MRQC_RSS_IPV4_TCP | MRQC_RSS_IPV4_UDP |
+      MRQC_RSS_IPV6 | MRQC_RSS_IPV6_TCP | MRQC_RSS_IPV6_UDP);
+}
+
+void
+igb::init_tx()
+{
+  verbose.println("igb: Initialize transmit");
+
+  for (int q = 0; q < nq_; q++)
+    q_[q]->init_tx();
+  // XXX COLD should be 0x200 for half-duplex
+  ewr(WMREG_TCTL, TCTL_EN|TCTL_PSP|TCTL_CT(0x0f)|TCTL_COLD(0x3f));
+  ewr(WMREG_TIPG, TIPG_IPGT(10)|TIPG_IPGR1(8)|TIPG_IPGR2(6));
+}
+
+void
+igb::setup_irqs(bool msix)
+{
+  if (msix) {
+    // [82576 7.3.1.3] Vector q signals RX and TX on queue q and goes
+    // to core q, the one RSS steers the queue's flows to.
+    ewr(IGB_GPIE, GPIE_MSIX_MODE | GPIE_PBA | GPIE_NSICR);
+    u32 mask = 0;
+    for (int q = 0; q < nq_; q++) {
+      u32 ivar = erd(IGB_IVAR(q & 7));
+      ivar &= ~((0xffU << IVAR_RX_SHIFT(q)) | (0xffU << IVAR_TX_SHIFT(q)));
+      ivar |= (q | IVAR_VALID) << IVAR_RX_SHIFT(q);
+      ivar |= (q | IVAR_VALID) << IVAR_TX_SHIFT(q);
+      ewr(IGB_IVAR(q & 7), ivar);
+
+      irq qirq = pci_map_msix_irq(pcif_, q, q);
+      assert(qirq.valid());
+      igb_queue *iq = q_[q];
+      qirq.register_callback([iq]() {
+          iq->cleantx();
+          iq->cleanrx();
+        });
+      mask |= 1 << q;
+    }
+    pci_enable_msix(pcif_);
+
+    verbose.println("igb: Enable interrupts");
+    // Sending a vector's message clears its cause, so handlers don't
+    // need to touch EICR.
+    ewr(IGB_EIAC, mask);
+    ewr(IGB_EIMS, mask);
+    erd(WMREG_STATUS);
+    return;
+  }
+
+  // A single interrupt for all of the queues.
+  irq igbirq = pci_map_msi_irq(pcif_);
+  if (!igbirq.valid()) {
+    igbirq = extpic->map_pci_irq(pcif_);
+    igbirq.enable();
+  }
+  igbirq.register_callback([this]() {
+      u32 icr = erd(WMREG_ICR);
+      while (icr & (ICR_TXDW|ICR_RXO|ICR_RXT0)) {
+        for (int q = 0; q < nq_; q++) {
+          if (icr & ICR_TXDW)
+            q_[q]->cleantx();
+          if (icr & ICR_RXT0)
+            q_[q]->cleanrx();
+        }
+        if (icr & ICR_RXO) {
+          netstat_inc(&netstats::rx_overrun);
+          cprintf("igb: RX buffer overflow\n");
+        }
+        icr = erd(WMREG_ICR);
+      }
+    });
+
+  verbose.println("igb: Enable interrupts");
+  ewr(WMREG_IMS, ICR_TXDW | ICR_RXO | ICR_RXT0);
+  erd(WMREG_STATUS);
+}
+
+void
+initigb(void)
+{
+  for (int devid : igb_devids)
+    pci_register_driver(0x8086, devid, igb::attach);
+}
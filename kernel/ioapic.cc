@@ -70,6 +70,7 @@ public:
   irq map_pci_irq(struct pci_func *f);
 
   void dump();
+  void route_irq(const struct irq &, int cpu) override;
 
 protected:
   void enable_irq(const struct irq &, bool enable);
@@ -193,8 +194,9 @@ ioapic_82093::enable_irq(const struct irq &irq, bool enable)
   if (!ioapic)
     panic("ioapic: Cannot enable IRQ %d, no IOAPIC for that IRQ", irq.gsi);
 
-  // Route interrupts to CPU 0
-  struct cpu *dest = &cpus[0];
+  // Route interrupts to the IRQ's affinity, which is CPU 0 unless
+  // something has moved it.
+  struct cpu *dest = &cpus[irq.affinity()];
 
   // If we're using an IOMMU, allocate an interrupt redirection entry
   uint64_t iommu_index = 0;
@@ -225,6 +227,30 @@ ioapic_82093::enable_irq(const struct irq &irq, bool enable)
   ioapic->write(REG_TABLE+2*pin+1, (reg >> 32) & 0xFFFFFFFF);
 }
 
+void
+ioapic_82093::route_irq(const struct irq &irq, int cpu)
+{
+  assert(irq.valid());
+
+  int pin;
+  auto ioapic = map_gsi(irq.gsi, &pin);
+  if (!ioapic)
+    return;
+
+  verbose.println("ioapic: Routing ", irq, " to APICID ", cpus[cpu].hwid.num);
+
+  // Leave the pin's mode and mask alone and only change where it goes.
+  // Under an IOMMU that's the remapping entry the pin points at.
+  u32 lo = ioapic->read(REG_TABLE+2*pin);
+  u32 hi = ioapic->read(REG_TABLE+2*pin+1);
+  if (!iommu) {
+    ioapic->write(REG_TABLE+2*pin+1, (u32)cpus[cpu].hwid.num << 24);
+  } else {
+    int iommu_index = ((hi >> 17) & 0x7fff) | (((lo >> 11) & 1) << 15);
+    iommu->set_int_dest(iommu_index, &cpus[cpu]);
+  }
+}
+
 void
 ioapic_82093::eoi_irq(const struct irq &irq)
 {
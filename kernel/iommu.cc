@@ -2,6 +2,15 @@
 //
 // [IOMMU] refers to Intel Virtualization Technology for Directed I/O
 // Architecture Specification Rev 1.3
+//
+// Only interrupt remapping is set up.  DMA remapping is left disabled
+// (no root table is installed and GCMD.TE is never set), so devices
+// address physical memory directly and drivers program them with v2p()
+// addresses.  Enabling it would need a domain page table per device and
+// an IOVA for every DMA buffer; to keep that cheap, long-lived buffers
+// (descriptor and RX rings, page-cache pages, journal buffers) should be
+// mapped once and kept, and unmaps batched into a single IOTLB
+// invalidation through the invalidation queue used below.
 
 #include "iommu.hh"
 
@@ -172,6 +181,7 @@ public:
   constexpr intel_iommu() : instances(), irt(nullptr), next(0) { }
   void register_base(paddr base);
   int allocate_int(struct irq irq, struct cpu *dest);
+  void set_int_dest(int index, struct cpu *dest);
   bool configure();
 };
 
@@ -280,6 +290,16 @@ intel_iommu::allocate_int(struct irq irq, struct cpu *dest)
   return index;
 }
 
+void
+intel_iommu::set_int_dest(int index, struct cpu *dest)
+{
+  assert(index >= 0 && (size_t)index < next);
+  verbose.println("iommu: Moving index ", index, " to CPU ", dest->id);
+  irt[index].destination = dest->hwid.num;
+  for (auto &i : instances)
+    i.invalidate(index, false);
+}
+
 void
 iommu_instance::invalidate(int index, bool was_nonpresent)
 {
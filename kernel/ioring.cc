@@ -0,0 +1,244 @@
+// Asynchronous I/O rings, a simple io_uring.
+//
+// An application sets up a ring in its own memory (see uk/ioring.h),
+// queues reads, writes, fsyncs, and opens on it, and submits a batch of
+// them with one ioring_enter.  Each request runs in a kernel worker
+// thread (see kworker.hh), spread round-robin over the cores starting
+// with the submitter's, so many I/Os can be in flight without a thread
+// per request.  The worker runs the request as the system call would,
+// in the address space and with the file table and working directory
+// the submitter had when it submitted, and posts the result to the
+// completion queue.
+//
+// ioring_enter never has more requests in flight than there's room
+// for in the completion queue, so it can't overflow.  A request that
+// blocks for a long time, like a read from an empty pipe, ties up one
+// of its core's few worker threads, so rings are best used for files.
+
+#include "types.h"
+#include "kernel.hh"
+#include "cpu.hh"
+#include "proc.hh"
+#include "vm.hh"
+#include "file.hh"
+#include "filetable.hh"
+#include "mnode.hh"
+#include "kworker.hh"
+#include <uk/ioring.h>
+#include <uk/fcntl.h>
+#include <utility>
+
+ssize_t sys_read(int fd, userptr<void> p, size_t n);
+ssize_t sys_pread(int fd, userptr<void> ubuf, size_t count, off_t offset);
+ssize_t sys_write(int fd, userptr<void> p, size_t n);
+ssize_t sys_pwrite(int fd, const void *ubuf, size_t count, off_t offset);
+int sys_fsync(int fd);
+int sys_openat(int dirfd, userptr_str path, int omode, ...);
+
+struct file_ioring : public referenced, public file {
+  // The ring in the address space of whoever set it up.
+  const uptr ring_;
+  const u32 entries_;
+
+  // Serializes submitting.
+  sleeplock submit_lock_;
+  u32 sq_head_;                 // Protected by submit_lock_
+
+  // Serializes posting completions, which writes to user memory.
+  sleeplock cq_lock_;
+  std::atomic<u32> cq_tail_;    // Written under cq_lock_
+  std::atomic<u32> inflight_;
+
+  // ioring_enter waits for completions on cv_.
+  spinlock wait_lock_;
+  condvar cv_;
+
+  file_ioring(uptr ring, u32 entries)
+    : ring_(ring), entries_(entries), submit_lock_("ioring:submit"),
+      sq_head_(0), cq_lock_("ioring:cq"), cq_tail_(0), inflight_(0),
+      wait_lock_("ioring"), cv_("ioring") {}
+  NEW_DELETE_OPS(file_ioring);
+
+  void inc() override { referenced::inc(); }
+  void dec() override { referenced::dec(); }
+
+  userptr<u32> field(size_t off)
+  {
+    return userptr<u32>((u32*)(ring_ + off));
+  }
+
+  userptr<struct ioring_sqe> sqe(u32 i)
+  {
+    return userptr<struct ioring_sqe>(
+      (struct ioring_sqe*)(ring_ + sizeof(struct ioring)) +
+      (i & (entries_ - 1)));
+  }
+
+  userptr<struct ioring_cqe> cqe(u32 i)
+  {
+    return userptr<struct ioring_cqe>(
+      (struct ioring_cqe*)((struct ioring_sqe*)(ring_ + sizeof(struct ioring)) +
+                           entries_) +
+      (i & (2 * entries_ - 1)));
+  }
+
+  int ioring_enter(unsigned int to_submit,
+                   unsigned int min_complete) override;
+
+  // Post a completion.  Called by the worker that ran the request, in
+  // the submitter's address space.
+  void post(u64 user_data, s64 res)
+  {
+    struct ioring_cqe c = { user_data, res };
+    {
+      auto l = cq_lock_.guard();
+      u32 t = cq_tail_;
+      // If the application unmapped the ring, the completion is lost.
+      if (cqe(t).store(&c)) {
+        t++;
+        field(__offsetof(struct ioring, cq_tail)).store(&t);
+      }
+      cq_tail_ = t;
+    }
+    scoped_acquire l(&wait_lock_);
+    inflight_--;
+    cv_.wake_all();
+  }
+};
+
+struct ioring_op : public kwork {
+  sref<file_ioring> ring;
+  struct ioring_sqe sqe;
+  sref<vmap> vmap;
+  sref<filetable> ftable;
+  sref<mnode> cwd;
+
+  ioring_op(const sref<file_ioring> &ring, const struct ioring_sqe &sqe,
+            proc *p)
+    : ring(ring), sqe(sqe), vmap(p->vmap), ftable(p->ftable), cwd(p->cwd_m) {}
+  NEW_DELETE_OPS(ioring_op);
+
+  s64 execute()
+  {
+    if (sqe.flags)
+      return -1;
+    switch (sqe.opcode) {
+    case IORING_OP_NOP:
+      return 0;
+    case IORING_OP_READ:
+      return sys_read(sqe.fd, userptr<void>((void*)sqe.addr), sqe.len);
+    case IORING_OP_WRITE:
+      return sys_write(sqe.fd, userptr<void>((void*)sqe.addr), sqe.len);
+    case IORING_OP_PREAD:
+      return sys_pread(sqe.fd, userptr<void>((void*)sqe.addr), sqe.len,
+                       sqe.off);
+    case IORING_OP_PWRITE:
+      return sys_pwrite(sqe.fd, (const void*)sqe.addr, sqe.len, sqe.off);
+    case IORING_OP_FSYNC:
+      return sys_fsync(sqe.fd);
+    case IORING_OP_OPENAT:
+      return sys_openat(sqe.fd, userptr_str((const char*)sqe.addr),
+                        sqe.op_flags);
+    default:
+      return -1;
+    }
+  }
+
+  void run() override
+  {
+    // Take on the submitter's address space, file table, and working
+    // directory.  The scheduler switches to myproc()->vmap, so this
+    // holds even if the request sleeps.
+    proc *p = myproc();
+    std::swap(p->vmap, vmap);
+    std::swap(p->ftable, ftable);
+    std::swap(p->cwd_m, cwd);
+    switchvm(p);
+
+    ring->post(sqe.user_data, execute());
+
+    std::swap(p->vmap, vmap);
+    std::swap(p->ftable, ftable);
+    std::swap(p->cwd_m, cwd);
+    switchvm(p);
+    delete this;
+  }
+};
+
+int
+file_ioring::ioring_enter(unsigned int to_submit, unsigned int min_complete)
+{
+  struct ioring hdr;
+  if (!userptr<struct ioring>((struct ioring*)ring_).load(&hdr))
+    return -1;
+
+  unsigned int submitted = 0;
+  if (to_submit) {
+    auto l = submit_lock_.guard();
+    proc *p = myproc();
+    u32 avail = hdr.sq_tail - sq_head_;
+    if (avail > entries_)
+      return -1;
+    int start = myid();
+    while (submitted < to_submit && submitted < avail) {
+      // Leave room in the completion queue for everything in flight.
+      if (inflight_ + (cq_tail_ - hdr.cq_head) >= 2 * entries_)
+        break;
+      struct ioring_sqe s;
+      if (!sqe(sq_head_).load(&s))
+        break;
+      ioring_op *op;
+      try {
+        op = new ioring_op(sref<file_ioring>::newref(this), s, p);
+      } catch (std::bad_alloc &e) {
+        break;
+      }
+      sq_head_++;
+      inflight_++;
+      kwork_push(op, (start + submitted) % ncpu);
+      submitted++;
+    }
+    if (submitted)
+      field(__offsetof(struct ioring, sq_head)).store(&sq_head_);
+  }
+
+  if (min_complete) {
+    scoped_acquire l(&wait_lock_);
+    while (cq_tail_ - hdr.cq_head < min_complete && inflight_ &&
+           !myproc()->killed)
+      cv_.sleep(&wait_lock_);
+  }
+  return submitted;
+}
+
+//SYSCALL
+int
+sys_ioring_setup(userptr<struct ioring> ring, unsigned int entries)
+{
+  if (entries == 0 || entries > IORING_MAX_ENTRIES ||
+      (entries & (entries - 1)) || ((uptr)ring % 8))
+    return -1;
+
+  struct ioring hdr = {};
+  hdr.entries = entries;
+  if (!ring.store(&hdr))
+    return -1;
+
+  sref<file> f;
+  try {
+    f = make_sref<file_ioring>((uptr)ring, entries);
+  } catch (std::bad_alloc &e) {
+    return -1;
+  }
+  return fdalloc(std::move(f), 0);
+}
+
+//SYSCALL
+int
+sys_ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete)
+{
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+  return f->ioring_enter(to_submit, min_complete);
+}
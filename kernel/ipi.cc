@@ -22,6 +22,13 @@ struct ipi_queue
 
 DEFINE_PERCPU(struct ipi_queue, myipi);
 
+void
+abstract_lapic::send_ipi_many(const bitset<NCPU> &targets, int ino)
+{
+  for (auto cpu : targets)
+    send_ipi(&cpus[cpu], ino);
+}
+
 // Wakeup the given CPU by sending an asynchronous IPI with no payload.
 void
 poke_cpu(int cpu)
@@ -30,24 +37,33 @@ poke_cpu(int cpu)
 }
 
 void
+poke_cpus(const bitset<NCPU> &cpu_set)
+{
+  lapic->send_ipi_many(cpu_set, T_IPICALL);
+}
+
+// Queue this call on cpu.  Returns whether cpu needs an IPI to notice,
+// which it doesn't if it has calls queued already or is running them.
+bool
 ipi_call::start(unsigned cpu)
 {
   bool need_ipi = false;
   auto &q = myipi[cpu];
-  {
-    auto l = q.lock.guard();
-    if (!(q.head || q.ipicall_active))
-      need_ipi = true;
-    next[cpu] = nullptr;
-    *q.tail = this;
-    q.tail = &this->next[cpu];
-  }
-  if (need_ipi)
-    lapic->send_ipi(&cpus[cpu], T_IPICALL);
+  auto l = q.lock.guard();
+  if (!(q.head || q.ipicall_active))
+    need_ipi = true;
+  next[cpu] = nullptr;
+  *q.tail = this;
+  q.tail = &this->next[cpu];
+  return need_ipi;
 }
 
-void
-ipi_call::run_on(const bitset<NCPU> &cpus)
+// Queue this call on cpus and send the IPIs in one go, which the
+// x2APIC multicasts.  waiting is set to the number of CPUs that will
+// call finish(), plus extra.  Returns whether the caller has to run
+// the call itself, on this CPU.
+bool
+ipi_call::post(const bitset<NCPU> &cpus, int extra)
 {
   // If we're called with interrupts enabled, then we might be
   // migrated during this, but it's also safe to self-IPI.  If we're
@@ -55,16 +71,45 @@ ipi_call::run_on(const bitset<NCPU> &cpus)
   // safe to do a local call.
   bool interruptable = readrflags() & FL_IF;
   unsigned id = interruptable ? -1 : myid();
-  waiting = cpus.count() - (!interruptable && cpus[id]);
+  bool local = !interruptable && cpus[id];
+  waiting = cpus.count() - local + extra;
+  bitset<NCPU> need_ipi;
   for (auto cpu : cpus)
-    if (cpu != id)
-      start(cpu);
-  if (!interruptable && cpus[id])
+    if (cpu != id && start(cpu))
+      need_ipi.set(cpu);
+  if (need_ipi.any())
+    lapic->send_ipi_many(need_ipi, T_IPICALL);
+  return local;
+}
+
+void
+ipi_call::finish()
+{
+  if (waiting.fetch_sub(1, memory_order_acq_rel) == 1)
+    done();
+}
+
+void
+ipi_call::run_on(const bitset<NCPU> &cpus)
+{
+  async = false;
+  if (post(cpus, 0))
     run();
   while (waiting.load(memory_order_relaxed))
     nop_pause();
 }
 
+void
+ipi_call::run_on_async(const bitset<NCPU> &cpus)
+{
+  async = true;
+  // Count ourselves in waiting, so done() can't run before we're
+  // through with the call.
+  if (post(cpus, 1))
+    run();
+  finish();
+}
+
 // Handle an IPI call interrupt on this CPU.
 void
 on_ipicall()
@@ -90,8 +135,12 @@ on_ipicall()
       ipi_call *next = call->next[id];
 
       // This call is done.  After we mark it done, we can't use any
-      // fields because it may be freed immediately by its creator.
-      call->waiting.fetch_sub(1, memory_order_relaxed);
+      // fields because it may be freed immediately by its creator
+      // (or, if it's asynchronous, by whoever finishes it last).
+      if (call->async)
+        call->finish();
+      else
+        call->waiting.fetch_sub(1, memory_order_relaxed);
 
       call = next;
     }
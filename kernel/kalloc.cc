@@ -22,6 +22,9 @@
 #include "file.hh"
 #include "major.h"
 #include "heapprof.hh"
+#include "condvar.hh"
+#include "critical.hh"
+#include "kmcache.hh"
 
 #include <algorithm>
 #include <iterator>
@@ -282,6 +285,10 @@ struct cpu_mem
   // Hot page cache of recently freed pages
   void *hot_pages[KALLOC_HOT_PAGES];
   size_t nhot;
+
+  // Cache of recently freed huge pages
+  void *huge_pages[KALLOC_HOT_HUGE_PAGES];
+  size_t nhuge;
 };
 
 // Prefer mycpu()->mem for local access to this.  This is NOINIT since
@@ -636,10 +643,29 @@ early_kalloc(size_t size, size_t align)
   return (char*)p2v(pa);
 }
 
+// The shrinkers that kalloc calls when it runs out of memory.  They are
+// only registered at boot, and the slow path reads them without
+// locking once nshrinkers says they are there.
+struct shrinker
+{
+  const char *name;
+  shrink_priority prio;
+  u64 (*fn)(u64 npages);
+  std::atomic<u64> calls;
+  std::atomic<u64> freed;
+};
+static shrinker shrinkers[KALLOC_MAX_SHRINKERS];
+static std::atomic<int> nshrinkers;
+static spinlock shrinkers_lock("shrinkers");
+static u64 total_pages;
+static std::atomic<bool> reclaiming;
+
 void
 kmemprint(print_stream *s)
 {
   size_t total_free = 0, total_limit = 0, total_lowest_free = 0;
+  size_t total_huge = 0;
+  const size_t HUGE_ORDER = floor_log2_const(HUGE_PGSIZE / PGSIZE);
 
   s->println();
   for (int cpu = 0; cpu < ncpu; ++cpu) {
@@ -660,6 +686,9 @@ kmemprint(print_stream *s)
       //MIN_SIZE is the same as the page size (4 KB).
       s->print("free (pages) ", stats.free / buddy_allocator::MIN_SIZE,
       " limit (pages) ", free_limit / buddy_allocator::MIN_SIZE, "]");
+      for (size_t order = HUGE_ORDER; order <= buddy_allocator::MAX_ORDER;
+           ++order)
+        total_huge += stats.nfree[order] << (order - HUGE_ORDER);
       total_free += stats.free;
       total_limit += free_limit;
       total_lowest_free += stats.lowest_free;
@@ -673,10 +702,23 @@ kmemprint(print_stream *s)
 
   s->println();
 
+  s->print("Free huge pages: ", total_huge);
+  for (int cpu = 0; cpu < ncpu; ++cpu)
+    total_huge += cpu_mem[cpu].nhuge;
+  s->print(" (", total_huge, " with the per-CPU caches)");
+
+  s->println();
+
   s->print("Lowest recorded free pages: ",
            total_lowest_free / buddy_allocator::MIN_SIZE);
 
   s->println();
+
+  kmem_cache::print_all(s);
+
+  for (int i = 0; i < nshrinkers; i++)
+    s->println("Shrinker ", shrinkers[i].name, ": ", shrinkers[i].freed.load(),
+               " pages freed in ", shrinkers[i].calls.load(), " calls");
 }
 
 static int
@@ -687,55 +729,261 @@ kmemstatsread(mdev*, char *dst, u32 off, u32 n)
   return s.get_used();
 }
 
+void
+register_shrinker(const char *name, shrink_priority prio, u64 (*fn)(u64 npages))
+{
+  auto l = shrinkers_lock.guard();
+  int n = nshrinkers.load(std::memory_order_relaxed);
+  if (n == KALLOC_MAX_SHRINKERS)
+    panic("register_shrinker: too many shrinkers");
+  shrinkers[n].name = name;
+  shrinkers[n].prio = prio;
+  shrinkers[n].fn = fn;
+  nshrinkers.store(n + 1, std::memory_order_release);
+}
+
+// The number of pages the buddy allocators started out with.
+u64
+kalloc_total_pages(void)
+{
+  return total_pages;
+}
+
+// The number of free pages in the buddy allocators, not counting the
+// per-CPU caches.  This doesn't lock the buddies, so it's only an
+// estimate.
+u64
+kalloc_free_pages(void)
+{
+  u64 free = 0;
+  for (auto &lb : buddies)
+    free += lb.alloc.get_free_bytes();
+  return free / PGSIZE;
+}
+
+// Run the shrinkers of one priority until they have freed npages.
+// Returns the number of pages they freed.
+static u64
+run_shrinkers(shrink_priority prio, u64 npages)
+{
+  u64 nfreed = 0;
+  int n = nshrinkers.load(std::memory_order_acquire);
+  for (int i = 0; i < n && nfreed < npages; i++) {
+    shrinker *sh = &shrinkers[i];
+    if (sh->prio != prio)
+      continue;
+    u64 f = sh->fn(npages - nfreed);
+    sh->calls++;
+    sh->freed += f;
+    nfreed += f;
+  }
+  return nfreed;
+}
+
+// Ask the shrinkers to free memory after an allocation of size bytes
+// failed.  The priorities are tried in order, and the first one that
+// frees anything ends the search.  SHRINK_DATA_CACHES is only tried
+// KALLOC_RECLAIM_TRIES times per allocation (counted in *tries), and then
+// only by one thread at a time (which also keeps allocations made by
+// those shrinkers from recursing) that can sleep; afterwards it waits a
+// bit for the released pages to come back to the allocator, since
+// page_info references are refcache'd and the pages are only freed at
+// the end of the next refcache epochs.  Returns false if nothing could
+// be freed.
+static bool
+kalloc_shrink(size_t size, int *tries)
+{
+  u64 npages = std::max((u64)KALLOC_RECLAIM_BATCH, (u64)(size + PGSIZE - 1) / PGSIZE);
+
+  if (run_shrinkers(SHRINK_CPU_CACHES, npages))
+    return true;
+  if (run_shrinkers(SHRINK_OBJECT_CACHES, npages))
+    return true;
+
+  if ((*tries)++ >= KALLOC_RECLAIM_TRIES || check_critical(NO_SCHED))
+    return false;
+  if (reclaiming.exchange(true))
+    return false;
+  u64 nreclaimed = run_shrinkers(SHRINK_DATA_CACHES, npages);
+  reclaiming = false;
+  if (!nreclaimed)
+    return false;
+
+  struct spinlock lock("kalloc_reclaim");
+  struct condvar cv("kalloc_reclaim");
+  u64 target = nsectime() + QUANTUM * 1000000ull;
+  scoped_acquire l(&lock);
+  while (nsectime() < target)
+    cv.sleep_to(&lock, target);
+  return true;
+}
+
 #if KALLOC_LOAD_BALANCE
 char*
 kalloc(const char *name, size_t size, int cpu)
 {
   return allmem.kalloc(name, size);
 }
+
+size_t
+kalloc_batch(const char *name, size_t n, void **pages, int cpu)
+{
+  size_t i;
+  for (i = 0; i < n; i++)
+    if (!(pages[i] = allmem.kalloc(name, PGSIZE, cpu)))
+      break;
+  return i;
+}
 #else
+// Allocate up to n pages into pages[] from the buddy allocators, in mem's
+// steal order, holding each buddy's lock only once.  Whole buddy blocks are
+// split into pages, so the pages come in contiguous runs whenever the
+// buddies have them.  Returns the number of pages allocated.
+//
+// So that stealing doesn't fragment the memory other cores get their huge
+// pages from, the first pass over the steal order takes nothing from a
+// remote buddy that would have to split a huge page or larger block; only
+// if that comes up short does a second pass take whatever is left.
+static size_t
+alloc_pages_from_buddies(struct cpu_mem *mem, void **pages, size_t n, int cpu)
+{
+  size_t got = 0;
+  for (int pass = 0; pass < 2 && got < n; pass++) {
+    for (auto idx : mem->steal) {
+      bool local = mem->steal.is_local(idx);
+      if (pass == 1 && local)
+        continue;
+      auto &lb = buddies[idx];
+      auto l = lb.lock.guard();
+      size_t before = got;
+      while (got < n) {
+        size_t order = std::min((size_t)floor_log2(n - got),
+                                (size_t)buddy_allocator::MAX_ORDER);
+        char *run = nullptr;
+        for (;; order--) {
+          size_t size = (size_t)PGSIZE << order;
+          if (pass == 0 && !local)
+            run = (char*) lb.alloc.alloc_nothrow_nosplit(size,
+                                                          HUGE_PGSIZE / 2);
+          else
+            run = (char*) lb.alloc.alloc_nothrow(size);
+          if (run || order == 0)
+            break;
+        }
+        if (!run)
+          break;
+        lb.alloc.split(run, (size_t)PGSIZE << order);
+        for (size_t i = 0; i < ((size_t)1 << order); i++)
+          pages[got++] = run + i * PGSIZE;
+      }
+      if (got > before && !local) {
+        kstats::inc(&kstats::kalloc_hot_list_steal_count);
+#if PRINT_STEAL
+        cprintf("CPU %d stealing %lu pages from buddy %lu\n",
+                cpu >= 0 ? cpu : myid(), got - before, idx);
+#endif
+      }
+      if (got == n)
+        break;
+    }
+  }
+  return got;
+}
+
+// Check and label a block that is being handed out.
+static void
+kalloc_prepare(void *res, size_t size, const char *name, const char *source,
+               void *alloc_rip)
+{
+  if (ALLOC_MEMSET) {
+    char* chk = (char*)res;
+    for (int i = 0; i < size - 2*sizeof(void*); i++) {
+      // Ignore buddy allocator list links at the beginning of each
+      // page
+      if ((uintptr_t)&chk[i] % PGSIZE < sizeof(void*)*2)
+        continue;
+      if (chk[i] != 1)
+        spanic.println(shexdump(chk, size),
+                       "kalloc: free memory from ", source,
+                       " was overwritten ", (void*)chk, "+", shex(i));
+    }
+    memset(res, 2, size);
+  }
+  if (!name)
+    name = "kmem";
+
+  // Update debug_info
+  alloc_debug_info *adi = alloc_debug_info::of(res, size);
+  if (KERNEL_HEAP_PROFILE) {
+    if (heap_profile_update(HEAP_PROFILE_KALLOC, alloc_rip, size))
+      adi->set_kalloc_rip(alloc_rip);
+    else
+      adi->set_kalloc_rip(nullptr);
+  }
+  heap_sample_alloc(HEAP_PROFILE_KALLOC, alloc_rip, res, size);
+
+  mtlabel(mtrace_label_block, res, size, name, strlen(name));
+}
+
+static void free_pages_to_buddies(struct cpu_mem *mem, void **pages, size_t n);
+
+// The shrinker for this CPU's page caches: return its cached huge pages
+// and hot pages to the buddy allocators, where they can be coalesced or
+// split for allocations of other sizes.  Other CPUs' caches are only
+// safe to touch from those CPUs, so they are left alone.
+static u64
+shrink_cpu_caches(u64 npages)
+{
+  scoped_cli cli;
+  auto mem = mycpu()->mem;
+  u64 nfreed = mem->nhuge * (HUGE_PGSIZE / PGSIZE) + mem->nhot;
+  for (; mem->nhuge > 0; --mem->nhuge) {
+    void *v = mem->huge_pages[mem->nhuge - 1];
+    for (auto buddyidx : mem->steal) {
+      if (buddies[buddyidx].alloc.contains(v)) {
+        auto l = buddies[buddyidx].lock.guard();
+        buddies[buddyidx].alloc.free(v, HUGE_PGSIZE);
+        break;
+      }
+    }
+  }
+  if (mem->nhot) {
+    std::sort(mem->hot_pages, mem->hot_pages + mem->nhot);
+    free_pages_to_buddies(mem, mem->hot_pages, mem->nhot);
+    mem->nhot = 0;
+  }
+  return nfreed;
+}
+
 char*
 kalloc(const char *name, size_t size, int cpu)
 {
   if (!kinited)
     return (char*)early_kalloc(size, size);
 
+  int reclaim_tries = 0;
+again:
   void *res = nullptr;
   const char *source = nullptr;
 
   if (size == PGSIZE) {
-    // Go to the hot list
+    // Go to the hot list.  Another core's hot list is only safe to
+    // touch from that core, so allocations for a remote core go
+    // straight to its buddies.
     scoped_cli cli;
+    if (cpu >= 0 && cpu != myid())
+      goto general;
     auto mem = cpu >= 0 ? cpus[cpu].mem : mycpu()->mem;
     if (mem->nhot == 0) {
       // No hot pages; fill half of the cache
       kstats::inc(&kstats::kalloc_hot_list_refill_count);
-      auto buddyit = mem->steal.begin(), buddyend = mem->steal.end();
-      auto lb = &buddies[*buddyit];
-      auto l = lb->lock.guard();
-      while (mem->nhot < KALLOC_HOT_PAGES / 2 && buddyit != buddyend) {
-        void *page = lb->alloc.alloc_nothrow(PGSIZE);
-        if (!page) {
-          // Move to the next allocator
-          if (++buddyit == buddyend && mem->nhot == 0) {
-            // We couldn't allocate any pages; we're probably out of
-            // memory, but drop through to the more aggressive
-            // general-purpose allocator.
-            goto general;
-          }
-          lb = &buddies[*buddyit];
-          l.release();
-          l = lb->lock.guard();
-          if (!mem->steal.is_local(*buddyit)) {
-            kstats::inc(&kstats::kalloc_hot_list_steal_count);
-#if PRINT_STEAL
-            cprintf("CPU %d stealing hot list from buddy %lu\n",
-                    cpu >= 0 ? cpu : myid(), *buddyit);
-#endif
-          }
-        } else {
-          mem->hot_pages[mem->nhot++] = page;
-        }
+      mem->nhot = alloc_pages_from_buddies(mem, mem->hot_pages,
+                                           KALLOC_HOT_PAGES / 2, cpu);
+      if (mem->nhot == 0) {
+        // We couldn't allocate any pages; we're probably out of
+        // memory, but drop through to the more aggressive
+        // general-purpose allocator.
+        goto general;
       }
       source = "refilled hot list";
     }
@@ -743,6 +991,16 @@ kalloc(const char *name, size_t size, int cpu)
     kstats::inc(&kstats::kalloc_page_alloc_count);
     if (!source)
       source = "hot list";
+  } else if (size == HUGE_PGSIZE) {
+    // Go to the huge page cache.  Unlike the hot list, this isn't
+    // refilled in bulk, since that would tie up huge pages that
+    // other cores may need.
+    scoped_cli cli;
+    auto mem = cpu >= 0 ? cpus[cpu].mem : mycpu()->mem;
+    if (mem->nhuge == 0 || (cpu >= 0 && cpu != myid()))
+      goto general;
+    res = mem->huge_pages[--mem->nhuge];
+    source = "huge list";
   } else {
     // General allocation path for non-PGSIZE allocations or if we
     // can't fill our hot page cache.
@@ -764,42 +1022,60 @@ kalloc(const char *name, size_t size, int cpu)
     source = "buddy";
   }
   if (res) {
-    if (ALLOC_MEMSET) {
-      char* chk = (char*)res;
-      for (int i = 0; i < size - 2*sizeof(void*); i++) {
-        // Ignore buddy allocator list links at the beginning of each
-        // page
-        if ((uintptr_t)&chk[i] % PGSIZE < sizeof(void*)*2)
-          continue;
-        if (chk[i] != 1)
-          spanic.println(shexdump(chk, size),
-                         "kalloc: free memory from ", source,
-                         " was overwritten ", (void*)chk, "+", shex(i));
-      }
-      memset(res, 2, size);
-    }
-    if (!name)
-      name = "kmem";
-
-    // Update debug_info
-    alloc_debug_info *adi = alloc_debug_info::of(res, size);
-    if (KERNEL_HEAP_PROFILE) {
-      auto alloc_rip = __builtin_return_address(0);
-      if (heap_profile_update(HEAP_PROFILE_KALLOC, alloc_rip, size))
-        adi->set_kalloc_rip(alloc_rip);
-      else
-        adi->set_kalloc_rip(nullptr);
-    }
-
-    mtlabel(mtrace_label_block, res, size, name, strlen(name));
+    kalloc_prepare(res, size, name, source, __builtin_return_address(0));
     return (char*)res;
   } else {
+    if (kalloc_shrink(size, &reclaim_tries))
+      goto again;
     cprintf("kalloc: out of memory\n");
     if (KERNEL_HEAP_PROFILE)
       heap_profile_print(&console);
     return nullptr;
   }
 }
+
+// Allocate n pages into pages[].  This takes what it can from the hot list,
+// and the rest from the buddy allocators with a single lock acquisition per
+// buddy, in contiguous runs where possible.  Returns the number of pages
+// allocated, which is less than n only if memory ran out.  Each page can be
+// freed on its own, or with kfree_batch().
+size_t
+kalloc_batch(const char *name, size_t n, void **pages, int cpu)
+{
+  size_t got = 0;
+  if (!kinited) {
+    for (; got < n; got++)
+      pages[got] = early_kalloc(PGSIZE, PGSIZE);
+    return n;
+  }
+
+  int reclaim_tries = 0;
+  size_t nhot;
+  do {
+    size_t first = got;
+    struct cpu_mem *mem;
+    {
+      scoped_cli cli;
+      mem = cpu >= 0 ? cpus[cpu].mem : mycpu()->mem;
+      nhot = std::min(n - got, mem->nhot);
+      mem->nhot -= nhot;
+      memmove(pages + got, mem->hot_pages + mem->nhot, nhot * sizeof *pages);
+      got += nhot;
+    }
+    if (got < n)
+      got += alloc_pages_from_buddies(mem, pages + got, n - got, cpu);
+    kstats::inc(&kstats::kalloc_page_alloc_count, (u64)(got - first));
+
+    for (size_t i = first; i < got; i++)
+      kalloc_prepare(pages[i], PGSIZE, name,
+                     i - first < nhot ? "hot list" : "buddy",
+                     __builtin_return_address(0));
+  } while (got < n && kalloc_shrink((n - got) * PGSIZE, &reclaim_tries));
+
+  if (got < n)
+    cprintf("kalloc_batch: out of memory\n");
+  return got;
+}
 #endif
 
 void *
@@ -1060,6 +1336,7 @@ initkalloc(void)
       }
     }
     size_t node_buddies = buddies.size() - node_low;
+    total_pages += node_stats.free / PGSIZE;
 
     console.println("kalloc: ", ssize(node_stats.free), " available in node ",
                     node.id,
@@ -1085,6 +1362,7 @@ initkalloc(void)
       // there's only one subnode).
       cpu->mem->steal.add(node_low, node_low + node_buddies);
       cpu->mem->nhot = 0;
+      cpu->mem->nhuge = 0;
       cpu->mem->mempool = node_low;
       ++cpu_index;
     }
@@ -1112,6 +1390,11 @@ initkalloc(void)
   kminit();
   kinited = 1;
 
+#if !KALLOC_LOAD_BALANCE
+  register_shrinker("kalloc per-CPU caches", SHRINK_CPU_CACHES,
+                    shrink_cpu_caches);
+#endif
+
   devsw[MAJ_KMEMSTATS].pread = kmemstatsread;
 }
 
@@ -1121,9 +1404,17 @@ kfree(void *v, size_t size)
 {
   allmem.kfree(v, size);
 }
-#else
+
 void
-kfree(void *v, size_t size)
+kfree_batch(void **pages, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    allmem.kfree(pages[i], PGSIZE);
+}
+#else
+// Undo kalloc_prepare() for a block that is being freed.
+static void
+kfree_prepare(void *v, size_t size)
 {
   // Fill with junk to catch dangling refs.
   if (ALLOC_MEMSET && kinited)
@@ -1139,6 +1430,57 @@ kfree(void *v, size_t size)
     if (alloc_rip)
       heap_profile_update(HEAP_PROFILE_KALLOC, alloc_rip, -size);
   }
+  if (kinited)
+    heap_sample_free(HEAP_PROFILE_KALLOC, v);
+}
+
+// Return n pages, sorted by address, to the buddy allocators.  Consecutive
+// pages that go to the same buddy are freed under one acquisition of its
+// lock.
+static void
+free_pages_to_buddies(struct cpu_mem *mem, void **pages, size_t n)
+{
+  locked_buddy *lb = nullptr;
+  lock_guard<spinlock> lock;
+  for (size_t i = 0; i < n; ++i) {
+    void *ptr = pages[i];
+    // Do we have the right buddy?
+    if (!lb || !(lb->alloc.contains(ptr) &&
+                 lb->alloc.get_free_bytes() < lb->free_limit)) {
+      // Find the first buddy in steal order that contains ptr and
+      // hasn't reached its free limit.  We do it this way in case
+      // there are overlapping buddies.
+      lock.release();
+      lb = nullptr;
+      for (auto buddyidx : mem->steal) {
+        auto lbtry = &buddies[buddyidx];
+        // We can access free_bytes and free_limit without locking
+        // here since it's okay if we actually go a little over
+        // free_limit.
+        if (lbtry->alloc.contains(ptr) &&
+            lbtry->alloc.get_free_bytes() < lbtry->free_limit) {
+          lb = lbtry;
+          break;
+        }
+      }
+      assert(lb);
+      if (!mem->steal.is_local(lb - &buddies[0])) {
+        kstats::inc(&kstats::kalloc_hot_list_remote_free_count);
+#if PRINT_STEAL
+        cprintf("CPU %d returning hot list to buddy %lu\n", myid(),
+                lb - &buddies[0]);
+#endif
+      }
+      lock = lb->lock.guard();
+    }
+    lb->alloc.free(ptr, PGSIZE);
+  }
+}
+
+void
+kfree(void *v, size_t size)
+{
+  kfree_prepare(v, size);
 
   auto mem = mycpu()->mem;
   if (size == PGSIZE) {
@@ -1150,42 +1492,7 @@ kfree(void *v, size_t size)
       // allocator list, minimizing and batching our locks.
       kstats::inc(&kstats::kalloc_hot_list_flush_count);
       std::sort(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2));
-      locked_buddy *lb = nullptr;
-      lock_guard<spinlock> lock;
-      for (size_t i = 0; i < KALLOC_HOT_PAGES / 2; ++i) {
-        void *ptr = mem->hot_pages[i];
-        // Do we have the right buddy?
-        if (!lb || !(lb->alloc.contains(ptr) &&
-                     lb->alloc.get_free_bytes() < lb->free_limit)) {
-          // Find the first buddy in steal order that contains ptr and
-          // hasn't reached its free limit.  We do it this way in case
-          // there are overlapping buddies.
-          lock.release();
-          lb = nullptr;
-          for (auto buddyidx : mem->steal) {
-            auto lbtry = &buddies[buddyidx];
-            // We can access free_bytes and free_limit without locking
-            // here since it's okay if we actually go a little over
-            // free_limit.
-            if (lbtry->alloc.contains(ptr) &&
-                lbtry->alloc.get_free_bytes() < lbtry->free_limit) {
-              lb = lbtry;
-              break;
-            }
-          }
-          assert(lb);
-          if (!mem->steal.is_local(lb - &buddies[0])) {
-            kstats::inc(&kstats::kalloc_hot_list_remote_free_count);
-#if PRINT_STEAL
-            cprintf("CPU %d returning hot list to buddy %lu\n", myid(),
-                    lb - &buddies[0]);
-#endif
-          }
-          lock = lb->lock.guard();
-        }
-        lb->alloc.free(ptr, PGSIZE);
-      }
-      lock.release();
+      free_pages_to_buddies(mem, mem->hot_pages, KALLOC_HOT_PAGES / 2);
       // Shift hot page list down
       // XXX(Austin) Could use two lists and switch off
       mem->nhot = KALLOC_HOT_PAGES - (KALLOC_HOT_PAGES / 2);
@@ -1197,6 +1504,17 @@ kfree(void *v, size_t size)
     return;
   }
 
+  if (size == HUGE_PGSIZE) {
+    // Keep it in the huge page cache if there's room.  If there
+    // isn't, the buddy allocator can coalesce it back into larger
+    // blocks.
+    scoped_cli cli;
+    if (mem->nhuge < KALLOC_HOT_HUGE_PAGES) {
+      mem->huge_pages[mem->nhuge++] = v;
+      return;
+    }
+  }
+
   // Find the first allocator in steal order to return v to.  This
   // will check our local allocators first and handle overlapping
   // buddies.
@@ -1209,6 +1527,34 @@ kfree(void *v, size_t size)
   }
   panic("kfree: pointer %p is not in an allocated region", v);
 }
+
+// Free n pages at once.  The hot list is topped up first; the rest go
+// straight back to the buddy allocators, sorted so that each buddy's lock is
+// taken once per run of its pages.  This reorders pages[].
+void
+kfree_batch(void **pages, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    kfree_prepare(pages[i], PGSIZE);
+  kstats::inc(&kstats::kalloc_page_free_count, (u64)n);
+
+  struct cpu_mem *mem;
+  size_t nhot;
+  {
+    scoped_cli cli;
+    mem = mycpu()->mem;
+    nhot = std::min(n, KALLOC_HOT_PAGES - mem->nhot);
+    memmove(mem->hot_pages + mem->nhot, pages + n - nhot,
+            nhot * sizeof *pages);
+    mem->nhot += nhot;
+  }
+
+  if (n > nhot) {
+    kstats::inc(&kstats::kalloc_hot_list_flush_count);
+    std::sort(pages, pages + n - nhot);
+    free_pages_to_buddies(mem, pages, n - nhot);
+  }
+}
 #endif
 
 void
@@ -0,0 +1,524 @@
+// In-kernel microbenchmark runner (see kbench.hh).
+//
+// Usage: echo "names [cores] [iters]" > /dev/kbench; cat /dev/kbench
+//
+// names and cores are comma-separated lists; names may be "all".
+// cores defaults to 1,2,4,... up to ncpu and iters to 100000.  Each
+// benchmark runs once per core count, with one kernel thread pinned to
+// each of cores 0 to n-1, and reports its cycles per operation (the
+// mean over the cores, and the slowest core's), its throughput, and
+// its throughput relative to the 1-core run.  Reading /dev/kbench
+// returns the report of the last runs, or the registered benchmarks if
+// there were none.  kbench=names on the kernel command line runs those
+// benchmarks with the defaults at boot and prints the report to the
+// console.
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include "cpu.hh"
+#include "file.hh"
+#include "major.h"
+#include "kalloc.hh"
+#include "spinlock.hh"
+#include "bit_spinlock.hh"
+#include "refcache.hh"
+#include "chainhash.hh"
+#include "linearhash.hh"
+#include "radix_array.hh"
+#include "kbench.hh"
+
+extern u64 cpuhz;
+extern char cmdline[];
+
+static kbench *benches;
+
+kbench::kbench(const char *name)
+  : name(name), next(benches)
+{
+  // Runs from the global constructors, before any other core is up.
+  benches = this;
+}
+
+enum { DEFAULT_ITERS = 100000 };
+
+struct kbench_run
+{
+  kbench *b;
+  int ncores;
+  u64 iters;
+  std::atomic<int> ready;
+  std::atomic<int> done;
+  u64 cycles[NCPU];
+};
+
+struct kbench_arg
+{
+  kbench_run *run;
+  int id;
+};
+
+static kbench_arg args[NCPU];
+
+static void
+kbench_worker(void *a)
+{
+  kbench_arg *arg = (kbench_arg*)a;
+  kbench_run *r = arg->run;
+
+  // Every worker has a core of its own, so they can spin until all of
+  // them are running and start together.
+  r->ready++;
+  while (r->ready.load() < r->ncores)
+    nop_pause();
+  u64 t0 = rdtsc();
+  r->b->run(arg->id, r->iters);
+  r->cycles[arg->id] = rdtsc() - t0;
+  r->done++;
+}
+
+static char report[8192];
+static size_t report_len;
+static std::atomic<bool> running;
+
+static void
+report_printf(const char *fmt, ...)
+{
+  if (report_len + 1 >= sizeof(report))
+    return;
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(report + report_len, sizeof(report) - report_len, fmt, ap);
+  va_end(ap);
+  report_len += strlen(report + report_len);
+}
+
+// Run b on ncores cores and add a line to the report.  base is the
+// 1-core throughput, in ops/s, to compute the scaling against; returns
+// this run's.
+static u64
+run_one(kbench *b, int ncores, u64 iters, u64 base)
+{
+  static kbench_run r;
+  r.b = b;
+  r.ncores = ncores;
+  r.iters = iters;
+  r.ready = 0;
+  r.done = 0;
+
+  b->setup(ncores);
+  for (int i = 0; i < ncores; i++) {
+    args[i].run = &r;
+    args[i].id = i;
+    threadpin(kbench_worker, &args[i], "kbench", i);
+  }
+  while (r.done.load() < ncores)
+    yield();
+  b->teardown();
+
+  u64 sum = 0, max = 0;
+  for (int i = 0; i < ncores; i++) {
+    sum += r.cycles[i];
+    if (r.cycles[i] > max)
+      max = r.cycles[i];
+  }
+  // Tenths of cycles per operation; the kernel doesn't use the FPU.
+  u64 avg10 = sum * 10 / ncores / iters;
+  u64 max10 = max * 10 / iters;
+  u64 ops = max ? (u64)ncores * iters * (cpuhz / 1000) / max * 1000 : 0;
+  report_printf("%-18s %5d %9lu %7lu.%lu %7lu.%lu %12lu", b->name, ncores,
+                iters, avg10 / 10, avg10 % 10, max10 / 10, max10 % 10, ops);
+  if (base) {
+    u64 s = ops * 100 / base;
+    report_printf(" %4lu.%02lu\n", s / 100, s % 100);
+  } else {
+    report_printf("     -\n");
+  }
+  return ops;
+}
+
+static kbench*
+find_bench(const char *name, size_t len)
+{
+  for (kbench *b = benches; b; b = b->next)
+    if (strlen(b->name) == len && strncmp(b->name, name, len) == 0)
+      return b;
+  return nullptr;
+}
+
+// Parse a comma-separated list of numbers at *p into out.  Returns the
+// count, or -1 on a malformed list.
+static int
+parse_list(const char **p, int *out, int max)
+{
+  int n = 0;
+  const char *s = *p;
+  while (*s >= '0' && *s <= '9') {
+    int v = 0;
+    while (*s >= '0' && *s <= '9')
+      v = v * 10 + (*s++ - '0');
+    if (n == max)
+      return -1;
+    out[n++] = v;
+    if (*s != ',')
+      break;
+    s++;
+  }
+  *p = s;
+  return n;
+}
+
+// Run the benchmarks named in the "names [cores] [iters]" command cmd.
+static int
+kbench_cmd(const char *cmd)
+{
+  const char *names = cmd;
+  const char *p = cmd;
+  while (*p && *p != ' ' && *p != '\n')
+    p++;
+  const char *names_end = p;
+  while (*p == ' ')
+    p++;
+
+  int cores[NCPU];
+  int ncores = 0;
+  if (*p >= '0' && *p <= '9') {
+    ncores = parse_list(&p, cores, NCPU);
+    if (ncores < 0)
+      return -1;
+    while (*p == ' ')
+      p++;
+  } else {
+    for (int n = 1; n < ncpu; n *= 2)
+      cores[ncores++] = n;
+    cores[ncores++] = ncpu;
+  }
+  u64 iters = DEFAULT_ITERS;
+  if (*p >= '0' && *p <= '9') {
+    iters = 0;
+    while (*p >= '0' && *p <= '9')
+      iters = iters * 10 + (*p++ - '0');
+  }
+  if (names == names_end || iters == 0)
+    return -1;
+  for (int i = 0; i < ncores; i++)
+    if (cores[i] < 1 || cores[i] > ncpu)
+      return -1;
+
+  // Check all the names before running any.
+  bool all = names_end - names == 3 && strncmp(names, "all", 3) == 0;
+  for (const char *n = names; !all && n < names_end; ) {
+    const char *e = n;
+    while (e < names_end && *e != ',')
+      e++;
+    if (!find_bench(n, e - n))
+      return -1;
+    n = e + 1;
+  }
+
+  report_len = 0;
+  report_printf("%-18s %5s %9s %9s %9s %12s %6s\n", "bench", "cores",
+                "iters", "cyc/op", "max/op", "ops/s", "scale");
+  for (const char *n = names; n < names_end; ) {
+    const char *e = n;
+    while (e < names_end && *e != ',')
+      e++;
+    for (kbench *b = benches; b; b = b->next) {
+      if (!all && !(strlen(b->name) == (size_t)(e - n) &&
+                    strncmp(b->name, n, e - n) == 0))
+        continue;
+      u64 base = 0;
+      for (int i = 0; i < ncores; i++) {
+        u64 ops = run_one(b, cores[i], iters, base);
+        if (cores[i] == 1)
+          base = ops;
+      }
+    }
+    n = e + 1;
+  }
+  return 0;
+}
+
+static int
+kbenchread(mdev*, char *dst, u32 off, u32 n)
+{
+  char buf[1024];
+  const char *src = report;
+  size_t len = report_len;
+  if (!len) {
+    snprintf(buf, sizeof(buf), "benchmarks:");
+    len = strlen(buf);
+    for (kbench *b = benches; b; b = b->next) {
+      snprintf(buf + len, sizeof(buf) - len, " %s", b->name);
+      len += strlen(buf + len);
+    }
+    snprintf(buf + len, sizeof(buf) - len, "\n");
+    len += strlen(buf + len);
+    src = buf;
+  }
+  if (off >= len)
+    return 0;
+  n = MIN(n, len - off);
+  memmove(dst, src + off, n);
+  return n;
+}
+
+static int
+kbenchwrite(mdev*, const char *buf, u32 n)
+{
+  char cmd[128];
+  if (n >= sizeof(cmd))
+    return -1;
+  memmove(cmd, buf, n);
+  cmd[n] = 0;
+
+  bool expected = false;
+  if (!running.compare_exchange_strong(expected, true))
+    return -1;
+  int r = kbench_cmd(cmd);
+  running = false;
+  return r < 0 ? -1 : n;
+}
+
+static char boot_cmd[128];
+
+static void
+kbench_boot(void*)
+{
+  // The workers on other cores start once those cores come up.
+  running = true;
+  if (kbench_cmd(boot_cmd) < 0)
+    cprintf("kbench: bad kbench=%s\n", boot_cmd);
+  else
+    cprintf("%s", report);
+  running = false;
+}
+
+// The benchmarks
+
+// Acquire and release one spinlock shared by all cores.
+class spinlock_shared_bench : public kbench
+{
+  spinlock lock_;
+
+public:
+  spinlock_shared_bench(const char *name, bool queued)
+    : kbench(name), lock_("kbench", false, queued) { }
+
+  void run(int id, u64 iters) override
+  {
+    for (u64 i = 0; i < iters; i++) {
+      lock_.acquire();
+      lock_.release();
+    }
+  }
+};
+
+static spinlock_shared_bench spinlock_bench("spinlock", false);
+static spinlock_shared_bench spinlock_queued_bench("spinlock_queued", true);
+
+// Acquire and release a spinlock of the core's own.
+static class : public kbench
+{
+  struct padded_lock
+  {
+    spinlock lock;
+  } __mpalign__;
+  padded_lock locks_[NCPU];
+
+public:
+  using kbench::kbench;
+
+  void setup(int ncores) override
+  {
+    for (int i = 0; i < ncores; i++)
+      locks_[i].lock = spinlock("kbench private");
+  }
+
+  void run(int id, u64 iters) override
+  {
+    spinlock *l = &locks_[id].lock;
+    for (u64 i = 0; i < iters; i++) {
+      l->acquire();
+      l->release();
+    }
+  }
+} spinlock_private_bench("spinlock_private");
+
+// An atomic increment of a shared counter, as the baseline for the
+// scalable counters below.
+static class : public kbench
+{
+  std::atomic<u64> count_;
+
+public:
+  using kbench::kbench;
+
+  void run(int id, u64 iters) override
+  {
+    for (u64 i = 0; i < iters; i++)
+      count_++;
+  }
+} atomic_bench("atomic_inc");
+
+// inc and dec of one refcache object shared by all cores.
+static class : public kbench
+{
+  class object : public refcache::referenced
+  {
+  public:
+    NEW_DELETE_OPS(object);
+  protected:
+    void onzero() override { delete this; }
+  };
+  object *obj_;
+
+public:
+  using kbench::kbench;
+
+  void setup(int ncores) override { obj_ = new object(); }
+  void teardown(void) override { obj_->dec(); }
+
+  void run(int id, u64 iters) override
+  {
+    for (u64 i = 0; i < iters; i++) {
+      obj_->inc();
+      obj_->dec();
+    }
+  }
+} refcache_bench("refcache_incdec");
+
+enum { NKEYS = 4096 };
+
+// Lookups of keys spread over a chainhash.
+static class : public kbench
+{
+  chainhash<u64, u64> *h_;
+
+public:
+  using kbench::kbench;
+
+  void setup(int ncores) override
+  {
+    h_ = new chainhash<u64, u64>(NKEYS);
+    for (u64 k = 0; k < NKEYS; k++)
+      h_->insert(k, k);
+  }
+  void teardown(void) override { delete h_; }
+
+  void run(int id, u64 iters) override
+  {
+    u64 v;
+    for (u64 i = 0; i < iters; i++)
+      if (!h_->lookup((i * 7 + id * 613) % NKEYS, &v))
+        panic("kbench: chainhash lookup");
+  }
+} chainhash_bench("chainhash_lookup");
+
+// Lookups of keys spread over a linearhash.
+static class : public kbench
+{
+  linearhash<u64, u64> *h_;
+
+public:
+  using kbench::kbench;
+
+  void setup(int ncores) override
+  {
+    h_ = new linearhash<u64, u64>(NKEYS * 2);
+    for (u64 k = 0; k < NKEYS; k++)
+      h_->insert(k, k);
+  }
+  void teardown(void) override { delete h_; }
+
+  void run(int id, u64 iters) override
+  {
+    u64 v;
+    for (u64 i = 0; i < iters; i++)
+      if (!h_->lookup((i * 7 + id * 613) % NKEYS, &v))
+        panic("kbench: linearhash lookup");
+  }
+} linearhash_bench("linearhash_lookup");
+
+// A radix_array value of the smallest kind: bit 0 is the lock, bit 1
+// whether it is set.
+struct kbench_slot
+{
+  u64 v_;
+
+  kbench_slot() : v_(0) { }
+  explicit kbench_slot(u64 x) : v_(x << 2 | 2) { }
+  kbench_slot(const kbench_slot &o) : v_(o.v_) { }
+  kbench_slot &operator=(const kbench_slot &o)
+  {
+    // Keep our own lock bit.
+    v_ = (o.v_ & ~1ull) | (v_ & 1);
+    return *this;
+  }
+
+  bit_spinlock get_lock() { return bit_spinlock(&v_, 0); }
+  bool is_set() const { return v_ & 2; }
+};
+
+enum { RADIX_SPAN = 1 << 16 };
+
+// Locked single-slot fills, each core in a range of its own.
+static class : public kbench
+{
+  radix_array<kbench_slot, (u64)NCPU * RADIX_SPAN, PGSIZE,
+              kalloc_allocator<kbench_slot>> ra_;
+
+public:
+  using kbench::kbench;
+
+  void teardown(void) override
+  {
+    ra_.unset(ra_.begin(), ra_.end());
+  }
+
+  void run(int id, u64 iters) override
+  {
+    for (u64 i = 0; i < iters; i++) {
+      auto it = ra_.find((u64)id * RADIX_SPAN + i % RADIX_SPAN);
+      auto l = ra_.acquire(it);
+      ra_.fill(it, kbench_slot(i));
+    }
+  }
+} radix_bench("radix_fill");
+
+// kmalloc and kmfree of a small object.
+static class : public kbench
+{
+public:
+  using kbench::kbench;
+
+  void run(int id, u64 iters) override
+  {
+    for (u64 i = 0; i < iters; i++) {
+      void *p = kmalloc(64, "kbench");
+      if (!p)
+        panic("kbench: kmalloc");
+      kmfree(p, 64);
+    }
+  }
+} kmalloc_bench("kmalloc");
+
+void
+initkbench(void)
+{
+  devsw[MAJ_KBENCH].pread = kbenchread;
+  devsw[MAJ_KBENCH].write = kbenchwrite;
+
+  const char *p = cmdline;
+  while (*p && strncmp(p, "kbench=", 7) != 0)
+    p++;
+  if (*p) {
+    p += 7;
+    size_t n = 0;
+    while (p[n] && p[n] != ' ' && n < sizeof(boot_cmd) - 1)
+      n++;
+    memmove(boot_cmd, p, n);
+    boot_cmd[n] = 0;
+    threadpin(kbench_boot, nullptr, "kbench boot", 0);
+  }
+}
@@ -49,6 +49,8 @@ operator new[](std::size_t nbytes)
     else
       adi->set_newarr_rip(nullptr);
   }
+  heap_sample_alloc(HEAP_PROFILE_NEWARRAY, __builtin_return_address(0), x+1,
+                    nbytes);
 
   return x+1;
 }
@@ -66,6 +68,7 @@ operator delete[](void* p)
     if (alloc_rip)
       heap_profile_update(HEAP_PROFILE_NEWARRAY, alloc_rip, -nbytes);
   }
+  heap_sample_free(HEAP_PROFILE_NEWARRAY, p);
 
   kmfree(x-1, nbytes + sizeof(u64));
 }
@@ -159,6 +159,8 @@ kmalloc(u64 nbytes, const char *name, int cpu)
     else
       adi->set_kmalloc_rip(nullptr);
   }
+  heap_sample_alloc(HEAP_PROFILE_KMALLOC, __builtin_return_address(0), h,
+                    nbytes);
 
   mtlabel(mtrace_label_heap, (void*) h, nbytes, name, strlen(name));
 
@@ -178,6 +180,7 @@ kmfree(void *ap, u64 nbytes)
     if (alloc_rip)
       heap_profile_update(HEAP_PROFILE_KMALLOC, alloc_rip, -nbytes);
   }
+  heap_sample_free(HEAP_PROFILE_KMALLOC, ap);
 
   if (nbytes > PGSIZE / 2) {
     // Free full page allocation
@@ -0,0 +1,192 @@
+//
+// Typed object caches with per-CPU magazines.
+//
+
+#include "types.h"
+#include "mmu.h"
+#include "kernel.hh"
+#include "kmcache.hh"
+#include "mtrace.h"
+#include "kstream.hh"
+#include "heapprof.hh"
+
+#include <utility>
+
+// Caches that have allocated memory, for print_all().
+static kmem_cache *all_caches;
+static spinlock all_caches_lock("kmem_cache list");
+
+void *
+kmem_cache::alloc()
+{
+  void *p = nullptr;
+  {
+    scoped_cli cli;
+    cpu_magazines &cm = *cpus_;
+    if (!cm.loaded || cm.loaded->n == 0) {
+      if (cm.prev && cm.prev->n == MAGAZINE_SIZE) {
+        std::swap(cm.loaded, cm.prev);
+      } else if (magazine *full = get_full()) {
+        // Give the depot back an empty magazine and load a full one.
+        if (cm.prev)
+          put_magazine(cm.prev);
+        cm.prev = cm.loaded;
+        cm.loaded = full;
+      }
+    }
+    if (cm.loaded && cm.loaded->n > 0)
+      p = cm.loaded->objs[--cm.loaded->n];
+  }
+  if (p) {
+    mtlabel(mtrace_label_heap, p, size_, name_, strlen(name_));
+    heap_sample_alloc(HEAP_PROFILE_KMCACHE, __builtin_return_address(0), p,
+                      size_);
+  }
+  return p;
+}
+
+void
+kmem_cache::free(void *p)
+{
+  mtunlabel(mtrace_label_heap, p);
+  heap_sample_free(HEAP_PROFILE_KMCACHE, p);
+  if (ALLOC_MEMSET)
+    memset(p, 3, size_);
+
+  scoped_cli cli;
+  cpu_magazines &cm = *cpus_;
+  if (!cm.loaded || cm.loaded->n == MAGAZINE_SIZE) {
+    if (cm.prev && cm.prev->n == 0) {
+      std::swap(cm.loaded, cm.prev);
+    } else if (magazine *empty = get_empty()) {
+      // Give the depot back a full magazine and load an empty one.
+      if (cm.prev)
+        put_magazine(cm.prev);
+      cm.prev = cm.loaded;
+      cm.loaded = empty;
+    } else {
+      // No memory for a magazine; put the object straight in the
+      // depot.
+      auto l = lock_.guard();
+      auto obj = (free_obj*)p;
+      obj->next = free_objs_;
+      free_objs_ = obj;
+      return;
+    }
+  }
+  cm.loaded->objs[cm.loaded->n++] = p;
+}
+
+// Return a full magazine from the depot, filling one from free objects
+// (and a new slab, if there are none) if the depot has no full
+// magazines.  Returns nullptr if out of memory.
+kmem_cache::magazine *
+kmem_cache::get_full()
+{
+  auto l = lock_.guard();
+  if (magazine *m = full_) {
+    full_ = m->next;
+    return m;
+  }
+
+  if (!free_objs_) {
+    l.release();
+    if (!grow())
+      return nullptr;
+    l = lock_.guard();
+  }
+
+  magazine *m = empty_;
+  if (m) {
+    empty_ = m->next;
+  } else {
+    l.release();
+    m = (magazine*)kmalloc(sizeof(magazine), "kmem_cache magazine");
+    if (!m)
+      return nullptr;
+    l = lock_.guard();
+  }
+  m->n = 0;
+  while (free_objs_ && m->n < MAGAZINE_SIZE) {
+    m->objs[m->n++] = free_objs_;
+    free_objs_ = free_objs_->next;
+  }
+  return m;
+}
+
+// Return an empty magazine from the depot, or a new one.  Returns
+// nullptr if out of memory.
+kmem_cache::magazine *
+kmem_cache::get_empty()
+{
+  {
+    auto l = lock_.guard();
+    if (magazine *m = empty_) {
+      empty_ = m->next;
+      return m;
+    }
+  }
+  magazine *m = (magazine*)kmalloc(sizeof(magazine), "kmem_cache magazine");
+  if (m)
+    m->n = 0;
+  return m;
+}
+
+// Return a magazine to the depot.  Only the loaded magazine can be
+// partly full, so this is either full or empty.
+void
+kmem_cache::put_magazine(magazine *m)
+{
+  auto l = lock_.guard();
+  if (m->n == 0) {
+    m->next = empty_;
+    empty_ = m;
+  } else {
+    m->next = full_;
+    full_ = m;
+  }
+}
+
+// Allocate a slab and add its objects to the depot's free objects.
+bool
+kmem_cache::grow()
+{
+  char *slab = kalloc(name_, slab_size_);
+  if (!slab)
+    return false;
+
+  free_obj *head = nullptr;
+  for (char *q = slab + slab_size_ - slab_size_ % size_; q > slab;) {
+    q -= size_;
+    auto obj = (free_obj*)q;
+    obj->next = head;
+    head = obj;
+  }
+
+  bool first;
+  {
+    auto l = lock_.guard();
+    first = nslabs_++ == 0;
+    free_obj *tail = head;
+    while (tail->next)
+      tail = tail->next;
+    tail->next = free_objs_;
+    free_objs_ = head;
+  }
+
+  if (first) {
+    auto l = all_caches_lock.guard();
+    next_ = all_caches;
+    all_caches = this;
+  }
+  return true;
+}
+
+void
+kmem_cache::print_all(print_stream *s)
+{
+  auto l = all_caches_lock.guard();
+  for (kmem_cache *c = all_caches; c; c = c->next_)
+    s->println(c->name_, ": ", c->size_, " byte objects, ",
+               c->nslabs_, " slabs of ", c->slab_size_, " bytes");
+}
@@ -0,0 +1,66 @@
+#include "types.h"
+#include "kernel.hh"
+#include "cpu.hh"
+#include "percpu.hh"
+#include "kworker.hh"
+
+namespace {
+  struct kworker_pool
+  {
+    kworker_pool()
+      : lock_("kworker_pool", LOCKSTAT_WQ), cv_("kworker"), nidle_(0) {}
+
+    spinlock lock_;
+    condvar cv_;
+    // Protected by lock_.
+    isqueue<kwork, &kwork::link_> queue_;
+    u64 nidle_;
+  };
+}
+
+DEFINE_PERCPU(kworker_pool, kworker_pools, NO_CRITICAL);
+
+void
+kwork_push(kwork *w, int cpu)
+{
+  if (cpu < 0)
+    cpu = myid();
+  assert(cpu < ncpu);
+  kworker_pool *pool = &kworker_pools[cpu];
+  scoped_acquire l(&pool->lock_);
+  pool->queue_.push_back(w);
+  if (pool->nidle_)
+    pool->cv_.wake_all();
+}
+
+static void
+kworker(void *arg)
+{
+  kworker_pool *pool = &kworker_pools[(uintptr_t)arg];
+  for (;;) {
+    kwork *w;
+    {
+      scoped_acquire l(&pool->lock_);
+      while (pool->queue_.empty()) {
+        pool->nidle_++;
+        pool->cv_.sleep(&pool->lock_);
+        pool->nidle_--;
+      }
+      w = &pool->queue_.front();
+      pool->queue_.pop_front();
+    }
+    w->run();
+  }
+}
+
+void
+initkworker(void)
+{
+  for (int c = 0; c < ncpu; c++) {
+    for (int i = 0; i < KWORKERS_PER_CPU; i++) {
+      char namebuf[32];
+      snprintf(namebuf, sizeof(namebuf), "kworker_%u.%u", c, i);
+      threadpin(kworker, (void*)(uintptr_t)c, namebuf, c);
+    }
+  }
+}
@@ -42,19 +42,31 @@ void initinode_early(void);
 void recover_scalefs(void);
 void initinode_late(void);
 void initdisk(void);
+void initblkio(void);
 void inituser(void);
 void initsamp(void);
 void inite1000(void);
+void initigb(void);
 void initahci(void);
+void initnvme(void);
 void initpci(void);
 void initnet(void);
 void initsched(void);
 void initlockstat(void);
+void initlockprof(void);
+void initsperf(void);
+void initheapprof(void);
+void initschedtrace(void);
+void inittracepoint(void);
+void initfaultstats(void);
+void initsyscallstats(void);
+void initkbench(void);
 void initidle(void);
 void initcpprt(void);
 void initfutex(void);
 void initcmdline(void);
 void initrefcache(void);
+void initkworker(void);
 void initacpitables(void);
 void initnuma(void);
 void initcpus(void);
@@ -65,6 +77,7 @@ void initwd(void);
 void initdev(void);
 void inithpet(void);
 void initrtc(void);
+void inittimepage(void);
 void initmfs(void);
 void idleloop(void);
 void init_scalefs(void);
@@ -185,6 +198,7 @@ cmain(u64 mbmagic, u64 mbaddr)
   initphysmem(mbaddr);
   initpg();                // Requires initphysmem
   inithz();        // CPU Hz, microdelay
+  inittimer();     // nsectime; requires inithz
   initseg(&cpus[0]);
   inittls(&cpus[0]);       // Requires initseg
 
@@ -235,17 +249,31 @@ cmain(u64 mbmagic, u64 mbaddr)
   initidle();
   initgc();        // gc epochs and threads
   initrefcache();  // Requires initsched
+  initkworker();   // Requires initsched
   initconsole();
   initfutex();
   initsamp();
   initlockstat();
+  initlockprof();
+  initsperf();
+  initheapprof();
+  initschedtrace();
+  inittracepoint();
+  initfaultstats();
+  initsyscallstats();
+  initkbench();
   initacpi();              // Requires initacpitables, initkalloc?
   inite1000();             // Before initpci
+  initigb();               // Before initpci
   initahci();
+  initnvme();
   initpci();               // Suggests initacpi
   initnet();
-  initrtc();               // Requires inithpet
+  inittimepage();
+  initrtc();               // Requires inithpet, inittimepage
   initdev();               // Misc /dev nodes
+  binit();                 // buffer cache
+  initblkio();
   initdisk();      // disk
 
   initinode_early();     // inode cache
@@ -12,10 +12,16 @@
 #include "disk.hh"
 #include "buf.hh"
 #include "ideconfig.hh"
+#include "kstream.hh"
+#include "major.h"
+#include "file.hh"
 #include <sys/time.h>
+#include <atomic>
+#include <algorithm>
 
 extern u8 _fs_imgz_start[];
 extern u64 _fs_imgz_size;
+extern u64 cpuhz;
 
 #if MEMIDE
 
@@ -29,7 +35,12 @@ class memdisk : public disk
 public:
   NEW_DELETE_OPS(memdisk);
 
-  memdisk(u64 nbytes) : data_ptr_(nullptr), nbytes_(nbytes)
+  memdisk(u64 nbytes)
+    : data_ptr_(nullptr), nbytes_(nbytes),
+      latency_us(MEMIDE_LATENCY_US), bandwidth_mbps(MEMIDE_BANDWIDTH_MBPS),
+      flush_us(MEMIDE_FLUSH_US), nreads(0), nwrites(0), nflushes(0),
+      live_(false), busy_until_(0), last_due_(0), head_(nullptr),
+      tail_(nullptr)
   {
     dk_nbytes = nbytes;
     snprintf(dk_busloc, sizeof(dk_busloc), "memide");
@@ -43,51 +54,202 @@ public:
 
   void readv(kiovec *iov, int iov_cnt, u64 off) override
   {
-    u8 *p;
+    sref<disk_completion> dc = make_sref<disk_completion>();
+    areadv(iov, iov_cnt, off, dc);
+    dc->wait();
+  }
 
-    assert (iov_cnt == 1);
-    u64 count = iov[0].iov_len;
+  void writev(kiovec *iov, int iov_cnt, u64 off) override
+  {
+    sref<disk_completion> dc = make_sref<disk_completion>();
+    awritev(iov, iov_cnt, off, dc);
+    dc->wait();
+  }
+
+  void flush() override
+  {
+    sref<disk_completion> dc = make_sref<disk_completion>();
+    aflush(dc);
+    dc->wait();
+  }
 
-    if(off > nbytes_ || off + count > nbytes_)
-      panic("memdisk::readv: sector out of range: offset %ld, count %ld\n",
-            off, count);
+  // The data moves as soon as the request is made; only its completion is
+  // held back by the latency model.
+  void areadv(kiovec *iov, int iov_cnt, u64 off,
+              sref<disk_completion> dc) override
+  {
+    nreads++;
+    complete(schedule(copy(iov, iov_cnt, off, false), false), dc);
+  }
 
-    assert(off % BSIZE == 0);
-    p = data_ptr_[off / BSIZE];
-    memmove(iov[0].iov_base, p, count);
+  void awritev(kiovec *iov, int iov_cnt, u64 off,
+               sref<disk_completion> dc) override
+  {
+    nwrites++;
+    complete(schedule(copy(iov, iov_cnt, off, true), false), dc);
   }
 
-  void writev(kiovec *iov, int iov_cnt, u64 off) override
+  void aflush(sref<disk_completion> dc) override
   {
-    u8 *p;
+    nflushes++;
+    complete(schedule(0, true), dc);
+  }
+
+  // Completes the I/O requests whose simulated service time has passed.
+  static void completer(void *arg);
 
-    // For simplicity, we mandate that all the I/O requests in the vector are of
-    // equal size (BSIZE).
+public:
+  u8** data_ptr_;
+  const u64 nbytes_;
 
-    u64 count = iov[0].iov_len;
+  // The latency model (see /dev/memdisk). Each request takes latency_us to
+  // complete once its data has been transferred, at bandwidth_mbps (0 for
+  // unlimited) one request at a time. A flush holds up every request behind
+  // it for flush_us.
+  std::atomic<u64> latency_us;
+  std::atomic<u64> bandwidth_mbps;
+  std::atomic<u64> flush_us;
+
+  std::atomic<u64> nreads;
+  std::atomic<u64> nwrites;
+  std::atomic<u64> nflushes;
+
+private:
+  // Copy the data between iov and the disk, and return how many bytes it was.
+  u64 copy(kiovec *iov, int iov_cnt, u64 off, bool write)
+  {
+    u64 count = 0;
+    for (int i = 0; i < iov_cnt; i++)
+      count += iov[i].iov_len;
 
-    if (off > nbytes_ || off + iov_cnt * count > nbytes_)
-      panic("memdisk::writev: sector out of range: offset %ld, count %ld\n",
-             off, iov_cnt * count);
+    if (off > nbytes_ || off + count > nbytes_)
+      panic("memdisk::%s: sector out of range: offset %ld, count %ld\n",
+            write ? "writev" : "readv", off, count);
 
-    u64 blknum = off / BSIZE;
     for (int i = 0; i < iov_cnt; i++) {
-      assert(iov[i].iov_len == BSIZE);
-      p = data_ptr_[blknum];
-      memmove(p, iov[i].iov_base, iov[i].iov_len);
-      blknum++;
+      char *base = (char *) iov[i].iov_base;
+      for (u64 done = 0; done < iov[i].iov_len; ) {
+        u64 blkoff = off % BSIZE;
+        u64 n = std::min(iov[i].iov_len - done, BSIZE - blkoff);
+        u8 *p = data_ptr_[off / BSIZE] + blkoff;
+        if (write)
+          memmove(p, base + done, n);
+        else
+          memmove(base + done, p, n);
+        done += n;
+        off += n;
+      }
     }
+    return count;
   }
 
-  void flush() override
+  // Return the TSC value at which a request for nbytes (or a flush), made
+  // now, completes.  Requests complete in the order they were made, since a
+  // flush can't overtake the writes in front of it either.
+  u64 schedule(u64 nbytes, bool flush)
   {
+    u64 lat = latency_us, bw = bandwidth_mbps, fl = flush_us;
+    if (!live_ || (!lat && !bw && !fl))
+      return 0;
+
+    scoped_acquire l(&lock_);
+    u64 start = std::max(rdtsc(), busy_until_);
+    u64 due;
+    if (flush) {
+      busy_until_ = start + fl * cpuhz / 1000000;
+      due = busy_until_;
+    } else {
+      if (bw)
+        start += nbytes * cpuhz / (bw * 1000000);
+      busy_until_ = start;
+      due = start + lat * cpuhz / 1000000;
+    }
+    due = std::max(due, last_due_);
+    last_due_ = due;
+    return due;
   }
 
-public:
-  u8** data_ptr_;
-  const u64 nbytes_;
+  struct pending_io {
+    NEW_DELETE_OPS(pending_io);
+    u64 due;
+    sref<disk_completion> dc;
+    pending_io *next;
+  };
+
+  void complete(u64 due, sref<disk_completion> dc)
+  {
+    if (!due) {
+      dc->notify();
+      return;
+    }
+
+    pending_io *io = new pending_io();
+    io->due = due;
+    io->dc = dc;
+    io->next = nullptr;
+
+    scoped_acquire l(&lock_);
+    if (tail_) {
+      tail_->next = io;
+    } else {
+      head_ = io;
+      cv_.wake_all();
+    }
+    tail_ = io;
+  }
+
+  // Until the completer runs, the model is off, so that the I/O done while
+  // booting doesn't wait for a thread that can't run yet.
+  std::atomic<bool> live_;
+
+  spinlock lock_;
+  condvar cv_;
+  u64 busy_until_;      // When the transfers requested so far are over
+  u64 last_due_;
+  pending_io *head_;    // In completion order
+  pending_io *tail_;
 };
 
+void
+memdisk::completer(void *arg)
+{
+  memdisk *md = (memdisk *) arg;
+  // Waits longer than a tick sleep; shorter ones have to spin.
+  u64 tick = cpuhz / 1000 * QUANTUM;
+
+  md->live_ = true;
+  md->lock_.acquire();
+  for (;;) {
+    pending_io *io = md->head_;
+    if (!io) {
+      md->cv_.sleep(&md->lock_);
+      continue;
+    }
+
+    u64 now = rdtsc();
+    if (io->due > now) {
+      u64 wait = io->due - now;
+      if (wait > tick) {
+        md->cv_.sleep_to(&md->lock_,
+                         nsectime() + (wait - tick) / (cpuhz / 1000000) * 1000);
+      } else {
+        md->lock_.release();
+        yield();
+        md->lock_.acquire();
+      }
+      continue;
+    }
+
+    md->head_ = io->next;
+    if (!md->head_)
+      md->tail_ = nullptr;
+    md->lock_.release();
+    io->dc->notify();
+    delete io;
+    md->lock_.acquire();
+  }
+}
+
 static memdisk* md;
 
 // Allocate memory for the ramdisk intelligently:
@@ -252,6 +414,51 @@ verify_backing_memory(u64 disk_size_bytes)
     assert(md->data_ptr_[i]);
 }
 
+static int
+memdiskread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  s.println("Latency: ", md->latency_us.load(), " us");
+  s.println("Bandwidth: ", md->bandwidth_mbps.load(), " MB/s");
+  s.println("Flush: ", md->flush_us.load(), " us");
+  s.println("Reads: ", md->nreads.load(), " writes: ", md->nwrites.load(),
+            " flushes: ", md->nflushes.load());
+  return s.get_used();
+}
+
+// Usage:
+// To make every request take 100us, cap the bandwidth at 500MB/s, and make
+// flushes take 2ms, do:
+// $ echo 100 500 2000 > /dev/memdisk
+// (echo 0 0 0 to turn the latency model off.)
+static int
+memdiskwrite(mdev*, const char *buf, u32 n)
+{
+  u64 v[3] = { 0, 0, 0 };
+  u32 i = 0;
+
+  for (int k = 0; k < 3; k++) {
+    u32 start = i;
+    for (; i < n && buf[i] >= '0' && buf[i] <= '9'; i++)
+      v[k] = v[k] * 10 + (buf[i] - '0');
+    if (i == start || (k < 2 && (i == n || buf[i] != ' '))) {
+      cprintf("memdisk: expected <latency-us> <bandwidth-mbps> <flush-us>\n");
+      return n;
+    }
+    if (k < 2)
+      i++;
+  }
+  if (i < n && buf[i] != '\n') {
+    cprintf("memdisk: expected <latency-us> <bandwidth-mbps> <flush-us>\n");
+    return n;
+  }
+
+  md->latency_us = v[0];
+  md->bandwidth_mbps = v[1];
+  md->flush_us = v[2];
+  return n;
+}
+
 void
 initmemdisk(void)
 {
@@ -262,6 +469,9 @@ initdisk(void)
 {
   md = new memdisk(_fs_img_size);
   disk_register(md);
+  threadpin(memdisk::completer, md, "memdisk", ncpu - 1);
+  devsw[MAJ_MEMDISK].pread = memdiskread;
+  devsw[MAJ_MEMDISK].write = memdiskwrite;
 
   struct timeval before, after;
 
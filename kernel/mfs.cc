@@ -4,6 +4,8 @@
 #include "major.h"
 #include "kstream.hh"
 #include "file.hh"
+#include "percpu.hh"
+#include "sperf.hh"
 
 u64 root_mnum;
 mfs* root_fs;
@@ -29,8 +31,8 @@ linearhash<u64, u64> *mnum_to_inum = NULL;
 //   skipelem("a", name) = "", setting name = "a"
 //   skipelem("", name) = skipelem("////", name) = 0
 //
-static int
-skipelem(const char **rpath, char *name)
+int
+skipelem(const char **rpath, fsname *name)
 {
   const char *path = *rpath;
   const char *s;
@@ -49,9 +51,7 @@ skipelem(const char **rpath, char *name)
             " (%d characters)\n", DIRSIZ);
     return -1;
   } else {
-    memmove(name, s, len);
-    if (len < DIRSIZ)
-      name[len] = 0;
+    *name = fsname(s, len);
   }
   while (*path == '/')
     path++;
@@ -59,20 +59,127 @@ skipelem(const char **rpath, char *name)
   return 1;
 }
 
+namespace {
+  // The path-prefix cache maps everything but the last element of a path,
+  // relative to the directory the lookup starts from, to the directory it
+  // resolves to, so that namex() only has to look up the last element.
+  // Cached prefixes can only go stale when a directory is unlinked or
+  // moved; dcache_invalidate() then bumps dcache_gen, which makes every
+  // existing entry miss.
+  struct dcache_entry {
+    u64 gen;                    // dcache_gen at lookup time; 0 if unused
+    mfs* fs;
+    u64 start;
+    u64 mnum;
+    u32 hash;
+    u32 len;
+    char prefix[SCALEFS_DCACHE_PATH];
+  };
+
+  struct dcache {
+    dcache_entry ents[SCALEFS_DCACHE_SIZE];
+    spinlock lock;
+  };
+
+  percpu<dcache> dcaches;
+  std::atomic<u64> dcache_gen(1);
+
+  u32
+  dcache_hash(mfs* fs, u64 start, const char* prefix, u32 len)
+  {
+    u64 h = (uintptr_t)fs ^ (start * 0x9e3779b97f4a7c15ull);
+    for (u32 i = 0; i < len; i++)
+      h = (h ^ (u8)prefix[i]) * 0x100000001b3ull;
+    return h ^ (h >> 32);
+  }
+
+  u64
+  dcache_lookup(mfs* fs, u64 start, const char* prefix, u32 len, u32 hash)
+  {
+    u64 gen = dcache_gen;
+    auto &dc = dcaches[myid()];
+    auto l = dc.lock.guard();
+    dcache_entry* e = &dc.ents[hash % SCALEFS_DCACHE_SIZE];
+    if (e->gen != gen || e->hash != hash || e->fs != fs ||
+        e->start != start || e->len != len ||
+        memcmp(e->prefix, prefix, len) != 0)
+      return 0;
+    return e->mnum;
+  }
+
+  void
+  dcache_insert(u64 gen, mfs* fs, u64 start, const char* prefix, u32 len,
+                u32 hash, u64 mnum)
+  {
+    auto &dc = dcaches[myid()];
+    auto l = dc.lock.guard();
+    dcache_entry* e = &dc.ents[hash % SCALEFS_DCACHE_SIZE];
+    e->gen = gen;
+    e->fs = fs;
+    e->start = start;
+    e->mnum = mnum;
+    e->hash = hash;
+    e->len = len;
+    memmove(e->prefix, prefix, len);
+  }
+}
+
+void
+dcache_invalidate()
+{
+  // Lookups read dcache_gen before walking the path, so an entry filled in
+  // by a walk that raced with this change carries the old generation.
+  dcache_gen++;
+}
+
 // Look up and return the mnode for a path name.  If nameiparent is true,
 // return the mnode for the parent and copy the final path element into name.
 static sref<mnode>
-namex(sref<mnode> cwd, const char* path, bool nameiparent, strbuf<DIRSIZ>* name)
+namex(sref<mnode> cwd, const char* path, bool nameiparent, fsname* name)
 {
+  SPERF_REGION(namex);
   sref<mnode> m;
+  mfs* fs;
+  u64 start;
+
+  if (*path == '/') {
+    fs = root_fs;
+    start = root_mnum;
+  } else {
+    fs = cwd->fs_;
+    start = cwd->mnum_;
+  }
+
+  // Find the last path element.  If there is something in front of it,
+  // try to resolve all of that with a single cache probe.
+  const char* last = path + strlen(path);
+  while (last > path && last[-1] == '/')
+    last--;
+  while (last > path && last[-1] != '/')
+    last--;
+
+  const char* prefix = path;
+  u32 len = last - prefix, hash = 0;
+  u64 gen = 0;
+  if (len > 1 && len <= SCALEFS_DCACHE_PATH) {
+    hash = dcache_hash(fs, start, prefix, len);
+    gen = dcache_gen;
+    u64 mnum = dcache_lookup(fs, start, prefix, len, hash);
+    if (mnum && (m = fs->mget(mnum))) {
+      path = last;
+      gen = 0;
+    }
+  }
 
-  if (*path == '/')
-    m = root_fs->mget(root_mnum);
-  else
-    m = cwd;
+  if (!m) {
+    if (*path == '/')
+      m = root_fs->mget(root_mnum);
+    else
+      m = cwd;
+  }
 
   int r;
-  while ((r = skipelem(&path, name->buf_)) == 1) {
+  while ((r = skipelem(&path, name)) == 1) {
     if (m->type() != mnode::types::dir)
       return sref<mnode>();
 
@@ -86,6 +193,10 @@ namex(sref<mnode> cwd, const char* path, bool nameiparent, strbuf<DIRSIZ>* name)
       return sref<mnode>();
 
     m = next;
+    if (gen && path == last && m->type() == mnode::types::dir) {
+      dcache_insert(gen, fs, start, prefix, len, hash, m->mnum_);
+      gen = 0;
+    }
   }
 
   if (r == -1 || nameiparent)
@@ -97,18 +208,73 @@ namex(sref<mnode> cwd, const char* path, bool nameiparent, strbuf<DIRSIZ>* name)
 sref<mnode>
 namei(sref<mnode> cwd, const char* path)
 {
-  strbuf<DIRSIZ> buf;
+  fsname buf;
   return namex(cwd, path, false, &buf);
 }
 
 sref<mnode>
-nameiparent(sref<mnode> cwd, const char* path, strbuf<DIRSIZ>* buf)
+nameiparent(sref<mnode> cwd, const char* path, fsname* buf)
 {
   return namex(cwd, path, true, buf);
 }
 
-s64
-readm(sref<mnode> m, char* buf, u64 start, u64 nbytes)
+// Walks a vector of user buffers, copying to or from them in order.
+struct iov_cursor {
+  const struct iovec *iov;
+  int left;
+  u64 segoff;
+
+  iov_cursor(const struct iovec *iov, int iovcnt)
+    : iov(iov), left(iovcnt), segoff(0) {}
+
+  // Copy n bytes between the next n bytes of the buffers and p, from
+  // p if in, to p if not.
+  bool copy(char *p, u64 n, bool in)
+  {
+    while (n) {
+      if (!left)
+        return false;
+      u64 len = MIN(n, iov->iov_len - segoff);
+      char *u = (char*)iov->iov_base + segoff;
+      if (in ? fetchmem(p, u, len) < 0 : putmem(u, p, len) < 0)
+        return false;
+      p += len;
+      n -= len;
+      segoff += len;
+      if (segoff == iov->iov_len) {
+        iov++;
+        left--;
+        segoff = 0;
+      }
+    }
+    return true;
+  }
+
+  // Move past the next n bytes of the buffers without copying them.
+  void skip(u64 n)
+  {
+    while (n && left) {
+      u64 len = MIN(n, iov->iov_len - segoff);
+      n -= len;
+      segoff += len;
+      if (segoff == iov->iov_len) {
+        iov++;
+        left--;
+        segoff = 0;
+      }
+    }
+  }
+
+  bool copy_out(const char *src, u64 n) { return copy((char*)src, n, false); }
+  bool copy_in(char *dst, u64 n) { return copy(dst, n, true); }
+};
+
+// Copy [start, start+nbytes) of m out of its page-cache pages with
+// copy(off, src, n), which copies n bytes from src to offset off of
+// the destination and returns false if it can't.
+template<class CopyOut>
+static s64
+readm_copy(sref<mnode> m, u64 start, u64 nbytes, CopyOut copy)
 {
   if (m->type() != mnode::types::file)
     return -1;
@@ -138,7 +304,8 @@ readm(sref<mnode> m, char* buf, u64 start, u64 nbytes)
     if (pgend > PGSIZE)
       pgend = PGSIZE;
 
-    memmove(buf + off, (const char*) pi->va() + pgoff, pgend - pgoff);
+    if (!copy(off, (const char*) pi->va() + pgoff, pgend - pgoff))
+      return off ? off : -1;
     off += (pgend - pgoff);
   }
 
@@ -146,8 +313,45 @@ readm(sref<mnode> m, char* buf, u64 start, u64 nbytes)
 }
 
 s64
-writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
-       mfile::resizer* parentresize)
+readm(sref<mnode> m, char* buf, u64 start, u64 nbytes)
+{
+  return readm_copy(m, start, nbytes,
+                    [buf](u64 off, const char *src, u64 n) {
+                      memmove(buf + off, src, n);
+                      return true;
+                    });
+}
+
+s64
+readm_user(sref<mnode> m, userptr<void> buf, u64 start, u64 nbytes)
+{
+  char *dst = (char*)buf.unsafe_get();
+  return readm_copy(m, start, nbytes,
+                    [dst](u64 off, const char *src, u64 n) {
+                      return putmem(dst + off, src, n) == 0;
+                    });
+}
+
+s64
+readm_userv(sref<mnode> m, const struct iovec *iov, int iovcnt, u64 start,
+            u64 nbytes)
+{
+  iov_cursor cur(iov, iovcnt);
+  return readm_copy(m, start, nbytes,
+                    [&cur](u64 off, const char *src, u64 n) {
+                      return cur.copy_out(src, n);
+                    });
+}
+
+// Copy [start, start+nbytes) of m into its page-cache pages with
+// copy(dst, off, n), which copies n bytes from offset off of the source
+// to dst and returns false if it can't.  If parentresize is non-null,
+// the caller holds m's resizer and it's used for every page; otherwise
+// the resizer is only taken for pages that extend the file.
+template<class CopyIn>
+static s64
+writem_copy(sref<mnode> m, u64 start, u64 nbytes,
+            mfile::resizer* parentresize, CopyIn copy)
 {
   if (m->type() != mnode::types::file)
     return -1;
@@ -185,17 +389,23 @@ writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
        * have O_TRUNC, which discards all pages.
        */
 
-      memmove((char*) pi->va() + pgoff, buf + off, pgend - pgoff);
+      snapshot_page_write(m->as_file(), pgbase / PGSIZE, pi.get());
+      if (!copy((char*) pi->va() + pgoff, off, pgend - pgoff))
+        break;
       m->as_file()->dirty(true);
       m->as_file()->set_page_dirty(pgbase / PGSIZE);
 
-      if (resize && *resize)
+      if (resize && *resize && pos + pgend - pgoff > resize->read_size())
         resize->resize_nogrow(pos + pgend - pgoff);
     } else {
       /* File does not yet have the page we are about to update */
       if (!resize) {
         scoped_resize = m->as_file()->write_size();
         resize = &scoped_resize;
+        // Another writer (most likely a concurrent O_APPEND write) may have
+        // added the page while we waited for the resizer.  Start over.
+        if (resize->read_size() > pgbase)
+          continue;
       }
 
       /*
@@ -209,7 +419,7 @@ writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
         if (msize % PGSIZE) {
           resize->resize_nogrow(msize - (msize % PGSIZE) + PGSIZE);
         } else {
-          char* p = zalloc("file page");
+          char* p = m->as_file()->alloc_page(msize / PGSIZE);
           if (!p)
             break;
 
@@ -220,12 +430,13 @@ writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
         msize = resize->read_size();
       }
 
-      char* p = zalloc("file page");
+      char* p = m->as_file()->alloc_page(pgbase / PGSIZE);
       if (!p)
         break;
 
-      memmove(p + pgoff, buf + off, pgend - pgoff);
       pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
+      if (!copy(p + pgoff, off, pgend - pgoff))
+        break;
       resize->resize_append(pos + pgend - pgoff, pi);
     }
 
@@ -235,6 +446,29 @@ writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
   return off ?: -1;
 }
 
+s64
+writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
+       mfile::resizer* parentresize)
+{
+  return writem_copy(m, start, nbytes, parentresize,
+                     [buf](char *dst, u64 off, u64 n) {
+                       memmove(dst, buf + off, n);
+                       return true;
+                     });
+}
+
+s64
+writem_userv(sref<mnode> m, const struct iovec *iov, int iovcnt, u64 start,
+             u64 nbytes, mfile::resizer* resize, u64 iovoff)
+{
+  iov_cursor cur(iov, iovcnt);
+  cur.skip(iovoff);
+  return writem_copy(m, start, nbytes, resize,
+                     [&cur](char *dst, u64 off, u64 n) {
+                       return cur.copy_in(dst, n);
+                     });
+}
+
 static int
 mfsstatsread(mdev*, char *dst, u32 off, u32 n)
 {
@@ -243,8 +477,38 @@ mfsstatsread(mdev*, char *dst, u32 off, u32 n)
   return s.get_used();
 }
 
+// Usage:
+// To interleave new page-cache pages over the NUMA nodes, do:
+// $ echo interleave > /dev/mfsstats
+// The other policies are first-touch and owner.
+static int
+mfsstatswrite(mdev*, const char *buf, u32 n)
+{
+  static const struct {
+    const char *name;
+    page_placement p;
+  } policies[] = {
+    { "first-touch", page_placement::first_touch },
+    { "interleave", page_placement::interleave },
+    { "owner", page_placement::owner },
+  };
+
+  u32 len = n;
+  if (len > 0 && buf[len - 1] == '\n')
+    len--;
+  for (auto &policy : policies) {
+    if (strlen(policy.name) == len && strncmp(buf, policy.name, len) == 0) {
+      pagecache_set_placement(policy.p);
+      return n;
+    }
+  }
+  cprintf("mfsstats: unknown placement policy\n");
+  return n;
+}
+
 void
 initmfs(void)
 {
   devsw[MAJ_MFSSTATS].pread = mfsstatsread;
+  devsw[MAJ_MFSSTATS].write = mfsstatswrite;
 }
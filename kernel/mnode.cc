@@ -6,12 +6,76 @@
 #include "percpu.hh"
 #include "vm.hh"
 #include "file.hh"
+#include "condvar.hh"
+#include "cpu.hh"
+#include "numa.hh"
+#include "kstream.hh"
+#include "sperf.hh"
+#include "tracepoint.hh"
+
+extern "C" void zpage(void*);
 
 namespace {
   // 32MB mcache (XXX make this proportional to physical RAM)
   weakcache<pair<mfs*, u64>, mnode> mnode_cache(32 << 20);
+
+  // Per-core CLOCK lists of the clean page-cache pages that pagecache_reclaim()
+  // may evict. Entries are (mnum, pageidx) pairs rather than references, so
+  // that the lists don't keep files or pages alive; entries of pages that have
+  // gone away are dropped when the hand gets to them. The entries in
+  // [hand, pages.size()) are live; the hand gives a recently used page a second
+  // chance by moving its entry to the back.
+  struct clock_list {
+    std::vector<pair<u64, u64>> pages;
+    size_t hand;
+    size_t prune_at;
+    spinlock lock;
+    clock_list() : hand(0), prune_at(SCALEFS_CLOCK_PRUNE_MIN) {}
+  };
+  percpu<clock_list> clock_lists;
+
+  // Number of entries in the dirty_pages_ lists of all files, which is about
+  // the number of dirty page-cache pages. Each core batches its updates to
+  // the shared count.
+  std::atomic<s64> ndirty_pages;
+  percpu<s64> ndirty_delta;
+
+  // Page-cache placement policy and, per core, the number of page-cache
+  // pages allocated on each NUMA node and on a node other than the core's.
+  std::atomic<page_placement> placement(
+    (page_placement)SCALEFS_PAGE_PLACEMENT);
+  struct placement_counts {
+    u64 node_pages[MAX_NUMA_NODES];
+    u64 remote_pages;
+  };
+  percpu<placement_counts> placement_stats;
+
+  void
+  account_dirty_pages(s64 n)
+  {
+    scoped_cli cli;
+    s64 &delta = *ndirty_delta;
+    delta += n;
+    if (delta > 32 || delta < -32) {
+      ndirty_pages += delta;
+      delta = 0;
+    }
+  }
 };
 
+u64
+pagecache_dirty_pages()
+{
+  s64 n = ndirty_pages;
+  return n > 0 ? n : 0;
+}
+
+bool
+pagecache_dirty_exceeds(u64 ratio)
+{
+  return pagecache_dirty_pages() * 100 > kalloc_total_pages() * ratio;
+}
+
 sref<mnode>
 mfs::mget(u64 mnum)
 {
@@ -64,11 +128,6 @@ mfs::alloc(u8 type, u64 parent_mnum)
   if (!mnode_cache.insert(make_pair(this, mnum), m.get()))
     panic("mnode_cache insert failed (duplicate mnumber?)");
 
-  if (this == root_fs && (type == mnode::types::dir ||
-                          type == mnode::types::file)) {
-    rootfs_interface->alloc_mnode_lock(mnum);
-    rootfs_interface->alloc_metadata_log(mnum);
-  }
   m->cache_pin(true);
   m->valid_ = true;
   mlinkref mlink(std::move(m));
@@ -78,7 +137,7 @@ mfs::alloc(u8 type, u64 parent_mnum)
 
 mnode::mnode(mfs* fs, u64 mnum)
   : fs_(fs), mnum_(mnum), initialized_(false), cache_pin_(false), dirty_(false),
-    valid_(false), delete_inode_(false)
+    on_dirty_list_(false), valid_(false), delete_inode_(false)
 {
   kstats::inc(&kstats::mnode_alloc);
 }
@@ -100,7 +159,21 @@ mnode::dirty(bool flag)
 {
   if (dirty_ == flag)
     return;
-  cmpxch(&dirty_, !flag, flag);
+  if (cmpxch(&dirty_, !flag, flag) && flag)
+    add_to_dirty_list();
+}
+
+// Records this mnode in the per-core list of dirty mnodes that the next sync()
+// will look at, unless it is on that list already.
+void
+mnode::add_to_dirty_list()
+{
+  if (on_dirty_list_ || !cmpxch(&on_dirty_list_, false, true))
+    return;
+
+  int cpu = myid();
+  auto l = rootfs_interface->dirty_mnums[cpu].lock.guard();
+  rootfs_interface->dirty_mnums[cpu].mnum_list.push_back(mnum_);
 }
 
 bool
@@ -122,15 +195,22 @@ mnode::onzero()
 
   if (delete_inode_) {
     rootfs_interface->free_metadata_log(mnum_);
-    rootfs_interface->free_mnode_lock(mnum_);
 
-    // Mark this inode for lazy deletion.
-    auto l = rootfs_interface->delete_inums[cpu].lock.guard();
-    rootfs_interface->delete_inums[cpu].mnum_list.push_back(mnum_);
+    // Mark this inode for lazy deletion, which this core's flusher does in
+    // the background.
+    {
+      auto l = rootfs_interface->delete_inums[cpu].lock.guard();
+      rootfs_interface->delete_inums[cpu].mnum_list.push_back(mnum_);
+    }
+    rootfs_interface->kick_inode_reclaim(cpu);
   }
 
-  if (type() == types::file)
+  if (type() == types::file) {
+    this->as_file()->drop_readahead();
+    this->as_file()->discard_dirty_pages();
     this->as_file()->remove_pgtable_mappings(0);
+    this->as_file()->set_exec_image(nullptr);
+  }
 
   mnode_cache.cleanup(weakref_);
   kstats::inc(&kstats::mnode_free);
@@ -152,7 +232,12 @@ void
 mfile::resizer::resize_nogrow(u64 newsize)
 {
   u64 oldsize = mf_->size_;
+  snapshot_resize(mf_, oldsize, newsize);
+  if (newsize < oldsize)
+    mf_->append_end_ = newsize;
   mf_->size_ = newsize;
+  mf_->content_gen_++;
+  mf_->collapse_replicas();
   assert(PGROUNDUP(newsize) <= PGROUNDUP(oldsize));
   auto begin = mf_->pages_.find(PGROUNDUP(newsize) / PGSIZE);
   auto end = mf_->pages_.find(PGROUNDUP(oldsize) / PGSIZE);
@@ -175,6 +260,7 @@ void
 mfile::resizer::resize_append(u64 size, sref<page_info> pi)
 {
   assert(PGROUNDUP(mf_->size_) / PGSIZE + 1 == PGROUNDUP(size) / PGSIZE);
+  snapshot_resize(mf_, mf_->size_, size);
 
   if (PGOFFSET(mf_->size_)) {
     /* Also filled out last partial page */
@@ -191,16 +277,46 @@ mfile::resizer::resize_append(u64 size, sref<page_info> pi)
     ps.set_partial_page(true);
   ps.set_dirty_bit(true);
   mf_->pages_.fill(it, ps);
+  mf_->add_dirty_page(it.index());
+  mf_->delalloc_pages_++;
   mf_->size_ = size;
+  mf_->content_gen_++;
   mf_->dirty(true);
 }
 
 void
 mfile::set_page_dirty(u64 pageidx)
 {
-  auto it = pages_.find(pageidx);
-  auto lock = pages_.acquire(it);
-  it->set_dirty_bit(true);
+  {
+    auto it = pages_.find(pageidx);
+    auto lock = pages_.acquire(it);
+    content_gen_++;
+    if (!it->test_and_set_dirty_bit(true))
+      add_dirty_page(pageidx);
+  }
+  collapse_replicas();
+}
+
+void
+mfile::add_dirty_page(u64 pageidx)
+{
+  {
+    auto l = dirty_pages_lock_.guard();
+    if (dirty_pages_.empty())
+      dirtied_at_ = nsectime();
+    dirty_pages_.push_back(pageidx);
+  }
+  account_dirty_pages(1);
+}
+
+// Forget about the dirty pages of a file that is going away.
+void
+mfile::discard_dirty_pages()
+{
+  auto l = dirty_pages_lock_.guard();
+  account_dirty_pages(-(s64)dirty_pages_.size());
+  dirty_pages_.clear();
+  dirtied_at_ = 0;
 }
 
 void
@@ -214,9 +330,212 @@ mfile::resizer::initialize_from_disk(u64 size)
   mf_->size_ = size;
 }
 
+// Like initialize_from_disk(), for an empty file whose contents were just
+// replaced on the disk (by clone_file()).
+void
+mfile::resizer::reload_from_disk(u64 size)
+{
+  assert(mf_->size_ == 0);
+  snapshot_resize(mf_, 0, size);
+  initialize_from_disk(size);
+  mf_->content_gen_++;
+  mf_->collapse_replicas();
+}
+
+void
+pagecache_set_placement(page_placement p)
+{
+  placement = p;
+}
+
+void
+pagecache_print_placement(print_stream *s)
+{
+  static const char *names[] = { "first-touch", "interleave", "owner" };
+  u64 remote = 0;
+  s->println("page cache placement: ", names[(int)placement.load()]);
+  for (size_t node = 0; node < numa_nodes.size(); node++) {
+    u64 n = 0;
+    for (int cpu = 0; cpu < ncpu; cpu++)
+      n += placement_stats[cpu].node_pages[node];
+    s->println("  node ", node, ": ", n, " pages allocated");
+  }
+  for (int cpu = 0; cpu < ncpu; cpu++)
+    remote += placement_stats[cpu].remote_pages;
+  s->println("  ", remote, " pages allocated on a remote node");
+}
+
+mfile::mfile(mfs* fs, u64 mnum, u64 parent_mnum)
+  : mnode(fs, mnum), parent_mnum_(parent_mnum), size_(0), append_end_(0),
+    fsync_lock_("mfile fsync", LOCKSTAT_FS), dirtied_at_(0),
+    delalloc_pages_(0), ra_next_(0), ra_size_(0), ra_start_(0),
+    remote_pages_(0), content_gen_(0), exec_image_(nullptr),
+    has_replicas_(false)
+{
+  auto node = mycpu()->node;
+  owner_node_ = node ? node->id : -1;
+}
+
+u64
+mfile::reserve_append(u64 n)
+{
+  // Writes that aren't appends can extend the file too, so a reservation
+  // starts at whichever end is further along.
+  u64 end = append_end_;
+  for (;;) {
+    u64 pos = std::max(end, (u64)*read_size());
+    if (append_end_.compare_exchange_weak(end, pos + n))
+      return pos;
+  }
+}
+
+void
+mfile::unreserve_append(u64 pos, u64 n, u64 written)
+{
+  // Only the latest reservation can shrink; an earlier one that comes up
+  // short leaves a hole of zeroes, like a write past the end of the file.
+  u64 end = pos + n;
+  if (written < n)
+    append_end_.compare_exchange_strong(end, pos + written);
+}
+
+// Allocate a zeroed page to hold page pageidx of this file, on the NUMA node
+// the placement policy picks for it.  Pages for this node come from the
+// local zalloc cache; pages for another node come from the buddy allocators
+// of one of that node's cores.
+char *
+mfile::alloc_page(u64 pageidx)
+{
+  int here = myid();
+  auto node = cpus[here].node;
+  if (!node)
+    return zalloc("file page");
+
+  size_t target = node->id;
+  switch (placement.load()) {
+  case page_placement::first_touch:
+    break;
+  case page_placement::interleave:
+    // Offset by the file so that the first pages of small files don't all
+    // land on node 0.
+    target = (mnum_ + pageidx) % numa_nodes.size();
+    break;
+  case page_placement::owner:
+    if (owner_node_ >= 0)
+      target = owner_node_;
+    break;
+  }
+
+  char *p;
+  if (target == node->id) {
+    p = zalloc("file page");
+  } else {
+    auto &cpuids = numa_nodes[target].cpuids;
+    int cpu = cpuids[(pageidx / numa_nodes.size()) % cpuids.size()];
+    p = kalloc("file page", PGSIZE, cpu);
+    if (p)
+      zpage(p);
+  }
+  if (!p)
+    return nullptr;
+
+  scoped_cli cli;
+  placement_stats->node_pages[target]++;
+  if (target != node->id) {
+    placement_stats->remote_pages++;
+    remote_pages_++;
+  }
+  return p;
+}
+
+// The NUMA node that physical address pa is on, or -1.
+static int
+node_of(paddr pa)
+{
+  for (size_t n = 0; n < numa_nodes.size(); n++) {
+    auto &mems = numa_nodes[n].mems;
+    for (size_t i = 0; i < mems.size(); i++)
+      if (pa >= mems[i].base && pa < mems[i].base + mems[i].length)
+        return n;
+  }
+  return -1;
+}
+
+// Returns the page to map for page pageidx, whose page-cache page is pi, in
+// a read-only mapping on this core. For an exec'd binary whose page is on
+// another NUMA node, that's a copy of it on this node, made the first time
+// it's needed here; otherwise it's pi. The caller holds the lock of the
+// mapping it installs the page in, which collapse_replicas() has to take to
+// unmap the copy again.
+sref<page_info>
+mfile::replica_page(u64 pageidx, sref<page_info> pi)
+{
+  auto node = mycpu()->node;
+  if (!VM_REPLICA_PAGES || !node || numa_nodes.size() < 2 ||
+      !exec_image_.load(std::memory_order_relaxed))
+    return pi;
+  int home = node_of(pi->pa());
+  if (home < 0 || home == (int)node->id)
+    return pi;
+
+  u64 gen = content_gen_;
+  {
+    auto l = replica_lock_.guard();
+    for (auto &r : replicas_)
+      if (r.pageidx == pageidx && r.node == (int)node->id)
+        return r.page;
+    if (replicas_.size() >= VM_REPLICA_PAGES)
+      return pi;
+  }
+
+  char *p = kalloc("file page replica");
+  if (!p)
+    return pi;
+  memmove(p, pi->va(), PGSIZE);
+  sref<page_info> copy = sref<page_info>::transfer(new(page_info::of(p))
+                                                   page_info());
+
+  auto l = replica_lock_.guard();
+  has_replicas_ = true;
+  // The file changed while we copied it.
+  if (content_gen_ != gen)
+    return pi;
+  for (auto &r : replicas_)
+    if (r.pageidx == pageidx && r.node == (int)node->id)
+      return r.page;
+  replicas_.push_back(replica{pageidx, (int)node->id, copy});
+  return copy;
+}
+
+// Drop this file's replica pages and unmap them from the vmaps that map
+// them, after a change to the file's contents. Called after content_gen_
+// has moved on, so that replica_page() doesn't add any more for the old
+// contents.
+void
+mfile::collapse_replicas()
+{
+  if (!has_replicas_)
+    return;
+
+  std::vector<replica> old;
+  {
+    auto l = replica_lock_.guard();
+    old.swap(replicas_);
+    has_replicas_ = false;
+  }
+
+  for (auto &r : old) {
+    for_each_mapping(r.pageidx, r.pageidx + 1,
+                     [&r](vmap *vm, uptr start, uptr end) {
+      vm->clear_mapping(start, r.page.get());
+    });
+  }
+}
+
 mfile::page_state
-mfile::get_page(u64 pageidx)
+mfile::get_page(u64 pageidx, bool allow_readahead)
 {
+  SPERF_REGION(get_page);
   auto it = pages_.find(pageidx);
   if (!it.is_set())
     return mfile::page_state();
@@ -228,26 +547,304 @@ mfile::get_page(u64 pageidx)
       if (check_critical(critical_mask::NO_SCHED))
         throw blocking_io(sref<mfile>::newref(this), pageidx);
 
-      // Read page from disk
-      char *p = zalloc("file page");
-      assert(p);
+      auto ra_lock = ra_lock_.guard();
+
+      // If the page is part of a readahead window, it is already on its way.
+      // Wait for the window and start reading the next one.
+      if (!ra_pages_.empty() && pageidx >= ra_start_ &&
+          pageidx < ra_start_ + ra_pages_.size()) {
+        u64 next = ra_start_ + ra_pages_.size();
+        finish_readahead();
+        if (allow_readahead) {
+          ra_size_ = std::min(ra_size_ * 2, (u64)SCALEFS_READAHEAD_MAX);
+          readahead(next, ra_size_);
+        }
+      }
+
+      if (it->get_page_info() == nullptr && allow_readahead) {
+        // A miss right after the previous one starts (or continues) a
+        // sequential stream; any other miss ends it.
+        if (pageidx == ra_next_)
+          ra_size_ = ra_size_ ? std::min(ra_size_ * 2,
+                                         (u64)SCALEFS_READAHEAD_MAX) :
+                                SCALEFS_READAHEAD_MIN;
+        else
+          ra_size_ = 0;
+        ra_next_ = pageidx + 1;
+      }
+
+      if (it->get_page_info() == nullptr) {
+
+        // Read page from disk
+        TRACEPOINT(FS_READPAGE, mnum_, pageidx);
+        char *p = alloc_page(pageidx);
+        assert(p);
+
+        auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
+        size_t pos = pageidx * PGSIZE;
+        size_t nbytes = size_ - pos;
+        if (nbytes > PGSIZE)
+          nbytes = PGSIZE;
+
+        size_t bytes_read = rootfs_interface->load_file_page(mnum_, p, pos,
+                                                             nbytes);
+        assert(nbytes == bytes_read);
+        {
+          auto lock = pages_.acquire(it);
+          page_state ps(pi);
+          if (PGOFFSET(nbytes))
+            ps.set_partial_page(true);
+          pages_.fill(it, ps);
+        }
+        track_page(pageidx, pi);
+
+        if (allow_readahead && ra_size_)
+          readahead(pageidx + 1, ra_size_);
+      }
+  }
+
+  page_state ps = it->copy_consistent();
+  ps.mark_used();
+  return ps;
+}
+
+// Start reading up to npages pages from start onwards into ra_pages_, without
+// waiting for the I/O. The window stops at the end of the file and at the first
+// page that is already in the page-cache. Caller must hold ra_lock_.
+void
+mfile::readahead(u64 start, u64 npages)
+{
+  if (!ra_pages_.empty())
+    finish_readahead();
+
+  u64 end = std::min(start + npages, PGROUNDUP(size_) / PGSIZE);
+  std::vector<char*> bufs;
+  for (u64 idx = start; idx < end; idx++) {
+    auto it = pages_.find(idx);
+    if (!it.is_set() || it->get_page_info() != nullptr)
+      break;
+
+    char *p = alloc_page(idx);
+    if (!p)
+      break;
+    bufs.push_back(p);
+    ra_pages_.push_back(
+      sref<page_info>::transfer(new (page_info::of(p)) page_info()));
+  }
+
+  if (bufs.empty())
+    return;
+
+  ra_start_ = start;
+  ra_next_ = start + bufs.size();
+  rootfs_interface->load_file_pages(mnum_, start, bufs.size(), &bufs[0],
+                                    &ra_dcs_);
+}
+
+// Wait for the readahead window to arrive and add its pages to the page-cache.
+// Pages that were loaded, written or truncated in the meantime are dropped.
+// Caller must hold ra_lock_.
+void
+mfile::finish_readahead()
+{
+  for (auto &dc : ra_dcs_)
+    dc->wait();
+  ra_dcs_.clear();
+
+  for (size_t i = 0; i < ra_pages_.size(); i++) {
+    u64 pageidx = ra_start_ + i;
+    auto it = pages_.find(pageidx);
+    auto lock = pages_.acquire(it);
+    if (!it.is_set() || it->get_page_info() != nullptr)
+      continue;
+
+    // The disk block may hold stale bytes past the end of the file.
+    size_t pos = pageidx * PGSIZE;
+    if (pos >= size_)
+      continue;
+    size_t nbytes = std::min(size_ - pos, (u64)PGSIZE);
+    if (PGOFFSET(nbytes))
+      memset((char*)ra_pages_[i]->va() + nbytes, 0, PGSIZE - nbytes);
+
+    page_state ps(ra_pages_[i]);
+    if (PGOFFSET(nbytes))
+      ps.set_partial_page(true);
+    pages_.fill(it, ps);
+    track_page(pageidx, ra_pages_[i]);
+  }
+  ra_pages_.clear();
+}
+
+// Bring in a page for a fault on a file-backed mapping (see blocking_io). The
+// missing pages around it, within its SCALEFS_FAULT_CLUSTER-aligned cluster,
+// are read with batched asynchronous I/O and the faulting thread sleeps on the
+// completions, so that a thread touching a mapping page by page doesn't take
+// one synchronous read per fault. With fault_hint::sequential (from
+// MADV_SEQUENTIAL), the read instead covers SCALEFS_READAHEAD_MAX pages from
+// the faulting page on and the window after that is started in the
+// background; with fault_hint::random, only the faulting page is read.
+void
+mfile::fault_in_page(u64 pageidx, fault_hint hint)
+{
+  if (hint == fault_hint::random) {
+    get_page(pageidx, false);
+    return;
+  }
+
+  if (fs_ == root_fs) {
+    auto ra_lock = ra_lock_.guard();
+
+    auto missing = [this](u64 idx) {
+      auto it = pages_.find(idx);
+      return it.is_set() && it->get_page_info() == nullptr;
+    };
+
+    if (hint == fault_hint::sequential) {
+      if (!ra_pages_.empty() && pageidx >= ra_start_ &&
+          pageidx < ra_start_ + ra_pages_.size())
+        finish_readahead();
+      if (missing(pageidx)) {
+        readahead(pageidx, SCALEFS_READAHEAD_MAX);
+        finish_readahead();
+      }
+      readahead(pageidx + SCALEFS_READAHEAD_MAX, SCALEFS_READAHEAD_MAX);
+    } else if (missing(pageidx)) {
+      u64 first = pageidx - pageidx % SCALEFS_FAULT_CLUSTER;
+      u64 start = pageidx;
+      while (start > first && missing(start - 1))
+        start--;
+
+      readahead(start, first + SCALEFS_FAULT_CLUSTER - start);
+      finish_readahead();
+    }
+  }
+
+  // Falls back to a synchronous read if the page didn't make it in.
+  get_page(pageidx);
+}
+
+// Whether page pageidx is in the page-cache, so that get_page() can return it
+// without blocking. If so, *used (if given) says whether it was used since the
+// CLOCK hand last went by.
+bool
+mfile::page_resident(u64 pageidx, bool *used)
+{
+  auto it = pages_.find(pageidx);
+  if (!it.is_set())
+    return false;
+  sref<page_info> pi = it->get_page_info();
+  if (!pi)
+    return false;
+  if (used)
+    *used = pi->recently_used();
+  return true;
+}
+
+// Start reading the pages of [start, start + npages) that aren't cached, in
+// readahead windows of up to SCALEFS_READAHEAD_MAX pages. Each window waits
+// for the one before it, and the last is left in flight for a reader or
+// finish_prefetch() to pick up, so that the caller can get on with other
+// files.
+void
+mfile::prefetch(u64 start, u64 npages)
+{
+  if (fs_ != root_fs)
+    return;
+
+  auto ra_lock = ra_lock_.guard();
+  u64 end = std::min(start + npages, PGROUNDUP(size_) / PGSIZE);
+  for (u64 idx = start; idx < end; ) {
+    if (page_resident(idx)) {
+      idx++;
+      continue;
+    }
+    readahead(idx, std::min(end - idx, (u64)SCALEFS_READAHEAD_MAX));
+    idx += std::max(ra_pages_.size(), (size_t)1);
+  }
+}
+
+// Wait for the window that prefetch() left in flight.
+void
+mfile::finish_prefetch()
+{
+  auto ra_lock = ra_lock_.guard();
+  if (!ra_pages_.empty())
+    finish_readahead();
+}
 
-      auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
-      size_t pos = pageidx * PGSIZE;
-      size_t nbytes = size_ - pos;
-      if (nbytes > PGSIZE)
-        nbytes = PGSIZE;
+// Wait for any readahead I/O in flight and throw its pages away. Called
+// before the mfile goes away, so that the disk doesn't write into freed pages.
+void
+mfile::drop_readahead()
+{
+  auto ra_lock = ra_lock_.guard();
+  for (auto &dc : ra_dcs_)
+    dc->wait();
+  ra_dcs_.clear();
+  ra_pages_.clear();
+}
 
-      size_t bytes_read = rootfs_interface->load_file_page(mnum_, p, pos, nbytes);
-      assert(nbytes == bytes_read);
-      auto lock = pages_.acquire(it);
-      page_state ps(pi);
-      if (PGOFFSET(nbytes))
-        ps.set_partial_page(true);
-      pages_.fill(it, ps);
+// Call f(vm, start, end) for each vmap that maps any of pages [start_pg,
+// end_pg) of this file, where [start, end) is the part of vm that maps
+// them. f runs without rmap_lock_ held and with a reference to vm, so it
+// may take vm's locks. vmaps that are being destroyed are skipped.
+template<class F>
+void
+mfile::for_each_mapping(u64 start_pg, u64 end_pg, F f)
+{
+  struct target {
+    sref<vmap> vm;
+    uptr start, end;
+  };
+  std::vector<target> targets;
+  {
+    auto l = rmap_lock_.guard();
+    for (auto &m : rmap_) {
+      u64 lo = std::max(start_pg, (u64)(m.start - m.base) / PGSIZE);
+      u64 hi = std::min(end_pg, (u64)(m.end - m.base) / PGSIZE);
+      if (lo >= hi || !m.vm->tryinc())
+        continue;
+      targets.push_back(target{sref<vmap>::transfer(m.vm),
+                               m.base + lo * PGSIZE, m.base + hi * PGSIZE});
+    }
   }
+  for (auto &t : targets)
+    f(t.vm.get(), t.start, t.end);
+}
+
+void
+mfile::add_mapping(vmap *vm, uptr start, uptr end, intptr_t base)
+{
+  auto l = rmap_lock_.guard();
+  rmap_.push_back(mapping{vm, start, end, base});
+}
 
-  return it->copy_consistent();
+void
+mfile::remove_mapping(vmap *vm, uptr start, uptr end)
+{
+  auto l = rmap_lock_.guard();
+  for (size_t i = 0; i < rmap_.size(); ) {
+    mapping &m = rmap_[i];
+    if (m.vm != vm || m.end <= start || end <= m.start) {
+      i++;
+    } else if (m.start < start && end < m.end) {
+      // Split it around [start, end).
+      mapping tail = m;
+      tail.start = end;
+      m.end = start;
+      rmap_.push_back(tail);
+      i++;
+    } else if (m.start < start) {
+      m.end = start;
+      i++;
+    } else if (end < m.end) {
+      m.start = end;
+      i++;
+    } else {
+      m = rmap_.back();
+      rmap_.pop_back();
+    }
+  }
 }
 
 // Evict a (clean) page from the page-cache.
@@ -260,112 +857,442 @@ mfile::put_page(u64 pageidx)
 
   sref<page_info> pi = it->get_page_info();
   if (pi != nullptr && fs_ == root_fs) {
-    // Don't evict dirty pages.
-    if (it->is_dirty_page())
+    // Don't evict dirty pages, or pages that are still being written out.
+    if (it->is_dirty_page() || pi->under_writeback())
       return;
 
     it->reset_page_info();
 
-    std::vector<page_info::rmap_entry> rmap_vec;
-    pi->get_rmap_vector(rmap_vec);
-    for (auto rmap_it = rmap_vec.begin(); rmap_it != rmap_vec.end(); rmap_it++)
-      rmap_it->first->clear_mapping(rmap_it->second);
+    for_each_mapping(pageidx, pageidx + 1,
+                     [&pi](vmap *vm, uptr start, uptr end) {
+      vm->clear_mapping(start, pi.get());
+    });
 
     pi->dec();
 
   }
 }
 
-// This function gets called when a file is truncated. Page table mappings for
-// any pages that are no longer a part of the file need to be cleared from vmaps
-// that have the file mmapped. Each page_info object keeps track of these vmaps
-// via an oplog-maintained reverse map. This rmap is now traversed to unmap the
-// truncated pages from the vmaps in question.
+// Put a page-cache page that has a copy on the disk on this core's CLOCK list,
+// unless it is on one already.
 void
-mfile::remove_pgtable_mappings(u64 start_offset) {
-  auto page_trunc_start = pages_.find(PGROUNDUP(start_offset) / PGSIZE);
-  for (auto it = page_trunc_start; it != pages_.end(); ) {
-    // Skip unset spans
-    if (!it.is_set()) {
-      it += it.base_span();
+mfile::track_page(u64 pageidx, const sref<page_info> &pi)
+{
+  if (fs_ != root_fs || pi->set_on_clock())
+    return;
+
+  auto &cl = clock_lists[myid()];
+  auto l = cl.lock.guard();
+  cl.pages.push_back(make_pair(mnum_, pageidx));
+  if (cl.pages.size() - cl.hand < cl.prune_at)
+    return;
+
+  // Drop the entries of pages that were evicted, truncated or deleted since
+  // the last time, so that the list stays proportional to the page-cache.
+  // Nothing here sleeps.
+  size_t live = 0;
+  for (size_t i = cl.hand; i < cl.pages.size(); i++) {
+    sref<mnode> m = root_fs->mget(cl.pages[i].first);
+    if (!m || m->type() != mnode::types::file || !m->is_initialized())
       continue;
+    auto it = m->as_file()->pages_.find(cl.pages[i].second);
+    if (!it.is_set() || it->get_page_info() == nullptr)
+      continue;
+    cl.pages[live++] = cl.pages[i];
+  }
+  cl.pages.erase(cl.pages.begin() + live, cl.pages.end());
+  cl.hand = 0;
+  cl.prune_at = std::max((size_t)SCALEFS_CLOCK_PRUNE_MIN, 2 * live);
+}
+
+// Look at a page on behalf of the CLOCK hand: evict it if it is clean and
+// hasn't been used since the hand last went by, clearing its reference bit
+// otherwise.
+mfile::reclaim_result
+mfile::reclaim_page(u64 pageidx)
+{
+  auto it = pages_.find(pageidx);
+  if (!it.is_set())
+    return reclaim_result::gone;
+
+  sref<page_info> pi;
+  {
+    auto lock = pages_.acquire(it);
+    pi = it->get_page_info();
+    if (pi == nullptr)
+      return reclaim_result::gone;
+    if (it->is_dirty_page() || pi->under_writeback() ||
+        pi->test_and_clear_used())
+      return reclaim_result::kept;
+    it->reset_page_info();
+  }
+
+  for_each_mapping(pageidx, pageidx + 1,
+                   [&pi](vmap *vm, uptr start, uptr end) {
+    vm->clear_mapping(start, pi.get());
+  });
+
+  pi->dec();
+  return reclaim_result::evicted;
+}
+
+u64
+pagecache_reclaim(u64 npages)
+{
+  const size_t batch = 32;
+  u64 nreclaimed = 0;
+
+  for (int i = 0; i < ncpu && nreclaimed < npages; i++) {
+    auto &cl = clock_lists[(myid() + i) % ncpu];
+
+    // Go around the list at most twice: once to clear the reference bits and
+    // once more to evict the pages that weren't used in between.
+    size_t budget;
+    {
+      auto l = cl.lock.guard();
+      budget = 2 * (cl.pages.size() - cl.hand);
+    }
+
+    while (budget && nreclaimed < npages) {
+      pair<u64, u64> entries[batch];
+      size_t n = 0;
+      {
+        auto l = cl.lock.guard();
+        while (n < batch && n < budget && cl.hand < cl.pages.size())
+          entries[n++] = cl.pages[cl.hand++];
+        if (cl.hand > batch && cl.hand * 2 >= cl.pages.size()) {
+          cl.pages.erase(cl.pages.begin(), cl.pages.begin() + cl.hand);
+          cl.hand = 0;
+        }
+      }
+      if (!n)
+        break;
+      budget -= n;
+
+      size_t nkept = 0;
+      for (size_t j = 0; j < n; j++) {
+        sref<mnode> m = root_fs->mget(entries[j].first);
+        if (!m || m->type() != mnode::types::file || !m->is_initialized())
+          continue;
+        switch (m->as_file()->reclaim_page(entries[j].second)) {
+        case mfile::reclaim_result::kept:
+          entries[nkept++] = entries[j];
+          break;
+        case mfile::reclaim_result::evicted:
+          nreclaimed++;
+          break;
+        case mfile::reclaim_result::gone:
+          break;
+        }
+      }
+
+      if (nkept) {
+        auto l = cl.lock.guard();
+        for (size_t j = 0; j < nkept; j++)
+          cl.pages.push_back(entries[j]);
+      }
+    }
+  }
+
+  return nreclaimed;
+}
+
+void
+pagecache_hot_pages(std::vector<pair<u64, u64>> *out, size_t max)
+{
+  std::vector<pair<u64, u64>> cold;
+  size_t limit = out->size() + max;
+  for (int c = 0; c < ncpu && out->size() < limit; c++) {
+    auto &cl = clock_lists[c];
+    std::vector<pair<u64, u64>> entries;
+    {
+      auto l = cl.lock.guard();
+      for (size_t i = cl.hand; i < cl.pages.size() && entries.size() < max;
+           i++)
+        entries.push_back(cl.pages[i]);
     }
-    auto pg_info = it->get_page_info();
-    if (pg_info) {
-      std::vector<page_info::rmap_entry> rmap_vec;
-      pg_info->get_rmap_vector(rmap_vec);
-      for (auto rmap_it = rmap_vec.begin(); rmap_it != rmap_vec.end(); rmap_it++)
-        rmap_it->first->delete_mapping(rmap_it->second);
+
+    for (auto &e : entries) {
+      sref<mnode> m = root_fs->mget(e.first);
+      if (!m || m->type() != mnode::types::file || !m->is_initialized())
+        continue;
+      bool used;
+      if (!m->as_file()->page_resident(e.second, &used))
+        continue;
+      if (!used)
+        cold.push_back(e);
+      else if (out->size() < limit)
+        out->push_back(e);
     }
-    ++it;
+  }
+
+  for (auto &e : cold) {
+    if (out->size() >= limit)
+      break;
+    out->push_back(e);
   }
 }
 
+// This function gets called when a file is truncated. Page table mappings for
+// any pages that are no longer a part of the file need to be removed from the
+// vmaps that have the file mmapped, which the reverse map tells us.
+void
+mfile::remove_pgtable_mappings(u64 start_offset) {
+  for_each_mapping(PGROUNDUP(start_offset) / PGSIZE, maxidx,
+                   [this](vmap *vm, uptr start, uptr end) {
+    vm->delete_file_range(this, start, end);
+  });
+}
+
 // Drop the (clean) page-cache pages associated with this file.
 void
 mfile::drop_pagecache()
 {
   u64 mlen = *read_size();
-  auto page_end = pages_.find(PGROUNDUP(mlen) / PGSIZE);
-  for (auto it = pages_.begin(); it != page_end; ) {
-    // Skip unset spans
-    if (!it.is_set()) {
-      mlen = *read_size();
-      if (mlen <= it.index()*PGSIZE)
-        break;
-      it += it.base_span();
-      if (mlen <= it.index()*PGSIZE)
-        break;
-      continue;
+  pages_.for_each_run(0, PGROUNDUP(mlen) / PGSIZE,
+                      [this](const decltype(pages_)::run &r) {
+    // Stop if the file has been truncated in the meantime.
+    if (*read_size() <= r.index * PGSIZE)
+      return true;
+    for (size_t i = 0; i < r.count; i++) {
+      // Don't evict dirty pages.
+      if (!r[i].is_dirty_page())
+        put_page(r.index + i);
     }
+    return false;
+  });
+}
 
-    // Don't evict dirty pages.
-    if (it->is_dirty_page()) {
-      ++it;
-      continue;
-    }
+void
+mfile::sync_file(int cpu, bool datasync)
+{
+  if (!is_dirty())
+    return;
+
+  sync_pages(cpu, 0, maxidx, datasync, true);
+}
 
-    put_page(it.index());
-    ++it;
+// Write the file's dirty pages back on behalf of the writeback flusher or a
+// throttled writer, queueing the transaction on the given core's journal
+// (the caller flushes it). Returns false if there was nothing to write. Like
+// fdatasync(), this leaves the metadata for the next fsync() or sync(), except
+// that a file whose inode isn't on the disk yet gets created first.
+bool
+mfile::writeback(int cpu)
+{
+  if (fs_ != root_fs)
+    return false;
+  {
+    auto l = dirty_pages_lock_.guard();
+    if (dirty_pages_.empty())
+      return false;
   }
+
+  u64 inum;
+  if (!rootfs_interface->inum_lookup(mnum_, &inum))
+    rootfs_interface->process_metadata_log(get_tsc(), mnum_, cpu);
+  sync_file_range(cpu, 0, 0);
+  return true;
 }
 
+// Called after a write. If dirty pages have taken up more than
+// SCALEFS_DIRTY_RATIO percent of memory, make the writer write back its own
+// file, so that it can't dirty memory faster than the disk can clean it.
 void
-mfile::sync_file(int cpu)
+mfile::balance_dirty_pages()
 {
-  if (!is_dirty())
+  if (fs_ != root_fs || !pagecache_dirty_exceeds(SCALEFS_DIRTY_RATIO))
     return;
 
+  rootfs_interface->wakeup_flushers();
+  int cpu = myid();
+  if (writeback(cpu))
+    rootfs_interface->flush_transaction_queue(cpu);
+}
+
+// Flush the dirty pages that overlap [offset, offset + nbytes) to the disk.
+// The on-disk file size is only ever extended, never truncated, and only as
+// far as the pages that were written out; a later fsync() takes care of the
+// rest.
+void
+mfile::sync_file_range(int cpu, u64 offset, u64 nbytes)
+{
+  u64 end_pg = maxidx;
+  if (nbytes && offset + nbytes > offset)
+    end_pg = PGROUNDUP(offset + nbytes) / PGSIZE;
+  sync_pages(cpu, offset / PGSIZE, end_pg, true, false);
+}
+
+// Write out the dirty pages in [start_pg, end_pg) in a single transaction,
+// visiting only the pages recorded in dirty_pages_.
+void
+mfile::sync_pages(int cpu, u64 start_pg, u64 end_pg, bool datasync,
+                  bool whole_file)
+{
   auto lock = fsync_lock_.guard();
 
+  // The pages written by the last sync must be on the disk before any of them
+  // are written again, or the two writes of a block could land out of order.
+  if (data_wb_) {
+    data_wb_->wait();
+    data_wb_.reset();
+  }
+
+  u64 ilen = rootfs_interface->get_file_size(mnum_);
+  // Don't leave a hole between the current end of the file on the disk and
+  // the pages we are about to write.
+  if (!whole_file && start_pg > ilen / PGSIZE)
+    start_pg = ilen / PGSIZE;
+
+  if (whole_file) {
+    // Writes that race with this sync mark the file dirty again.
+    dirty(false);
+  }
+
+  std::vector<u64> pageidx_list;
+  {
+    auto l = dirty_pages_lock_.guard();
+    if (whole_file) {
+      pageidx_list.swap(dirty_pages_);
+    } else {
+      std::vector<u64> remaining;
+      for (auto idx : dirty_pages_) {
+        if (idx >= start_pg && idx < end_pg)
+          pageidx_list.push_back(idx);
+        else
+          remaining.push_back(idx);
+      }
+      dirty_pages_.swap(remaining);
+    }
+    if (dirty_pages_.empty())
+      dirtied_at_ = 0;
+  }
+  account_dirty_pages(-(s64)pageidx_list.size());
+
+  // Write the pages out in file order, so that the block layer sees mostly
+  // contiguous block numbers.
+  std::sort(pageidx_list.begin(), pageidx_list.end());
+
   auto guard = rootfs_interface->fs_journal[cpu]->commitq_insert_lock.guard();
 
   transaction *trans = new transaction();
   u64 mlen = *read_size();
 
-  // Flush all in-memory file pages to disk.
+  // Flush the dirty in-memory file pages to disk.
+
+  // Pages beyond the end of the file on the disk have no blocks yet. Count
+  // the ones we are about to write, bounded by what the writes reserved, and
+  // have them allocated as a single run.
+  u64 nalloc = 0;
+  u64 delalloc = delalloc_pages_;
+  if (delalloc) {
+    for (auto it_idx = pageidx_list.begin(); it_idx != pageidx_list.end();
+         it_idx++) {
+      if (it_idx != pageidx_list.begin() && *it_idx == *(it_idx - 1))
+        continue;
+      if (*it_idx >= PGROUNDUP(ilen) / PGSIZE && *it_idx * PGSIZE < mlen)
+        nalloc++;
+    }
+    nalloc = std::min(nalloc, delalloc);
+    while (!delalloc_pages_.compare_exchange_weak(
+             delalloc, delalloc - std::min(nalloc, delalloc)))
+      ;
+  }
+
+  // A compressed file is written a chunk at a time: every chunk holding a
+  // dirty page is compressed and written out whole. Its other pages are read
+  // in first, before prepare_sync_file_pages() takes the ilock() that reading
+  // a compressed chunk needs.
+  struct dirty_chunk { u32 chunk; u32 npages; };
+  std::vector<dirty_chunk> chunks;
+  std::vector<sref<page_info>> chunk_pages;
+  if (rootfs_interface->file_compressed(mnum_)) {
+    u64 npages = PGROUNDUP(mlen) / PGSIZE;
+    for (auto idx : pageidx_list) {
+      if (idx >= npages) {
+        auto it = pages_.find(idx);
+        if (it.is_set() && it->is_dirty_page())
+          add_dirty_page(idx);
+        continue;
+      }
+      u32 c = idx / ZCHUNK_PAGES;
+      if (!chunks.empty() && chunks.back().chunk == c)
+        continue;
+
+      dirty_chunk dc = { c, 0 };
+      u64 end = std::min((u64)(c + 1) * ZCHUNK_PAGES, npages);
+      for (u64 p = (u64)c * ZCHUNK_PAGES; p < end; p++) {
+        sref<page_info> pi = get_page(p, false).get_page_info();
+        if (!pi)
+          break; // Truncated under us
+        auto it = pages_.find(p);
+        if (it.is_set())
+          it->test_and_set_dirty_bit(false);
+        chunk_pages.push_back(pi);
+        dc.npages++;
+      }
+      if (dc.npages)
+        chunks.push_back(dc);
+    }
+    pageidx_list.clear();
+  }
 
-  sref<inode> ip = rootfs_interface->prepare_sync_file_pages(mnum_, trans);
+  sref<inode> ip = rootfs_interface->prepare_sync_file_pages(
+    mnum_, trans, nalloc * (PGSIZE / BSIZE));
+  sref<data_writeback> wb;
+  if (SCALEFS_ORDERED_DATA)
+    wb = make_sref<data_writeback>();
+
+  u64 written_end = 0;
+  size_t next_page = 0;
+  for (auto &dc : chunks) {
+    char *pp[ZCHUNK_PAGES];
+    for (u32 i = 0; i < dc.npages; i++)
+      pp[i] = (char*)chunk_pages[next_page + i]->va();
+    rootfs_interface->sync_file_chunk(ip, dc.chunk, pp, dc.npages, trans);
+    for (u32 i = 0; i < dc.npages; i++)
+      track_page((u64)dc.chunk * ZCHUNK_PAGES + i,
+                 chunk_pages[next_page + i]);
+    next_page += dc.npages;
+    written_end = std::max(written_end,
+                           std::min(((u64)dc.chunk * ZCHUNK_PAGES + dc.npages)
+                                    * PGSIZE, mlen));
+  }
 
-  auto page_end = pages_.find(PGROUNDUP(mlen) / PGSIZE);
-  for (auto it = pages_.begin(); it != page_end; ) {
-    // Skip unset spans
-    if (!it.is_set()) {
-      mlen = *read_size();
-      if (mlen <= it.index()*PGSIZE)
-        break;
-      it += it.base_span();
-      if (mlen <= it.index()*PGSIZE)
-        break;
+  for (auto it_idx = pageidx_list.begin(); it_idx != pageidx_list.end();
+       it_idx++) {
+    u64 idx = *it_idx;
+    if (it_idx != pageidx_list.begin() && idx == *(it_idx - 1))
       continue;
-    }
 
-    if (!it->is_dirty_page()) {
-      ++it;
+    auto it = pages_.find(idx);
+    if (!it.is_set())
+      continue;
+
+    // A page past the size we sampled belongs to a concurrent append; leave
+    // it for the next sync.
+    if (idx * PGSIZE >= mlen) {
+      if (it->is_dirty_page())
+        add_dirty_page(idx);
       continue;
     }
 
-    size_t pos = it.index() * PGSIZE;
+    // Hold a reference to the page and clear its dirty bit before writing it
+    // out, so that a write that races with us marks it dirty (and records it
+    // in dirty_pages_) again.
+    sref<page_info> pi = it->get_page_info();
+    if (!pi || !it->test_and_set_dirty_bit(false))
+      continue;
+
+    size_t pos = idx * PGSIZE;
+
+    // A file small enough keeps its data in its inode.
+    if (idx == 0 && mlen <= INLINE_MAX &&
+        rootfs_interface->sync_file_inline(ip, (char*)pi->va(), mlen) == 0) {
+      written_end = mlen;
+      track_page(idx, pi);
+      continue;
+    }
 
     // The actual number of bytes to be written is mlen - pos, but we use
     // PGSIZE as the size argument in order to avoid expensive Read-Modify-Writes
@@ -373,26 +1300,60 @@ mfile::sync_file(int cpu)
     // asynchronous writes]. Since the rest of the bytes in the page are
     // zero anyway, this is harmless; we won't leak any random bytes into the
     // file.
-    assert(PGSIZE == rootfs_interface->sync_file_page(ip,
-                    (char*)it->get_page_info()->va(), pos, PGSIZE, trans));
-    it->set_dirty_bit(false);
-    ++it;
+    assert(PGSIZE == rootfs_interface->sync_file_page(ip, (char*)pi->va(),
+                                                      pos, PGSIZE, trans));
+    written_end = std::min(pos + PGSIZE, mlen);
+    track_page(idx, pi);
+    if (wb)
+      wb->add_page(pi);
   }
 
-  rootfs_interface->finish_sync_file_pages(ip, trans);
-
-  u64 ilen = rootfs_interface->get_file_size(mnum_);
-  // If the in-memory file is shorter, truncate the file on the disk.
-  if (ilen > mlen)
-    rootfs_interface->truncate_file(mnum_, mlen, trans);
-
-  // Update the size and the inode.
-  rootfs_interface->update_file_size(mnum_, mlen, trans);
+  rootfs_interface->finish_sync_file_pages(ip, trans, wb);
+  data_wb_ = wb;
+
+  if (whole_file) {
+    // If the in-memory file is shorter, truncate the file on the disk.
+    if (ilen > mlen)
+      rootfs_interface->truncate_file(mnum_, mlen, trans);
+
+    // Update the size and the inode.
+    rootfs_interface->update_file_size(mnum_, mlen, trans, datasync);
+  } else {
+    // Extend the size on the disk to cover the pages that were written out
+    // (all the pages between ilen and written_end are dirty and in range, so
+    // they were written too), and log the inode if the block map changed.
+    rootfs_interface->update_file_size(mnum_, std::max(ilen, written_end),
+                                       trans, true);
+  }
 
   // Add the fsync transaction to the journal's transaction queue. It will be
   // committed to disk later on by a call to flush_journal().
   rootfs_interface->add_transaction_to_queue(trans, cpu);
-  dirty(false);
+}
+
+void
+mdir::probe(const fsname& name) const
+{
+  if (initialized_ || fs_ != root_fs || name == "." || probed_.lookup(name))
+    return;
+
+  auto l = load_lock_.guard();
+  if (initialized_ || probed_.lookup(name))
+    return;
+  rootfs_interface->load_dir_name(fs_->mget(mnum_), name);
+  probed_.insert(name, true);
+}
+
+void
+mdir::load_all() const
+{
+  if (initialized_ || fs_ != root_fs)
+    return;
+
+  auto l = load_lock_.guard();
+  if (initialized_)
+    return;
+  rootfs_interface->initialize_dir(fs_->mget(mnum_));
 }
 
 void
@@ -422,4 +1383,5 @@ mfsprint(print_stream *s)
   s->println("  ", stats.items / stats.total_buckets, " avg chain length");
   if (stats.used_buckets)
     s->println("  ", stats.items / stats.used_buckets, " avg used chain length");
+  pagecache_print_placement(s);
 }
@@ -44,6 +44,8 @@ public:
 
   void mask_pc(bool mask) { }
 
+  void set_timer(u64 deadline) { }
+
   void start_ap(struct cpu *c, u32 addr)
   {
     panic("no LAPIC; cannot start AP");
@@ -5,10 +5,17 @@
 #include "proc.hh"
 #include "fs.h"
 #include "file.hh"
+#include "page_info.hh"
 #include "net.hh"
 #include "major.h"
 #include "netdev.hh"
+#include "epoll.hh"
+#include "netstat.hh"
+#include "tracepoint.hh"
+#include "kstream.hh"
+#include "cpu.hh"
 #include <uk/socket.h>
+#include <uk/fcntl.h>
 
 #ifdef LWIP
 extern "C" {
@@ -27,6 +34,36 @@ void if_input(struct netif *netif, void *buf, u16 len);
 
 netdev *the_netdev;
 
+DEFINE_PERCPU(struct netstats, mynetstats, NO_CRITICAL);
+
+// Usage: cat /dev/netstat
+static int
+netstatread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  struct netstats total = {};
+
+  s.print("cpu");
+#define X(name) s.print(" " #name);
+  NETSTATS_ALL(X)
+#undef X
+  s.println();
+  for (int c = 0; c < ncpu; c++) {
+    s.print(c);
+#define X(name) \
+    s.print(" ", mynetstats[c].name); total.name += mynetstats[c].name;
+    NETSTATS_ALL(X)
+#undef X
+    s.println();
+  }
+  s.print("total");
+#define X(name) s.print(" ", total.name);
+  NETSTATS_ALL(X)
+#undef X
+  s.println();
+  return s.get_used();
+}
+
 void
 netfree(void *va)
 {
@@ -39,12 +76,50 @@ netalloc(void)
   return kalloc("(netalloc)");
 }
 
+// Packets the stack has sent since it last released the core lock.
+// They go to the device together when it does (see lwip_core_unlock),
+// or when there are NETTX_BATCH of them, so a burst of segments costs
+// one doorbell.  Protected by the lwIP core lock.
+static struct netpkt nettx_pkts[NETTX_BATCH];
+static int nettx_n;
+
+// Send va, asking the device for a checksum if csum_start isn't 0 (see
+// netpkt).  Caller holds the lwIP core lock.
 int
-nettx(void *va, u16 len)
+nettx(void *va, u16 len, u16 csum_start, u16 csum_off)
 {
   if (!the_netdev)
     return -1;
-  return the_netdev->transmit(va, len);
+  TRACEPOINT(NET_TX, len);
+  nettx_pkts[nettx_n] = { va, len, csum_start, csum_off };
+  if (++nettx_n == NETTX_BATCH)
+    nettx_flush();
+  return 0;
+}
+
+// Caller holds the lwIP core lock.
+void
+nettx_flush(void)
+{
+  if (!nettx_n)
+    return;
+  int sent = the_netdev->transmit_batch(nettx_pkts, nettx_n);
+  u64 bytes = 0;
+  for (int i = 0; i < sent; i++)
+    bytes += nettx_pkts[i].len;
+  netstat_inc(&netstats::tx_packets, sent);
+  netstat_inc(&netstats::tx_bytes, bytes);
+  // Like a packet lost on the wire.
+  netstat_inc(&netstats::tx_ring_full, nettx_n - sent);
+  for (int i = sent; i < nettx_n; i++)
+    netfree(nettx_pkts[i].buf);
+  nettx_n = 0;
+}
+
+bool
+nettx_csum_offload(void)
+{
+  return the_netdev && the_netdev->csum_offload();
 }
 
 void
@@ -57,22 +132,116 @@ nethwaddr(u8 *hwaddr)
 
 #ifdef LWIP
 
+static void netpoll(void);
+static void netpoll_once(void);
+
+static struct netif nif;
+
+// The readiness of lwIP socket s, for epoll.  Caller holds the lwIP
+// core lock.
+static u32
+lwip_ready(int s)
+{
+  fd_set rset, wset;
+  FD_ZERO(&rset);
+  FD_ZERO(&wset);
+  FD_SET(s, &rset);
+  FD_SET(s, &wset);
+  struct timeval tv = { 0, 0 };
+  if (lwip_select(s + 1, &rset, &wset, nullptr, &tv) < 0)
+    return EPOLLERR;
+  return (FD_ISSET(s, &rset) ? EPOLLIN : 0) |
+    (FD_ISSET(s, &wset) ? EPOLLOUT : 0);
+}
+
+// A TCP connection between two sockets on this machine doesn't go
+// through lwIP at all.  When a stream socket connects to a local
+// address where one of ours is listening, the two ends are joined by a
+// pair of kernel pipes, one each way, like a pair of UNIX sockets, and
+// the listener's accept returns the other end.  Writes on one copy
+// into the pipe (or, from sendfile, hand it page-cache pages) and reads
+// on the other copy out of it.  The connecting socket still has its
+// lwIP socket, but never uses it.
+struct listen_group;
+
 class file_lwip_socket : public refcache::referenced, public file
 {
+public:
+  ilink<file_lwip_socket> netpoll_link;
+  // On a listen_group's members, or on a listener's pending_.
+  ilink<file_lwip_socket> loop_link;
+  ilink<file_lwip_socket> pending_link;
+
+private:
+  // The lwIP socket, or -1 for the accepted end of a loopback
+  // connection.
   int socket_;
   semaphore wsem_, rsem_;
+  const bool nonblock_;
+  const bool stream_;
+  sref<poll_source> poll_;
+  // The readiness netpoll last saw, less what reads and writes may
+  // have used up since, so netpoll notifies the next time it's ready.
+  std::atomic<u32> polled_;
+
+  // If this is an end of a loopback connection, the pipes it reads
+  // from and writes to.  Set before anyone else can see the socket, or
+  // under netpoll_lock.
+  struct pipe *lrx_, *ltx_;
 
-  ~file_lwip_socket()
+  // Set by SO_REUSEPORT.
+  bool reuseport_;
+  // For a listener, the group it listens with, and the loopback
+  // connections waiting for it to accept them.  group_ is set under
+  // both netpoll_lock and loop_lock; the rest is protected by loop_lock,
+  // though poll peeks at npending_.
+  sref<listen_group> group_;
+  int backlog_;
+  std::atomic<int> npending_;
+  int home_;                    // The core that last listened or accepted
+  ilist<file_lwip_socket, &file_lwip_socket::pending_link> pending_;
+  // A blocking accept sleeps on accept_cv_ until accept_gen_ changes,
+  // which a loopback connect or netpoll does when there may be a
+  // connection.  accepting_ says whether netpoll needs to look.
+  spinlock accept_lock_;
+  condvar accept_cv_;
+  std::atomic<u64> accept_gen_;
+  std::atomic<int> accepting_;
+
+  ~file_lwip_socket();
+
+  static u32 poll(void *arg)
   {
+    file_lwip_socket *s = (file_lwip_socket*)arg;
+    if (s->ltx_)
+      return pipepoll(s->lrx_, 0) | pipepoll(s->ltx_, 1);
     lwip_core_lock();
-    lwip_close(socket_);
+    u32 r = lwip_ready(s->lsock());
     lwip_core_unlock();
+    if (s->npending_)
+      r |= EPOLLIN;
+    return r;
   }
 
+  // The lwIP socket that accept and netpoll look at: the group's, for a
+  // listener.
+  int lsock() const;
+
+  void wake_accept()
+  {
+    scoped_acquire l(&accept_lock_);
+    accept_gen_++;
+    accept_cv_.wake_all();
+  }
+
+  int loop_connect(const struct sockaddr_in *sin);
+  void join(const sref<listen_group> &g, int backlog);
+
+  friend void netpoll_once(void);
+  friend struct listen_group;
+
 public:
-  file_lwip_socket(int socket)
-    : socket_(socket), wsem_("file_lwip_socket::wsem", 1),
-      rsem_("file_lwip_socket::rsem", 1) { }
+  file_lwip_socket(int socket, bool nonblock, bool stream);
   NEW_DELETE_OPS(file_lwip_socket);
 
   void inc() override { referenced::inc(); }
@@ -81,6 +250,9 @@ public:
   ssize_t read(char *buf, size_t n) override
   {
     auto l = rsem_.guard();
+    if (ltx_)
+      return piperead(lrx_, buf, n);
+    polled_.fetch_and(~EPOLLIN);
     lwip_core_lock();
     int r = lwip_read(socket_, buf, n);
     lwip_core_unlock();
@@ -90,49 +262,499 @@ public:
   ssize_t write(const char *buf, size_t n) override
   {
     auto l = wsem_.guard();
+    if (ltx_)
+      return pipewrite(ltx_, buf, n);
+    polled_.fetch_and(~EPOLLOUT);
     lwip_core_lock();
     int r = lwip_write(socket_, buf, n);
     lwip_core_unlock();
     return r;
   }
 
+  // For sendfile from the page cache.  lwIP's socket layer always
+  // copies what it's given into its own pbufs, so this is the only copy
+  // before the driver's; there's no user buffer in between.  sendfile
+  // goes a page at a time and says whether more pages follow.  Those
+  // are sent with MSG_MORE, so lwIP fills whole segments across pages,
+  // and the last one without, so its final segment gets PSH.  A
+  // loopback connection's pipe takes a reference to the page instead.
+  ssize_t write_page(const sref<page_info> &page, size_t off,
+                     size_t len, bool more) override
+  {
+    auto l = wsem_.guard();
+    if (ltx_)
+      return pipewrite_page(ltx_, page, off, len);
+    polled_.fetch_and(~EPOLLOUT);
+    lwip_core_lock();
+    int r = lwip_send(socket_, (const char*)page->va() + off, len,
+                      more ? MSG_MORE : 0);
+    lwip_core_unlock();
+    return r;
+  }
+
   int bind(const struct sockaddr *addr, size_t addrlen) override
   {
+    if (socket_ < 0)
+      return -1;
     lwip_core_lock();
     int r = lwip_bind(socket_, addr, addrlen);
     lwip_core_unlock();
     return r;
   }
 
-  int listen(int backlog) override
+  int listen(int backlog) override;
+  int setsockopt(int level, int optname, const void *optval,
+                 size_t optlen) override;
+  int connect(const struct sockaddr *addr, size_t addrlen) override;
+  int accept(struct sockaddr_storage* addr, size_t *addrlen, file **out)
+    override;
+
+  poll_source *get_poll_source() override { return poll_.get(); }
+
+  void onzero() override
   {
+    delete this;
+  }
+};
+
+// lwIP doesn't tell us when a socket becomes ready, so after it
+// handles packets or timers, which is when that happens, netpoll asks
+// it about the sockets epoll is watching and notifies the ones that
+// weren't ready before.  lwIP has few enough sockets for this to be
+// cheap.
+static spinlock netpoll_lock("netpoll", LOCKSTAT_NET);
+static ilist<file_lwip_socket, &file_lwip_socket::netpoll_link> netpoll_list;
+
+// The stream sockets listening on one address and port.  Without
+// SO_REUSEPORT that's one socket; with it, any number share the lwIP
+// socket the first of them listened on, which stays open until they've
+// all gone.  lwIP can only queue their connections together, and every
+// waiting member races for each one, but each member has its own queue
+// of loopback connections, which go to a member on the connecting core
+// if there is one and are spread by core otherwise.  So per-core
+// servers on one port don't share a queue, or a lock, for those.
+struct listen_group : public referenced {
+  int socket;                   // The lwIP listening socket, or -1
+  const u32 addr;
+  const u16 port;
+  const bool reuseport;
+  // Protected by loop_lock.
+  ilist<file_lwip_socket, &file_lwip_socket::loop_link> members;
+  int nmembers;
+  ilink<listen_group> link;
+
+  listen_group(u32 addr, u16 port, bool reuseport)
+    : socket(-1), addr(addr), port(port), reuseport(reuseport),
+      nmembers(0) {}
+  ~listen_group()
+  {
+    if (socket < 0)
+      return;
     lwip_core_lock();
-    int r = lwip_listen(socket_, backlog);
+    lwip_close(socket);
     lwip_core_unlock();
+  }
+  NEW_DELETE_OPS(listen_group);
+
+  // The member that should get a loopback connection made on this
+  // core, or null if all of their backlogs are full.  Caller holds
+  // loop_lock.
+  file_lwip_socket *pick()
+  {
+    int cpu = myid(), n = 0;
+    for (file_lwip_socket &m : members) {
+      if (m.npending_ >= m.backlog_)
+        continue;
+      if (m.home_ == cpu)
+        return &m;
+      n++;
+    }
+    if (n == 0)
+      return nullptr;
+    int k = cpu % n;
+    for (file_lwip_socket &m : members)
+      if (m.npending_ < m.backlog_ && k-- == 0)
+        return &m;
+    return nullptr;
+  }
+};
+
+// Listen groups, for loopback connections and SO_REUSEPORT to find.
+static spinlock loop_lock("netloop", LOCKSTAT_NET);
+static ilist<listen_group, &listen_group::link> listen_groups;
+
+static listen_group *
+find_group(u32 addr, u16 port)
+{
+  for (listen_group &g : listen_groups)
+    if (g.port == port && (g.addr == IPADDR_ANY || g.addr == addr))
+      return &g;
+  return nullptr;
+}
+
+int
+file_lwip_socket::lsock() const
+{
+  return group_ ? group_->socket : socket_;
+}
+
+file_lwip_socket::file_lwip_socket(int socket, bool nonblock, bool stream)
+  : socket_(socket), wsem_("file_lwip_socket::wsem", 1),
+    rsem_("file_lwip_socket::rsem", 1), nonblock_(nonblock),
+    stream_(stream), poll_(make_sref<poll_source>(poll, this)), polled_(0),
+    lrx_(nullptr), ltx_(nullptr), reuseport_(false), backlog_(0),
+    npending_(0), home_(-1), accept_lock_("file_lwip_socket::accept"),
+    accept_cv_("file_lwip_socket::accept"), accept_gen_(0), accepting_(0)
+{
+  if (socket_ < 0)
+    return;
+  scoped_acquire l(&netpoll_lock);
+  netpoll_list.push_back(this);
+}
+
+file_lwip_socket::~file_lwip_socket()
+{
+  // Connections nobody accepted are reset, as lwIP would.
+  ilist<file_lwip_socket, &file_lwip_socket::pending_link> pending;
+  if (group_) {
+    scoped_acquire l(&loop_lock);
+    group_->members.erase(group_->members.iterator_to(this));
+    if (--group_->nmembers == 0)
+      listen_groups.erase(listen_groups.iterator_to(group_.get()));
+    while (!pending_.empty()) {
+      file_lwip_socket *s = &pending_.front();
+      pending_.pop_front();
+      pending.push_back(s);
+    }
+  }
+  while (!pending.empty()) {
+    file_lwip_socket *s = &pending.front();
+    pending.pop_front();
+    s->dec();
+  }
+
+  poll_->detach();
+  if (ltx_) {
+    pipeclose(ltx_, 1);
+    pipeclose(lrx_, 0);
+  }
+  if (socket_ < 0)
+    return;
+  {
+    scoped_acquire l(&netpoll_lock);
+    netpoll_list.erase(netpoll_list.iterator_to(this));
+  }
+  // The group closes its socket once its last member has gone.
+  if (group_ && group_->socket == socket_)
+    return;
+  lwip_core_lock();
+  lwip_close(socket_);
+  lwip_core_unlock();
+}
+
+// Make this socket a member of g.
+void
+file_lwip_socket::join(const sref<listen_group> &g, int backlog)
+{
+  scoped_acquire nl(&netpoll_lock);
+  scoped_acquire l(&loop_lock);
+  if (g->nmembers++ == 0)
+    listen_groups.push_back(g.get());
+  g->members.push_back(this);
+  group_ = g;
+  backlog_ = backlog;
+  home_ = myid();
+}
+
+int
+file_lwip_socket::listen(int backlog)
+{
+  if (socket_ < 0 || ltx_)
+    return -1;
+  backlog = MAX(backlog, 1);
+  if (group_) {
+    scoped_acquire l(&loop_lock);
+    backlog_ = backlog;
+    return 0;
+  }
+
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  lwip_core_lock();
+  bool named = stream_ &&
+    lwip_getsockname(socket_, (struct sockaddr*)&sin, &len) == 0 &&
+    sin.sin_port != 0;
+  lwip_core_unlock();
+
+  // With SO_REUSEPORT, join the sockets already listening here, if
+  // they have it too.  Our own lwIP socket stays bound but unused.
+  if (named) {
+    sref<listen_group> g;
+    {
+      scoped_acquire l(&loop_lock);
+      listen_group *lg = find_group(sin.sin_addr.s_addr, sin.sin_port);
+      if (lg && lg->addr == sin.sin_addr.s_addr && lg->reuseport &&
+          reuseport_)
+        g = sref<listen_group>::newref(lg);
+    }
+    if (g) {
+      join(g, backlog);
+      return 0;
+    }
+  }
+
+  sref<listen_group> g;
+  if (named) {
+    try {
+      g = make_sref<listen_group>(sin.sin_addr.s_addr, sin.sin_port,
+                                  reuseport_);
+    } catch (std::bad_alloc &e) {
+      return -1;
+    }
+  }
+  lwip_core_lock();
+  int r = lwip_listen(socket_, backlog);
+  // accept waits for lwIP connections itself, so that it can wait for
+  // loopback ones at the same time.
+  if (r == 0 && g) {
+    u32_t on = 1;
+    lwip_ioctl(socket_, FIONBIO, &on);
+  }
+  lwip_core_unlock();
+  if (r < 0 || !g)
     return r;
+  g->socket = socket_;
+  join(g, backlog);
+  return 0;
+}
+
+int
+file_lwip_socket::setsockopt(int level, int optname, const void *optval,
+                             size_t optlen)
+{
+  if (socket_ < 0)
+    return -1;
+  if (level == SOL_SOCKET && optname == SO_REUSEPORT) {
+    if (optlen < sizeof(int) || group_)
+      return -1;
+    reuseport_ = *(const int*)optval != 0;
+    // lwIP has no SO_REUSEPORT of its own, but needs SO_REUSEADDR to
+    // let more than one socket bind the port.
+    optname = SO_REUSEADDR;
   }
+  lwip_core_lock();
+  int r = lwip_setsockopt(socket_, level, optname, optval, optlen);
+  lwip_core_unlock();
+  return r;
+}
 
-  int accept(struct sockaddr_storage* addr, size_t *addrlen, file **out)
-    override
+// Join this socket to a local listener on sin, if there is one.
+// Returns 0 if it did, -1 if it failed, or 1 to connect through lwIP.
+int
+file_lwip_socket::loop_connect(const struct sockaddr_in *sin)
+{
+  u32 addr = sin->sin_addr.s_addr;
+  bool loopback = (ntohl(addr) >> 24) == 127;
+  if (!stream_ || sin->sin_family != AF_INET ||
+      !(loopback || addr == nif.ip_addr.addr))
+    return 1;
+  // The accepted end is non-blocking if the listener is, as with
+  // lwIP's accept.
+  bool peer_nonblock = false;
   {
+    scoped_acquire l(&loop_lock);
+    listen_group *g = find_group(addr, sin->sin_port);
+    if (!g)
+      return 1;
+    file_lwip_socket *ls = g->pick();
+    if (!ls)
+      return -1;
+    peer_nonblock = ls->nonblock_;
+  }
+
+  // Allocating may sleep, so the listeners may have changed after;
+  // pick again.
+  file_lwip_socket *peer;
+  try {
+    peer = new file_lwip_socket(-1, peer_nonblock, true);
+  } catch (std::bad_alloc &e) {
+    return -1;
+  }
+  int rflags = nonblock_ ? O_NONBLOCK : 0;
+  int pflags = peer_nonblock ? O_NONBLOCK : 0;
+  struct pipe *up = pipesockalloc(peer->poll_, poll_, pflags, rflags);
+  struct pipe *down = pipesockalloc(poll_, peer->poll_, rflags, pflags);
+
+  // Full backlogs refuse the connection.
+  bool joined = false;
+  if (up && down) {
+    scoped_acquire l(&loop_lock);
+    listen_group *g = find_group(addr, sin->sin_port);
+    file_lwip_socket *ls = g ? g->pick() : nullptr;
+    if (ls && ls->nonblock_ == peer_nonblock) {
+      peer->lrx_ = up;
+      peer->ltx_ = down;
+      ls->pending_.push_back(peer);
+      ls->npending_++;
+      ls->wake_accept();
+      ls->poll_->notify(EPOLLIN);
+      joined = true;
+    }
+  }
+  if (!joined) {
+    if (up)
+      pipesockclose(up);
+    if (down)
+      pipesockclose(down);
+    peer->dec();
+    return -1;
+  }
+
+  scoped_acquire l(&netpoll_lock);
+  lrx_ = down;
+  ltx_ = up;
+  return 0;
+}
+
+int
+file_lwip_socket::connect(const struct sockaddr *addr, size_t addrlen)
+{
+  if (socket_ < 0 || ltx_)
+    return -1;
+  if (addrlen >= sizeof(struct sockaddr_in)) {
+    int r = loop_connect((const struct sockaddr_in*)addr);
+    if (r <= 0)
+      return r;
+  }
+  lwip_core_lock();
+  int r = lwip_connect(socket_, addr, addrlen);
+  lwip_core_unlock();
+  return r;
+}
+
+int
+file_lwip_socket::accept(struct sockaddr_storage* addr, size_t *addrlen,
+                         file **out)
+{
+  if (socket_ < 0)
+    return -1;
+  accepting_++;
+  auto cleanup = scoped_cleanup([this](){ accepting_--; });
+  for (;;) {
+    u64 gen = accept_gen_;
+    file_lwip_socket *peer = nullptr;
+    if (group_) {
+      scoped_acquire l(&loop_lock);
+      home_ = myid();
+      if (!pending_.empty()) {
+        peer = &pending_.front();
+        pending_.pop_front();
+        npending_--;
+      }
+    }
+    if (peer) {
+      struct sockaddr_in *sin = (struct sockaddr_in*)addr;
+      memset(sin, 0, sizeof(*sin));
+      sin->sin_len = sizeof(*sin);
+      sin->sin_family = AF_INET;
+      sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      *addrlen = sizeof(*sin);
+      *out = peer;
+      return 0;
+    }
+
+    polled_.fetch_and(~EPOLLIN);
     lwip_core_lock();
     socklen_t len = sizeof(*addr);
-    int ss = lwip_accept(socket_, (struct sockaddr*)addr, &len);
+    int ss = lwip_accept(lsock(), (struct sockaddr*)addr, &len);
+    if (ss >= 0 && nonblock_) {
+      u32_t on = 1;
+      lwip_ioctl(ss, FIONBIO, &on);
+    }
     lwip_core_unlock();
-    if (ss < 0)
+    if (ss >= 0) {
+      *addrlen = len;
+      *out = new file_lwip_socket(ss, nonblock_, true);
+      return 0;
+    }
+    if (!group_ || nonblock_ || myproc()->killed)
       return -1;
-    *addrlen = len;
-    *out = new file_lwip_socket{ss};
-    return 0;
+
+    scoped_acquire l(&accept_lock_);
+    while (accept_gen_ == gen && !myproc()->killed)
+      accept_cv_.sleep(&accept_lock_);
   }
+}
 
-  void onzero() override
+// Requests for netpoll_once() since the core running it started.
+static std::atomic<u64> netpoll_pending;
+
+static void
+netpoll_once(void)
+{
+  sref<poll_source> srcs[MEMP_NUM_NETCONN];
+  u32 events[MEMP_NUM_NETCONN];
+  int n = 0;
   {
-    delete this;
+    scoped_acquire l(&netpoll_lock);
+    fd_set rset, wset;
+    FD_ZERO(&rset);
+    FD_ZERO(&wset);
+    int maxfd = -1;
+    for (file_lwip_socket &s : netpoll_list) {
+      if (s.ltx_ || (!s.poll_->watched() && !s.accepting_))
+        continue;
+      int fd = s.lsock();
+      FD_SET(fd, &rset);
+      FD_SET(fd, &wset);
+      maxfd = MAX(maxfd, fd);
+    }
+    if (maxfd < 0)
+      return;
+    struct timeval tv = { 0, 0 };
+    lwip_core_lock();
+    int r = lwip_select(maxfd + 1, &rset, &wset, nullptr, &tv);
+    lwip_core_unlock();
+    if (r < 0)
+      return;
+    for (file_lwip_socket &s : netpoll_list) {
+      if (s.ltx_)
+        continue;
+      int fd = s.lsock();
+      if (s.accepting_ && FD_ISSET(fd, &rset))
+        s.wake_accept();
+      if (!s.poll_->watched() || n == MEMP_NUM_NETCONN)
+        continue;
+      u32 mask = (FD_ISSET(fd, &rset) ? EPOLLIN : 0) |
+        (FD_ISSET(fd, &wset) ? EPOLLOUT : 0);
+      u32 fresh = mask & ~s.polled_.exchange(mask);
+      if (fresh) {
+        srcs[n] = s.poll_;
+        events[n++] = fresh;
+      }
+    }
   }
-};
+  for (int i = 0; i < n; i++)
+    srcs[i]->notify(events[i]);
+}
 
-static struct netif nif;
+// Every packet and timer tick asks for a poll, and a poll selects on
+// all of the watched sockets under the core lock, so these are
+// coalesced: only one core polls at a time, and if others asked while
+// it did, it polls once more for all of them.  Caller must not hold the
+// lwIP core lock.
+static void
+netpoll(void)
+{
+  if (netpoll_pending.fetch_add(1) != 0)
+    return;
+  u64 seen = 1;
+  for (;;) {
+    netpoll_once();
+    if (netpoll_pending.compare_exchange_strong(seen, 0))
+      return;
+  }
+}
 
 struct timer_thread {
   u64 nsec;
@@ -146,9 +768,30 @@ int errno;
 void
 netrx(void *va, u16 len)
 {
+  netstat_inc(&netstats::rx_packets);
+  netstat_inc(&netstats::rx_bytes, len);
+  TRACEPOINT(NET_RX, 1, len);
   lwip_core_lock();
   if_input(&nif, va, len);
   lwip_core_unlock();
+  netpoll();
+}
+
+// Like netrx for n packets, taking the core lock once.
+void
+netrx_batch(void *const *va, const u16 *len, int n)
+{
+  u64 bytes = 0;
+  for (int i = 0; i < n; i++)
+    bytes += len[i];
+  netstat_inc(&netstats::rx_packets, n);
+  netstat_inc(&netstats::rx_bytes, bytes);
+  TRACEPOINT(NET_RX, n, bytes);
+  lwip_core_lock();
+  for (int i = 0; i < n; i++)
+    if_input(&nif, va[i], len[i]);
+  lwip_core_unlock();
+  netpoll();
 }
 
 static void __attribute__((noreturn))
@@ -162,6 +805,7 @@ net_timer(void *x)
     lwip_core_lock();
     t->func();
     lwip_core_unlock();
+    netpoll();
     acquire(&t->waitlk);
     t->waitcv.sleep_to(&t->waitlk, cur + t->nsec);
     release(&t->waitlk);
@@ -326,6 +970,7 @@ initnet(void)
   struct proc *t;
 
   devsw[MAJ_NETIF].pread = netifread;
+  devsw[MAJ_NETSTAT].pread = netstatread;
 
   t = threadalloc(initnet_worker, nullptr);
   if (t == nullptr)
@@ -341,12 +986,18 @@ int
 netsocket(int domain, int type, int protocol, file **out)
 {
   int r;
+  bool nonblock = type & SOCK_NONBLOCK;
   lwip_core_lock();
-  r = lwip_socket(domain, type, protocol);
+  r = lwip_socket(domain, type & ~SOCK_NONBLOCK, protocol);
+  if (r >= 0 && nonblock) {
+    u32_t on = 1;
+    lwip_ioctl(r, FIONBIO, &on);
+  }
   lwip_core_unlock();
   if (r < 0)
     return -1;
-  *out = new file_lwip_socket{r};
+  bool stream = (type & ~SOCK_NONBLOCK) == SOCK_STREAM;
+  *out = new file_lwip_socket(r, nonblock, stream);
   return 0;
 }
 
@@ -355,6 +1006,7 @@ netsocket(int domain, int type, int protocol, file **out)
 void
 initnet(void)
 {
+  devsw[MAJ_NETSTAT].pread = netstatread;
 }
 
 void
@@ -363,6 +1015,13 @@ netrx(void *va, u16 len)
   netfree(va);
 }
 
+void
+netrx_batch(void *const *va, const u16 *len, int n)
+{
+  for (int i = 0; i < n; i++)
+    netfree(va[i]);
+}
+
 int
 netsocket(int domain, int type, int protocol, file **out)
 {
@@ -0,0 +1,663 @@
+// NVM Express driver.
+//
+// Every core gets its own I/O submission/completion queue pair and, when the
+// controller has enough MSI-X vectors, its own completion interrupt delivered
+// to that core. Commands are submitted on the queue of the core that issues
+// them, so the per-core ScaleFS journals (which are written from their own
+// cores) each drive a separate hardware queue and never share a lock.
+
+#include "types.h"
+#include "amd64.h"
+#include "kernel.hh"
+#include "pci.hh"
+#include "pcireg.hh"
+#include "disk.hh"
+#include "ideconfig.hh"
+#include "nvmereg.hh"
+#include "kstream.hh"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "cpu.hh"
+#include "proc.hh"
+
+enum { ADMIN_QUEUE_DEPTH = 16 };
+
+// A read or write from the disk interface. It may take several commands,
+// since a command's data must be describable by a single PRP list.
+struct nvme_request
+{
+  std::atomic<int> pending;     // Outstanding commands, plus one while issuing
+  sref<disk_completion> dc;
+  u32 result;                   // Of the last command to complete
+  u16 status;
+
+  explicit nvme_request(sref<disk_completion> dc)
+    : pending(1), dc(dc), result(0), status(0) {}
+  NEW_DELETE_OPS(nvme_request);
+
+  void put() {
+    if (--pending == 0) {
+      if (dc)
+        dc->notify();
+      delete this;
+    }
+  }
+};
+
+// A submission queue and its completion queue.
+class nvme_queue
+{
+public:
+  nvme_queue(volatile u8 *bar, u32 dstrd, int qid, u32 depth, int cpu);
+  NEW_DELETE_OPS(nvme_queue);
+
+  const int qid;
+  const u32 depth;
+  volatile nvme_sqe *sq;
+  volatile nvme_cqe *cq;
+
+  // Issue a command whose PRP list (if it needs one) has been written to the
+  // PRP page of its cid. Both must be called with lock held.
+  u16 alloc_cid();
+  void submit(u16 cid, nvme_sqe *cmd, nvme_request *req);
+  u64* prp_page(u16 cid) { return prp_pages_[cid]; }
+
+  // Tell the controller about the commands submitted since the last call.
+  void ring();
+
+  // Complete whatever the controller has posted to the completion queue.
+  void reap();
+  void reap_locked();
+
+  spinlock lock;
+
+private:
+  volatile u32 *sq_db_, *cq_db_;
+  u32 sq_tail_, sq_rung_, cq_head_;
+  u16 phase_;
+
+  // At most depth-1 cids are handed out, so the queues can never overflow.
+  std::vector<u16> free_cids_;
+  std::vector<nvme_request*> reqs_;
+  std::vector<u64*> prp_pages_;
+  condvar cv_;
+};
+
+class nvme_disk : public disk
+{
+public:
+  nvme_disk(struct pci_func *pcif);
+  NEW_DELETE_OPS(nvme_disk);
+
+  static int attach(struct pci_func *pcif);
+  bool init();
+
+  void readv(kiovec *iov, int iov_cnt, u64 off) override;
+  void writev(kiovec *iov, int iov_cnt, u64 off) override;
+  void flush() override;
+
+  void areadv(kiovec *iov, int iov_cnt, u64 off,
+              sref<disk_completion> dc) override;
+  void awritev(kiovec *iov, int iov_cnt, u64 off,
+               sref<disk_completion> dc) override;
+  void aflush(sref<disk_completion> dc) override;
+  void awritev_fua(kiovec *iov, int iov_cnt, u64 off,
+                   sref<disk_completion> dc) override;
+
+private:
+  struct pci_func *const pcif_;
+  volatile u8 *const bar_;
+  volatile nvme_reg *const reg_;
+  u32 dstrd_;
+  u32 depth_;
+
+  u32 nsid_;
+  u32 lba_shift_;
+  u64 max_xfer_;
+
+  nvme_queue *admin_;
+  int nioq_;
+  nvme_queue *ioq_[NCPU];
+
+  bool enable();
+  int admin_cmd(nvme_sqe *cmd, u32 *result = nullptr);
+  bool identify(void *buf, u32 cns, u32 nsid);
+  bool create_queues();
+  void setup_irqs(bool msix);
+
+  nvme_queue* myqueue() { return ioq_[myid() % nioq_]; }
+  void rw(kiovec *iov, int iov_cnt, u64 off, u8 opcode,
+          sref<disk_completion> dc, bool fua = false);
+  void issue_rw(nvme_queue *q, u16 cid, u8 opcode, u64 off, u64 len,
+                u64 prp1, u32 nprps, nvme_request *req, bool fua);
+
+  void blocking_wait(sref<disk_completion> dc);
+};
+
+int
+nvme_disk::attach(struct pci_func *pcif)
+{
+  if (PCI_INTERFACE(pcif->dev_class) != 0x02) {
+    console.println("NVMe: not an NVM Express controller");
+    return 0;
+  }
+
+  console.println("NVMe: attaching");
+  pci_func_enable(pcif);
+  nvme_disk *d = new nvme_disk(pcif);
+  if (!d->init()) {
+    console.println("NVMe: initialization failed");
+    return 0;
+  }
+  disk_register(d);
+  console.println("NVMe: done");
+  return 1;
+}
+
+void
+initnvme(void)
+{
+#if NVMEIDE
+  pci_register_class_driver(PCI_CLASS_MASS_STORAGE,
+                            PCI_SUBCLASS_MASS_STORAGE_NVM,
+                            &nvme_disk::attach);
+#endif
+}
+
+nvme_queue::nvme_queue(volatile u8 *bar, u32 dstrd, int qid, u32 depth,
+                       int cpu)
+  : qid(qid), depth(depth), lock("nvme_queue"),
+    sq_tail_(0), sq_rung_(0), cq_head_(0), phase_(1),
+    cv_("nvme_queue::cv")
+{
+  size_t sq_bytes = PGROUNDUP(depth * sizeof(nvme_sqe));
+  size_t cq_bytes = PGROUNDUP(depth * sizeof(nvme_cqe));
+  sq = (nvme_sqe*) kalloc("nvme_sq", sq_bytes, cpu);
+  cq = (nvme_cqe*) kalloc("nvme_cq", cq_bytes, cpu);
+  assert(sq && cq);
+  memset((void*) sq, 0, sq_bytes);
+  memset((void*) cq, 0, cq_bytes);
+
+  sq_db_ = (volatile u32*) (bar + NVME_DOORBELL_BASE +
+                            (2 * qid) * (4 << dstrd));
+  cq_db_ = (volatile u32*) (bar + NVME_DOORBELL_BASE +
+                            (2 * qid + 1) * (4 << dstrd));
+
+  for (u32 cid = depth - 1; cid > 0; cid--)
+    free_cids_.push_back(cid - 1);
+  for (u32 cid = 0; cid < depth; cid++) {
+    reqs_.push_back(nullptr);
+    prp_pages_.push_back(nullptr);
+  }
+}
+
+u16
+nvme_queue::alloc_cid()
+{
+  while (free_cids_.empty()) {
+    // Let the controller see what we've queued so far before waiting for it.
+    ring();
+    if (myproc()->get_state() == RUNNING) {
+      cv_.sleep(&lock);
+    } else {
+      reap_locked();
+    }
+  }
+
+  u16 cid = free_cids_.back();
+  free_cids_.pop_back();
+  if (!prp_pages_[cid]) {
+    prp_pages_[cid] = (u64*) kalloc("nvme_prp");
+    assert(prp_pages_[cid]);
+  }
+  return cid;
+}
+
+void
+nvme_queue::submit(u16 cid, nvme_sqe *cmd, nvme_request *req)
+{
+  cmd->cid = cid;
+  reqs_[cid] = req;
+  if (req)
+    ++req->pending;
+  memcpy((void*) &sq[sq_tail_], cmd, sizeof(*cmd));
+  sq_tail_ = (sq_tail_ + 1) % depth;
+
+  // Ring the doorbell once per batch rather than per command, unless the
+  // batch has grown to a sizable part of the queue.
+  if ((sq_tail_ + depth - sq_rung_) % depth >= depth / 4)
+    ring();
+}
+
+void
+nvme_queue::ring()
+{
+  if (sq_rung_ == sq_tail_)
+    return;
+  *sq_db_ = sq_tail_;
+  sq_rung_ = sq_tail_;
+}
+
+void
+nvme_queue::reap()
+{
+  scoped_acquire a(&lock);
+  reap_locked();
+  ring();
+}
+
+void
+nvme_queue::reap_locked()
+{
+  bool reaped = false;
+  for (;;) {
+    volatile nvme_cqe *cqe = &cq[cq_head_];
+    u16 status = cqe->status;
+    if (NVME_CQE_PHASE(status) != phase_)
+      break;
+
+    // Admin commands report failures to their issuer; there's nothing to be
+    // done about a failed read or write.
+    u16 cid = cqe->cid;
+    if (NVME_CQE_SC(status) && qid != 0)
+      panic("NVMe: queue %d: command %u failed, status 0x%x\n",
+            qid, cid, NVME_CQE_SC(status));
+
+    nvme_request *req = reqs_[cid];
+    reqs_[cid] = nullptr;
+    free_cids_.push_back(cid);
+    if (req) {
+      req->result = cqe->dw0;
+      req->status = NVME_CQE_SC(status);
+      req->put();
+    }
+
+    if (++cq_head_ == depth) {
+      cq_head_ = 0;
+      phase_ ^= 1;
+    }
+    reaped = true;
+  }
+
+  if (reaped) {
+    *cq_db_ = cq_head_;
+    cv_.wake_all();
+  }
+}
+
+nvme_disk::nvme_disk(struct pci_func *pcif)
+  : pcif_(pcif),
+    bar_((volatile u8*) p2v(pcif->reg_base[0])),
+    reg_((volatile nvme_reg*) bar_),
+    admin_(nullptr), nioq_(0)
+{
+}
+
+bool
+nvme_disk::init()
+{
+  u64 cap = reg_->cap;
+  dstrd_ = NVME_CAP_DSTRD(cap);
+  depth_ = NVME_QUEUE_DEPTH;
+  if (depth_ > NVME_CAP_MQES(cap) + 1)
+    depth_ = NVME_CAP_MQES(cap) + 1;
+  if (NVME_CAP_MPSMIN(cap) + 12 > PGSHIFT) {
+    cprintf("NVMe: controller doesn't support %d byte pages\n", PGSIZE);
+    return false;
+  }
+
+  admin_ = new nvme_queue(bar_, dstrd_, 0, ADMIN_QUEUE_DEPTH, 0);
+  if (!enable())
+    return false;
+
+  auto *id = (nvme_id_ctrl*) kalloc("nvme_id");
+  if (!identify(id, NVME_IDENTIFY_CTRL, 0)) {
+    cprintf("NVMe: cannot identify controller\n");
+    return false;
+  }
+
+  memcpy(dk_model, id->mn, sizeof(dk_model));
+  dk_model[sizeof(dk_model) - 1] = '\0';
+  memcpy(dk_serial, id->sn, sizeof(dk_serial));
+  dk_serial[sizeof(dk_serial) - 1] = '\0';
+  memcpy(dk_firmware, id->fr, sizeof(dk_firmware));
+  dk_firmware[sizeof(dk_firmware) - 1] = '\0';
+  snprintf(dk_busloc, sizeof(dk_busloc), "nvme.%x.%x", pcif_->bus->busno,
+           pcif_->dev);
+
+  // A command can move at most what one page of PRP entries describes, and
+  // at most 2^MDTS of the controller's minimum pages.
+  max_xfer_ = (u64) (PGSIZE / sizeof(u64)) * PGSIZE;
+  u64 mps_min = 1ull << (12 + NVME_CAP_MPSMIN(cap));
+  if (id->mdts && (mps_min << id->mdts) < max_xfer_)
+    max_xfer_ = mps_min << id->mdts;
+
+  if (id->nn < 1) {
+    cprintf("NVMe: %s has no namespaces\n", dk_busloc);
+    return false;
+  }
+
+  // We only use the first namespace.
+  nsid_ = 1;
+  auto *ns = (nvme_id_ns*) id;
+  if (!identify(ns, NVME_IDENTIFY_NS, nsid_)) {
+    cprintf("NVMe: cannot identify namespace %u\n", nsid_);
+    return false;
+  }
+  lba_shift_ = ns->lbaf[ns->flbas & 0xf].lbads;
+  dk_fua = true;
+  dk_nbytes = ns->nsze << lba_shift_;
+  kfree(id);
+
+  if (!create_queues())
+    return false;
+
+  cprintf("NVMe: %s: <%s> %lu MB, %d I/O queues of %u entries\n",
+          dk_busloc, dk_model, dk_nbytes >> 20, nioq_, depth_);
+  return true;
+}
+
+bool
+nvme_disk::enable()
+{
+  u64 timeout = (NVME_CAP_TO(reg_->cap) + 1) * 500 * 1000;  // in usec
+
+  if (reg_->cc & NVME_CC_EN) {
+    reg_->cc = reg_->cc & ~NVME_CC_EN;
+    for (u64 t = 0; reg_->csts & NVME_CSTS_RDY; t += 1000) {
+      if (t > timeout) {
+        cprintf("NVMe: controller won't reset\n");
+        return false;
+      }
+      microdelay(1000);
+    }
+  }
+
+  reg_->aqa = ((ADMIN_QUEUE_DEPTH - 1) << 16) | (ADMIN_QUEUE_DEPTH - 1);
+  reg_->asq = v2p((void*) admin_->sq);
+  reg_->acq = v2p((void*) admin_->cq);
+  reg_->cc = NVME_CC_EN | NVME_CC_CSS_NVM | NVME_CC_MPS(PGSHIFT) |
+             NVME_CC_AMS_RR | NVME_CC_IOSQES(6) | NVME_CC_IOCQES(4);
+
+  for (u64 t = 0; !(reg_->csts & NVME_CSTS_RDY); t += 1000) {
+    if ((reg_->csts & NVME_CSTS_CFS) || t > timeout) {
+      cprintf("NVMe: controller won't become ready, CSTS 0x%x\n", reg_->csts);
+      return false;
+    }
+    microdelay(1000);
+  }
+  return true;
+}
+
+// Issue an admin command and poll for its completion. Returns the command's
+// status code, or -1 if it timed out.
+int
+nvme_disk::admin_cmd(nvme_sqe *cmd, u32 *result)
+{
+  // Keep the issuing reference until we've read the outcome.
+  nvme_request *req = new nvme_request(sref<disk_completion>());
+
+  scoped_acquire a(&admin_->lock);
+  admin_->submit(admin_->alloc_cid(), cmd, req);
+  admin_->ring();
+
+  for (u64 t = 0; req->pending > 1; t += 10) {
+    if (t > 1000 * 1000) {
+      cprintf("NVMe: admin command 0x%x timed out\n", cmd->opcode);
+      return -1;
+    }
+    microdelay(10);
+    admin_->reap_locked();
+  }
+
+  int status = req->status;
+  if (result)
+    *result = req->result;
+  req->put();
+  return status;
+}
+
+bool
+nvme_disk::identify(void *buf, u32 cns, u32 nsid)
+{
+  nvme_sqe cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opcode = NVME_ADMIN_IDENTIFY;
+  cmd.nsid = nsid;
+  cmd.prp1 = v2p(buf);
+  cmd.cdw10 = cns;
+  return admin_cmd(&cmd) == 0;
+}
+
+bool
+nvme_disk::create_queues()
+{
+  // Ask for a queue pair per core.
+  nvme_sqe cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opcode = NVME_ADMIN_SET_FEATURES;
+  cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+  cmd.cdw11 = ((ncpu - 1) << 16) | (ncpu - 1);
+  u32 granted;
+  if (admin_cmd(&cmd, &granted) != 0) {
+    cprintf("NVMe: cannot set the number of queues\n");
+    return false;
+  }
+
+  nioq_ = std::min(ncpu, (int) std::min(granted & 0xffff, granted >> 16) + 1);
+
+  // With MSI-X, every I/O queue interrupts the core that it belongs to. If
+  // there are fewer vectors than queues, cores share queues instead.
+  int nvec = pci_msix_vectors(pcif_);
+  if (nvec)
+    nioq_ = std::min(nioq_, nvec);
+
+  for (int q = 0; q < nioq_; q++) {
+    int qid = q + 1;
+    nvme_queue *ioq = ioq_[q] = new nvme_queue(bar_, dstrd_, qid, depth_, q);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1 = v2p((void*) ioq->cq);
+    cmd.cdw10 = ((depth_ - 1) << 16) | qid;
+    cmd.cdw11 = ((nvec ? q : 0) << 16) | NVME_CQ_IRQ_ENABLED |
+                NVME_QUEUE_PHYS_CONTIG;
+    if (admin_cmd(&cmd) != 0) {
+      cprintf("NVMe: cannot create completion queue %d\n", qid);
+      return false;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_CREATE_SQ;
+    cmd.prp1 = v2p((void*) ioq->sq);
+    cmd.cdw10 = ((depth_ - 1) << 16) | qid;
+    cmd.cdw11 = (qid << 16) | NVME_QUEUE_PHYS_CONTIG;
+    if (admin_cmd(&cmd) != 0) {
+      cprintf("NVMe: cannot create submission queue %d\n", qid);
+      return false;
+    }
+  }
+
+  setup_irqs(nvec != 0);
+  return true;
+}
+
+void
+nvme_disk::setup_irqs(bool msix)
+{
+  if (msix) {
+    for (int q = 0; q < nioq_; q++) {
+      irq ioq_irq = pci_map_msix_irq(pcif_, q, q);
+      assert(ioq_irq.valid());
+      nvme_queue *ioq = ioq_[q];
+      ioq_irq.register_callback([ioq]() { ioq->reap(); });
+    }
+    pci_enable_msix(pcif_);
+    return;
+  }
+
+  // A single interrupt for all of the queues.
+  irq nvme_irq = pci_map_msi_irq(pcif_);
+  if (!nvme_irq.valid()) {
+    nvme_irq = extpic->map_pci_irq(pcif_);
+    nvme_irq.enable();
+  }
+  nvme_irq.register_callback([this]() {
+      for (int q = 0; q < nioq_; q++)
+        ioq_[q]->reap();
+    });
+}
+
+void
+nvme_disk::blocking_wait(sref<disk_completion> dc)
+{
+  while (!dc->done()) {
+    if (myproc()->get_state() == RUNNING) {
+      dc->wait();
+    } else {
+      for (int q = 0; q < nioq_; q++)
+        ioq_[q]->reap();
+    }
+  }
+}
+
+// Submit a read or write on this core's queue. A command's PRP list can't
+// describe a hole or a partial page in the middle of its transfer, so the
+// iovecs are cut into separate commands wherever one segment doesn't end on a
+// page boundary or the next doesn't start on one, or when a command would
+// exceed the controller's transfer size limit.
+void
+nvme_disk::rw(kiovec *iov, int iov_cnt, u64 off, u8 opcode,
+              sref<disk_completion> dc, bool fua)
+{
+  assert((off & ((1 << lba_shift_) - 1)) == 0);
+
+  nvme_request *req = new nvme_request(dc);
+  nvme_queue *q = myqueue();
+  scoped_acquire a(&q->lock);
+
+  u16 cid = 0;
+  u64 cmd_off = off, len = 0, prp1 = 0, end = 0;
+  u32 nprps = 0;
+  for (int i = 0; i < iov_cnt; i++) {
+    char *va = (char*) iov[i].iov_base;
+    for (u64 left = iov[i].iov_len; left; ) {
+      u64 pa = v2p(va);
+      u64 n = std::min(left, (u64) PGSIZE - (pa % PGSIZE));
+      if (len && (end % PGSIZE || pa % PGSIZE || len + n > max_xfer_)) {
+        issue_rw(q, cid, opcode, cmd_off, len, prp1, nprps, req, fua);
+        cmd_off += len;
+        len = 0;
+      }
+
+      if (!len) {
+        cid = q->alloc_cid();
+        prp1 = pa;
+        nprps = 0;
+      } else {
+        q->prp_page(cid)[nprps++] = pa;
+      }
+      len += n;
+      end = pa + n;
+      va += n;
+      left -= n;
+    }
+  }
+  if (len)
+    issue_rw(q, cid, opcode, cmd_off, len, prp1, nprps, req, fua);
+  q->ring();
+
+  a.release();
+  req->put();
+}
+
+void
+nvme_disk::issue_rw(nvme_queue *q, u16 cid, u8 opcode, u64 off, u64 len,
+                    u64 prp1, u32 nprps, nvme_request *req, bool fua)
+{
+  u64 nlb = len >> lba_shift_;
+  assert((len & ((1 << lba_shift_) - 1)) == 0 && nlb > 0 && nlb <= 65536);
+
+  nvme_sqe cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opcode = opcode;
+  cmd.nsid = nsid_;
+  cmd.prp1 = prp1;
+  if (nprps == 1)
+    cmd.prp2 = q->prp_page(cid)[0];
+  else if (nprps > 1)
+    cmd.prp2 = v2p(q->prp_page(cid));
+
+  u64 slba = off >> lba_shift_;
+  cmd.cdw10 = slba & 0xffffffff;
+  cmd.cdw11 = slba >> 32;
+  cmd.cdw12 = nlb - 1;
+  if (fua)
+    cmd.cdw12 |= NVME_RW_FUA;
+  q->submit(cid, &cmd, req);
+}
+
+void
+nvme_disk::readv(kiovec *iov, int iov_cnt, u64 off)
+{
+  auto dc = sref<disk_completion>::transfer(new disk_completion());
+  areadv(iov, iov_cnt, off, dc);
+  blocking_wait(dc);
+}
+
+void
+nvme_disk::areadv(kiovec *iov, int iov_cnt, u64 off,
+                  sref<disk_completion> dc)
+{
+  rw(iov, iov_cnt, off, NVME_CMD_READ, dc);
+}
+
+void
+nvme_disk::writev(kiovec *iov, int iov_cnt, u64 off)
+{
+  auto dc = sref<disk_completion>::transfer(new disk_completion());
+  awritev(iov, iov_cnt, off, dc);
+  blocking_wait(dc);
+}
+
+void
+nvme_disk::awritev(kiovec *iov, int iov_cnt, u64 off,
+                   sref<disk_completion> dc)
+{
+  rw(iov, iov_cnt, off, NVME_CMD_WRITE, dc);
+}
+
+void
+nvme_disk::awritev_fua(kiovec *iov, int iov_cnt, u64 off,
+                       sref<disk_completion> dc)
+{
+  rw(iov, iov_cnt, off, NVME_CMD_WRITE, dc, true);
+}
+
+void
+nvme_disk::flush()
+{
+  auto dc = sref<disk_completion>::transfer(new disk_completion());
+  aflush(dc);
+  blocking_wait(dc);
+}
+
+void
+nvme_disk::aflush(sref<disk_completion> dc)
+{
+  // Unlike SATA's FLUSH CACHE, an NVMe Flush may be queued alongside reads
+  // and writes; it covers every write that completed before it was issued,
+  // whichever queue that write went through.
+  nvme_request *req = new nvme_request(dc);
+  nvme_queue *q = myqueue();
+  {
+    scoped_acquire a(&q->lock);
+    nvme_sqe cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_CMD_FLUSH;
+    cmd.nsid = nsid_;
+    q->submit(q->alloc_cid(), &cmd, req);
+    q->ring();
+  }
+  req->put();
+}
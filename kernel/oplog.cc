@@ -0,0 +1,8 @@
+#include "types.h"
+#include "kernel.hh"
+#include "oplog.hh"
+
+namespace oplog {
+  percpu<tsc_logger::pending_bytes, NO_CRITICAL> tsc_logger::pending_bytes_;
+  void (*tsc_logger::pressure_fn_)(int cpu);
+}
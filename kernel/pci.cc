@@ -178,6 +178,9 @@ pci_scan_caplist(struct pci_func* f)
     case PCI_CAP_MSI:
       f->msi_capreg = cap_ptr;
       break;
+    case PCI_CAP_MSIX:
+      f->msix_capreg = cap_ptr;
+      break;
     default:
       break;
     }
@@ -185,8 +188,59 @@ pci_scan_caplist(struct pci_func* f)
   }
 }
 
+// Moves an MSI by rewriting the function's Message Address Register
+// (or, under an IOMMU, the remapping entry it names).  The function's
+// struct pci_func belongs to the bus scan, so keep its address.
+class msi_router : public irq_router
+{
+  u32 busno_, dev_, func_;
+  u8 capreg_;
+  int iommu_index_;
+
+public:
+  msi_router(struct pci_func *f, int iommu_index)
+    : busno_(f->bus->busno), dev_(f->dev), func_(f->func),
+      capreg_(f->msi_capreg), iommu_index_(iommu_index) { }
+  NEW_DELETE_OPS(msi_router);
+
+  void route_irq(const struct irq &irq, int cpu) override
+  {
+    if (iommu)
+      iommu->set_int_dest(iommu_index_, &cpus[cpu]);
+    else
+      pci_conf_write(0, busno_, dev_, func_, capreg_ + 4*1,
+                     (0x0fee << 20) | (cpus[cpu].hwid.num << 12) | (1 << 3),
+                     32);
+  }
+};
+
+// Moves an MSI-X entry.  The entry is masked while its address changes
+// so the device can't send a message with a torn address.
+class msix_router : public irq_router
+{
+  volatile u32 *ent_;
+  int iommu_index_;
+
+public:
+  msix_router(volatile u32 *ent, int iommu_index)
+    : ent_(ent), iommu_index_(iommu_index) { }
+  NEW_DELETE_OPS(msix_router);
+
+  void route_irq(const struct irq &irq, int cpu) override
+  {
+    if (iommu) {
+      iommu->set_int_dest(iommu_index_, &cpus[cpu]);
+      return;
+    }
+    u32 ctl = ent_[3];
+    ent_[3] = ctl | 1;
+    ent_[0] = (0x0fee << 20) | (cpus[cpu].hwid.num << 12) | (1 << 3);
+    ent_[3] = ctl;
+  }
+};
+
 irq
-pci_map_msi_irq(struct pci_func *f)
+pci_map_msi_irq(struct pci_func *f, int cpu)
 {
   // PCI System Architecture, Fourth Edition
   bool is_64bit = false;
@@ -199,7 +253,10 @@ pci_map_msi_irq(struct pci_func *f)
   if (!res.reserve(nullptr, 0))
     return irq();
 
-  verbose.println("pci: Routing ", *f, " to MSI ", res);
+  if (cpu < 0)
+    cpu = irq_spread_cpu();
+
+  verbose.println("pci: Routing ", *f, " to MSI ", res, " on cpu ", cpu);
 
   u32 cap_entry = pci_conf_read(f, f->msi_capreg);  
 
@@ -218,7 +275,7 @@ pci_map_msi_irq(struct pci_func *f)
   // If we're using an IOMMU, allocate an interrupt redirection entry
   uint64_t iommu_index = 0;
   if (iommu)
-    iommu_index = iommu->allocate_int(res, &cpus[0]);
+    iommu_index = iommu->allocate_int(res, &cpus[cpu]);
 
   // [PCI SA pg 253]
   // Step 4. Assign a dword-aligned memory address to the device's
@@ -228,7 +285,7 @@ pci_map_msi_irq(struct pci_func *f)
   // manual.)
   if (!iommu) {
     // Non-remapped ("compatibility format") interrupts
-    uint64_t dest = cpus[0].hwid.num;
+    uint64_t dest = cpus[cpu].hwid.num;
     pci_conf_write(f, f->msi_capreg + 4*1,
                    (0x0fee << 20) |   // magic constant for northbridge
                    (dest << 12) |     // destination ID
@@ -277,9 +334,69 @@ pci_map_msi_irq(struct pci_func *f)
   // control register.
   pci_conf_write(f, f->msi_capreg, cap_entry | (1 << 16));
 
+  res.set_router(new msi_router(f, iommu_index), cpu);
   return res;
 }
 
+// Number of MSI-X vectors that @f supports, or 0 if it doesn't do MSI-X.
+int
+pci_msix_vectors(struct pci_func *f)
+{
+  if (!f->msix_capreg)
+    return 0;
+  return PCI_MSIX_MCR_TBLSIZE(pci_conf_read(f, f->msix_capreg));
+}
+
+// Route entry @entry of @f's MSI-X table to a fresh IRQ delivered to @cpu.
+// Nothing is delivered until pci_enable_msix() turns MSI-X on for the
+// function, which the driver does after registering its handlers.
+irq
+pci_map_msix_irq(struct pci_func *f, int entry, int cpu)
+{
+  if (entry >= pci_msix_vectors(f))
+    return irq();
+
+  irq res = irq::default_msi();
+  if (!res.reserve(nullptr, 0))
+    return irq();
+
+  verbose.println("pci: Routing ", *f, " MSI-X ", entry, " to ", res,
+                  " on cpu ", cpu);
+
+  u32 tbl = pci_conf_read(f, f->msix_capreg + 4);
+  volatile u32 *ent = (volatile u32*)
+    p2v(f->reg_base[PCI_MSIX_TBL_BIR(tbl)] + PCI_MSIX_TBL_OFFSET(tbl) +
+        entry * PCI_MSIX_ENTRY_SIZE);
+
+  // The entries use the same message address and data formats as MSI (see
+  // pci_map_msi_irq()).
+  uint64_t iommu_index = 0;
+  if (!iommu) {
+    ent[0] = (0x0fee << 20) | (cpus[cpu].hwid.num << 12) | (1 << 3);
+    ent[1] = 0;
+    ent[2] = res.vector;
+  } else {
+    iommu_index = iommu->allocate_int(res, &cpus[cpu]);
+    ent[0] = (0x0fee << 20) |
+             ((iommu_index & 0x7fff) << 5) |
+             ((iommu_index >> 15) << 2) |
+             (1 << 4) | (1 << 3);
+    ent[1] = 0;
+    ent[2] = 0;
+  }
+  ent[3] = 0;   // Unmask the entry
+  res.set_router(new msix_router(ent, iommu_index), cpu);
+  return res;
+}
+
+void
+pci_enable_msix(struct pci_func *f)
+{
+  u32 cap_entry = pci_conf_read(f, f->msix_capreg);
+  pci_conf_write(f, f->msix_capreg,
+                 (cap_entry & ~PCI_MSIX_MCR_MASK) | PCI_MSIX_MCR_ENABLE);
+}
+
 static int
 pci_scan_bus(struct pci_bus *bus)
 {
@@ -7,6 +7,9 @@
 #include "fs.h"
 #include "file.hh"
 #include "cpu.hh"
+#include "kalloc.hh"
+#include "page_info.hh"
+#include "epoll.hh"
 #include "uk/unistd.h"
 #include "uk/fcntl.h"
 
@@ -16,25 +19,65 @@ struct pipe {
   virtual ~pipe() { };
   virtual int write(const char *addr, int n) = 0;
   virtual int read(char *addr, int n) = 0;
+  // Append len bytes of page, starting at off, by reference rather
+  // than by copying them.  Returns how many bytes were taken.
+  virtual int write_page(const sref<page_info> &page, size_t off,
+                         size_t len) = 0;
+  // Move up to n bytes from the pipe to out, handing it pages with
+  // file::write_page (with more while the pipe has more for it).
+  virtual ssize_t splice_to(file *out, size_t n) = 0;
   virtual int close(int writable) = 0;
+  // The end's readiness for epoll.
+  virtual u32 poll(bool writable) = 0;
   NEW_DELETE_OPS(pipe);
+
+  // Each end tells epoll about its events (see epoll.hh).
+  sref<poll_source> rsrc, wsrc;
 };
 
 struct ordered : pipe {
+  // The pipe's contents are a queue of segments, each either a run of
+  // bytes in data or a reference to part of a page (from a page cache
+  // file or another pipe), so splicing a file into a pipe doesn't copy
+  // it.  A page segment shows later writes to that page, as with
+  // Linux's splice.
+  struct segment {
+    sref<page_info> page;       // Null for bytes in data
+    u32 off, len;
+  };
+  enum { PIPE_SEGS = 32 };
+
   struct spinlock lock;
   struct spinlock lock_close;
   struct condvar  empty;
   struct condvar  full;
   std::atomic<bool> readopen;   // read fd is still open
-  int writeopen;  // write fd is still open
+  std::atomic<int> writeopen;   // write fd is still open
   std::atomic<size_t> nread;  // number of bytes read
   std::atomic<size_t> nwrite; // number of bytes written
-  bool nonblock;
+  // Readers waiting on empty and writers waiting on full, so the other
+  // side only takes the condvar when someone is there.  Protected by
+  // lock.
+  int rwaiting, wwaiting;
+  // Whether reads, and writes, fail rather than wait.  The same unless
+  // the pipe is one direction of a socket (see pipesockalloc).
+  bool rnonblock, wnonblock;
+  // Stream offsets of the bytes in data, and the segment queue.
+  // Protected by lock.
+  size_t ring_r, ring_w;
+  size_t seg_head, seg_tail;
+  segment segs[PIPE_SEGS];
   char data[PIPESIZE];
 
+  // A reader wakes waiting writers once this much of the pipe is free,
+  // rather than on every read, so a writer refills it in big chunks.
+  enum { WRITER_WAKE_SPACE = PIPESIZE / 4 };
+
   ordered(int flags)
     : readopen(true), writeopen(1), nread(0), nwrite(0),
-      nonblock(flags & O_NONBLOCK)
+      rwaiting(0), wwaiting(0), rnonblock(flags & O_NONBLOCK),
+      wnonblock(flags & O_NONBLOCK), ring_r(0), ring_w(0), seg_head(0),
+      seg_tail(0)
   {
     lock = spinlock("pipe", LOCKSTAT_PIPE);
     lock_close = spinlock("pipe:close", LOCKSTAT_PIPE);
@@ -45,8 +88,88 @@ struct ordered : pipe {
   };
   NEW_DELETE_OPS(ordered);
 
+  // Copy n bytes into the ring at stream offset off, or out of it.
+  // Either may wrap around the end of data.
+  void copy_in(size_t off, const char *src, size_t n) {
+    size_t pos = off % PIPESIZE;
+    size_t first = std::min(n, PIPESIZE - pos);
+    memmove(data + pos, src, first);
+    memmove(data, src + first, n - first);
+  }
+
+  void copy_out(size_t off, char *dst, size_t n) {
+    size_t pos = off % PIPESIZE;
+    size_t first = std::min(n, PIPESIZE - pos);
+    memmove(dst, data + pos, first);
+    memmove(dst + first, data, n - first);
+  }
+
+  // Whether there's room for more bytes, or for another page segment.
+  // Pages count against PIPESIZE like bytes do.
+  bool has_room(bool page) {
+    if (nwrite - nread >= PIPESIZE)
+      return false;
+    if (seg_tail - seg_head < PIPE_SEGS)
+      return true;
+    return !page && !segs[(seg_tail - 1) % PIPE_SEGS].page;
+  }
+
+  // Wait for has_room(page).  Returns false if the caller should give
+  // up instead.
+  bool wait_room(bool page) {
+    while (!has_room(page)) {
+      if (wnonblock || myproc()->killed)
+        return false;
+      // Readers have a full pipe's worth waiting for them.
+      if (rwaiting)
+        empty.wake_all();
+      scoped_acquire lclose(&lock_close);
+      if (!readopen)
+        return false;
+      wwaiting++;
+      full.sleep(&lock, &lock_close);
+      wwaiting--;
+    }
+    return true;
+  }
+
+  // Wait for the pipe to be non-empty.  Returns 1 once it is, 0 at end
+  // of file, or -1 on error.
+  int wait_data() {
+    while (nread == nwrite) {
+      if (rnonblock || myproc()->killed)
+        return -1;
+      scoped_acquire lclose(&lock_close);
+      if (writeopen == 0)
+        return 0;
+      rwaiting++;
+      empty.sleep(&lock, &lock_close);
+      rwaiting--;
+    }
+    return 1;
+  }
+
+  // Drop n bytes from the front of the head segment.
+  void consume(size_t n) {
+    segment &s = segs[seg_head % PIPE_SEGS];
+    if (!s.page)
+      ring_r += n;
+    s.off += n;
+    s.len -= n;
+    if (!s.len) {
+      s.page.reset();
+      seg_head++;
+    }
+    nread += n;
+  }
+
+  void wake_writers() {
+    if (wwaiting && PIPESIZE - (nwrite - nread) >= WRITER_WAKE_SPACE)
+      full.wake_all();
+  }
+
   virtual int write(const char *addr, int n) override {
-    if (nonblock) {
+    if (wnonblock) {
       for (;;) {
         size_t nr = nread;
         size_t nw = nwrite;
@@ -63,24 +186,52 @@ struct ordered : pipe {
       return -1;
 
     scoped_acquire l(&lock);
-    for(int i = 0; i < n; i++){
-      while(nwrite == nread + PIPESIZE){ 
-        if (nonblock || myproc()->killed)
-          return -1;
-        scoped_acquire lclose(&lock_close);
-        if (!readopen)
-          return -1;
-        full.sleep(&lock, &lock_close);
+    size_t done = 0;
+    while (done < n) {
+      if (!wait_room(false))
+        return done ? (int)done : -1;
+      size_t cc = std::min(n - done, PIPESIZE - (nwrite - nread));
+      copy_in(ring_w, addr + done, cc);
+      ring_w += cc;
+      // Extend the last segment if it's bytes too.
+      if (seg_tail == seg_head || segs[(seg_tail - 1) % PIPE_SEGS].page) {
+        segment &s = segs[seg_tail++ % PIPE_SEGS];
+        s.off = s.len = 0;
       }
-      data[nwrite++ % PIPESIZE] = addr[i];
+      segs[(seg_tail - 1) % PIPE_SEGS].len += cc;
+      nwrite += cc;
+      done += cc;
     }
-    if (n > 0)
+    if (rwaiting)
       empty.wake_all();
+    rsrc->notify(EPOLLIN);
     return n;
   }
 
+  virtual int write_page(const sref<page_info> &page, size_t off,
+                         size_t len) override {
+    if (!readopen)
+      return -1;
+    if (!len)
+      return 0;
+
+    scoped_acquire l(&lock);
+    if (!wait_room(true))
+      return -1;
+    size_t cc = std::min(len, PIPESIZE - (nwrite - nread));
+    segment &s = segs[seg_tail++ % PIPE_SEGS];
+    s.page = page;
+    s.off = off;
+    s.len = cc;
+    nwrite += cc;
+    if (rwaiting)
+      empty.wake_all();
+    rsrc->notify(EPOLLIN);
+    return cc;
+  }
+
   virtual int read(char *addr, int n) override {
-    if (nonblock) {
+    if (rnonblock) {
       for (;;) {
         size_t nr = nread;
         size_t nw = nwrite;
@@ -94,23 +245,81 @@ struct ordered : pipe {
     }
 
     scoped_acquire l(&lock);
-    while(nread == nwrite) {
-      if (nonblock || myproc()->killed)
-        return -1;
-      scoped_acquire lclose(&lock_close);
-      if (writeopen == 0)
-        return 0;
-      empty.sleep(&lock, &lock_close);
+    int r = wait_data();
+    if (r <= 0)
+      return r;
+    size_t cc = 0;
+    while (cc < n && seg_head != seg_tail) {
+      segment &s = segs[seg_head % PIPE_SEGS];
+      size_t k = std::min(n - cc, (size_t)s.len);
+      if (s.page)
+        memmove(addr + cc, (char*)s.page->va() + s.off, k);
+      else
+        copy_out(ring_r, addr + cc, k);
+      consume(k);
+      cc += k;
     }
-    int i;
-    for(i = 0; i < n; i++) { 
-      if(nread == nwrite)
+    wake_writers();
+    wsrc->notify(EPOLLOUT);
+    return cc;
+  }
+
+  virtual ssize_t splice_to(file *out, size_t n) override {
+    size_t done = 0;
+    // Bytes in data go out in a page of their own.  kalloc may sleep,
+    // so get one before taking the lock if the last piece needed it.
+    sref<page_info> bounce;
+    bool need_bounce = false;
+    while (done < n) {
+      if (need_bounce && !bounce) {
+        char *p = kalloc("pipe splice");
+        if (!p)
+          return done ? (ssize_t)done : -1;
+        bounce = sref<page_info>::transfer(new(page_info::of(p)) page_info());
+      }
+
+      sref<page_info> page;
+      size_t off = 0, len;
+      bool more;
+      {
+        scoped_acquire l(&lock);
+        if (done == 0) {
+          int r = wait_data();
+          if (r <= 0)
+            return r;
+        } else if (nread == nwrite) {
+          break;
+        }
+        segment &s = segs[seg_head % PIPE_SEGS];
+        len = std::min(n - done, (size_t)s.len);
+        if (s.page) {
+          page = s.page;
+          off = s.off;
+        } else if (!bounce) {
+          need_bounce = true;
+          continue;
+        } else {
+          len = std::min(len, (size_t)PGSIZE);
+          copy_out(ring_r, (char*)bounce->va(), len);
+          // out may keep a reference to it, so don't reuse it.
+          page = std::move(bounce);
+        }
+        consume(len);
+        more = done + len < n && nread != nwrite;
+        wake_writers();
+        wsrc->notify(EPOLLOUT);
+      }
+
+      // Whatever out doesn't take of this piece is lost, as it would be
+      // if we'd read it and failed to write it.
+      ssize_t r = out->write_page(page, off, len, more);
+      if (r <= 0)
+        return done ? (ssize_t)done : -1;
+      done += r;
+      if ((size_t)r < len)
         break;
-      addr[i] = data[nread++ % PIPESIZE];
     }
-    if (i > 0)
-      full.wake_all();
-    return i;
+    return done;
   }
 
   virtual int close(int writable) override {
@@ -119,6 +328,7 @@ struct ordered : pipe {
       writeopen = 0;
     } else {
       readopen = 0;
+      full.wake_all();
     }
     empty.wake_all();
     if(readopen == 0 && writeopen == 0){
@@ -126,8 +336,273 @@ struct ordered : pipe {
     }
     return 0;
   }
+
+  virtual u32 poll(bool writable) override {
+    if (writable) {
+      if (!readopen)
+        return EPOLLERR;
+      return nwrite - nread < PIPESIZE ? EPOLLOUT : 0;
+    }
+    u32 mask = 0;
+    if (nread != nwrite)
+      mask |= EPOLLIN;
+    if (!writeopen)
+      mask |= EPOLLHUP;
+    return mask;
+  }
 };
 
+// An unordered pipe keeps a queue of messages per core.  A write adds
+// its data, as messages of up to MSG_MAX bytes, to its core's queue,
+// and a read returns one message, from its own core's queue if it can
+// and otherwise from another core's.  Producers and consumers on
+// different cores don't share cache lines until a queue fills or runs
+// dry, but messages written on different cores may be read in any
+// order.  A read into a buffer shorter than the message gets the start
+// of it and the rest is dropped.  Selected by pipe2's O_ANYORDER.
+struct unordered : pipe {
+  enum { QUEUE_SIZE = 2 * PGSIZE, MSG_MAX = PGSIZE };
+
+  struct queue {
+    struct spinlock lock;
+    // Stream offsets into buf, which holds a u32 length followed by
+    // that many bytes for each message.  Written under lock; read
+    // without it to skip empty queues.
+    std::atomic<size_t> head, tail;
+    char *buf;                  // Allocated by the core's first write
+    __padout__;
+  } __mpalign__;
+
+  queue queues[NCPU];
+
+  // The rest is only for the slow paths.  wait_lock protects sleeping
+  // on and waking empty and full, and the open flags.  It's taken
+  // before a queue's lock, never after.
+  struct spinlock wait_lock __mpalign__;
+  struct condvar empty;
+  struct condvar full;
+  std::atomic<int> rwaiting, wwaiting;
+  std::atomic<bool> readopen, writeopen;
+  bool nonblock;
+
+  unordered(int flags)
+    : queues(), rwaiting(0), wwaiting(0), readopen(true), writeopen(true),
+      nonblock(flags & O_NONBLOCK)
+  {
+    for (queue &q : queues)
+      q.lock = spinlock("pipe:queue");
+    wait_lock = spinlock("pipe:wait", LOCKSTAT_PIPE);
+    empty = condvar("pipe:empty");
+    full = condvar("pipe:full");
+  }
+  ~unordered() override {
+    for (queue &q : queues)
+      if (q.buf)
+        kfree(q.buf, QUEUE_SIZE);
+  }
+  NEW_DELETE_OPS(unordered);
+
+  static void copy_in(queue &q, const void *src, size_t n) {
+    size_t pos = q.tail % QUEUE_SIZE;
+    size_t first = std::min(n, QUEUE_SIZE - pos);
+    memmove(q.buf + pos, src, first);
+    memmove(q.buf, (const char*)src + first, n - first);
+    q.tail += n;
+  }
+
+  static void copy_out(queue &q, void *dst, size_t n) {
+    size_t pos = q.head % QUEUE_SIZE;
+    size_t first = std::min(n, QUEUE_SIZE - pos);
+    memmove(dst, q.buf + pos, first);
+    memmove((char*)dst + first, q.buf, n - first);
+    q.head += n;
+  }
+
+  static bool has_room(const queue &q, size_t n) {
+    return q.buf && QUEUE_SIZE - (q.tail - q.head) >= sizeof(u32) + n;
+  }
+
+  // Add a message to this core's queue, or any other with room.
+  bool try_put(const char *addr, size_t n) {
+    int start = myid();
+    queue &mine = queues[start];
+    if (!mine.buf) {
+      char *b = kalloc("pipe:queue", QUEUE_SIZE, start);
+      if (b) {
+        scoped_acquire l(&mine.lock);
+        if (!mine.buf) {
+          mine.buf = b;
+          b = nullptr;
+        }
+      }
+      if (b)
+        kfree(b, QUEUE_SIZE);
+    }
+    for (int i = 0; i < ncpu; i++) {
+      queue &q = queues[(start + i) % ncpu];
+      if (!has_room(q, n))
+        continue;
+      scoped_acquire l(&q.lock);
+      if (!has_room(q, n))
+        continue;
+      u32 len = n;
+      copy_in(q, &len, sizeof(len));
+      copy_in(q, addr, n);
+      return true;
+    }
+    return false;
+  }
+
+  // Take a message from this core's queue, or any other.  Returns its
+  // length (or n, if that's less), or -1 if every queue is empty.
+  int try_get(char *addr, size_t n) {
+    int start = myid();
+    for (int i = 0; i < ncpu; i++) {
+      queue &q = queues[(start + i) % ncpu];
+      if (q.head == q.tail)
+        continue;
+      scoped_acquire l(&q.lock);
+      if (q.head == q.tail)
+        continue;
+      u32 len;
+      copy_out(q, &len, sizeof(len));
+      size_t cc = std::min(n, (size_t)len);
+      copy_out(q, addr, cc);
+      q.head += len - cc;
+      return cc;
+    }
+    return -1;
+  }
+
+  int put(const char *addr, size_t n) {
+    for (;;) {
+      if (try_put(addr, n)) {
+        if (rwaiting) {
+          scoped_acquire w(&wait_lock);
+          empty.wake_all();
+        }
+        rsrc->notify(EPOLLIN);
+        return 0;
+      }
+      if (nonblock || myproc()->killed)
+        return -1;
+      scoped_acquire w(&wait_lock);
+      if (!readopen)
+        return -1;
+      // A reader that empties a queue after this try wakes us.
+      wwaiting++;
+      if (!try_put(addr, n)) {
+        full.sleep(&wait_lock);
+        wwaiting--;
+        continue;
+      }
+      wwaiting--;
+      if (rwaiting)
+        empty.wake_all();
+      rsrc->notify(EPOLLIN);
+      return 0;
+    }
+  }
+
+  virtual int write(const char *addr, int n) override {
+    size_t done = 0;
+    while (done < n) {
+      size_t cc = std::min((size_t)n - done, (size_t)MSG_MAX);
+      if (!readopen || put(addr + done, cc) < 0)
+        return done ? (int)done : -1;
+      done += cc;
+    }
+    return n;
+  }
+
+  virtual int read(char *addr, int n) override {
+    for (;;) {
+      int r = try_get(addr, n);
+      if (r < 0 && !(nonblock || myproc()->killed)) {
+        scoped_acquire w(&wait_lock);
+        // A writer that adds a message after this try wakes us.
+        rwaiting++;
+        r = try_get(addr, n);
+        if (r < 0) {
+          if (!writeopen) {
+            rwaiting--;
+            return 0;
+          }
+          empty.sleep(&wait_lock);
+          rwaiting--;
+          continue;
+        }
+        rwaiting--;
+      }
+      if (r >= 0 && wwaiting) {
+        scoped_acquire w(&wait_lock);
+        full.wake_all();
+      }
+      if (r >= 0)
+        wsrc->notify(EPOLLOUT);
+      return r;
+    }
+  }
+
+  virtual int write_page(const sref<page_info> &page, size_t off,
+                         size_t len) override {
+    return write((const char*)page->va() + off, len);
+  }
+
+  // Moves one message per call.
+  virtual ssize_t splice_to(file *out, size_t n) override {
+    char *p = kalloc("pipe splice");
+    if (!p)
+      return -1;
+    sref<page_info> page =
+      sref<page_info>::transfer(new(page_info::of(p)) page_info());
+    int r = read(p, std::min(n, (size_t)PGSIZE));
+    if (r <= 0)
+      return r;
+    return out->write_page(page, 0, r, false);
+  }
+
+  virtual int close(int writable) override {
+    scoped_acquire w(&wait_lock);
+    if (writable)
+      writeopen = false;
+    else
+      readopen = false;
+    empty.wake_all();
+    full.wake_all();
+    return !readopen && !writeopen;
+  }
+
+  virtual u32 poll(bool writable) override {
+    if (writable) {
+      if (!readopen)
+        return EPOLLERR;
+      for (int i = 0; i < ncpu; i++)
+        if (!queues[i].buf || has_room(queues[i], 0))
+          return EPOLLOUT;
+      return 0;
+    }
+    u32 mask = 0;
+    for (int i = 0; i < ncpu; i++)
+      if (queues[i].head != queues[i].tail)
+        mask |= EPOLLIN;
+    if (!writeopen)
+      mask |= EPOLLHUP;
+    return mask;
+  }
+};
+
+static u32
+pipe_poll_reader(void *arg)
+{
+  return ((struct pipe*)arg)->poll(false);
+}
+
+static u32
+pipe_poll_writer(void *arg)
+{
+  return ((struct pipe*)arg)->poll(true);
+}
 
 int
 pipealloc(sref<file> *f0, sref<file> *f1, int flags)
@@ -135,7 +610,12 @@ pipealloc(sref<file> *f0, sref<file> *f1, int flags)
   struct pipe *p = nullptr;
   auto cleanup = scoped_cleanup([&](){delete p;});
   try {
-    p = new ordered(flags);
+    if (flags & O_ANYORDER)
+      p = new unordered(flags);
+    else
+      p = new ordered(flags);
+    p->rsrc = make_sref<poll_source>(pipe_poll_reader, p);
+    p->wsrc = make_sref<poll_source>(pipe_poll_writer, p);
     *f0 = make_sref<file_pipe_reader>(p);
     *f1 = make_sref<file_pipe_writer>(p);
   } catch (std::bad_alloc &e) {
@@ -145,11 +625,45 @@ pipealloc(sref<file> *f0, sref<file> *f1, int flags)
   return 0;
 }
 
+// One direction of a socket-like byte stream that lives in the kernel,
+// like a loopback TCP connection (see net.cc), rather than a pair of
+// files.  rsrc and wsrc are the sockets' poll sources, so a socket that
+// reads from one such pipe and writes to another can give both the same
+// source.  Each end has its own O_NONBLOCK, since its socket does.
+struct pipe *
+pipesockalloc(const sref<poll_source> &rsrc, const sref<poll_source> &wsrc,
+              int rflags, int wflags)
+{
+  ordered *p;
+  try {
+    p = new ordered(0);
+  } catch (std::bad_alloc &e) {
+    return nullptr;
+  }
+  p->rnonblock = rflags & O_NONBLOCK;
+  p->wnonblock = wflags & O_NONBLOCK;
+  p->rsrc = rsrc;
+  p->wsrc = wsrc;
+  return p;
+}
+
+// Free a pipe from pipesockalloc that was never used.
+void
+pipesockclose(struct pipe *p)
+{
+  delete p;
+}
+
 void
 pipeclose(struct pipe *p, int writable)
 {
+  // Once this end is closed, the other end may free p at any time.
+  sref<poll_source> mine = writable ? p->wsrc : p->rsrc;
+  sref<poll_source> other = writable ? p->rsrc : p->wsrc;
+  mine->detach();
   if (p->close(writable))
     delete p;
+  other->notify(writable ? EPOLLHUP : EPOLLERR);
 }
 
 int
@@ -163,3 +677,28 @@ piperead(struct pipe *p, char *addr, int n)
 {
   return p->read(addr, n);
 }
+
+int
+pipewrite_page(struct pipe *p, const sref<page_info> &page, size_t off,
+               size_t len)
+{
+  return p->write_page(page, off, len);
+}
+
+ssize_t
+pipesplice(struct pipe *p, struct file *out, size_t n)
+{
+  return p->splice_to(out, n);
+}
+
+u32
+pipepoll(struct pipe *p, int writable)
+{
+  return p->poll(writable);
+}
+
+poll_source *
+pipepollsrc(struct pipe *p, int writable)
+{
+  return writable ? p->wsrc.get() : p->rsrc.get();
+}
@@ -9,6 +9,7 @@
 #include "bits.hh"
 #include "kmtrace.hh"
 #include "kalloc.hh"
+#include "vmalloc.hh"
 #include "vm.hh"
 #include "ns.hh"
 #include "work.hh"
@@ -26,6 +27,98 @@ proc::hash(const u32 &p)
 xns<u32, proc*, proc::hash> *xnspid __mpalign__;
 struct proc *bootproc __mpalign__;
 
+// Each core hands out pids from its own queue, so fork on different
+// cores doesn't bounce a shared counter.  An empty queue is refilled
+// with PID_BATCH fresh pids from next_pid_block; the pids of reaped
+// processes go back on the queue of the core that reaps them, oldest
+// first out, to delay reuse.  The queue is only touched by its own core
+// with interrupts off, so it needs no lock.  Consecutive pids hash to
+// different xnspid buckets, so each core's forks also insert into
+// their own part of the pid namespace.
+struct pid_queue
+{
+  u32 pids[PID_CACHE];
+  u32 head, tail;
+};
+DEFINE_PERCPU(pid_queue, pid_queues);
+static std::atomic<u32> next_pid_block __mpalign__ (1);
+
+static u32
+alloc_pid(void)
+{
+  scoped_cli cli;
+  pid_queue *q = pid_queues.get();
+  if (q->head == q->tail) {
+    u32 base = next_pid_block.fetch_add(PID_BATCH);
+    for (u32 i = 0; i < PID_BATCH; i++)
+      q->pids[q->tail++ % PID_CACHE] = base + i;
+  }
+  return q->pids[q->head++ % PID_CACHE];
+}
+
+// Recycle the pid of a process that has been removed from xnspid.  If
+// this core already has plenty of free pids, the pid is simply dropped.
+static void
+free_pid(u32 pid)
+{
+  scoped_cli cli;
+  pid_queue *q = pid_queues.get();
+  if (q->tail - q->head < PID_CACHE)
+    q->pids[q->tail++ % PID_CACHE] = pid;
+}
+
+// Each core also keeps the kernel stacks of the processes it finishes,
+// for its next forks, so that fork/exit churn doesn't go through kalloc
+// or, with KSTACK_DEBUG, through vmalloc's page table updates and TLB
+// shootdowns.  A cached debug stack keeps its mapping and guard pages.
+// Like the pid queue, it's only touched by its own core with interrupts
+// off.
+struct kstack_cache
+{
+  char *stacks[KSTACK_CACHE];
+  u32 count;
+};
+DEFINE_PERCPU(kstack_cache, kstack_caches);
+
+static char *
+alloc_kstack(void)
+{
+  {
+    scoped_cli cli;
+    kstack_cache *c = kstack_caches.get();
+    if (c->count)
+      return c->stacks[--c->count];
+  }
+#if KSTACK_DEBUG
+  // vmalloc the stack to surround it with guard pages so we can
+  // detect stack over/underflows.
+  return (char*) vmalloc<char[]>(KSTACKSIZE).release();
+#else
+  char *s = (char*) kalloc("kstack", KSTACKSIZE);
+  if (!s)
+    throw_bad_alloc();
+  return s;
+#endif
+}
+
+static void
+free_kstack(char *s)
+{
+  {
+    scoped_cli cli;
+    kstack_cache *c = kstack_caches.get();
+    if (c->count < KSTACK_CACHE) {
+      c->stacks[c->count++] = s;
+      return;
+    }
+  }
+#if KSTACK_DEBUG
+  vmalloc_free(s);
+#else
+  kfree(s, KSTACKSIZE);
+#endif
+}
+
 #if MTRACE
 struct kstack_tag kstack_tag[NCPU];
 #endif
@@ -34,11 +127,14 @@ enum { sched_debug = 0 };
 
 proc::proc(int npid) :
   kstack(0), pid(npid), parent(0), tf(0), context(0), killed(0),
-  tsc(0), curcycles(0), cpuid(0), fpu_state(nullptr),
-  cpu_pin(0), oncv(0), cv_wakeup(0),
+  tsc(0), curcycles(0), cputime(0), faults(), child_faults(), cpuid(0),
+  fpu_state(nullptr),
+  cpu_pin(0), oncv(0), cv_wakeup(0), cv_wheel(0),
   futex_lock("proc::futex_lock", LOCKSTAT_PROC),
+  futex_fa(nullptr), futex_queued(false),
   user_fs_(0), unmap_tlbreq_(0), data_cpuid(-1), in_exec_(0), 
-  uaccess_(0), yield_(false),
+  uaccess_(0), yield_(false), sched_class(SCHED_CLASS_NORMAL), slice_ticks(0),
+  enq_tsc(0),
   upath(nullptr), uargv(nullptr),
   exception_inuse(0), magic(PROC_MAGIC), unmapped_hint(0), state_(EMBRYO)
 {
@@ -188,6 +284,10 @@ exit(int status)
 
   // Kernel threads might not have a parent
   if (myproc()->parent != nullptr) {
+    // Our children have all gone to init, so child_faults is final.
+    pagefault_stats_fold(&myproc()->parent->child_faults, myproc()->faults);
+    pagefault_stats_fold(&myproc()->parent->child_faults,
+                         myproc()->child_faults);
     release(&myproc()->parent->lock);
     myproc()->parent->cv->wake_all();
   } else {
@@ -224,7 +324,7 @@ proc::alloc(void)
   char *sp;
   proc* p;
 
-  p = new proc(xnspid->allockey());
+  p = new proc(alloc_pid());
   if (p == nullptr)
     throw_bad_alloc();
 
@@ -238,18 +338,11 @@ proc::alloc(void)
 
   // Allocate kernel stack.
   try {
-#if KSTACK_DEBUG
-    // vmalloc the stack to surround it with guard pages so we can
-    // detect stack over/underflows.
-    p->kstack_vm = vmalloc<char[]>(KSTACKSIZE);
-    p->kstack = p->kstack_vm.get();
-#else
-    if(!(p->kstack = (char*) kalloc("kstack", KSTACKSIZE)))
-      throw_bad_alloc();
-#endif
+    p->kstack = alloc_kstack();
   } catch (...) {
     if (!xnspid->remove(p->pid, &p))
       panic("allocproc: ns_remove");
+    free_pid(p->pid);
     freeproc(p);
     throw;
   }
@@ -366,8 +459,8 @@ procdumpall(void)
     if (strncmp("refcache", p->name, 8) == 0)
       continue;
 
-    cprintf("\n%-3d %-10s %8s %2u  %lu\n",
-            p->pid, name, state, p->cpuid, p->tsc);
+    cprintf("\n%-3d %-10s %8s %2u  %lu  %lu\n",
+            p->pid, name, state, p->cpuid, p->tsc, p->cputime);
     
     if(p->get_state() == SLEEPING){
       getcallerpcs((void*)p->context->rbp, pc, NELEM(pc));
@@ -394,6 +487,7 @@ doclone(clone_flags flags)
   auto proc_cleanup = scoped_cleanup([&np]() {
     if (!xnspid->remove(np->pid, &np))
       panic("fork: ns_remove");
+    free_pid(np->pid);
     freeproc(np);
   });
 
@@ -416,6 +510,7 @@ doclone(clone_flags flags)
   np->tf->rax = 0;
 
   if (flags & CLONE_SHARE_FTABLE) {
+    myproc()->ftable->set_threaded();
     np->ftable = myproc()->ftable;
   } else if (!(flags & CLONE_NO_FTABLE)) {
     np->ftable = myproc()->ftable->copy();
@@ -442,12 +537,14 @@ doclone(clone_flags flags)
 void
 finishproc(struct proc *p, bool removepid)
 {
-  if (removepid && !xnspid->remove(p->pid, &p))
-    panic("finishproc: ns_remove");
-#if !KSTACK_DEBUG
+  if (removepid) {
+    if (!xnspid->remove(p->pid, &p))
+      panic("finishproc: ns_remove");
+    free_pid(p->pid);
+  }
   if (p->kstack)
-    kfree(p->kstack, KSTACKSIZE);
-#endif
+    free_kstack(p->kstack);
+  p->kstack = nullptr;
 
   p->pid = 0;
   p->parent = 0;
@@ -501,6 +598,7 @@ wait(int wpid,  userptr<int> status)
           proc *np = &p;
           if (!xnspid->remove(pid, &np))
             panic("wait: ns_remove");
+          free_pid(pid);
 
           finishproc_work *w = new finishproc_work(&p);
           assert(dwork_push(w, p.run_cpuid_) >= 0);
@@ -543,6 +641,7 @@ threadalloc(void (*fn)(void *), void *arg)
   auto proc_cleanup = scoped_cleanup([&p]() {
     if (!xnspid->remove(p->pid, &p))
       panic("fork: ns_remove");
+    free_pid(p->pid);
     freeproc(p);
   });
 
@@ -555,6 +654,7 @@ threadalloc(void (*fn)(void *), void *arg)
   p->context->r12 = (u64)fn;
   p->context->r13 = (u64)arg;
   p->parent = nullptr;
+  p->sched_class = SCHED_CLASS_KERNEL;
   p->cwd.reset();
 
   proc_cleanup.dismiss();
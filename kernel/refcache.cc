@@ -35,6 +35,8 @@ namespace refcache {
   // incremented.
   static std::atomic<size_t> global_epoch_left __mpalign__;
 
+  std::atomic<int> hurried_cores __mpalign__;
+
   static __padout__ __attribute__((unused));
 }
 
@@ -80,6 +82,7 @@ refcache::cache::evict(struct refcache::cache::way *way,
       obj->review_epoch_ = local_epoch + (local_epoch_is_exact ? 2 : 3);
       obj->dirty_ = false;
       review_.push_back(obj);
+      ++nreview_;
       // If this object has a weak reference, mark it dying.
       if (obj->weak_) {
         weak_referenced *wobj = static_cast<weak_referenced*>(obj);
@@ -113,6 +116,7 @@ refcache::cache::review()
   // may have interrupts enabled, first find the cut-off.
   uint64_t epoch = global_epoch;
   referenced *last_reviewable = nullptr;
+  size_t nreviewable = 0;
   for (referenced &obj : review_) {
     if (REFCACHE_DEBUG) {
       if (!(obj.review_epoch_ <= epoch + 3))
@@ -125,6 +129,7 @@ refcache::cache::review()
     if (obj.review_epoch_ > epoch)
       break;
     last_reviewable = &obj;
+    ++nreviewable;
   }
 
   if (!last_reviewable)
@@ -136,6 +141,7 @@ refcache::cache::review()
     scoped_cli cli;
     reviewable = std::move(review_);
     review_ = reviewable.cut_after(reviewable.iterator_to(last_reviewable));
+    nreview_ -= nreviewable;
   }
 
   // Scan reviewable objects.  Objects will either be deleted,
@@ -178,6 +184,7 @@ refcache::cache::review()
         obj->review_epoch_ = epoch + 2;
         scoped_cli cli;
         review_.push_back(&*obj);
+        ++nreview_;
         ++nrequeued;
       } else {
         // It was zero for the whole round.  Free it.
@@ -185,10 +192,7 @@ refcache::cache::review()
           sdebug.println("refcache: CPU ", myid(), " freeing obj ", &*obj);
         obj->review_epoch_ = 0;
         l.release();
-
-        scoped_acquire rl(&reap_lock_);
-        reap_.push_back(&*obj);
-        reap_cv_.wake_all();
+        reap(&*obj);
       }
     } else {
       // The count is now non-zero and hence clearly unstable.  Drop
@@ -214,6 +218,8 @@ refcache::cache::review()
   //                   " freed ", nfreed, " requeued ", nrequeued,
   //                   " disowned ", ndisowned);
 
+  nreviewed_ += nreviewed;
+  ndirty_zero_ += nrequeued;
   kstats::inc(&kstats::refcache_item_reviewed_count, nreviewed);
   kstats::inc(&kstats::refcache_item_requeued_count, nrequeued);
   kstats::inc(&kstats::refcache_item_disowned_count, ndisowned);
@@ -271,11 +277,48 @@ refcache::cache::flush()
   kstats::inc(&kstats::refcache_item_flushed_count, nflushed);
 }
 
+void
+refcache::cache::reap(referenced *obj)
+{
+  scoped_acquire rl(&reap_lock_);
+  reap_.push_back(obj);
+  reap_cv_.wake_all();
+}
+
+void
+refcache::cache::update_hurry()
+{
+  // Leave at half the threshold, so a list that hovers around it
+  // doesn't update hurried_cores every epoch.
+  bool hurry = hurried_ ? nreview_ > REFCACHE_HURRY_OBJECTS / 2
+                        : nreview_ >= REFCACHE_HURRY_OBJECTS;
+  if (hurry == hurried_)
+    return;
+  hurried_ = hurry;
+  if (hurry) {
+    kstats::inc(&kstats::refcache_hurry_count);
+    if (hurried_cores++ == 0)
+      timer_wake_tickless();
+  } else {
+    --hurried_cores;
+  }
+}
+
 void
 refcache::cache::tick()
 {
   flush();
   review();
+  update_hurry();
+}
+
+void
+refcache::cache::hurry()
+{
+  if (local_epoch == global_epoch)
+    return;
+  kstats::inc(&kstats::refcache_hurry_flush_count);
+  tick();
 }
 
 void
@@ -308,6 +351,42 @@ refcache::cache::reaper()
   }
 }
 
+void
+refcache::referenced::dec_local()
+{
+  scoped_cli cli;
+  cache *c = &*mycache;
+  if (!weak_) {
+    // Our delta and the global count are the whole count, and while
+    // the object isn't on a review list, nobody else is looking at it.
+    auto way = c->hash_way(this);
+    scoped_acquire l(&lock_);
+    int64_t delta = way->obj == this ? way->delta : 0;
+    if (review_epoch_ == 0 && refcount_ + delta == 1) {
+      if (REFCACHE_DEBUG) {
+        for (int i = 0; i < ncpu; i++)
+          if (i != myid() && mycache[i].hash_way(this)->obj == this)
+            spanic.println("refcache: dec_local of obj ", this,
+                           " cached on CPU ", i);
+      }
+      if (way->obj == this) {
+        auto writer_way = way->seq.write_begin();
+        way->obj = nullptr;
+        way->delta = 0;
+      }
+      {
+        auto writer_global = refcount_seq_.write_begin();
+        refcount_ = 0;
+      }
+      l.release();
+      kstats::inc(&kstats::refcache_local_freed_count);
+      c->reap(this);
+      return;
+    }
+  }
+  dec();
+}
+
 uint64_t
 refcache::referenced::get_consistent()
 {
@@ -336,6 +415,35 @@ retry:
   }
 }
 
+uint64_t
+refcache::referenced::get_approx()
+{
+  scoped_cli cli;
+  for (;;) {
+    auto way = mycache->hash_way(this);
+    auto rway = way->seq.read_begin();
+    auto rglobal = refcount_seq_.read_begin();
+    int64_t count = refcount_ + (way->obj == this ? way->delta : 0);
+    if (rway.need_retry() || rglobal.need_retry())
+      continue;
+    return count < 0 ? 0 : count;
+  }
+}
+
+void
+refcache::print_stats(print_stream *s)
+{
+  s->println("refcache epoch ", global_epoch.load(), ", CACHE_SLOTS ",
+             (int)CACHE_SLOTS, ", hurried cores ", hurried_cores.load());
+  s->println("cpu review-depth reviewed dirty-zeros dirty-zero-% conflicts");
+  for (int i = 0; i < ncpu; i++) {
+    cache *c = &mycache[i];
+    s->println(i, " ", c->nreview_, " ", c->nreviewed_, " ", c->ndirty_zero_,
+               " ", c->nreviewed_ ? c->ndirty_zero_ * 100 / c->nreviewed_ : 0,
+               " ", c->nconflict_);
+  }
+}
+
 #ifdef TEST
 class reftest : public refcache::weak_referenced
 {
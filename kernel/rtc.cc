@@ -83,6 +83,7 @@ initrtc(void)
   uint64_t nsectime_now = nsectime();
 
   rtc_nsec0 = rtc_now * 1000000000ull - nsectime_now;
+  timepage_update(rtc_nsec0);
 }
 
 //SYSCALL
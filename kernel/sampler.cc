@@ -15,6 +15,7 @@
 #include "percpu.hh"
 #include "kstream.hh"
 #include "cpuid.hh"
+#include "ipi.hh"
 
 #include <algorithm>
 
@@ -66,6 +67,10 @@ public:
   virtual void rearm(uint64_t mask) = 0;
   // Enable all enabled counters
   virtual void resume() = 0;
+  // Count retired kernel instructions and last-level cache misses on
+  // the two counters after the sampler's, for scopedperf regions, or
+  // stop counting them.  Returns false if this PMU can't.
+  virtual bool regions(bool enable) { return false; }
   virtual void dump() { }
 };
 
@@ -227,6 +232,8 @@ class intel_pmu : public pmu
     perf_selector sel[MAX_PMCS];
     // Debug store area for PEBS
     struct ds_area ds_area;
+    // Region counters to enable along with the sampler's
+    uint64_t region_mask;
   };
 
   percpu<struct local> local;
@@ -375,7 +382,32 @@ public:
     }
     if (pebs_mask)
       writemsr(MSR_INTEL_PEBS_ENABLE, pebs_mask);
-    writemsr(MSR_INTEL_PERF_GLOBAL_CTRL, mask);
+    writemsr(MSR_INTEL_PERF_GLOBAL_CTRL, mask | local->region_mask);
+  }
+
+  bool
+  regions(bool enable) override
+  {
+    // INST_RETIRED.ANY and LONGEST_LAT_CACHE.MISS, which are both
+    // architectural events [Intel SDM 3b 18.2.1.2]
+    static const uint64_t events[2] = { 0x00c0, 0x412e };
+    const uint64_t mask = 3ull << MAX_PMCS;
+
+    if (num_pmcs < MAX_PMCS + 2)
+      return false;
+    local->region_mask = 0;
+    writemsr(MSR_INTEL_PERF_GLOBAL_CTRL,
+             readmsr(MSR_INTEL_PERF_GLOBAL_CTRL) & ~mask);
+    // Leave the counts alone; regions only read deltas.
+    for (int i = 0; i < 2; i++)
+      writemsr(MSR_INTEL_PERF_SEL0 + MAX_PMCS + i,
+               enable ? events[i] | PERF_SEL_OS | PERF_SEL_ENABLE : 0);
+    if (enable) {
+      local->region_mask = mask;
+      writemsr(MSR_INTEL_PERF_GLOBAL_CTRL,
+               readmsr(MSR_INTEL_PERF_GLOBAL_CTRL) | mask);
+    }
+    return true;
   }
 
   void
@@ -578,9 +610,16 @@ void
 sampconf(void)
 {
   pushcli();
-  if (selectors[0].period)
+  // Start a new log when the sampler is enabled, and keep it when the
+  // sampler is disabled, so that it can be read.
+  if (selectors[0].enable && (selectors[0].period || selectors[0].offcpu))
     pmulog[myid()].count = 0;
-  pmu->configure(0, selectors[0]);
+  // Off-CPU records go to the same log, and the log isn't safe to
+  // update from both NMIs and regular code, so the PMU stays off.
+  perf_selector sel = selectors[0];
+  if (sel.offcpu)
+    sel.enable = false;
+  pmu->configure(0, sel);
   popcli();
 }
 
@@ -646,6 +685,70 @@ samplog(int pmc, struct trapframe *tf)
   }
 }
 
+//
+// Off-CPU profiling
+//
+
+static bool offcpu_enable;
+
+// Called before a thread sleeps.  Returns the time, or 0 if off-CPU
+// profiling is disabled.
+u64
+offcpu_begin(void)
+{
+  if (!offcpu_enable)
+    return 0;
+  return nsectime();
+}
+
+// Called when the thread is back on a CPU, with the value offcpu_begin
+// returned before it slept.  Records the sleep in the current CPU's
+// log.
+void
+offcpu_end(u64 start)
+{
+  if (!start || !offcpu_enable)
+    return;
+
+  struct pmuevent ev{};
+  uptr pcs[NTRACE + 1];
+  // Our caller is the sleep, which is the leaf; the rest is the chain
+  // that led to it.
+  getcallerpcs(__builtin_frame_address(0), pcs, NELEM(pcs));
+  ev.kernel = 1;
+  ev.offcpu = 1;
+  ev.rip = pcs[0];
+  memmove(ev.trace, pcs + 1, sizeof(ev.trace));
+  u64 us = (nsectime() - start + 999) / 1000;
+  ev.count = MIN(us, (u64)~0u);
+
+  pushcli();
+  if (!pmulog->log(ev))
+    offcpu_enable = false;
+  popcli();
+}
+
+//
+// scopedperf region counters
+//
+
+// Program the region counters on every CPU, or stop them.  Returns
+// false if the PMU doesn't have them.
+bool
+sampregions(bool enable)
+{
+  bitset<NCPU> targets;
+  bool ok = true;
+
+  for (int i = 0; i < ncpu; i++)
+    targets.set(i);
+  run_on_cpus(targets, [&]() {
+      if (!pmu->regions(enable))
+        ok = false;
+    });
+  return ok;
+}
+
 static int
 readlog(char *dst, u32 off, u32 n)
 {
@@ -747,7 +850,13 @@ sampwrite(mdev*, const char *buf, u32 n)
   }
   *static_cast<perf_selector*>(&selectors[0]) = *ps;
   selectors[0].on_overflow = samplog;
+  // Stop recording off-CPU time before the logs are reset, and start
+  // after.
+  if (!ps->enable || !ps->offcpu)
+    offcpu_enable = false;
   sampstart();
+  if (ps->enable && ps->offcpu)
+    offcpu_enable = true;
   return n;
 }
 
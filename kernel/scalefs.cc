@@ -7,23 +7,34 @@
 #include "scalefs.hh"
 #include "kstream.hh"
 #include "major.h"
+#include "crc32c.hh"
+#include "fsstats.hh"
+#include "sperf.hh"
+#include "tracepoint.hh"
+#include "kworker.hh"
 
+// Set through /dev/fsstats to keep the checkpointers from applying
+// transactions until a journal runs out of space, so that a crash leaves
+// the journals filled with committed but unapplied transactions.
+static std::atomic<bool> checkpoints_held;
 
 mfs_interface::mfs_interface()
 {
   for (int cpu = 0; cpu < NCPU; cpu++)
     fs_journal[cpu] = new journal();
 
-  inum_to_mnum = new chainhash<u64, u64>(NINODES_PRIME);
-  mnum_to_inum = new chainhash<u64, u64>(NINODES_PRIME);
-  mnum_to_lock = new chainhash<u64, sleeplock*>(NINODES_PRIME);
-  mnum_to_name = new chainhash<u64, strbuf<DIRSIZ>>(NINODES_PRIME); // Debug
-  metadata_log_htab = new chainhash<u64, mfs_logical_log*>(NINODES_PRIME);
-  blocknum_to_queue = new chainhash<u32, tx_queue_info>(NINODEBITMAP_BLKS_PRIME);
+  // Every CPU falls back to the reserve pool, so queue its waiters.
+  freeblock_bitmap.reserve_freelist.list_lock =
+    spinlock("block reserve", LOCKSTAT_FS, true);
+
+  inum_to_mnum = new linearhash<u64, u64>();
+  mnum_to_inum = new linearhash<u64, u64>();
+  mnum_to_name = new chainhash<u64, fsname>(NINODES_PRIME); // Debug
+  metadata_log_htab = new linearhash<u64, mfs_logical_log*>();
 }
 
 bool
-mfs_interface::mnum_name_insert(u64 mnum, const strbuf<DIRSIZ>& name)
+mfs_interface::mnum_name_insert(u64 mnum, const fsname& name)
 {
 #if DEBUG
   return mnum_to_name->insert(mnum, name);
@@ -33,7 +44,7 @@ mfs_interface::mnum_name_insert(u64 mnum, const strbuf<DIRSIZ>& name)
 }
 
 bool
-mfs_interface::mnum_name_lookup(u64 mnum, strbuf<DIRSIZ> *nameptr)
+mfs_interface::mnum_name_lookup(u64 mnum, fsname *nameptr)
 {
   return mnum_to_name->lookup(mnum, nameptr);
 }
@@ -52,26 +63,17 @@ mfs_interface::mnode_lookup(u64 inum, u64 *mnumptr)
   return sref<mnode>();
 }
 
-void
-mfs_interface::alloc_mnode_lock(u64 mnum)
-{
-  mnum_to_lock->insert(mnum, new sleeplock());
-}
-
-void
-mfs_interface::free_mnode_lock(u64 mnum)
+// Returns mnum's oplog, allocating it if this is the first metadata operation
+// on mnum. Mnodes that are only ever read, such as files loaded from the disk,
+// never get one; an oplog costs several cache lines per CPU.
+mfs_logical_log *
+mfs_interface::metadata_log(u64 mnum)
 {
-  sleeplock *mnode_lock;
-  if (mnum_to_lock->lookup(mnum, &mnode_lock)) {
-    mnum_to_lock->remove(mnum);
-    delete mnode_lock;
-  }
-}
+  mfs_logical_log *mfs_log;
+  if (metadata_log_htab->lookup(mnum, &mfs_log))
+    return mfs_log;
 
-void
-mfs_interface::alloc_metadata_log(u64 mnum)
-{
-  mfs_logical_log *mfs_log = new mfs_logical_log(mnum);
+  mfs_log = new mfs_logical_log(mnum);
 
   for (int cpu = 0; cpu < NCPU; cpu++) {
     // We don't need to acquire the per-cpu link_lock here to initialize the
@@ -80,7 +82,12 @@ mfs_interface::alloc_metadata_log(u64 mnum)
     mfs_log->link_count[cpu] = 0;
   }
 
-  metadata_log_htab->insert(mnum, mfs_log);
+  if (!metadata_log_htab->insert(mnum, mfs_log)) {
+    // Somebody else got there first.
+    delete mfs_log;
+    assert(metadata_log_htab->lookup(mnum, &mfs_log));
+  }
+  return mfs_log;
 }
 
 void
@@ -129,6 +136,68 @@ mfs_interface::load_file_page(u64 mfile_mnum, char *p, size_t pos,
   return readi(i, p, pos, nbytes);
 }
 
+// Reads the file pages [pageidx, pageidx + npages) from the disk, with one
+// scatter-gather read per run of blocks that are contiguous on the same disk.
+// The reads are asynchronous: the caller must wait on the completions added to
+// *dcs before using the pages. Holes are skipped, so the pages must start out
+// zeroed.
+void
+mfs_interface::load_file_pages(u64 mfile_mnum, u64 pageidx, u32 npages,
+                               char **pages,
+                               std::vector<sref<disk_completion>> *dcs)
+{
+  static_assert(PGSIZE == BSIZE, "file pages must map onto disk blocks");
+  scoped_gc_epoch e;
+  sref<inode> ip = get_inode(mfile_mnum, "load_file_pages");
+
+  // Compressed chunks have to be decompressed before the pages can be used,
+  // so they are read right away.
+  if (inode_compressed(ip)) {
+    zread_pages(ip, pageidx, npages, pages);
+    return;
+  }
+
+  // So is the data of an inline file, which is all in page 0.
+  if (inode_inline(ip)) {
+    if (pageidx == 0)
+      readi(ip, pages[0], 0, ip->size);
+    return;
+  }
+
+  std::vector<u32> blocknums;
+  blocknums.reserve(npages);
+  for (u32 i = 0; i < npages; i++)
+    blocknums.push_back(inode_lookup_block(ip, pageidx + i));
+
+  std::vector<kiovec> iov;
+  iov.reserve(npages);
+  for (u32 i = 0; i < npages; ) {
+    u32 first = blocknums[i];
+    if (!first) {
+      i++;
+      continue;
+    }
+
+    u32 dev = blknum_to_dev(first);
+    u32 j = i + 1;
+    while (j < npages && blocknums[j] &&
+           blknum_to_dev(blocknums[j]) == dev &&
+           remap_blknum(blocknums[j]) == remap_blknum(first) + (j - i))
+      j++;
+
+    iov.clear();
+    for (u32 k = i; k < j; k++) {
+      kiovec kiov = { (void *)pages[k], BSIZE };
+      iov.push_back(kiov);
+    }
+
+    auto dc = make_sref<disk_completion>();
+    dcs->push_back(dc);
+    disk_readv(dev, &iov[0], iov.size(), (u64)first * BSIZE, dc);
+    i = j;
+  }
+}
+
 // Reads the on-disk file size.
 u64
 mfs_interface::get_file_size(u64 mfile_mnum)
@@ -138,17 +207,23 @@ mfs_interface::get_file_size(u64 mfile_mnum)
   return i->size;
 }
 
-// Updates the file size on the disk.
+// Updates the file size on the disk. For fdatasync(), the inode is logged only
+// if its size or block map changed; timestamps are not maintained on disk, so
+// there is nothing else that needs to go out with the data.
 void
-mfs_interface::update_file_size(u64 mfile_mnum, u32 size, transaction *tr)
+mfs_interface::update_file_size(u64 mfile_mnum, u32 size, transaction *tr,
+                                bool datasync)
 {
   scoped_gc_epoch e;
   sref<inode> i = get_inode(mfile_mnum, "update_file_size");
+  if (datasync && i->size == size && !i->addrs_dirty)
+    return;
   update_size(i, size, tr);
 }
 
 sref<inode>
-mfs_interface::prepare_sync_file_pages(u64 mfile_mnum, transaction *tr)
+mfs_interface::prepare_sync_file_pages(u64 mfile_mnum, transaction *tr,
+                                       u32 delalloc_blocks)
 {
   scoped_gc_epoch e;
   sref<inode> ip = get_inode(mfile_mnum, "sync_file_page");
@@ -161,9 +236,29 @@ mfs_interface::prepare_sync_file_pages(u64 mfile_mnum, transaction *tr)
   acquire_inodebitmap_locks(inum_list, INODE_BLOCK, tr);
 
   ilock(ip, WRITELOCK);
+  if (delalloc_blocks)
+    inode_reserve_blocks(ip, delalloc_blocks);
   return ip;
 }
 
+// Flushes out the in-memory file pages of a compressed chunk to the disk.
+void
+mfs_interface::sync_file_chunk(sref<inode> ip, u32 chunk, char **pages,
+                               u32 npages, transaction *tr)
+{
+  zwrite_chunk(ip, chunk, pages, npages, tr);
+}
+
+// Stores the n bytes at p, all of a small file's data, in its inode instead of
+// in a block (see iwrite_inline()). Returns 0, or -1 if the file can't keep
+// its data inline and has to be written with sync_file_page().
+int
+mfs_interface::sync_file_inline(sref<inode> ip, const char *p, size_t n)
+{
+  scoped_gc_epoch e;
+  return iwrite_inline(ip, p, n);
+}
+
 // Flushes out the contents of an in-memory file page to the disk.
 int
 mfs_interface::sync_file_page(sref<inode> ip, char *p, size_t pos,
@@ -174,14 +269,21 @@ mfs_interface::sync_file_page(sref<inode> ip, char *p, size_t pos,
   return writei(ip, p, pos, nbytes, tr, true, true, true);
 }
 
+// With wb, the data writes are left in flight for the commit to wait for
+// (see data_writeback).
 void
-mfs_interface::finish_sync_file_pages(sref<inode> ip, transaction *tr)
+mfs_interface::finish_sync_file_pages(sref<inode> ip, transaction *tr,
+                                      sref<data_writeback> wb)
 {
   scoped_gc_epoch e;
 
   // Make sure that there are no pending writes in the block-queue.
-  tr->flush_block_queue();
+  if (wb)
+    tr->flush_block_queue_async(std::move(wb));
+  else
+    tr->flush_block_queue();
   tr->add_dirty_blocks_lazy();
+  inode_release_reserved_blocks(ip);
   iunlock(ip);
 }
 
@@ -201,14 +303,104 @@ mfs_interface::truncate_file(u64 mfile_mnum, u32 offset, transaction *tr)
     m->as_file()->remove_pgtable_mappings(offset);
 }
 
+// Preallocates disk blocks for [offset, offset + len) of a file, without
+// changing its size (see ifallocate()). Returns 0 on success.
+int
+mfs_interface::fallocate_file(u64 mfile_mnum, u64 offset, u64 len,
+                              transaction *tr)
+{
+  scoped_gc_epoch e;
+  sref<inode> ip = get_inode(mfile_mnum, "fallocate_file");
+
+  std::vector<u64> inum_list;
+  inum_list.push_back(ip->inum);
+  acquire_inodebitmap_locks(inum_list, INODE_BLOCK, tr);
+
+  ilock(ip, WRITELOCK);
+  u32 bn = offset / BSIZE;
+  int r = ifallocate(ip, bn, (offset + len + BSIZE - 1) / BSIZE - bn, tr);
+  // The data of an inline file may have been written out to a block.
+  tr->flush_block_queue();
+  iupdate(ip, tr);
+  iunlock(ip);
+  return r;
+}
+
+// Makes the (empty) file dst_mnum a copy of src_mnum that shares its data
+// blocks (see iclone()). Returns 0 on success.
+int
+mfs_interface::clone_file(u64 src_mnum, u64 dst_mnum, transaction *tr)
+{
+  scoped_gc_epoch e;
+  sref<inode> src = get_inode(src_mnum, "clone_file");
+  sref<inode> dst = get_inode(dst_mnum, "clone_file");
+
+  // The journal files' blocks must stay theirs alone.
+  for (int cpu = 0; cpu < NCPU; cpu++)
+    if (src == sv6_journal[cpu] || dst == sv6_journal[cpu])
+      return -1;
+
+  // Holding both inode-block locks until this transaction is queued keeps
+  // the references it takes from being dropped on the disk before they are
+  // taken there (see pre_process_transaction()).
+  std::vector<u64> inum_list;
+  inum_list.push_back(src->inum);
+  inum_list.push_back(dst->inum);
+  acquire_inodebitmap_locks(inum_list, INODE_BLOCK, tr);
+
+  // Lock ordering rule: ilock() inodes in increasing inode number order.
+  if (src->inum < dst->inum) {
+    ilock(src, READLOCK);
+    ilock(dst, WRITELOCK);
+  } else {
+    ilock(dst, WRITELOCK);
+    ilock(src, READLOCK);
+  }
+  int r = iclone(src, dst, tr);
+  iupdate(dst, tr);
+  iunlock(src);
+  iunlock(dst);
+  return r;
+}
+
+// Turns compression on or off for an empty file (see iset_compressed()).
+// Returns 0 on success.
+int
+mfs_interface::set_file_compression(u64 mfile_mnum, bool on, transaction *tr)
+{
+  scoped_gc_epoch e;
+  sref<inode> ip = get_inode(mfile_mnum, "set_file_compression");
+
+  std::vector<u64> inum_list;
+  inum_list.push_back(ip->inum);
+  acquire_inodebitmap_locks(inum_list, INODE_BLOCK, tr);
+
+  ilock(ip, WRITELOCK);
+  int r = iset_compressed(ip, on);
+  if (r == 0)
+    iupdate(ip, tr);
+  iunlock(ip);
+  return r;
+}
+
+// Whether a file's data is stored compressed. Files that aren't on the disk
+// yet aren't.
+bool
+mfs_interface::file_compressed(u64 mfile_mnum)
+{
+  scoped_gc_epoch e;
+  u64 inum;
+  if (!inum_lookup(mfile_mnum, &inum))
+    return false;
+  return inode_compressed(iget(1, inum));
+}
+
 // Returns an inode locked for write, on success.
 sref<inode>
 mfs_interface::alloc_inode_for_mnode(u64 mnum, u8 type)
 {
   sref<inode> ip;
-  sleeplock *mnode_lock;
-  assert(mnum_to_lock->lookup(mnum, &mnode_lock));
-  auto lk = mnode_lock->guard();
+  auto lk = mnode_locks[mnum % NMNODE_LOCKS].guard();
 
   u64 inum;
   if (inum_lookup(mnum, &inum)) {
@@ -414,8 +606,12 @@ mfs_interface::delete_mnum_inode_safe(u64 mnum, transaction *tr,
   // to make sure we absolutely get this right.
   if (mnode_dying) {
     // mnode_dying == true indicates that the mnode has reached onzero().
-    // So it is safe to delete its inode from the disk.
+    // So it is safe to delete its inode from the disk, and to take it off
+    // the orphan list in the same transaction.
     __delete_mnum_inode(mnum, tr);
+    std::vector<u64> none;
+    acquire_inodebitmap_locks(none, SUPER_BLOCK, tr);
+    remove_orphan_inode(inum, tr);
     return;
   }
 
@@ -424,7 +620,13 @@ mfs_interface::delete_mnum_inode_safe(u64 mnum, transaction *tr,
     // It looks like userspace still has open file descriptors referring to
     // this mnode, so it is not safe to delete its on-disk inode just yet.
     // So mark it for deletion and postpone it until this mnode's onzero()
-    // function is invoked.
+    // function is invoked. Until then, the orphan list keeps a crash from
+    // leaking the inode. It is recorded before the mnode is marked, so that
+    // the delete (which needs the superblock's lock too) can't get to the
+    // list first.
+    std::vector<u64> none;
+    acquire_inodebitmap_locks(none, SUPER_BLOCK, tr);
+    add_orphan_inode(inum, tr);
     m->mark_inode_for_deletion();
   } else {
     // The mnode is gone (which also implies that all its open file
@@ -463,21 +665,90 @@ mfs_interface::__delete_mnum_inode(u64 mnum, transaction *tr)
   free_inode(ip, tr);
 }
 
-// Initializes the mdir the first time it is referred to. Populates directory
-// entries from the disk.
+bool
+mfs_interface::has_deleted_inodes(int cpu)
+{
+  auto l = delete_inums[cpu].lock.guard();
+  return !delete_inums[cpu].mnum_list.empty();
+}
+
+// Deletes the inodes marked for lazy deletion by mnode::onzero() on this
+// core, one transaction each. Called with the core's commitq_insert_lock
+// held.
+void
+mfs_interface::queue_deleted_inodes(int cpu)
+{
+  std::vector<u64> del_mnum_list;
+  {
+    auto l = delete_inums[cpu].lock.guard();
+    del_mnum_list = std::move(delete_inums[cpu].mnum_list);
+  }
+  for (auto &del_mnum : del_mnum_list) {
+    transaction *tr = new transaction();
+    delete_mnum_inode_safe(del_mnum, tr, true, true);
+    add_transaction_to_queue(tr, cpu);
+  }
+}
+
+// Deletes and commits the inodes of the unlinked files that were closed on
+// this core, so that their inodes and blocks can be reused (and their
+// entries in the orphan list go away) without waiting for the next sync.
+// Called by the core's flusher.
+void
+mfs_interface::reclaim_deleted_inodes(int cpu)
+{
+  if (!has_deleted_inodes(cpu))
+    return;
+  {
+    auto commit_insert_guard = fs_journal[cpu]->commitq_insert_lock.guard();
+    queue_deleted_inodes(cpu);
+  }
+  flush_transaction_queue(cpu);
+}
+
+// Wakes this core's flusher to reclaim the inodes queued by mnode::onzero().
+void
+mfs_interface::kick_inode_reclaim(int cpu)
+{
+  auto &f = flushers[cpu];
+  scoped_acquire l(&f.lock);
+  f.kicked = true;
+  f.cv.wake_all();
+}
+
+// Populates the mdir with the directory entries on the disk that haven't
+// been looked up by name already. Called with the mdir's load_lock_ held.
 void
 mfs_interface::initialize_dir(sref<mnode> m)
 {
   scoped_gc_epoch e;
   sref<inode> i = get_inode(m->mnum_, "initialize_dir");
   load_dir(i, m);
+  m->initialized(true);
+}
+
+// Loads the directory entry for name, if there is one on the disk, into the
+// mdir. Called with the mdir's load_lock_ held.
+void
+mfs_interface::load_dir_name(sref<mnode> m, const fsname& name)
+{
+  scoped_gc_epoch e;
+  sref<inode> i = get_inode(m->mnum_, "load_dir_name");
+
+  // dirlookup() reads only the blocks on the way to name if the directory
+  // is indexed.
+  ilock(i, READLOCK);
+  sref<inode> ip = dirlookup(i, name.c_str());
+  iunlock(i);
+
+  if (ip)
+    load_dir_link(i, m, name, ip->inum);
 }
 
 lock_guard<sleeplock>
 mfs_interface::metadata_op_lockguard(u64 mnum, int cpu)
 {
-  mfs_logical_log *mfs_log;
-  assert(metadata_log_htab->lookup(mnum, &mfs_log));
+  mfs_logical_log *mfs_log = metadata_log(mnum);
   return std::move(mfs_log->get_tsc_lock_guard(cpu));
 }
 
@@ -488,16 +759,14 @@ mfs_interface::metadata_op_lockguard(u64 mnum, int cpu)
 void
 mfs_interface::metadata_op_start(u64 mnum, int cpu, u64 tsc_val)
 {
-  mfs_logical_log *mfs_log;
-  assert(metadata_log_htab->lookup(mnum, &mfs_log));
+  mfs_logical_log *mfs_log = metadata_log(mnum);
   mfs_log->update_start_tsc(cpu, tsc_val);
 }
 
 void
 mfs_interface::metadata_op_end(u64 mnum, int cpu, u64 tsc_val)
 {
-  mfs_logical_log *mfs_log;
-  assert(metadata_log_htab->lookup(mnum, &mfs_log));
+  mfs_logical_log *mfs_log = metadata_log(mnum);
   mfs_log->update_end_tsc(cpu, tsc_val);
 }
 
@@ -505,16 +774,14 @@ mfs_interface::metadata_op_end(u64 mnum, int cpu, u64 tsc_val)
 void
 mfs_interface::add_to_metadata_log(u64 mnum, int cpu, mfs_operation *op)
 {
-  mfs_logical_log *mfs_log;
-  assert(metadata_log_htab->lookup(mnum, &mfs_log));
+  mfs_logical_log *mfs_log = metadata_log(mnum);
   mfs_log->add_operation(op, cpu);
 }
 
 void
 mfs_interface::inc_mfslog_linkcount(u64 mnum)
 {
-  mfs_logical_log *mfs_log;
-  assert(metadata_log_htab->lookup(mnum, &mfs_log));
+  mfs_logical_log *mfs_log = metadata_log(mnum);
   int cpu = myid();
   scoped_acquire a(&mfs_log->link_lock[cpu]);
   mfs_log->link_count[cpu]++;
@@ -523,8 +790,7 @@ mfs_interface::inc_mfslog_linkcount(u64 mnum)
 void
 mfs_interface::dec_mfslog_linkcount(u64 mnum)
 {
-  mfs_logical_log *mfs_log;
-  assert(metadata_log_htab->lookup(mnum, &mfs_log));
+  mfs_logical_log *mfs_log = metadata_log(mnum);
   int cpu = myid();
   scoped_acquire a(&mfs_log->link_lock[cpu]);
   mfs_log->link_count[cpu]--;
@@ -534,7 +800,8 @@ u64
 mfs_interface::get_mfslog_linkcount(u64 mnum)
 {
   mfs_logical_log *mfs_log;
-  assert(metadata_log_htab->lookup(mnum, &mfs_log));
+  if (!metadata_log_htab->lookup(mnum, &mfs_log))
+    return 0;
 
   u64 count = 0;
 
@@ -554,73 +821,98 @@ mfs_interface::get_mfslog_linkcount(u64 mnum)
 }
 
 // Applies all metadata operations logged in the logical logs. Called on sync.
+//
+// The mnodes dirtied on each core are processed by that core's metadata
+// syncer, into that core's journal, so that sync scales with the number of
+// cores. Operations on unrelated mnodes are independent, and the ones that
+// are not (links, unlinks and renames across directories) are resolved by
+// process_metadata_log() itself, which is safe to run concurrently, just as
+// it is for concurrent fsync()s. Transactions that end up on different
+// journals but touch the same disk blocks are ordered by the commit code.
 void
 mfs_interface::process_metadata_log_and_flush(int cpu)
 {
-  // Invoke process_metadata_log() on every dirty mnode.
+  // In process_metadata_log(), we make decisions based on the mnode's refcount
+  // (i.e., whether to free the on-disk inode or postpone it until reboot). So
+  // to avoid interference with the refcount, we collect the mnode numbers
+  // here, and not references to the mnodes themselves (which would have
+  // bumped up the refcount inadvertently!).
   std::vector<u64> mnum_list;
-  metadata_log_htab->enumerate([&](const u64 &mnum, mfs_logical_log* &mfs_log)->bool {
+  sync_batch batch;
+  std::vector<u64> own_list;
 
-    sref<mnode> m = root_fs->mget(mnum);
-    if (m && m->is_dirty()) {
-      // In process_metadata_log(), we make decisions based on the mnode's
-      // refcount (i.e., whether to free the on-disk inode or postpone it until
-      // reboot). So to avoid interference with the refcount, we store the mnode
-      // numbers here, and not references to the mnodes themselves (which would
-      // have bumped up the refcount inadvertently!).
+  for (int i = 0; i < NCPU; i++) {
+    std::vector<u64> part;
+    {
+      auto l = dirty_mnums[i].lock.guard();
+      part = std::move(dirty_mnums[i].mnum_list);
+      dirty_mnums[i].mnum_list.clear();
+    }
+    if (part.empty())
+      continue;
+
+    for (auto mnum : part)
       mnum_list.push_back(mnum);
+    if (i == cpu || i >= ncpu) {
+      for (auto mnum : part)
+        own_list.push_back(mnum);
+      continue;
     }
 
-      // We call process_metadata_log() outside enumerate() because it does a
-      // lookup on metadata_log_htab itself, which causes weird interactions.
+    {
+      scoped_acquire l(&batch.lock);
+      batch.remaining++;
+    }
+    auto &s = metadata_syncers[i];
+    scoped_acquire l(&s.lock);
+    s.work.push_back({&batch, std::move(part)});
+    s.cv.wake_all();
+  }
 
-    return false;
-  });
+  // Process our own partition while the other syncers work on theirs.
+  process_dirty_mnums(own_list, cpu);
 
-  for (auto &mnum : mnum_list) {
-    sref<mnode> m = root_fs->mget(mnum);
-    if (m && m->is_dirty())
-      process_metadata_log(get_tsc(), m->mnum_, cpu);
+  {
+    scoped_acquire l(&batch.lock);
+    while (batch.remaining)
+      batch.cv.sleep(&batch.lock);
   }
 
   // Transactions enqueued to the same journal queue (indexed by the cpu number)
-  // are always flushed in the order they are enqueued. Hence the transactions
-  // generated by process_metadata_log() above go to disk first, followed by
-  // those generated by sync_dirty_files_and_dirs().
+  // are always flushed in the order they are enqueued, and the ones on other
+  // journals that touch the same disk blocks are committed first. Hence the
+  // transactions generated by process_metadata_log() above go to disk first,
+  // followed by those generated by sync_dirty_files_and_dirs().
 
   sync_dirty_files_and_dirs(cpu, mnum_list);
 
-  {
-    // Commit all these transactions via our CPU's per-core journal.
-    auto commit_insert_guard = fs_journal[cpu]->commitq_insert_lock.guard();
+  // Keep track of the mnodes that are still dirty (e.g., ones that were
+  // dirtied again while we were syncing them), for the next sync.
+  for (auto &mnum : mnum_list) {
+    sref<mnode> m = root_fs->mget(mnum);
+    if (m && m->is_dirty())
+      m->add_to_dirty_list();
+  }
 
-    for (int i = 0; i < NCPU; i++)  {
-      // Delete all the inodes marked for lazy deletion by mnode::onzero()
-      std::vector<u64> del_mnum_list;
-      {
-        auto l = delete_inums[i].lock.guard();
-        del_mnum_list = std::move(delete_inums[i].mnum_list);
-      }
+  for (int i = 0; i < NCPU; i++)  {
+    if (!has_deleted_inodes(i))
+      continue;
 
-      for (auto &del_mnum : del_mnum_list) {
-        transaction *tr = new transaction();
-        delete_mnum_inode_safe(del_mnum, tr, true, true);
-
-	// Note: Queueing dependent transactions on different journals will
-	// cause a deadlock here (because we try to flush each journal
-	// completely before moving onto the next one). We sidestep this
-	// deadlock by committing all these transactions via the same journal
-	// (our per-core journal); that's why the second argument has to be
-	// 'cpu', as opposed to 'i'.
-        add_transaction_to_queue(tr, cpu);
-      }
-    }
+    // Queue these deletes on the journal of the core that marked the inodes
+    // for deletion. Any dependencies on other journals are resolved by the
+    // commit code, which commits the transactions we depend on itself.
+    auto commit_insert_guard = fs_journal[i]->commitq_insert_lock.guard();
+    queue_deleted_inodes(i);
   }
 
   // Commit and apply pending transactions from ALL the per-core queues, not
-  // just the queue we added transactions to above.
-  for (int i = 0; i < NCPU; i++)
+  // just the queue we added transactions to above. Journals that are idle have
+  // nothing for us to wait for.
+  for (int i = 0; i < NCPU; i++) {
+    if (fs_journal[i]->is_idle())
+      continue;
     flush_transaction_queue(i, true);
+  }
 }
 
 void
@@ -632,8 +924,10 @@ mfs_interface::sync_dirty_files_and_dirs(int cpu, std::vector<u64> &mnum_list)
   for (auto &mnum : mnum_list) {
     // Some mnodes might linger for a while even after their oplog entries are
     // processed and removed from the metadata-log hash-table. Be careful not to
-    // try and process them again!
-    if (!metadata_log_htab->lookup(mnum, &mfs_log))
+    // try and process them again! Those have lost their inode as well, whereas
+    // an mnode that only had its pages written may never have had an oplog.
+    u64 inum;
+    if (!metadata_log_htab->lookup(mnum, &mfs_log) && !inum_lookup(mnum, &inum))
       continue;
 
     sref<mnode> m = root_fs->mget(mnum);
@@ -646,6 +940,124 @@ mfs_interface::sync_dirty_files_and_dirs(int cpu, std::vector<u64> &mnum_list)
   }
 }
 
+// Invokes process_metadata_log() on every mnode in mnum_list that is still
+// dirty, queueing the resulting transactions on this core's journal.
+void
+mfs_interface::process_dirty_mnums(std::vector<u64> &mnum_list, int cpu)
+{
+  for (auto &mnum : mnum_list) {
+    sref<mnode> m = root_fs->mget(mnum);
+    if (!m)
+      continue;
+
+    // Any mnode that gets dirtied from now on goes on the dirty list again.
+    m->removed_from_dirty_list();
+
+    if (m->is_dirty())
+      process_metadata_log(get_tsc(), m->mnum_, cpu);
+  }
+}
+
+// Waits for a partition of a sync to be handed to this core's metadata
+// syncer, processes it and tells the syncing thread when it is done.
+void
+mfs_interface::process_metadata_sync_work(int cpu)
+{
+  auto &s = metadata_syncers[cpu];
+  sync_work w;
+  {
+    scoped_acquire l(&s.lock);
+    while (s.work.empty())
+      s.cv.sleep(&s.lock);
+    w = std::move(s.work.back());
+    s.work.pop_back();
+  }
+
+  process_dirty_mnums(w.mnum_list, cpu);
+
+  scoped_acquire l(&w.batch->lock);
+  if (--w.batch->remaining == 0)
+    w.batch->cv.wake_all();
+}
+
+// Sleeps until the next round of writeback is due on this core, or until a
+// throttled writer kicks the flushers. Returns true if the metadata logs
+// should be synced in this round too.
+bool
+mfs_interface::wait_for_writeback_work(int cpu)
+{
+  auto &f = flushers[cpu];
+  u64 deadline = nsectime() + SCALEFS_WRITEBACK_INTERVAL_MS * 1000000ull;
+  scoped_acquire l(&f.lock);
+  while (!f.kicked && nsectime() < deadline)
+    f.cv.sleep_to(&f.lock, deadline);
+  f.kicked = false;
+  bool sync = f.sync_metadata;
+  f.sync_metadata = false;
+  return sync;
+}
+
+void
+mfs_interface::wakeup_flushers()
+{
+  for (int cpu = 0; cpu < ncpu; cpu++) {
+    auto &f = flushers[cpu];
+    if (f.kicked)
+      continue;
+    scoped_acquire l(&f.lock);
+    f.kicked = true;
+    f.cv.wake_all();
+  }
+}
+
+// Asks this core's flusher to sync the metadata logs, because the core has
+// logged more than OPLOG_PENDING_BYTES of operations that have not been
+// applied yet. This is called from within oplog with a spinlock held.
+void
+mfs_interface::kick_metadata_sync(int cpu)
+{
+  auto &f = flushers[cpu];
+  scoped_acquire l(&f.lock);
+  f.sync_metadata = true;
+  f.kicked = true;
+  f.cv.wake_all();
+}
+
+// One round of background writeback for the files dirtied on this core: write
+// back the data of the files that have had dirty pages for longer than
+// SCALEFS_DIRTY_EXPIRE_MS, or of all of them once dirty pages take up more
+// than SCALEFS_DIRTY_BACKGROUND_RATIO percent of memory, as one transaction
+// per file, and commit them together. The files stay on the dirty list, since
+// their metadata is left for sync.
+void
+mfs_interface::writeback_dirty_files(int cpu)
+{
+  bool all = pagecache_dirty_exceeds(SCALEFS_DIRTY_BACKGROUND_RATIO);
+  u64 expired = nsectime() - SCALEFS_DIRTY_EXPIRE_MS * 1000000ull;
+
+  std::vector<u64> mnum_list;
+  {
+    auto l = dirty_mnums[cpu].lock.guard();
+    mnum_list = dirty_mnums[cpu].mnum_list;
+  }
+
+  bool wrote = false;
+  for (auto &mnum : mnum_list) {
+    sref<mnode> m = root_fs->mget(mnum);
+    if (!m || m->type() != mnode::types::file || !m->is_initialized())
+      continue;
+
+    u64 dirtied_at = m->as_file()->dirtied_at();
+    if (!dirtied_at || (!all && dirtied_at > expired))
+      continue;
+    if (m->as_file()->writeback(cpu))
+      wrote = true;
+  }
+
+  if (wrote)
+    flush_transaction_queue(cpu);
+}
+
 void
 mfs_interface::evict_bufcache()
 {
@@ -817,6 +1229,114 @@ mfs_interface::apply_rename_pair(std::vector<rename_metadata> &rename_stack,
   mfs_log_src->lock.release();
 }
 
+// Whether op, which is in the oplog of a file rename's destination directory
+// and comes before it, can be applied after the rename instead: it must be a
+// file operation that does not touch the renamed file or the name it was
+// given (newname).
+bool
+mfs_interface::rename_commutes(mfs_operation *op, u64 mnum,
+                               const char *newname)
+{
+  const char *names[2] = { nullptr, nullptr };
+
+  switch (op->operation_type) {
+  case MFS_OP_LINK_FILE:
+    names[0] = static_cast<mfs_operation_link*>(op)->name;
+    break;
+  case MFS_OP_UNLINK_FILE:
+    names[0] = static_cast<mfs_operation_unlink*>(op)->name;
+    break;
+  case MFS_OP_RENAME_LINK_FILE:
+    names[0] = static_cast<mfs_operation_rename_link*>(op)->name;
+    names[1] = static_cast<mfs_operation_rename_link*>(op)->newname;
+    break;
+  case MFS_OP_RENAME_UNLINK_FILE:
+    names[0] = static_cast<mfs_operation_rename_unlink*>(op)->name;
+    names[1] = static_cast<mfs_operation_rename_unlink*>(op)->newname;
+    break;
+  default:
+    // Creates, directory operations and rename barriers.
+    return false;
+  }
+
+  if (file_op_mnum(op) == mnum)
+    return false;
+  for (auto n : names)
+    if (n && strcmp(n, newname) == 0)
+      return false;
+  return true;
+}
+
+// Applies the cross-directory file rename in rm, whose unlink part is at the
+// front of the source directory's oplog, without first applying the earlier
+// operations in the destination directory's oplog. That is safe as long as
+// none of them involves the file or its new name (see rename_commutes()), and
+// saves processing the destination directory, and whatever it depends on, on
+// every sync of a directory that files are moved out of. Returns false if the
+// rename has to be paired up by processing the destination directory after
+// all.
+bool
+mfs_interface::apply_file_rename(const rename_metadata &rm, int cpu)
+{
+  mfs_logical_log *mfs_log_src, *mfs_log_dst;
+  assert(metadata_log_htab->lookup(rm.src_parent_mnum, &mfs_log_src));
+  if (!metadata_log_htab->lookup(rm.dst_parent_mnum, &mfs_log_dst))
+    return false;
+
+  // Same lock ordering as apply_rename_pair().
+  mfs_log_src->lock.acquire();
+  mfs_log_dst->lock.acquire();
+
+  bool ok = true;
+  mfs_operation_rename_link *link_op = nullptr;
+  mfs_operation_rename_unlink *unlink_op = nullptr;
+  {
+    auto src_guard = mfs_log_src->synchronize_upto_tsc(rm.timestamp);
+    auto dst_guard = mfs_log_dst->synchronize_upto_tsc(rm.timestamp);
+    auto &src_vec = mfs_log_src->operation_vec;
+    auto &dst_vec = mfs_log_dst->operation_vec;
+    auto it = dst_vec.begin();
+
+    // A concurrent fsync() might have applied the rename already.
+    if (src_vec.empty() || src_vec.front()->timestamp != rm.timestamp)
+      goto unlock;
+    unlink_op = dynamic_cast<mfs_operation_rename_unlink*>(src_vec.front());
+    assert(unlink_op);
+
+    for (; it != dst_vec.end() && (*it)->timestamp < rm.timestamp; ++it) {
+      if (!rename_commutes(*it, unlink_op->mnode_mnum, unlink_op->newname)) {
+        ok = false;
+        goto unlock;
+      }
+    }
+
+    if (it == dst_vec.end() || (*it)->timestamp != rm.timestamp) {
+      ok = false;
+      goto unlock;
+    }
+    link_op = dynamic_cast<mfs_operation_rename_link*>(*it);
+    assert(link_op);
+
+    dst_vec.erase(it);
+    src_vec.erase(src_vec.begin());
+
+  unlock:
+    ; // release the locks held by src_guard and dst_guard
+  }
+
+  if (link_op) {
+    // Apply both parts within the same transaction, as apply_rename_pair()
+    // does.
+    transaction *tr = new transaction(link_op->timestamp);
+    add_op_to_transaction_queue(link_op, cpu, tr, true);
+    add_op_to_transaction_queue(unlink_op, cpu, tr);
+  }
+
+  mfs_log_dst->lock.release();
+  mfs_log_src->lock.release();
+  return ok;
+}
+
 void
 mfs_interface::add_op_to_transaction_queue(mfs_operation *op, int cpu,
                                            transaction *tr, bool skip_add)
@@ -847,7 +1367,7 @@ mfs_interface::absorb_file_link_unlink(mfs_logical_log *mfs_log,
   std::vector<unsigned long> erase_indices;
   u64 htable_size = mfs_log->operation_vec.size() * 5;
   auto linkname_to_index =
-                   new chainhash<strbuf<DIRSIZ>, unsigned long>(htable_size);
+                   new chainhash<fsname, unsigned long>(htable_size);
 
   for (auto it = mfs_log->operation_vec.begin();
        it != mfs_log->operation_vec.end(); it++) {
@@ -857,7 +1377,7 @@ mfs_interface::absorb_file_link_unlink(mfs_logical_log *mfs_log,
     case MFS_OP_LINK_FILE:
       {
         auto link_op = dynamic_cast<mfs_operation_link*>(*it);
-        strbuf<DIRSIZ> name(link_op->name);
+        fsname name(link_op->name);
         linkname_to_index->insert(name, it - mfs_log->operation_vec.begin());
       }
       break;
@@ -866,7 +1386,7 @@ mfs_interface::absorb_file_link_unlink(mfs_logical_log *mfs_log,
       {
         unsigned long index;
         auto unlink_op = dynamic_cast<mfs_operation_unlink*>(*it);
-        strbuf<DIRSIZ> name(unlink_op->name);
+        fsname name(unlink_op->name);
         if (linkname_to_index->lookup(name, &index)) {
           // Mark these link and unlink ops for absorption.
           erase_indices.push_back(it - mfs_log->operation_vec.begin());
@@ -904,6 +1424,7 @@ out:
   std::sort(erase_indices.begin(), erase_indices.end(),
             std::greater<unsigned long>());
 
+  fsstat_inc(&fsstats::absorbed_ops, erase_indices.size());
   for (auto &idx : erase_indices) {
     mfs_operation *op = mfs_log->operation_vec.at(idx);
     delete op;
@@ -935,6 +1456,7 @@ mfs_interface::absorb_delete_inode(mfs_logical_log *mfs_log, u64 mnum, int cpu,
       mfs_operation *op = mfs_log->operation_vec.front();
       delete op;
       mfs_log->operation_vec.erase(mfs_log->operation_vec.begin());
+      fsstat_inc(&fsstats::absorbed_ops);
 
       // TODO: If this is a directory, its oplog might not be empty. Deal with
       // this case properly.
@@ -956,10 +1478,258 @@ mfs_interface::absorb_delete_inode(mfs_logical_log *mfs_log, u64 mnum, int cpu,
   unlink_mnum_list.push_back(mnum);
 }
 
-// Return values from process_ops_from_oplog():
-// -------------------------------------------
-enum {
-  RET_INVALID = -1,
+// Returns the mnode number of the file that op links, unlinks or renames, or 0
+// if op isn't one of those.
+u64
+mfs_interface::file_op_mnum(mfs_operation *op)
+{
+  switch (op->operation_type) {
+  case MFS_OP_LINK_FILE:
+    return static_cast<mfs_operation_link*>(op)->mnode_mnum;
+  case MFS_OP_UNLINK_FILE:
+    return static_cast<mfs_operation_unlink*>(op)->mnode_mnum;
+  case MFS_OP_RENAME_LINK_FILE:
+    return static_cast<mfs_operation_rename_link*>(op)->mnode_mnum;
+  case MFS_OP_RENAME_UNLINK_FILE:
+    return static_cast<mfs_operation_rename_unlink*>(op)->mnode_mnum;
+  default:
+    return 0;
+  }
+}
+
+// Absorbs the files referred to by the operations in mnum's oplog that were
+// created and unlinked again since they were last flushed (see
+// absorb_transient_file()). absorb_file_link_unlink() only catches the case
+// where the link and unlink are in the same oplog; this also catches files
+// that were renamed in between, into other directories, such as temporary
+// files that get renamed into place and then deleted.
+void
+mfs_interface::absorb_transient_files(u64 mnum, u64 max_tsc,
+                                      std::vector<u64> &unlink_mnum_list)
+{
+  if (mnode::type_of(mnum) != mnode::types::dir)
+    return;
+
+  mfs_logical_log *mfs_log;
+  if (!metadata_log_htab->lookup(mnum, &mfs_log))
+    return;
+
+  std::vector<u64> candidates;
+  {
+    auto l = mfs_log->lock.guard();
+    auto guard = mfs_log->synchronize_upto_tsc(max_tsc);
+    for (auto &op : mfs_log->operation_vec) {
+      u64 fmnum = file_op_mnum(op);
+      if (fmnum && std::find(candidates.begin(), candidates.end(), fmnum) ==
+                   candidates.end())
+        candidates.push_back(fmnum);
+    }
+  }
+
+  for (auto &fmnum : candidates) {
+    // The file's 'create' has been flushed if it has an inode on the disk.
+    u64 inum;
+    if (inum_lookup(fmnum, &inum))
+      continue;
+    if (absorb_transient_file(fmnum, max_tsc))
+      unlink_mnum_list.push_back(fmnum);
+  }
+}
+
+// If the file mnum was created since the last flush and its only name has
+// been unlinked again, possibly after a series of renames, drop all of its
+// operations from all the oplogs they are in, so that the file never reaches
+// the disk. The oplogs involved are locked together; if any of them is busy,
+// the file is left for regular processing. Returns whether it was absorbed.
+bool
+mfs_interface::absorb_transient_file(u64 mnum, u64 max_tsc)
+{
+  struct chain_op {
+    mfs_logical_log *log;
+    mfs_operation *op;
+  };
+
+  std::vector<u64> log_mnums;
+  log_mnums.push_back(mnum);
+
+  // Each round locks one more directory along the file's history.
+  for (;;) {
+    std::sort(log_mnums.begin(), log_mnums.end());
+
+    std::vector<mfs_logical_log*> logs;
+    bool locked = true;
+    for (auto &m : log_mnums) {
+      mfs_logical_log *mfs_log;
+      if (!metadata_log_htab->lookup(m, &mfs_log) ||
+          !mfs_log->lock.try_acquire()) {
+        locked = false;
+        break;
+      }
+      logs.push_back(mfs_log);
+    }
+
+    auto release = scoped_cleanup([&logs]() {
+      for (auto &mfs_log : logs)
+        mfs_log->lock.release();
+    });
+    if (!locked)
+      return false;
+
+    auto log_of = [&](u64 m) -> mfs_logical_log* {
+      for (size_t i = 0; i < log_mnums.size(); i++)
+        if (log_mnums[i] == m)
+          return logs[i];
+      return nullptr;
+    };
+
+    std::vector<lock_guard<spinlock>> guards;
+    for (auto &mfs_log : logs)
+      guards.push_back(mfs_log->synchronize_upto_tsc(max_tsc));
+
+    // Follow the file's name from its 'create' to its unlink.
+    std::vector<chain_op> chain;
+    auto in_chain = [&chain](mfs_operation *op) {
+      for (auto &c : chain)
+        if (c.op == op)
+          return true;
+      return false;
+    };
+
+    mfs_logical_log *flog = log_of(mnum);
+    if (flog->operation_vec.size() != 1 ||
+        flog->operation_vec.front()->operation_type != MFS_OP_CREATE_FILE)
+      return false;
+    // Any other link to the file would survive the unlink.
+    if (get_mfslog_linkcount(mnum) != 1)
+      return false;
+
+    auto create_op =
+      static_cast<mfs_operation_create*>(flog->operation_vec.front());
+    chain.push_back({flog, create_op});
+
+    u64 dir = create_op->parent_mnum;
+    const char *name = create_op->name;
+    u64 after = create_op->timestamp;
+    bool linked = false;
+    u64 missing = 0;
+
+    while (!missing) {
+      mfs_logical_log *dlog = log_of(dir);
+      if (!dlog) {
+        missing = dir;
+        break;
+      }
+
+      mfs_operation *next = nullptr;
+      for (auto &op : dlog->operation_vec) {
+        if (op->timestamp >= after && file_op_mnum(op) == mnum &&
+            !in_chain(op)) {
+          next = op;
+          break;
+        }
+      }
+      // Either the file is still linked here or the operation has already
+      // been applied.
+      if (!next)
+        return false;
+
+      if (next->operation_type == MFS_OP_LINK_FILE) {
+        auto link_op = static_cast<mfs_operation_link*>(next);
+        if (linked || link_op->timestamp != create_op->timestamp ||
+            strcmp(link_op->name, name))
+          return false;
+        linked = true;
+        chain.push_back({dlog, next});
+        continue;
+      }
+
+      if (!linked)
+        return false;
+
+      if (next->operation_type == MFS_OP_UNLINK_FILE) {
+        if (strcmp(static_cast<mfs_operation_unlink*>(next)->name, name))
+          return false;
+        chain.push_back({dlog, next});
+        break;
+      }
+
+      // A rename away from the file's current name. Both halves carry the
+      // source and destination, and share the timestamp.
+      u64 src, dst;
+      const char *oldname;
+      if (next->operation_type == MFS_OP_RENAME_LINK_FILE) {
+        auto op = static_cast<mfs_operation_rename_link*>(next);
+        src = op->src_parent_mnum;
+        dst = op->dst_parent_mnum;
+        oldname = op->name;
+      } else {
+        auto op = static_cast<mfs_operation_rename_unlink*>(next);
+        src = op->src_parent_mnum;
+        dst = op->dst_parent_mnum;
+        oldname = op->name;
+      }
+      if (src != dir || strcmp(oldname, name))
+        return false;
+
+      mfs_logical_log *dstlog = log_of(dst);
+      if (!dstlog) {
+        missing = dst;
+        break;
+      }
+
+      mfs_operation_rename_link *link_op = nullptr;
+      mfs_operation_rename_unlink *unlink_op = nullptr;
+      for (auto &op : dstlog->operation_vec)
+        if (op->timestamp == next->timestamp &&
+            op->operation_type == MFS_OP_RENAME_LINK_FILE)
+          link_op = static_cast<mfs_operation_rename_link*>(op);
+      for (auto &op : dlog->operation_vec)
+        if (op->timestamp == next->timestamp &&
+            op->operation_type == MFS_OP_RENAME_UNLINK_FILE)
+          unlink_op = static_cast<mfs_operation_rename_unlink*>(op);
+
+      // If the rename replaced another file, the disk has to see it, to get
+      // rid of that file's name.
+      if (!link_op || !unlink_op || link_op->replaced)
+        return false;
+
+      chain.push_back({dstlog, link_op});
+      chain.push_back({dlog, unlink_op});
+      dir = dst;
+      name = link_op->newname;
+      after = link_op->timestamp;
+    }
+
+    if (missing) {
+      log_mnums.push_back(missing);
+      continue;
+    }
+
+    for (auto &c : chain) {
+      auto &vec = c.log->operation_vec;
+      vec.erase(std::find(vec.begin(), vec.end(), c.op));
+      delete c.op;
+    }
+    fsstat_inc(&fsstats::absorbed_ops, chain.size());
+    break;
+  }
+
+  // Account for the absorbed link and unlink, and make sure that the file's
+  // data doesn't go to the disk either.
+  dec_mfslog_linkcount(mnum);
+  sref<mnode> m = root_fs->mget(mnum);
+  if (m) {
+    m->as_file()->discard_dirty_pages();
+    if (m->is_dirty())
+      m->dirty(false);
+  }
+  return true;
+}
+
+// Return values from process_ops_from_oplog():
+// -------------------------------------------
+enum {
+  RET_INVALID = -1,
 
   // All done (processed operations upto max_tsc in the given mfs_log)
   RET_DONE = 0,
@@ -982,6 +1752,11 @@ enum {
 
   // Got a counterpart for a rename sub-operation, which completes the pair.
   RET_RENAME_PAIR,
+
+  // Encountered the unlink part of a cross-directory file rename and pushed
+  // it on the rename stack, to be applied by apply_file_rename() without
+  // processing the destination directory's oplog.
+  RET_RENAME_OUT,
 };
 
 // process_ops_from_oplog():
@@ -990,10 +1765,13 @@ enum {
 // and then processes the first 'count' number of those operations. If count is
 // -1, it processes all of them, but if count is 1, it is treated as a special
 // case instruction to process only the 'create' operation of the mnode.
-// The return values are described above.
+// The return values are described above. A file rename out of this directory
+// with timestamp slow_rename_tsc is paired up the slow way, by processing the
+// destination directory, because apply_file_rename() could not apply it.
 int
 mfs_interface::process_ops_from_oplog(
                     mfs_logical_log *mfs_log, u64 max_tsc, int count, int cpu,
+                    u64 slow_rename_tsc,
                     std::vector<pending_metadata> &pending_stack,
                     std::vector<u64> &unlink_mnum_list,
                     std::vector<dirunlink_metadata> &dirunlink_stack,
@@ -1230,6 +2008,21 @@ mfs_interface::process_ops_from_oplog(
         if (rename_stack.size())
           rename_timestamp = rename_stack.back().timestamp;
 
+        // Moving a file out of this directory need not wait for everything
+        // before it in the destination directory's oplog, which under a
+        // maildir-style workload is mostly other files being moved in. Let
+        // apply_file_rename() try to apply the pair right away.
+        if (rename_unlink_op &&
+            rename_unlink_op->mnode_type == mnode::types::file &&
+            rename_unlink_op->timestamp != slow_rename_tsc &&
+            rename_unlink_op->timestamp != rename_timestamp) {
+          rename_stack.push_back({rename_unlink_op->src_parent_mnum,
+                                  rename_unlink_op->dst_parent_mnum,
+                                  rename_unlink_op->timestamp});
+          retval = RET_RENAME_OUT;
+          goto out;
+        }
+
         if (rename_link_op) {
           rename_stack.push_back({rename_link_op->src_parent_mnum,
                                   rename_link_op->dst_parent_mnum,
@@ -1313,23 +2106,17 @@ mfs_interface::process_metadata_log(u64 max_tsc, u64 mnode_mnum, int cpu)
   std::vector<rename_metadata> rename_stack;
   std::vector<rename_barrier_metadata> rename_barrier_stack;
   std::vector<u64> absorb_mnum_list;
+  u64 slow_rename_tsc = 0;
   int ret;
 
+  kstats::inc(&kstats::metadata_log_count);
+  kstats::timer timer(&kstats::metadata_log_cycles);
+
   auto commit_insert_guard = fs_journal[cpu]->commitq_insert_lock.guard();
 
-  // Delete all the inodes marked for lazy deletion by mnode::onzero()
-  {
-    std::vector<u64> del_mnum_list;
-    {
-      auto l = delete_inums[cpu].lock.guard();
-      del_mnum_list = std::move(delete_inums[cpu].mnum_list);
-    }
-    for (auto &del_mnum : del_mnum_list) {
-      transaction *tr = new transaction();
-      delete_mnum_inode_safe(del_mnum, tr, true, true);
-      add_transaction_to_queue(tr, cpu);
-    }
-  }
+  queue_deleted_inodes(cpu);
+
+  absorb_transient_files(mnode_mnum, max_tsc, unlink_mnum_list);
 
   pending_stack.push_back({mnode_mnum, max_tsc, -1});
 
@@ -1343,7 +2130,8 @@ mfs_interface::process_metadata_log(u64 max_tsc, u64 mnode_mnum, int cpu)
     }
 
     mfs_log->lock.acquire();
-    ret = process_ops_from_oplog(mfs_log, pm.max_tsc, pm.count, cpu, pending_stack,
+    ret = process_ops_from_oplog(mfs_log, pm.max_tsc, pm.count, cpu,
+                                 slow_rename_tsc, pending_stack,
                                  unlink_mnum_list, dirunlink_stack, rename_stack,
                                  rename_barrier_stack, absorb_mnum_list);
     mfs_log->lock.release();
@@ -1382,6 +2170,18 @@ mfs_interface::process_metadata_log(u64 max_tsc, u64 mnode_mnum, int cpu)
       pending_stack.pop_back();
       break;
 
+    // Either way, carry on with the source directory: past the rename if it
+    // was applied, or else up to it again, this time chasing the destination
+    // directory for its counterpart.
+    case RET_RENAME_OUT:
+      {
+        rename_metadata rm = rename_stack.back();
+        rename_stack.pop_back();
+        if (!apply_file_rename(rm, cpu))
+          slow_rename_tsc = rm.timestamp;
+      }
+      continue;
+
     default:
       panic("Got invalid return code from process_ops_from_oplog()");
     }
@@ -1415,7 +2215,6 @@ mfs_interface::process_metadata_log(u64 max_tsc, u64 mnode_mnum, int cpu)
       // So failing this lookup is a reliable indication (in this particular
       // context) that this mnode was deleted already.
       free_metadata_log(mnum);
-      free_mnode_lock(mnum);
     }
   }
 
@@ -1516,30 +2315,26 @@ mfs_interface::add_transaction_to_queue(transaction *tr, int cpu)
   tr->enq_tsc = get_tsc();
   tr->last_group_txn_tsc = tr->enq_tsc;
   tr->txq_id = cpu;
+  fsstat_inc(&fsstats::txns_enqueued);
 
   tx_queue_info my_txq(tr->txq_id, tr->enq_tsc);
 
   for (auto &blknum : tr->inodebitmap_blk_list) {
-    tx_queue_info other_txq;
+    // We hold this block's 2-Phase lock, so no other CPU can be looking at or
+    // updating its last writer concurrently.
+    inodebitmap_block *ib = inodebitmap_blocks.at(blknum);
 
     // Note down the last transaction that modified a common disk block,
     // if it got added to a different queue. (If it went to the same queue
     // that we are going to, the ordering will be automatically preserved).
-    if (blocknum_to_queue->lookup(blknum, &other_txq)) {
-      if (other_txq.id_ != tr->txq_id)
-        tr->dependent_txq.push_back(other_txq);
-
-      blocknum_to_queue->remove(blknum);
-    }
+    if (ib->last_writer.timestamp_ && ib->last_writer.id_ != tr->txq_id)
+      tr->add_dependency(ib->last_writer);
 
-    // The insert has to succeed because we are holding all the relevant
-    // 2-Phase locks; so no other CPU can be inserting to the same blocknum
-    // concurrently.
-    assert(blocknum_to_queue->insert(blknum, my_txq));
+    ib->last_writer = my_txq;
   }
 
-  // Phase 2 of the 2-Phase locking. Updating the blocknum_to_queue hash-table
-  // with this transaction's cpu and timestamp is sufficient to help us preserve
+  // Phase 2 of the 2-Phase locking. Recording this transaction's cpu and
+  // timestamp as the blocks' last writer is sufficient to help us preserve
   // the ordering between dependent transactions across different cores. So it
   // is safe to execute phase 2 and release the locks here.
   release_inodebitmap_locks(tr);
@@ -1576,6 +2371,31 @@ mfs_interface::pre_process_transaction(transaction *tr)
 
   if (!tr->free_block_list.empty())
     bfree_on_disk(tr->free_block_list, tr);
+
+  if (tr->ref_block_list.empty() && tr->unref_block_list.empty())
+    return;
+
+  // Update the refcounts of shared blocks on the disk. Taking the references
+  // first keeps the counts from going below zero in between. The references
+  // dropped here were taken by transactions that have already come through
+  // here, since taking one (clone_file()) holds the inode-block locks of the
+  // files sharing the block until then.
+  std::sort(tr->ref_block_list.begin(), tr->ref_block_list.end());
+  std::sort(tr->unref_block_list.begin(), tr->unref_block_list.end());
+
+  bnum_list.clear();
+  for (auto &b : tr->ref_block_list)
+    bnum_list.push_back(b);
+  for (auto &b : tr->unref_block_list)
+    bnum_list.push_back(b);
+  acquire_inodebitmap_locks(bnum_list, REFCOUNT_BLOCK, tr);
+
+  if (!tr->ref_block_list.empty())
+    block_refs_on_disk(tr->ref_block_list.data(), tr->ref_block_list.size(),
+                       tr, 1);
+  if (!tr->unref_block_list.empty())
+    block_refs_on_disk(tr->unref_block_list.data(),
+                       tr->unref_block_list.size(), tr, -1);
 }
 
 void
@@ -1600,29 +2420,48 @@ mfs_interface::apply_trans_on_disk(transaction *tr)
   // This transaction has been committed to the journal. Writeback the changes
   // to the original locations on the disk.
   tr->write_to_disk_and_flush();
+  fsstat_inc(&fsstats::home_bytes, tr->blocks.size() * BSIZE);
 
   // Update the on-disk journal's skip block to indicate that this transaction
-  // should not be re-applied during crash-recovery.
-  int cpu = tr->txq_id;
-  u32 orig_offset = fs_journal[cpu]->current_offset();
-  fs_journal[cpu]->update_offset(0);
-  write_journal_skip_block(tr->commit_tsc, cpu);
-  fs_journal[cpu]->update_offset(orig_offset);
+  // should not be re-applied during crash-recovery, and that the head of the
+  // log has moved past it.
+  write_journal_skip_block(tr->commit_tsc, tr->jrnl_end_off, tr->txq_id);
 }
 
 void
 mfs_interface::commit_transaction_to_disk(int cpu, transaction *trans)
+{
+  transaction *commit_trans = commit_transaction_to_disk_async(cpu, trans);
+  finish_commit_transaction(cpu, trans, commit_trans);
+}
+
+// Writes the transaction's start block and data blocks to the on-disk journal,
+// and issues its commit block without waiting for the commit block to become
+// durable. Returns the journal transaction that tracks the outstanding flush
+// of the commit block; the caller must hand it to finish_commit_transaction().
+transaction*
+mfs_interface::commit_transaction_to_disk_async(int cpu, transaction *trans)
 {
   ilock(sv6_journal[cpu], WRITELOCK);
 
   // Write the transaction's start block and the data blocks to the on-disk
   // journal.
-  write_journal_transaction_blocks(trans->blocks, trans->commit_tsc,
-                                   trans->disks_written, cpu);
+  write_journal_transaction_blocks(trans, cpu);
 
   // Commit the transaction to the on-disk journal with the given timestamp.
-  write_journal_commit_block(trans->commit_tsc, cpu);
+  transaction *commit_trans = write_journal_commit_block_async(trans, cpu);
   iunlock(sv6_journal[cpu]);
+  return commit_trans;
+}
+
+// Waits for the commit block of the transaction to become durable and then
+// moves the transaction to the apply queue.
+void
+mfs_interface::finish_commit_transaction(int cpu, transaction *trans,
+                                         transaction *commit_trans)
+{
+  commit_trans->wait_for_flush();
+  delete commit_trans;
 
   post_process_transaction(trans);
 
@@ -1630,15 +2469,41 @@ mfs_interface::commit_transaction_to_disk(int cpu, transaction *trans)
   // this particular batch of transactions to get committed.
   u64 latest_commit_tsc = trans->last_group_txn_tsc;
   fs_journal[cpu]->notify_commit(latest_commit_tsc);
+
+  // Move the committed transaction to the apply queue.
+  {
+    auto apply_insert_guard = fs_journal[cpu]->applyq_insert_lock.guard();
+    auto aq_guard = fs_journal[cpu]->tx_apply_queue_lock.guard();
+    fs_journal[cpu]->tx_apply_queue.push_back(trans);
+  }
+
+  // With pipelined commits, applying the transaction to its home location on
+  // the disk is left to the background checkpointer. Otherwise, wake it up
+  // only once the journal fills past the high watermark.
+  if (checkpoints_held)
+    return;
+  if (SCALEFS_PIPELINED_COMMIT ||
+      fs_journal[cpu]->used_space() >
+      fs_journal[cpu]->log_size() / 100 * SCALEFS_CHECKPOINT_WATERMARK)
+    fs_journal[cpu]->kick_apply_worker();
 }
 
 void
 mfs_interface::apply_transaction_to_disk(int cpu, transaction *trans)
 {
+  kstats::inc(&kstats::journal_apply_count);
+  kstats::timer timer(&kstats::journal_apply_cycles);
+  SPERF_REGION(apply);
+
   // Apply all the committed sub-transactions to their final destinations
   // on the disk.
   apply_trans_on_disk(trans);
 
+  // The skip block now records this transaction as applied, so its space in
+  // the journal can be reused.
+  fs_journal[cpu]->release_space(trans->jrnl_end_off, trans->jrnl_nbytes);
+  fs_journal[cpu]->notify_checkpoint();
+
   // Notify transactions (in other journal queues) which were waiting for
   // this particular batch of transactions to get applied to the on-disk
   // filesystem.
@@ -1648,9 +2513,34 @@ mfs_interface::apply_transaction_to_disk(int cpu, transaction *trans)
   delete trans;
 }
 
-void
-mfs_interface::commit_all_transactions(int cpu)
+// Commits all the transactions in the per-core journal's commit queue. In the
+// pipelined mode (SCALEFS_PIPELINED_COMMIT), the journal blocks of the next
+// batch of transactions are written out while the commit block of the previous
+// batch is still being flushed to the disk.
+//
+// A transaction that depends on transactions still sitting in other journals'
+// commit queues cannot be committed until those are. If wait_for_deps is set,
+// we commit the transactions that are ready in those journals ourselves (or
+// wait for whoever is committing them already), so that we never sit waiting
+// for another core to get around to syncing its journal. Otherwise we stop at
+// that transaction, and return false to indicate that the commit queue is not
+// empty yet. Returns true once the commit queue has been drained.
+bool
+mfs_interface::commit_all_transactions(int cpu, bool wait_for_deps)
 {
+  // The previously written batch whose commit block is still in flight, along
+  // with the journal transaction tracking that commit block.
+  transaction *inflight_trans = nullptr, *inflight_commit = nullptr;
+
+  bool drained = false;
+
+  auto finish_inflight = [&]() {
+    if (inflight_trans) {
+      finish_commit_transaction(cpu, inflight_trans, inflight_commit);
+      inflight_trans = inflight_commit = nullptr;
+    }
+  };
+
   for (;;) {
     u64 enq_tsc = 0;
     u64 blocks_size = 0;
@@ -1671,41 +2561,94 @@ mfs_interface::commit_all_transactions(int cpu)
 
       auto cq_guard = fs_journal[cpu]->tx_commit_queue_lock.guard();
 
-      if (fs_journal[cpu]->tx_commit_queue.empty())
-        return;
+      if (fs_journal[cpu]->tx_commit_queue.empty()) {
+        drained = true;
+        break;
+      }
 
       transaction *tr = fs_journal[cpu]->tx_commit_queue.front();
       enq_tsc = tr->enq_tsc;
       for (auto &dep_txn : tr->dependent_txq)
         dependent_txq.push_back(dep_txn);
 
-      tr->deduplicate_blocks();
       blocks_size = tr->blocks.size();
     }
 
-    if (!fits_in_journal(blocks_size, cpu)) {
-      apply_all_transactions(cpu);
+    if (blocks_size > JOURNAL_MAX_TRANS_BLOCKS ||
+        journal_trans_size(blocks_size) > fs_journal[cpu]->log_size()) {
+      cprintf("fits_in_journal failed, blocks-size %lu cpu %d "
+              "journal offset %d limit %lu\n", blocks_size, cpu,
+              fs_journal[cpu]->current_offset(), fs_journal[cpu]->log_size());
+      panic("commit_all_transactions: transaction too large for the journal");
+    }
 
-      if (!fits_in_journal(blocks_size, cpu)) {
-        cprintf("fits_in_journal failed, blocks-size %lu cpu %d "
-                "journal offset %d limit %lu\n", blocks_size, cpu,
-                fs_journal[cpu]->current_offset(), PHYS_JOURNAL_SIZE);
-      }
-      assert(fits_in_journal(blocks_size, cpu));
+    // If the journal is full, leave it to the checkpointer to apply the
+    // committed transactions and make room, instead of doing it ourselves.
+    while (!fits_in_journal(blocks_size, cpu)) {
+      // The in-flight batch must reach the apply queue before its journal
+      // space can be reclaimed.
+      finish_inflight();
+
+      u64 gen = fs_journal[cpu]->get_checkpoint_gen();
+      if (fits_in_journal(blocks_size, cpu))
+        break;
+      fsstat_inc(&fsstats::journal_full);
+      fs_journal[cpu]->kick_apply_worker();
+      fs_journal[cpu]->wait_for_checkpoint(gen);
     }
 
     // Postpone committing this batch of transactions until all the dependent
     // transactions in other queues have been committed to the disk. It is
     // sufficient to look at the first transaction in the batch, since that's
     // the only transaction allowed to have any cross-queue dependencies.
+    // Complete our own in-flight commit first, since the transactions we are
+    // about to wait for might in turn be waiting for it.
+    if (!dependent_txq.empty())
+      finish_inflight();
+
+    bool deps_committed = true;
     for (auto &dep_txn : dependent_txq) {
-      while (fs_journal[dep_txn.id_]->get_committed_tsc() < dep_txn.timestamp_)
-        fs_journal[dep_txn.id_]->wait_for_commit(dep_txn.timestamp_);
+      journal *dep_journal = fs_journal[dep_txn.id_];
+
+      if (wait_for_deps &&
+          dep_journal->get_committed_tsc() < dep_txn.timestamp_)
+        fsstat_inc(&fsstats::commit_dep_waits);
+      while (dep_journal->get_committed_tsc() < dep_txn.timestamp_) {
+        if (!wait_for_deps) {
+          deps_committed = false;
+          break;
+        }
+
+        // Commit what we can from the other journal, unless someone else is
+        // already at it. In that case, wait for them, but retry periodically
+        // since a non-blocking committer may stop short of the transaction
+        // that we need. Dependencies always point to transactions that were
+        // enqueued earlier, so this doesn't deadlock.
+        bool helped = false;
+        {
+          auto dep_journal_guard = dep_journal->journal_lock.try_guard();
+          if (dep_journal_guard) {
+            u64 committed_tsc = dep_journal->get_committed_tsc();
+            commit_all_transactions(dep_txn.id_, false);
+            helped = dep_journal->get_committed_tsc() != committed_tsc;
+          }
+        }
+
+        if (!helped)
+          dep_journal->wait_for_commit(dep_txn.timestamp_,
+                                       nsectime() + 1000000); // 1 ms
+      }
+
+      if (!deps_committed)
+        break;
     }
 
+    if (!deps_committed)
+      break;
+
     transaction *trans = nullptr;
-    auto commit_remove_guard = fs_journal[cpu]->commitq_remove_lock.guard();
     {
+      auto commit_remove_guard = fs_journal[cpu]->commitq_remove_lock.guard();
       auto cq_guard = fs_journal[cpu]->tx_commit_queue_lock.guard();
 
       // The commit-queue should not have shrunk in the meantime, because we
@@ -1723,12 +2666,12 @@ mfs_interface::commit_all_transactions(int cpu)
 
         // This transaction doesn't have cross-queue dependencies, so try to
         // merge it with the other transaction and commit them together.
-        (*it)->deduplicate_blocks();
-        if (!fits_in_journal(trans->blocks.size() + (*it)->blocks.size(), cpu))
+        if (!fits_in_journal(trans->merged_block_count(*it), cpu)) {
+          fsstat_inc(&fsstats::merge_full);
           break;
+        }
 
         trans->add_blocks(std::move((*it)->blocks));
-        trans->deduplicate_blocks();
 
         for (auto d : (*it)->disks_written)
           trans->disks_written.set(d);
@@ -1736,7 +2679,8 @@ mfs_interface::commit_all_transactions(int cpu)
         if (!fits_in_journal(trans->blocks.size(), cpu)) {
           cprintf("fits_in_journal failed, blocks-size %lu cpu %d "
                   "journal offset %d limit %lu\n", trans->blocks.size(), cpu,
-                  fs_journal[cpu]->current_offset(), PHYS_JOURNAL_SIZE);
+                  fs_journal[cpu]->current_offset(),
+                  fs_journal[cpu]->log_size());
         }
         assert(fits_in_journal(trans->blocks.size(), cpu));
 
@@ -1746,22 +2690,43 @@ mfs_interface::commit_all_transactions(int cpu)
         trans->last_group_txn_tsc = (*it)->enq_tsc;
         assert(trans->last_group_txn_tsc > trans->enq_tsc);
 
+        // This waits for its file data writes, which the batch has to wait
+        // for anyway.
         delete *it;
         it = fs_journal[cpu]->tx_commit_queue.erase(it);
+        fsstat_inc(&fsstats::txns_merged);
       }
     }
 
     trans->commit_tsc = get_tsc();
+    fsstat_inc(&fsstats::commits);
+    fsstat_inc(&fsstats::commit_blocks, trans->blocks.size());
 
-    commit_transaction_to_disk(cpu, trans);
-
-    // Move the committed transaction to the apply queue.
-    auto apply_insert_guard = fs_journal[cpu]->applyq_insert_lock.guard();
-    {
-      auto aq_guard = fs_journal[cpu]->tx_apply_queue_lock.guard();
-      fs_journal[cpu]->tx_apply_queue.push_back(trans);
+    if (!SCALEFS_PIPELINED_COMMIT) {
+      commit_transaction_to_disk(cpu, trans);
+      continue;
     }
+
+    // Write out this batch's start block and data blocks while the commit
+    // block of the previous batch is in flight. The previous batch is only
+    // reported as committed once its commit block is durable, and before the
+    // commit block of this batch is written, so that batches are committed
+    // (and notified) in order.
+    ilock(sv6_journal[cpu], WRITELOCK);
+    write_journal_transaction_blocks(trans, cpu);
+    iunlock(sv6_journal[cpu]);
+
+    finish_inflight();
+
+    ilock(sv6_journal[cpu], WRITELOCK);
+    inflight_commit = write_journal_commit_block_async(trans, cpu);
+    iunlock(sv6_journal[cpu]);
+    inflight_trans = trans;
   }
+
+  // Our callers expect everything to be durable by the time we return.
+  finish_inflight();
+  return drained;
 }
 
 void
@@ -1773,14 +2738,14 @@ mfs_interface::apply_all_transactions(int cpu)
 
     // We need to hold the applyq_remove_lock above (even though we are not
     // actually removing transactions from the queue yet), so as to maintain
-    // this invariant: if the apply-queue is empty, the journal's offset should
-    // be zero.
+    // this invariant: if the apply-queue is empty, every transaction committed
+    // to this journal has been applied to the disk.
     // We might observe an empty apply-queue here due to a concurrent thread
     // dequeuing and applying the last transaction in that queue; in that case,
-    // we need to wait for the journal to be cleared by that thread, before
-    // returning. Since the dequeue-apply-clear-journal sequence is performed
-    // with the applyq_remove_lock held, we just need to observe the state of
-    // the apply-queue with the same lock held.
+    // we need to wait for that thread to finish applying it, before returning.
+    // Since the dequeue-apply sequence is performed with the applyq_remove_lock
+    // held, we just need to observe the state of the apply-queue with the same
+    // lock held.
 
     auto apply_guard = fs_journal[cpu]->tx_apply_queue_lock.guard();
     if (fs_journal[cpu]->tx_apply_queue.empty())
@@ -1836,6 +2801,8 @@ mfs_interface::apply_all_transactions(int cpu)
       // If we added any new nested dependencies, process them first.
       if (dependent_txq.size() != txq_size) {
         assert(dependent_txq.size() > txq_size);
+        fsstat_inc(&fsstats::apply_dep_waits,
+                   dependent_txq.size() - txq_size);
         continue;
       }
 
@@ -1855,6 +2822,8 @@ mfs_interface::apply_all_transactions(int cpu)
         tr->last_group_txn_tsc = (*it)->last_group_txn_tsc;
         assert((*it)->commit_tsc > tr->commit_tsc);
         tr->commit_tsc = (*it)->commit_tsc;
+        tr->jrnl_end_off = (*it)->jrnl_end_off;
+        tr->jrnl_nbytes += (*it)->jrnl_nbytes;
         delete *it;
         it = fs_journal[dep_cpu]->tx_apply_queue.erase(it);
       }
@@ -1874,17 +2843,6 @@ mfs_interface::apply_all_transactions(int cpu)
 
     if (fs_journal[dep_cpu]->get_applied_tsc() >= dep_tsc)
       dependent_txq.pop_back();
-
-    // Clear the journal if we emptied the transaction-apply queue.
-    {
-      auto apply_guard = fs_journal[dep_cpu]->tx_apply_queue_lock.guard();
-      if (!fs_journal[dep_cpu]->tx_apply_queue.empty())
-        continue;
-    }
-
-    ilock(sv6_journal[dep_cpu], WRITELOCK);
-    reset_journal(dep_cpu);
-    iunlock(sv6_journal[dep_cpu]);
   }
 }
 
@@ -1892,8 +2850,14 @@ void
 mfs_interface::flush_transaction_queue(int cpu, bool apply_transactions)
 {
   auto journal_guard = fs_journal[cpu]->journal_lock.guard();
+  TRACEPOINT(FS_COMMIT, cpu, apply_transactions);
 
-  commit_all_transactions(cpu);
+  {
+    kstats::inc(&kstats::journal_commit_count);
+    kstats::timer timer(&kstats::journal_commit_cycles);
+    SPERF_REGION(commit);
+    commit_all_transactions(cpu);
+  }
 
   // Apply all the committed transactions from the per-core journal to the
   // filesystem, if explicitly requested by the caller.
@@ -1971,128 +2935,224 @@ print_all_txq_stats()
   rootfs_interface->print_txq_stats();
 }
 
-bool
-mfs_interface::fits_in_journal(size_t num_trans_blocks, int cpu)
+// Number of address blocks needed to hold the block numbers of a transaction's
+// data blocks, beyond the ones that fit in its start block.
+u32
+mfs_interface::journal_addr_blocks(size_t num_trans_blocks)
 {
-  // Estimate the space requirements of this transaction in the journal.
+  if (num_trans_blocks <= JOURNAL_STARTBLK_SLOTS)
+    return 0;
 
-  // Check if we can fit num_trans_blocks disk blocks of the transaction
-  // as well as the start and commit blocks in the journal. (And also an
-  // additional address block if necessary).
+  return (num_trans_blocks - JOURNAL_STARTBLK_SLOTS + JOURNAL_ADDRBLK_SLOTS - 1)
+         / JOURNAL_ADDRBLK_SLOTS;
+}
 
-  u64 trans_size = num_trans_blocks * BSIZE + 2 * sizeof(journal_header_block)
-                   + sizeof(journal_addr_block);
+// Estimate the space requirements of a transaction in the journal.
+u64
+mfs_interface::journal_trans_size(size_t num_trans_blocks)
+{
+  // The num_trans_blocks disk blocks of the transaction as well as the start
+  // and commit blocks. (And also the address blocks, if necessary).
+  return num_trans_blocks * BSIZE + 2 * sizeof(journal_header_block)
+         + journal_addr_blocks(num_trans_blocks) * sizeof(journal_addr_block);
+}
 
-  if (trans_size > PHYS_JOURNAL_SIZE)
-    return false;
+bool
+mfs_interface::fits_in_journal(size_t num_trans_blocks, int cpu)
+{
+  // Check if we can fit the transaction in the free space of the circular log.
+  u64 trans_size = journal_trans_size(num_trans_blocks);
 
-  if (fs_journal[cpu]->current_offset() + trans_size > PHYS_JOURNAL_SIZE)
+  if (num_trans_blocks > JOURNAL_MAX_TRANS_BLOCKS ||
+      trans_size > fs_journal[cpu]->log_size())
     return false;
 
-  return true;
+  return fs_journal[cpu]->has_room(trans_size);
 }
 
 void
-mfs_interface::write_journal(char *buf, size_t size, transaction *tr, int cpu)
+mfs_interface::write_journal(const char *buf, size_t size, transaction *tr,
+                             int cpu)
 {
   u32 offset = fs_journal[cpu]->current_offset();
 
-  // Make sure we are writing BSIZE bytes at BSIZE-aligned offsets, so that
-  // we can skip reading the disk within writei().
+  // The log is written in whole, BSIZE-aligned blocks, straight to the disk
+  // blocks backing the journal file. buf must stay intact until tr is written
+  // out.
   assert(offset % BSIZE == 0 && size == BSIZE);
-  assert(writei(sv6_journal[cpu], buf, offset, size, tr) == size);
+  tr->add_journal_block(fs_journal[cpu]->disk_blocknum(offset), buf);
 
-  offset += size;
-  fs_journal[cpu]->update_offset(offset);
+  fs_journal[cpu]->advance_tail(size);
 }
 
 // Write a transaction's disk blocks to the on-disk journal. The only thing
 // remaining to write to the journal on the disk after this function returns,
-// would be the commit block.
+// would be the commit block. The transaction is laid out contiguously in the
+// log, so the tail wraps around to the start of the log beforehand if needed.
+//
+// The journal blocks are written with Force Unit Access on disks that support
+// it, so that neither they nor the commit block need the disk's whole write
+// cache to be flushed. On other disks they are not flushed here: the commit
+// block carries a checksum of them, so they are flushed together with the
+// commit block instead. Only the blocks that the transaction wrote directly to
+// their home locations (i.e., file data) must be durable before the commit
+// block is written.
 // Caller must hold ilock for write on sv6_journal.
 void
-mfs_interface::write_journal_transaction_blocks(
-    const std::vector<transaction_diskblock*> &datablocks,
-    const u64 timestamp, bitset<NDISK> &disks_written, int cpu)
+mfs_interface::write_journal_transaction_blocks(transaction *trans, int cpu)
 {
+  const auto &datablocks = trans->blocks;
+  const u64 timestamp = trans->commit_tsc;
   journal_header_block hdr_start;
-  journal_addr_block hdr_addr;
   memset(&hdr_start, 0, sizeof(hdr_start));
-  memset(&hdr_addr, 0, sizeof(hdr_addr));
   hdr_start.timestamp = timestamp;
   hdr_start.header_type = JOURNAL_TXN_START;
 
-  // No. of block addresses that can fit in the start and the address blocks.
-  u32 nslots_startblk = sizeof(hdr_start.blocknums) / sizeof(u32);
-  u32 nslots_addrblk = sizeof(hdr_addr.blocknums) / sizeof(u32);
-
-  assert(datablocks.size() <= nslots_startblk + nslots_addrblk);
-
-  int count = 0;
-  for (auto it = datablocks.begin(); it != datablocks.end(); it++, count++) {
-
-    // Fill the addresses in the start block itself, as far as possible, and use
-    // the dedicated address block if it spills over. We won't need more than 1
-    // address block, because our journal size is about 4 MB, which limits the
-    // number of data blocks for any transaction to about 1024 or so (roughly).
-    if (count < nslots_startblk)
-      hdr_start.blocknums[count] = (*it)->blocknum;
-    else
-      hdr_addr.blocknums[count - nslots_startblk] = (*it)->blocknum;
+  assert(datablocks.size() <= JOURNAL_MAX_TRANS_BLOCKS);
+
+  // Fill the addresses in the start block itself, as far as possible, and use
+  // dedicated address blocks for the ones that spill over. The number of
+  // address blocks is bounded by the size of the journal.
+  u32 count = 0;
+  for (auto it = datablocks.begin();
+       it != datablocks.end() && count < JOURNAL_STARTBLK_SLOTS; it++, count++)
+    hdr_start.blocknums[count] = (*it)->blocknum;
+
+  hdr_start.num_addr_blocks = journal_addr_blocks(datablocks.size());
+
+  // The start block, the address block(s), the data blocks and the commit
+  // block.
+  u64 trans_size = (2 + hdr_start.num_addr_blocks + datablocks.size()) * BSIZE;
+  u32 gap = fs_journal[cpu]->begin_append(trans_size);
+  trans->jrnl_end_off = fs_journal[cpu]->current_offset() + trans_size;
+  trans->jrnl_nbytes = gap + trans_size;
+  fsstat_inc(&fsstats::journal_bytes, trans_size);
+
+  // Start flushing the blocks written outside the journal, while we write out
+  // the journal blocks. The file data written in place has to be on the disk
+  // before the flush.
+  trans->wait_for_data_writes();
+  sref<disk_completion> dc_vec[NDISK];
+  for (auto d : trans->disks_written) {
+    dc_vec[d] = make_sref<disk_completion>();
+    disk_flush(d, dc_vec[d]);
   }
 
-  if (datablocks.size() > nslots_startblk)
-    hdr_start.num_addr_blocks = 1;
-
-  // Write out the start block, (the addr block) and the data blocks.
+  // Lay out the start block, the address block(s) and the data blocks, and
+  // write them to the journal with as few disk I/Os as possible.
 
   transaction *jrnl_trans = new transaction();
 
   write_journal((char *)&hdr_start, sizeof(hdr_start), jrnl_trans, cpu);
+  u32 checksum = crc32c(0, (const u8 *)&hdr_start, sizeof(hdr_start));
 
   // Write out the address block(s), if we have any.
+  journal_addr_block *hdr_addrs = nullptr;
   if (hdr_start.num_addr_blocks)
-    write_journal((char *)&hdr_addr, sizeof(hdr_addr), jrnl_trans, cpu);
+    hdr_addrs = (journal_addr_block *)
+      kmalloc(hdr_start.num_addr_blocks * sizeof(journal_addr_block),
+              "journal_addr_blocks");
+
+  for (u32 a = 0; a < hdr_start.num_addr_blocks; a++) {
+    journal_addr_block *hdr_addr = &hdr_addrs[a];
+    memset(hdr_addr, 0, sizeof(*hdr_addr));
+    for (u32 i = 0; i < JOURNAL_ADDRBLK_SLOTS && count < datablocks.size();
+         i++, count++)
+      hdr_addr->blocknums[i] = datablocks[count]->blocknum;
+
+    write_journal((char *)hdr_addr, sizeof(*hdr_addr), jrnl_trans, cpu);
+    checksum = crc32c(checksum, (const u8 *)hdr_addr, sizeof(*hdr_addr));
+  }
+  assert(count == datablocks.size());
 
-  // Write out the data blocks themselves to the in-memory journal.
-  for (auto &b : datablocks)
+  // The data blocks stay pinned until they have been written to the journal.
+  std::vector<lock_guard<sleeplock>> pins;
+  pins.reserve(datablocks.size());
+  for (auto &b : datablocks) {
+    pins.push_back(b->pin());
     write_journal(b->blockdata, BSIZE, jrnl_trans, cpu);
+    checksum = crc32c(checksum, (const u8 *)b->blockdata, BSIZE);
+  }
 
-  // Merge the disks_written obtained from any previous disk writes by the
-  // given transaction.
-  for (auto d : disks_written)
-    jrnl_trans->disks_written.set(d);
+  trans->jrnl_checksum = checksum;
+
+  // Finally, write the transaction's journal blocks to the disk.
+  jrnl_trans->write_to_disk(true);
+  pins.clear();
+  if (hdr_addrs)
+    kmfree(hdr_addrs, hdr_start.num_addr_blocks * sizeof(journal_addr_block));
 
-  // Finally, write the transaction's disk blocks to stable storage (disk).
-  jrnl_trans->write_to_disk_and_flush();
+  for (auto d : trans->disks_written) {
+    dc_vec[d]->wait();
+    dc_vec[d].reset();
+  }
+
+  // From now on, the disks to flush along with the commit block are the ones
+  // holding the journal that can't do FUA writes.
+  trans->disks_written.reset();
+  for (auto d : jrnl_trans->disks_written)
+    trans->disks_written.set(d);
 
   delete jrnl_trans;
 }
 
 // Caller must hold ilock for write on sv6_journal.
 void
-mfs_interface::write_journal_commit_block(u64 timestamp, int cpu)
+mfs_interface::write_journal_commit_block(transaction *trans, int cpu)
 {
-  // The transaction ends with a commit block containing the same timestamp.
-  journal_header_block hdr_commit(timestamp, JOURNAL_TXN_COMMIT);
+  transaction *jrnl_trans = write_journal_commit_block_async(trans, cpu);
+  jrnl_trans->wait_for_flush();
+  delete jrnl_trans;
+}
 
+// Same as write_journal_commit_block(), except that this doesn't wait for the
+// commit block to be flushed to the disk. Returns the journal transaction that
+// the caller must wait_for_flush() on (and then delete).
+// Caller must hold ilock for write on sv6_journal.
+transaction*
+mfs_interface::write_journal_commit_block_async(transaction *trans, int cpu)
+{
   transaction *jrnl_trans = new transaction();
-  write_journal((char *)&hdr_commit, sizeof(hdr_commit), jrnl_trans, cpu);
-  jrnl_trans->write_to_disk_and_flush();
-  delete jrnl_trans;
+
+  // The transaction ends with a commit block containing the same timestamp,
+  // and the checksum of its journal blocks. The commit block is still being
+  // written when we return, so jrnl_trans owns its buffer.
+  journal_header_block *hdr_commit =
+    (journal_header_block *) jrnl_trans->alloc_journal_buf();
+  memset(hdr_commit, 0, sizeof(*hdr_commit));
+  hdr_commit->timestamp = trans->commit_tsc;
+  hdr_commit->header_type = JOURNAL_TXN_COMMIT;
+  hdr_commit->checksum = trans->jrnl_checksum;
+
+  write_journal((char *)hdr_commit, sizeof(*hdr_commit), jrnl_trans, cpu);
+
+  // Write the commit block with FUA, and flush the transaction's journal
+  // blocks on the disks where they weren't written with FUA.
+  for (auto d : trans->disks_written)
+    jrnl_trans->disks_written.set(d);
+  trans->disks_written.reset();
+
+  jrnl_trans->write_to_disk_and_flush_async(true);
+  return jrnl_trans;
 }
 
+// The skip block always lives at the very beginning of the journal. It is
+// written in place, without disturbing the journal's current offset, so that
+// a concurrent fits_in_journal() never observes a bogus offset. Besides the
+// timestamp of the last applied transaction, it records the head of the
+// circular log, where crash-recovery starts looking for transactions.
 // Caller must hold ilock for write on sv6_journal.
 void
-mfs_interface::write_journal_skip_block(u64 timestamp, int cpu,
+mfs_interface::write_journal_skip_block(u64 timestamp, u32 head, int cpu,
                                         bool use_async_io)
 {
-  assert(fs_journal[cpu]->current_offset() == 0);
-
   journal_header_block hdr_skip(timestamp, JOURNAL_TXN_SKIP);
+  memset(hdr_skip.blocknums, 0, sizeof(hdr_skip.blocknums));
+  hdr_skip.blocknums[0] = head;
 
   transaction *jrnl_trans = new transaction();
-  write_journal((char *)&hdr_skip, sizeof(hdr_skip), jrnl_trans, cpu);
+  assert(writei(sv6_journal[cpu], (char *)&hdr_skip, 0, sizeof(hdr_skip),
+                jrnl_trans) == sizeof(hdr_skip));
 
   if (use_async_io)
     jrnl_trans->write_to_disk_and_flush();
@@ -2103,17 +3163,14 @@ mfs_interface::write_journal_skip_block(u64 timestamp, int cpu,
 }
 
 bool
-mfs_interface::get_txn_skip_block(int cpu, u64 *skip_upto_tsc)
+mfs_interface::get_txn_skip_block(int cpu, u64 *skip_upto_tsc, u32 *head)
 {
   static char skipbuf[BSIZE], zerobuf[BSIZE];
   size_t hdr_size = sizeof(journal_header_block);
-  u32 offset = fs_journal[cpu]->current_offset();
 
-  if (readi(sv6_journal[cpu], skipbuf, offset, hdr_size) != hdr_size)
+  if (readi(sv6_journal[cpu], skipbuf, 0, hdr_size) != hdr_size)
     return false;
 
-  fs_journal[cpu]->update_offset(offset + hdr_size);
-
   if (!memcmp((void *)skipbuf, zerobuf, hdr_size))
     return false;
 
@@ -2123,6 +3180,9 @@ mfs_interface::get_txn_skip_block(int cpu, u64 *skip_upto_tsc)
     return false;
 
   *skip_upto_tsc = hdskipptr->timestamp;
+  *head = hdskipptr->blocknums[0];
+  if (*head < journal::LOG_START || *head > fs_journal[cpu]->log_end_offset())
+    *head = journal::LOG_START;
   return true;
 }
 
@@ -2148,32 +3208,68 @@ mfs_interface::get_txn_start_block(int cpu)
 
 bool
 mfs_interface::get_txn_data_blocks(int cpu, journal_header *hdstartptr,
-                                   transaction *trans)
+                                   transaction *trans, u32 *checksum)
 {
   static char databuf[BSIZE];
+  static journal_addr_block addrbuf;
   u32 offset = fs_journal[cpu]->current_offset();
-  int num_blks = sizeof(hdstartptr->blocknums) / sizeof(u32);
-  u32 datablock_offset = hdstartptr->num_addr_blocks ?
-                         offset + sizeof(journal_addr_block) : offset;
+  u32 datablock_offset = offset +
+                         hdstartptr->num_addr_blocks * sizeof(journal_addr_block);
+
+  auto read_addrblock = [&](u32 a) {
+    return readi(sv6_journal[cpu], (char *)&addrbuf,
+                 offset + a * sizeof(journal_addr_block),
+                 sizeof(addrbuf)) == sizeof(addrbuf);
+  };
+
+  auto read_datablock = [&](u32 blocknum) {
+    if (readi(sv6_journal[cpu], databuf, datablock_offset, BSIZE) != BSIZE)
+      return false;
 
-  for (int i = 0; i < num_blks && hdstartptr->blocknums[i]; i++) {
+    datablock_offset += BSIZE;
+    *checksum = crc32c(*checksum, (const u8 *)databuf, BSIZE);
+    trans->add_block(blocknum, databuf);
+    return true;
+  };
 
-    if (readi(sv6_journal[cpu], databuf, datablock_offset, BSIZE) != BSIZE) {
+  // The address blocks precede the data blocks in the checksum.
+  for (u32 a = 0; a < hdstartptr->num_addr_blocks; a++) {
+    if (!read_addrblock(a)) {
       delete trans;
       return false;
     }
+    *checksum = crc32c(*checksum, (const u8 *)&addrbuf, sizeof(addrbuf));
+  }
 
-    datablock_offset += BSIZE;
-    trans->add_block(hdstartptr->blocknums[i], databuf);
+  for (u32 i = 0; i < JOURNAL_STARTBLK_SLOTS && hdstartptr->blocknums[i]; i++) {
+    if (!read_datablock(hdstartptr->blocknums[i])) {
+      delete trans;
+      return false;
+    }
+  }
+
+  // The block numbers that didn't fit in the start block are held in the
+  // address blocks that follow it.
+  for (u32 a = 0; a < hdstartptr->num_addr_blocks; a++) {
+    if (!read_addrblock(a)) {
+      delete trans;
+      return false;
+    }
+
+    for (u32 i = 0; i < JOURNAL_ADDRBLK_SLOTS && addrbuf.blocknums[i]; i++) {
+      if (!read_datablock(addrbuf.blocknums[i])) {
+        delete trans;
+        return false;
+      }
+    }
   }
 
-  assert(!hdstartptr->num_addr_blocks); // TODO: Handle this case later.
   fs_journal[cpu]->update_offset(datablock_offset);
   return true;
 }
 
 bool
-mfs_interface::get_txn_commit_block(int cpu, transaction *trans)
+mfs_interface::get_txn_commit_block(int cpu, transaction *trans, u32 checksum)
 {
   static char commitbuf[BSIZE];
   size_t hdr_size = sizeof(journal_header_block);
@@ -2194,6 +3290,16 @@ mfs_interface::get_txn_commit_block(int cpu, transaction *trans)
     return false;
   }
 
+  // The journal blocks and the commit block are flushed to the disk together,
+  // so a crash can leave behind a commit block without (all of) the blocks
+  // that precede it. Such a transaction is treated as not committed.
+  if (hdcommitptr->checksum != checksum) {
+    cprintf("recover_journal: checksum mismatch in transaction %lu\n",
+            trans->commit_tsc);
+    delete trans;
+    return false;
+  }
+
   return true;
 }
 
@@ -2208,88 +3314,87 @@ mfs_interface::recover_journal(int cpu, std::vector<transaction*> &trans_vec)
   sv6_journal[cpu] = namei(sref<inode>(), jrnl_name);
   assert(sv6_journal[cpu]);
 
-  bool dont_apply;
-  u64 last_tsc = 0, skip_upto_tsc = 0;
+  // mkfs decides how large each of the per-core journals is.
+  fs_journal[cpu]->set_size(sv6_journal[cpu]->size);
+
+  u64 skip_upto_tsc = 0, last_tsc;
+  u32 head = journal::LOG_START;
+  bool wrapped = false;
 
   ilock(sv6_journal[cpu], WRITELOCK);
 
-  if (!get_txn_skip_block(cpu, &skip_upto_tsc))
+  // The log is written directly to the disk blocks backing the journal file
+  // (see write_journal()), which mkfs allocated up front.
+  fs_journal[cpu]->blkmap.clear();
+  fs_journal[cpu]->blkmap.reserve(sv6_journal[cpu]->size / BSIZE);
+  for (u32 bn = 0; bn < sv6_journal[cpu]->size / BSIZE; bn++)
+    fs_journal[cpu]->blkmap.push_back(inode_blocknum(sv6_journal[cpu], bn));
+
+  if (!get_txn_skip_block(cpu, &skip_upto_tsc, &head))
     goto out;
 
-  while (fs_journal[cpu]->current_offset() < PHYS_JOURNAL_SIZE) {
-    dont_apply = false;
+  // Walk the circular log starting at its head. Transactions are logged in
+  // increasing timestamp order, and everything that the skip block doesn't
+  // cover is yet to be applied. So the first header that isn't the start of
+  // a newer transaction marks either the point where the log wrapped around
+  // (the first time around), or the end of the log.
+  last_tsc = skip_upto_tsc;
+  fs_journal[cpu]->update_offset(head);
 
+  for (;;) {
     journal_header *hdstartptr = get_txn_start_block(cpu);
-    if (!hdstartptr || hdstartptr->timestamp < last_tsc)
-      break;
+    if (!hdstartptr || hdstartptr->timestamp <= last_tsc) {
+      if (wrapped)
+        break;
+      wrapped = true;
+      fs_journal[cpu]->update_offset(journal::LOG_START);
+      continue;
+    }
 
     last_tsc = hdstartptr->timestamp;
 
-    if (hdstartptr->timestamp <= skip_upto_tsc)
-      dont_apply = true;
-
     transaction *trans = new transaction(hdstartptr->timestamp);
     trans->commit_tsc = hdstartptr->timestamp;
+    u32 checksum = crc32c(0, (const u8 *)hdstartptr, sizeof(journal_header));
 
-    if (!get_txn_data_blocks(cpu, hdstartptr, trans))
+    if (!get_txn_data_blocks(cpu, hdstartptr, trans, &checksum))
       break;
 
-    if (!get_txn_commit_block(cpu, trans))
+    if (!get_txn_commit_block(cpu, trans, checksum))
       break;
 
     assert(trans);
-
-    if (dont_apply) {
-      cprintf("recover_journal: skipping transaction %lu (skip-upto %lu)\n",
-              trans->commit_tsc, skip_upto_tsc);
-      delete trans;
-    } else {
-      trans_vec.push_back(trans);
-    }
+    trans_vec.push_back(trans);
   }
 
 out:
+  // Recovery is the only reader of the log, so there is no point in keeping
+  // it in the bufcache (which the log writes bypass anyway).
+  drop_bufcache(sv6_journal[cpu]);
   iunlock(sv6_journal[cpu]);
 }
 
 void
 mfs_interface::init_journal(int cpu)
 {
-  fs_journal[cpu]->update_offset(0);
-  write_journal_skip_block(0, cpu, false); // Use synchronous I/O.
+  // Use synchronous I/O.
+  write_journal_skip_block(0, journal::LOG_START, cpu, false);
 
-  journal_header_block hdr_zero;
+  static journal_header_block hdr_zero;
 
   memset((char *)&hdr_zero, 0, sizeof(hdr_zero));
+  fs_journal[cpu]->update_offset(journal::LOG_START);
 
-  while (fs_journal[cpu]->current_offset() < PHYS_JOURNAL_SIZE) {
-
-    transaction *jrnl_trans = new transaction();
+  // Zero the whole log in one go; every block reuses the same zero buffer.
+  transaction *jrnl_trans = new transaction();
+  while (fs_journal[cpu]->current_offset() <
+         fs_journal[cpu]->log_end_offset())
     write_journal((char *)&hdr_zero, sizeof(hdr_zero), jrnl_trans, cpu);
 
-    jrnl_trans->write_to_disk_and_flush_raw();
-    delete jrnl_trans;
-  }
-
-  fs_journal[cpu]->update_offset(sizeof(hdr_zero));
-}
+  jrnl_trans->write_to_disk_and_flush_raw();
+  delete jrnl_trans;
 
-// Reset the journal so that we can start writing to it again, from the
-// beginning. This is called after applying all the transactions committed to
-// this journal. To reset, we simply update the skip block of the journal with
-// the commit_tsc of the last transaction that was applied from this journal.
-// That ensures that we will never re-apply any of the transactions that the
-// journal currently holds, during crash-recovery. On the other hand, any new
-// transaction that gets committed after we finish resetting the journal, will
-// have a higher timestamp than the one recorded in the skip block, and hence
-// those transactions will get applied during crash-recovery.
-//
-// Caller must hold the journal lock and also ilock for write on sv6_journal.
-void
-mfs_interface::reset_journal(int cpu)
-{
-  fs_journal[cpu]->update_offset(0);
-  write_journal_skip_block(fs_journal[cpu]->last_applied_commit_tsc, cpu);
+  fs_journal[cpu]->reset_log();
 }
 
 sref<mnode>
@@ -2330,34 +3435,110 @@ mfs_interface::load_dir_entry(u64 inum, sref<mnode> parent)
 void
 mfs_interface::load_dir(sref<inode> i, sref<mnode> m)
 {
-  dirent de;
-  for (size_t pos = 0; pos < i->size; pos += sizeof(de)) {
-    assert(sizeof(de) == readi(i, (char*) &de, pos, sizeof(de)));
-    if (!de.inum)
-      continue;
+  char *buf = kalloc("load_dir", BSIZE);
+  assert(buf);
+  auto cleanup = scoped_cleanup([buf](){kfree(buf, BSIZE);});
+
+  for (size_t pos = 0; pos < i->size; pos += BSIZE) {
+    int n = readi(i, buf, pos, BSIZE);
+    assert(n > 0);
+
+    const dirent *de;
+    std::vector<u32> inums;
+    for (int off = 0; off + (int)sizeof(*de) <= n; off += de->reclen) {
+      de = (const dirent*) (buf + off);
+      if (!de->reclen)
+        break;
+      if (de->inum)
+        inums.push_back(de->inum);
+    }
+    iprefetch(i->dev, inums);
 
-    sref<mnode> mf = load_dir_entry(de.inum, m);
-    if (!mf)
-      continue;
+    for (int off = 0; off + (int)sizeof(*de) <= n; off += de->reclen) {
+      de = (const dirent*) (buf + off);
+      if (!de->reclen)
+        break;
+      if (!de->inum)
+        continue;
 
-    strbuf<DIRSIZ> name(de.name);
-    // No links are held to the directory itself (via ".")
-    // The root directory is an exception.
-    if (name == "." || (name == ".." && i->inum != 1))
-      continue;
+      fsname name(de->name, de->namelen);
+      // The mdir is already authoritative for the names that were looked up.
+      if (m->as_dir()->probed_.lookup(name))
+        continue;
+      load_dir_link(i, m, name, de->inum);
+    }
+  }
+}
+
+// The inode number and generation of file mnum, which unlike its mnode number
+// identify it across reboots (see kernel/warmlist.cc).
+bool
+mfs_interface::file_identity(u64 mnum, u64 *inum, u32 *gen)
+{
+  scoped_gc_epoch e;
+  if (!inum_lookup(mnum, inum))
+    return false;
+  sref<inode> i = iget(1, *inum);
+  if (i->type.load() != T_FILE)
+    return false;
+  *gen = i->gen;
+  return true;
+}
+
+// The mfile of the file with inode inum, if it is still generation gen,
+// allocating an mnode for it if no directory that links to it has been loaded
+// yet. Such an mnode is pinned in the mnode cache, for load_dir_link() to find
+// once the directory is loaded. Only safe while nothing else is loading
+// directories, i.e., at boot.
+sref<mnode>
+mfs_interface::load_file(u64 inum, u32 gen)
+{
+  scoped_gc_epoch e;
+  struct superblock sb;
+  get_superblock(&sb);
+  if (inum <= 1 || inum >= sb.ninodes)
+    return sref<mnode>();
+
+  u64 mnum;
+  sref<mnode> m = mnode_lookup(inum, &mnum);
+  if (m)
+    return m->type() == mnode::types::file ? m : sref<mnode>();
+
+  sref<inode> i = iget(1, inum);
+  if (i->type.load() != T_FILE || i->gen != gen || i->nlink() <= 0)
+    return sref<mnode>();
+  m = load_dir_entry(inum, sref<mnode>());
+  if (m)
+    m->cache_pin(true);
+  return m;
+}
+
+// Adds the on-disk directory entry (name, inum) of directory i to its mdir m,
+// allocating an mnode for inum if it doesn't have one yet.
+void
+mfs_interface::load_dir_link(sref<inode> i, sref<mnode> m, const fsname& name,
+                             u64 inum)
+{
+  // No links are held to the directory itself (via ".")
+  // The root directory is an exception.
+  if (name == "." || (name == ".." && i->inum != 1))
+    return;
+
+  sref<mnode> mf = load_dir_entry(inum, m);
+  if (!mf)
+    return;
+
+  mlinkref mlink(mf);
+  mlink.acquire();
+  assert(m->as_dir()->load(name, &mlink));
+  mnum_name_insert(mf->mnum_, name);
 
-    mlinkref mlink(mf);
+  // Add a link to the parent directory.
+  if (mf->mnum_ != root_mnum && mf->type() == mnode::types::dir) {
+    fsname parent_name("..");
+    mlinkref mlink(m);
     mlink.acquire();
-    assert(m->as_dir()->insert(name, &mlink));
-    mnum_name_insert(mf->mnum_, name);
-
-    // Add a link to the parent directory.
-    if (mf->mnum_ != root_mnum && mf->type() == mnode::types::dir) {
-      strbuf<DIRSIZ> parent_name("..");
-      mlinkref mlink(m);
-      mlink.acquire();
-      assert(mf->as_dir()->insert(parent_name, &mlink));
-    }
+    assert(mf->as_dir()->load(parent_name, &mlink));
   }
 }
 
@@ -2375,54 +3556,70 @@ mfs_interface::load_root()
   assert(i->type.load() == T_DIR);
   m = mnode_alloc(1, mnode::types::dir);
 
-  strbuf<DIRSIZ> name("/");
+  fsname name("/");
   mnum_name_insert(m->mnum_, name);
   return m;
 }
 
-// Initialize the freeblock_bitmap from the disk when the system boots.
+// Whether the allocation summary says the bitmap block holding the bit for
+// block bno is entirely in use (0), entirely free (1), or may well be neither
+// (-1).
+static int
+bitmap_group_state(const u32 *bfree, u32 nblocks, u32 bno)
+{
+  if (!bfree)
+    return -1;
+
+  u32 bgroup = SB_BGROUP_BLKS(nblocks) * BPB;
+  u32 g = bno / bgroup;
+  u32 ngroup = std::min(nblocks, (g+1) * bgroup) - g * bgroup;
+  if (bfree[g] == 0)
+    return 0;
+  if (bfree[g] == ngroup)
+    return 1;
+  return -1;
+}
+
+// Initialize the freeblock_bitmap from the disk when the system boots. Only
+// the split of the blocks among the CPUs is decided here; each CPU's freelist
+// is then filled in by a kworker on that CPU, in parallel once the other
+// CPUs are up, or by whoever needs it first.
 void
 mfs_interface::initialize_freeblock_bitmap()
 {
-  sref<buf> bp;
-  int b, bi, nbits;
   superblock sb;
-  u32 blocknum, first_free_bblock_bit = 0;
+  u32 first_free_bblock_bit = 0;
+  const u32 *bfree = get_bfree_summary();
 
   get_superblock(&sb);
 
-  // Allocate the memory for the bit_vector in one shot, instead of doing it
-  // piecemeal using .push_back() in a loop.
-  freeblock_bitmap.bit_vector.reserve(sb.size);
-
-  for (b = 0; b < sb.size; b += BPB) {
-    blocknum = BBLOCK(b, sb.ninodes);
-    bp = buf::get(1, blocknum);
-    auto copy = bp->read();
-
-    nbits = std::min((u32)BPB, sb.size - b);
-
-    for (bi = 0; bi < nbits; bi++) {
-      int m = 1 << (bi % 8);
-      bool f = ((copy->data[bi/8] & m) == 0) ? true : false;
-
-      // Maintain a vector as well as a linked-list representation of the
-      // free-bits, to speed up freeing and allocation of blocks, respectively.
-      free_bit *bit = new free_bit(b + bi, f);
-      freeblock_bitmap.bit_vector.push_back(bit);
-
-      // Make note of the first bitmap block (bit) that starts with a free bit
-      // (which is an approximation that, that entire bitmap block (and all
-      // the subsequent ones) contains only free bits). That's where we'll
-      // start allocating per-CPU resources from (further down in the code),
-      // in order to avoid initializing CPU0 with nearly no free bits.
-      if (!first_free_bblock_bit && f && bi == 0)
-        first_free_bblock_bit = b;
+  // Find the first bitmap block (bit) that starts with a free bit (which is an
+  // approximation that, that entire bitmap block (and all the subsequent ones)
+  // contains only free bits). That's where we'll start allocating per-CPU
+  // resources from, in order to avoid initializing CPU0 with nearly no free
+  // bits. The allocation summary lets us skip over the groups that are
+  // entirely in use.
+  {
+    scoped_gc_epoch e;
+    buf_scanner scan(1, BBLOCK(sb.size - 1, sb.ninodes) + 1);
+    for (u32 b = 0; b < sb.size; b += BPB) {
+      int state = bitmap_group_state(bfree, sb.size, b);
+      if (state == 0)
+        continue;
+      if (state < 0) {
+        sref<buf> bp = scan.get(BBLOCK(b, sb.ninodes));
+        auto copy = bp->read();
+        if (copy->data[0] & 1)
+          continue;
+      }
+      first_free_bblock_bit = b;
+      break;
     }
   }
 
-  // Distribute the blocks among the CPUs and add the free blocks to the per-CPU
-  // freelists.
+  // Distribute the blocks among the CPUs. Whatever is left over at either end
+  // forms a global reserve pool of free blocks, to be used when a per-CPU
+  // freelist runs out, before stealing free blocks from other CPUs' freelists.
 
   // TODO: Remove this assert and handle cases where multiple CPUs have to share
   // the same bitmap blocks.
@@ -2431,50 +3628,143 @@ mfs_interface::initialize_freeblock_bitmap()
 
   u32 nbitblocks = sb.size/BPB - first_free_bblock_bit/BPB;
   u32 bitblocks_per_cpu = nbitblocks/NCPU;
-  u32 bits_per_cpu = bitblocks_per_cpu * BPB;
 
-  for (int cpu = 0; cpu < NCPU; cpu++) {
-    auto list_lock = freeblock_bitmap.freelists[cpu].list_lock.guard();
+  freeblock_bitmap.nblocks = sb.size;
+  freeblock_bitmap.cpu_base = first_free_bblock_bit;
+  freeblock_bitmap.blocks_per_cpu = bitblocks_per_cpu * BPB;
 
-    if (VERBOSE)
+  if (VERBOSE) {
+    for (int cpu = 0; cpu < NCPU; cpu++)
       cprintf("Per-CPU block allocator: CPU %d   blocks [%u - %u]\n",
-              cpu, first_free_bblock_bit + cpu * bits_per_cpu,
-              first_free_bblock_bit + ((cpu+1) * bits_per_cpu) - 1);
-
-    for (u32 bno = cpu * bits_per_cpu; bno < (cpu+1) * bits_per_cpu; bno++) {
-      auto bit = freeblock_bitmap.bit_vector.at(bno + first_free_bblock_bit);
-      bit->cpu = cpu;
-      if (bit->is_free)
-        freeblock_bitmap.freelists[cpu].bit_freelist.push_back(bit);
-    }
+              cpu, first_free_bblock_bit + cpu * freeblock_bitmap.blocks_per_cpu,
+              first_free_bblock_bit +
+              (cpu+1) * freeblock_bitmap.blocks_per_cpu - 1);
   }
 
-  // Build a global reserve pool of free blocks using whatever is remaining,
-  // to be used when a per-CPU freelist runs out, before stealing free blocks
-  // from other CPUs' freelists.
-  if (NCPU * bitblocks_per_cpu < nbitblocks) {
-    auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
-    for (u32 bno = NCPU * bits_per_cpu; bno + first_free_bblock_bit < sb.size;
-         bno++) {
-      auto bit = freeblock_bitmap.bit_vector.at(bno + first_free_bblock_bit);
-      bit->cpu = NCPU; // Invalid CPU number to denote reserve pool.
-      if (bit->is_free)
-        freeblock_bitmap.reserve_freelist.bit_freelist.push_back(bit);
-    }
+  for (int cpu = 0; cpu < NCPU; cpu++)
+    kwork_submit([this, cpu]() { populate_freelist(cpu); }, cpu % ncpu);
+  kwork_submit([this]() { populate_freelist(NCPU); }, 0);
+}
+
+// Fill in cpu's freelist (the reserve pool's, if cpu is NCPU) from the bitmap
+// blocks it owns, unless that has been done already. This has to happen
+// before any of its blocks is allocated or freed.
+void
+mfs_interface::populate_freelist(int cpu)
+{
+  auto &fl = freeblock_bitmap.cpu_freelist(cpu);
+  if (fl.populated.load(std::memory_order_acquire))
+    return;
+
+  scoped_gc_epoch e;
+  auto populate_lock = fl.populate_lock.guard();
+  if (fl.populated.load(std::memory_order_relaxed))
+    return;
+
+  u32 base = freeblock_bitmap.cpu_base;
+  u32 blocks_per_cpu = freeblock_bitmap.blocks_per_cpu;
+  if (cpu < NCPU) {
+    scan_free_blocks(base + cpu * blocks_per_cpu,
+                     base + (cpu+1) * blocks_per_cpu);
+  } else {
+    scan_free_blocks(0, base);
+    scan_free_blocks(base + NCPU * blocks_per_cpu, freeblock_bitmap.nblocks);
   }
+  fl.populated.store(true, std::memory_order_release);
+}
 
-  // Any other leftover free bits from [0 to first_free_bblock_bit) also go
-  // to the reserve pool. Also make sure to set the CPU number for those bits
-  // irrespective of whether they are free.
-  {
-    auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
-    for (u32 bno = 0; bno < first_free_bblock_bit; bno++) {
-      auto bit = freeblock_bitmap.bit_vector.at(bno);
-      bit->cpu = NCPU; // Invalid CPU number to denote reserve pool.
-      if (bit->is_free)
-        freeblock_bitmap.reserve_freelist.bit_freelist.push_back(bit);
+// Fill in the home freelist of block bno, before the block is freed: once the
+// block is marked free in the bitmap, filling it in would find it free too.
+void
+mfs_interface::populate_home_freelist(u32 bno)
+{
+  populate_freelist(freeblock_bitmap.home_cpu(bno));
+}
+
+// Add every run of free bits for the blocks [start, end), which begins a
+// bitmap block, to the freelists.
+void
+mfs_interface::scan_free_blocks(u32 start, u32 end)
+{
+  superblock sb;
+  const u32 *bfree = get_bfree_summary();
+  u32 run_start = 0, run_len = 0;
+
+  if (start >= end)
+    return;
+
+  get_superblock(&sb);
+  buf_scanner scan(1, BBLOCK(end - 1, sb.ninodes) + 1);
+  for (u32 b = start; b < end; b += BPB) {
+    u32 nbits = std::min((u32)BPB, end - b);
+    int state = bitmap_group_state(bfree, sb.size, b);
+
+    if (state == 1) {
+      if (!run_len)
+        run_start = b;
+      run_len += nbits;
+      continue;
+    } else if (state == 0) {
+      if (run_len)
+        add_free_extent(run_start, run_len);
+      run_len = 0;
+      continue;
+    }
+
+    sref<buf> bp = scan.get(BBLOCK(b, sb.ninodes));
+    auto copy = bp->read();
+
+    for (u32 bi = 0; bi < nbits; bi++) {
+      // Skip over whole bytes that are entirely in use.
+      if (bi % 8 == 0 && bi + 8 <= nbits && copy->data[bi/8] == 0xff) {
+        if (run_len)
+          add_free_extent(run_start, run_len);
+        run_len = 0;
+        bi += 7;
+        continue;
+      }
+
+      int m = 1 << (bi % 8);
+      if ((copy->data[bi/8] & m) == 0) {
+        if (!run_len)
+          run_start = b + bi;
+        run_len++;
+      } else if (run_len) {
+        add_free_extent(run_start, run_len);
+        run_len = 0;
+      }
     }
   }
+
+  if (run_len)
+    add_free_extent(run_start, run_len);
+}
+
+// Add the free blocks [start, start + len) to their home freelists, splitting
+// the run wherever it crosses from one home to the next.
+void
+mfs_interface::add_free_extent(u32 start, u32 len)
+{
+  u32 end = start + len;
+  u32 cpu_base = freeblock_bitmap.cpu_base;
+  u32 blocks_per_cpu = freeblock_bitmap.blocks_per_cpu;
+
+  while (start < end) {
+    int cpu = freeblock_bitmap.home_cpu(start);
+    u32 home_end;
+    if (cpu < NCPU)
+      home_end = cpu_base + (cpu+1) * blocks_per_cpu;
+    else if (start < cpu_base)
+      home_end = cpu_base;
+    else
+      home_end = end;
+
+    u32 n = std::min(end, home_end) - start;
+    auto &fl = freeblock_bitmap.home_freelist(start);
+    auto list_lock = fl.list_lock.guard();
+    fl.extents.insert(start, n);
+    start += n;
+  }
 }
 
 // Allocate a block from the freeblock_bitmap.
@@ -2482,51 +3772,70 @@ u32
 mfs_interface::alloc_block()
 {
   u32 bno;
-  superblock sb;
+  alloc_blocks(1, &bno);
+  return bno;
+}
+
+// Allocate a run of up to nblocks physically contiguous blocks from the
+// freeblock_bitmap. Returns the length of the run (at least 1) and its first
+// block in *start. The run is the lowest-addressed free extent in the local
+// CPU's freelist that is long enough, or else the longest one there is.
+u32
+mfs_interface::alloc_blocks(u32 nblocks, u32 *start)
+{
+  u32 len = try_alloc_blocks(nblocks, start);
+  if (!len)
+    panic("alloc_blocks(): Out of blocks on CPU %d\n", myid());
+  return len;
+}
+
+// Like alloc_blocks(), but returns 0 if there are no free blocks left.
+u32
+mfs_interface::try_alloc_blocks(u32 nblocks, u32 *start)
+{
+  u32 len;
   int cpu = myid();
+  auto &fl = freeblock_bitmap.freelists[cpu];
+  auto &reserve = freeblock_bitmap.reserve_freelist;
   static bool warned_once = false;
 
-  // Use the linked-list representation of the free-bits to perform block
-  // allocation in O(1) time. This list only contains the blocks that are
-  // actually free, so we can allocate any one of them.
+  assert(nblocks > 0);
 
+  populate_freelist(cpu);
   {
-    auto list_lock = freeblock_bitmap.freelists[cpu].list_lock.guard();
-
-    if (!freeblock_bitmap.freelists[cpu].bit_freelist.empty()) {
-      auto it = freeblock_bitmap.freelists[cpu].bit_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      bno = it->bno_;
-      freeblock_bitmap.freelists[cpu].bit_freelist.erase(it);
-      return bno;
-    }
+    auto list_lock = fl.list_lock.guard();
+    if ((len = fl.extents.remove(nblocks, start)))
+      return len;
   }
 
   // If we run out of blocks in our local CPU's freelist, tap into the global
   // reserve pool first.
   if (VERBOSE && !warned_once) {
-    cprintf("WARNING: alloc_block(): CPU %d allocating blocks from the global "
+    cprintf("WARNING: alloc_blocks(): CPU %d allocating blocks from the global "
              "reserve pool.\nThis could be a sign that blocks are getting "
              "leaked!\n", cpu);
     warned_once = true;
   }
 
-  // TODO: Allocate from the reserve pool in bulk in order to reduce the
-  // chances of contention even further.
-  {
-    if (freeblock_bitmap.reserve_freelist.bit_freelist.empty())
-      goto try_neighbor;
-
-    auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
+  // Take blocks from the reserve pool in bulk, so that we don't have to come
+  // back (and contend on its lock) for every allocation. Whatever the caller
+  // doesn't need goes into our freelist; the blocks still return to the
+  // reserve pool when they are eventually freed.
+  populate_freelist(NCPU);
+  if (!reserve.extents.empty()) {
+    u32 refill = std::max(nblocks, (u32)SCALEFS_BALLOC_REFILL);
+    {
+      auto list_lock = reserve.list_lock.guard();
+      len = reserve.extents.remove(refill, start);
+    }
 
-    if (!freeblock_bitmap.reserve_freelist.bit_freelist.empty()) {
-      auto it = freeblock_bitmap.reserve_freelist.bit_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      bno = it->bno_;
-      freeblock_bitmap.reserve_freelist.bit_freelist.erase(it);
-      return bno;
+    if (len) {
+      u32 n = std::min(len, nblocks);
+      if (n < len) {
+        auto list_lock = fl.list_lock.guard();
+        fl.extents.insert(*start + n, len - n);
+      }
+      return n;
     }
   }
 
@@ -2535,90 +3844,73 @@ mfs_interface::alloc_block()
   // point, in order to avoid hotspots. Note that these blocks are only
   // borrowed temporarily and are prompty returned to the original CPU's
   // freelists upon being freed.
-try_neighbor:
   for (int fallback_cpu = cpu + 1; fallback_cpu % NCPU != cpu; fallback_cpu++) {
     int fcpu = fallback_cpu % NCPU;
 
-    if (freeblock_bitmap.freelists[fcpu].bit_freelist.empty())
+    populate_freelist(fcpu);
+    if (freeblock_bitmap.freelists[fcpu].extents.empty())
       continue;
 
     auto list_lock = freeblock_bitmap.freelists[fcpu].list_lock.guard();
-
-    if (!freeblock_bitmap.freelists[fcpu].bit_freelist.empty()) {
-      auto it = freeblock_bitmap.freelists[fcpu].bit_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      bno = it->bno_;
-      freeblock_bitmap.freelists[fcpu].bit_freelist.erase(it);
-      return bno;
-    }
+    if ((len = freeblock_bitmap.freelists[fcpu].extents.remove(nblocks, start)))
+      return len;
   }
 
-  panic("alloc_block(): Out of blocks on CPU %d\n", cpu);
-
-  get_superblock(&sb);
-  return sb.size; // out of blocks
+  return 0;
 }
 
-// Mark a block as free in the freeblock_bitmap.
+// Mark a block as free in the freeblock_bitmap. The block goes back to its
+// home freelist, whichever freelist it was allocated from.
 void
 mfs_interface::free_block(u32 bno)
 {
-  // Use the vector representation of the free-bits to free the block in
-  // O(1) time (by optimizing the blocknumber-to-free_bit lookup).
-  free_bit *bit = freeblock_bitmap.bit_vector.at(bno);
-
-  int cpu = bit->cpu;
-  if (cpu < NCPU) {
-    auto list_lock = freeblock_bitmap.freelists[cpu].list_lock.guard();
-    assert(!bit->is_free);
-    bit->is_free = true;
-    freeblock_bitmap.freelists[cpu].bit_freelist.push_back(bit);
-  } else {
-    // This block belongs to the global reserve pool.
-    auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
-    assert(!bit->is_free);
-    bit->is_free = true;
-    freeblock_bitmap.reserve_freelist.bit_freelist.push_back(bit);
-  }
+  assert(bno < freeblock_bitmap.nblocks);
+  auto &fl = freeblock_bitmap.home_freelist(bno);
+  assert(fl.populated);  // See populate_home_freelist().
+  auto list_lock = fl.list_lock.guard();
+  fl.extents.insert(bno, 1);
 }
 
 void
 mfs_interface::print_free_blocks(print_stream *s)
 {
-  percpu<u32> count;
-  u32 total_count = 0, reserve_pool_count = 0;
+  u64 total_count = 0, total_extents = 0;
 
-  for (int cpu = 0; cpu < NCPU; cpu++)
-    count[cpu] = 0;
-
-  // Traversing the bit_freelist would be faster because they contain only blocks
-  // that are actually free. However, to do that we would have to acquire the
-  // list_lock, which would prevent concurrent allocations and frees. So go through
-  // the bit_vector instead.
-
-  for (auto &b : freeblock_bitmap.bit_vector) {
-    if (b->is_free) {
-      // No need to re-confirm that it is free with the lock held, since this
-      // count is approximate (like a snapshot) anyway.
-      if (b->cpu < NCPU)
-        count[b->cpu]++;
-      else
-        reserve_pool_count++;
-      total_count++;
-    }
-  }
+  for (int cpu = 0; cpu <= NCPU; cpu++)
+    populate_freelist(cpu);
 
-  s->println();
-  s->print("Total num free blocks: ", total_count);
-  s->print(" / ", freeblock_bitmap.bit_vector.size());
   s->println();
   for (int cpu = 0; cpu < NCPU; cpu++) {
-    s->print("Num free blocks (CPU ", cpu, "): ", count[cpu]);
+    auto &fl = freeblock_bitmap.freelists[cpu];
+    u64 count, nextents;
+    {
+      auto list_lock = fl.list_lock.guard();
+      count = fl.extents.nfree();
+      nextents = fl.extents.nextents();
+    }
+    s->print("Num free blocks (CPU ", cpu, "): ", count,
+             " in ", nextents, " extents");
     s->println();
+    total_count += count;
+    total_extents += nextents;
   }
+
+  u64 reserve_pool_count, reserve_pool_extents;
+  {
+    auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
+    reserve_pool_count = freeblock_bitmap.reserve_freelist.extents.nfree();
+    reserve_pool_extents = freeblock_bitmap.reserve_freelist.extents.nextents();
+  }
+  total_count += reserve_pool_count;
+  total_extents += reserve_pool_extents;
+
   s->println();
-  s->print("Num free blocks (Reserve Pool): ", reserve_pool_count);
+  s->print("Num free blocks (Reserve Pool): ", reserve_pool_count,
+           " in ", reserve_pool_extents, " extents");
+  s->println();
+  s->println();
+  s->print("Total num free blocks: ", total_count);
+  s->print(" / ", freeblock_bitmap.nblocks, " in ", total_extents, " extents");
   s->println();
 }
 
@@ -2647,49 +3939,148 @@ blkstatsread(mdev*, char *dst, u32 off, u32 n)
   return s.get_used();
 }
 
-void
-mfs_interface::reclaim_unreachable_inodes()
+DEFINE_PERCPU(struct fsstats, myfsstats, NO_CRITICAL);
+
+// How long the last boot took to recover the journals, by phase: reading
+// each journal back, merging the journals into one transaction in commit
+// order, writing that to the disk, and resetting the journals.
+static struct {
+  u64 scan_ns[NCPU];
+  u64 txns[NCPU];
+  u64 blocks[NCPU];
+  u64 merge_ns;
+  u64 apply_ns;
+  u64 apply_blocks;
+  u64 reset_ns;
+  u64 reclaim_ns;
+} recovery_stats;
+
+// Usage: cat /dev/fsstats
+static int
+fsstatsread(mdev*, char *dst, u32 off, u32 n)
 {
-#if 0 // Resurrect this after rewriting the recovery code.
-  int cpu = myid();
-  bool do_flush = false;
-
-  superblock sb;
-  get_superblock(&sb);
-
-  for (u32 inum = 0; inum < sb.ninodes; inum += IPB) {
-    sref<buf> bp = buf::get(1, IBLOCK(inum));
-    auto copy = bp->read();
-
-    int ninums = std::min((u32)IPB, sb.ninodes - inum);
-
-    for (int i = 0; i < ninums; i++) {
-      const dinode *dip = (const struct dinode*)copy->data + (inum + i)%IPB;
+  window_stream s(dst, off, n);
+  struct fsstats total = {};
+
+  s.print("cpu");
+#define X(name) s.print(" " #name);
+  FSSTATS_ALL(X)
+#undef X
+  s.println();
+  for (int c = 0; c < ncpu; c++) {
+    s.print(c);
+#define X(name) \
+    s.print(" ", myfsstats[c].name); total.name += myfsstats[c].name;
+    FSSTATS_ALL(X)
+#undef X
+    s.println();
+    for (int b = 0; b < FSSTATS_FSYNC_BUCKETS; b++)
+      total.fsync_hist[b] += myfsstats[c].fsync_hist[b];
+  }
+  s.print("total");
+#define X(name) s.print(" ", total.name);
+  FSSTATS_ALL(X)
+#undef X
+  s.println();
+
+  s.println();
+  s.println("fsync_us count");
+  for (int b = 0; b < FSSTATS_FSYNC_BUCKETS; b++) {
+    if (!total.fsync_hist[b])
+      continue;
+    if (b == 0)
+      s.print("<1");
+    else if (b == FSSTATS_FSYNC_BUCKETS - 1)
+      s.print(">=", 1ul << (b - 1));
+    else
+      s.print(1ul << (b - 1), "-", (1ul << b) - 1);
+    s.println(" ", total.fsync_hist[b]);
+  }
 
-      if (dip->nlink != 0)
-        continue;
+  s.println();
+  s.println("journal used_bytes log_bytes");
+  for (int c = 0; c < ncpu; c++)
+    s.println(c, " ", rootfs_interface->fs_journal[c]->used_space(), " ",
+              rootfs_interface->fs_journal[c]->log_size());
+  if (checkpoints_held)
+    s.println("checkpoints held");
+
+  s.println();
+  s.println("recovery_journal txns blocks scan_us");
+  u64 scan_ns = 0;
+  for (int c = 0; c < NCPU; c++) {
+    scan_ns += recovery_stats.scan_ns[c];
+    if (recovery_stats.txns[c])
+      s.println(c, " ", recovery_stats.txns[c], " ", recovery_stats.blocks[c],
+                " ", recovery_stats.scan_ns[c] / 1000);
+  }
+  s.println("recovery_us scan ", scan_ns / 1000,
+            " merge ", recovery_stats.merge_ns / 1000,
+            " apply ", recovery_stats.apply_ns / 1000,
+            " reset ", recovery_stats.reset_ns / 1000,
+            " reclaim ", recovery_stats.reclaim_ns / 1000);
+  s.println("recovery_apply_blocks ", recovery_stats.apply_blocks);
+  return s.get_used();
+}
 
-      u32 dead_inum = inum + i;
-      sref<inode> dead_ip = iget(1, dead_inum);
+// Usage: echo hold > /dev/fsstats
+//        echo release > /dev/fsstats
+// hold leaves committed transactions in the journals until they fill up
+// (to set up a crash for recovery benchmarks); release lets the
+// checkpointers catch up again.
+static int
+fsstatswrite(mdev*, const char *buf, u32 n)
+{
+  if (n >= 4 && strncmp(buf, "hold", 4) == 0) {
+    checkpoints_held = true;
+    return n;
+  }
+  if (n >= 7 && strncmp(buf, "release", 7) == 0) {
+    checkpoints_held = false;
+    for (int c = 0; c < ncpu; c++)
+      rootfs_interface->fs_journal[c]->kick_apply_worker();
+    return n;
+  }
+  return -1;
+}
 
-      transaction *tr = new transaction();
-      ilock(dead_ip, WRITELOCK);
-      itrunc(dead_ip, 0, tr);
-      iunlock(dead_ip);
+// Frees the inodes on the orphan list: files that were unlinked while still
+// open, and still open when we went down. Called at boot, once the free
+// inode and block bitmaps are set up.
+void
+mfs_interface::reclaim_orphan_inodes()
+{
+  int cpu = myid();
+  u32 orphans[SB_NORPHANS];
+  u32 n = get_orphan_inodes(orphans);
 
-      // TODO: This works fine when deleting files or empty directories, but we
-      // will have to do a recursive unlink/delete when dealing with unreachable
-      // non-empty directories.
-      free_inode(dead_ip, tr);
+  for (u32 i = 0; i < n; i++) {
+    transaction *tr = new transaction();
+    std::vector<u64> inum_list;
+    inum_list.push_back(orphans[i]);
+    acquire_inodebitmap_locks(inum_list, INODE_BLOCK, tr);
 
-      add_transaction_to_queue(tr, cpu);
-      do_flush = true;
+    // An entry can outlive its inode if the list was updated in a
+    // transaction that didn't make it to the disk along with the unlink;
+    // only free inodes that are really unreachable.
+    sref<inode> ip = iget(1, orphans[i]);
+    if (ip->type && !ip->nlink()) {
+      ilock(ip, WRITELOCK);
+      itrunc(ip, 0, tr);
+      iunlock(ip);
+      free_inode(ip, tr);
     }
+
+    std::vector<u64> none;
+    acquire_inodebitmap_locks(none, SUPER_BLOCK, tr);
+    remove_orphan_inode(orphans[i], tr);
+    add_transaction_to_queue(tr, cpu);
   }
 
-  if (do_flush)
+  if (n) {
+    cprintf("reclaim_orphan_inodes: %u orphans\n", n);
     flush_transaction_queue(cpu, true);
-#endif
+  }
 }
 
 // Allocates a lock for every inode block and every bitmap block.
@@ -2700,14 +4091,17 @@ mfs_interface::alloc_inodebitmap_locks()
   get_superblock(&sb);
 
   // The superblock is immediately followed by the inode blocks, which in turn
-  // are immediately followed by the bitmap blocks. So we allocate locks for
-  // block numbers 0 through the last bitmap block (inclusive).
+  // are immediately followed by the bitmap blocks (and the refcount blocks,
+  // if any). So we allocate locks for block numbers 0 through the last of
+  // them (inclusive).
   int last_blocknum = BBLOCK(sb.size - 1, sb.ninodes);
+  if (sb.features & SB_FEATURE_REFCOUNTS)
+    last_blocknum = RBLOCK(sb.size - 1, sb.ninodes, sb.size);
 
-  inodebitmap_locks.reserve(last_blocknum + 1);
+  inodebitmap_blocks.reserve(last_blocknum + 1);
 
   for (int i = 0; i <= last_blocknum; i++)
-    inodebitmap_locks.push_back(new sleeplock());
+    inodebitmap_blocks.push_back(new inodebitmap_block());
 }
 
 // Acquire a set of inode-block or bitmap-block locks in the context of the
@@ -2715,7 +4109,8 @@ mfs_interface::alloc_inodebitmap_locks()
 //
 // @num_list: List of inode numbers or list of block numbers.
 //            (They are distinguished by the type parameter).
-// @type: INODE_BLOCK or BITMAP_BLOCK
+// @type: INODE_BLOCK, BITMAP_BLOCK, REFCOUNT_BLOCK or SUPER_BLOCK (for which
+//        num_list is ignored)
 //
 // Note: The numbers in num_list must be uniform - either all of them must be
 // inode numbers or all of them must be block numbers.
@@ -2761,13 +4156,40 @@ mfs_interface::acquire_inodebitmap_locks(std::vector<u64> &num_list, int type,
     }
 
     break;
+
+  case REFCOUNT_BLOCK:
+    get_superblock(&sb);
+
+    for (auto &n : num_list) {
+      blocknum = RBLOCK(n, sb.ninodes, sb.size);
+      for (auto &b : block_numbers) {
+        if (b == blocknum)
+          goto skip_refcount; // Already locked
+      }
+      block_numbers.push_back(blocknum);
+     skip_refcount:
+      ;
+    }
+
+    break;
+
+  case SUPER_BLOCK:
+    // The superblock (for its orphan list) is locked after the inode blocks
+    // and before the bitmap blocks, despite its block number. Nothing takes
+    // inode-block locks after it.
+    for (auto &b : tr->inodebitmap_blk_list) {
+      if (b == 1)
+        return; // Already locked
+    }
+    block_numbers.push_back(1);
+    break;
   }
 
   // Lock ordering rule: Acquire the locks in increasing order of their
   // block numbers.
   std::sort(block_numbers.begin(), block_numbers.end());
   for (auto &blknum : block_numbers) {
-    sleeplock *sl = inodebitmap_locks.at(blknum);
+    sleeplock *sl = &inodebitmap_blocks.at(blknum)->lock;
     sl->acquire();
     tr->inodebitmap_locks.push_back(sl);
     tr->inodebitmap_blk_list.push_back(blknum);
@@ -2792,39 +4214,108 @@ recover_scalefs()
   anon_fs = new mfs();
   rootfs_interface = new mfs_interface();
 
-  // Check all the journals and reapply committed transactions
-  std::vector<transaction*> txns_to_apply;
-  for (int cpu = 0; cpu < NCPU; cpu++)
-    rootfs_interface->recover_journal(cpu, txns_to_apply);
-
-  if (!txns_to_apply.empty()) {
-    std::sort(txns_to_apply.begin(), txns_to_apply.end(),
-              journal::compare_txn_tsc);
+  // Check all the journals for committed transactions. Each journal yields
+  // its transactions in increasing commit timestamp order.
+  static std::vector<transaction*> journal_txns[NCPU];
+  for (int cpu = 0; cpu < NCPU; cpu++) {
+    u64 start = nsectime();
+    rootfs_interface->recover_journal(cpu, journal_txns[cpu]);
+    recovery_stats.scan_ns[cpu] = nsectime() - start;
+    recovery_stats.txns[cpu] = journal_txns[cpu].size();
+    for (transaction *tr : journal_txns[cpu])
+      recovery_stats.blocks[cpu] += tr->num_blocks();
+  }
 
-    for (auto &tr : txns_to_apply) {
-      cprintf("recover_scalefs: applying transaction with commit timestamp %lu\n",
-              tr->commit_tsc);
-      tr->write_to_disk_update_bufcache();
-      delete tr;
+  // Merge the journals by commit timestamp, folding the transactions into a
+  // single one that holds the latest version of every block, and reapply
+  // that with batched I/O.
+  u64 start = nsectime();
+  transaction *recovered = new transaction();
+  static size_t next[NCPU];
+  size_t nrecovered = 0;
+  for (;;) {
+    int min_cpu = -1;
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+      if (next[cpu] == journal_txns[cpu].size())
+        continue;
+      if (min_cpu < 0 || journal_txns[cpu][next[cpu]]->commit_tsc <
+                         journal_txns[min_cpu][next[min_cpu]]->commit_tsc)
+        min_cpu = cpu;
     }
+    if (min_cpu < 0)
+      break;
 
-    txns_to_apply.clear();
+    transaction *tr = journal_txns[min_cpu][next[min_cpu]++];
+    recovered->absorb_recovered(tr);
+    delete tr;
+    nrecovered++;
   }
+  recovery_stats.merge_ns = nsectime() - start;
+  recovery_stats.apply_blocks = recovered->num_blocks();
+
+  start = nsectime();
+  if (nrecovered) {
+    cprintf("recover_scalefs: applying %zu transactions (%zu blocks)\n",
+            nrecovered, recovered->num_blocks());
+    recovered->write_to_disk_update_bufcache();
+  }
+  delete recovered;
+  recovery_stats.apply_ns = nsectime() - start;
+
+  for (int cpu = 0; cpu < NCPU; cpu++)
+    journal_txns[cpu].clear();
 
+  start = nsectime();
   for (int cpu = 0; cpu < NCPU; cpu++)
     rootfs_interface->init_journal(cpu);
+  recovery_stats.reset_ns = nsectime() - start;
+}
+
+// The per-core checkpointer: applies the committed transactions of a journal
+// to their home locations on the disk in the background, which frees up their
+// space in the circular log. It is woken up after every commit in the
+// pipelined mode, and when the journal passes the high watermark (or runs out
+// of space) otherwise.
+// Background writeback of dirty file pages, one thread per core.
+static void
+writeback_flusher(void *x)
+{
+  int cpu = (int)(uintptr_t) x;
 
-  // If a newly created file (or directory) is fsynced, but its link in the
-  // parent is not flushed (by fsyncing the parent directory), the file is
-  // potentially unreachable on the disk. If we indeed crash without fsyncing
-  // the parent directory, the file (or child directory) must be deleted/
-  // reclaimed during crash-recovery upon reboot. A similar situation arises
-  // if the last link to an on-disk file or directory is removed (unlinked)
-  // but userspace still holds open file descriptors to it at the time of
-  // fsync; in that case, its inode cannot be deleted from the disk at the
-  // time of fsync, but must be postponed until reboot. We reclaim such
-  // dead/unreachable inodes here during reboot.
-  rootfs_interface->reclaim_unreachable_inodes();
+  for (;;) {
+    if (rootfs_interface->wait_for_writeback_work(cpu))
+      rootfs_interface->process_metadata_log_and_flush(cpu);
+    rootfs_interface->reclaim_deleted_inodes(cpu);
+    rootfs_interface->writeback_dirty_files(cpu);
+  }
+}
+
+static void
+metadata_log_pressure(int cpu)
+{
+  rootfs_interface->kick_metadata_sync(cpu);
+}
+
+// Processes the metadata logs of the mnodes dirtied on this core on behalf of
+// sync, one thread per core.
+static void
+metadata_syncer(void *x)
+{
+  int cpu = (int)(uintptr_t) x;
+
+  for (;;)
+    rootfs_interface->process_metadata_sync_work(cpu);
+}
+
+static void
+journal_checkpointer(void *x)
+{
+  int cpu = (int)(uintptr_t) x;
+
+  for (;;) {
+    rootfs_interface->fs_journal[cpu]->wait_for_apply_work();
+    rootfs_interface->apply_all_transactions(cpu);
+  }
 }
 
 void
@@ -2837,9 +4328,37 @@ init_scalefs()
 
   rootfs_interface->alloc_inodebitmap_locks();
 
+  // Files that were unlinked, but still open when we went down, are on the
+  // orphan list in the superblock; free them now that their inodes and
+  // blocks can be. (A file that was fsynced, but whose link in its parent
+  // never made it to the disk, isn't on the list, and stays allocated.)
+  u64 start = nsectime();
+  rootfs_interface->reclaim_orphan_inodes();
+  recovery_stats.reclaim_ns = nsectime() - start;
+
   devsw[MAJ_BLKSTATS].pread = blkstatsread;
+  devsw[MAJ_FSSTATS].pread = fsstatsread;
+  devsw[MAJ_FSSTATS].write = fsstatswrite;
   devsw[MAJ_EVICTCACHES].write = evict_caches;
+  // Evict clean file pages before clean metadata blocks.
+  register_shrinker("page cache", SHRINK_DATA_CACHES, pagecache_reclaim);
+  register_shrinker("buffer cache", SHRINK_DATA_CACHES, bufcache_shrink);
+  oplog::tsc_logger::set_pressure_handler(metadata_log_pressure);
 
   root_mnum = rootfs_interface->load_root()->mnum_;
   /* the root mnode gets an extra reference because of its own ".." */
+
+  for (int c = 0; c < ncpu; c++) {
+    char namebuf[32];
+    snprintf(namebuf, sizeof(namebuf), "jckpt_%u", c);
+    threadpin(journal_checkpointer, (void*)(uintptr_t) c, namebuf, c);
+
+    snprintf(namebuf, sizeof(namebuf), "wbflush_%u", c);
+    threadpin(writeback_flusher, (void*)(uintptr_t) c, namebuf, c);
+
+    snprintf(namebuf, sizeof(namebuf), "msync_%u", c);
+    threadpin(metadata_syncer, (void*)(uintptr_t) c, namebuf, c);
+  }
+
+  warmlist_load();
 }
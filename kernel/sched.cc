@@ -11,15 +11,50 @@
 #include "vm.hh"
 #include "major.h"
 #include "rnd.hh"
-#include "lb.hh"
+#include "numa.hh"
 #include "work.hh"
+#include "ring.hh"
+#include "cpuid.hh"
+#include "schedtrace.h"
+#include "tracepoint.hh"
 #include "ilist.hh"
 #include "kstream.hh"
 #include "file.hh"
 
 enum { sched_debug = 0 };
 
-struct schedule : public balance_pool<schedule> {
+extern u64 cpuhz;
+
+// Run queue statistics, printed by /dev/stat: how long procs wait on a
+// run queue between being made runnable (woken or preempted) and running,
+// histogrammed by log2 of microseconds, and how many procs were already
+// queued when one was added, by log2.
+#define SCHED_WAIT_BUCKETS 24
+#define SCHED_QLEN_BUCKETS 10
+
+static int
+log2_bucket(u64 v, int nbuckets)
+{
+  int b = v ? 64 - __builtin_clzll(v) : 0;
+  return std::min(b, nbuckets - 1);
+}
+
+static void
+print_hist(print_stream *s, const char *what, const u64 *hist, int nbuckets)
+{
+  s->print("    ", what, ":");
+  for (int b = 0; b < nbuckets; b++) {
+    if (!hist[b])
+      continue;
+    if (b == nbuckets - 1)
+      s->print(" >=", 1ull << (b - 1), ":", hist[b]);
+    else
+      s->print(" <", 1ull << b, ":", hist[b]);
+  }
+  s->println();
+}
+
+struct schedule {
 public:
   schedule(int id);
   ~schedule() {};
@@ -34,23 +69,61 @@ public:
   void enq_dwork(dwork *w);
   void try_dwork();
 
-  void balance_move_to(schedule *other);
-  u64 balance_count() const;
+  int steal_half(schedule *thief);
+
+  // A rough, unlocked measure of how busy this core is: its queued
+  // procs, plus one if it isn't idle.
+  u64 load() const {
+    return nqueued_ + !idle_;
+  }
+  volatile bool idle_;
+
+  // Whether this core has queued procs or deferred work.  Unlocked, and
+  // only meaningful on this core, which is work_ring_'s only consumer.
+  bool has_work() const {
+    return *(volatile const u64 *)&nqueued_ || !work_ring_.empty() ||
+      work_overflow_.load(std::memory_order_relaxed);
+  }
+
+  // Written when work is queued for this core while it's idle, which
+  // ends an MWAIT on it (see sched_dir::idle_wait).
+  std::atomic<u64> wake_seq_ __mpalign__;
 
   sched_stat stats_;
   u64 ncansteal_;
 private:
   void sanity(void);
 
+  void kick() {
+    if (idle_)
+      wake_seq_.store(wake_seq_.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+  }
+
   struct spinlock lock_ __mpalign__;
-  ilist<proc, &proc::sched_link> proc_;
+  // One run queue per sched_class.
+  ilist<proc, &proc::sched_link> proc_[NSCHED_CLASS];
+  // Kernel-class procs dequeued in a row while user procs were waiting.
+  int kernel_run_;
+  // Procs on proc_, and the histograms above (all protected by lock_).
+  u64 nqueued_;
+  u64 wait_cycles_;
+  u64 wait_max_;
+  u64 wait_hist_[SCHED_WAIT_BUCKETS];
+  u64 qlen_hist_[SCHED_QLEN_BUCKETS];
+  // Deferred work goes in work_ring_ without locking; work_, protected
+  // by lock_, only takes what doesn't fit.
   isqueue<dwork, &dwork::link_> work_;
+  std::atomic<bool> work_overflow_;
+  mpsc_ring<dwork*, SCHED_DWORK_RING> work_ring_;
   volatile bool cansteal_ __mpalign__;
   __padout__;
 };
 
 schedule::schedule(int id)
-  : balance_pool(1), id_(id), lock_("schedule::lock_", LOCKSTAT_SCHED)
+  : id_(id), idle_(true), wake_seq_(0), lock_("schedule::lock_", LOCKSTAT_SCHED),
+    kernel_run_(0), nqueued_(0), wait_cycles_(0), wait_max_(0),
+    wait_hist_(), qlen_hist_(), work_overflow_(false)
 {
   ncansteal_ = 0;
   stats_.enqs = 0;
@@ -62,89 +135,115 @@ schedule::schedule(int id)
   stats_.schedstart = 0;
 }
 
-u64 
-schedule::balance_count() const {
-  // 1 if the number of processes that in runnable state and have
-  // run long enough that they could be stolen is bigger than 1?
-  // XXX length of queue?
-  //
-  // XXX reading ncansteal could be expensive, but local core updates
-  // it and remote core reads it, experiencing a cache-line transfer
-  return cansteal_ > 0 ? 1 : 0;
-}
-
-void 
-schedule::balance_move_to(schedule* target)
+// Move up to half of this core's stealable processes to thief, and
+// return how many moved.  Processes that last ran here (data_cpuid) have
+// their state in this core's cache, so take others first.
+int
+schedule::steal_half(schedule *thief)
 {
-  proc *victim = nullptr;
+  proc *victims[SCHED_STEAL_MAX];
+  int n = 0;
 
   if (!cansteal_ || !tryacquire(&lock_))
-    return;
-
-  for (auto it = proc_.begin(); it != proc_.end(); ++it) {
-    if ((*it).cansteal(true)) {
-      proc_.erase(it);
+    return 0;
+
+  int want = (ncansteal_ + 1) / 2;
+  if (want > NELEM(victims))
+    want = NELEM(victims);
+  for (int pass = 0; pass < 2 * NSCHED_CLASS && n < want; pass++) {
+    auto &q = proc_[pass / 2];
+    for (auto it = q.begin(); it != q.end() && n < want; ) {
+      proc &p = *it;
+      if (!p.cansteal(true) || (pass % 2 == 0 && p.data_cpuid == id_)) {
+        ++it;
+        continue;
+      }
+      it = q.erase(it);
+      nqueued_--;
       if (--ncansteal_ == 0)
         cansteal_ = false;
-      sanity();
-      victim = &(*it);
+      victims[n++] = &p;
     }
   }
+  sanity();
   release(&lock_);
-  if (!victim) {
-    ++stats_.misses;
-    return;
-  }
 
-  acquire(&victim->lock);
-  if (victim->get_state() == RUNNABLE && !victim->cpu_pin &&
-      victim->curcycles != 0 && victim->curcycles > VICTIMAGE)
-  {
-    victim->curcycles = 0;
-    victim->cpuid = mycpu()->id;
-    target->enq(victim);
+  // Processes are locked before run queues, so move them without
+  // holding lock_.
+  int nstolen = 0;
+  for (int i = 0; i < n; i++) {
+    proc *victim = victims[i];
+    acquire(&victim->lock);
+    if (victim->get_state() == RUNNABLE && !victim->cpu_pin) {
+      victim->curcycles = 0;
+      victim->cpuid = thief->id_;
+      thief->enq(victim);
+      ++nstolen;
+    } else {
+      // It changed under us; leave it where it was.
+      ++stats_.misses;
+      this->enq(victim);
+    }
     release(&victim->lock);
-    //cprintf("%d: stole %s from %d\n", mycpu()->id, victim->name, id_);
-    ++stats_.steals;
-    return;
-  }
-  ++stats_.misses;
-  cprintf("%d: don't steal %s---hasn't run long enough\n", 
-          mycpu()->id, victim->name);
-#if 0
-  // XXX why is this code here?  you should only steal a runnable process
-  // it has run for a while on the cpu, or not all.
-  if (victim->get_state() == RUNNABLE) {
-    target->enq(victim);
   }
-#endif
-  release(&victim->lock);
+  stats_.steals += nstolen;
+  if (!n)
+    ++stats_.misses;
+  return nstolen;
 }
 
 void
 schedule::enq(proc* p)
 {
   scoped_acquire x(&lock_);
-  proc_.push_back(p);
+  proc_[p->sched_class].push_back(p);
+  p->enq_tsc = rdtsc();
+  qlen_hist_[log2_bucket(nqueued_++, SCHED_QLEN_BUCKETS)]++;
   if (p->cansteal(true))
     if (ncansteal_++ == 0) {
       cansteal_ = true;
     }
   sanity();
   stats_.enqs++;
+  kick();
+
+  // A kernel worker woken on this core preempts the user proc it
+  // interrupted as soon as that returns from the trap.  (Other cores
+  // notice at their next tick.)
+  if (p->sched_class == SCHED_CLASS_KERNEL && id_ == myid()) {
+    proc *cur = myproc();
+    if (cur && cur->sched_class != SCHED_CLASS_KERNEL && cur != p)
+      cur->yield_ = true;
+  }
 }
 
 proc*
 schedule::deq(void)
 {   
-  if (proc_.empty())
+  if (proc_[SCHED_CLASS_KERNEL].empty() && proc_[SCHED_CLASS_NORMAL].empty())
     return nullptr;
-  // Remove from head
+  // Remove from the head of the highest class, unless kernel workers
+  // have kept user procs waiting for SCHED_KERNEL_BURST turns in a row.
   scoped_acquire x(&lock_);
-  if (proc_.empty()) 
-    return nullptr;
-  proc &p = proc_.front();
-  proc_.pop_front();
+  auto *q = &proc_[SCHED_CLASS_KERNEL];
+  if (q->empty() ||
+      (kernel_run_ >= SCHED_KERNEL_BURST &&
+       !proc_[SCHED_CLASS_NORMAL].empty())) {
+    q = &proc_[SCHED_CLASS_NORMAL];
+    kernel_run_ = 0;
+    if (q->empty())
+      return nullptr;
+  } else if (!proc_[SCHED_CLASS_NORMAL].empty()) {
+    kernel_run_++;
+  }
+  proc &p = q->front();
+  q->pop_front();
+  nqueued_--;
+  u64 wait = rdtsc() - p.enq_tsc;
+  wait_cycles_ += wait;
+  if (wait > wait_max_)
+    wait_max_ = wait;
+  wait_hist_[log2_bucket(wait / (cpuhz / 1000000), SCHED_WAIT_BUCKETS)]++;
   if (p.cansteal(true))
     if (--ncansteal_ == 0)
       cansteal_ = false;
@@ -157,6 +256,22 @@ void
 schedule::dump(print_stream *s)
 {
   s->print(" enq ", stats_.enqs, " deqs ", stats_.deqs, " steals ", stats_.steals, " misses ", stats_.misses);
+  if (!stats_.deqs)
+    return;
+
+  u64 wait_hist[SCHED_WAIT_BUCKETS], qlen_hist[SCHED_QLEN_BUCKETS];
+  u64 mean, max;
+  {
+    scoped_acquire x(&lock_);
+    memmove(wait_hist, wait_hist_, sizeof(wait_hist));
+    memmove(qlen_hist, qlen_hist_, sizeof(qlen_hist));
+    mean = wait_cycles_ / stats_.deqs / (cpuhz / 1000000);
+    max = wait_max_ / (cpuhz / 1000000);
+  }
+  s->println();
+  s->println("    runqueue delay mean ", mean, " us, max ", max, " us");
+  print_hist(s, "runqueue delay (us)", wait_hist, SCHED_WAIT_BUCKETS);
+  print_hist(s, "runqueue length", qlen_hist, SCHED_QLEN_BUCKETS);
 }
 
 void
@@ -165,9 +280,10 @@ schedule::sanity(void)
 #if DEBUG
   u64 n = 0;
 
-  for (auto &p : proc_) 
-    if (p.cansteal(true))
-      n++;
+  for (auto &q : proc_)
+    for (auto &p : q)
+      if (p.cansteal(true))
+        n++;
   
   if (n != ncansteal_)
     panic("schedule::sanity: %lu != %lu", n, ncansteal_);
@@ -177,29 +293,68 @@ schedule::sanity(void)
 void
 schedule::enq_dwork(dwork *w)
 {
+  {
+    // Don't get preempted between claiming a slot and filling it, since
+    // that holds up everything queued after it.
+    scoped_cli cli;
+    if (work_ring_.push(w)) {
+      kick();
+      return;
+    }
+  }
   scoped_acquire x(&lock_);
   work_.push_back(w);
+  work_overflow_.store(true, std::memory_order_relaxed);
+  kick();
 }
 
 void
 schedule::try_dwork(void)
 {
-  auto l = lock_.guard();
-  while (!work_.empty()) {
+  dwork *batch[16];
+  for (;;) {
+    size_t n;
+    {
+      // Only this core pops work_ring_.  We may have migrated since
+      // our caller picked this schedule, in which case leave the work
+      // for its core.
+      scoped_cli cli;
+      if (id_ != myid())
+        return;
+      n = work_ring_.pop(batch, NELEM(batch));
+    }
+    for (size_t i = 0; i < n; i++)
+      batch[i]->run();
+    if (n)
+      continue;
+
+    if (!work_overflow_.load(std::memory_order_relaxed))
+      return;
+    auto l = lock_.guard();
+    if (work_.empty()) {
+      work_overflow_.store(false, std::memory_order_relaxed);
+      return;
+    }
     auto &w = work_.front();
     work_.pop_front();
     l.release();
     w.run();
-    l = lock_.guard();
   }
 }
 
 struct sched_dir {
 private:
-  balancer<sched_dir, schedule> b_;
   percpu<schedule*> schedule_;
+
+  // Try to steal from cpu.  Returns the number of processes stolen.
+  int steal_from(int cpu, schedule *thief) {
+    if (cpu == thief->id_ || cpu >= ncpu)
+      return 0;
+    return schedule_[cpu]->steal_half(thief);
+  }
+
 public:
-  sched_dir() : b_(this) {
+  sched_dir() {
     for (int i = 0; i < NCPU; i++) {
       schedule_[i] = new schedule(i);
     }
@@ -207,19 +362,94 @@ public:
   ~sched_dir() {};
   NEW_DELETE_OPS(sched_dir);
 
-  schedule* balance_get(int id) const {
-    return schedule_[id];
+  // Return the least loaded core on this NUMA node, preferring this
+  // one and then the ones just past it.
+  int pick_cpu() {
+    scoped_cli cli;
+    int best = myid();
+    u64 bestload = schedule_[best]->load();
+    numa_node *mynode = mycpu()->node;
+    size_t n = mynode ? mynode->cpuids.size() : ncpu;
+    size_t me = 0;
+    for (size_t i = 0; mynode && i < n; i++)
+      if (mynode->cpuids[i] == myid())
+        me = i;
+    for (size_t i = 1; i < n && bestload; i++) {
+      int c = mynode ? mynode->cpuids[(me + i) % n] : (myid() + i) % n;
+      u64 load = schedule_[c]->load();
+      if (load < bestload) {
+        best = c;
+        bestload = load;
+      }
+    }
+    return best;
   }
 
-  void steal() {
+  // Steal work for this (idle) core, trying the cores on this NUMA node
+  // before the others.  Within each node, every thief starts just past
+  // itself so that thieves spread out over the victims.  Returns the
+  // number of processes stolen.
+  int steal() {
     if (!SCHED_LOAD_BALANCE)
-      return;
-    pushcli();
-    b_.balance();
-    popcli();
+      return 0;
+    scoped_cli cli;
+    schedule *thief = schedule_[myid()];
+    numa_node *mynode = mycpu()->node;
+    int n = 0;
+
+    if (!mynode) {
+      for (int i = 1; i < ncpu && !n; i++)
+        n = steal_from((myid() + i) % ncpu, thief);
+      return n;
+    }
+
+    size_t me = 0;
+    for (size_t i = 0; i < mynode->cpuids.size(); i++)
+      if (mynode->cpuids[i] == myid())
+        me = i;
+    for (size_t i = 1; i < mynode->cpuids.size() && !n; i++)
+      n = steal_from(mynode->cpuids[(me + i) % mynode->cpuids.size()], thief);
+
+    for (size_t j = 1; j < numa_nodes.size() && !n; j++) {
+      numa_node &node = numa_nodes[(mynode->id + j) % numa_nodes.size()];
+      size_t sz = node.cpuids.size();
+      for (size_t i = 0; i < sz && !n; i++)
+        n = steal_from(node.cpuids[(myid() + i) % sz], thief);
+    }
+    return n;
+  }
+
+  // Wait for work on this idle core.  See sched_idle_wait.
+  void idle_wait() {
+    schedule *s = schedule_[myid()];
+    if (IDLE_POLL_US) {
+      u64 end = rdtsc() + cpuhz / 1000000 * IDLE_POLL_US;
+      do {
+        if (s->has_work())
+          return;
+        nop_pause();
+      } while (rdtsc() < end);
+    }
+    if (IDLE_MWAIT && cpuid::features().mwait) {
+      monitor(&s->wake_seq_);
+      if (!s->has_work()) {
+        timer_idle(true);
+        mwait(0);
+        timer_idle(false);
+      }
+    } else if (!s->has_work()) {
+      timer_idle(true);
+      asm volatile("hlt");
+      timer_idle(false);
+    }
   }
 
   void addrun(struct proc* p) {
+    // Procs that were preempted come back through here, too.
+    if (p->get_state() != RUNNABLE) {
+      schedtrace_record(SCHEDTRACE_WAKEUP, p, p->cpuid);
+      TRACEPOINT(SCHED_WAKEUP, p->pid, p->cpuid);
+    }
     p->set_state(RUNNABLE);
     schedule_[p->cpuid]->enq(p);
   }
@@ -259,7 +489,9 @@ public:
     if(readrflags()&FL_IF)
       panic("sched interruptible");
     intena = mycpu()->intena;
-    myproc()->curcycles += rdtsc() - myproc()->tsc;
+    u64 ran = rdtsc() - myproc()->tsc;
+    myproc()->curcycles += ran;
+    myproc()->cputime += ran;
 
     // Interrupts are disabled
     next = this->next();
@@ -278,6 +510,8 @@ public:
         next = idleproc();
       } else {
         myproc()->set_state(RUNNING);
+        myproc()->slice_ticks = 0;
+        schedule_[mycpu()->id]->idle_ = (myproc() == idleproc());
         mycpu()->intena = intena;
         release(&myproc()->lock);
         return;
@@ -286,10 +520,15 @@ public:
 
     if (next->get_state() != RUNNABLE)
       panic("non-RUNNABLE next %s %u", next->name, next->get_state());
+    next->slice_ticks = 0;
+    schedule_[mycpu()->id]->idle_ = (next == idleproc());
 
     prev = myproc();
     mycpu()->proc = next;
     mycpu()->prev = prev;
+    schedtrace_record(SCHEDTRACE_SWITCH_OUT, prev, myid());
+    schedtrace_record(SCHEDTRACE_SWITCH_IN, next, myid());
+    TRACEPOINT(SCHED_SWITCH, prev->pid, next->pid);
 
     if (prev->get_state() == ZOMBIE)
       mtstop(prev);
@@ -370,11 +609,26 @@ statread(mdev* m, char *dst, u32 off, u32 n)
   return s.get_used();
 }
 
+int
+sched_pick_cpu(void)
+{
+  return thesched_dir.pick_cpu();
+}
+
 int
 steal(void)
 {
-  thesched_dir.steal();
-  return 0;
+  return thesched_dir.steal();
+}
+
+// Called by the idle loop when there is nothing to do.  Spin for up to
+// IDLE_POLL_US watching this core's run queue and deferred work, then
+// sleep until an interrupt or, with MWAIT, until work is queued here.
+// Returns when there may be work; the caller must check.
+void
+sched_idle_wait(void)
+{
+  thesched_dir.idle_wait();
 }
 
 void
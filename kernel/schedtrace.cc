@@ -0,0 +1,151 @@
+// Scheduling trace: a ring of context switch and wakeup events per
+// core, read through /dev/schedtrace (see schedtrace.h).
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include <uk/stat.h>
+#include "cpu.hh"
+#include "proc.hh"
+#include "percpu.hh"
+#include "file.hh"
+#include "major.h"
+#include "kalloc.hh"
+#include "schedtrace.h"
+#include <atomic>
+
+extern u64 cpuhz;
+
+namespace {
+  struct trace_ring
+  {
+    schedtrace_event *events;   // SCHEDTRACE_EVENTS of them, or null
+    u64 head;                   // Events recorded since tracing started
+  };
+
+  // Only its own core writes a ring, with interrupts disabled.
+  DEFINE_PERCPU(trace_ring, trace_rings, NO_CRITICAL);
+  std::atomic<bool> tracing;
+  spinlock ctl_lock("schedtrace", LOCKSTAT_SCHED);
+}
+
+#define HEADER_SZ (sizeof(struct schedtrace_header) + \
+                   NCPU * sizeof(((struct schedtrace_header*)0)->cpu[0]))
+#define RING_SZ (SCHEDTRACE_EVENTS * sizeof(struct schedtrace_event))
+
+void
+schedtrace_record(int type, struct proc *p, int arg)
+{
+  if (!tracing.load(std::memory_order_relaxed))
+    return;
+
+  scoped_cli cli;
+  trace_ring *r = trace_rings.get_unchecked();
+  if (!r->events)
+    return;
+  schedtrace_event *e = &r->events[r->head++ % SCHEDTRACE_EVENTS];
+  e->tsc = rdtsc();
+  e->pid = p->pid;
+  e->arg = arg;
+  e->type = type;
+  e->state = p->get_state();
+  safestrcpy(e->name, p->name, sizeof(e->name));
+}
+
+// Fill in the header of a trace of the rings as they are now.
+static void
+fill_header(schedtrace_header *hdr)
+{
+  u64 off = HEADER_SZ;
+  hdr->ncpus = NCPU;
+  hdr->cpuhz = cpuhz;
+  for (int c = 0; c < NCPU; c++) {
+    u64 head = c < ncpu ? trace_rings[c].head : 0;
+    u64 count = head < SCHEDTRACE_EVENTS ? head : SCHEDTRACE_EVENTS;
+    hdr->cpu[c].offset = off;
+    hdr->cpu[c].count = count;
+    hdr->cpu[c].dropped = head - count;
+    off += count * sizeof(schedtrace_event);
+  }
+}
+
+static int
+traceread(mdev*, char *dst, u32 off, u32 n)
+{
+  char *hbuf = (char*) kmalloc(HEADER_SZ, "schedtrace header");
+  if (!hbuf)
+    return -1;
+  schedtrace_header *hdr = (schedtrace_header*) hbuf;
+  fill_header(hdr);
+
+  u32 done = 0;
+  if (off < HEADER_SZ) {
+    u32 cc = MIN(HEADER_SZ - off, n);
+    memmove(dst, hbuf + off, cc);
+    done += cc;
+  }
+
+  for (int c = 0; c < ncpu && done < n; c++) {
+    u64 start = hdr->cpu[c].offset;
+    u64 end = start + hdr->cpu[c].count * sizeof(schedtrace_event);
+    u64 first = trace_rings[c].head - hdr->cpu[c].count;
+    const char *ring = (const char*) trace_rings[c].events;
+    // Copy the part of [start, end) that [off+done, off+n) covers, from
+    // the ring, where the section's bytes begin at event first.
+    while (done < n && off + done >= start && off + done < end) {
+      u64 pos = (first * sizeof(schedtrace_event) + (off + done - start))
+        % RING_SZ;
+      u64 cc = MIN(MIN(end - (off + done), RING_SZ - pos), n - done);
+      memmove(dst + done, ring + pos, cc);
+      done += cc;
+    }
+  }
+
+  kmfree(hbuf, HEADER_SZ);
+  return done;
+}
+
+static void
+tracestat(mdev*, struct stat *st)
+{
+  u64 sz = HEADER_SZ;
+  for (int c = 0; c < ncpu; c++) {
+    u64 head = trace_rings[c].head;
+    sz += (head < SCHEDTRACE_EVENTS ? head : SCHEDTRACE_EVENTS) *
+      sizeof(schedtrace_event);
+  }
+  st->st_size = sz;
+}
+
+// "1" clears the rings and starts tracing; "0" stops it.
+static int
+tracewrite(mdev*, const char *buf, u32 n)
+{
+  if (n < 1 || (buf[0] != '0' && buf[0] != '1'))
+    return -1;
+
+  scoped_acquire l(&ctl_lock);
+  tracing.store(false);
+  if (buf[0] == '0')
+    return n;
+
+  for (int c = 0; c < ncpu; c++) {
+    if (!trace_rings[c].events) {
+      trace_rings[c].events =
+        (schedtrace_event*) kalloc("schedtrace", RING_SZ);
+      if (!trace_rings[c].events)
+        return -1;
+    }
+    trace_rings[c].head = 0;
+  }
+  tracing.store(true);
+  return n;
+}
+
+void
+initschedtrace(void)
+{
+  devsw[MAJ_SCHEDTRACE].pread = traceread;
+  devsw[MAJ_SCHEDTRACE].write = tracewrite;
+  devsw[MAJ_SCHEDTRACE].stat = tracestat;
+}
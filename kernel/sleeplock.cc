@@ -0,0 +1,47 @@
+// The contended path of sleeplock acquire (see sleeplock.hh).
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include "cpu.hh"
+#include "sleeplock.hh"
+
+// Is the lock's holder running on another core right now?  This only
+// compares owner_ with what that core is running, so it never touches a
+// proc that may have exited.
+bool
+sleeplock::owner_running()
+{
+  proc *p = owner_.load(std::memory_order_relaxed);
+  int c = owner_cpu_.load(std::memory_order_relaxed);
+  if (!p || c < 0 || c == myid())
+    return false;
+  return cpus[c].proc == p;
+}
+
+void
+sleeplock::acquire_contended()
+{
+  for (u64 i = 0; i < SLEEPLOCK_SPIN; i++) {
+    if (!held_.load(std::memory_order_acquire)) {
+      scoped_acquire x(&spinlock_);
+      if (!held_) {
+        take();
+        lockstat_sleeplock(&spinlock_, false);
+        return;
+      }
+    } else if (!owner_running()) {
+      break;
+    }
+    nop_pause();
+  }
+
+  scoped_acquire x(&spinlock_);
+  bool slept = false;
+  while (held_) {
+    cv_.sleep(&spinlock_);
+    slept = true;
+  }
+  take();
+  lockstat_sleeplock(&spinlock_, slept);
+}
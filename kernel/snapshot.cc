@@ -0,0 +1,515 @@
+// Point-in-time snapshots of the in-memory file system, for backups.
+//
+// Taking a snapshot copies nothing; it just picks a cutoff time stamp.
+// After that, the first change to each directory entry, file size and
+// file page saves the value it is about to overwrite, while holding
+// whatever orders it against other changes to the same thing (the
+// directory's bucket lock, or the file's resizer).  A reader of the
+// snapshot looks at the current value first and only then at the saved
+// one: a change that came in between saved the old value before making
+// the new one visible, so either way the reader ends up with the value
+// as of the cutoff, and writers never wait for it.
+//
+// The mnodes of names unlinked since the cutoff stay pinned in memory,
+// so that the snapshot can still reach them and their pages.
+//
+// Stores through a writable MAP_SHARED mapping don't go through
+// writem(), so they aren't preserved, and a write() that was already
+// copying into a page when the snapshot was taken may show up in it in
+// part.  Directory changes are never torn like that: they happen under a
+// spinlock, and snapshot_create() waits for the ones in flight.
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include "mnode.hh"
+#include "mfs.hh"
+#include "file.hh"
+#include "fs.h"
+#include "kalloc.hh"
+#include "ipi.hh"
+#include "hpet.hh"
+#include "snapshot.hh"
+#include <uk/stat.h>
+
+#include <algorithm>
+
+namespace {
+  // The entries of a directory that changed since the cutoff, as they were
+  // then: an mnode number, or 0 if there was no such name.
+  struct snap_dir {
+    NEW_DELETE_OPS(snap_dir);
+    snap_dir(sref<mnode> d) : dir(d), old(4) {}
+
+    const sref<mnode> dir;
+    splithash<fsname, u64> old;
+  };
+
+  // The size of a file at the cutoff, once it has changed, and copies of
+  // the pages that were written to or truncated away since.
+  struct snap_file {
+    static const u64 unchanged = ~0ull;
+
+    NEW_DELETE_OPS(snap_file);
+    snap_file(sref<mnode> f) : file(f), size(unchanged), pages(4) {}
+    ~snap_file() {
+      pages.enumerate([](const u64 &idx, page_info *pi) {
+          pi->dec();
+          return false;
+        });
+    }
+
+    const sref<mnode> file;
+    std::atomic<u64> size;
+    splithash<u64, page_info*> pages;
+  };
+}
+
+class snapshot : public referenced, public rcu_freed
+{
+public:
+  snapshot()
+    : rcu_freed("snapshot", this, sizeof(*this)), cutoff_(0),
+      broken_(false), dirs_(16), files_(16) {}
+  ~snapshot();
+  NEW_DELETE_OPS(snapshot);
+  void do_gc() override { delete this; }
+
+  // Whether a change happening now comes after the cutoff.  The cutoff is
+  // set right after the snapshot is published, so this only spins if the
+  // change raced with snapshot_create().
+  bool after_cutoff() {
+    u64 now = get_tsc();
+    u64 t;
+    while (!(t = cutoff_))
+      nop_pause();
+    return now > t;
+  }
+
+  snap_dir *dir(mdir *d);
+  snap_file *file(mfile *f);
+  void pin(sref<mnode> m);
+  void set_broken() { broken_ = true; }
+  bool broken() const { return broken_; }
+
+  // Reading the file system as of the cutoff.
+  bool lookup(const mdir *d, const fsname &name, u64 *mnum) const;
+  sref<mnode> namei(sref<mnode> cwd, const char *path) const;
+  std::vector<std::pair<fsname, u64>> entries(const mdir *d) const;
+  u64 size(mfile *f) const;
+  s64 read(mfile *f, char *buf, u64 off, u64 n) const;
+
+private:
+  friend int snapshot_create(void);
+
+  std::atomic<u64> cutoff_;
+  // Set once the snapshot can't be trusted any more: a change could not
+  // save what it overwrote, or the snapshot was dropped and stopped
+  // tracking changes.  Reads fail from then on.
+  std::atomic<bool> broken_;
+  splithash<u64, snap_dir*> dirs_;
+  splithash<u64, snap_file*> files_;
+  spinlock pins_lock_;
+  std::vector<sref<mnode>> pins_;
+
+protected:
+  void onzero() override { gc_delayed(this); }
+};
+
+// The current snapshot, holding a reference to it.  Serialized by
+// snapshot_lock.
+static std::atomic<snapshot*> the_snapshot;
+static sleeplock snapshot_lock;
+
+static sref<snapshot>
+current_snapshot()
+{
+  sref<snapshot> s;
+  if (!the_snapshot.load(std::memory_order_relaxed))
+    return s;
+  // The gc epoch keeps a snapshot that is being dropped allocated until
+  // init() has seen that its count is zero.
+  scoped_gc_epoch e;
+  snapshot *p = the_snapshot;
+  if (p)
+    s.init(p);
+  return s;
+}
+
+snapshot::~snapshot()
+{
+  dirs_.enumerate([](const u64 &mnum, snap_dir *sd) {
+      delete sd;
+      return false;
+    });
+  files_.enumerate([](const u64 &mnum, snap_file *sf) {
+      delete sf;
+      return false;
+    });
+}
+
+snap_dir *
+snapshot::dir(mdir *d)
+{
+  snap_dir *sd;
+  if (dirs_.lookup(d->mnum_, &sd))
+    return sd;
+  sd = new snap_dir(sref<mnode>::newref(d));
+  if (!dirs_.insert(d->mnum_, sd)) {
+    delete sd;
+    dirs_.lookup(d->mnum_, &sd);
+  }
+  return sd;
+}
+
+snap_file *
+snapshot::file(mfile *f)
+{
+  snap_file *sf;
+  if (files_.lookup(f->mnum_, &sf))
+    return sf;
+  sf = new snap_file(sref<mnode>::newref(f));
+  if (!files_.insert(f->mnum_, sf)) {
+    delete sf;
+    files_.lookup(f->mnum_, &sf);
+  }
+  return sf;
+}
+
+void
+snapshot::pin(sref<mnode> m)
+{
+  auto l = pins_lock_.guard();
+  pins_.push_back(std::move(m));
+}
+
+bool
+snapshot::lookup(const mdir *d, const fsname &name, u64 *mnum) const
+{
+  if (name == ".") {
+    *mnum = d->mnum_;
+    return true;
+  }
+
+  u64 cur = 0;
+  bool found = d->map_.lookup(name, &cur);
+  if (!found) {
+    d->probe(name);
+    found = d->map_.lookup(name, &cur);
+  }
+
+  snap_dir *sd;
+  u64 old;
+  if (dirs_.lookup(d->mnum_, &sd) && sd->old.lookup(name, &old)) {
+    *mnum = old;
+    return old != 0;
+  }
+  *mnum = cur;
+  return found;
+}
+
+sref<mnode>
+snapshot::namei(sref<mnode> cwd, const char *path) const
+{
+  sref<mnode> m = *path == '/' ? root_fs->mget(root_mnum) : cwd;
+  fsname name;
+  int r = 0;
+  while (m && (r = skipelem(&path, &name)) == 1) {
+    u64 mnum;
+    if (m->type() != mnode::types::dir || !lookup(m->as_dir(), name, &mnum))
+      return sref<mnode>();
+    m = m->fs_->mget(mnum);
+  }
+  if (r == -1)
+    return sref<mnode>();
+  return m;
+}
+
+std::vector<std::pair<fsname, u64>>
+snapshot::entries(const mdir *d) const
+{
+  std::vector<std::pair<fsname, u64>> v;
+  v.emplace_back(fsname("."), d->mnum_);
+
+  d->load_all();
+  fsname name;
+  u64 mnum;
+  for (const fsname *prev = nullptr; d->map_.enumerate(prev, &name, &mnum);
+       prev = &v.back().first)
+    v.emplace_back(name, mnum);
+
+  // Look for saved entries only now, after reading the current ones.  A
+  // name can come up twice, from both, but then with the same mnode.
+  snap_dir *sd;
+  if (dirs_.lookup(d->mnum_, &sd)) {
+    for (size_t i = 1; i < v.size(); i++)
+      sd->old.lookup(v[i].first, &v[i].second);
+    const fsname *prev = nullptr;
+    while (sd->old.enumerate(prev, &name, &mnum)) {
+      v.emplace_back(name, mnum);
+      prev = &v.back().first;
+    }
+  }
+
+  std::sort(v.begin(), v.end(),
+            [](const std::pair<fsname, u64> &a,
+               const std::pair<fsname, u64> &b) {
+              return a.first < b.first;
+            });
+  size_t n = 0;
+  for (size_t i = 0; i < v.size(); i++) {
+    if (v[i].second == 0 || (n && v[n - 1].first == v[i].first))
+      continue;
+    if (n != i)
+      v[n] = std::move(v[i]);
+    n++;
+  }
+  v.erase(v.begin() + n, v.end());
+  return v;
+}
+
+u64
+snapshot::size(mfile *f) const
+{
+  u64 size = *f->read_size();
+  snap_file *sf;
+  if (files_.lookup(f->mnum_, &sf)) {
+    u64 old = sf->size;
+    if (old != snap_file::unchanged)
+      size = old;
+  }
+  return size;
+}
+
+s64
+snapshot::read(mfile *f, char *buf, u64 off, u64 n) const
+{
+  u64 fsize = size(f);
+  if (off >= fsize)
+    return 0;
+  n = std::min(n, fsize - off);
+
+  u64 done = 0;
+  while (done < n) {
+    u64 pos = off + done;
+    u64 pgoff = PGOFFSET(pos);
+    u64 len = std::min(PGSIZE - pgoff, n - done);
+    bool have = false;
+
+    sref<page_info> pi = f->get_page(pos / PGSIZE).get_page_info();
+    if (pi) {
+      memmove(buf + done, (const char*)pi->va() + pgoff, len);
+      have = true;
+    }
+    snap_file *sf;
+    page_info *old;
+    if (files_.lookup(f->mnum_, &sf) && sf->pages.lookup(pos / PGSIZE, &old)) {
+      memmove(buf + done, (const char*)old->va() + pgoff, len);
+      have = true;
+    }
+    if (!have)
+      break;
+    done += len;
+  }
+
+  if (broken_)
+    return -1;
+  return done;
+}
+
+void
+snapshot_dir_observer(void *dir, const fsname& name, const u64 *old)
+{
+  sref<snapshot> s = current_snapshot();
+  if (!s || !s->after_cutoff())
+    return;
+  // Only the first change since the cutoff gets to save its old value.
+  s->dir(static_cast<mdir*>(dir))->old.insert(name, old ? *old : 0);
+}
+
+void
+snapshot_unlinked(sref<mnode> m)
+{
+  sref<snapshot> s = current_snapshot();
+  if (s)
+    s->pin(std::move(m));
+}
+
+void
+snapshot_page_write(mfile *mf, u64 pageidx, page_info *pi)
+{
+  sref<snapshot> s = current_snapshot();
+  if (!s || !s->after_cutoff())
+    return;
+
+  snap_file *sf = s->file(mf);
+  u64 old = sf->size;
+  if (sf->pages.lookup(pageidx) ||
+      (old != snap_file::unchanged && pageidx * PGSIZE >= old))
+    return;
+
+  char *p = kalloc("snapshot page");
+  if (!p) {
+    s->set_broken();
+    return;
+  }
+  memmove(p, pi->va(), PGSIZE);
+  page_info *copy = new (page_info::of(p)) page_info();
+  if (!sf->pages.insert(pageidx, copy))
+    copy->dec();
+}
+
+void
+snapshot_resize(mfile *mf, u64 oldsize, u64 newsize)
+{
+  sref<snapshot> s = current_snapshot();
+  if (!s || !s->after_cutoff())
+    return;
+
+  snap_file *sf = s->file(mf);
+  u64 unchanged = snap_file::unchanged;
+  sf->size.compare_exchange_strong(unchanged, oldsize);
+
+  // Hold on to the pages that a shrink is about to drop, reading them in
+  // first if they aren't in memory.
+  u64 end = PGROUNDUP(std::min(oldsize, sf->size.load())) / PGSIZE;
+  for (u64 i = PGROUNDUP(newsize) / PGSIZE; i < end; i++) {
+    if (sf->pages.lookup(i))
+      continue;
+    sref<page_info> pi = mf->get_page(i, false).get_page_info();
+    if (!pi) {
+      s->set_broken();
+      continue;
+    }
+    if (sf->pages.insert(i, pi.get()))
+      pi.transfer_to_ptr();
+  }
+}
+
+int
+snapshot_create(void)
+{
+  auto l = snapshot_lock.guard();
+  if (the_snapshot)
+    return -1;
+
+  snapshot *s = new snapshot();
+  {
+    scoped_cli cli;
+    the_snapshot = s;
+    s->cutoff_ = get_tsc();
+  }
+
+  // A directory change that came before the cutoff may still be in its
+  // critical section, with interrupts off.  Wait for all of them to
+  // finish, so that the snapshot's readers see them.
+  bitset<NCPU> targets;
+  for (int i = 0; i < ncpu; i++)
+    targets.set(i);
+  run_on_cpus(targets, []() {});
+  return 0;
+}
+
+int
+snapshot_drop(void)
+{
+  auto l = snapshot_lock.guard();
+  snapshot *s = the_snapshot.exchange(nullptr);
+  if (!s)
+    return -1;
+  s->set_broken();
+  s->dec();
+  return 0;
+}
+
+sref<file>
+snapshot_open(sref<mnode> cwd, const char *path)
+{
+  sref<snapshot> s = current_snapshot();
+  if (!s)
+    return sref<file>();
+  sref<mnode> m = s->namei(cwd, path);
+  if (!m || (m->type() != mnode::types::file &&
+             m->type() != mnode::types::dir))
+    return sref<file>();
+  return make_sref<file_snapshot>(s, m);
+}
+
+file_snapshot::file_snapshot(sref<snapshot> s, sref<mnode> m)
+  : snap_(s), m_(m), off_(0), have_entries_(false)
+{
+}
+
+void
+file_snapshot::onzero()
+{
+  delete this;
+}
+
+int
+file_snapshot::stat(struct stat *st, enum stat_flags flags)
+{
+  if (stat_mnode(m_, st, flags) < 0)
+    return -1;
+  if (m_->type() == mnode::types::file)
+    st->st_size = snap_->size(m_->as_file());
+  return 0;
+}
+
+ssize_t
+file_snapshot::read(char *addr, size_t n)
+{
+  if (m_->type() != mnode::types::file)
+    return -1;
+  auto l = off_lock_.guard();
+  ssize_t r = snap_->read(m_->as_file(), addr, off_, n);
+  if (r > 0)
+    off_ += r;
+  return r;
+}
+
+ssize_t
+file_snapshot::pread(char *addr, size_t n, off_t offset)
+{
+  if (m_->type() != mnode::types::file || offset < 0)
+    return -1;
+  return snap_->read(m_->as_file(), addr, offset, n);
+}
+
+ssize_t
+file_snapshot::fill_dirents(char *b, size_t len)
+{
+  if (m_->type() != mnode::types::dir)
+    return -1;
+
+  auto l = off_lock_.guard();
+  if (!have_entries_) {
+    entries_ = snap_->entries(m_->as_dir());
+    have_entries_ = true;
+  }
+
+  size_t n = 0;
+  for (; off_ < entries_.size(); off_++) {
+    const fsname &name = entries_[off_].first;
+    u64 mnum = entries_[off_].second;
+    size_t namelen = name.size();
+    size_t reclen = (offsetof(xv6_dirent, d_name) + namelen + 1 + 7) & ~7;
+    if (n + reclen > len) {
+      if (n == 0)
+        return -1;              // EINVAL: buffer too small
+      break;
+    }
+
+    xv6_dirent *de = (xv6_dirent*)(b + n);
+    memset(de, 0, reclen);
+    de->d_ino = mnum;
+    de->d_reclen = reclen;
+    de->d_type = mnode::type_of(mnum);
+    memmove(de->d_name, name.c_str(), namelen);
+    n += reclen;
+  }
+
+  if (snap_->broken())
+    return -1;
+  return n;
+}
@@ -4,8 +4,94 @@
 #include "cpputil.hh"
 #include "spinlock.hh"
 #include "sperf.hh"
+#include "file.hh"
+#include "kstream.hh"
+#include "major.h"
 
 using namespace scopedperf;
 
 static tsc_ctr tsc;
 ctrgroup_chain<tsc_ctr> perfgroup(&tsc);
+
+bool sperf_regions_on;
+bool sperf_regions_pmcs;
+
+static sperf_pmc_ctr instructions(2, "instructions");
+static sperf_pmc_ctr llc_misses(3, "llc-misses");
+static ctrgroup_chain<tsc_ctr, sperf_pmc_ctr, sperf_pmc_ctr>
+  regiongroup(&tsc, &instructions, &llc_misses);
+
+// /dev/perfregions prints these, so scopedperf's printall doesn't.
+#define X(name) \
+  sperf_sum sperf_##name(&regiongroup, #name, perfsum_base::hide);
+SPERF_REGIONS(X)
+#undef X
+
+static sperf_sum *const regions[] = {
+#define X(name) &sperf_##name,
+  SPERF_REGIONS(X)
+#undef X
+};
+
+static spinlock regions_lock("perfregions");
+
+// Usage: cat /dev/perfregions
+static int
+perfregions_read(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+
+  s.println("regions ", sperf_regions_on ? "on" : "off",
+            sperf_regions_pmcs ? "" : " (no PMU counters)");
+  s.println("region calls cycles instructions llc-misses cycles/call ipc");
+  for (auto r : regions) {
+    u64 calls = r->get_count();
+    u64 cycles = r->get_sum(0), insts = r->get_sum(1);
+    u64 ipc100 = cycles ? insts * 100 / cycles : 0;
+    s.println(r->get_name(), " ", calls, " ", cycles, " ", insts, " ",
+              r->get_sum(2), " ", calls ? cycles / calls : 0, " ",
+              ipc100 / 100, ".", sfmt(ipc100 % 100).width(2).pad());
+  }
+  return s.get_used();
+}
+
+// Usage: echo on|off|reset > /dev/perfregions
+// Turning the regions on also clears them.
+static int
+perfregions_write(mdev*, const char *buf, u32 n)
+{
+  auto is = [&](const char *cmd) {
+    u32 len = strlen(cmd);
+    return n >= len && strncmp(buf, cmd, len) == 0;
+  };
+  auto l = regions_lock.guard();
+
+  if (is("on")) {
+    if (sperf_regions_on)
+      return n;
+    for (auto r : regions)
+      r->reset();
+    // The counters keep their values when they're turned off, so
+    // regions still running then see sane deltas.
+    if (sampregions(true))
+      sperf_regions_pmcs = true;
+    sperf_regions_on = true;
+  } else if (is("off")) {
+    sperf_regions_on = false;
+    if (sperf_regions_pmcs)
+      sampregions(false);
+  } else if (is("reset")) {
+    for (auto r : regions)
+      r->reset();
+  } else {
+    return -1;
+  }
+  return n;
+}
+
+void
+initsperf(void)
+{
+  devsw[MAJ_PERFREGIONS].pread = perfregions_read;
+  devsw[MAJ_PERFREGIONS].write = perfregions_write;
+}
@@ -11,6 +11,10 @@
 #include "fs.h"
 #include "file.hh"
 #include "major.h"
+#include "kstream.hh"
+
+#include <algorithm>
+#include <vector>
 
 #if LOCKSTAT
 // The klockstat structure pointed to by spinlocks that want lockstat,
@@ -114,12 +118,26 @@ releasing(struct spinlock *lk)
 #endif
 }
 
+void
+lockstat_sleeplock(struct spinlock *lk, bool slept)
+{
+#if LOCKSTAT
+  if (lockstat_enable && lk->stat != nullptr && lk->stat != &klockstat_lazy) {
+    struct cpulockstat *s = mylockstat(lk);
+    if (slept)
+      s->sleeps++;
+    else
+      s->spins++;
+  }
+#endif
+}
+
 // Check whether this cpu is holding the lock.
 #if SPINLOCK_DEBUG
 bool
 spinlock::holding()
 {
-  return locked && cpu == mycpu();
+  return (locked & LOCKED) && cpu == mycpu();
 }
 #endif
 
@@ -281,6 +299,157 @@ initlockstat(void)
 }
 #endif
 
+// The contention profiler.  Unlike lockstat, it's cheap enough to leave
+// on: an acquire that gets the lock right away doesn't touch it, and one
+// that has to wait only bumps a per-core counter, except for every
+// LOCKPROF_SAMPLE'th, which is timed and charged to the lock and the
+// code that acquired it.  Spinlocks have no names outside of debug
+// builds, so sites are identified by the lock's address and the return
+// address of the acquire; the lock that waited is looked up in the
+// symbol table from the latter.
+//
+// Each core has a small hash table of sites, which only it updates, with
+// interrupts disabled.  Sites that don't fit are only counted.
+
+namespace {
+  enum {
+    // Sites per core.  A power of two.
+    LOCKPROF_SITES = 64,
+  };
+
+  struct lockprof_site
+  {
+    const spinlock *lk;
+    const void *rip;
+    u64 samples;
+    u64 cycles;                 // Total time waited in the samples
+    u64 max;                    // Longest wait in the samples
+  };
+
+  struct lockprof_cpu
+  {
+    u64 contended;              // Acquisitions that had to wait
+    u64 dropped;                // Samples for which there was no site
+    u64 clear_gen;              // Last clear this core has seen
+    lockprof_site sites[LOCKPROF_SITES];
+  } __mpalign__;
+}
+
+static lockprof_cpu lockprofs[NCPU];
+static std::atomic<u64> lockprof_clear_gen;
+
+// Start timing a contended acquisition, if it's to be sampled.  Returns
+// the start time, or 0.  Called with interrupts disabled.
+static inline u64
+lockprof_begin(void)
+{
+  if (!LOCKPROF_SAMPLE)
+    return 0;
+  lockprof_cpu *p = &lockprofs[mycpu()->id];
+  if (++p->contended % LOCKPROF_SAMPLE)
+    return 0;
+  return rdtsc();
+}
+
+static void
+lockprof_record(const spinlock *lk, const void *rip, u64 cycles)
+{
+  lockprof_cpu *p = &lockprofs[mycpu()->id];
+  u64 gen = lockprof_clear_gen.load(std::memory_order_relaxed);
+  if (p->clear_gen != gen) {
+    memset(p->sites, 0, sizeof(p->sites));
+    p->dropped = 0;
+    p->clear_gen = gen;
+  }
+
+  u32 h = ((uptr)lk >> 4) ^ ((uptr)rip * 0x9e3779b1);
+  for (u32 i = 0; i < LOCKPROF_SITES; i++) {
+    lockprof_site *s = &p->sites[(h + i) % LOCKPROF_SITES];
+    if (!s->lk) {
+      s->lk = lk;
+      s->rip = rip;
+    } else if (s->lk != lk || s->rip != rip) {
+      continue;
+    }
+    s->samples++;
+    s->cycles += cycles;
+    s->max = std::max(s->max, cycles);
+    return;
+  }
+  p->dropped++;
+}
+
+// Finish timing a contended acquisition begun with lockprof_begin().
+static inline void
+lockprof_end(const spinlock *lk, u64 start, const void *rip)
+{
+  if (start)
+    lockprof_record(lk, rip, rdtsc() - start);
+}
+
+// Usage: cat /dev/lockprof
+// Prints the sites, most time waited first.  Writing anything to it
+// clears them.
+static int
+lockprof_read(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  std::vector<lockprof_site> sites;
+  u64 contended = 0, dropped = 0;
+  u64 gen = lockprof_clear_gen.load(std::memory_order_relaxed);
+
+  for (int c = 0; c < ncpu; c++) {
+    contended += lockprofs[c].contended;
+    // Cores that haven't sampled anything since the last clear still
+    // have the sites from before it.
+    if (lockprofs[c].clear_gen != gen)
+      continue;
+    dropped += lockprofs[c].dropped;
+    for (auto &site : lockprofs[c].sites) {
+      lockprof_site snap = site;
+      if (!snap.lk)
+        continue;
+      auto it = sites.begin();
+      while (it != sites.end() && (it->lk != snap.lk || it->rip != snap.rip))
+        it++;
+      if (it == sites.end()) {
+        sites.push_back(snap);
+      } else {
+        it->samples += snap.samples;
+        it->cycles += snap.cycles;
+        it->max = std::max(it->max, snap.max);
+      }
+    }
+  }
+  std::sort(sites.begin(), sites.end(),
+            [](const lockprof_site &a, const lockprof_site &b) {
+              return a.cycles > b.cycles;
+            });
+
+  s.println("contended ", contended, " sampled 1/", LOCKPROF_SAMPLE,
+            " dropped ", dropped);
+  s.println("lock caller samples cycles max-cycles");
+  for (auto &site : sites)
+    s.println((void*)site.lk, " ", site.rip, " ", site.samples, " ",
+              site.cycles, " ", site.max);
+  return s.get_used();
+}
+
+static int
+lockprof_write(mdev*, const char *buf, u32 n)
+{
+  // Each core clears its own sites the next time it samples.
+  lockprof_clear_gen++;
+  return n;
+}
+
+void
+initlockprof(void)
+{
+  devsw[MAJ_LOCKPROF].pread = lockprof_read;
+  devsw[MAJ_LOCKPROF].write = lockprof_write;
+}
+
 spinlock::spinlock(spinlock &&o)
 #if USE_CODEX_IMPL
   : locked(o.locked)
@@ -369,12 +538,105 @@ spinlock::release()
   popcli();
 }
 #else
+// A waiter's node in the queue of a queued spinlock.  Each CPU has one
+// node per context that can be waiting for a lock at once (with
+// interrupts disabled, that can only be an NMI handler); beyond that, a
+// waiter spins on the lock word like a test-and-set lock.
+struct qnode {
+  std::atomic<qnode*> next;
+  std::atomic<bool> head;       // next waiter to take the lock
+} __mpalign__;
+
+enum { QNODES = 4 };
+static struct {
+  qnode nodes[QNODES];
+  u32 depth;                    // nodes in use
+} __mpalign__ qnodes[NCPU];
+
+// Take a queued lock, which was not free.  Returns the number of
+// retries, for lockstat.
+u64
+spinlock::acquire_queued()
+{
+  u64 retries = 0;
+  int c = mycpu()->id;
+  u32 idx = qnodes[c].depth++;
+  u32 v;
+
+  if (idx >= QNODES) {
+    for (;;) {
+      v = locked.load(std::memory_order_relaxed);
+      if (!(v & LOCKED) &&
+          locked.compare_exchange_weak(v, v | LOCKED, std::memory_order_acquire))
+        break;
+      retries++;
+      nop_pause();
+    }
+    qnodes[c].depth--;
+    return retries;
+  }
+
+  qnode *node = &qnodes[c].nodes[idx];
+  node->next.store(nullptr, std::memory_order_relaxed);
+  node->head.store(false, std::memory_order_relaxed);
+  u32 tail = (((u32)c + 1) * QNODES + idx) << TAIL_SHIFT;
+  u32 tail_mask = ~((1u << TAIL_SHIFT) - 1);
+
+  // Become the last waiter, and link behind the previous one.
+  v = locked.load(std::memory_order_relaxed);
+  while (!locked.compare_exchange_weak(v, (v & ~tail_mask) | tail,
+                                       std::memory_order_acq_rel))
+    ;
+  if (v & tail_mask) {
+    u32 prev = (v >> TAIL_SHIFT) - QNODES;
+    qnodes[prev / QNODES].nodes[prev % QNODES].next.store(
+      node, std::memory_order_release);
+    while (!node->head.load(std::memory_order_acquire)) {
+      retries++;
+      nop_pause();
+    }
+  }
+
+  // We're at the head of the queue, so only we spin on the lock word.
+  for (;;) {
+    v = locked.load(std::memory_order_acquire);
+    if (v & LOCKED) {
+      retries++;
+      nop_pause();
+      continue;
+    }
+    if ((v & tail_mask) == tail) {
+      // Nobody is behind us, so empty the queue.
+      if (locked.compare_exchange_weak(v, (v & ~tail_mask) | LOCKED,
+                                       std::memory_order_acquire))
+        break;
+      continue;
+    }
+    if (locked.compare_exchange_weak(v, v | LOCKED, std::memory_order_acquire)) {
+      qnode *next;
+      while (!(next = node->next.load(std::memory_order_acquire)))
+        nop_pause();
+      next->head.store(true, std::memory_order_release);
+      break;
+    }
+  }
+  qnodes[c].depth--;
+  return retries ? retries : 1;
+}
+
 bool
 spinlock::try_acquire()
 {
   pushcli();
   locking(this);
-  if (locked.exchange(1, std::memory_order_acquire) != 0) {
+  u32 v = locked.load(std::memory_order_relaxed);
+  if (v & QUEUED) {
+    if ((v & LOCKED) ||
+        !locked.compare_exchange_strong(v, v | LOCKED, std::memory_order_acquire)) {
+      popcli();
+      return false;
+    }
+  } else if (locked.exchange(1, std::memory_order_acquire) != 0) {
       popcli();
       return false;
   }
@@ -395,9 +657,22 @@ spinlock::acquire()
   locking(this);
 
   retries = 0;
-  while (locked.exchange(1, std::memory_order_acquire) != 0) {
-    retries++;
-    nop_pause();
+  u32 v = locked.load(std::memory_order_relaxed);
+  if (v & QUEUED) {
+    if (v != QUEUED ||
+        !locked.compare_exchange_strong(v, QUEUED | LOCKED,
+                                        std::memory_order_acquire)) {
+      u64 start = lockprof_begin();
+      retries = acquire_queued();
+      lockprof_end(this, start, __builtin_return_address(0));
+    }
+  } else if (locked.exchange(1, std::memory_order_acquire) != 0) {
+    u64 start = lockprof_begin();
+    do {
+      retries++;
+      nop_pause();
+    } while (locked.exchange(1, std::memory_order_acquire) != 0);
+    lockprof_end(this, start, __builtin_return_address(0));
   }
   ::locked(this, retries);
 }
@@ -408,7 +683,10 @@ spinlock::release()
 {
   releasing(this);
 
-  locked.store(0, std::memory_order_release);
+  if (locked.load(std::memory_order_relaxed) & QUEUED)
+    locked.fetch_and(~(u32)LOCKED, std::memory_order_release);
+  else
+    locked.store(0, std::memory_order_release);
 
   popcli();
 }
@@ -8,6 +8,8 @@
 #include "cpu.hh"
 #include "kmtrace.hh"
 #include "errno.h"
+#include "sperf.hh"
+#include <uk/syscall_batch.h>
 
 extern "C" int __uaccess_mem(void* dst, const void* src, u64 size);
 extern "C" int __uaccess_str(char* dst, const char* src, u64 size);
@@ -114,7 +116,12 @@ syscall(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
         mtrec();
         {
           mt_ascope ascope("syscall:%ld", num);
+          SPERF_REGION(syscall);
+          // Calls that throw aren't counted.
+          u64 start = syscallstats_enabled ? rdtsc() : 0;
           r = syscalls[num](a0, a1, a2, a3, a4, a5);
+          if (start)
+            syscallstats_record(num, rdtsc() - start);
         }
         mtstop(myproc());
         mtign();
@@ -135,3 +142,56 @@ syscall(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
 #endif
   }
 }
+
+int sys_fork_flags(int flags);
+int sys_execv(userptr_str upath, userptr<userptr_str> uargv);
+void sys_exit(int status);
+void sys_halt(void);
+long sys_syscall_batch(userptr<struct syscall_batch_entry> ents, size_t n);
+
+// fork would return into the child at the batch's return, and exec
+// replaces the trap frame the rest of the batch would return to.
+static bool
+batchable(u64 num)
+{
+  auto fn = syscalls[num];
+  return fn != (decltype(fn))sys_fork_flags &&
+    fn != (decltype(fn))sys_execv &&
+    fn != (decltype(fn))sys_exit &&
+    fn != (decltype(fn))sys_halt &&
+    fn != (decltype(fn))sys_syscall_batch;
+}
+
+// Run a vector of system calls for the price of one kernel entry.
+// Each entry goes through syscall(), so it is traced, counted, and
+// retried on allocation failure just as if it had been made alone.
+//SYSCALL
+long
+sys_syscall_batch(userptr<struct syscall_batch_entry> ents, size_t n)
+{
+  if (n > SYSCALL_BATCH_MAX)
+    return -1;
+
+  size_t i;
+  for (i = 0; i < n; i++) {
+    struct syscall_batch_entry e;
+    if (!(ents + i).load(&e))
+      break;
+    if (e.num < nsyscalls && syscalls[e.num] && batchable(e.num))
+      e.ret = syscall(e.args[0], e.args[1], e.args[2], e.args[3],
+                      e.args[4], e.args[5], e.num);
+    else
+      e.ret = -1;
+    userptr<u64> ret((u64*)((uptr)(ents + i) +
+                            __offsetof(struct syscall_batch_entry, ret)));
+    if (!ret.store(&e.ret))
+      break;
+    if (myproc()->killed ||
+        ((e.flags & SYSCALL_BATCH_BARRIER) && (int)e.ret < 0) ||
+        ((e.flags & SYSCALL_BATCH_BARRIER_LONG) && (long)e.ret < 0)) {
+      i++;
+      break;
+    }
+  }
+  return i == 0 && n != 0 ? -1 : i;
+}
@@ -0,0 +1,113 @@
+// System call counts and latency histograms, per core, read through
+// /dev/syscalls (see syscallstats.h).
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include "cpu.hh"
+#include "percpu.hh"
+#include "file.hh"
+#include "major.h"
+#include "kalloc.hh"
+#include "syscallstats.h"
+
+extern u64 cpuhz;
+extern const char* syscall_names[];
+extern const int nsyscalls;
+
+bool syscallstats_enabled = true;
+
+// Like kstats, these are only approximately per core: a process that
+// migrates in the middle of an update may race with the next one.
+DEFINE_PERCPU(syscall_stats, cpu_syscalls, NO_CRITICAL);
+
+void
+syscallstats_record(u64 num, u64 cycles)
+{
+  if (num >= SYSCALL_STATS_MAX)
+    return;
+  syscall_stats *s = cpu_syscalls.get_unchecked();
+  s->count[num]++;
+  s->cycles[num] += cycles;
+  int b = 63 - __builtin_clzll(cycles | 1) - SC_HIST_SHIFT;
+  if (b < 0)
+    b = 0;
+  else if (b >= SC_HIST_BUCKETS)
+    b = SC_HIST_BUCKETS - 1;
+  s->hist[num][b]++;
+}
+
+// The per-core stats are too big to gather into one buffer, so they're
+// copied straight out of the per-core areas.
+static int
+syscallstatsread(mdev*, char *dst, u32 off, u32 n)
+{
+  size_t hdrsz = sizeof(syscallstats_info);
+  size_t sz = hdrsz + ncpu * sizeof(syscall_stats);
+  if (off >= sz)
+    return 0;
+  if (n > sz - off)
+    n = sz - off;
+
+  u32 done = 0;
+  if (off < hdrsz) {
+    syscallstats_info *info =
+      (syscallstats_info*) kmalloc(hdrsz, "syscallstats");
+    if (!info)
+      return -1;
+    memset(info, 0, hdrsz);
+    info->ncpus = ncpu;
+    info->cpuhz = cpuhz;
+    info->enabled = syscallstats_enabled;
+    info->nsyscalls = MIN(nsyscalls, SYSCALL_STATS_MAX);
+    for (u64 i = 0; i < info->nsyscalls; i++) {
+      const char *name = syscall_names[i];
+      if (!name)
+        continue;
+      if (strncmp(name, "sys_", 4) == 0)
+        name += 4;
+      strncpy(info->names[i], name, SYSCALL_NAME_MAX - 1);
+    }
+    done = MIN(n, hdrsz - off);
+    memmove(dst, (char*)info + off, done);
+    kmfree(info, hdrsz);
+  }
+  while (done < n) {
+    size_t pos = off + done - hdrsz;
+    size_t c = pos / sizeof(syscall_stats);
+    size_t coff = pos % sizeof(syscall_stats);
+    u32 cc = MIN(n - done, sizeof(syscall_stats) - coff);
+    memmove(dst + done, (char*)&cpu_syscalls[c] + coff, cc);
+    done += cc;
+  }
+  return n;
+}
+
+// Usage: echo on|off|reset > /dev/syscalls
+static int
+syscallstatswrite(mdev*, const char *buf, u32 n)
+{
+  auto is = [&](const char *cmd) {
+    u32 len = strlen(cmd);
+    return n >= len && strncmp(buf, cmd, len) == 0;
+  };
+
+  if (is("on")) {
+    syscallstats_enabled = true;
+  } else if (is("off")) {
+    syscallstats_enabled = false;
+  } else if (is("reset")) {
+    for (int c = 0; c < ncpu; c++)
+      memset(&cpu_syscalls[c], 0, sizeof(syscall_stats));
+  } else {
+    return -1;
+  }
+  return n;
+}
+
+void
+initsyscallstats(void)
+{
+  devsw[MAJ_SYSCALLS].pread = syscallstatsread;
+  devsw[MAJ_SYSCALLS].write = syscallstatswrite;
+}
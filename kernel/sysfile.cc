@@ -11,6 +11,7 @@
 #include "kmtrace.hh"
 #include "dirns.hh"
 #include "mfs.hh"
+#include "snapshot.hh"
 #include <uk/fcntl.h>
 #include <uk/stat.h>
 #include "kstats.hh"
@@ -27,22 +28,35 @@ getfile(int fd)
   return myproc()->ftable->getfile(fd);
 }
 
+// For the read and write paths: fd's file, for as long as the system
+// call runs, without a reference count bump if this thread has the
+// filetable to itself.
+static fdref
+getfd(int fd)
+{
+  return myproc()->ftable->getfd(fd);
+}
+
 // Allocate a file descriptor for the given file.
-// Takes over file reference from caller on success.
+// Takes over file reference from caller on success.  A threaded
+// process gets an FD from this core's range unless it asks for the
+// lowest one with O_LOWFD.
 int
 fdalloc(sref<file>&& f, int omode)
 {
   if (!f)
     return -1;
-  return myproc()->ftable->allocfd(
-    std::move(f), omode & O_ANYFD, omode & O_CLOEXEC);
+  filetable *ft = myproc()->ftable.get();
+  bool percpu = (omode & O_ANYFD) || (!(omode & O_LOWFD) && ft->threaded());
+  return ft->allocfd(std::move(f), percpu, omode & O_CLOEXEC);
 }
 
 //SYSCALL
 int
 sys_dup(int ofd)
 {
-  return fdalloc(getfile(ofd), 0);
+  // POSIX promises dup() the lowest FD; shells depend on it.
+  return fdalloc(getfile(ofd), O_LOWFD);
 }
 
 //SYSCALL
@@ -144,6 +158,7 @@ sys_close(int fd)
 void
 sys_sync(void)
 {
+  warmlist_save();
   int cpu = myid();
   rootfs_interface->process_metadata_log_and_flush(cpu);
 }
@@ -185,45 +200,190 @@ sys_fsync(int fd)
   return f->fsync();
 }
 
+/*
+ * fdatasync() is like fsync(), except that it skips processing the file's
+ * metadata log when the file already exists on the disk. Only the file's
+ * contents, and its size if that changed, are guaranteed to be on the disk
+ * when it returns.
+ */
 //SYSCALL
-ssize_t
-sys_read(int fd, userptr<void> p, size_t n)
+int
+sys_fdatasync(int fd)
 {
   sref<file> f = getfile(fd);
   if (!f)
     return -1;
+  return f->fdatasync();
+}
 
-  char *b = kalloc("readbuf");
-  if (!b)
+/*
+ * sync_file_range() writes out the dirty pages of the file that overlap
+ * [offset, offset + nbytes), where nbytes == 0 means "till the end of the
+ * file". Pages are written and committed synchronously, so the WAIT flags
+ * have nothing extra to wait for. As with fdatasync(), the file's metadata log
+ * is not processed; the on-disk file size is extended to cover the written
+ * pages, but pending truncates and link changes wait for fsync()/sync().
+ */
+//SYSCALL
+int
+sys_sync_file_range(int fd, off_t offset, off_t nbytes, unsigned int flags)
+{
+  if (offset < 0 || nbytes < 0)
     return -1;
-  auto cleanup = scoped_cleanup([b](){kfree(b);});
-  // XXX(Austin) Too bad
-  if (n > PGSIZE)
-    n = PGSIZE;
-  ssize_t res = f->read(b, n);
-  if (res < 0)
+  if (flags & ~(SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                SYNC_FILE_RANGE_WAIT_AFTER))
     return -1;
-  if (!p.store_bytes(b, res))
+
+  sref<file> f = getfile(fd);
+  if (!f)
     return -1;
-  return res;
+
+  if (!(flags & SYNC_FILE_RANGE_WRITE))
+    return 0;
+  return f->sync_range(offset, nbytes);
 }
 
+// Preallocate disk blocks for [offset, offset + len) of a regular file, like
+// Linux's fallocate() with FALLOC_FL_KEEP_SIZE: the file's size doesn't
+// change, and the blocks read as zeroes until they are written. Writes into
+// the range then need no block allocation when they are synced. Only
+// extent-mapped file systems (mkfs -e) support this.
 //SYSCALL
-ssize_t
-sys_pread(int fd, void *ubuf, size_t count, off_t offset)
+int
+sys_fallocate(int fd, off_t offset, off_t len)
 {
+  if (offset < 0 || len <= 0 || (u64)offset + len > (u64)MAXFILE * BSIZE)
+    return -1;
+
   sref<file> f = getfile(fd);
   if (!f)
     return -1;
+  return f->fallocate(offset, len);
+}
 
-  if (count > 4*1024*1024)
-    count = 4*1024*1024;
+// Store fd's file, which must be empty, compressed (on != 0) or not. Its
+// data is then compressed with zlib as it is synced, ZCHUNK_PAGES pages at
+// a time, and decompressed as it is read back in. Only extent-mapped file
+// systems (mkfs -e) support this.
+//SYSCALL
+int
+sys_set_compression(int fd, int on)
+{
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+  return f->set_compression(on != 0);
+}
 
-  char* b = (char*) kmalloc(count, "preadbuf");
-  auto cleanup = scoped_cleanup([&](){kmfree(b, count);});
-  ssize_t r = f->pread(b, count, offset);
-  if (r > 0)
-    putmem(ubuf, b, r);
+// Make dst_fd's file, which must be empty, a copy of src_fd's that shares
+// its disk blocks. Each block is only copied once one of the files writes
+// to it, so the copy costs about as much as the block map. Only disks made
+// with block refcounts support this.
+//SYSCALL
+int
+sys_clone_file(int src_fd, int dst_fd)
+{
+  sref<file> src = getfile(src_fd);
+  sref<file> dst = getfile(dst_fd);
+  if (!src || !dst)
+    return -1;
+  return dst->clone_from(src.get());
+}
+
+// Take a snapshot of the file system as it is now, for a backup to read
+// through snapshot_open() while everything else goes on changing it.
+// There is only one snapshot at a time, until snapshot_drop().
+//SYSCALL
+int
+sys_snapshot_create(void)
+{
+  return snapshot_create();
+}
+
+//SYSCALL
+int
+sys_snapshot_drop(void)
+{
+  return snapshot_drop();
+}
+
+// Open a file or a directory as it was when the snapshot was taken.  The
+// file descriptor is read-only; getdents() lists a directory.
+//SYSCALL
+int
+sys_snapshot_open(userptr_str path)
+{
+  char path_copy[PATH_MAX];
+  if (!path.load(path_copy, sizeof(path_copy)))
+    return -1;
+
+  sref<file> f = snapshot_open(myproc()->cwd_m, path_copy);
+  if (!f)
+    return -1;
+  return fdalloc(std::move(f), O_RDONLY);
+}
+
+//SYSCALL
+ssize_t
+sys_read(int fd, userptr<void> p, size_t n)
+{
+  fdref f = getfd(fd);
+  if (!f)
+    return -1;
+  return f->read_user(p, n);
+}
+
+//SYSCALL
+ssize_t
+sys_pread(int fd, userptr<void> ubuf, size_t count, off_t offset)
+{
+  fdref f = getfd(fd);
+  if (!f)
+    return -1;
+  return f->pread_user(ubuf, count, offset);
+}
+
+//SYSCALL
+ssize_t
+sys_sendfile(int outfd, int infd, userptr<off_t> uoff, size_t count)
+{
+  sref<file> out = getfile(outfd);
+  sref<file> in = getfile(infd);
+  if (!out || !in)
+    return -1;
+
+  off_t off;
+  if (uoff && !uoff.load(&off))
+    return -1;
+  ssize_t r = in->sendfile(out.get(), uoff ? &off : nullptr, count);
+  if (r >= 0 && uoff && !uoff.store(&off))
+    return -1;
+  return r;
+}
+
+// Move data between two files without copying it through user space.
+// One end should be a pipe: file to pipe hands the pipe page-cache
+// pages, and pipe to anything hands over the pipe's pages.  Unlike
+// sendfile, in may be a pipe.  off_out isn't supported and flags are
+// ignored.
+//SYSCALL
+ssize_t
+sys_splice(int fd_in, userptr<off_t> off_in, int fd_out,
+           userptr<off_t> off_out, size_t len, unsigned int flags)
+{
+  if (off_out)
+    return -1;
+  sref<file> in = getfile(fd_in);
+  sref<file> out = getfile(fd_out);
+  if (!in || !out)
+    return -1;
+
+  off_t off;
+  if (off_in && !off_in.load(&off))
+    return -1;
+  ssize_t r = in->sendfile(out.get(), off_in ? &off : nullptr, len);
+  if (r >= 0 && off_in && !off_in.store(&off))
+    return -1;
   return r;
 }
 
@@ -234,7 +394,7 @@ sys_write(int fd, const userptr<void> p, size_t n)
   kstats::timer timer_fill(&kstats::write_cycles);
   kstats::inc(&kstats::write_count);
 
-  sref<file> f = getfile(fd);
+  fdref f = getfd(fd);
   if (!f)
     return -1;
   char *b = kalloc("writebuf");
@@ -253,7 +413,7 @@ sys_write(int fd, const userptr<void> p, size_t n)
 ssize_t
 sys_pwrite(int fd, const void *ubuf, size_t count, off_t offset)
 {
-  sref<file> f = getfile(fd);
+  fdref f = getfd(fd);
   if (!f)
     return -1;
 
@@ -266,6 +426,76 @@ sys_pwrite(int fd, const void *ubuf, size_t count, off_t offset)
   return f->pwrite(b, count, offset);
 }
 
+// Copy in the iovcnt buffers of a user I/O vector and total them up.
+static bool
+load_iov(const userptr<struct iovec> uiov, int iovcnt, struct iovec *iov,
+         size_t *total)
+{
+  if (iovcnt < 0 || iovcnt > UIO_MAXIOV)
+    return false;
+  if (iovcnt && !uiov.load(iov, iovcnt))
+    return false;
+  // The total has to fit in the ssize_t the syscall returns.
+  *total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > (~0ul >> 1) - *total)
+      return false;
+    *total += iov[i].iov_len;
+  }
+  return true;
+}
+
+//SYSCALL
+ssize_t
+sys_readv(int fd, const userptr<struct iovec> uiov, int iovcnt)
+{
+  struct iovec iov[UIO_MAXIOV];
+  size_t total;
+  fdref f = getfd(fd);
+  if (!f || !load_iov(uiov, iovcnt, iov, &total))
+    return -1;
+  return f->readv_user(iov, iovcnt, total);
+}
+
+//SYSCALL
+ssize_t
+sys_writev(int fd, const userptr<struct iovec> uiov, int iovcnt)
+{
+  kstats::timer timer_fill(&kstats::write_cycles);
+  kstats::inc(&kstats::write_count);
+
+  struct iovec iov[UIO_MAXIOV];
+  size_t total;
+  fdref f = getfd(fd);
+  if (!f || !load_iov(uiov, iovcnt, iov, &total))
+    return -1;
+  return f->writev_user(iov, iovcnt, total);
+}
+
+//SYSCALL
+ssize_t
+sys_preadv(int fd, const userptr<struct iovec> uiov, int iovcnt, off_t offset)
+{
+  struct iovec iov[UIO_MAXIOV];
+  size_t total;
+  fdref f = getfd(fd);
+  if (!f || !load_iov(uiov, iovcnt, iov, &total))
+    return -1;
+  return f->preadv_user(iov, iovcnt, total, offset);
+}
+
+//SYSCALL
+ssize_t
+sys_pwritev(int fd, const userptr<struct iovec> uiov, int iovcnt, off_t offset)
+{
+  struct iovec iov[UIO_MAXIOV];
+  size_t total;
+  fdref f = getfd(fd);
+  if (!f || !load_iov(uiov, iovcnt, iov, &total))
+    return -1;
+  return f->pwritev_user(iov, iovcnt, total, offset);
+}
+
 //SYSCALL
 int
 sys_fstatx(int fd, userptr<struct stat> st, enum stat_flags flags)
@@ -281,18 +511,63 @@ sys_fstatx(int fd, userptr<struct stat> st, enum stat_flags flags)
   return 0;
 }
 
+// Return the directory that paths relative to dirfd are looked up from.
+static sref<mnode>
+getdirat(int dirfd)
+{
+  if (dirfd == AT_FDCWD)
+    return myproc()->cwd_m;
+
+  sref<file> fdir = getfile(dirfd);
+  if (!fdir)
+    return sref<mnode>();
+  file* ff = fdir.get();
+  if (&typeid(*ff) != &typeid(file_mnode))
+    return sref<mnode>();
+  return static_cast<file_mnode*>(ff)->m;
+}
+
+//SYSCALL
+int
+sys_fstatat(int dirfd, userptr_str path, userptr<struct stat> st)
+{
+  sref<mnode> cwd = getdirat(dirfd);
+  if (!cwd)
+    return -1;
+
+  char path_copy[PATH_MAX];
+  if (!path.load(path_copy, sizeof(path_copy)))
+    return -1;
+
+  sref<mnode> m = namei(cwd, path_copy);
+  if (!m)
+    return -1;
+
+  struct stat st_buf;
+  if (stat_mnode(m, &st_buf, STAT_NO_FLAGS) < 0)
+    return -1;
+  if (!st.store(&st_buf))
+    return -1;
+  return 0;
+}
+
 // Create the path new as a link to the same inode as old.
 //SYSCALL
 int
-sys_link(userptr_str old_path, userptr_str new_path)
+sys_linkat(int olddirfd, userptr_str old_path, int newdirfd,
+           userptr_str new_path)
 {
   u64 tsc = 0;
   char old[PATH_MAX], newn[PATH_MAX];
   if (!old_path.load(old, sizeof old) || !new_path.load(newn, sizeof newn))
     return -1;
 
-  strbuf<DIRSIZ> oldname;
-  sref<mnode> olddir = nameiparent(myproc()->cwd_m, old, &oldname);
+  sref<mnode> oldcwd = getdirat(olddirfd), newcwd = getdirat(newdirfd);
+  if (!oldcwd || !newcwd)
+    return -1;
+
+  fsname oldname;
+  sref<mnode> olddir = nameiparent(oldcwd, old, &oldname);
   if (!olddir)
     return -1;
 
@@ -300,8 +575,8 @@ sys_link(userptr_str old_path, userptr_str new_path)
   if (!olddir->as_dir()->exists(oldname))
     return -1;
 
-  strbuf<DIRSIZ> name;
-  sref<mnode> md = nameiparent(myproc()->cwd_m, newn, &name);
+  fsname name;
+  sref<mnode> md = nameiparent(newcwd, newn, &name);
   if (!md)
     return -1;
 
@@ -337,7 +612,7 @@ sys_link(userptr_str old_path, userptr_str new_path)
 
   mfs_operation *op =
       new mfs_operation_link(rootfs_interface, tsc, mflink.mn()->mnum_,
-                             md->mnum_, name.buf_, mflink.mn()->type());
+                             md->mnum_, name.c_str(), mflink.mn()->type());
   rootfs_interface->add_to_metadata_log(md->mnum_, cpu, op);
   rootfs_interface->inc_mfslog_linkcount(mflink.mn()->mnum_);
   rootfs_interface->metadata_op_end(md->mnum_, cpu, get_tsc());
@@ -346,23 +621,28 @@ sys_link(userptr_str old_path, userptr_str new_path)
 
 //SYSCALL
 int
-sys_rename(userptr_str old_path, userptr_str new_path)
+sys_renameat(int olddirfd, userptr_str old_path, int newdirfd,
+             userptr_str new_path)
 {
   u64 tsc = 0;
   char old[PATH_MAX], newn[PATH_MAX];
   if (!old_path.load(old, sizeof old) || !new_path.load(newn, sizeof newn))
     return -1;
 
-  strbuf<DIRSIZ> oldname;
-  sref<mnode> mdold = nameiparent(myproc()->cwd_m, old, &oldname);
+  sref<mnode> oldcwd = getdirat(olddirfd), newcwd = getdirat(newdirfd);
+  if (!oldcwd || !newcwd)
+    return -1;
+
+  fsname oldname;
+  sref<mnode> mdold = nameiparent(oldcwd, old, &oldname);
   if (!mdold)
     return -1;
 
   if (!mdold->as_dir()->exists(oldname))
     return -1;
 
-  strbuf<DIRSIZ> newname;
-  sref<mnode> mdnew = nameiparent(myproc()->cwd_m, newn, &newname);
+  fsname newname;
+  sref<mnode> mdnew = nameiparent(newcwd, newn, &newname);
   if (!mdnew)
     return -1;
 
@@ -411,7 +691,7 @@ sys_rename(userptr_str old_path, userptr_str new_path)
           return -1;
         if (md->mnum_ == root_mnum)
           break;
-        md = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
+        md = md->as_dir()->lookup(fsname(".."));
       }
     }
 
@@ -428,7 +708,7 @@ sys_rename(userptr_str old_path, userptr_str new_path)
       if (mfold->type() == mnode::types::dir) {
         sref<mnode> mdparent, md = mdnew;
         while (1) {
-          mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
+          mdparent = md->as_dir()->lookup(fsname(".."));
           // Don't add mdnew->mnum_ twice; we already added it once above.
           if (md != mdnew)
             mnode_mnums.push_back(md->mnum_);
@@ -458,7 +738,7 @@ sys_rename(userptr_str old_path, userptr_str new_path)
     if (mdold != mdnew && mfold->type() == mnode::types::dir) {
       sref<mnode> mdparent, md = mdnew;
       while (1) {
-        mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
+        mdparent = md->as_dir()->lookup(fsname(".."));
         // Don't add to mdnew twice; we already added to it once above.
         if (md != mdnew)
           rootfs_interface->metadata_op_start(md->mnum_, cpu, tsc_val);
@@ -482,7 +762,7 @@ sys_rename(userptr_str old_path, userptr_str new_path)
         mfs_operation *op_rename_barrier;
         sref<mnode> mdparent, md = mdnew;
         while (1) {
-          mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
+          mdparent = md->as_dir()->lookup(fsname(".."));
           op_rename_barrier = new mfs_operation_rename_barrier(rootfs_interface,
                                   tsc, md->mnum_, mdparent->mnum_, mfold->type());
 
@@ -502,13 +782,14 @@ sys_rename(userptr_str old_path, userptr_str new_path)
       // are the same (which implies that we are logging both these operations
       // to a common mnode).
       op_rename_link = new mfs_operation_rename_link(rootfs_interface, tsc,
-                           oldname.buf_, mfold->mnum_, mdold->mnum_,
-                           newname.buf_, mdnew->mnum_, mfold->type());
+                           oldname.c_str(), mfold->mnum_, mdold->mnum_,
+                           newname.c_str(), mdnew->mnum_, mfold->type(),
+                           !!mfroadblock);
       rootfs_interface->add_to_metadata_log(mdnew->mnum_, cpu, op_rename_link);
 
       op_rename_unlink = new mfs_operation_rename_unlink(rootfs_interface, tsc,
-                             oldname.buf_, mfold->mnum_, mdold->mnum_,
-                             newname.buf_, mdnew->mnum_, mfold->type());
+                             oldname.c_str(), mfold->mnum_, mdold->mnum_,
+                             newname.c_str(), mdnew->mnum_, mfold->type());
       rootfs_interface->add_to_metadata_log(mdold->mnum_, cpu, op_rename_unlink);
 
       tsc_val = get_tsc();
@@ -516,7 +797,7 @@ sys_rename(userptr_str old_path, userptr_str new_path)
       if (mdold != mdnew && mfold->type() == mnode::types::dir) {
         sref<mnode> mdparent, md = mdnew;
         while (1) {
-          mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
+          mdparent = md->as_dir()->lookup(fsname(".."));
           // Don't add to mdnew twice; we will add to it again below anyway.
           if (md != mdnew)
             rootfs_interface->metadata_op_end(md->mnum_, cpu, tsc_val);
@@ -538,7 +819,7 @@ sys_rename(userptr_str old_path, userptr_str new_path)
     if (mdold != mdnew && mfold->type() == mnode::types::dir) {
       sref<mnode> mdparent, md = mdnew;
       while (1) {
-        mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
+        mdparent = md->as_dir()->lookup(fsname(".."));
         // Don't add to mdnew twice; we will add to it again below anyway.
         if (md != mdnew)
           rootfs_interface->metadata_op_end(md->mnum_, cpu, tsc_val);
@@ -561,17 +842,23 @@ sys_rename(userptr_str old_path, userptr_str new_path)
 
 }
 
+// Unlike POSIX, directories can be removed without AT_REMOVEDIR, but
+// AT_REMOVEDIR refuses to remove anything else.
 //SYSCALL
 int
-sys_unlink(userptr_str path)
+sys_unlinkat(int dirfd, userptr_str path, int flags)
 {
   u64 tsc = 0;
   char path_copy[PATH_MAX];
   if (!path.load(path_copy, sizeof path_copy))
     return -1;
 
-  strbuf<DIRSIZ> name;
-  sref<mnode> md = nameiparent(myproc()->cwd_m, path_copy, &name);
+  sref<mnode> cwd = getdirat(dirfd);
+  if (!cwd)
+    return -1;
+
+  fsname name;
+  sref<mnode> md = nameiparent(cwd, path_copy, &name);
   if (!md)
     return -1;
 
@@ -582,6 +869,9 @@ sys_unlink(userptr_str path)
   if (!mf)
     return -1;
 
+  if ((flags & AT_REMOVEDIR) && mf->type() != mnode::types::dir)
+    return -1;
+
   assert(md->fs_ == root_fs);
   int cpu = myid();
   lock_guard<sleeplock> guard;
@@ -611,7 +901,7 @@ sys_unlink(userptr_str path)
     assert(md->as_dir()->remove(name, mf, &tsc));
     mfs_operation *op =
         new mfs_operation_unlink(rootfs_interface, tsc, mf->mnum_, md->mnum_,
-                                 name.buf_, mf->type());
+                                 name.c_str(), mf->type());
     rootfs_interface->add_to_metadata_log(md->mnum_, cpu, op);
     rootfs_interface->metadata_op_end(md->mnum_, cpu, get_tsc());
     return 0;
@@ -625,25 +915,25 @@ sys_unlink(userptr_str path)
 
   if (mf->type() == mnode::types::file) {
     mfs_operation *op = new mfs_operation_unlink(rootfs_interface, tsc, mf->mnum_,
-                                                 md->mnum_, name.buf_, mf->type());
+                                                 md->mnum_, name.c_str(), mf->type());
     rootfs_interface->add_to_metadata_log(md->mnum_, cpu, op);
     rootfs_interface->metadata_op_end(md->mnum_, cpu, get_tsc());
   }
   return 0;
 }
 
-void add_create_to_metadata_log(u64 md_mnum, u64 mf_mnum, strbuf<DIRSIZ> name,
+void add_create_to_metadata_log(u64 md_mnum, u64 mf_mnum, fsname name,
                                 short type, int cpu, u64 tsc)
 {
   rootfs_interface->mnum_name_insert(mf_mnum, name);
   mfs_operation *op_c, *op_l;
 
   op_c = new mfs_operation_create(rootfs_interface, tsc, mf_mnum,
-                                  md_mnum, name.buf_, type);
+                                  md_mnum, name.c_str(), type);
   rootfs_interface->add_to_metadata_log(mf_mnum, cpu, op_c);
 
   op_l = new mfs_operation_link(rootfs_interface, tsc, mf_mnum,
-                                md_mnum, name.buf_, type);
+                                md_mnum, name.c_str(), type);
   rootfs_interface->add_to_metadata_log(md_mnum, cpu, op_l);
   rootfs_interface->inc_mfslog_linkcount(mf_mnum);
 
@@ -657,7 +947,7 @@ create(sref<mnode> cwd, const char *path, short type, short major, short minor,
 {
   u64 tsc = 0;
   for (;;) {
-    strbuf<DIRSIZ> name;
+    fsname name;
     sref<mnode> md = nameiparent(cwd, path, &name);
     if (!md || md->as_dir()->killed())
       return sref<mnode>();
@@ -767,19 +1057,9 @@ create(sref<mnode> cwd, const char *path, short type, short major, short minor,
 int
 sys_openat(int dirfd, userptr_str path, int omode, ...)
 {
-  sref<mnode> cwd;
-  if (dirfd == AT_FDCWD) {
-    cwd = myproc()->cwd_m;
-  } else {
-    sref<file> fdir = getfile(dirfd);
-    if (!fdir)
-      return -1;
-    file* ff = fdir.get();
-    if (&typeid(*ff) != &typeid(file_mnode))
-      return -1;
-    file_mnode* fdirm = static_cast<file_mnode*>(ff);
-    cwd = fdirm->m;
-  }
+  sref<mnode> cwd = getdirat(dirfd);
+  if (!cwd)
+    return -1;
 
   char path_copy[PATH_MAX];
   if (!path.load(path_copy, sizeof(path_copy)))
@@ -811,19 +1091,9 @@ sys_openat(int dirfd, userptr_str path, int omode, ...)
 int
 sys_mkdirat(int dirfd, userptr_str path, mode_t mode)
 {
-  sref<mnode> cwd;
-  if (dirfd == AT_FDCWD) {
-    cwd = myproc()->cwd_m;
-  } else {
-    sref<file> fdir = getfile(dirfd);
-    if (!fdir)
-      return -1;
-    file* ff = fdir.get();
-    if (&typeid(*ff) != &typeid(file_mnode))
-      return -1;
-    file_mnode* fdirm = static_cast<file_mnode*>(ff);
-    cwd = fdirm->m;
-  }
+  sref<mnode> cwd = getdirat(dirfd);
+  if (!cwd)
+    return -1;
 
   char path_copy[PATH_MAX];
   if (!path.load(path_copy, sizeof(path_copy)))
@@ -943,9 +1213,10 @@ sys_pipe(userptr<int> fd)
   return sys_pipe2(fd, 0);
 }
 
+// nameptr must have room for DIRSIZ+1 bytes.
 //SYSCALL
 int
-sys_readdir(int dirfd, const userptr<char> prevptr, userptr<char> nameptr)
+sys_readdir(int dirfd, userptr_str prevptr, userptr<char> nameptr)
 {
   sref<file> df = getfile(dirfd);
   if (!df)
@@ -959,20 +1230,149 @@ sys_readdir(int dirfd, const userptr<char> prevptr, userptr<char> nameptr)
   if (dfm->m->type() != mnode::types::dir)
     return -1;
 
-  strbuf<DIRSIZ> prev;
-  if (prevptr && !prevptr.load(prev.buf_, sizeof(prev.buf_)))
+  char prevbuf[DIRSIZ+1];
+  if (prevptr && !prevptr.load(prevbuf, sizeof(prevbuf)))
     return -1;
 
-  strbuf<DIRSIZ> name;
+  fsname prev(prevbuf), name;
   if (!dfm->m->as_dir()->enumerate(prevptr ? &prev : nullptr, &name))
     return 0;
 
-  if (!nameptr.store(name.buf_, sizeof(name.buf_)))
+  if (!nameptr.store(name.c_str(), name.size() + 1))
     return -1;
 
   return 1;
 }
 
+// Fill b with as many of the directory dfm's remaining entries as fit in
+// len bytes, continuing from its getdents() cursor.  Each record is hdr
+// bytes followed by the NUL-terminated name, padded to 8 bytes; fill(rec,
+// reclen, mnum) fills in the rest of its header, or returns false to skip
+// the entry.  Returns the number of bytes filled, or -1 if not even one
+// record fits.
+template<class Fill>
+static ssize_t
+fill_dir_records(file_mnode *dfm, char *b, size_t len, size_t hdr, Fill fill)
+{
+  auto l = dfm->off_lock.guard();
+  size_t n = 0;
+  for (;;) {
+    fsname name;
+    u64 mnum;
+    if (!dfm->m->as_dir()->enumerate(dfm->dir_pos_valid ? &dfm->dir_pos :
+                                     nullptr, &name, &mnum))
+      break;
+
+    size_t namelen = name.size();
+    size_t reclen = (hdr + namelen + 1 + 7) & ~7;
+    if (n + reclen > len) {
+      if (n == 0)
+        return -1;              // EINVAL: buffer too small
+      break;
+    }
+
+    char *rec = b + n;
+    memset(rec, 0, reclen);
+    if (fill(rec, reclen, mnum)) {
+      memmove(rec + hdr, name.c_str(), namelen);
+      n += reclen;
+    }
+
+    dfm->dir_pos = name;
+    dfm->dir_pos_valid = true;
+  }
+  return n;
+}
+
+// Fill ubuf with as many struct xv6_dirent's as fit in len bytes,
+// continuing from where the previous getdents() on this file left off.
+// Returns the number of bytes filled, or 0 at the end of the directory.
+//SYSCALL
+ssize_t
+sys_getdents(int dirfd, userptr<void> ubuf, size_t len)
+{
+  sref<file> df = getfile(dirfd);
+  if (!df)
+    return -1;
+
+  file* dff = df.get();
+  bool snap = &typeid(*dff) == &typeid(file_snapshot);
+  if (!snap && (&typeid(*dff) != &typeid(file_mnode) ||
+                static_cast<file_mnode*>(dff)->m->type() != mnode::types::dir))
+    return -1;
+
+  char *b = kalloc("getdentsbuf");
+  if (!b)
+    return -1;
+  auto cleanup = scoped_cleanup([b](){kfree(b);});
+  if (len > PGSIZE)
+    len = PGSIZE;
+
+  ssize_t n;
+  if (snap)
+    n = static_cast<file_snapshot*>(dff)->fill_dirents(b, len);
+  else
+    n = fill_dir_records(static_cast<file_mnode*>(dff), b, len,
+                         offsetof(xv6_dirent, d_name),
+                         [](char *rec, size_t reclen, u64 mnum) {
+                           xv6_dirent *de = (xv6_dirent*)rec;
+                           de->d_ino = mnum;
+                           de->d_reclen = reclen;
+                           de->d_type = mnode::type_of(mnum);
+                           return true;
+                         });
+  if (n > 0 && !ubuf.store_bytes(b, n))
+    return -1;
+  return n;
+}
+
+// Like getdents(), but with struct xv6_direntstat's, which also have each
+// entry's size and (approximate) link count, so that listing a directory
+// with its metadata doesn't take a stat() per entry.  Entries that are
+// unlinked while this runs may be left out.
+//SYSCALL
+ssize_t
+sys_getdents_stat(int dirfd, userptr<void> ubuf, size_t len)
+{
+  sref<file> df = getfile(dirfd);
+  if (!df)
+    return -1;
+
+  file* dff = df.get();
+  if (&typeid(*dff) != &typeid(file_mnode))
+    return -1;
+
+  file_mnode* dfm = static_cast<file_mnode*>(dff);
+  if (dfm->m->type() != mnode::types::dir)
+    return -1;
+
+  char *b = kalloc("getdentsbuf");
+  if (!b)
+    return -1;
+  auto cleanup = scoped_cleanup([b](){kfree(b);});
+  if (len > PGSIZE)
+    len = PGSIZE;
+
+  mfs *fs = dfm->m->fs_;
+  ssize_t n = fill_dir_records(dfm, b, len, offsetof(xv6_direntstat, d_name),
+                               [fs](char *rec, size_t reclen, u64 mnum) {
+    sref<mnode> m = fs->mget(mnum);
+    if (!m)
+      return false;
+    xv6_direntstat *de = (xv6_direntstat*)rec;
+    de->d_ino = mnum;
+    if (m->type() == mnode::types::file)
+      de->d_size = *m->as_file()->read_size();
+    de->d_nlink = m->nlink_.get_approx();
+    de->d_reclen = reclen;
+    de->d_type = m->type();
+    return true;
+  });
+  if (n > 0 && !ubuf.store_bytes(b, n))
+    return -1;
+  return n;
+}
+
 //SYSCALL {"uargs":["const char *upath", "char * const uargv[]", "const void *actions", "size_t actions_len"]}
 int
 sys_sys_spawn(userptr_str upath, userptr<userptr_str> uargv,
@@ -1045,33 +1445,43 @@ sys_sys_spawn(userptr_str upath, userptr<userptr_str> uargv,
     newftable = myproc()->ftable->copy(true);
   }
 
-  // Create the new process
+  std::unique_ptr<char[]> path;
+  if (!(path = upath.load_alloc(DIRSIZ+1)))
+    return -1;
+  std::vector<std::unique_ptr<char[]> > xargv;
+  if (load_str_list(uargv, MAXARG, MAXARGLEN, &xargv) < 0)
+    return -1;
+  std::vector<char*> argv;
+  for (auto &p : xargv)
+    argv.push_back(p.get());
+  argv.push_back(nullptr);
+
+  // Create the new process.  It never gets a copy of our vmap:
+  // load_image builds its vmap from scratch.
   proc *p = doclone(CLONE_NO_VMAP | CLONE_NO_FTABLE | CLONE_NO_RUN);
   if (!p)
     return -1;
 
   // Load the new image
-  {
-    std::unique_ptr<char[]> path;
-    if (!(path = upath.load_alloc(DIRSIZ+1)))
-      return -1;
-    std::vector<std::unique_ptr<char[]> > xargv;
-    if (load_str_list(uargv, MAXARG, MAXARGLEN, &xargv) < 0)
-      return -1;
-    std::vector<char*> argv;
-    for (auto &p : xargv)
-      argv.push_back(p.get());
-    argv.push_back(nullptr);
-    if (load_image(p, path.get(), argv.data(), nullptr) < 0)
-      return -1;
+  if (load_image(p, path.get(), argv.data(), nullptr) < 0) {
+    {
+      scoped_acquire l(&myproc()->lock);
+      myproc()->childq.erase(p);
+    }
+    finishproc(p);
+    return -1;
   }
 
   // Install ftable
   p->ftable = std::move(newftable);
 
-  // Make p runnable (normally doclone would do this)
+  // Make p runnable (normally doclone would do this).  Unlike fork, the
+  // child shares no memory with us, so start it wherever the scheduler
+  // thinks is least busy.
   {
     scoped_acquire l(&p->lock);
+    if (!p->cpu_pin)
+      p->cpuid = sched_pick_cpu();
     addrun(p);
   }
 
@@ -15,6 +15,9 @@
 #include <uk/mman.h>
 #include <uk/utsname.h>
 #include <uk/unistd.h>
+#include <algorithm>
+
+extern "C" void zpage(void*);
 
 //SYSCALL
 int
@@ -131,12 +134,22 @@ sys_mmap(userptr<void> addr, size_t len, int prot, int flags, int fd,
     if (flags & MAP_SHARED) {
       m = anon_fs->alloc(mnode::types::file).mn();
       auto resizer = m->as_file()->write_size();
-      for (size_t i = 0; i < len; i += PGSIZE) {
-        void* p = zalloc("MAP_ANON|MAP_SHARED");
-        if (!p)
+      // Allocate the pages a batch at a time, so that big mappings don't
+      // take the allocator's locks once per page.
+      void *pages[64];
+      for (size_t i = 0; i < len; ) {
+        size_t want = std::min((size_t)64, (PGROUNDUP(len) - i) / PGSIZE);
+        size_t n = kalloc_batch("MAP_ANON|MAP_SHARED", want, pages);
+        if (n < want) {
+          kfree_batch(pages, n);
           throw_bad_alloc();
-        auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
-        resizer.resize_append(i + PGSIZE, pi);
+        }
+        for (size_t j = 0; j < n; j++, i += PGSIZE) {
+          zpage(pages[j]);
+          auto pi = sref<page_info>::transfer(
+            new (page_info::of(pages[j])) page_info());
+          resizer.resize_append(i + PGSIZE, pi);
+        }
       }
     }
   } else {
@@ -168,6 +181,10 @@ sys_mmap(userptr<void> addr, size_t len, int prot, int flags, int fd,
   if (m && (flags & MAP_PRIVATE))
     desc.flags |= vmdesc::FLAG_COW;
   uptr r = myproc()->vmap->insert(desc, start, end - start);
+  // Like Linux, MAP_POPULATE is best effort; faults will get
+  // whatever it couldn't.
+  if ((flags & MAP_POPULATE) && r != (uptr)MAP_FAILED)
+    myproc()->vmap->populate(r, end - start);
   return (void*)r;
 }
 
@@ -192,7 +209,25 @@ sys_madvise(userptr<void> addr, size_t len, int advice)
 
   switch (advice) {
   case MADV_WILLNEED:
-    if (myproc()->vmap->willneed(align_addr, align_len) < 0)
+    // Like MAP_POPULATE, so that memory mapped first and prefaulted
+    // later still gets huge pages.
+    if (myproc()->vmap->populate(align_addr, align_len) < 0)
+      return -1;
+    return 0;
+
+  case MADV_DONTNEED:
+    if (myproc()->vmap->dontneed(align_addr, align_len) < 0)
+      return -1;
+    return 0;
+
+  case MADV_NORMAL:
+  case MADV_SEQUENTIAL:
+  case MADV_RANDOM:
+    if (myproc()->vmap->advise(align_addr, align_len,
+                               advice == MADV_SEQUENTIAL ?
+                               vmdesc::FLAG_SEQUENTIAL :
+                               advice == MADV_RANDOM ?
+                               vmdesc::FLAG_RANDOM : 0) < 0)
       return -1;
     return 0;
 
@@ -239,6 +274,8 @@ sys_pt_pages(void)
 void
 sys_halt(void)
 {
+  warmlist_save();
+  unmount_rootfs();
   halt();
   panic("halt returned");
 }
@@ -268,11 +305,14 @@ sys_setaffinity(int cpu)
   return myproc()->set_cpu_pin(cpu);
 }
 
+// target and extra are futex.h's addr2 and val3.  For FUTEX_REQUEUE,
+// FUTEX_CMP_REQUEUE and FUTEX_WAKE_OP, timer is the second count, val2.
 //SYSCALL
 long
-sys_futex(const u64* addr, int op, u64 val, u64 timer)
+sys_futex(const u64* addr, int op, u64 val, u64 timer, const u64* target,
+          u64 extra)
 {
-  futexkey_t key;
+  futexkey_t key, key2;
 
   if (futexkey(addr, myproc()->vmap.get(), &key) < 0)
     return -1;
@@ -284,6 +324,16 @@ sys_futex(const u64* addr, int op, u64 val, u64 timer)
     return futexwait(key, val, timer);
   case FUTEX_WAKE:
     return futexwake(key, val);
+  case FUTEX_REQUEUE:
+  case FUTEX_CMP_REQUEUE:
+    if (futexkey(target, myproc()->vmap.get(), &key2) < 0)
+      return -1;
+    return futexrequeue(key, val, timer, key2,
+                        op == FUTEX_CMP_REQUEUE ? &extra : nullptr);
+  case FUTEX_WAKE_OP:
+    if (futexkey(target, myproc()->vmap.get(), &key2, true) < 0)
+      return -1;
+    return futexwakeop(key, val, key2, timer, extra);
   default:
     return -1;
   }
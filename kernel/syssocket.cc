@@ -159,11 +159,154 @@ sys_sendto(int sockfd, const userptr<void> buf, size_t len, int flags,
                    addrlen);
 }
 
+//SYSCALL
+int
+sys_sendmmsg(int sockfd, userptr<struct mmsghdr> msgvec, unsigned int vlen,
+             int flags)
+{
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+  if (vlen > MMSG_MAX)
+    vlen = MMSG_MAX;
+
+  // The batch ends before the first message to a different address
+  // than msgvec[0]'s.
+  struct sockaddr_storage ss, ss2;
+  bool has_addr = false;
+  socklen_t addrlen = 0;
+  userptr<void> bufs[MMSG_MAX];
+  size_t lens[MMSG_MAX];
+  unsigned int n;
+  for (n = 0; n < vlen; n++) {
+    struct mmsghdr mh;
+    struct iovec iov;
+    if (!(msgvec + n).load(&mh))
+      return -1;
+    if (mh.msg_hdr.msg_iovlen != 1 ||
+        !userptr<struct iovec>(mh.msg_hdr.msg_iov).load(&iov))
+      return -1;
+    bool named = mh.msg_hdr.msg_name != nullptr;
+    if (named &&
+        sockaddr_from_user(n ? &ss2 : &ss,
+                           userptr<struct sockaddr>(
+                             (struct sockaddr*)mh.msg_hdr.msg_name),
+                           mh.msg_hdr.msg_namelen) < 0)
+      return -1;
+    if (n == 0) {
+      has_addr = named;
+      addrlen = mh.msg_hdr.msg_namelen;
+    } else if (named != has_addr ||
+               (named && (mh.msg_hdr.msg_namelen != addrlen ||
+                          memcmp(&ss, &ss2, addrlen) != 0))) {
+      break;
+    }
+    bufs[n] = userptr<void>(iov.iov_base);
+    lens[n] = iov.iov_len;
+  }
+
+  int r = f->sendmmsg(bufs, lens, n, flags,
+                      has_addr ? (struct sockaddr*)&ss : nullptr, addrlen);
+  for (int i = 0; i < r; i++) {
+    unsigned int len = lens[i];
+    if (!userptr<unsigned int>(&(msgvec + i).unsafe_get()->msg_len).store(&len))
+      return -1;
+  }
+  return r;
+}
+
+//SYSCALL
+int
+sys_recvmmsg(int sockfd, userptr<struct mmsghdr> msgvec, unsigned int vlen,
+             int flags, userptr<struct timespec> timeout)
+{
+  sref<file> f = getfile(sockfd);
+  if (!f || timeout)
+    return -1;
+  if (vlen > MMSG_MAX)
+    vlen = MMSG_MAX;
+
+  userptr<void> bufs[MMSG_MAX];
+  size_t lens[MMSG_MAX];
+  bool named = false;
+  for (unsigned int i = 0; i < vlen; i++) {
+    struct mmsghdr mh;
+    struct iovec iov;
+    if (!(msgvec + i).load(&mh))
+      return -1;
+    if (mh.msg_hdr.msg_iovlen != 1 ||
+        !userptr<struct iovec>(mh.msg_hdr.msg_iov).load(&iov))
+      return -1;
+    named |= mh.msg_hdr.msg_name != nullptr;
+    bufs[i] = userptr<void>(iov.iov_base);
+    lens[i] = iov.iov_len;
+  }
+
+  // Only fetch source addresses if someone wants them.
+  size_t sssz = vlen * sizeof(struct sockaddr_storage);
+  struct sockaddr_storage *ss = nullptr;
+  size_t sslens[MMSG_MAX];
+  if (named && vlen) {
+    ss = (struct sockaddr_storage*) kmalloc(sssz, "recvmmsg");
+    if (!ss)
+      return -1;
+  }
+  auto cleanup = scoped_cleanup([&](){ if (ss) kmfree(ss, sssz); });
+
+  int r = f->recvmmsg(bufs, lens, vlen, flags, ss, sslens);
+  for (int i = 0; i < r; i++) {
+    struct mmsghdr *um = (msgvec + i).unsafe_get();
+    unsigned int len = lens[i];
+    if (!userptr<unsigned int>(&um->msg_len).store(&len))
+      return -1;
+    if (!ss)
+      continue;
+    // msgvec[i] may have changed since we loaded it, but
+    // sockaddr_to_user copes with whatever is there now.
+    void *name;
+    if (!userptr<void*>(&um->msg_hdr.msg_name).load(&name))
+      return -1;
+    if (name &&
+        sockaddr_to_user(userptr<struct sockaddr>((struct sockaddr*)name),
+                         userptr<socklen_t>(&um->msg_hdr.msg_namelen),
+                         &ss[i], sslens[i]) < 0)
+      return -1;
+  }
+  return r;
+}
+
 //SYSCALL
 int
 sys_connect(int sockfd, const userptr<struct sockaddr> addr, u32 addrlen)
 {
-  return -1;
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+
+  struct sockaddr_storage ss;
+  if (!addr)
+    return -1;
+  int r = sockaddr_from_user(&ss, addr, addrlen);
+  if (r < 0)
+    return r;
+
+  return f->connect((struct sockaddr*)&ss, addrlen);
+}
+
+//SYSCALL
+int
+sys_setsockopt(int sockfd, int level, int optname, const userptr<void> optval,
+               u32 optlen)
+{
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+
+  // Socket options are an int or a small struct.
+  char buf[64];
+  if (optlen > sizeof(buf) || !optval.load_bytes(buf, optlen))
+    return -1;
+  return f->setsockopt(level, optname, buf, optlen);
 }
 
 //SYSCALL
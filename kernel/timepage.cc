@@ -0,0 +1,56 @@
+// The time page, mapped read-only into every address space so that
+// user space can tell the time without a system call (see timepage.h).
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include "kalloc.hh"
+#include "vm.hh"
+#include "page_info.hh"
+#include "timepage.h"
+
+extern u64 cpuhz;
+
+static sref<page_info> timepage_pi;
+static struct timepage *tp;
+
+void
+inittimepage(void)
+{
+  char *p = zalloc("timepage");
+  if (!p)
+    panic("inittimepage: out of memory");
+  timepage_pi = sref<page_info>::transfer(new(page_info::of(p)) page_info());
+  tp = (struct timepage*) p;
+}
+
+// Restart the time page's clocks from now, given the UNIX time in
+// nanoseconds when nsectime() was 0.
+void
+timepage_update(u64 realtime_nsec0)
+{
+  // Updates come from initrtc on one core, but be safe anyway.
+  static spinlock lock("timepage");
+  scoped_acquire l(&lock);
+
+  u64 uptime = nsectime();
+  tp->seq++;
+  barrier();
+  tp->cpuhz = cpuhz;
+  tp->mult = (1000000000ull << 32) / cpuhz;
+  tp->tsc_base = rdtsc();
+  tp->uptime_base = uptime;
+  tp->realtime_base = realtime_nsec0 + uptime;
+  barrier();
+  tp->seq++;
+}
+
+// Map the time page into vmp.
+int
+timepage_map(vmap *vmp)
+{
+  if (vmp->insert(vmdesc::readonly_page(timepage_pi), TIMEPAGE_VA, PGSIZE) ==
+      (uptr)-1)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,188 @@
+// Tracepoints: a ring of fixed-size records per core, read through
+// /dev/tracepoints (see tracepoint.h).
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include <uk/stat.h>
+#include "cpu.hh"
+#include "proc.hh"
+#include "percpu.hh"
+#include "file.hh"
+#include "major.h"
+#include "kalloc.hh"
+#include "tracepoint.hh"
+
+extern u64 cpuhz;
+
+std::atomic<u64> tracepoint_mask;
+
+namespace {
+  struct trace_ring
+  {
+    tracepoint_event *events;   // TRACEPOINT_EVENTS of them, or null
+    u64 head;                   // Records since tracing started
+  };
+
+  // Only its own core writes a ring, with interrupts disabled, so
+  // recording takes no locks.
+  DEFINE_PERCPU(trace_ring, trace_rings, NO_CRITICAL);
+  spinlock ctl_lock("tracepoint");
+}
+
+#define HEADER_SZ (sizeof(struct tracepoint_header) + \
+                   NCPU * sizeof(((struct tracepoint_header*)0)->cpu[0]))
+#define RING_SZ (TRACEPOINT_EVENTS * sizeof(struct tracepoint_event))
+
+void
+tracepoint_record(int id, u64 a0, u64 a1, u64 a2)
+{
+  scoped_cli cli;
+  trace_ring *r = trace_rings.get_unchecked();
+  if (!r->events)
+    return;
+  tracepoint_event *e = &r->events[r->head++ % TRACEPOINT_EVENTS];
+  proc *p = myproc();
+  e->tsc = rdtsc();
+  e->pid = p ? p->pid : 0;
+  e->id = id;
+  e->pad = 0;
+  e->arg[0] = a0;
+  e->arg[1] = a1;
+  e->arg[2] = a2;
+}
+
+// Fill in the header of a trace of the rings as they are now.
+static void
+fill_header(tracepoint_header *hdr)
+{
+  u64 off = HEADER_SZ;
+  hdr->ncpus = NCPU;
+  hdr->cpuhz = cpuhz;
+  for (int c = 0; c < NCPU; c++) {
+    u64 head = c < ncpu ? trace_rings[c].head : 0;
+    u64 count = head < TRACEPOINT_EVENTS ? head : TRACEPOINT_EVENTS;
+    hdr->cpu[c].offset = off;
+    hdr->cpu[c].count = count;
+    hdr->cpu[c].dropped = head - count;
+    off += count * sizeof(tracepoint_event);
+  }
+}
+
+static int
+traceread(mdev*, char *dst, u32 off, u32 n)
+{
+  char *hbuf = (char*) kmalloc(HEADER_SZ, "tracepoint header");
+  if (!hbuf)
+    return -1;
+  tracepoint_header *hdr = (tracepoint_header*) hbuf;
+  fill_header(hdr);
+
+  u32 done = 0;
+  if (off < HEADER_SZ) {
+    u32 cc = MIN(HEADER_SZ - off, n);
+    memmove(dst, hbuf + off, cc);
+    done += cc;
+  }
+
+  for (int c = 0; c < ncpu && done < n; c++) {
+    u64 start = hdr->cpu[c].offset;
+    u64 end = start + hdr->cpu[c].count * sizeof(tracepoint_event);
+    u64 first = trace_rings[c].head - hdr->cpu[c].count;
+    const char *ring = (const char*) trace_rings[c].events;
+    // Copy the part of [start, end) that [off+done, off+n) covers, from
+    // the ring, where the section's bytes begin at record first.
+    while (done < n && off + done >= start && off + done < end) {
+      u64 pos = (first * sizeof(tracepoint_event) + (off + done - start))
+        % RING_SZ;
+      u64 cc = MIN(MIN(end - (off + done), RING_SZ - pos), n - done);
+      memmove(dst + done, ring + pos, cc);
+      done += cc;
+    }
+  }
+
+  kmfree(hbuf, HEADER_SZ);
+  return done;
+}
+
+static void
+tracestat(mdev*, struct stat *st)
+{
+  u64 sz = HEADER_SZ;
+  for (int c = 0; c < ncpu; c++) {
+    u64 head = trace_rings[c].head;
+    sz += (head < TRACEPOINT_EVENTS ? head : TRACEPOINT_EVENTS) *
+      sizeof(tracepoint_event);
+  }
+  st->st_size = sz;
+}
+
+// Parse a decimal or 0x-prefixed hex mask, or "all".
+static bool
+parse_mask(const char *buf, u32 n, u64 *mask)
+{
+  while (n && (buf[n-1] == '\n' || buf[n-1] == ' '))
+    n--;
+  if (n == 3 && strncmp(buf, "all", 3) == 0) {
+    *mask = (1ull << TP_NTYPES) - 1;
+    return true;
+  }
+  u32 i = 0, base = 10;
+  if (n > 2 && buf[0] == '0' && (buf[1] == 'x' || buf[1] == 'X')) {
+    i = 2;
+    base = 16;
+  }
+  if (i == n)
+    return false;
+  u64 v = 0;
+  for (; i < n; i++) {
+    char c = buf[i];
+    u32 d;
+    if (c >= '0' && c <= '9')
+      d = c - '0';
+    else if (base == 16 && c >= 'a' && c <= 'f')
+      d = c - 'a' + 10;
+    else if (base == 16 && c >= 'A' && c <= 'F')
+      d = c - 'A' + 10;
+    else
+      return false;
+    v = v * base + d;
+  }
+  *mask = v & ((1ull << TP_NTYPES) - 1);
+  return true;
+}
+
+// A mask of tracepoints clears the rings and starts tracing them; "0"
+// stops.
+static int
+tracewrite(mdev*, const char *buf, u32 n)
+{
+  u64 mask;
+  if (!parse_mask(buf, n, &mask))
+    return -1;
+
+  scoped_acquire l(&ctl_lock);
+  tracepoint_mask.store(0);
+  if (!mask)
+    return n;
+
+  for (int c = 0; c < ncpu; c++) {
+    if (!trace_rings[c].events) {
+      trace_rings[c].events =
+        (tracepoint_event*) kalloc("tracepoint", RING_SZ);
+      if (!trace_rings[c].events)
+        return -1;
+    }
+    trace_rings[c].head = 0;
+  }
+  tracepoint_mask.store(mask);
+  return n;
+}
+
+void
+inittracepoint(void)
+{
+  devsw[MAJ_TRACEPOINTS].pread = traceread;
+  devsw[MAJ_TRACEPOINTS].write = tracewrite;
+  devsw[MAJ_TRACEPOINTS].stat = tracestat;
+}
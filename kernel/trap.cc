@@ -16,6 +16,8 @@
 #include "hwvm.hh"
 #include "refcache.hh"
 #include "cpuid.hh"
+#include "file.hh"
+#include "major.h"
 
 extern "C" void __uaccess_end(void);
 
@@ -33,8 +35,17 @@ static struct irq_info
   irq_handler *handlers;
   // True if this IRQ has been allocated to a device
   bool in_use;
+  // What delivers this IRQ, if anything has routed it yet, and the
+  // CPU it's delivered to.  Protected by irq_route_lock.
+  irq_router *router;
+  int cpu;
+  struct irq desc;
 } irq_info[256 - T_IRQ0];
 
+static spinlock irq_route_lock("irq_route");
+static int irqaffinityread(mdev*, char *dst, u32 off, u32 n);
+static int irqaffinitywrite(mdev*, const char *buf, u32 n);
+
 static void trap(struct trapframe *tf);
 
 u64
@@ -48,6 +59,7 @@ sysentry_c(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
   trapframe *tf = (trapframe*) (myproc()->kstack + KSTACKSIZE - sizeof(*tf));
   myproc()->tf = tf;
   u64 r = syscall(a0, a1, a2, a3, a4, a5, num);
+  refcache::maybe_flush();
 
   if(myproc()->killed) {
     mtstart(trap, myproc());
@@ -173,8 +185,17 @@ trap_c(struct trapframe *tf)
 static void
 trap(struct trapframe *tf)
 {
+  bool ticked = false;
+
   switch(tf->trapno){
   case T_IRQ0 + IRQ_TIMER:
+    // The timer also goes off for timeouts between ticks, which don't
+    // count against the running process's slice.
+    ticked = timerintr();
+    if (!ticked) {
+      lapiceoi();
+      break;
+    }
     kstats::inc(&kstats::sched_tick_count);
     // for now, just care about timer interrupts
 #if CODEX
@@ -196,8 +217,6 @@ trap(struct trapframe *tf)
       }
       mycpu()->timer_printpc = 0;
     }
-    if (mycpu()->id == 0)
-      timerintr();
     refcache::mycache->tick();
     lapiceoi();
     if (mycpu()->no_sched_count) {
@@ -323,7 +342,8 @@ trap(struct trapframe *tf)
   // Force process to give up CPU on clock tick.
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->get_state() == RUNNING &&
-     (tf->trapno == T_IRQ0+IRQ_TIMER || myproc()->yield_)) {
+     ((ticked && ++myproc()->slice_ticks >= myproc()->slice()) ||
+      myproc()->yield_)) {
     yield();
   }
 
@@ -354,6 +374,9 @@ inittrap(void)
   // And reserve interrupt 255 (Intel SDM Vol. 3 suggests this can't
   // be used for MSI).
   irq_info[255 - T_IRQ0].in_use = true;
+
+  devsw[MAJ_IRQAFFINITY].pread = irqaffinityread;
+  devsw[MAJ_IRQAFFINITY].write = irqaffinitywrite;
 }
 
 void
@@ -564,6 +587,107 @@ irq::register_handler(irq_handler *handler)
   irq_info[gsi].handlers = handler;
 }
 
+void
+irq::enable(bool enable)
+{
+  assert(valid());
+  // The external PIC reads our affinity when it programs the pin.
+  {
+    scoped_acquire l(&irq_route_lock);
+    auto &info = irq_info[gsi];
+    if (!info.router) {
+      info.router = extpic;
+      info.desc = *this;
+    }
+  }
+  extpic->enable_irq(*this, enable);
+}
+
+int
+irq::affinity() const
+{
+  assert(valid());
+  return irq_info[gsi].cpu;
+}
+
+void
+irq::set_router(irq_router *router, int cpu)
+{
+  assert(valid());
+  scoped_acquire l(&irq_route_lock);
+  auto &info = irq_info[gsi];
+  info.router = router;
+  info.cpu = cpu;
+  info.desc = *this;
+}
+
+bool
+irq::set_affinity(int cpu)
+{
+  assert(valid());
+  if (cpu < 0 || cpu >= ncpu)
+    return false;
+  scoped_acquire l(&irq_route_lock);
+  auto &info = irq_info[gsi];
+  if (!info.router)
+    return false;
+  if (info.cpu != cpu) {
+    info.router->route_irq(info.desc, cpu);
+    info.cpu = cpu;
+  }
+  return true;
+}
+
+int
+irq_spread_cpu(void)
+{
+  static std::atomic<unsigned> next;
+  return next++ % ncpu;
+}
+
+// /dev/irqaffinity lists each routed IRQ with the CPU it's delivered
+// to.  Writing "<irq> <cpu>" moves an IRQ.
+static int
+irqaffinityread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  scoped_acquire l(&irq_route_lock);
+  for (int gsi = 0; gsi < (int)(sizeof(irq_info) / sizeof(irq_info[0]));
+       ++gsi) {
+    auto &info = irq_info[gsi];
+    if (!info.router)
+      continue;
+    s.println(gsi, " ", info.cpu,
+              info.router == extpic ? " ioapic" : " msi");
+  }
+  return s.get_used();
+}
+
+static int
+irqaffinitywrite(mdev*, const char *buf, u32 n)
+{
+  u32 i = 0;
+  int gsi = 0, cpu = 0;
+  for (; i < n && buf[i] >= '0' && buf[i] <= '9'; i++)
+    gsi = gsi * 10 + (buf[i] - '0');
+  if (i == n || buf[i] != ' ')
+    return -1;
+  u32 start = ++i;
+  for (; i < n && buf[i] >= '0' && buf[i] <= '9'; i++)
+    cpu = cpu * 10 + (buf[i] - '0');
+  if (i == start || gsi >= (int)(sizeof(irq_info) / sizeof(irq_info[0])))
+    return -1;
+
+  struct irq irq;
+  {
+    scoped_acquire l(&irq_route_lock);
+    irq = irq_info[gsi].desc;
+  }
+  if (!irq.valid() || !irq.set_affinity(cpu))
+    return -1;
+  return n;
+}
+
 void
 to_stream(class print_stream *s, const struct irq &irq)
 {
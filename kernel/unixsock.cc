@@ -7,29 +7,30 @@
 #include "atomic_util.hh"
 #include "proc.hh"
 #include "file.hh"
+#include "epoll.hh"
 #include <uk/socket.h>
 #include <uk/un.h>
 
 #define QUEUELEN 10   // Number of message per queue of a local socket
 #define LB 0          // Run with load balancer?
 
-struct msghdr {
+struct localmsg {
   u32 len;
   struct sockaddr_un uaddr;
   char *data;
-  islink<msghdr> link;
-  typedef isqueue<msghdr, &msghdr::link> list_t;
+  islink<localmsg> link;
+  typedef isqueue<localmsg, &localmsg::link> list_t;
 
-  msghdr() {}
-  ~msghdr() {}
+  localmsg() {}
+  ~localmsg() {}
 
-  NEW_DELETE_OPS(msghdr);
+  NEW_DELETE_OPS(localmsg);
 };
 
 struct coresocket : public balance_pool<coresocket> {
   int len;
   struct spinlock lock;
-  msghdr::list_t messages;
+  localmsg::list_t messages;
 
   coresocket() : balance_pool(QUEUELEN), len(0),
                  lock("coresocket", LOCKSTAT_LOCALSOCK) {}
@@ -57,7 +58,7 @@ struct coresocket : public balance_pool<coresocket> {
       n++;
       target->len++;
       len--;
-      msghdr& m = messages.front();
+      localmsg& m = messages.front();
       messages.pop_front();
       target->messages.push_back(&m);
     }
@@ -78,8 +79,11 @@ struct localsock {
   condvar rw_cv[NCPU];
   balancer<localsock, coresocket> b;
   atomic<int> nreader;
+  // Readable when any core has a message queued, and always writable.
+  sref<poll_source> poll_;
 
-  localsock(bool ordered) : ordered_(ordered), b(this), nreader(0) {
+  localsock(bool ordered) : ordered_(ordered), b(this), nreader(0),
+                            poll_(make_sref<poll_source>(poll, this)) {
     for (int i = 0; i < NCPU; i++)
       pipes[i] = 0;
     if (ordered)
@@ -87,6 +91,7 @@ struct localsock {
   }
 
   ~localsock() {
+    poll_->detach();
     for (int i = 0; i < NCPU; i++) {
       coresocket* c = pipes[i].load();
       if (c)
@@ -96,6 +101,16 @@ struct localsock {
 
   NEW_DELETE_OPS(localsock);
 
+  static u32 poll(void *arg) {
+    localsock *s = (localsock*)arg;
+    for (int i = 0; i < NCPU; i++) {
+      coresocket *c = s->pipes[i];
+      if (c && c->len > 0)
+        return EPOLLIN | EPOLLOUT;
+    }
+    return EPOLLOUT;
+  }
+
   coresocket* reader() {
     for (int i = 0; i < NCPU; i++) {
       if (pipes[i] != NULL)
@@ -135,7 +150,9 @@ struct localsock {
 #endif
   }
 
-  int write(msghdr *m) {
+  // Queue up to n messages, waiting for room for at least one.  Returns
+  // how many were queued, or -1 if the caller was killed.
+  int write_batch(localmsg **ms, int n) {
     bool toyield = true;
     for (;;) {
       if (myproc()->killed)
@@ -170,22 +187,56 @@ struct localsock {
       scoped_acquire a(&rw_cv_lock[cpu]);
 
       scoped_acquire l(&cp->lock);
-      if (cp->len < QUEUELEN) {
+      int k = 0;
+      for (; k < n && cp->len < QUEUELEN; k++) {
         // cprintf("w %d(%d): coresocket %p\n", myproc()->pid, myproc()->cpuid, cp);
-        cp->messages.push_back(m);
+        cp->messages.push_back(ms[k]);
         cp->len++;
+      }
+      if (k) {
         // Wake up the sleeping reader
         rw_cv[cpu].wake_all();
-        return 0;
+        poll_->notify(EPOLLIN);
+        return k;
+      }
+    }
+  }
+
+  int write(localmsg *m) {
+    return write_batch(&m, 1) < 0 ? -1 : 0;
+  }
+
+  // Dequeue up to n messages into ms from any core's queue, starting
+  // with this one's, without waiting.  Returns how many were dequeued.
+  int try_read_batch(localmsg **ms, int n) {
+    int start = myid();
+    for (int i = 0; i < NCPU; i++) {
+      coresocket *cp = pipes[(start + i) % NCPU];
+      if (!cp || cp->len <= 0)
+        continue;
+      scoped_acquire l(&cp->lock);
+      int k = 0;
+      for (; k < n && cp->len > 0; k++) {
+        ms[k] = &cp->messages.front();
+        cp->messages.pop_front();
+        cp->len--;
       }
+      if (k)
+        return k;
     }
+    return 0;
   }
 
-  msghdr* read() {
+  // Dequeue up to n messages into ms, waiting for at least one unless
+  // nonblock.  Returns how many were dequeued, or -1 if the caller was
+  // killed.
+  int read_batch(localmsg **ms, int n, bool nonblock = false) {
+    if (nonblock)
+      return try_read_batch(ms, n);
     //bool toyield = true;
     for (;;) {
       if (myproc()->killed)
-        return NULL;
+        return -1;
 
       coresocket* cp = mycoresocket();
 
@@ -215,22 +266,33 @@ struct localsock {
 #endif
 
       scoped_acquire l(&cp->lock);
-      if (cp->len > 0) {
+      int k = 0;
+      for (; k < n && cp->len > 0; k++) {
         // cprintf("r %d(%d): coresocket %p\n", myproc()->pid, myproc()->cpuid, cp);
-        msghdr &m = cp->messages.front();
+        ms[k] = &cp->messages.front();
         cp->messages.pop_front();
         cp->len--;
-        return &m;
       }
+      if (k)
+        return k;
       // toyield = true;   // iterate between yielding and balancing
     }
   }
+
+  localmsg* read(bool nonblock = false) {
+    localmsg *m;
+    if (read_batch(&m, 1, nonblock) <= 0)
+      return NULL;
+    return m;
+  }
 };
 
 struct file_unix_dgram : public refcache::referenced, public file
 {
   struct localsock *localsock_;
   char socketpath_[UNIX_PATH_MAX];
+  // Receives fail rather than wait when nothing is queued.
+  const bool nonblock_;
 
   ~file_unix_dgram()
   {
@@ -254,8 +316,30 @@ struct file_unix_dgram : public refcache::referenced, public file
     return sun;
   }
 
+  // The socket bound to addr.
+  static sref<mnode>
+  lookup(const struct sockaddr *addr, size_t addrlen)
+  {
+    auto uaddr = check_sockaddr(addr, addrlen);
+    if (!uaddr)
+      return sref<mnode>();
+
+    sref<mnode> ip = namei(myproc()->cwd_m, uaddr->sun_path);
+    if (!ip || ip->type() != mnode::types::sock)
+      return sref<mnode>();
+    return ip;
+  }
+
+  static void
+  free_msg(localmsg *m)
+  {
+    kfree(m->data);
+    delete m;
+  }
+
 public:
-  file_unix_dgram(bool ordered) : localsock_(new localsock(ordered)) {}
+  file_unix_dgram(bool ordered, bool nonblock)
+    : localsock_(new localsock(ordered)), nonblock_(nonblock) {}
   NEW_DELETE_OPS(file_unix_dgram);
 
   void inc() override { referenced::inc(); }
@@ -286,17 +370,10 @@ public:
     kstats::timer timer_fill(&kstats::socket_local_sendto_cycles);
     kstats::inc(&kstats::socket_local_sendto_cnt);
 
-    auto uaddr = check_sockaddr(dest_addr, addrlen);
-    if (!uaddr)
-      return -1;
-
-    sref<mnode> ip = namei(myproc()->cwd_m, uaddr->sun_path);
+    sref<mnode> ip = lookup(dest_addr, addrlen);
     if (!ip)
       return -1;
 
-    if (ip->type() != mnode::types::sock)
-      return -1;
-
     char *b = kalloc("writebuf");
     if (!b)
       return -1;
@@ -308,7 +385,7 @@ public:
       return -1;
     }
 
-    msghdr *m = new msghdr();
+    localmsg *m = new localmsg();
     m->data = b;
     m->len = len;
     m->uaddr.sun_family = AF_UNIX;
@@ -332,7 +409,9 @@ public:
 
     ssize_t r = -1;
 
-    msghdr *m = localsock_->read();
+    localmsg *m = localsock_->read(nonblock_);
+    if (!m)
+      return -1;
     if (src_addr) {
       *(struct sockaddr_un*)src_addr = m->uaddr;
       *addrlen = sizeof(m->uaddr);
@@ -351,6 +430,97 @@ public:
     return r;
   }
 
+  // Queue the whole batch with as few trips through the destination's
+  // locks as it has room for.
+  int
+  sendmmsg(const userptr<void> *bufs, size_t *lens, unsigned int n,
+           int flags, const struct sockaddr *dest_addr,
+           size_t addrlen) override
+  {
+    kstats::timer timer_fill(&kstats::socket_local_sendto_cycles);
+
+    sref<mnode> ip = lookup(dest_addr, addrlen);
+    if (!ip)
+      return -1;
+
+    localmsg *ms[MMSG_MAX];
+    if (n > MMSG_MAX)
+      n = MMSG_MAX;
+    unsigned int built;
+    for (built = 0; built < n; built++) {
+      char *b = kalloc("writebuf");
+      if (!b)
+        break;
+      size_t len = MIN(lens[built], PGSIZE);
+      if (!bufs[built].load_bytes(b, len)) {
+        kfree(b);
+        break;
+      }
+      localmsg *m = new localmsg();
+      m->data = b;
+      m->len = len;
+      m->uaddr.sun_family = AF_UNIX;
+      strncpy(m->uaddr.sun_path, socketpath_, UNIX_PATH_MAX);
+      lens[built] = len;
+      ms[built] = m;
+    }
+
+    unsigned int sent = 0;
+    while (sent < built) {
+      int r = ip->as_sock()->get_sock()->write_batch(ms + sent, built - sent);
+      if (r < 0)
+        break;
+      sent += r;
+    }
+    for (unsigned int i = sent; i < built; i++)
+      free_msg(ms[i]);
+    kstats::inc(&kstats::socket_local_sendto_cnt, (u64)sent);
+    return sent ? sent : -1;
+  }
+
+  int
+  recvmmsg(const userptr<void> *bufs, size_t *lens, unsigned int n,
+           int flags, struct sockaddr_storage *src_addrs,
+           size_t *addrlens) override
+  {
+    kstats::timer timer_fill(&kstats::socket_local_recvfrom_cycles);
+
+    localmsg *ms[MMSG_MAX];
+    if (n > MMSG_MAX)
+      n = MMSG_MAX;
+    int got = localsock_->read_batch(ms, n, nonblock_);
+    if (got <= 0)
+      return -1;
+    kstats::inc(&kstats::socket_local_recvfrom_cnt, (u64)got);
+
+    // Unlike recvfrom, truncate a datagram that doesn't fit, rather than
+    // failing, so the rest of the batch isn't lost with it.  If a copy
+    // faults, the datagrams from there on are.
+    int r = got;
+    for (int i = 0; i < got; i++) {
+      localmsg *m = ms[i];
+      if (i < r) {
+        if (src_addrs) {
+          *(struct sockaddr_un*)&src_addrs[i] = m->uaddr;
+          addrlens[i] = sizeof(m->uaddr);
+        }
+        size_t len = MIN(lens[i], m->len);
+        if (bufs[i].store_bytes(m->data, len))
+          lens[i] = len;
+        else
+          r = i;
+      }
+      free_msg(m);
+    }
+    return r ? r : -1;
+  }
+
+  poll_source *
+  get_poll_source() override
+  {
+    return localsock_->poll_.get();
+  }
+
   void
   onzero() override
   {
@@ -361,10 +531,12 @@ public:
 int
 unixsocket(int domain, int type, int protocol, file **out)
 {
+  bool nonblock = type & SOCK_NONBLOCK;
+  type &= ~SOCK_NONBLOCK;
   if (type == SOCK_DGRAM)
-    *out = new file_unix_dgram{true};
+    *out = new file_unix_dgram{true, nonblock};
   else if (type == SOCK_DGRAM_UNORDERED)
-    *out = new file_unix_dgram{false};
+    *out = new file_unix_dgram{false, nonblock};
   else
     return -1;
   return 0;
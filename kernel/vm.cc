@@ -16,8 +16,11 @@
 #include "page_info.hh"
 #include <algorithm>
 #include "kstats.hh"
+#include "sperf.hh"
+#include "tracepoint.hh"
+#include "faultstats.h"
 
-extern struct proc *bootproc;
+extern "C" void zpage(void*);
 
 enum { SDEBUG = false };
 static console_stream sdebug(SDEBUG);
@@ -39,6 +42,8 @@ void to_stream(class print_stream *s, const vmdesc &vmd)
         {"ANON", vmdesc::FLAG_ANON},
         {"WRITE", vmdesc::FLAG_WRITE},
         {"SHARED", vmdesc::FLAG_SHARED},
+        {"SEQUENTIAL", vmdesc::FLAG_SEQUENTIAL},
+        {"RANDOM", vmdesc::FLAG_RANDOM},
       }), " ");
   if (vmd.page)
     s->print((void*)vmd.page->pa(), "}");
@@ -46,6 +51,58 @@ void to_stream(class print_stream *s, const vmdesc &vmd)
     s->print("null}");
 }
 
+// The readahead hint for faults on page frames with these flags.
+static mfile::fault_hint
+hint_of(u64 flags)
+{
+  if (flags & vmdesc::FLAG_SEQUENTIAL)
+    return mfile::fault_hint::sequential;
+  if (flags & vmdesc::FLAG_RANDOM)
+    return mfile::fault_hint::random;
+  return mfile::fault_hint::normal;
+}
+
+/*
+ * Page stash
+ */
+
+// Pages allocated a batch at a time with kalloc_batch and handed out
+// one at a time, so that populating a big range doesn't go to the
+// allocator for every page.  Pages left over are freed when the stash
+// is destroyed.
+class page_stash
+{
+  enum { NPAGES = 64 };
+  void *pages_[NPAGES];
+  size_t n_;
+
+public:
+  page_stash() : n_(0) { }
+  ~page_stash()
+  {
+    if (n_)
+      kfree_batch(pages_, n_);
+  }
+
+  // Return a page, refilling the stash with up to want pages if it's
+  // empty.  Returns nullptr if out of memory.
+  void *get(size_t want)
+  {
+    if (n_ == 0)
+      n_ = kalloc_batch("(vmap::page_stash)",
+                        std::min(std::max(want, (size_t)1), (size_t)NPAGES),
+                        pages_);
+    return n_ ? pages_[--n_] : nullptr;
+  }
+
+  // Return a page from get() that wasn't used.
+  void put(void *p)
+  {
+    assert(n_ < NPAGES);
+    pages_[n_++] = p;
+  }
+};
+
 /*
  * Page holder
  */
@@ -106,17 +163,55 @@ public:
     }
     new (&cur->pages[cur->used++]) sref<class page_info>(std::move(page));
   }
+};
+
+// Collects the ranges of file mappings that a vmap operation maps or
+// unmaps and passes them to the reverse maps of their files (see
+// mfile::add_mapping).  Adjacent page frames that map the same file
+// the same way are passed as one range, so the files hear about each
+// run rather than each page.
+class rmap_update
+{
+  vmap *vm_;
+  bool add_;
+  sref<mnode> inode_;
+  intptr_t base_;
+  uptr start_, end_;
+
+public:
+  rmap_update(vmap *vm, bool add)
+    : vm_(vm), add_(add), base_(0), start_(0), end_(0) { }
+  rmap_update(const rmap_update&) = delete;
+  rmap_update &operator=(const rmap_update&) = delete;
+
+  ~rmap_update()
+  {
+    flush();
+  }
 
-  // Collects the page and removes the rmap entry in the corresponding page_info 
-  void add(sref<class page_info> &&page, std::pair<vmap*, uptr> rmap)
+  // Note that desc is mapped (or unmapped) from start to end.
+  void note(const vmdesc &desc, uptr start, uptr end)
   {
-    if (cur->used == curmax) {
-      cur->next = new (kalloc("page_holder::batch")) batch();
-      cur = cur->next;
-      curmax = NHEAP;
+    if (!desc.inode)
+      return;
+    if (desc.inode != inode_ || desc.start != base_ || start != end_) {
+      flush();
+      inode_ = desc.inode;
+      base_ = desc.start;
+      start_ = start;
     }
-    page->remove_pte(rmap);
-    new (&cur->pages[cur->used++]) sref<class page_info>(std::move(page));
+    end_ = end;
+  }
+
+  void flush()
+  {
+    if (!inode_)
+      return;
+    if (add_)
+      inode_->as_file()->add_mapping(vm_, start_, end_, base_);
+    else
+      inode_->as_file()->remove_mapping(vm_, start_, end_);
+    inode_.reset();
   }
 };
 
@@ -131,23 +226,24 @@ vmap::alloc(void)
 }
 
 vmap::vmap() : 
-  brk_(0), brklock_("brk_lock", LOCKSTAT_VM)
+  brk_(0), brklock_("brk_lock", LOCKSTAT_VM),
+  lazy_lock_("lazy_pages", LOCKSTAT_VM)
 {
 }
 
 vmap::~vmap()
 {
+  // Take this vmap out of the reverse maps of the files it maps.
+  rmap_update rmap(this, false);
   for (auto it = vpfs_.begin(), end = vpfs_.end(); it != end; ) {
     // Skip unset spans
     if (!it.is_set()) {
       it += it.base_span();
       continue;
     }
-    if (myproc() != bootproc && it->page && it->inode) {
-      std::pair<vmap*, uptr> rmap = std::make_pair(&*this, it.index()*PGSIZE);
-      it->page->remove_pte(rmap);
-    }
-    ++it;
+    size_t span = it.span();
+    rmap.note(*it, it.index() * PGSIZE, (it.index() + span) * PGSIZE);
+    it += span;
   }
 }
 
@@ -163,6 +259,19 @@ vmap::copy()
   {
     auto out = nm->vpfs_.begin();
     auto lock = vpfs_.acquire(vpfs_.begin(), vpfs_.end());
+    rmap_update rmap(nm.get(), true);
+    // The run of page frames [cow_start, cow_end) we've marked COW but
+    // not yet invalidated, starting at cow_begin.  Contiguous runs are
+    // invalidated together, rather than one page at a time.
+    auto cow_begin = vpfs_.begin();
+    uptr cow_start = 0, cow_end = 0;
+    auto flush_cow = [&]() {
+      if (cow_end > cow_start)
+        cache.invalidate(cow_start * PGSIZE, (cow_end - cow_start) * PGSIZE,
+                         cow_begin, &shootdown);
+      cow_start = cow_end = 0;
+    };
+
     for (auto it = vpfs_.begin(), end = vpfs_.end(); it != end; ) {
       // Skip unset spans
       if (!it.is_set()) {
@@ -175,27 +284,33 @@ vmap::copy()
       if (SDEBUG)
         sdebug.println("vm: dup ", *it, " at ", shex(it.index() * PGSIZE));
 
+      // Every page frame in [it, it + span) has the same descriptor,
+      // so we can handle them all at once.
+      size_t span = it.span();
+
       // If the original vmdesc isn't COW, mark it so and fix the page
       // table.
       if (it->page && !(it->flags & vmdesc::FLAG_SHARED) && !(it->flags & vmdesc::FLAG_COW)) {
         if (SDEBUG)
           sdebug.println("vm: mark COW");
         it->flags |= vmdesc::FLAG_COW;
-        // XXX(Austin) Should we try to invalidate in larger chunks?
-        cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
+        if (cow_end != it.index()) {
+          flush_cow();
+          cow_begin = it;
+          cow_start = it.index();
+        }
+        cow_end = it.index() + span;
       }
 
       // Copy the descriptor
-      nm->vpfs_.fill(out, it->dup());
-      if (myproc() != bootproc && out->page && out->inode) {
-        std::pair<vmap*, uptr> rmap = std::make_pair(&*(nm.get()), out.index()*PGSIZE);
-        out->page->add_pte(rmap);
-      }
+      nm->vpfs_.fill(out, out + span, it->dup());
+      rmap.note(*it, out.index() * PGSIZE, (out.index() + span) * PGSIZE);
 
-      // Next page
-      ++out;
-      ++it;
+      // Next run
+      out += span;
+      it += span;
     }
+    flush_cow();
 
     shootdown.perform();
   }
@@ -209,6 +324,7 @@ vmap::insert(const vmdesc &desc, uptr start, uptr len, bool dotlb)
 {
   kstats::inc(&kstats::mmap_count);
   kstats::timer timer(&kstats::mmap_cycles);
+  TRACEPOINT(VM_MMAP, start, len);
 
   if (SDEBUG)
     sdebug.println("vm: insert(", desc, ",", shex(start), ",", shex(len),
@@ -236,17 +352,23 @@ again:
   {
     auto lock = vpfs_.acquire(begin, end);
 
-    for (auto it = begin; it < end; it += it.span()) {
-      if (!it.is_set())
-        continue;
-      // Verify unmapped region now that we hold the lock
-      if (!fixed)
-        goto again;
-      if (myproc() != bootproc && it->page && it->inode) {
-        std::pair<vmap*, uptr> rmap = std::make_pair(&*this, it.index()*PGSIZE);
-        pages.add(std::move(it->page), rmap);
-      } else
+    // Other cores must be done with a lazily unmapped range before it
+    // is mapped again.
+    if (cache.lazy_overlaps(start, start + len))
+      goto flush_lazy;
+
+    {
+      rmap_update unmapped(this, false);
+      for (auto it = begin; it < end; it += it.span()) {
+        if (!it.is_set())
+          continue;
+        // Verify unmapped region now that we hold the lock
+        if (!fixed)
+          goto again;
+        unmapped.note(*it, it.index() * PGSIZE,
+                      std::min(it.index() + it.span(), end.index()) * PGSIZE);
         pages.add(std::move(it->page));
+      }
     }
 
     cache.invalidate(start, len, begin, &shootdown);
@@ -260,11 +382,18 @@ again:
     } else {
       vpfs_.fill(begin, end, desc);
     }
+    if (desc.inode)
+      desc.inode->as_file()->add_mapping(this, start, start + len,
+                                         begin->start);
 
     shootdown.perform();
   }
 
   return start;
+
+flush_lazy:
+  cache.flush_lazy();
+  goto again;
 }
 
 int
@@ -272,23 +401,35 @@ vmap::remove(uptr start, uptr len)
 {
   kstats::inc(&kstats::munmap_count);
   kstats::timer timer(&kstats::munmap_cycles);
+  TRACEPOINT(VM_MUNMAP, start, len);
 
   if (SDEBUG)
     sdebug.println("vm: remove(", start, ",", len, ")");
 
   mmu::shootdown shootdown;
   page_holder pages;
+  // If this only unmaps a few anonymous pages, the other cores can
+  // clear their mappings of them later, while we hold on to them.
+  // File pages remain in use through the page cache, so a stale
+  // mapping of one must not outlive munmap.
+  std::vector<sref<page_info> > lazy;
+  bool defer = VM_LAZY_UNMAP_PAGES > 0;
+  u64 gen = 0;
 
   {
     auto begin = vpfs_.find(start / PGSIZE);
     auto end = vpfs_.find((start + len) / PGSIZE);
     auto lock = vpfs_.acquire(begin, end);
+    rmap_update unmapped(this, false);
     for (auto it = begin; it < end; it += it.span()) {
       if (it.is_set()) {
-        if (myproc() != bootproc && it->page && it->inode) {
-          std::pair<vmap*, uptr> rmap = std::make_pair(&*this, it.index()*PGSIZE);
-          pages.add(std::move(it->page), rmap);
-        } else
+        unmapped.note(*it, it.index() * PGSIZE,
+                      std::min(it.index() + it.span(), end.index()) * PGSIZE);
+        if (it->inode || lazy.size() == VM_LAZY_UNMAP_PAGES)
+          defer = false;
+        if (defer && it->page)
+          lazy.push_back(std::move(it->page));
+        else
           pages.add(std::move(it->page));
       }
     }
@@ -296,41 +437,98 @@ vmap::remove(uptr start, uptr len)
     // XXX If this is a large unset, we could actively re-fold already
     // expanded regions.
     vpfs_.unset(begin, end);
-    shootdown.perform();
+    if (defer)
+      gen = cache.defer(shootdown);
+    else
+      shootdown.perform();
   }
 
+  if (gen) {
+    auto l = lazy_lock_.guard();
+    for (auto &page : lazy)
+      lazy_pages_.push_back(std::make_pair(gen, std::move(page)));
+  }
+  if (defer)
+    reap_lazy();
   return 0;
 }
 
 void
-vmap::delete_mapping(uptr addr)
+vmap::reap_lazy()
+{
+  bool flush;
+  {
+    auto l = lazy_lock_.guard();
+    flush = lazy_pages_.size() > VM_LAZY_UNMAP_PAGES;
+  }
+  if (flush)
+    cache.flush_lazy();
+
+  u64 horizon = cache.lazy_horizon();
+  auto l = lazy_lock_.guard();
+  size_t live = 0;
+  for (size_t i = 0; i < lazy_pages_.size(); i++) {
+    if (lazy_pages_[i].first < horizon)
+      continue;
+    if (live != i)
+      lazy_pages_[live] = std::move(lazy_pages_[i]);
+    live++;
+  }
+  lazy_pages_.erase(lazy_pages_.begin() + live, lazy_pages_.end());
+}
+
+void
+vmap::delete_file_range(mnode *m, uptr start, uptr end)
 {
   mmu::shootdown shootdown;
-  auto vpf = vpfs_.find(addr/PGSIZE);
-  auto lock = vpfs_.acquire(vpf,vpf+1);
-  if (vpf.is_set())
-    vpfs_.unset(vpf,vpf+1);
-  cache.invalidate(addr, PGSIZE, vpf, &shootdown);
+  page_holder pages;
+  auto begin = vpfs_.find(start / PGSIZE);
+  auto stop = vpfs_.find(end / PGSIZE);
+  auto lock = vpfs_.acquire(begin, stop);
+
+  // The range may have been remapped since the file's reverse map was
+  // read, so only take the runs that still map m.
+  std::vector<std::pair<uptr, uptr> > runs;
+  for (auto it = begin; it < stop; it += it.span()) {
+    if (!it.is_set() || it->inode.get() != m)
+      continue;
+    uptr lo = it.index(), hi = std::min(it.index() + it.span(), stop.index());
+    if (!runs.empty() && runs.back().second == lo)
+      runs.back().second = hi;
+    else
+      runs.push_back(std::make_pair(lo, hi));
+    pages.add(std::move(it->page));
+  }
+
+  for (auto &r : runs) {
+    auto rbegin = vpfs_.find(r.first);
+    cache.invalidate(r.first * PGSIZE, (r.second - r.first) * PGSIZE, rbegin,
+                     &shootdown);
+    vpfs_.unset(rbegin, vpfs_.find(r.second));
+    m->as_file()->remove_mapping(this, r.first * PGSIZE, r.second * PGSIZE);
+  }
   shootdown.perform();
 }
 
 void
-vmap::clear_mapping(uptr addr)
+vmap::clear_mapping(uptr addr, const page_info *pi)
 {
   mmu::shootdown shootdown;
   auto vpf = vpfs_.find(addr/PGSIZE);
   auto lock = vpfs_.acquire(vpf);
 
-  if (vpf.is_set()) {
-    auto &desc = *vpf;
-    if (vpf.base_span() == 1) {
-      // Safe to update in place
-      desc.page = sref<page_info>();
-    } else {
-      vmdesc n(desc);
-      n.page = sref<page_info>();
-      vpfs_.fill(vpf, std::move(n));
-    }
+  // A private mapping may have its own copy of the page by now.
+  if (!vpf.is_set() || vpf->page.get() != pi)
+    return;
+
+  auto &desc = *vpf;
+  if (vpf.base_span() == 1) {
+    // Safe to update in place
+    desc.page = sref<page_info>();
+  } else {
+    vmdesc n(desc);
+    n.page = sref<page_info>();
+    vpfs_.fill(vpf, std::move(n));
   }
 
   cache.invalidate(addr, PGSIZE, vpf, &shootdown);
@@ -348,24 +546,28 @@ retry:
 
     page_holder pages;
     mmu::shootdown shootdown;
+    page_stash stash;
 
     for (auto it = begin; it < end; it += it.span()) {
       if (!it.is_set())
         continue;
 
       bool writable = (it->flags & vmdesc::FLAG_WRITE);
+      // If ensure_page will need a new page, hand it one from the
+      // stash.
+      void *fresh = nullptr;
+      if ((!it->page && (it->flags & vmdesc::FLAG_ANON)) ||
+          (writable && (it->flags & vmdesc::FLAG_COW)))
+        fresh = stash.get(end.index() - it.index());
       if (writable && (it->flags & vmdesc::FLAG_COW)) {
-        sref<page_info> old_page = it->page;
-        if (myproc() != bootproc && old_page && it->inode) {
-          std::pair<vmap*, uptr> rmap = std::make_pair(&*this, it.index()*PGSIZE);
-          pages.add(std::move(old_page), rmap);
-        } else
-          pages.add(std::move(old_page));
+        pages.add(sref<page_info>(it->page));
         cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
       }
 
       page_info *page = ensure_page(it, writable ? access_type::WRITE
-          : access_type::READ);
+          : access_type::READ, nullptr, &fresh);
+      if (fresh)
+        stash.put(fresh);
       if (!page)
         continue;
 
@@ -405,6 +607,73 @@ vmap::invalidate_cache(uptr start, uptr len)
   return 0;
 }
 
+int
+vmap::populate(uptr start, uptr len)
+{
+  for (uptr va = start; va < start + len; ) {
+    uptr next = std::min((va + HUGE_PGSIZE) & ~(uptr)(HUGE_PGSIZE - 1),
+                         start + len);
+    // Whole huge pages of anonymous memory are faulted in as huge
+    // pages, as a fault on them would.
+    bool allocated;
+    if (VM_HUGE_PAGES && next - va == HUGE_PGSIZE &&
+        huge_fault(va, access_type::READ, &allocated)) {
+      va = next;
+      continue;
+    }
+    if (willneed(va, next - va) < 0)
+      return -1;
+    va = next;
+  }
+  return 0;
+}
+
+int
+vmap::dontneed(uptr start, uptr len)
+{
+  mmu::shootdown shootdown;
+  page_holder pages;
+
+  auto begin = vpfs_.find(start / PGSIZE);
+  auto end = vpfs_.find((start + len) / PGSIZE);
+  auto lock = vpfs_.acquire(begin, end);
+
+  for (auto it = begin; it < end; it += it.span()) {
+    // Shared pages stay where they are; we only drop their mappings.
+    if (!it.is_set() || !it->page || (it->flags & vmdesc::FLAG_SHARED))
+      continue;
+
+    pages.add(std::move(it->page));
+
+    // Anonymous memory reads as zeros from now on.  A private file
+    // mapping goes back to sharing the file's page copy-on-write.
+    if (it->inode)
+      it->flags |= vmdesc::FLAG_COW;
+    else
+      it->flags &= ~vmdesc::FLAG_COW;
+  }
+
+  cache.invalidate(start, len, begin, &shootdown);
+  shootdown.perform();
+  return 0;
+}
+
+int
+vmap::advise(uptr start, uptr len, uint64_t hint)
+{
+  auto begin = vpfs_.find(start / PGSIZE);
+  auto end = vpfs_.find((start + len) / PGSIZE);
+  auto lock = vpfs_.acquire(begin, end);
+
+  for (auto it = begin; it < end; it += it.span()) {
+    if (!it.is_set())
+      return -1;                // ENOMEM
+    it->flags = (it->flags & ~(vmdesc::FLAG_SEQUENTIAL | vmdesc::FLAG_RANDOM))
+      | hint;
+  }
+  return 0;
+}
+
 int
 vmap::mprotect(uptr start, uptr len, uint64_t flags)
 {
@@ -463,10 +732,8 @@ vmap::dup_page(uptr dest, uptr src)
     auto lock = vpfs_.acquire(destit);
     assert(!destit.is_set());
     vpfs_.fill(destit, desc);
-    if (myproc() != bootproc && destit->page && destit->inode) {
-      std::pair<vmap*, uptr> rmap = std::make_pair(&*this, destit.index()*PGSIZE);
-      destit->page->add_pte(rmap);
-    }
+    if (desc.inode)
+      desc.inode->as_file()->add_mapping(this, dest, dest + PGSIZE, desc.start);
   }
 
   return 0;
@@ -476,6 +743,134 @@ vmap::dup_page(uptr dest, uptr src)
  * pagefault handling code on vmap
  */
 
+bool
+vmap::huge_fault(uptr va, access_type type, bool *allocated)
+{
+  const size_t npages = HUGE_PGSIZE / PGSIZE;
+  uptr hva = va & ~(uptr)(HUGE_PGSIZE - 1);
+  *allocated = false;
+  if (hva + HUGE_PGSIZE > USERTOP)
+    return false;
+
+  // Check without the lock whether this is worth trying: va must be
+  // in anonymous memory that is either untouched (which vmap::insert
+  // leaves folded into a single radix node) or already backed by a
+  // huge page.  We check again under the lock.
+  auto it = vpfs_.find(va / PGSIZE);
+  if (!it.is_set() || (it->flags & vmdesc::FLAG_COW) ||
+      !(it->flags & vmdesc::FLAG_ANON))
+    return false;
+  page_info *pi = it->page.get();
+  if (pi ? !pi->huge_head() : it.base_span() < npages)
+    return false;
+
+  // Allocate and zero a new huge page before taking the lock.
+  char *p = nullptr;
+  if (!pi) {
+    p = kalloc("(vmap::huge_fault)", HUGE_PGSIZE);
+    if (!p)
+      return false;
+    memset(p, 0, HUGE_PGSIZE);
+  }
+
+  auto begin = vpfs_.find(hva / PGSIZE);
+  auto end = vpfs_.find((hva + HUGE_PGSIZE) / PGSIZE);
+  auto lock = vpfs_.acquire(begin, end);
+
+  // Every page frame in the region must have the same flags, and
+  // either none has a page yet or they map the pages of one huge page
+  // in order.
+  bool ok = begin.is_set();
+  u64 flags = ok ? begin->flags & ~vmdesc::FLAG_LOCK : 0;
+  page_info *head = ok ? begin->page.get() : nullptr;
+  ok = ok && (flags & vmdesc::FLAG_ANON) && !(flags & vmdesc::FLAG_COW) &&
+    (type == access_type::READ || (flags & vmdesc::FLAG_WRITE)) &&
+    (head ? !p && head->huge_head() == head : p != nullptr);
+  for (auto it = begin; ok && it < end; it += it.span()) {
+    if (!it.is_set() || (it->flags & ~vmdesc::FLAG_LOCK) != flags)
+      ok = false;
+    else if (!head)
+      ok = !it->page;
+    else
+      ok = it.span() == 1 && it->page &&
+        it->page->pa() == head->pa() + (it.index() - begin.index()) * PGSIZE;
+  }
+  if (!ok) {
+    if (p)
+      kfree(p, HUGE_PGSIZE);
+    return false;
+  }
+
+  if (p) {
+    // Give each page of the huge page its own page_info, so that a
+    // COW fault, mprotect, or munmap of part of it can deal with its
+    // pages one at a time.
+    head = new(page_info::of(p)) page_info(page_info::of(p));
+    for (size_t i = 0; i < npages; i++) {
+      auto pit = begin + i;
+      vmdesc n(*pit);
+      n.page = sref<page_info>::transfer(
+        i == 0 ? head :
+        new(page_info::of(p + i * PGSIZE)) page_info(head));
+      vpfs_.fill(pit, std::move(n));
+    }
+    *allocated = true;
+    kstats::inc(&kstats::page_fault_huge_alloc_count);
+  }
+
+  pme_t pte = head->pa() | PTE_P | PTE_U;
+  if (flags & vmdesc::FLAG_WRITE)
+    pte |= PTE_W;
+  if (!cache.insert_huge(hva, begin, pte))
+    // The caller will map the page we now have with a 4K mapping.
+    return false;
+  kstats::inc(&kstats::page_fault_huge_count);
+  return true;
+}
+
+void
+vmap::fault_around(uptr va)
+{
+  uptr start = va & ~(uptr)(FAULT_AROUND_PAGES * PGSIZE - 1);
+  uptr stop = std::min(start + FAULT_AROUND_PAGES * PGSIZE, (uptr)USERTOP);
+  auto begin = vpfs_.find(start / PGSIZE);
+  auto end = vpfs_.find(stop / PGSIZE);
+  auto lock = vpfs_.acquire(begin, end);
+
+  pme_t ptes[FAULT_AROUND_PAGES] = {};
+  size_t n = (stop - start) / PGSIZE, mapped = 0;
+  try {
+    for (auto it = begin; it < end; ++it) {
+      size_t i = it.index() - begin.index();
+      if (it.index() * PGSIZE == va || !it.is_set() ||
+          (it->flags & vmdesc::FLAG_ANON))
+        continue;
+      // Only take pages that are already in the page cache; reading
+      // the rest is up to their own faults.
+      if (!it->page &&
+          !it->inode->as_file()->page_resident(
+            (it.index() * PGSIZE - it->start) / PGSIZE))
+        continue;
+      page_info *page = ensure_page(it, access_type::READ);
+      if (!page)
+        continue;
+      // Map it as a read fault on it would.
+      ptes[i] = page->pa() | PTE_P | PTE_U;
+      if ((it->flags & vmdesc::FLAG_WRITE) && !(it->flags & vmdesc::FLAG_COW))
+        ptes[i] |= PTE_W;
+      mapped++;
+    }
+  } catch (blocking_io &e) {
+    // The page was evicted after we checked.  Leave it, and anything
+    // after it, to their own faults.
+    e.abort();
+  }
+  if (mapped) {
+    cache.insert_batch(start, begin, ptes, n);
+    kstats::inc(&kstats::page_fault_around_count, mapped);
+  }
+}
+
 int
 vmap::pagefault(uptr va, u32 err)
 {
@@ -486,17 +881,40 @@ vmap::pagefault(uptr va, u32 err)
     return -1;
 
   kstats::inc(&kstats::page_fault_count);
+  TRACEPOINT(VM_PAGEFAULT, va, err);
   kstats::timer timer(&kstats::page_fault_cycles);
   kstats::timer timer_alloc(&kstats::page_fault_alloc_cycles);
   kstats::timer timer_fill(&kstats::page_fault_fill_cycles);
+  SPERF_REGION(pagefault);
+  u64 start_tsc = rdtsc();
+  // Whether we had to read the page in.
+  bool did_io = false;
 
   // If we replace a page, hold a reference until after the shootdown.
   sref<class page_info> old_page;
+  bool file_read = false;
+  // How to bring in file pages if ensure_page needs to do I/O.
+  mfile::fault_hint hint = mfile::fault_hint::normal;
 
   // When we clear from va to va+PGSIZE, make sure that's just this
   // page.
   va = PGROUNDDOWN(va);
 
+  if (VM_HUGE_PAGES) {
+    bool allocated;
+    if (huge_fault(va, type, &allocated)) {
+      if (allocated) {
+        kstats::inc(&kstats::page_fault_alloc_count);
+        timer_fill.abort();
+      } else {
+        kstats::inc(&kstats::page_fault_fill_count);
+        timer_alloc.abort();
+      }
+      pagefault_record(allocated ? PF_ZERO : PF_PRESENT, rdtsc() - start_tsc);
+      return 1;
+    }
+  }
+
  retry:
   try {
     auto it = vpfs_.find(va / PGSIZE);
@@ -512,19 +930,27 @@ vmap::pagefault(uptr va, u32 err)
     if (type == access_type::WRITE && !(desc.flags & vmdesc::FLAG_WRITE)) {
       return -1;
     }
+    hint = hint_of(desc.flags);
 
     // If this is a COW fault, we need to hold a reference to the old
     // physical page until we've cleared the PTE and done TLB shoot
     // down.
     if (type == access_type::WRITE && (desc.flags & vmdesc::FLAG_COW)) {
       old_page = desc.page;
-      if (myproc() != bootproc && old_page && desc.inode) {
-        std::pair<vmap*, uptr> rmap = std::make_pair(&*this, it.index()*PGSIZE);
-        old_page->remove_pte(rmap);
-      }
       cache.invalidate(va, PGSIZE, it, &shootdown);
     }
 
+    // What the fault does, if it succeeds.
+    int fault_type;
+    if (type == access_type::WRITE && (desc.flags & vmdesc::FLAG_COW))
+      fault_type = PF_COW;
+    else if (desc.page)
+      fault_type = PF_PRESENT;
+    else if (desc.flags & vmdesc::FLAG_ANON)
+      fault_type = PF_ZERO;
+    else
+      fault_type = did_io ? PF_FILE_MISS : PF_FILE_HIT;
+
     // Ensure we have a backing page and copy COW pages
     bool allocated;
     page_info *page = ensure_page(it, type, &allocated);
@@ -550,12 +976,25 @@ vmap::pagefault(uptr va, u32 err)
     }
 
     shootdown.perform();
+    file_read = (type == access_type::READ &&
+                 !(desc.flags & vmdesc::FLAG_ANON));
+    pagefault_record(fault_type, rdtsc() - start_tsc);
   } catch (blocking_io &e) {
     // ensure_page attempted to do IO.  Retry the IO now that we've
     // dropped the vpf range lock.
-    e.retry();
+    u64 io_tsc = rdtsc();
+    e.retry(hint);
+    pagefault_record(PF_RETRY, rdtsc() - io_tsc);
+    did_io = true;
     goto retry;
   }
+
+  // Map the neighbouring pages of the file that are already cached,
+  // so a sequential scan of a mapping doesn't fault on every page.
+  // This has to wait until we've dropped the faulting page's lock,
+  // since it locks the pages around it.
+  if (FAULT_AROUND_PAGES > 1 && file_read)
+    fault_around(va);
   return 1;
 }
 
@@ -583,7 +1022,7 @@ pagefault(vmap *vmap, uptr va, u32 err)
 }
 
 void*
-vmap::pagelookup(uptr va)
+vmap::pagelookup(uptr va, bool write)
 {
   if (va >= USERTOP)
     return nullptr;
@@ -601,7 +1040,8 @@ retry:
     if (!it.is_set())
       return nullptr;
 
-    page_info* pi = ensure_page(it, access_type::READ);
+    page_info* pi = ensure_page(it, write ? access_type::WRITE
+                                          : access_type::READ);
     if (!pi)
       return nullptr;
 
@@ -616,7 +1056,7 @@ retry:
 }
 
 void*
-pagelookup(vmap* vmap, uptr va)
+pagelookup(vmap* vmap, uptr va, bool write)
 {
 #if MTRACE
   mt_ascope ascope("%s(%#lx)", __func__, va);
@@ -627,7 +1067,7 @@ pagelookup(vmap* vmap, uptr va)
 #if EXCEPTIONS
     try {
 #endif
-      return vmap->pagelookup(va);
+      return vmap->pagelookup(va, write);
 #if EXCEPTIONS
     } catch (std::bad_alloc& e) {
       cprintf("%d: pagelookup retry\n", myproc()->pid);
@@ -702,6 +1142,7 @@ vmap::sbrk(ssize_t n, uptr *addr)
   if (SDEBUG)
     sdebug.println("vm: sbrk(", n, ") pid ", myproc()->pid);
 
+again:
   scoped_acquire xlock(&brklock_);
   auto curbrk = brk_;
   *addr = curbrk;
@@ -739,6 +1180,15 @@ vmap::sbrk(ssize_t n, uptr *addr)
       end = vpfs_.find(newend / PGSIZE);
     auto rlock = vpfs_.acquire(begin, end);
 
+    // Other cores must be done with a lazily unmapped range before it
+    // is mapped again.
+    if (cache.lazy_overlaps(newstart, newend)) {
+      rlock.release();
+      xlock.release();
+      cache.flush_lazy();
+      goto again;
+    }
+
     // Make sure we're not about to overwrite an existing mapping
     for (auto it = begin; it < end; it += it.span()) {
       if (it.is_set()) {
@@ -775,7 +1225,7 @@ vmap::unmapped_area(size_t npages)
 
 page_info *
 vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
-                  bool *allocated)
+                  bool *allocated, void **fresh)
 {
   if (allocated)
     *allocated = false;
@@ -792,7 +1242,14 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
       assert(!(desc.flags & vmdesc::FLAG_COW));
       if (allocated)
         *allocated = true;
-      char *p = zalloc("(vmap::pagelookup)");
+      char *p;
+      if (fresh && *fresh) {
+        p = (char*)*fresh;
+        *fresh = nullptr;
+        zpage(p);
+      } else {
+        p = zalloc("(vmap::pagelookup)");
+      }
       if (!p)
         throw_bad_alloc();
       page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
@@ -801,6 +1258,8 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
       page = desc.inode->as_file()->get_page(page_idx).get_page_info();
       if (!page)
         return nullptr;
+      if (!(desc.flags & vmdesc::FLAG_WRITE))
+        page = desc.inode->as_file()->replica_page(page_idx, std::move(page));
     }
   }
 
@@ -808,7 +1267,14 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
     // This is a COW fault; copy in to a new page
     if (allocated)
       *allocated = true;
-    char *p = zalloc("(vmap::pagelookup)");
+    char *p;
+    if (fresh && *fresh) {
+      // No need to zero it; we're about to overwrite it.
+      p = (char*)*fresh;
+      *fresh = nullptr;
+    } else {
+      p = zalloc("(vmap::pagelookup)");
+    }
     if (!p)
       throw_bad_alloc();
 
@@ -834,10 +1300,6 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
     // save extraneous reference counting
     vpfs_.fill(it, std::move(n));
   }
-  if (myproc() != bootproc && it->page && it->inode) {
-    std::pair<vmap*, uptr> rmap = std::make_pair(&*this, it.index()*PGSIZE);
-    it->page->add_pte(rmap);
-  }
   return page.get();
 }
 
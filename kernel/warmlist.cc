@@ -0,0 +1,177 @@
+// Persistent page-cache warmup list.
+//
+// After a reboot the page-cache starts out empty, and until the services
+// that were running have read their files back in, every miss is a disk
+// read.  So sync() and halt save the pages that are cached at the time,
+// recently used ones first and at most SCALEFS_WARMLIST_PAGES of them, to
+// WARMLIST_PATH as runs of pages of a file, and when init_scalefs() is done
+// the list is read back and a kernel thread per core reads its share of the
+// runs with the asynchronous readahead I/O (see mfile::prefetch()).
+//
+// Files are named by inode number and generation, since mnode numbers don't
+// survive a reboot.  A run whose inode has since been freed or reused is
+// skipped.  The list is only a hint: nothing goes wrong if it is stale,
+// missing, or out of date because the last shutdown was a crash.
+
+#include "types.h"
+#include "kernel.hh"
+#include "mnode.hh"
+#include "mfs.hh"
+#include "fs.h"
+#include "sleeplock.hh"
+
+#include <algorithm>
+#include <memory>
+
+#define WARMLIST_PATH "/sv6warmlist"
+#define WARMLIST_MAGIC 0x7473696c6d726177ull  // "warmlist"
+
+namespace {
+  struct warmlist_header {
+    u64 magic;
+    u64 nruns;
+  };
+
+  struct warmlist_run {
+    u64 inum;
+    u32 gen;
+    u32 start;                  // First page
+    u32 npages;
+    u32 pad;
+  };
+
+  // The runs one core's warmup thread reads in.
+  struct warm_work {
+    NEW_DELETE_OPS(warm_work);
+    std::vector<pair<sref<mnode>, warmlist_run>> runs;
+  };
+
+  sleeplock save_lock;
+
+  void
+  warm_thread(void *arg)
+  {
+    warm_work *w = (warm_work*)arg;
+    for (auto &r : w->runs)
+      r.first->as_file()->prefetch(r.second.start, r.second.npages);
+    for (auto &r : w->runs)
+      r.first->as_file()->finish_prefetch();
+    delete w;
+  }
+}
+
+void
+warmlist_save()
+{
+  if (!SCALEFS_WARMLIST_PAGES)
+    return;
+
+  auto l = save_lock.guard();
+  std::vector<pair<u64, u64>> hot;
+  pagecache_hot_pages(&hot, SCALEFS_WARMLIST_PAGES);
+
+  sref<mnode> m = create(root_fs->mget(root_mnum), WARMLIST_PATH, T_FILE,
+                         0, 0, false);
+  if (!m || m->type() != mnode::types::file)
+    return;
+
+  struct page {
+    u64 inum;
+    u32 gen;
+    u64 idx;
+    bool operator<(const page &o) const
+    {
+      return inum != o.inum ? inum < o.inum : idx < o.idx;
+    }
+  };
+  std::vector<page> pages;
+  for (auto &h : hot) {
+    page p;
+    if (h.first == m->mnum_ || h.second > ~0u ||
+        !rootfs_interface->file_identity(h.first, &p.inum, &p.gen))
+      continue;
+    p.idx = h.second;
+    pages.push_back(p);
+  }
+  std::sort(pages.begin(), pages.end());
+
+  std::vector<warmlist_run> runs;
+  for (auto &p : pages) {
+    if (!runs.empty() && runs.back().inum == p.inum) {
+      warmlist_run &r = runs.back();
+      if (p.idx < r.start + r.npages)
+        continue;
+      if (p.idx == r.start + r.npages) {
+        r.npages++;
+        continue;
+      }
+    }
+    warmlist_run r = { p.inum, p.gen, (u32)p.idx, 1, 0 };
+    runs.push_back(r);
+  }
+
+  warmlist_header hdr = { WARMLIST_MAGIC, runs.size() };
+  if (*m->as_file()->read_size())
+    m->as_file()->write_size().resize_nogrow(0);
+  writem(m, (const char*)&hdr, 0, sizeof(hdr), nullptr);
+  if (!runs.empty())
+    writem(m, (const char*)&runs[0], sizeof(hdr),
+           runs.size() * sizeof(warmlist_run), nullptr);
+}
+
+void
+warmlist_load()
+{
+  if (!SCALEFS_WARMLIST_PAGES)
+    return;
+
+  sref<mnode> m = namei(root_fs->mget(root_mnum), WARMLIST_PATH);
+  if (!m || m->type() != mnode::types::file)
+    return;
+
+  warmlist_header hdr;
+  if (readm(m, (char*)&hdr, 0, sizeof(hdr)) != sizeof(hdr) ||
+      hdr.magic != WARMLIST_MAGIC || hdr.nruns == 0 ||
+      hdr.nruns > SCALEFS_WARMLIST_PAGES)
+    return;
+  std::unique_ptr<warmlist_run[]> runs(new warmlist_run[hdr.nruns]);
+  u64 len = hdr.nruns * sizeof(warmlist_run);
+  if (readm(m, (char*)runs.get(), sizeof(hdr), len) != (s64)len)
+    return;
+
+  // Look the files up here, while nothing else is loading directories (see
+  // mfs_interface::load_file()), and spread the reading over the cores by
+  // pages rather than by runs.
+  warm_work *work[NCPU];
+  u64 load[NCPU] = {};
+  u64 npages = 0, nloaded = 0;
+  for (int c = 0; c < ncpu; c++)
+    work[c] = new warm_work();
+  for (u64 i = 0; i < hdr.nruns; i++) {
+    const warmlist_run &r = runs[i];
+    sref<mnode> f = rootfs_interface->load_file(r.inum, r.gen);
+    if (!f)
+      continue;
+    int c = 0;
+    for (int i = 1; i < ncpu; i++)
+      if (load[i] < load[c])
+        c = i;
+    work[c]->runs.push_back(make_pair(f, r));
+    load[c] += r.npages;
+    npages += r.npages;
+    nloaded++;
+  }
+
+  for (int c = 0; c < ncpu; c++) {
+    if (work[c]->runs.empty()) {
+      delete work[c];
+      continue;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "warmlist_%u", c);
+    threadpin(warm_thread, work[c], name, c);
+  }
+
+  if (VERBOSE)
+    cprintf("warmlist: reading %lu pages in %lu runs\n", npages, nloaded);
+}
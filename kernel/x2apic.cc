@@ -32,9 +32,11 @@
   #define ASSERT     0x00004000   // Assert interrupt (vs deassert)
   #define DEASSERT   0x00000000
   #define FIXED      0x00000000
+  #define LOGICAL    0x00000800ull   // Logical destination mode
 #define TIMER   0x832   // Local Vector Table 0 (TIMER)
   #define X1         0x0000000B   // divide counts by 1
   #define PERIODIC   0x00020000   // Periodic
+  #define TSC_DEADLINE 0x00040000 // Interrupt at MSR_TSC_DEADLINE
 #define THERM   0x833   // Thermal sensor LVT
 #define PCINT   0x834   // Performance Counter LVT
 #define LINT0   0x835   // Local Vector Table 1 (LINT0)
@@ -51,6 +53,8 @@
 static console_stream verbose(true);
 
 static u64 x2apichz;
+// Each CPU's logical destination, or 0 if its LAPIC isn't set up yet.
+static u32 x2apicldr[NCPU];
 
 class x2apic_lapic : public abstract_lapic
 {
@@ -59,7 +63,9 @@ public:
   hwid_t id() override;
   void eoi() override;
   void send_ipi(struct cpu *c, int ino) override;
+  void send_ipi_many(const bitset<NCPU> &targets, int ino) override;
   void mask_pc(bool mask) override;
+  void set_timer(u64 deadline) override;
   void start_ap(struct cpu *c, u32 addr) override;
   bool is_x2apic() override;
   void dump() override;
@@ -158,6 +164,35 @@ x2apic_lapic::send_ipi(struct cpu *c, int ino)
   writemsr(ICR, (((u64)c->hwid.num)<<32) | FIXED | DEASSERT | ino);
 }
 
+// In x2APIC mode, a CPU's logical destination is fixed by its APIC ID:
+// its cluster of 16 in the high 16 bits and a bit for its place in the
+// cluster in the low 16.  So a logical IPI reaches any of the targets
+// in one cluster, and we need one ICR write per cluster rather than
+// per CPU.
+void
+x2apic_lapic::send_ipi_many(const bitset<NCPU> &targets, int ino)
+{
+  u32 dest[NCPU];
+  int ndest = 0;
+  asm volatile("mfence");
+  for (auto cpu : targets) {
+    u32 ldr = x2apicldr[cpu];
+    if (!ldr) {
+      writemsr(ICR, (((u64)cpus[cpu].hwid.num)<<32) | FIXED | DEASSERT | ino);
+      continue;
+    }
+    int i = 0;
+    while (i < ndest && (dest[i] >> 16) != (ldr >> 16))
+      i++;
+    if (i == ndest)
+      dest[ndest++] = ldr;
+    else
+      dest[i] |= ldr & 0xffff;
+  }
+  for (int i = 0; i < ndest; i++)
+    writemsr(ICR, ((u64)dest[i]<<32) | LOGICAL | FIXED | DEASSERT | ino);
+}
+
 hwid_t
 x2apic_lapic::id()
 {
@@ -209,7 +244,6 @@ x2apic_lapic::clearintr()
 void
 x2apic_lapic::cpu_init()
 {
-  u64 count;
   u32 value;
   int maxlvt;
 
@@ -264,15 +298,19 @@ x2apic_lapic::cpu_init()
     x2apichz = 100 * (ccr0 - ccr1);
   }
 
-  count = (QUANTUM*x2apichz) / 1000;
-  if (count > 0xffffffff)
-    panic("initx2apic: QUANTUM too large");
-
-  // The timer repeatedly counts down at bus frequency
-  // from xapic[TICR] and then issues an interrupt.  
+  // The timer interrupts once, either when the TSC reaches the
+  // deadline or after counting down from TICR at bus frequency, and
+  // timerintr() sets it again for the next tick or timeout.
   writemsr(TDCR, X1);
-  writemsr(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  writemsr(TICR, count); 
+  if (cpuid::features().tsc_deadline) {
+    writemsr(TIMER, TSC_DEADLINE | (T_IRQ0 + IRQ_TIMER));
+    // WRMSR to the LVT isn't serializing in x2APIC mode, so order it
+    // before the deadline write.
+    asm volatile("mfence" ::: "memory");
+  } else {
+    writemsr(TIMER, T_IRQ0 + IRQ_TIMER);
+  }
+  set_timer(rdtsc() + cpuhz / 1000 * QUANTUM);
 
   // Clear error status register (requires back-to-back writes).
   writemsr(ESR, 0);
@@ -281,9 +319,26 @@ x2apic_lapic::cpu_init()
   // Ack any outstanding interrupts.
   writemsr(EOI, 0);
 
+  // Now other CPUs can multicast to us.
+  x2apicldr[myid()] = readmsr(LDR);
+
   return;
 }
 
+void
+x2apic_lapic::set_timer(u64 deadline)
+{
+  if (cpuid::features().tsc_deadline) {
+    writemsr(MSR_TSC_DEADLINE, deadline);
+    return;
+  }
+  // TICR is 32 bits, so a far deadline takes a few interrupts.
+  u64 now = rdtsc();
+  u64 delta = deadline > now ? std::min(deadline - now, cpuhz) : 0;
+  u64 count = delta * x2apichz / cpuhz;
+  writemsr(TICR, count ? std::min(count, (u64)0xffffffff) : 1);
+}
+
 void
 x2apic_lapic::dump()
 {
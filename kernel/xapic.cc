@@ -43,6 +43,7 @@ static console_stream verbose(true);
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
   #define X1         0x0000000B   // divide counts by 1
   #define PERIODIC   0x00020000   // Periodic
+  #define TSC_DEADLINE 0x00040000 // Interrupt at MSR_TSC_DEADLINE
 #define THERM   (0x0330/4)   // Thermal sensor LVT
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
@@ -69,6 +70,7 @@ public:
   void eoi() override;
   void send_ipi(struct cpu *c, int ino) override;
   void mask_pc(bool mask) override;
+  void set_timer(u64 deadline) override;
   void start_ap(struct cpu *c, u32 addr) override;
   void dump() override;
 private:
@@ -118,8 +120,6 @@ xapic_lapic::init()
 void
 xapic_lapic::cpu_init()
 {
-  u64 count;
-
   verbose.println("xapic: Initializing LAPIC (CPU ", myid(), ")");
 
   // Enable local APIC, do not suppress EOI broadcast, set spurious
@@ -136,15 +136,16 @@ xapic_lapic::cpu_init()
     xapichz = 100 * (ccr0 - ccr1);
   }
 
-  count = (QUANTUM*xapichz) / 1000;
-  if (count > 0xffffffff)
-    panic("initxapic: QUANTUM too large");
-
-  // The timer repeatedly counts down at bus frequency
-  // from xapic[TICR] and then issues an interrupt.  
+  // The timer interrupts once, either when the TSC reaches the
+  // deadline or after counting down from TICR at bus frequency, and
+  // timerintr() sets it again for the next tick or timeout.
   xapicw(TDCR, X1);
-  xapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-  xapicw(TICR, count); 
+  if (cpuid::features().tsc_deadline) {
+    xapicw(TIMER, TSC_DEADLINE | (T_IRQ0 + IRQ_TIMER));
+  } else {
+    xapicw(TIMER, T_IRQ0 + IRQ_TIMER);
+  }
+  set_timer(rdtsc() + cpuhz / 1000 * QUANTUM);
 
   // Disable logical interrupt lines.
   xapicw(LINT0, MASKED);
@@ -243,6 +244,20 @@ xapic_lapic::start_ap(struct cpu *c, u32 addr)
   }
 }
 
+void
+xapic_lapic::set_timer(u64 deadline)
+{
+  if (cpuid::features().tsc_deadline) {
+    writemsr(MSR_TSC_DEADLINE, deadline);
+    return;
+  }
+  // TICR is 32 bits, so a far deadline takes a few interrupts.
+  u64 now = rdtsc();
+  u64 delta = deadline > now ? std::min(deadline - now, cpuhz) : 0;
+  u64 count = delta * xapichz / cpuhz;
+  xapicw(TICR, count ? std::min(count, (u64)0xffffffff) : 1);
+}
+
 void
 xapic_lapic::dump()
 {
@@ -6,6 +6,9 @@
 #include "ilist.hh"
 #include "mtrace.h"
 #include "work.hh"
+#include "condvar.hh"
+
+#include <algorithm>
 
 extern "C" void zpage(void*);
 extern "C" void zpage_nc(void*);
@@ -24,6 +27,14 @@ struct zallocator {
   free_page::list_t pages;
   unsigned nPages;
   dwframe frame;
+
+  // The number of pages the idle loop keeps zeroed, and the zalloc
+  // calls and misses (calls that found no zeroed page) since
+  // window_start, from which the idle loop adapts target.  Also local
+  // to this CPU and accessed with interrupts disabled.
+  unsigned target;
+  u64 allocs, misses;
+  u64 window_start;
 };
 DEFINE_PERCPU(zallocator, z_);
 
@@ -35,10 +46,10 @@ struct zwork : public dwork {
   }
 
   virtual void run() override {
-    for (int i = 0; i < 32; i++) {
-      auto *r = (struct free_page*)kalloc("zpage");
-      if (r == nullptr)
-        break;
+    void *pages[32];
+    size_t n = kalloc_batch("zpage", 32, pages);
+    for (size_t i = 0; i < n; i++) {
+      auto *r = (struct free_page*)pages[i];
       zpage_nc(r);
       scoped_cli cli;
       z_->pages.push_front(r);
@@ -53,11 +64,14 @@ struct zwork : public dwork {
   NEW_DELETE_OPS(zwork);
 };
 
+// Most zeroing happens in zalloc_idle(), but a core that never goes
+// idle falls back to zeroing a batch of pages in a dwork whenever it is
+// about to run out.
 static void
 tryrefill(void)
 {
   int cpu = myid();
-  if (prezero && z_[cpu].nPages < 16 && z_[cpu].frame.zero()) {
+  if (prezero && z_[cpu].nPages < ZALLOC_TARGET_MIN && z_[cpu].frame.zero()) {
     zwork* w = new zwork(&z_[cpu].frame);
     // XXX This is higher priority than doing actual work.  We should
     // only do background zeroing if we would otherwise be idle.
@@ -79,7 +93,10 @@ zalloc(const char* name)
       p = (char*)&z_->pages.front();
       z_->pages.pop_front();
       --z_->nPages;
+    } else {
+      ++z_->misses;
     }
+    ++z_->allocs;
   }
 
   if (p == nullptr) {
@@ -113,7 +130,115 @@ zfree(void* p)
   ++z_->nPages;
 }
 
+// Adapt this CPU's target pool size once per window: double it if
+// zalloc ran dry during the window, and shrink it by a quarter if the
+// window used less than half of it.  Under memory pressure, drop to
+// the minimum.  Call with interrupts disabled.
+static void
+adapt_target(zallocator *z, bool pressure)
+{
+  u64 now = nsectime();
+  if (pressure) {
+    z->target = ZALLOC_TARGET_MIN;
+  } else if (now - z->window_start >= 100 * 1000000ull) {
+    if (z->misses)
+      z->target = std::min(z->target * 2, (unsigned)ZALLOC_TARGET_MAX);
+    else if (z->allocs < z->target / 2)
+      z->target = std::max(z->target - z->target / 4,
+                           (unsigned)ZALLOC_TARGET_MIN);
+  } else {
+    return;
+  }
+  z->allocs = z->misses = 0;
+  z->window_start = now;
+}
+
+// Called by the idle loop when there is nothing to run.  Zeroes a batch
+// of pages if this CPU's pool is below its target, or gives back pages
+// past the target.  Returns true if it did anything, so the idle loop
+// looks for work again instead of halting.
+bool
+zalloc_idle(void)
+{
+  enum { BATCH = 16 };
+  void *pages[BATCH];
+  size_t n = 0;
+  bool giveback = false;
+  bool pressure =
+    kalloc_free_pages() < kalloc_total_pages() / ZALLOC_PRESSURE_DIV;
+
+  {
+    scoped_cli cli;
+    zallocator *z = &*z_;
+    adapt_target(z, pressure);
+    if (z->nPages > z->target + BATCH) {
+      giveback = true;
+      for (; n < BATCH; n++) {
+        pages[n] = &z->pages.front();
+        z->pages.pop_front();
+        --z->nPages;
+      }
+    } else if (z->nPages < z->target && !pressure) {
+      // Allocate with interrupts disabled so that kalloc won't block
+      // trying to reclaim memory.
+      n = kalloc_batch("zpage", std::min((unsigned)BATCH,
+                                         z->target - z->nPages), pages);
+      if (n == 0)
+        return false;
+    } else {
+      return false;
+    }
+  }
+
+  if (giveback) {
+    kfree_batch(pages, n);
+    return true;
+  }
+
+  for (size_t i = 0; i < n; i++)
+    zpage_nc(pages[i]);
+  scoped_cli cli;
+  for (size_t i = 0; i < n; i++) {
+    z_->pages.push_front((struct free_page*)pages[i]);
+    ++z_->nPages;
+  }
+  return true;
+}
+
+// Shrinker that gives this CPU's pool of zeroed pages back to kalloc.
+// Other CPUs' pools are only safe to touch from those CPUs; the idle loop
+// shrinks them once it notices the memory pressure.
+static u64
+zalloc_shrink(u64 npages)
+{
+  enum { BATCH = 32 };
+  void *pages[BATCH];
+  u64 nfreed = 0;
+
+  while (nfreed < npages) {
+    size_t n = 0;
+    {
+      scoped_cli cli;
+      zallocator *z = &*z_;
+      z->target = ZALLOC_TARGET_MIN;
+      for (; n < BATCH && !z->pages.empty(); n++) {
+        pages[n] = &z->pages.front();
+        z->pages.pop_front();
+        --z->nPages;
+      }
+    }
+    if (n == 0)
+      break;
+    kfree_batch(pages, n);
+    nfreed += n;
+  }
+  return nfreed;
+}
+
 void
 initz(void)
 {
+  for (int cpu = 0; cpu < NCPU; cpu++)
+    z_[cpu].target = ZALLOC_TARGET_MIN;
+  register_shrinker("zalloc pools", SHRINK_CPU_CACHES, zalloc_shrink);
 }
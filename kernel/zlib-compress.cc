@@ -0,0 +1,49 @@
+#include "types.h"
+#include "kernel.hh"
+#include "zlib.h"
+#include "fs.h"
+#include "zlib-compress.hh"
+#include "zlib-decompress.hh"
+
+// Compress the nsrc BSIZE-byte buffers at src into a single zlib stream,
+// filling the ndst BSIZE-byte buffers at dst in turn. Returns the length of
+// the stream, or 0 if it doesn't fit in them.
+u64
+zlib_compress_blocks(const char *const *src, u32 nsrc, char *const *dst,
+                     u32 ndst)
+{
+  z_stream stream;
+  int err;
+
+  stream.zalloc = zlib_alloc;
+  stream.zfree  = zlib_free;
+  stream.opaque = (void *)"zlib";
+
+  err = deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+  if (err == Z_MEM_ERROR)
+    return 0;
+  if (err != Z_OK)
+    panic("%s: deflateInit() failed!\n", __func__);
+
+  u32 in = 0, out = 0;
+  stream.avail_in = 0;
+  stream.avail_out = 0;
+  do {
+    if (stream.avail_in == 0 && in < nsrc) {
+      stream.next_in = (unsigned char *)src[in++];
+      stream.avail_in = BSIZE;
+    }
+    if (stream.avail_out == 0) {
+      if (out == ndst)
+        break;
+      stream.next_out = (unsigned char *)dst[out++];
+      stream.avail_out = BSIZE;
+    }
+    err = deflate(&stream, in == nsrc ? Z_FINISH : Z_NO_FLUSH);
+    assert(err != Z_STREAM_ERROR); // state not clobbered
+  } while (err != Z_STREAM_END);
+
+  u64 len = err == Z_STREAM_END ? stream.total_out : 0;
+  deflateEnd(&stream);
+  return len;
+}
@@ -84,3 +84,33 @@ zlib_decompress(unsigned char *src, u64 srclen, u64 dstlen,
   assert(err == Z_STREAM_END);
   return 0;
 }
+
+// Decompress the zlib stream at src, of at most srclen bytes, into dst.
+// Returns the number of bytes it holds, or -1 if the stream is corrupt or
+// doesn't fit in dstlen bytes.
+s64
+zlib_decompress_buf(const void *src, u64 srclen, void *dst, u64 dstlen)
+{
+  z_stream stream;
+  int err;
+
+  stream.zalloc = zlib_alloc;
+  stream.zfree  = zlib_free;
+  stream.opaque = (void *)"zlib";
+
+  stream.next_in = (unsigned char *)src;
+  stream.avail_in = srclen;
+  stream.next_out = (unsigned char *)dst;
+  stream.avail_out = dstlen;
+
+  err = inflateInit(&stream);
+  if (err == Z_MEM_ERROR)
+    return -1;
+  if (err != Z_OK)
+    panic("%s: inflateInit() failed!\n", __func__);
+
+  err = inflate(&stream, Z_FINISH);
+  s64 len = err == Z_STREAM_END ? stream.total_out : -1;
+  inflateEnd(&stream);
+  return len;
+}
@@ -1,13 +1,131 @@
+#define XV6_STRING_IMPL
 #include "amd64.h"
 
 #include <ctype.h>
 #include <string.h>
 #include <strings.h>
 
+// Whether rep movsb and rep stosb are fast at any alignment (CPUID
+// 7.EBX "enhanced REP MOVSB/STOSB").  -1 until checked.  uaccess.S
+// reads this too.
+int string_erms = -1;
+
+static int
+has_erms(void)
+{
+  int e = string_erms;
+  if (e < 0) {
+    uint32_t a, b, c, d;
+    __asm volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d)
+                   : "a" (0));
+    b = 0;
+    if (a >= 7)
+      __asm volatile("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d)
+                     : "a" (7), "c" (0));
+    string_erms = e = (b >> 9) & 1;
+  }
+  return e;
+}
+
+// Below this, rep's startup costs more than it saves even with ERMS.
+#define REP_MIN 256
+
+static inline uint64_t
+load64(const char *p)
+{
+  uint64_t v;
+  __builtin_memcpy(&v, p, 8);
+  return v;
+}
+
+static inline void
+store64(char *p, uint64_t v)
+{
+  __builtin_memcpy(p, &v, 8);
+}
+
+// Copy up to 32 bytes.  Everything is loaded before anything is stored,
+// so this is safe for overlapping buffers in either direction.
+static inline void
+copy_small(char *d, const char *s, size_t n)
+{
+  if (n >= 16) {
+    uint64_t a = load64(s), b = load64(s + 8);
+    uint64_t y = load64(s + n - 16), z = load64(s + n - 8);
+    store64(d, a);
+    store64(d + 8, b);
+    store64(d + n - 16, y);
+    store64(d + n - 8, z);
+  } else if (n >= 8) {
+    uint64_t a = load64(s), z = load64(s + n - 8);
+    store64(d, a);
+    store64(d + n - 8, z);
+  } else if (n >= 4) {
+    uint32_t a, z;
+    __builtin_memcpy(&a, s, 4);
+    __builtin_memcpy(&z, s + n - 4, 4);
+    __builtin_memcpy(d, &a, 4);
+    __builtin_memcpy(d + n - 4, &z, 4);
+  } else if (n) {
+    char a = s[0], m = s[n / 2], z = s[n - 1];
+    d[0] = a;
+    d[n / 2] = m;
+    d[n - 1] = z;
+  }
+}
+
+// Copy n > 32 bytes from s up to d, where d does not start inside
+// [s, s+n).
+static inline void
+copy_forward(char *d, const char *s, size_t n)
+{
+  if (n >= REP_MIN && has_erms()) {
+    __asm volatile("rep movsb"
+                   : "+D" (d), "+S" (s), "+c" (n) :: "memory");
+    return;
+  }
+  // Whole words, then the last (possibly overlapping) word.  The last
+  // word is read first because a forward copy to a lower, overlapping
+  // d may overwrite it.
+  uint64_t z = load64(s + n - 8);
+  char *end = d + n - 8;
+  size_t w = n / 8;
+  __asm volatile("rep movsq"
+                 : "+D" (d), "+S" (s), "+c" (w) :: "memory");
+  store64(end, z);
+}
+
 void*
 memset(void *dst, int c, size_t n)
 {
-  stosb(dst, c, n);
+  char *d = dst;
+  uint64_t v = (uint8_t)c * 0x0101010101010101ull;
+  if (n < 4) {
+    if (n) {
+      d[0] = c;
+      d[n / 2] = c;
+      d[n - 1] = c;
+    }
+  } else if (n < 8) {
+    uint32_t v32 = v;
+    __builtin_memcpy(d, &v32, 4);
+    __builtin_memcpy(d + n - 4, &v32, 4);
+  } else if (n <= 32) {
+    store64(d, v);
+    store64(d + n - 8, v);
+    if (n > 16) {
+      store64(d + 8, v);
+      store64(d + n - 16, v);
+    }
+  } else if (n >= REP_MIN && has_erms()) {
+    stosb(dst, c, n);
+  } else {
+    char *end = d + n - 8;
+    size_t w = n / 8;
+    __asm volatile("rep stosq"
+                   : "+D" (d), "+c" (w) : "a" (v) : "memory");
+    store64(end, v);
+  }
   return dst;
 }
 
@@ -30,33 +148,33 @@ memmove(void *dst, const void *src, size_t n)
 
   s = src;
   d = dst;
-  if (s < d && s + n > d) {
+  if (n <= 32) {
+    copy_small(d, s, n);
+  } else if (s < d && s + n > d) {
     s += n;
     d += n;
-    if ((intptr_t)s%4 == 0 && (intptr_t)d%4 == 0 && n%4 == 0)
-      __asm volatile("std; rep movsl\n"
-              :: "D" (d-4), "S" (s-4), "c" (n/4) : "cc", "memory");
+    if ((intptr_t)s%8 == 0 && (intptr_t)d%8 == 0 && n%8 == 0)
+      __asm volatile("std; rep movsq\n"
+              :: "D" (d-8), "S" (s-8), "c" (n/8) : "cc", "memory");
     else
       __asm volatile("std; rep movsb\n"
               :: "D" (d-1), "S" (s-1), "c" (n) : "cc", "memory");
     // Some versions of GCC rely on DF being clear
     __asm volatile("cld" ::: "cc");
   } else {
-    if ((intptr_t)s%4 == 0 && (intptr_t)d%4 == 0 && n%4 == 0)
-      __asm volatile("cld; rep movsl\n"
-              :: "D" (d), "S" (s), "c" (n/4) : "cc", "memory");
-    else
-      __asm volatile("cld; rep movsb\n"
-              :: "D" (d), "S" (s), "c" (n) : "cc", "memory");
+    copy_forward(d, s, n);
   }
   return dst;
 }
 
-// memcpy exists to placate GCC.  Use memmove.
 void*
 memcpy(void *dst, const void *src, size_t n)
 {
-  return memmove(dst, src, n);
+  if (n <= 32)
+    copy_small(dst, src, n);
+  else
+    copy_forward(dst, src, n);
+  return dst;
 }
 
 void*
@@ -0,0 +1,225 @@
+#include "types.h"
+#include "user.h"
+#include "futex.h"
+#include "libutil.h"
+#include "taskpool.hh"
+
+#include <unistd.h>
+
+// Workers run nested waits on their own stacks, so give them more than
+// pthread_create's.
+enum { worker_stack_size = 64 * 1024 };
+
+// Rounds of failed stealing before an idle worker goes to sleep.
+enum { idle_spins = 1024 };
+
+static __thread task_pool *tls_pool;
+static __thread int tls_worker;
+
+bool
+task_pool::deque::push(task *t)
+{
+  long b = bottom.load(std::memory_order_relaxed);
+  long tp = top.load(std::memory_order_acquire);
+  if (b - tp >= CAPACITY)
+    return false;
+  slots[b % CAPACITY].store(t, std::memory_order_relaxed);
+  bottom.store(b + 1, std::memory_order_release);
+  return true;
+}
+
+task_pool::task *
+task_pool::deque::pop()
+{
+  long b = bottom.load(std::memory_order_relaxed) - 1;
+  bottom.store(b, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  long tp = top.load(std::memory_order_relaxed);
+  if (tp > b) {
+    // Empty
+    bottom.store(b + 1, std::memory_order_relaxed);
+    return nullptr;
+  }
+  task *t = slots[b % CAPACITY].load(std::memory_order_relaxed);
+  if (tp == b) {
+    // The last task.  Race thieves for it.
+    if (!top.compare_exchange_strong(tp, tp + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed))
+      t = nullptr;
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+  return t;
+}
+
+task_pool::task *
+task_pool::deque::steal()
+{
+  long tp = top.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  long b = bottom.load(std::memory_order_acquire);
+  if (tp >= b)
+    return nullptr;
+  task *t = slots[tp % CAPACITY].load(std::memory_order_relaxed);
+  if (!top.compare_exchange_strong(tp, tp + 1, std::memory_order_seq_cst,
+                                   std::memory_order_relaxed))
+    return nullptr;
+  return t;
+}
+
+task_pool::task_pool(int nworkers, int first_core)
+  : nworkers_(nworkers), workers_(nullptr), stop_(false), epoch_(0),
+    sleepers_(0)
+{
+  if (nworkers < 1)
+    die("task_pool: need at least one worker");
+  workers_ = new worker[nworkers];
+  for (int i = 0; i < nworkers; i++) {
+    workers_[i].pool = this;
+    workers_[i].id = i;
+    workers_[i].core = first_core + i;
+    workers_[i].rand = 2654435761u * (i + 1);
+  }
+
+  if (setaffinity(first_core) < 0)
+    die("task_pool: setaffinity %d failed", first_core);
+  workers_[0].tid = getpid();
+  tls_pool = this;
+  tls_worker = 0;
+
+  for (int i = 1; i < nworkers; i++) {
+    char *base = (char*)sbrk(worker_stack_size);
+    if (base == (char*)-1)
+      die("task_pool: sbrk failed");
+    int tid = forkt(base + worker_stack_size, (void*)worker_main, &workers_[i],
+                    FORK_SHARE_VMAP | FORK_SHARE_FD);
+    if (tid < 0)
+      die("task_pool: forkt failed");
+    workers_[i].tid = tid;
+  }
+}
+
+task_pool::~task_pool()
+{
+  stop_ = true;
+  epoch_++;
+  futex((const u64*)&epoch_, FUTEX_WAKE, nworkers_, 0, nullptr, 0);
+  for (int i = 1; i < nworkers_; i++)
+    waitpid(workers_[i].tid, nullptr, 0);
+  if (tls_pool == this)
+    tls_pool = nullptr;
+  delete[] workers_;
+}
+
+task_pool *
+task_pool::current()
+{
+  return tls_pool;
+}
+
+void
+task_pool::spawn(task *t, std::atomic<long> *pending)
+{
+  t->pending_ = pending;
+  pending->fetch_add(1);
+  if (current() != this || !workers_[tls_worker].q.push(t)) {
+    // Not one of our workers, or its deque is full
+    execute(t);
+    return;
+  }
+
+  // Pairs with the fence in idle(): either a sleeping worker sees our
+  // task, or we see it counted in sleepers_.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers_.load(std::memory_order_relaxed)) {
+    epoch_++;
+    futex((const u64*)&epoch_, FUTEX_WAKE, 1, 0, nullptr, 0);
+  }
+}
+
+void
+task_pool::execute(task *t)
+{
+  std::atomic<long> *pending = t->pending_;
+  t->run();
+  delete t;
+  pending->fetch_sub(1, std::memory_order_release);
+}
+
+void
+task_pool::wait(std::atomic<long> *pending)
+{
+  worker *w = current() == this ? &workers_[tls_worker] : nullptr;
+  while (pending->load(std::memory_order_acquire) > 0) {
+    task *t = w ? find_task(w) : nullptr;
+    if (t)
+      execute(t);
+    else
+      __builtin_ia32_pause();
+  }
+}
+
+task_pool::task *
+task_pool::find_task(worker *w)
+{
+  task *t = w->q.pop();
+  if (t || nworkers_ == 1)
+    return t;
+  for (int i = 0; i < nworkers_; i++) {
+    // xorshift64
+    w->rand ^= w->rand << 13;
+    w->rand ^= w->rand >> 7;
+    w->rand ^= w->rand << 17;
+    int victim = w->rand % (nworkers_ - 1);
+    if (victim >= w->id)
+      victim++;
+    if ((t = workers_[victim].q.steal()))
+      return t;
+  }
+  return nullptr;
+}
+
+bool
+task_pool::has_work() const
+{
+  for (int i = 0; i < nworkers_; i++)
+    if (workers_[i].q.bottom.load() > workers_[i].q.top.load())
+      return true;
+  return false;
+}
+
+void
+task_pool::idle(worker *w)
+{
+  u64 e = epoch_.load();
+  sleepers_++;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!stop_ && !has_work())
+    futex((const u64*)&epoch_, FUTEX_WAIT, e, 0, nullptr, 0);
+  sleepers_--;
+}
+
+void *
+task_pool::worker_main(void *arg)
+{
+  worker *w = (worker*)arg;
+  task_pool *pool = w->pool;
+  tls_pool = pool;
+  tls_worker = w->id;
+  if (setaffinity(w->core) < 0)
+    die("task_pool: setaffinity %d failed", w->core);
+
+  int spins = 0;
+  while (!pool->stop_) {
+    task *t = pool->find_task(w);
+    if (t) {
+      pool->execute(t);
+      spins = 0;
+    } else if (++spins < idle_spins) {
+      __builtin_ia32_pause();
+    } else {
+      pool->idle(w);
+      spins = 0;
+    }
+  }
+  return nullptr;
+}
@@ -8,7 +8,7 @@
 time_t
 time(time_t *t)
 {
-  uint64_t nsec = time_nsec();
+  uint64_t nsec = realtime_nsec();
   time_t res = nsec / 1000000000;
   if (t)
     *t = res;
@@ -18,7 +18,7 @@ time(time_t *t)
 int
 gettimeofday(struct timeval *tv, struct timezone *tz)
 {
-  uint64_t nsec = time_nsec();
+  uint64_t nsec = realtime_nsec();
   tv->tv_sec = nsec / 1000000000;
   tv->tv_usec = (nsec % 1000000000) / 1000;
   return 0;
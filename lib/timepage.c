@@ -0,0 +1,45 @@
+#include "types.h"
+#include "user.h"
+#include "amd64.h"
+#include "timepage.h"
+
+// Return the time page's base (uptime or realtime) plus the time since
+// its tsc_base, or 0 if the kernel hasn't filled the page in yet.
+static uint64_t
+timepage_read(int realtime)
+{
+  volatile struct timepage *tp = (volatile struct timepage*) TIMEPAGE_VA;
+  uint32_t seq;
+  uint64_t mult, tsc_base, base, now;
+
+  do {
+    seq = tp->seq;
+    barrier();
+    if (!tp->cpuhz)
+      return 0;
+    mult = tp->mult;
+    tsc_base = tp->tsc_base;
+    base = realtime ? tp->realtime_base : tp->uptime_base;
+    barrier();
+  } while ((seq & 1) || tp->seq != seq);
+
+  now = rdtsc();
+  // Another core may have set tsc_base a little ahead of our TSC.
+  if (now < tsc_base)
+    return base;
+  return base + (uint64_t)(((unsigned __int128)(now - tsc_base) * mult) >> 32);
+}
+
+uint64_t
+uptime_nsec(void)
+{
+  uint64_t t = timepage_read(0);
+  return t ? t : uptime();
+}
+
+uint64_t
+realtime_nsec(void)
+{
+  uint64_t t = timepage_read(1);
+  return t ? t : time_nsec();
+}
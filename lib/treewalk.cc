@@ -0,0 +1,108 @@
+#include "types.h"
+#include "user.h"
+#include "fs.h"
+#include "libutil.h"
+#include "treewalk.hh"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+// Walks one subdirectory.  It is opened when the task runs, not when
+// it is spawned, so the walk only holds fds for the directories it is
+// in, not for every directory that is waiting to be walked.
+class tree_walk::dir_task : public task_pool::task
+{
+  tree_walk *walk_;
+  int parent_fd_;
+  std::string path_;
+  size_t name_;                 // Offset of the name in path_
+
+public:
+  dir_task(tree_walk *walk, int parent_fd, std::string path, size_t name)
+    : walk_(walk), parent_fd_(parent_fd), path_(std::move(path)),
+      name_(name) { }
+
+  void run() override
+  {
+    int fd = openat(parent_fd_, path_.c_str() + name_, O_RDONLY);
+    if (fd < 0)
+      walk_->error(path_);
+    else
+      walk_->walk_dir(path_, fd);
+  }
+};
+
+int
+tree_walk::walk(const char *root)
+{
+  int fd = open(root, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISDIR(st.st_mode)) {
+    close(fd);
+    return -1;
+  }
+  walk_dir(root, fd);
+  return 0;
+}
+
+void
+tree_walk::walk_dir(const std::string &path, int fd)
+{
+  if (!enter(path, fd)) {
+    close(fd);
+    return;
+  }
+
+  // Read everything before calling files(), which may well change the
+  // directory.
+  char *buf = nullptr;
+  size_t len = 0, cap = 0;
+  for (;;) {
+    if (cap - len < 4096) {
+      cap = cap ? cap * 2 : 4096;
+      buf = (char*)realloc(buf, cap);
+      if (!buf)
+        die("tree_walk: out of memory");
+    }
+    ssize_t n = getdents_stat(fd, buf + len, 4096);
+    if (n < 0) {
+      error(path);
+      break;
+    }
+    if (n == 0)
+      break;
+    len += n;
+  }
+
+  std::vector<struct xv6_direntstat*> ents;
+  std::atomic<long> pending(0);
+  for (size_t off = 0; off < len; ) {
+    struct xv6_direntstat *de = (struct xv6_direntstat*)(buf + off);
+    off += de->d_reclen;
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+    if (de->d_type != T_DIR) {
+      ents.push_back(de);
+      continue;
+    }
+    std::string sub(path);
+    sub.append("/");
+    size_t name = sub.size();
+    sub.append(de->d_name);
+    pool_->spawn(new dir_task(this, fd, std::move(sub), name), &pending);
+  }
+  if (!ents.empty())
+    files(path, fd, ents.data(), ents.size());
+
+  pool_->wait(&pending);
+  free(buf);
+  close(fd);
+  leave(path);
+}
@@ -30,29 +30,7 @@ gets(char *buf, int max)
 int
 stat(const char *n, struct stat *st)
 {
-  int fd;
-  int r;
-
-  fd = open(n, O_RDONLY | O_ANYFD | O_CLOEXEC);
-  if(fd < 0)
-    return -1;
-  r = fstat(fd, st);
-  close(fd);
-  return r;
-}
-
-int
-fstatat(int dirfd, const char *n, struct stat *st)
-{
-  int fd;
-  int r;
-
-  fd = openat(dirfd, n, O_RDONLY);
-  if(fd < 0)
-    return -1;
-  r = fstat(fd, st);
-  close(fd);
-  return r;
+  return fstatat(AT_FDCWD, n, st);
 }
 
 pid_t
@@ -246,7 +224,25 @@ mkdir(const char *path, mode_t mode)
 int
 rmdir(const char *path)
 {
-  return unlink(path);
+  return unlinkat(AT_FDCWD, path, AT_REMOVEDIR);
+}
+
+int
+unlink(const char *path)
+{
+  return unlinkat(AT_FDCWD, path, 0);
+}
+
+int
+link(const char *oldpath, const char *newpath)
+{
+  return linkat(AT_FDCWD, oldpath, AT_FDCWD, newpath);
+}
+
+int
+rename(const char *oldpath, const char *newpath)
+{
+  return renameat(AT_FDCWD, oldpath, AT_FDCWD, newpath);
 }
 
 int
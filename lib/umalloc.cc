@@ -8,6 +8,7 @@
 #include <linux/unistd.h>       // __NR_gettid
 #endif
 
+#include <atomic>
 #include <memory>
 #include <new>
 #include <utility>
@@ -17,18 +18,22 @@
 #include "log2.hh"
 
 // This allocator strongly weighs its own scalability over other forms
-// of efficiency.  In particular, when memory is freed via a given
-// thread, only that thread can then reuse that memory.  Also, after a
-// page is carved up in to sub-page regions, it can never be used for
-// any other size class (allocations that involve a page or more of
-// memory can be re-partitioned, however).  It also never returns
-// memory to the system.
+// of efficiency.  Each thread allocates from its own free lists and
+// nothing on the fast paths is shared.  Memory freed by a thread other
+// than the one that allocated it is queued back to the allocating
+// thread, which takes the whole queue at once the next time it runs
+// out, so producer/consumer programs don't pile up memory in the
+// consumer while the producer keeps mapping more.  Sub-page regions go
+// back to the large allocator once a page of them is entirely free, and
+// large free runs give their pages back to the system.
 
 // == Overall architecture ==
 //
-// Throughout this allocator, it uses "size classes", which are simply
-// the ceil(log2(bytes)) of an allocation.  That is, each allocation
-// gets rounded up to the nearest power of two.
+// Throughout this allocator, it uses "size classes".  For the large
+// allocator, these are simply the ceil(log2(bytes)) of an allocation.
+// That is, each allocation gets rounded up to the nearest power of
+// two.  The small allocator uses four size classes between each power
+// of two (see small_class()).
 //
 // The allocator has three levels:
 //
@@ -51,14 +56,16 @@
 //
 // To free pages, the large allocator maintains a radix array of
 // metadata, indexed by page.  For each allocated region, this marks
-// it as allocated.  For each free region, this marks which thread has
+// it as allocated, and by which thread.  For each free region, this
+// marks which thread has
 // the region on its free list.  In both cases, it marks the head and
 // the rest of the region differently so regions can be identified.
 // When an object is freed to the large allocator, its size is
 // computed using the radix array and it is merged with adjacent free
 // pages that belong to the same thread (also using the radix array).
 // This could result in an arbitrary size region, so it is split in to
-// the largest size classes possible.
+// the largest size classes possible.  If the region is at least
+// trim_bytes, the freed pages are also dropped with MADV_DONTNEED.
 //
 // Finally, a *small allocator* handles allocations for size classes
 // half-a-page and smaller (where multiple objects will fit on one
@@ -70,7 +77,15 @@
 // beginning of the page.  As a result, there is no per-object space
 // overhead; only per-page overhead.  Freeing an object simply checks
 // the page header to find the object's size class and adds it to the
-// appropriate free list.
+// appropriate free list.  The page header also counts the page's
+// allocated objects; when that drops to zero the page's fragments are
+// taken off the free list and the page is freed to the large allocator
+// (except for one empty page per size class, kept to absorb churn).
+//
+// A thread that frees an object allocated by another thread pushes it
+// on that thread's remote free stack (see thread_heap) rather than on
+// its own free lists.  The owner drains the stack in one go when one
+// of its free lists comes up empty.
 //
 // malloc determines whether to use the large allocator or the small
 // allocator based on the requested object size.  free determines
@@ -95,6 +110,21 @@ namespace {
   // Must be >= 4096 and a valid size class
   size_t min_map_bytes = 256 * 1024;
 
+  // Large frees that leave a free run at least this big hand the
+  // freed pages back to the system.
+  size_t trim_bytes = 1024 * 1024;
+
+  // If non-zero, the large allocator carves the memory it gets from the
+  // system out of per-thread arenas of this many bytes (a multiple of
+  // HUGE_PGSIZE), rather than mapping min_map_bytes at a time.  Arenas
+  // are aligned to huge pages and prefaulted by the thread that will use
+  // them, so they are backed by huge pages from that thread's NUMA node
+  // and the map and reduce phases don't fault them in 4K at a time.
+  // Since freed memory stays with the thread that freed it, later phases
+  // reuse the arenas of earlier ones.
+  enum { HUGE_PGSIZE = 2 * 1024 * 1024 };
+  size_t arena_bytes = 0;
+
   pid_t gettid()
   {
 #if defined(XV6_USER)
@@ -157,8 +187,6 @@ namespace {
       b->pprev = &head;
       b->next = head;
 #ifdef UMALLOC_DEBUG
-      if (size_class >= 12)
-        assert((uintptr_t)ptr % PGSIZE == 0);
       b->size_class = size_class;
       if (head)
         assert(size_class == head->size_class);
@@ -207,10 +235,9 @@ namespace {
   // Size classes
   //
 
-  // XXX This has an internal fragmentation of 100%.  We could easily
-  // get it down to 50% by using the top *two* most significant bits,
-  // for example.  OTOH, the large allocator only rounds up to PGSIZE,
-  // so this would only really matter for small allocations.
+  // These have an internal fragmentation of 100%, but the large
+  // allocator only rounds up to PGSIZE, so this only matters for the
+  // small allocator, which uses finer classes (see small_class()).
 
   // At this many bytes, the size class will be one page large
   enum { LARGE_THRESHOLD = 2049 };
@@ -321,6 +348,67 @@ namespace {
     }
   };
 
+  //
+  // Thread heaps
+  //
+
+  // The part of a thread's allocator state that other threads need.
+  // Heaps are never freed, so a pointer to one stays good after its
+  // thread exits.  Each gets its own cache line, since other threads
+  // write remote_frees.
+  struct alignas(64) thread_heap
+  {
+    // Objects other threads have freed to this thread.  A stack linked
+    // through each object's first word.
+    std::atomic<void*> remote_frees;
+    pid_t tid;
+    // Index in heaps, or 0 if heaps was full.
+    int id;
+  };
+
+  // Heap 0 is unused; an allocation marked with heap id 0 can be freed
+  // by any thread, as if it were its own.
+  enum { MAX_HEAPS = 4096 };
+  thread_heap heaps[MAX_HEAPS];
+  std::atomic<int> next_heap_id(1);
+
+  __thread thread_heap *cur_heap;
+
+  thread_heap *my_heap()
+  {
+    if (!cur_heap) {
+      int id = next_heap_id++;
+      thread_heap *h;
+      if (id < MAX_HEAPS) {
+        h = &heaps[id];
+      } else {
+        void *p = mmap(0, sizeof(thread_heap), PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+          throw std::bad_alloc();
+        h = new (p) thread_heap();
+        id = 0;
+      }
+      h->tid = gettid();
+      h->id = id;
+      cur_heap = h;
+    }
+    return cur_heap;
+  }
+
+  // Free ptr, which h allocated, back to h.
+  void remote_free(thread_heap *h, void *ptr)
+  {
+    void *head = h->remote_frees.load(std::memory_order_relaxed);
+    do {
+      *(void**)ptr = head;
+    } while (!h->remote_frees.compare_exchange_weak(
+               head, ptr, std::memory_order_release,
+               std::memory_order_relaxed));
+  }
+
+  bool drain_remote_frees();
+
   //
   // Large allocator (size classes one page large and up)
   //
@@ -330,10 +418,17 @@ namespace {
   enum
   {
     UNMAPPED = 0,
-    ALLOCATED_HEAD = 1,
-    ALLOCATED_REST = -1
+    ALLOCATED_REST = -1,
+    // The first page of an allocation is ALLOCATED_HEAD minus the id
+    // of the heap that allocated it.  Thread IDs must stay above this.
+    ALLOCATED_HEAD = -0x40000000
   };
 
+  bool is_allocated_head(pid_t owner)
+  {
+    return owner <= ALLOCATED_HEAD && owner > ALLOCATED_HEAD - MAX_HEAPS;
+  }
+
   struct page_info
   {
     // * For unmapped pages, UNMAPPED.
@@ -342,7 +437,8 @@ namespace {
     // * For the non-first page of a free run, the negative thread ID
     //   that owns the run.
     // * For allocated pages, the first page of the allocation is
-    //   ALLOCATED_HEAD and the rest are ALLOCATED_REST.
+    //   ALLOCATED_HEAD minus the allocating heap's id and the rest are
+    //   ALLOCATED_REST.
     pid_t owner;
 
     // XXX The information about free pages could be written on the
@@ -396,7 +492,7 @@ namespace {
     assert(bytes >= PGSIZE);
     assert(bytes % PGSIZE == 0);
 
-    pid_t tid = gettid();
+    pid_t tid = my_heap()->tid;
     void *end = (char*)run + bytes;
     auto it = pages.find(idx(run));
     // Divide the run up in to size-class-sized pieces
@@ -439,23 +535,80 @@ namespace {
 
     // Mark pages allocated
     auto start = pages.find(idx(run));
-    pages.fill(start, page_info(ALLOCATED_HEAD));
+    pages.fill(start, page_info(ALLOCATED_HEAD - my_heap()->id));
     if (used_pages > 1)
       pages.fill(start + 1, start + used_pages, page_info(ALLOCATED_REST));
 
     return run;
   }
 
+  //
+  // Arenas
+  //
+
+  __thread char *arena_pos, *arena_end;
+
+  // Map bytes bytes (a multiple of HUGE_PGSIZE) on a huge page boundary
+  // and fault them in.
+  void *map_arena(size_t bytes)
+  {
+    size_t len = bytes + HUGE_PGSIZE;
+    char *p = (char*)mmap(0, len, PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return nullptr;
+    char *start = (char*)(((uintptr_t)p + HUGE_PGSIZE - 1) &
+                          ~(uintptr_t)(HUGE_PGSIZE - 1));
+    if (start != p)
+      munmap(p, start - p);
+    if (start + bytes != p + len)
+      munmap(start + bytes, p + len - (start + bytes));
+#ifdef MADV_HUGEPAGE
+    madvise(start, bytes, MADV_HUGEPAGE);
+#endif
+    madvise(start, bytes, MADV_WILLNEED);
+    pdebug("map_arena %p-%p\n", start, start + bytes);
+    return start;
+  }
+
+  // Get bytes bytes of fresh memory for the large allocator.
+  void *map_pages(size_t bytes)
+  {
+    if (!arena_bytes) {
+      void *p = mmap(0, bytes, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      return p == MAP_FAILED ? nullptr : p;
+    }
+    if (bytes >= arena_bytes)
+      return map_arena((bytes + HUGE_PGSIZE - 1) & ~(size_t)(HUGE_PGSIZE - 1));
+    if (!arena_pos || (size_t)(arena_end - arena_pos) < bytes) {
+      // Whatever is left of the current arena is smaller than the
+      // request and goes unused.
+      arena_pos = (char*)map_arena(arena_bytes);
+      if (!arena_pos)
+        return nullptr;
+      arena_end = arena_pos + arena_bytes;
+    }
+    void *p = arena_pos;
+    arena_pos += bytes;
+    return p;
+  }
+
   // Allocate bytes bytes from the large allocator.
   void *alloc_large(size_t bytes)
   {
     assert(bytes >= LARGE_THRESHOLD);
     size_t sc = size_to_class(bytes);
 
-    // Find a free run of at least this size class
-    for (size_t i = sc; i < MAX_LARGE_CLASS; ++i)
-      if (free_runs[i])
-        return alloc_from_run(free_runs[i].pop(i), i, bytes);
+    // Find a free run of at least this size class, taking back what
+    // other threads have freed if there isn't one.
+    for (int pass = 0; pass < 2; ++pass) {
+      for (size_t i = sc; i < MAX_LARGE_CLASS; ++i)
+        if (free_runs[i])
+          return alloc_from_run(free_runs[i].pop(i), i, bytes);
+      if (!drain_remote_frees())
+        break;
+    }
 
     // Can't satisfy request.  Get more pages from the system.
     size_t map_bytes = class_max_size(sc);
@@ -465,9 +618,8 @@ namespace {
       map_sc = size_to_class(map_bytes);
       assert(class_max_size(map_sc) == map_bytes);
     }
-    void *run = mmap(0, map_bytes, PROT_READ|PROT_WRITE,
-                     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-    if (run == MAP_FAILED)
+    void *run = map_pages(map_bytes);
+    if (!run)
       return nullptr;
     pdebug("alloc_large mapped %p for class %zu\n", run, map_sc);
 
@@ -475,21 +627,28 @@ namespace {
     return alloc_from_run(run, map_sc, bytes);
   }
 
-  // Free the memory at ptr to the large allocator.
+  // Free the memory at ptr to the large allocator.  If another thread
+  // allocated it, it goes back to that thread.
   void free_large(void *ptr)
   {
-    pid_t tid = gettid();
+    pid_t tid = my_heap()->tid;
 
     // Find length of run at start
     auto start = pages.find(idx(ptr));
     if (!start.is_set())
       throw std::runtime_error("Free of non-mapped memory");
-    if (start->owner != ALLOCATED_HEAD) {
+    if (!is_allocated_head(start->owner)) {
       if (start->owner == ALLOCATED_REST)
         throw std::runtime_error("Free in the middle of a block");
       else
         throw std::runtime_error("Double free");
     }
+    int owner_id = ALLOCATED_HEAD - start->owner;
+    thread_heap *owner = &heaps[owner_id];
+    if (owner_id && owner != my_heap()) {
+      remote_free(owner, ptr);
+      return;
+    }
     auto end = start;
     for (++end; end.is_set() && end->owner == ALLOCATED_REST; ++end)
       ;
@@ -527,6 +686,10 @@ namespace {
     // should be a way to avoid this.
     pdebug("free_large %p of %lu pages (expanded %p %lu pages)\n",
            ptr, end - start, idx_to_ptr(pre.index()), post - pre);
+    // Only the pages of this allocation are dropped.  The rest of the
+    // run was dropped when it was freed, if it was in a run this big.
+    if ((post - pre) * PGSIZE >= trim_bytes)
+      madvise(ptr, (end - start) * PGSIZE, MADV_DONTNEED);
     add_free_run(idx_to_ptr(pre.index()), (post - pre) * PGSIZE);
   }
 
@@ -545,23 +708,62 @@ namespace {
   // Small allocator (size classes less than a page)
   //
 
-  // XXX This never frees pages back to the large allocator, so once a
-  // page has been reserved for a size class, it will stay that size
-  // class forever.
+  // Small size classes are 16, 32, 48 and 64 bytes, then four classes
+  // between each power of two up to LARGE_THRESHOLD-1 (80, 96, 112,
+  // 128, 160, ...).  They are all multiples of 16, so fragments are
+  // always 16-byte aligned.
+  enum { NSMALL_CLASSES = 24 };
+
+  // Compute the small size class of a byte size of at least 1.
+  size_t small_class(size_t bytes)
+  {
+    if (bytes <= 64)
+      return (bytes + 15) / 16 - 1;
+    size_t l = floor_log2(bytes - 1);
+    return 4 + (l - 6) * 4 + ((bytes - 1 - (1ull << l)) >> (l - 2));
+  }
 
-  // Fragment free lists by size class (ceil(log2(bytes))).  Fragments
-  // must be at least sizeof(block_list::block), so the smaller
-  // classes are unused.
-  __thread block_list free_fragments[13] = {};
+  // Return the size of objects in small size class sc.
+  size_t small_class_size(size_t sc)
+  {
+    if (sc < 4)
+      return 16 * (sc + 1);
+    size_t l = 6 + (sc - 4) / 4;
+    return (1ull << l) + ((sc - 4) % 4 + 1) * (1ull << (l - 2));
+  }
 
   // Header for pages owned by the small allocator.  Following this
   // header, a page is divided into equal-size fragments.
   struct page_hdr
   {
     uintptr_t magic;
-    size_t size_class;
+    // The heap whose free lists this page's fragments go on.
+    thread_heap *heap;
+    uint32_t size_class;
+    // Fragments not on heap's free lists.  Only heap's thread touches
+    // this; a fragment freed remotely counts until it's drained.
+    uint32_t nused;
   };
   enum { PAGE_HDR_MAGIC = 0x2065c977e3516564 };
+  enum { PAGE_HDR_BYTES = 32 };
+
+  // Fragment free lists by small size class.  Fragments must be at
+  // least sizeof(block_list::block).
+  __thread block_list free_fragments[NSMALL_CLASSES] = {};
+
+  // For each size class, a page whose fragments are all free that we
+  // hang on to rather than freeing, so a class hovering around a page
+  // boundary doesn't keep going to the large allocator.
+  __thread page_hdr *empty_pages[NSMALL_CLASSES];
+
+  page_hdr *page_of(void *ptr)
+  {
+    // Round ptr to the page start to get the page metadata
+    page_hdr *hdr = (page_hdr*)(((uintptr_t)ptr) & ~(PGSIZE-1));
+    if (hdr->magic != PAGE_HDR_MAGIC)
+      throw std::runtime_error("Bad free or corrupted page magic");
+    return hdr;
+  }
 
   // Allocate bytes bytes from the small allocator
   void *alloc_small(size_t bytes)
@@ -572,9 +774,10 @@ namespace {
     if (bytes < sizeof(block_list::block))
       bytes = sizeof(block_list::block);
 
-    // Check for a free fragment
-    size_t sc = size_to_class(bytes);
-    if (!free_fragments[sc]) {
+    // Check for a free fragment, then for fragments other threads have
+    // freed back to us.
+    size_t sc = small_class(bytes);
+    if (!free_fragments[sc] && !(drain_remote_frees() && free_fragments[sc])) {
       // There are no free fragments of this size.  Get a page from
       // the large allocator and chop it up.
       void *page = alloc_large(PGSIZE);
@@ -582,14 +785,13 @@ namespace {
         return nullptr;
       page_hdr *hdr = static_cast<page_hdr*>(page);
       hdr->magic = PAGE_HDR_MAGIC;
+      hdr->heap = my_heap();
       hdr->size_class = sc;
+      hdr->nused = 0;
 
-      size_t sbytes = class_max_size(sc);
-      // Make sure fragments are always 16-byte aligned.  (This could
-      // be less aligned for smaller size classes, but there are no
-      // smaller size classes.)
-      char *fragment = (char*)page + 16;
-      assert(sizeof(page_hdr) <= 16);
+      size_t sbytes = small_class_size(sc);
+      static_assert(sizeof(page_hdr) <= PAGE_HDR_BYTES, "page_hdr too big");
+      char *fragment = (char*)page + PAGE_HDR_BYTES;
       char *last = (char*)page + PGSIZE - sbytes;
       int i = 0;
       for (; fragment <= last; fragment += sbytes, ++i)
@@ -598,28 +800,73 @@ namespace {
     }
 
     void *ptr = free_fragments[sc].pop(sc);
+    page_hdr *hdr = page_of(ptr);
+    if (hdr->nused++ == 0 && empty_pages[sc] == hdr)
+      empty_pages[sc] = nullptr;
     pdebug("alloc_small %zu bytes from class %zu => %p\n", bytes, sc, ptr);
     return ptr;
   }
 
-  // Free the memory at ptr to the small allocator.
+  // Free ptr, which this thread's heap owns, to the small allocator.
+  void free_small_local(void *ptr, page_hdr *hdr)
+  {
+    size_t sc = hdr->size_class;
+    pdebug("free_small %p to class %zu\n", ptr, sc);
+    free_fragments[sc].push(ptr, sc);
+    if (--hdr->nused)
+      return;
+    if (!empty_pages[sc]) {
+      empty_pages[sc] = hdr;
+      return;
+    }
+
+    // The whole page is free and we already have a spare.  Take its
+    // fragments off the free list and give it to the large allocator.
+    size_t sbytes = small_class_size(sc);
+    char *last = (char*)hdr + PGSIZE - sbytes;
+    for (char *f = (char*)hdr + PAGE_HDR_BYTES; f <= last; f += sbytes)
+      block_list::remove(f);
+    hdr->magic = 0;
+    pdebug("free_small releasing page %p of class %zu\n", hdr, sc);
+    free_large(hdr);
+  }
+
+  // Free the memory at ptr to the small allocator.  If another thread
+  // owns its page, it goes back to that thread.
   void free_small(void *ptr)
   {
-    // Round ptr to the page start to get the page metadata
-    page_hdr *hdr = (page_hdr*)(((uintptr_t)ptr) & ~(PGSIZE-1));
-    if (hdr->magic != PAGE_HDR_MAGIC)
-      throw std::runtime_error("Bad free or corrupted page magic");
-    pdebug("free_small %p to class %zu\n", ptr, hdr->size_class);
-    free_fragments[hdr->size_class].push(ptr, hdr->size_class);
+    page_hdr *hdr = page_of(ptr);
+    if (hdr->heap != my_heap())
+      remote_free(hdr->heap, ptr);
+    else
+      free_small_local(ptr, hdr);
   }
 
   // Get the allocated size of the small allocation at ptr.
   size_t get_size_small(void *ptr)
   {
-    page_hdr *hdr = (page_hdr*)(((uintptr_t)ptr) & ~(PGSIZE-1));
-    if (hdr->magic != PAGE_HDR_MAGIC)
-      throw std::runtime_error("Bad free or corrupted page magic");
-    return class_max_size(hdr->size_class);
+    return small_class_size(page_of(ptr)->size_class);
+  }
+
+  // Take back everything other threads have freed to this thread.
+  // Returns false if there was nothing.
+  bool drain_remote_frees()
+  {
+    thread_heap *h = my_heap();
+    if (!h->remote_frees.load(std::memory_order_relaxed))
+      return false;
+    void *ptr = h->remote_frees.exchange(nullptr, std::memory_order_acquire);
+    while (ptr) {
+      void *next = *(void**)ptr;
+      // Remote frees of both sizes come back to their owner, so these
+      // free locally.
+      if ((uintptr_t)ptr % PGSIZE == 0)
+        free_large(ptr);
+      else
+        free_small_local(ptr, page_of(ptr));
+      ptr = next;
+    }
+    return true;
   }
 }
 
@@ -692,6 +939,14 @@ malloc_set_alloc_unit(size_t bytes)
   min_map_bytes = class_max_size(size_to_class(bytes));
 }
 
+// Carve large allocations out of per-thread, huge-page-backed arenas of
+// at least bytes bytes (see arena_bytes).  0 turns arenas off.
+extern "C" void
+malloc_set_arena(size_t bytes)
+{
+  arena_bytes = (bytes + HUGE_PGSIZE - 1) & ~(size_t)(HUGE_PGSIZE - 1);
+}
+
 extern "C" void
 malloc_show_state()
 {
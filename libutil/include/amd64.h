@@ -144,6 +144,21 @@ nop_pause(void)
   __asm volatile("pause" : :);
 }
 
+// Arm address monitoring for a following mwait on the line holding addr.
+static inline void
+monitor(const volatile void *addr)
+{
+  __asm volatile("monitor" : : "a" (addr), "c" (0), "d" (0));
+}
+
+// Sleep in the C-state given by hint until a write to the monitored
+// line or an interrupt.
+static inline void
+mwait(uint32_t hint)
+{
+  __asm volatile("mwait" : : "a" (hint), "c" (0) : "memory");
+}
+
 static inline void
 rep_nop(void)
 {
@@ -340,6 +355,16 @@ invlpg(void *a)
   __asm volatile("invlpg (%0)" : : "r" (a) : "memory");
 }
 
+// INVPCID types
+#define INVPCID_ADDR    0               // One address in one PCID
+
+static inline void
+invpcid(uint64_t type, uint64_t pcid, void *a)
+{
+  struct { uint64_t pcid; uint64_t addr; } desc = { pcid, (uint64_t) a };
+  __asm volatile("invpcid %0, %1" : : "m" (desc), "r" (type) : "memory");
+}
+
 static inline int
 popcnt64(uint64_t v)
 {
@@ -380,6 +405,18 @@ locked_test_and_set_bit(int nr, volatile void *a)
   return old;
 }
 
+// Atomically clear bit nr of *a and return its old value
+static inline int
+locked_test_and_reset_bit(int nr, volatile void *a)
+{
+  int old;
+  __asm volatile("lock; btr %2,%1; sbb %0,%0"
+                 : "=r" (old), "+m" (*(volatile uint64_t*)a)
+                 : "Ir" (nr)
+                 : "memory");
+  return old;
+}
+
 // Atomically clear bit nr of *a, with release semantics appropriate
 // for clearing a lock bit.
 static inline void
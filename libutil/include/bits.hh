@@ -41,6 +41,12 @@
 
 #define CR4_PGE         0x00000080      // Page global enable
 #define CR4_PCE         0x100           // RDPMC at CPL > 0
+#define CR4_PCIDE       0x00020000      // Process-context identifiers
+
+// With CR4_PCIDE, the low bits of CR3 hold the PCID, and setting
+// CR3_NOFLUSH when loading CR3 keeps that PCID's TLB entries.
+#define CR3_PCID_MASK   0xfffull
+#define CR3_NOFLUSH     (1ull << 63)
 
 // FS/GS base registers
 #define MSR_FS_BASE     0xc0000100
@@ -53,6 +59,9 @@
 #define MSR_CSTAR       0xc0000083
 #define MSR_SFMASK      0xc0000084
 
+// LAPIC timer deadline, in TSC-deadline mode
+#define MSR_TSC_DEADLINE 0x6e0
+
 #define MSR_INTEL_MISC_ENABLE 0x1a0
 #define MISC_ENABLE_PEBS_UNAVAILABLE (1<<12) // Read-only
 
@@ -167,12 +167,18 @@ public:
     // 1.ECX
     bool mwait : 1;
     bool pdcm : 1;              // Perfmon and debug
+    bool pcid : 1;              // Process-context identifiers
+    bool sse4_2 : 1;            // Includes the crc32 instruction
     bool x2apic : 1;
+    bool tsc_deadline : 1;      // LAPIC timer TSC-deadline mode
 
     // 1.EDX
     bool apic : 1;              // "APIC on chip"
     bool ds : 1;                // Debug store
 
+    // 7.EBX (ECX=0)
+    bool invpcid : 1;
+
     // 80000001.EDX
     bool page1GB : 1;
     bool rdtscp : 1;            // Is rdtscp supported
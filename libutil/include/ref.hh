@@ -196,6 +196,10 @@ public:
     return ref_.invalid ? 0 : (ref_.count + 1);
   }
 
+  uint64_t get_approx() const {
+    return get_consistent();
+  }
+
 protected:
   virtual ~referenced() { }
   virtual void onzero() { delete this; }
@@ -17,8 +17,10 @@
   pthread_create((ptr), 0, (fn), (arg))
 
 #define O_ANYFD 0
+#define O_LOWFD 0
 
 #define STAT_OMIT_NLINK 0
+#define STAT_APPROX_NLINK 0
 #define fstatx(a, b, c) fstat((a), (b))
 
 #define SOCK_DGRAM_UNORDERED SOCK_DGRAM
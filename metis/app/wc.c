@@ -120,13 +120,15 @@ wordcount_map(split_t * args)
     assert(data);
     char tmp_key[max_key_len];
     int ilen = 0;
+    mr_emit_batch_t batch;
+    batch.n = batch.used = 0;
     for (uint32_t i = 0; i < args->length; i++) {
 	curr_ltr = toupper(data[i]);
 	switch (state) {
 	case IN_WORD:
 	    if ((curr_ltr < 'A' || curr_ltr > 'Z') && curr_ltr != '\'') {
 		tmp_key[ilen] = 0;
-		mr_map_emit(tmp_key, (void *) 1, ilen);
+		mr_map_emit_add(&batch, tmp_key, (void *) 1, ilen);
 		state = NOT_IN_WORD;
 	    } else {
 		tmp_key[ilen++] = curr_ltr;
@@ -146,8 +148,9 @@ wordcount_map(split_t * args)
     /* add the last word */
     if (state == IN_WORD) {
 	tmp_key[ilen] = 0;
-	mr_map_emit(tmp_key, (void *) 1, ilen);
+	mr_map_emit_add(&batch, tmp_key, (void *) 1, ilen);
     }
+    mr_map_emit_flush(&batch);
 }
 
 /* Add up the partial sums for each word */
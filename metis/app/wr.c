@@ -134,6 +134,8 @@ map(split_t * split)
     char tmp_key[max_key_len];
     int ilen = 0;
     char *index = NULL;
+    mr_emit_batch_t batch;
+    batch.n = batch.used = 0;
     for (i = 0; i < split->length; i++) {
 	curr_ltr = toupper(data[i]);
 	switch (state) {
@@ -141,7 +143,7 @@ map(split_t * split)
 	    if ((curr_ltr < 'A' || curr_ltr > 'Z') && curr_ltr != '\'') {
 		tmp_key[ilen] = 0;
 		prof_leaveapp();
-		mr_map_emit(tmp_key, index, ilen);
+		mr_map_emit_add(&batch, tmp_key, index, ilen);
 		prof_enterapp();
 		state = NOT_IN_WORD;
 	    } else {
@@ -164,10 +166,11 @@ map(split_t * split)
     if (state == IN_WORD) {
 	tmp_key[ilen] = 0;
 	prof_leaveapp();
-	mr_map_emit(tmp_key, index, ilen);
+	mr_map_emit_add(&batch, tmp_key, index, ilen);
 	prof_enterapp();
     }
     prof_leaveapp();
+    mr_map_emit_flush(&batch);
 }
 
 static void
@@ -96,13 +96,15 @@ map(split_t * args)
     char tmp_key[max_key_len];
     int ilen = 0;
     char *index = NULL;
+    mr_emit_batch_t batch;
+    batch.n = batch.used = 0;
     for (uint32_t i = 0; i < args->length; i++) {
 	char curr_ltr = toupper(data[i]);
 	switch (state) {
 	case IN_WORD:
 	    if ((curr_ltr < 'A' || curr_ltr > 'Z') && curr_ltr != '\'') {
 		tmp_key[ilen] = 0;
-		mr_map_emit(tmp_key, index, ilen);
+		mr_map_emit_add(&batch, tmp_key, index, ilen);
 		state = NOT_IN_WORD;
 	    } else {
 		tmp_key[ilen++] = curr_ltr;
@@ -123,8 +125,9 @@ map(split_t * args)
     /* add the last word */
     if (state == IN_WORD) {
 	tmp_key[ilen] = 0;
-	mr_map_emit(tmp_key, index, ilen);
+	mr_map_emit_add(&batch, tmp_key, index, ilen);
     }
+    mr_map_emit_flush(&batch);
 }
 
 static void
@@ -197,6 +200,8 @@ wr_usage(char *prog)
     printf("  -l ntops : # of top key/value pairs to display\n");
     printf("  -s inputsize : size of input in MB\n");
     printf("  -q : quiet output (for batch test)\n");
+    printf("  -a bytes : unit in which malloc maps memory\n");
+    printf("  -A bytes : per-thread huge page arenas for malloc\n");
     exit(EXIT_FAILURE);
 }
 
@@ -219,7 +224,7 @@ main(int argc, char *argv[])
     uint64_t inputsize = 0x80000000;
     char buf[128];
     int c;
-    while ((c = getopt(argc, argv, "p:l:m:r:qs:a:")) != -1) {
+    while ((c = getopt(argc, argv, "p:l:m:r:qs:a:A:")) != -1) {
 	switch (c) {
 	case 'p':
 	    nprocs = atoi(optarg);
@@ -250,6 +255,14 @@ main(int argc, char *argv[])
 	    printf("# --malloc=%s\n",
 		   pretty_size(atoi(optarg), buf, sizeof buf));
 	    break;
+	case 'A':
+	    {
+		void malloc_set_arena(size_t bytes);
+		malloc_set_arena(atol(optarg));
+	    }
+	    printf("# --arena=%s\n",
+		   pretty_size(atol(optarg), buf, sizeof buf));
+	    break;
 	default:
 	    wr_usage(argv[0]);
 	    exit(EXIT_FAILURE);
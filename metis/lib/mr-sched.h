@@ -26,6 +26,25 @@ extern void mr_finalize(void);
  * calls the keycopy function for each new key, and user can free the key
  * when this function returns. */
 extern void mr_map_emit(void *key, void *val, int key_size);
+/* Batched mr_map_emit, for map functions that emit many small keys: keys
+ * are copied into the batch and hashed and put a batch at a time, which
+ * keeps the hash function's loop and the bucket lookups hot.  Only for
+ * jobs with a keycopy function, since the batch's copy of a key goes away
+ * once it is flushed.  Call mr_map_emit_flush before the map function
+ * returns. */
+enum { MR_EMIT_BATCH = 32, MR_EMIT_BATCH_BYTES = 4096 };
+typedef struct {
+    int n;
+    unsigned used;
+    void *val[MR_EMIT_BATCH];
+    unsigned off[MR_EMIT_BATCH];
+    int keylen[MR_EMIT_BATCH];
+    char keys[MR_EMIT_BATCH_BYTES];
+} mr_emit_batch_t;
+
+extern void mr_map_emit_add(mr_emit_batch_t * b, void *key, void *val,
+			    int key_size);
+extern void mr_map_emit_flush(mr_emit_batch_t * b);
 /* called in user defined reduce function. The key is owned by Metis. The
  * user should not emit a key other than the argument to the user defined
  * reduce function; otherwise, the output is not guaranteed to ordered. */
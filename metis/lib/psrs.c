@@ -87,31 +87,69 @@ sublists(void *base, int start, int end, int *subsize, const void *pivots,
     }
 }
 
+/* Heads of the runs being merged are kept in a binary min-heap of run
+ * indices, so each output pair costs O(log p) comparisons instead of a
+ * scan over all p runs.  Ties go to the lower run, which keeps the merge
+ * stable.
+ */
+static inline int
+run_less(void **lpairs, const uint32_t *pos, int a, int b, size_t psz,
+	 pair_cmp_t pcmp)
+{
+    int c = pcmp(ARRELEM(lpairs[a], psz, pos[a]),
+		 ARRELEM(lpairs[b], psz, pos[b]));
+    return c < 0 || (c == 0 && a < b);
+}
+
+static void
+heap_down(int *heap, int n, int i, void **lpairs, const uint32_t *pos,
+	  size_t psz, pair_cmp_t pcmp)
+{
+    for (;;) {
+	int min = i;
+	int l = 2 * i + 1;
+	int r = l + 1;
+	if (l < n && run_less(lpairs, pos, heap[l], heap[min], psz, pcmp))
+	    min = l;
+	if (r < n && run_less(lpairs, pos, heap[r], heap[min], psz, pcmp))
+	    min = r;
+	if (min == i)
+	    return;
+	int t = heap[i];
+	heap[i] = heap[min];
+	heap[min] = t;
+	i = min;
+    }
+}
+
+/* Merge the lcpu-th sublist of every cpu's sorted pairs into out. */
 static void
 mergesort(void **lpairs, int npairs, int *subsize, int lcpu, void *out,
 	  int ncpus, size_t psz, pair_cmp_t pcmp)
 {
     uint32_t task_pos[JOS_NCPU];
-    for (int i = 0; i < ncpus; i++)
+    uint32_t task_end[JOS_NCPU];
+    int heap[JOS_NCPU];
+    int n = 0;
+    for (int i = 0; i < ncpus; i++) {
 	task_pos[i] = subsize[i * (ncpus + 1) + lcpu];
+	task_end[i] = subsize[i * (ncpus + 1) + lcpu + 1];
+	if (task_pos[i] < task_end[i])
+	    heap[n++] = i;
+    }
+    for (int i = n / 2 - 1; i >= 0; i--)
+	heap_down(heap, n, i, lpairs, task_pos, psz, pcmp);
     size_t nsorted = 0;
-    while (nsorted < npairs) {
-	int min_idx = 0;
-	void *min_pair = NULL;
-	for (int i = 0; i < ncpus; i++) {
-	    void *parray = lpairs[i];
-	    if (task_pos[i] >= subsize[i * (ncpus + 1) + lcpu + 1])
-		continue;
-	    if (min_pair == NULL
-		|| pcmp(min_pair, ARRELEM(parray, psz, task_pos[i])) > 0) {
-		min_pair = ARRELEM(parray, psz, task_pos[i]);
-		min_idx = i;
-	    }
-	}
-	memcpy(ARRELEM(out, psz, nsorted), min_pair, psz);
-	task_pos[min_idx]++;
+    while (n) {
+	int min_idx = heap[0];
+	memcpy(ARRELEM(out, psz, nsorted),
+	       ARRELEM(lpairs[min_idx], psz, task_pos[min_idx]), psz);
 	nsorted++;
+	if (++task_pos[min_idx] == task_end[min_idx])
+	    heap[0] = heap[--n];
+	heap_down(heap, n, 0, lpairs, task_pos, psz, pcmp);
     }
+    assert(nsorted == npairs);
 }
 
 /* input: lpairs
@@ -200,6 +238,17 @@ free_arr_colls(void *acolls, int ncolls, const pc_handler_t * pch)
     }
 }
 
+/* Inputs too small to give each cpu a pair per sublist are sorted by the
+ * main cpu alone.  PSRS only bounds the partition sizes for n >= p^3,
+ * but between p^2 and p^3 pairs the partitions are merely less even,
+ * which still beats sorting and merging everything on one cpu.
+ */
+static int
+psrs_serial(int n, int ncpus)
+{
+    return ncpus == 1 || n < ncpus * ncpus;
+}
+
 /* sort the elements of an array of collections.
  * If doreduce, reduce on each partition and put the elements into rbuckets;
  * otherwise, put the output into the first array of acolls;
@@ -227,7 +276,7 @@ psrs(void *acolls, int ncolls, int ncpus, int lcpu,
     int end = w * (lcpu + 1) - 1;
     if (end >= total_len)
 	end = total_len - 1;
-    if (total_len < ncpus * ncpus * ncpus) {
+    if (psrs_serial(total_len, ncpus)) {
 	if (lcpu != main_lcpu)
 	    return;
 	start = 0;
@@ -238,7 +287,7 @@ psrs(void *acolls, int ncolls, int ncpus, int lcpu,
     lpairs[lcpu] = localpairs;
     // sort the array locally
     qsort(localpairs, copied, psz, pcmp);
-    if (ncpus == 1 || total_len < ncpus * ncpus * ncpus) {
+    if (psrs_serial(total_len, ncpus)) {
 	assert(lcpu == main_lcpu);
 	free_arr_colls(acolls, ncolls, pch);
 	if (!doreduce) {
@@ -311,4 +360,49 @@ psrs(void *acolls, int ncolls, int ncpus, int lcpu,
     }
     psrs_barrier(lcpu, ncpus);
     free(localpairs);
+    if (lcpu == main_lcpu)
+	free((void *) pivots);
+}
+
+/* Concatenate acolls into the first collection, in order.  Each cpu
+ * copies and frees every ncpus-th collection, so the copy runs in
+ * parallel.  Does nothing if everything already is in the first
+ * collection, as it is after a psrs without reduce.
+ */
+void
+psrs_cat(void *acolls, int ncolls, int ncpus, int lcpu,
+	 const pc_handler_t * pch)
+{
+    const int parrsz = pch->pch_get_parr_size();
+    const int psz = pch->pch_get_pair_size();
+    // the main cpu may still be filling acolls if psrs ran serially
+    psrs_barrier(lcpu, ncpus);
+    int len = 0;
+    int rest = 0;
+    for (int i = 0; i < ncolls; i++) {
+	int n = pch->pch_get_len(ARRELEM(acolls, parrsz, i));
+	len += n;
+	if (i)
+	    rest += n;
+    }
+    if (!rest)
+	return;
+    if (lcpu == main_lcpu)
+	output = malloc(len * psz);
+    psrs_barrier(lcpu, ncpus);
+    int dst_idx = 0;
+    for (int i = 0; i < ncolls; i++) {
+	void *coll = ARRELEM(acolls, parrsz, i);
+	int n = pch->pch_get_len(coll);
+	if (i % ncpus == lcpu)
+	    memcpy(ARRELEM(output, psz, dst_idx),
+		   pch->pch_get_arr_elems(coll), n * psz);
+	dst_idx += n;
+    }
+    // the lengths must stay put until every cpu has found its offsets
+    psrs_barrier(lcpu, ncpus);
+    for (int i = lcpu; i < ncolls; i += ncpus)
+	pch->pch_shallow_free(ARRELEM(acolls, parrsz, i));
+    if (lcpu == main_lcpu)
+	pch->pch_set_elems(acolls, (void *) output, len);
 }
@@ -5,4 +5,6 @@
 
 void psrs(void *acoll, int ncoll, int ncpus, int lcpu,
 	  const pc_handler_t * pch, pair_cmp_t pcmp, int doreduce);
+void psrs_cat(void *acolls, int ncolls, int ncpus, int lcpu,
+	      const pc_handler_t * pch);
 #endif
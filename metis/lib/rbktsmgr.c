@@ -48,30 +48,6 @@ rbkts_destroy(int n)
     }
 }
 
-static void
-rbkts_cat(void)
-{
-    if (nbkts == 1)
-	return;
-    int total_len = 0;
-    for (int i = 0; i < nbkts; i++) {
-	void *rbkt = rbkts_get(i);
-	total_len += rbkt_pch->pch_get_len(rbkt);
-    }
-    const int psz = rbkt_pch->pch_get_pair_size();
-    void *output = malloc(psz * total_len);
-    int dst_idx = 0;
-    for (int i = 0; i < nbkts; i++) {
-	void *rbkt = rbkts_get(i);
-	int len = rbkt_pch->pch_get_len(rbkt);
-	memcpy(ARRELEM(output, psz, dst_idx),
-	       rbkt_pch->pch_get_arr_elems(rbkt), len * psz);
-	dst_idx += len;
-	rbkt_pch->pch_shallow_free(rbkt);
-    }
-    rbkt_pch->pch_set_elems(rbkts_get(0), output, total_len);
-}
-
 void
 rbkts_set_reduce_task(int itask)
 {
@@ -134,11 +110,9 @@ rbkts_merge_reduce(const pc_handler_t * pch, void *acolls, int ncolls,
     psrs(acolls, ncolls, ncpus, lcpu, pch, pair_cmp_keyonly, 1);
     if (the_app.any.outcmp)
 	psrs(rbkts, nbkts, ncpus, lcpu, rbkt_pch, rbkts_pair_cmp, 0);
-    /* cat the reduce buckets to produce the final results. It is safe
-     * for cpu 0 to use all reduce buckets because psrs applies a barrier
-     * across all reduce workers. */
-    if (lcpu == 0)
-	rbkts_cat();
+    /* cat the reduce buckets to produce the final results. All reduce
+     * workers take part, each copying its share of the buckets. */
+    psrs_cat(rbkts, nbkts, ncpus, lcpu, rbkt_pch);
 }
 
 void
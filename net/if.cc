@@ -1,12 +1,79 @@
 extern "C" {
 #include "lwip/stats.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/ip.h"
+#include "lwip/tcp_impl.h"
 #include "netif/etharp.h"
 }
 
 #include "kernel.hh"
+#include "mmu.h"
+#include "netstat.hh"
 
 #include <string.h>
 
+#if LWIP_SUPPORT_CUSTOM_PBUF && !ETH_PAD_SIZE
+/*
+ * A received packet's pbuf refers to the driver's buffer itself, so the
+ * data is only copied once, into the reader's buffer.  Drivers receive
+ * into a page from netalloc() and the device writes at most 2K of it,
+ * so the pbuf goes at the end of the page.  Freeing the pbuf frees the
+ * page, for the driver to netalloc() again.
+ */
+#define RX_ZEROCOPY 1
+
+static void
+rx_pbuf_free(struct pbuf *p)
+{
+  netfree((void*) PGROUNDDOWN((uptr)p));
+}
+#endif
+
+#if !CHECKSUM_GEN_TCP
+/*
+ * lwIP leaves TCP checksums to us (see lwipopts.h).  Fill in the
+ * checksum of an outgoing IPv4 TCP segment in buf, or have the device
+ * do it: then this only seeds the checksum field with the pseudo-header
+ * sum and sets *start and *off for nettx().
+ */
+static void
+tcp_output_csum(u8 *buf, u32 size, u16 *start, u16 *off)
+{
+  *start = *off = 0;
+  if (size < SIZEOF_ETH_HDR + IP_HLEN)
+    return;
+  struct eth_hdr *eth = (struct eth_hdr*) buf;
+  if (eth->type != PP_HTONS(ETHTYPE_IP))
+    return;
+  struct ip_hdr *ip = (struct ip_hdr*) (buf + SIZEOF_ETH_HDR);
+  u16 ihl = IPH_HL(ip) * 4;
+  if (IPH_PROTO(ip) != IP_PROTO_TCP || (IPH_OFFSET(ip) & PP_HTONS(IP_OFFMASK)))
+    return;
+  u16 tcplen = ntohs(IPH_LEN(ip)) - ihl;
+  u16 tcpoff = SIZEOF_ETH_HDR + ihl;
+  if (tcpoff + tcplen > size || tcplen < TCP_HLEN)
+    return;
+
+  // The pseudo-header, summed in network byte order like the rest.
+  u32 sum = 0;
+  u16 *a = (u16*) &ip->src;
+  for (int i = 0; i < 4; i++)
+    sum += a[i];
+  sum += PP_HTONS(IP_PROTO_TCP) + htons(tcplen);
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+
+  u16 *csum = (u16*) (buf + tcpoff + 16);
+  *csum = sum;
+  if (nettx_csum_offload()) {
+    *start = tcpoff;
+    *off = tcpoff + 16;
+  } else {
+    *csum = inet_chksum(buf + tcpoff, tcplen);
+  }
+}
+#endif
+
 /**
  * In this function, the hardware should be initialized.
  * Called from if_init().
@@ -60,6 +127,7 @@ low_level_output(struct netif *netif, struct pbuf *p)
   buf = (u8*) netalloc();
   if (buf == nullptr) {
     cprintf("low_level_output: netalloc failed\n");
+    netstat_inc(&netstats::tx_nobuf);
     return ERR_MEM;
   }
   
@@ -75,7 +143,13 @@ low_level_output(struct netif *netif, struct pbuf *p)
     size += q->len;
   }
 
+#if !CHECKSUM_GEN_TCP
+  u16 csum_start, csum_off;
+  tcp_output_csum(buf, size, &csum_start, &csum_off);
+  nettx(buf, size, csum_start, csum_off);
+#else
   nettx(buf, size);
+#endif
 
 #if ETH_PAD_SIZE
   pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
@@ -97,6 +171,23 @@ low_level_output(struct netif *netif, struct pbuf *p)
 static struct pbuf *
 low_level_input(struct netif *netif, void *buf, u16_t len)
 {
+#ifdef RX_ZEROCOPY
+  struct pbuf *p;
+  struct pbuf_custom *pc =
+    (struct pbuf_custom*)((char*)buf + PGSIZE - sizeof(*pc));
+
+  pc->custom_free_function = rx_pbuf_free;
+  p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, pc, buf,
+                          PGSIZE - sizeof(*pc));
+  if (p != nullptr) {
+    LINK_STATS_INC(link.recv);
+  } else {
+    LINK_STATS_INC(link.memerr);
+    LINK_STATS_INC(link.drop);
+    netstat_inc(&netstats::rx_nobuf);
+  }
+  return p;
+#else
   struct pbuf *p, *q;
 
 #if ETH_PAD_SIZE
@@ -139,9 +230,11 @@ low_level_input(struct netif *netif, void *buf, u16_t len)
   } else {
     LINK_STATS_INC(link.memerr);
     LINK_STATS_INC(link.drop);
+    netstat_inc(&netstats::rx_nobuf);
   }
 
   return p;  
+#endif
 }
 
 /**
@@ -161,7 +254,13 @@ if_input(struct netif *netif, void *buf, u16 len)
 
   /* move received packet into a new pbuf */
   p = low_level_input(netif, buf, len);
+#ifdef RX_ZEROCOPY
+  /* the pbuf owns buf now, unless there isn't one */
+  if (p == nullptr)
+    netfree(buf);
+#else
   netfree(buf);
+#endif
   /* no packet could be read, silently ignore this */
   if (p == nullptr) return;
   /* points to packet payload, which starts with an Ethernet header */
@@ -173,12 +272,14 @@ if_input(struct netif *netif, void *buf, u16 len)
   case ETHTYPE_ARP:
     if (ethernet_input(p, netif) != ERR_OK) {
       cprintf("if_input: ethernet_input failed\n");
+      netstat_inc(&netstats::rx_bad);
       pbuf_free(p);
     }
     break;
   default:
     if (VERBOSE)
       cprintf("if_input: unknown type %04x\n", htons(ethhdr->type));
+    netstat_inc(&netstats::rx_bad);
     pbuf_free(p);
     p = 0;
     break;
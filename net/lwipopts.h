@@ -8,6 +8,8 @@
 #define LWIP_COMPAT_MUTEX       1
 #define SYS_LIGHTWEIGHT_PROT	0
 #define LWIP_PROVIDE_ERRNO      1
+// For SO_REUSEADDR, which SO_REUSEPORT listeners need to share a port.
+#define SO_REUSE                1
 
 #define MEM_ALIGNMENT		4
 
@@ -25,15 +27,23 @@
 
 #define PBUF_POOL_SIZE		512
 #define PBUF_POOL_BUFSIZE	2000
+// Received packets are pbufs that refer to the driver's buffers (see
+// net/if.cc), rather than copies in pool pbufs.
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
 
 #define TCP_MSS			1460
-#define TCP_WND			24000
-#define TCP_SND_BUF		(16 * TCP_MSS)
+// Without window scaling, which this lwIP doesn't have, windows and
+// send buffers can't be more than 64K.  These are as big as they go.
+#define TCP_WND			(44 * TCP_MSS)
+#define TCP_SND_BUF		(44 * TCP_MSS)
 // lwip prints a warning if TCP_SND_QUEUELEN < (2 * TCP_SND_BUF/TCP_MSS), 
 // but 16 is faster.. 
 #define TCP_SND_QUEUELEN	(2 * TCP_SND_BUF/TCP_MSS)
 //#define TCP_SND_QUEUELEN	16
 
+// net/if.cc computes outgoing TCP checksums, or has the NIC do it.
+#define CHECKSUM_GEN_TCP	0
+
 // Print error messages when we run out of memory
 #define LWIP_DEBUG	1
 
@@ -269,6 +269,7 @@ sys_init(void)
 void
 lwip_core_unlock(void)
 {
+  nettx_flush();
   release(&lwprot.lk);  
 }
 
@@ -281,6 +282,7 @@ lwip_core_lock(void)
 void
 lwip_core_sleep(struct condvar *c, uint64_t deadline)
 {
+  nettx_flush();
   if (deadline == ~0)
     c->sleep(&lwprot.lk);
   else
@@ -0,0 +1,190 @@
+#include "types.h"
+#include <uk/unistd.h>
+
+BEGIN_DECLS
+
+struct sockaddr;
+struct epoll_event;
+struct sigaction;
+struct syscall_batch_entry;
+struct utsname;
+struct stat;
+struct ioring;
+struct mmsghdr;
+struct timespec;
+struct iovec;
+void disktest(void);
+int epoll_create1(int);
+int epoll_ctl(int, int, int, struct epoll_event*);
+int epoll_wait(int, struct epoll_event*, int, int);
+int ioring_setup(struct ioring*, unsigned int);
+int ioring_enter(int, unsigned int, unsigned int);
+uint64_t time_nsec(void);
+long syscall_batch(struct syscall_batch_entry*, size_t);
+int dup(int);
+int dup2(int, int);
+off_t lseek(int, off_t, int);
+int close(int);
+void sync(void);
+int fsync(int);
+int fdatasync(int);
+int sync_file_range(int, off_t, off_t, unsigned int);
+int fallocate(int, off_t, off_t);
+int set_compression(int, int);
+int clone_file(int, int);
+int snapshot_create(void);
+int snapshot_drop(void);
+int snapshot_open(const char *);
+ssize_t read(int, void*, size_t);
+ssize_t pread(int, void*, size_t, off_t);
+ssize_t sendfile(int, int, off_t*, size_t);
+ssize_t splice(int, off_t*, int, off_t*, size_t, unsigned int);
+ssize_t write(int, const void*, size_t);
+ssize_t pwrite(int, const void *, size_t, off_t);
+ssize_t readv(int, const struct iovec*, int);
+ssize_t writev(int, const struct iovec*, int);
+ssize_t preadv(int, const struct iovec*, int, off_t);
+ssize_t pwritev(int, const struct iovec*, int, off_t);
+int fstatx(int, struct stat*, enum stat_flags);
+int fstatat(int, const char *, struct stat*);
+int linkat(int, const char *, int, const char *);
+int renameat(int, const char *, int, const char *);
+int unlinkat(int, const char *, int);
+int openat(int, const char *, int, ...);
+int mkdirat(int, const char *, mode_t);
+int mknod(const char *, int, int);
+int chdir(const char *);
+int execv(const char *upath, char * const uargv[]);
+int pipe2(int*, int);
+int pipe(int*);
+int readdir(int, const char *, char*);
+ssize_t getdents(int, void*, size_t);
+ssize_t getdents_stat(int, void*, size_t);
+int sys_spawn(const char *upath, char * const uargv[], const void *actions, size_t actions_len);
+void preload_oplog(void);
+int fork_flags(int);
+void exit(int) __attribute__((noreturn));
+int waitpid(int, int*, int);
+int wait(int*);
+int kill(int);
+int getpid(void);
+int getppid(void);
+char* sbrk(int);
+int nsleep(u64);
+u64 uptime(void);
+void * mmap(void*, size_t, int, int, int, off_t);
+int munmap(void*, size_t);
+int madvise(void*, size_t, int);
+int mprotect(void*, size_t, int);
+long pt_pages(void);
+void halt(void) __attribute__((noreturn));
+long cpuhz(void);
+int setfs(u64);
+int setaffinity(int);
+long futex(const u64*, int, u64, u64, const u64*, u64);
+long yield(void);
+int uname(struct utsname*);
+int dup_page(void*, void*);
+int sigaction(int, struct sigaction*, struct sigaction*);
+void kmbalance(void);
+int socket(int, int, int);
+int bind(int, const struct sockaddr*, uint32_t);
+int listen(int, int);
+int accept(int, struct sockaddr*, uint32_t*);
+ssize_t recvfrom(int, void*, size_t, int, struct sockaddr*, uint32_t*);
+ssize_t sendto(int, const void*, size_t, int, const struct sockaddr*, uint32_t);
+int sendmmsg(int, struct mmsghdr*, unsigned int, int);
+int recvmmsg(int, struct mmsghdr*, unsigned int, int, struct timespec*);
+int connect(int, const struct sockaddr*, u32);
+int setsockopt(int, int, int, const void*, u32);
+ssize_t send(int, const void*, size_t, int);
+ssize_t recv(int, void*, size_t, int);
+
+#define SYS_disktest 1
+#define SYS_epoll_create1 2
+#define SYS_epoll_ctl 3
+#define SYS_epoll_wait 4
+#define SYS_ioring_setup 5
+#define SYS_ioring_enter 6
+#define SYS_time_nsec 7
+#define SYS_syscall_batch 8
+#define SYS_dup 9
+#define SYS_dup2 10
+#define SYS_lseek 11
+#define SYS_close 12
+#define SYS_sync 13
+#define SYS_fsync 14
+#define SYS_fdatasync 15
+#define SYS_sync_file_range 16
+#define SYS_fallocate 17
+#define SYS_set_compression 18
+#define SYS_clone_file 19
+#define SYS_snapshot_create 20
+#define SYS_snapshot_drop 21
+#define SYS_snapshot_open 22
+#define SYS_read 23
+#define SYS_pread 24
+#define SYS_sendfile 25
+#define SYS_splice 26
+#define SYS_write 27
+#define SYS_pwrite 28
+#define SYS_readv 29
+#define SYS_writev 30
+#define SYS_preadv 31
+#define SYS_pwritev 32
+#define SYS_fstatx 33
+#define SYS_fstatat 34
+#define SYS_linkat 35
+#define SYS_renameat 36
+#define SYS_unlinkat 37
+#define SYS_openat 38
+#define SYS_mkdirat 39
+#define SYS_mknod 40
+#define SYS_chdir 41
+#define SYS_execv 42
+#define SYS_pipe2 43
+#define SYS_pipe 44
+#define SYS_readdir 45
+#define SYS_getdents 46
+#define SYS_getdents_stat 47
+#define SYS_sys_spawn 48
+#define SYS_preload_oplog 49
+#define SYS_fork_flags 50
+#define SYS_exit 51
+#define SYS_waitpid 52
+#define SYS_wait 53
+#define SYS_kill 54
+#define SYS_getpid 55
+#define SYS_getppid 56
+#define SYS_sbrk 57
+#define SYS_nsleep 58
+#define SYS_uptime 59
+#define SYS_mmap 60
+#define SYS_munmap 61
+#define SYS_madvise 62
+#define SYS_mprotect 63
+#define SYS_pt_pages 64
+#define SYS_halt 65
+#define SYS_cpuhz 66
+#define SYS_setfs 67
+#define SYS_setaffinity 68
+#define SYS_futex 69
+#define SYS_yield 70
+#define SYS_uname 71
+#define SYS_dup_page 72
+#define SYS_sigaction 73
+#define SYS_kmbalance 74
+#define SYS_socket 75
+#define SYS_bind 76
+#define SYS_listen 77
+#define SYS_accept 78
+#define SYS_recvfrom 79
+#define SYS_sendto 80
+#define SYS_sendmmsg 81
+#define SYS_recvmmsg 82
+#define SYS_connect 83
+#define SYS_setsockopt 84
+#define SYS_send 85
+#define SYS_recv 86
+
+END_DECLS
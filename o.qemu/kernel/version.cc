@@ -0,0 +1,2 @@
+const char *xv6_version_string = "Wed Oct 14 08:07:51 UTC 2026";
+const char *xv6_release_string = "";
@@ -1,11 +1,19 @@
 #pragma once
 #define NPROC        64  // maximum number of processes
 #define KSTACKSIZE 32768 // size of per-process kernel stack
+// Each core allocates pids from a queue of up to PID_CACHE free pids,
+// refilled with PID_BATCH new ones at a time when it runs dry.
+#define PID_CACHE    64
+#define PID_BATCH    32
+// Each core keeps up to KSTACK_CACHE kernel stacks of exited processes, with
+// their guard pages under KSTACK_DEBUG, for its next forks.
+#define KSTACK_CACHE  8
 
 // Originally NOFILE was 100. We increased it to 250 for dbench.
 // Be careful though; using large values for NOFILE can slow down
-// fork/exec/clone/spawn etc because filetable::copy() will take
-// longer to complete.
+// fork/exec/clone/spawn etc.  fork shares the parent's descriptors
+// until one side modifies them, but then that side (and exec, if
+// close-on-exec FDs are open) copies all NOFILE of them for each core.
 #define NOFILE      250  // open files per process
 
 #if 0 // These parameters are currently unused.
@@ -14,35 +22,80 @@
 #define NINODE     5000  // maximum number of active i-nodes
 #endif
 
-#define NDEV         16  // maximum major device number
+#define NDEV         32  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXARGLEN    64  // max exec argument length
 #define MAXNAME      16  // max string names
 #define UNIX_PATH_MAX 128
+#define MMSG_MAX     32  // max datagrams per sendmmsg/recvmmsg
+#define EPOLL_MAX_EVENTS 64 // max events per epoll_wait
+#define IORING_MAX_ENTRIES 4096 // max SQEs in an ioring
+#define UIO_MAXIOV   64  // max buffers per readv/writev
+#define NETTX_BATCH  32  // max packets sent to the NIC with one doorbell
 #define NEPOCH        4
 #define CACHELINE    64  // cache line size
 #define CPUKSTACKS   (NPROC + NCPU*2)
 #define VICTIMAGE 1000000 // cycles a proc executes before an eligible victim
 #define NDISK         8  // maximum number of hard disks in the machine
-#define USE_SATA_NCQ  0  // Native Command Queuing for SATA hard disks
+#define USE_SATA_NCQ  1  // Native Command Queuing for SATA hard disks
+#define NVME_QUEUE_DEPTH 256 // entries in each per-core NVMe I/O queue
+// Latency model of the memory-backed disk (MEMIDE), for benchmarking I/O
+// paths without real hardware: each request completes MEMIDE_LATENCY_US after
+// its data is transferred at MEMIDE_BANDWIDTH_MBPS (0 for unlimited), and a
+// flush takes MEMIDE_FLUSH_US.  All 0 completes I/O as soon as it is copied.
+// /dev/memdisk changes them at run time.
+#define MEMIDE_LATENCY_US 0
+#define MEMIDE_BANDWIDTH_MBPS 0
+#define MEMIDE_FLUSH_US 0
 #define VERBOSE       0  // print kernel diagnostics
 #define SPINLOCK_DEBUG DEBUG // Debug spin locks
 #define RCU_TYPE_DEBUG DEBUG
 #define LOCKSTAT      DEBUG
+// Each core profiles one in LOCKPROF_SAMPLE of the spinlock acquisitions that
+// had to wait, in every build, and reports where through /dev/lockprof.  0
+// turns the profiler off.
+#define LOCKPROF_SAMPLE 64
 #define ALLOC_MEMSET  DEBUG
 #define BUDDY_DEBUG   DEBUG
 #define REFCACHE_DEBUG DEBUG
 #define RADIX_DEBUG   DEBUG
 #define SEQLOCK_DEBUG DEBUG
 #define KSTACK_DEBUG  DEBUG // use guard pages for over/underflow protection
+// vmalloc_free() unmaps memory lazily: a core holds on to the pages (and the
+// KVMALLOC space) it freed until they add up to VMALLOC_LAZY_PAGES pages, and
+// then releases them all with a single global TLB flush.  Each core keeps up
+// to VMALLOC_CACHE_RANGES released ranges of KVMALLOC space for reuse.
+#define VMALLOC_LAZY_PAGES 256
+// munmap of anonymous memory clears the other cores' mappings of it
+// lazily, at their next context switch, while the vmap holds on to the
+// unmapped pages.  Once a vmap holds more than VM_LAZY_UNMAP_PAGES of
+// them, it makes the cores that are behind catch up by IPI.  0 makes
+// munmap shoot down right away.
+#define VM_LAZY_UNMAP_PAGES 256
+#define VMALLOC_CACHE_RANGES 16
 #define USTACKPAGES   8
 #define GCINTERVAL    10000 // max. time between GC runs (in msec)
 #define GC_GLOBAL     true
+// The global GC scheme tracks quiescent cores in groups of at most
+// GC_FANOUT cores of the same NUMA node.  A core that has delayed GC_BATCH
+// frees since it last did so starts an expedited grace period, in which
+// the GC threads run every tick instead of every GCINTERVAL.
+#define GC_FANOUT     16
+#define GC_BATCH      4096
 // The MMU scheme.  One of:
 //  mmu_shared_page_table
 //  mmu_per_core_page_table
 #define MMU_SCHEME    mmu_per_core_page_table
+// With mmu_per_core_page_table, each core tags the TLB entries of the
+// last VM_PCIDS address spaces it ran with a PCID, if the CPU supports
+// them, so switching between them doesn't flush the TLB.  At most 4095.
+// 0 disables PCIDs.
+#define VM_PCIDS      16
+// Map 2MB-aligned, fully mapped regions of anonymous memory with huge
+// pages.  These are split back to 4K mappings on COW, mprotect, or a
+// partial munmap.
+#define VM_HUGE_PAGES 1
 // The TLB shootdown scheme, for shared page tables.  One of:
 //  batched_shootdown
 //  core_tracking_shootdown
@@ -52,8 +105,23 @@
 //  refcache:: for refcache counters
 //  locked_snzi:: for SNZI counters
 #define PAGE_REFCOUNT refcache::
+// A core whose refcache review list holds this many objects makes the
+// other cores flush their refcaches at system call exits and in the idle
+// loop, as well as every tick, until its list is down to half that.
+#define REFCACHE_HURRY_OBJECTS 4096
 // The maximum number of recently freed pages to cache per core.
 #define KALLOC_HOT_PAGES 128
+// The maximum number of recently freed huge (HUGE_PGSIZE) pages to cache
+// per core.
+#define KALLOC_HOT_HUGE_PAGES 8
+// zalloc keeps a per-core pool of pre-zeroed pages that the idle loop
+// refills.  Each core's target pool size adapts between ZALLOC_TARGET_MIN
+// and ZALLOC_TARGET_MAX pages to how often the pool runs dry, and the idle
+// loop stops zeroing (and gives pages back) once less than
+// 1/ZALLOC_PRESSURE_DIV of memory is free.
+#define ZALLOC_TARGET_MIN 16
+#define ZALLOC_TARGET_MAX 1024
+#define ZALLOC_PRESSURE_DIV 8
 // How to balance memory load.  If 1, dynamically load balance pages
 // between buddy allocators.  If 0, directly steal and return memory
 // from remote buddy allocators.
@@ -61,15 +129,133 @@
 // Buddy allocator granularity.  If 0, create a buddy per NUMA node.
 // If 1, create a buddy per CPU.
 #define KALLOC_BUDDY_PER_CPU 1
-// Whether or not to load balance in the scheduler.
-#define SCHED_LOAD_BALANCE 0
+// When kalloc runs out of memory, it asks the registered shrinkers (at most
+// KALLOC_MAX_SHRINKERS of them) to free at least this many pages and
+// retries.  It evicts cached data (e.g., the page cache) to do so up to
+// KALLOC_RECLAIM_TRIES times.
+#define KALLOC_RECLAIM_BATCH 256
+#define KALLOC_RECLAIM_TRIES 4
+#define KALLOC_MAX_SHRINKERS 16
+// Whether or not idle cores steal runnable processes from other cores
+// (same NUMA node first), and at most how many they take at a time (up
+// to half of the victim's stealable processes).
+#define SCHED_LOAD_BALANCE 1
+#define SCHED_STEAL_MAX 8
+// Time slices, in timer ticks of QUANTUM msec, for kernel worker threads
+// and for user processes.  Kernel workers always run first, but after
+// SCHED_KERNEL_BURST of them in a row, a waiting user process gets a
+// turn.
+#define SCHED_KERNEL_TICKS 1
+#define SCHED_NORMAL_TICKS 1
+#define SCHED_KERNEL_BURST 8
+// Slots in each core's lock-free ring of deferred work (dwork_push).
+// Work that doesn't fit goes on a locked list.  Must be a power of 2.
+#define SCHED_DWORK_RING 256
+// An idle core spins for up to IDLE_POLL_US watching its run queue and
+// deferred work before sleeping, which makes wakeups from other cores
+// much faster at the cost of power.  With IDLE_MWAIT, it then sleeps in
+// MWAIT (if the CPU has it), which other cores end by queueing work for
+// it, instead of halting until the next interrupt.
+#define IDLE_POLL_US  0
+#define IDLE_MWAIT    1
+// A sleeping idle core skips its scheduler ticks, waking only for its
+// timeouts and at least every IDLE_TICKLESS_MS (0 keeps it ticking).
+#define IDLE_TICKLESS_MS 1000
+// Events in each core's scheduling trace ring (/dev/schedtrace).
+#define SCHEDTRACE_EVENTS 4096
+// Records in each core's tracepoint ring (/dev/tracepoints).
+#define TRACEPOINT_EVENTS 8192
+// Kernel worker threads per core, which run kwork (see kworker.hh).
+#define KWORKERS_PER_CPU 2
+// A contended sleeplock spins for up to SLEEPLOCK_SPIN pauses while its
+// owner is running on another core before going to sleep.  0 always sleeps.
+#define SLEEPLOCK_SPIN 2000
 // Reference counting scheme for inode's nlink.  One of:
 //  :: for shared reference counters
 //  refcache:: for refcache counters
+//  snzi:: for SNZI counters
 #define FS_NLINK_REFCOUNT refcache::
+// If 1, ScaleFS writes the journal blocks of the next batch of transactions
+// while the commit block of the previous batch is being flushed, and applies
+// committed transactions to the disk from a background per-core worker.
+#define SCALEFS_PIPELINED_COMMIT 1
+// Percentage of the per-core journal that may fill up before the background
+// checkpointer starts applying committed transactions to the disk.
+#define SCALEFS_CHECKPOINT_WATERMARK 75
+// Number of free blocks that a per-core block allocator takes from the global
+// reserve pool at a time when it runs dry.
+#define SCALEFS_BALLOC_REFILL 1024
+// Smallest and largest number of pages that mfile::get_page() reads ahead of
+// a sequential reader.
+#define SCALEFS_READAHEAD_MIN 4
+#define SCALEFS_READAHEAD_MAX 64
+// Page faults on file-backed mappings read in the aligned cluster of this many
+// pages around the faulting page.
+#define SCALEFS_FAULT_CLUSTER 16
+// A read fault on a file-backed mapping also maps the pages of its aligned
+// window of this many pages (at most 512) that are already in the page-cache.
+#define FAULT_AROUND_PAGES 16
+// Read-only mappings of an exec'd binary get copies of its pages on their own
+// NUMA node, rather than the single page-cache page on whichever node it was
+// read on, for up to this many pages per binary (see mfile::replica_page()).
+// 0 disables the copies.
+#define VM_REPLICA_PAGES 1024
+// Which NUMA node page-cache pages are allocated on.  If 0, on the node of
+// the core that first reads or writes the page (first-touch).  If 1,
+// round-robin over the nodes by page index (interleave).  If 2, on the node of
+// the core that brought the file into memory (owner).  /dev/mfsstats changes
+// it at run time.
+#define SCALEFS_PAGE_PLACEMENT 0
+// Boot-time scans of the inode table and the free block bitmap read this many
+// blocks at a time into the buffer cache.
+#define SCALEFS_BUF_CLUSTER 256
+// Longest time (in microseconds) that a thread applying a transaction to the
+// disk waits for the threads applying other transactions concurrently, so that
+// the shared write elevator can merge their writes.
+#define SCALEFS_ELEVATOR_DEADLINE_US 200
+// Default memory budget of the buffer cache (set in /dev/bufcache). Past it,
+// clean buffers that aren't part of an unwritten transaction are evicted in
+// CLOCK order.
+#define SCALEFS_BUFCACHE_MAX (64 << 20)
+// Each core caches the directories that this many recently looked up path
+// prefixes resolved to.  Prefixes longer than SCALEFS_DCACHE_PATH bytes are
+// not cached.
+#define SCALEFS_DCACHE_SIZE 128
+#define SCALEFS_DCACHE_PATH 88
+// A per-core page-cache CLOCK list is pruned of the entries of pages that
+// are no longer cached once it grows past twice its live size, and never
+// below this many entries.
+#define SCALEFS_CLOCK_PRUNE_MIN 4096
+// sync() and halt save up to this many of the cached file pages to a list
+// that the next boot reads back in (see kernel/warmlist.cc).  0 disables it.
+#define SCALEFS_WARMLIST_PAGES 65536
+// File data is written in place, never through the journal. With
+// SCALEFS_ORDERED_DATA, a sync leaves its data writes in flight and the
+// journal commit waits for them before the commit block; otherwise the sync
+// waits for them itself, with the inode locked.
+#define SCALEFS_ORDERED_DATA 1
+// The per-core writeback flushers wake up every SCALEFS_WRITEBACK_INTERVAL_MS
+// and write back the data of files that were first dirtied more than
+// SCALEFS_DIRTY_EXPIRE_MS ago. Once dirty pages exceed
+// SCALEFS_DIRTY_BACKGROUND_RATIO percent of memory they write back all dirty
+// files, and past SCALEFS_DIRTY_RATIO percent writers write back their own
+// files before returning.
+#define SCALEFS_WRITEBACK_INTERVAL_MS 1000
+#define SCALEFS_DIRTY_EXPIRE_MS 5000
+#define SCALEFS_DIRTY_BACKGROUND_RATIO 10
+#define SCALEFS_DIRTY_RATIO 20
+// Once the operations a core has logged to TSC-ordered oplogs (e.g., the
+// ScaleFS metadata logs) and that are still waiting to be applied take up
+// this many bytes, the oplog owner is asked to synchronize them in the
+// background.
+#define OPLOG_PENDING_BYTES (4<<20)
 #define RANDOMIZE_KMALLOC 1
 // Track kernel memory usage
 #define KERNEL_HEAP_PROFILE 0
+// Sample kernel allocations once every this many bytes on average, for the
+// per-call-site estimates in /dev/heapprof (which also changes it at run
+// time).  0 compiles the sampling out.
+#define KERNEL_HEAP_SAMPLE (512 << 10)
 
 // Configuring MEMIDE/AHCIIDE in param.h is deprecated.
 // Use include/ideconfig.hh instead.
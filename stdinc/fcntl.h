@@ -8,5 +8,9 @@ BEGIN_DECLS
 
 int open(const char*, int, ...);
 int openat(int, const char *, int, ...);
+// Move len bytes between fd_in and fd_out, at least one of them a
+// pipe, without copying them through user space.  off_out must be null.
+ssize_t splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out,
+               size_t len, unsigned int flags);
 
 END_DECLS
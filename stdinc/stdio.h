@@ -46,5 +46,7 @@ void vdprintf(int fd, const char *fmt, va_list ap);
  * http://pubs.opengroup.org/onlinepubs/009695399/functions/rename.html
  */
 int    rename(const char *oldpath, const char *newpath);
+int    renameat(int olddirfd, const char *oldpath,
+                int newdirfd, const char *newpath);
 
 END_DECLS
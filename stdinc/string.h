@@ -34,3 +34,30 @@ void *mempcpy(void *dest, const void *src, size_t n);
 char *safestrcpy(char *s, const char *t, size_t n);
 
 END_DECLS
+
+// We build with -ffreestanding, which stops the compiler from treating
+// these as builtins.  Let it inline small fixed-size copies and fills
+// (and call the real function for anything else).
+#if defined(__GNUC__) && !defined(XV6_STRING_IMPL)
+static inline __attribute__((always_inline)) void *
+__string_memcpy(void *d, const void *s, size_t n)
+{
+  return __builtin_memcpy(d, s, n);
+}
+
+static inline __attribute__((always_inline)) void *
+__string_memmove(void *d, const void *s, size_t n)
+{
+  return __builtin_memmove(d, s, n);
+}
+
+static inline __attribute__((always_inline)) void *
+__string_memset(void *d, int c, size_t n)
+{
+  return __builtin_memset(d, c, n);
+}
+
+#define memcpy(d, s, n) __string_memcpy((d), (s), (n))
+#define memmove(d, s, n) __string_memmove((d), (s), (n))
+#define memset(d, c, n) __string_memset((d), (c), (n))
+#endif
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "compiler.h"
+#include <uk/epoll.h>
+
+BEGIN_DECLS
+
+int epoll_create1(int flags);
+// Watch fd for the events in event->events.  Pipes, sockets, and other
+// epoll-capable files report readiness as it changes; any other file
+// is always ready for reading and writing.
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+// Wait up to timeout milliseconds (forever if -1) for events on the
+// watched files and return up to maxevents of them.
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout);
+
+END_DECLS
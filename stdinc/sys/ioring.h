@@ -0,0 +1,17 @@
+#pragma once
+
+#include "compiler.h"
+#include <uk/ioring.h>
+
+BEGIN_DECLS
+
+// Set up the ring at ring, of IORING_SIZE(entries) bytes, for
+// asynchronous I/O.  entries must be a power of 2.  Returns an FD for
+// ioring_enter.
+int ioring_setup(struct ioring *ring, unsigned entries);
+// Submit up to to_submit SQEs, then wait until at least min_complete
+// CQEs are ready.  Returns how many SQEs were submitted; fewer than
+// to_submit are if the completion queue could overflow.
+int ioring_enter(int fd, unsigned to_submit, unsigned min_complete);
+
+END_DECLS
@@ -9,6 +9,11 @@ int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
 int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
 int listen(int sockfd, int backlog);
+// Only SO_REUSEPORT is our own: listening sockets that all set it
+// before bind share the port, and connections from this machine go to
+// the one on the connecting core.  Other options are lwIP's.
+int setsockopt(int sockfd, int level, int optname, const void *optval,
+               socklen_t optlen);
 ssize_t send(int sockfd, const void *msg, size_t len, int flags);
 ssize_t sendto(int sockfd, const void *msg, size_t len, int flags,
                const struct sockaddr *dest_addr, socklen_t addrlen);
@@ -16,5 +21,14 @@ int socket(int domain, int type, int protocol);
 ssize_t recv(int sockfd, void *buf, size_t len, int flags);
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags,
                  struct sockaddr *src_addr, socklen_t *addrlen);
+// Send or receive up to vlen (at most MMSG_MAX) datagrams at once.
+// Return how many were moved and set each one's msg_len.  sendmmsg
+// stops early at a message with a different address from the first.
+// recvmmsg waits for at least one datagram, truncates any that don't
+// fit, and doesn't support timeout.
+struct timespec;
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout);
 
 END_DECLS
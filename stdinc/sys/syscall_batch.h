@@ -0,0 +1,14 @@
+#pragma once
+
+#include "compiler.h"
+#include <sys/types.h>
+#include <uk/syscall_batch.h>
+
+BEGIN_DECLS
+
+// Run the n system calls in ents, storing each one's result in its
+// ret.  Returns how many ran, which is less than n if a barrier entry
+// failed, or -1 if ents can't be read.
+long syscall_batch(struct syscall_batch_entry *ents, size_t n);
+
+END_DECLS
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "compiler.h"
+#include <sys/types.h>
+#include <uk/uio.h>
+
+BEGIN_DECLS
+
+// Like read and write, but scatter into or gather from iovcnt buffers
+// (at most UIO_MAXIOV), in order.  On regular files these copy straight
+// between the buffers and the page cache.
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+END_DECLS
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+// Events, as in Linux.
+#define EPOLLIN      0x001
+#define EPOLLOUT     0x004
+#define EPOLLERR     0x008
+#define EPOLLHUP     0x010
+// Report each event once, when it happens, rather than for as long as
+// the file stays ready.
+#define EPOLLET      (1u << 31)
+// Report one event and then nothing more until EPOLL_CTL_MOD.
+#define EPOLLONESHOT (1u << 30)
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+#define EPOLL_CLOEXEC 0x2000    // O_CLOEXEC
+
+typedef union epoll_data {
+  void *ptr;
+  int fd;
+  uint32_t u32;
+  uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event {
+  uint32_t events;
+  epoll_data_t data;
+} __attribute__((__packed__));
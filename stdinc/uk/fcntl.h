@@ -13,7 +13,15 @@
 #define O_CLOEXEC 0x2000
 #define O_NONBLOCK 0x4000
 #define O_NDELAY  O_NONBLOCK
+#define O_ANYORDER 0x8000 // (xv6) pipe2: per-core, message-granular pipe
+#define O_LOWFD   0x10000 // (xv6) lowest FD even in a threaded process
 #define O_LARGEFILE 0     // for compatibility with fxmark
 #define O_DIRECTORY 0
 
 #define AT_FDCWD  -100
+#define AT_REMOVEDIR 0x200  // unlinkat() flag
+
+// sync_file_range() flags
+#define SYNC_FILE_RANGE_WAIT_BEFORE 0x1
+#define SYNC_FILE_RANGE_WRITE       0x2
+#define SYNC_FILE_RANGE_WAIT_AFTER  0x4
@@ -6,3 +6,25 @@
 #define T_DEV  3   // Special device
 #define T_SOCKET 4  // Named socket
 #define T_FIFO 5    // Pipe
+
+// A directory entry, as returned by getdents().  Entries are packed
+// back to back; d_reclen is the size of the whole record, including
+// the NUL-terminated name and padding to 8 bytes.
+struct xv6_dirent {
+  unsigned long d_ino;          // mnode number
+  unsigned short d_reclen;
+  unsigned char d_type;         // T_DIR, T_FILE, ...
+  char d_name[];
+};
+
+// A directory entry along with some of its mnode's metadata, as returned
+// by getdents_stat(), packed the same way.  d_nlink is approximate, as
+// with STAT_APPROX_NLINK.
+struct xv6_direntstat {
+  unsigned long d_ino;
+  unsigned long d_size;         // 0 unless a T_FILE
+  unsigned int d_nlink;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
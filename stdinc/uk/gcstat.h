@@ -5,5 +5,9 @@ struct gc_stat {
   u64 nrun;
   u64 ncycles;
   u64 nop;
+  u64 nexpedite;             /* expedited grace periods started */
+  u64 nbytes_delay;          /* bytes of the objects delayed */
+  u64 nbytes_free;           /* bytes of the objects freed */
+  u64 max_latency_ns;        /* longest time a delayed-free list waited */
 };
 
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+// Asynchronous I/O rings (see kernel/ioring.cc).  The application
+// allocates IORING_SIZE(entries) bytes of memory, which hold a header,
+// the submission queue of entries SQEs, and the completion queue of
+// 2*entries CQEs.  It fills in SQEs at sq_tail and advances sq_tail;
+// ioring_enter submits them, and the kernel advances sq_head as it
+// takes them.  The kernel fills in CQEs at cq_tail and advances it,
+// and the application consumes them at cq_head.  Indexes are free
+// running; slot i of the SQ is sqes[i % entries].
+
+#define IORING_OP_NOP    0
+#define IORING_OP_READ   1      // read(fd, addr, len)
+#define IORING_OP_WRITE  2      // write(fd, addr, len)
+#define IORING_OP_PREAD  3      // pread(fd, addr, len, off)
+#define IORING_OP_PWRITE 4      // pwrite(fd, addr, len, off)
+#define IORING_OP_FSYNC  5      // fsync(fd)
+#define IORING_OP_OPENAT 6      // openat(fd, (char*)addr, op_flags)
+
+struct ioring_sqe {
+  uint8_t opcode;
+  uint8_t flags;                // Must be 0
+  uint16_t pad;
+  int32_t fd;
+  uint64_t off;
+  uint64_t addr;
+  uint32_t len;
+  uint32_t op_flags;
+  uint64_t user_data;           // Copied to the CQE
+};
+
+struct ioring_cqe {
+  uint64_t user_data;
+  int64_t res;                  // What the system call would return
+};
+
+struct ioring {
+  // sq_tail and cq_head are written by the application, sq_head and
+  // cq_tail by the kernel.
+  volatile uint32_t sq_head;
+  volatile uint32_t sq_tail;
+  volatile uint32_t cq_head;
+  volatile uint32_t cq_tail;
+  uint32_t entries;             // Set by ioring_setup
+  uint32_t pad;
+};
+
+#define IORING_SQES(r) ((struct ioring_sqe*)((struct ioring*)(r) + 1))
+#define IORING_CQES(r) \
+  ((struct ioring_cqe*)(IORING_SQES(r) + ((struct ioring*)(r))->entries))
+#define IORING_SIZE(entries)                                    \
+  (sizeof(struct ioring) + (entries) * sizeof(struct ioring_sqe) + \
+   2 * (entries) * sizeof(struct ioring_cqe))
@@ -12,6 +12,11 @@ struct cpulockstat {
 
   u64 locking_ts;
   u64 locked_ts;
+
+  // Contended sleeplock acquires that got the lock by spinning while
+  // its owner ran, and that had to sleep.
+  u64 spins;
+  u64 sleeps;
   __padout__;
 } __mpalign__;
 
@@ -10,10 +10,16 @@
 #define MAP_PRIVATE   0x2
 #define MAP_FIXED     0x4
 #define MAP_ANONYMOUS 0x8
+#define MAP_POPULATE  0x10      // Prefault the mapping
 
 #define MAP_FAILED ((void*)-1)
 
-#define MADV_WILLNEED 3
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1       // Don't read ahead on faults
+#define MADV_SEQUENTIAL 2       // Read ahead aggressively on faults
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4       // Drop the pages; private memory reads zeros
+                                // (or the file) again afterwards
 
 // xv6 extension: invalidate all page tables
 #define MADV_INVALIDATE_CACHE 1000
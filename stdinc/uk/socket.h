@@ -1,5 +1,7 @@
 #pragma once
 
+#include <uk/uio.h>
+
 #ifdef LWIP
 #include "lwip/sockets.h"
 // Oddly, LWIP doesn't define sa_family_t
@@ -14,6 +16,11 @@ typedef uint8_t sa_family_t;
 #define SOCK_STREAM 1
 #define SOCK_DGRAM 2
 
+// As in lwIP
+#define SOL_SOCKET 0xfff
+#define SO_REUSEADDR 0x0004
+#define SO_REUSEPORT 0x0200
+
 struct sockaddr
 {
   sa_family_t sa_family;
@@ -41,12 +48,35 @@ struct __attribute__((__aligned__(__BIGGEST_ALIGNMENT__))) sockaddr_storage
   char __pad2;
 };
 
+// A message for sendmmsg and recvmmsg, laid out as on Linux.  Only
+// msg_name, msg_namelen and a single-entry msg_iov are used.
+struct msghdr
+{
+  void *msg_name;
+  socklen_t msg_namelen;
+  struct iovec *msg_iov;
+  size_t msg_iovlen;
+  void *msg_control;
+  size_t msg_controllen;
+  int msg_flags;
+};
+
+struct mmsghdr
+{
+  struct msghdr msg_hdr;
+  unsigned int msg_len;         // Bytes sent or received
+};
+
 #define AF_LOCAL 1
 #define AF_UNIX AF_LOCAL
 #define PF_LOCAL AF_LOCAL
 #define PF_UNIX AF_UNIX
 
 #define SOCK_DGRAM_UNORDERED 3
+
+// Or'd into socket()'s type: operations on the socket that would wait
+// fail instead.
+#define SOCK_NONBLOCK 0x4000    // O_NONBLOCK
 #ifdef __cplusplus
 static_assert(SOCK_DGRAM_UNORDERED != SOCK_STREAM,
               "SOCK_DGRAM_UNORDERED == SOCK_STREAM");
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+// Batched system calls (see sys_syscall_batch in kernel/syscall.cc).
+// Each entry names a system call by its SYS_ number and gives its
+// arguments.  syscall_batch runs the entries in order, as if each had
+// been made on its own, and stores what each returned in its ret.
+// ret holds the whole return register, so cast it to the call's
+// return type before looking at it.
+//
+// An entry with a barrier flag ends the batch if it fails, so that
+// entries depending on it don't run.  SYSCALL_BATCH_BARRIER is for
+// calls that return int, SYSCALL_BATCH_BARRIER_LONG for ones that
+// return long or ssize_t.
+
+#define SYSCALL_BATCH_BARRIER      0x1
+#define SYSCALL_BATCH_BARRIER_LONG 0x2
+
+#define SYSCALL_BATCH_MAX 1024
+
+struct syscall_batch_entry {
+  uint64_t num;
+  uint64_t args[6];
+  uint64_t ret;                 // Set by syscall_batch
+  uint32_t flags;
+  uint32_t pad;
+};
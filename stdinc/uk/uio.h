@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+
+// A buffer for readv, writev, and friends, laid out as on Linux.
+struct iovec
+{
+  void *iov_base;
+  size_t iov_len;
+};
@@ -8,7 +8,10 @@
 // xv6 fstatx flags
 enum stat_flags {
   STAT_NO_FLAGS = 0,
-  STAT_OMIT_NLINK = 1<<0
+  STAT_OMIT_NLINK = 1<<0,
+  // Report an st_nlink that may not yet include the latest links and
+  // unlinks made on other cores, which is much cheaper to read.
+  STAT_APPROX_NLINK = 1<<1
 };
 
 // lseek flags
@@ -15,6 +15,8 @@ ssize_t pread(int fd, void *buf, size_t count, off_t offset);
 int close(int fd);
 int link(const char *oldpath, const char *newpath);
 int unlink(const char *pathname);
+int linkat(int olddirfd, const char *oldpath, int newdirfd, const char *newpath);
+int unlinkat(int dirfd, const char *pathname, int flags);
 int execv(const char *path, char *const argv[]);
 int dup(int oldfd);
 int dup2(int oldfd, int newfd);
@@ -3,10 +3,10 @@ import subprocess
 import bisect
 import collections
 
-SAMP = struct.Struct("IIQ4QIIQ")
+SAMP = struct.Struct("IIQ8QIIQ")
 
 class SamplerFile(object):
-    NTRACE = 4
+    NTRACE = 8
     FLAGS, COUNT, RIP, TRACE0 = range(4)
     LATENCY, SOURCE, LOAD_ADDRESS = range(TRACE0+NTRACE, TRACE0+NTRACE+3)
 
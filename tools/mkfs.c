@@ -4,10 +4,15 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "include/types.h"
 #include "include/fs.h"
 
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
 int ninodes = NINODES;
 u32 size = NMEGS * BLKS_PER_MEG;
 
@@ -17,7 +22,19 @@ char zeroes[BSIZE];
 u32 freeblock;
 u32 usedblocks;
 u32 bitblocks;
+u32 refblocks;
 u32 freeinode = 1;
+int extents;
+int refcounts = 1;
+
+// The files to copy into the image, once their blocks have been laid out.
+struct copyjob {
+  int fd;
+  u32 inum;
+  u32 nblocks;
+} *jobs;
+int njobs;
+int nextjob;
 
 void balloc(int);
 void wsect(u32, void*);
@@ -26,6 +43,9 @@ void rinode(u32 inum, struct dinode *ip);
 void rsect(u32 sec, void *buf);
 u32 ialloc(u16 type);
 void iappend(u32 inum, void *p, int n);
+void dirappend(u32 dirino, u32 inum, const char *name);
+void summarize(void);
+void *copier(void *arg);
 
 // convert to intel byte order
 u16
@@ -55,18 +75,80 @@ main(int argc, char *argv[])
 {
   int i, cc, fd;
   u32 rootino, inum, off;
-  struct dirent de;
   char buf[BSIZE];
   struct dinode din;
   int nblocks;
+  u32 journal_blocks = PHYS_JOURNAL_SIZE / BSIZE;
+  u32 stripe_blks = 0;
+  int journal_dev = -1;
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_t *threads;
+  struct stat st;
+
+  for(;;){
+    // -j sets the size (in blocks) of the per-core journals, sv6journal*.
+    if(argc >= 3 && strcmp(argv[1], "-j") == 0){
+      journal_blocks = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    // -e makes all inodes extent-mapped (SB_FEATURE_EXTENTS).
+    } else if(argc >= 2 && strcmp(argv[1], "-e") == 0){
+      extents = 1;
+      argc -= 1;
+      argv += 1;
+    // -R leaves out block refcounts (SB_FEATURE_REFCOUNTS), so files
+    // can't be cloned. The refcount blocks are still laid out.
+    } else if(argc >= 2 && strcmp(argv[1], "-R") == 0){
+      refcounts = 0;
+      argc -= 1;
+      argv += 1;
+    // -s sets how many blocks of data go to each disk in turn.
+    } else if(argc >= 3 && strcmp(argv[1], "-s") == 0){
+      stripe_blks = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    // -J puts all the journals on a disk of their own, which data blocks
+    // aren't striped across (SB_FEATURE_JOURNAL_DEV).
+    } else if(argc >= 3 && strcmp(argv[1], "-J") == 0){
+      journal_dev = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    // -t sets how many threads copy the files in (default: one per CPU).
+    } else if(argc >= 3 && strcmp(argv[1], "-t") == 0){
+      nthreads = atoi(argv[2]);
+      argc -= 2;
+      argv += 2;
+    } else {
+      break;
+    }
+  }
 
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-e] [-R] [-j journal-blocks] [-s stripe-blocks] "
+            "[-J journal-disk] [-t threads] fs.img files...\n");
+    exit(1);
+  }
+
+  if(journal_blocks < 3 || journal_blocks > MAX_PHYS_JOURNAL_SIZE / BSIZE){
+    fprintf(stderr, "mkfs: bad journal size %u blocks\n", journal_blocks);
+    exit(1);
+  }
+
+  // The superblock has to stay on disk 0, in the first stripe.
+  if(stripe_blks == 1){
+    fprintf(stderr, "mkfs: bad stripe size %u blocks\n", stripe_blks);
+    exit(1);
+  }
+  if(journal_dev == 0 || journal_dev >= NDISK){
+    fprintf(stderr, "mkfs: bad journal disk %d\n", journal_dev);
     exit(1);
   }
+  if(nthreads < 1)
+    nthreads = 1;
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
-  assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(DIRENT_RECLEN(DIRSIZ) <= BSIZE);
+  assert(EXTENT_COUNT < NDIRECT + 2);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0){
@@ -75,34 +157,41 @@ main(int argc, char *argv[])
   }
 
   bitblocks = (size+BSIZE*8-1)/(BSIZE*8);
-  usedblocks = ninodes / IPB + 3 + bitblocks;
+  refblocks = (size+RPB-1)/RPB;
+  usedblocks = ninodes / IPB + 3 + bitblocks + refblocks;
   freeblock = usedblocks;
 
   nblocks = size - usedblocks;
 
-  printf("used %d (bit %d ninode %zu) free %u total %d\n", usedblocks,
-         bitblocks, ninodes/IPB + 1, freeblock, nblocks+usedblocks);
+  printf("used %d (bit %d ref %d ninode %zu) free %u total %d\n", usedblocks,
+         bitblocks, refblocks, ninodes/IPB + 1, freeblock, nblocks+usedblocks);
 
-  for(i = 0; i < nblocks + usedblocks; i++)
-    wsect(i, zeroes);
+  // The image starts out as one big hole, which reads back as zeroes, so
+  // only the blocks that aren't all zeroes ever get written. Zero it by
+  // hand if it can't be sized that way (e.g., it is a device).
+  if(ftruncate(fsfd, (off_t)size * BSIZE) < 0)
+    for(i = 0; i < nblocks + usedblocks; i++)
+      wsect(i, zeroes);
 
   sb.size = xint(size);
   sb.nblocks = xint(nblocks); // so whole disk is size sectors
   sb.ninodes = xint(ninodes);
+  sb.features = xint((extents ? SB_FEATURE_EXTENTS : 0) |
+                     (journal_dev > 0 ? SB_FEATURE_JOURNAL_DEV : 0) |
+                     (refcounts ? SB_FEATURE_REFCOUNTS : 0) |
+                     SB_FEATURE_INLINE_DATA);
+  sb.layout.stripe_blks = xint(stripe_blks);
+  sb.layout.journal_dev = xint(journal_dev > 0 ? journal_dev : 0);
 
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  dirappend(rootino, rootino, ".");
+  dirappend(rootino, rootino, "..");
 
+  // Lay out the files first, one after the other, and copy their contents
+  // in afterwards, in parallel.
+  jobs = calloc(argc, sizeof(*jobs));
   for(i = 2; i < argc; i++){
     if((fd = open(argv[i], 0)) < 0){
       perror(argv[i]);
@@ -122,28 +211,55 @@ main(int argc, char *argv[])
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, argv[i], DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    dirappend(rootino, inum, argv[i]);
 
     int jnum;
 
     if (strncmp(argv[i], "sv6journal", 10) == 0) {
       jnum = atoi(argv[i]+10);
       sb.journal_blknums[jnum].start_blknum = xint(freeblock);
-    }
 
-    while((cc = read(fd, buf, sizeof(buf))) > 0)
-      iappend(inum, buf, cc);
+      // The journal files only serve as placeholders, since the journal
+      // starts out zeroed; its size is chosen here instead. Its blocks are
+      // contiguous and never written here.
+      for (u32 b = 0; b < journal_blocks; b += cc) {
+        cc = min(journal_blocks - b, 256);
+        iappend(inum, NULL, cc * BSIZE);
+      }
 
-    if (strncmp(argv[i], "sv6journal", 10) == 0) {
       sb.journal_blknums[jnum].end_blknum = xint(freeblock - 1); // Inclusive
+      close(fd);
+    } else {
+      if(fstat(fd, &st) < 0){
+        perror(argv[i]);
+        exit(1);
+      }
+      for(off_t o = 0; o < st.st_size; o += cc){
+        cc = min(st.st_size - o, 256 * BSIZE);
+        iappend(inum, NULL, cc);
+      }
+      jobs[njobs].fd = fd;
+      jobs[njobs].inum = inum;
+      jobs[njobs].nblocks = (st.st_size + BSIZE - 1) / BSIZE;
+      njobs++;
     }
 
-    close(fd);
+    if(freeblock > size){
+      fprintf(stderr, "mkfs: %s does not fit in the file system\n", argv[i]);
+      exit(1);
+    }
   }
 
+  threads = calloc(nthreads, sizeof(*threads));
+  for(i = 0; i < nthreads; i++)
+    if(pthread_create(&threads[i], NULL, copier, NULL) != 0){
+      fprintf(stderr, "mkfs: pthread_create failed\n");
+      exit(1);
+    }
+  for(i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+
+  summarize();
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
   wsect(1, buf);
@@ -163,11 +279,7 @@ main(int argc, char *argv[])
 void
 wsect(u32 sec, void *buf)
 {
-  if(lseek(fsfd, sec * (long)BSIZE, 0) != sec * (long)BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(write(fsfd, buf, BSIZE) != BSIZE){
+  if(pwrite(fsfd, buf, BSIZE, sec * (long)BSIZE) != BSIZE){
     perror("write");
     exit(1);
   }
@@ -209,11 +321,7 @@ rinode(u32 inum, struct dinode *ip)
 void
 rsect(u32 sec, void *buf)
 {
-  if(lseek(fsfd, sec * (long)BSIZE, 0) != sec * (long)BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(read(fsfd, buf, BSIZE) != BSIZE){
+  if(pread(fsfd, buf, BSIZE, sec * (long)BSIZE) != BSIZE){
     perror("read");
     exit(1);
   }
@@ -254,8 +362,89 @@ balloc(int used)
   }
 }
 
-#define min(a, b) ((a) < (b) ? (a) : (b))
+// Number of xs in both [s1, e1) and [s2, e2).
+u32
+overlap(u32 s1, u32 e1, u32 s2, u32 e2)
+{
+  u32 s = max(s1, s2), e = min(e1, e2);
+  return s < e ? e - s : 0;
+}
 
+// Fill in the allocation summary. Everything mkfs allocates is at the start:
+// inodes [1, freeinode) and blocks [0, usedblocks).
+void
+summarize(void)
+{
+  u32 igroup = SB_IGROUP_BLKS(ninodes) * IPB;
+  u32 bgroup = SB_BGROUP_BLKS(size) * BPB;
+  int g;
+
+  assert(sizeof(sb) <= BSIZE);
+  for(g = 0; g < SB_NGROUPS; g++){
+    u32 istart = g * igroup, bstart = g * bgroup;
+    u32 nin = overlap(istart, istart + igroup, 0, ninodes);
+    u32 nb = overlap(bstart, bstart + bgroup, 0, size);
+    sb.summary.ifree[g] =
+      xint(nin - overlap(istart, istart + igroup, 1, freeinode));
+    sb.summary.bfree[g] =
+      xint(nb - overlap(bstart, bstart + bgroup, 0, usedblocks));
+  }
+  sb.summary.clean = xint(1);
+}
+
+// Return the disk block of file block fbn of an extent-mapped inode,
+// allocating it if need be. Files are only ever appended to here, so a new
+// block either continues the last extent or starts a new one after it.
+u32
+ebmap(struct dinode *din, u32 fbn)
+{
+  char buf[BSIZE];
+  struct dextent *blk = (struct dextent*)buf;
+  struct dextent *ext = NULL;
+  u32 n = xint(din->addrs[EXTENT_COUNT]);
+  u32 x;
+
+  if(n > NINLINE_EXTENTS){
+    rsect(xint(din->addrs[EXTENT_BLOCK]), buf);
+    ext = &blk[n - 1 - NINLINE_EXTENTS];
+  } else if(n > 0){
+    ext = (struct dextent*)din->addrs + n - 1;
+  }
+
+  if(ext && fbn < xint(ext->lblk) + xint(ext->len))
+    return xint(ext->pblk) + fbn - xint(ext->lblk);
+
+  assert(!ext || fbn == xint(ext->lblk) + xint(ext->len));
+  x = freeblock++;
+  usedblocks++;
+
+  if(ext && x == xint(ext->pblk) + xint(ext->len)){
+    ext->len = xint(xint(ext->len) + 1);
+  } else {
+    assert(n < NINLINE_EXTENTS + NEXTENTS_PER_BLOCK);
+    if(n == NINLINE_EXTENTS){
+      din->addrs[EXTENT_BLOCK] = xint(freeblock++);
+      usedblocks++;
+      bzero(buf, sizeof(buf));
+    }
+    if(n < NINLINE_EXTENTS)
+      ext = (struct dextent*)din->addrs + n;
+    else
+      ext = &blk[n - NINLINE_EXTENTS];
+    ext->lblk = xint(fbn);
+    ext->pblk = xint(x);
+    ext->len = xint(1);
+    din->addrs[EXTENT_COUNT] = xint(n + 1);
+  }
+
+  if(ext >= blk && ext < blk + NEXTENTS_PER_BLOCK)
+    wsect(xint(din->addrs[EXTENT_BLOCK]), buf);
+  return x;
+}
+
+// Append n bytes from xp to inum. With a null xp, the blocks are only
+// allocated, and keep whatever the image holds (zeroes, until copier()
+// fills them in).
 void
 iappend(u32 inum, void *xp, int n)
 {
@@ -272,7 +461,9 @@ iappend(u32 inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    if(extents){
+      x = ebmap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
         usedblocks++;
@@ -320,13 +511,127 @@ iappend(u32 inum, void *xp, int n)
       x = xint(indirect[i2]);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
-    rsect(x, buf);
-    bcopy(p, buf + off - (fbn * BSIZE), n1);
-    wsect(x, buf);
+    if(p){
+      rsect(x, buf);
+      bcopy(p, buf + off - (fbn * BSIZE), n1);
+      wsect(x, buf);
+      p += n1;
+    }
     n -= n1;
     off += n1;
-    p += n1;
   }
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Append an entry for inum to the directory dirino, first covering the
+// rest of the current block with an unused record if the entry doesn't
+// fit in it.  The root is the only directory mkfs creates.
+void
+dirappend(u32 dirino, u32 inum, const char *name)
+{
+  static u32 off;
+  char rec[DIRENT_RECLEN(DIRSIZ)];
+  struct dirent *de = (struct dirent*)rec;
+  u32 namelen = strlen(name);
+  u32 reclen = DIRENT_RECLEN(namelen);
+
+  if(namelen > DIRSIZ){
+    fprintf(stderr, "mkfs: name too long: %s\n", name);
+    exit(1);
+  }
+
+  if(off % BSIZE + reclen > BSIZE){
+    u32 pad = BSIZE - off % BSIZE;
+    bzero(rec, sizeof(rec));
+    de->reclen = xshort(pad);
+    iappend(dirino, rec, pad);
+    off += pad;
+  }
+
+  bzero(rec, sizeof(rec));
+  de->inum = xint(inum);
+  de->reclen = xshort(reclen);
+  de->namelen = namelen;
+  memmove(de->name, name, namelen);
+  iappend(dirino, rec, reclen);
+  off += reclen;
+}
+
+// Find the disk blocks of the first n file blocks of din, which are all
+// allocated, and put them in bnos.
+void
+file_blocks(struct dinode *din, u32 n, u32 *bnos)
+{
+  u32 indirect[NINDIRECT], dindirect[NINDIRECT];
+  struct dextent ext[NINLINE_EXTENTS + NEXTENTS_PER_BLOCK];
+  u32 fbn, i, b;
+
+  if(extents){
+    u32 next = xint(din->addrs[EXTENT_COUNT]);
+    memmove(ext, din->addrs, min(next, NINLINE_EXTENTS) * sizeof(*ext));
+    if(next > NINLINE_EXTENTS){
+      char buf[BSIZE];
+      rsect(xint(din->addrs[EXTENT_BLOCK]), buf);
+      memmove(ext + NINLINE_EXTENTS, buf,
+              (next - NINLINE_EXTENTS) * sizeof(*ext));
+    }
+    fbn = 0;
+    for(i = 0; i < next && fbn < n; i++)
+      for(b = 0; b < xint(ext[i].len) && fbn < n; b++)
+        bnos[fbn++] = xint(ext[i].pblk) + b;
+    assert(fbn == n);
+    return;
+  }
+
+  for(fbn = 0; fbn < n && fbn < NDIRECT; fbn++)
+    bnos[fbn] = xint(din->addrs[fbn]);
+  if(fbn < n){
+    rsect(xint(din->addrs[NDIRECT]), (char*)indirect);
+    for(; fbn < n && fbn < NDIRECT + NINDIRECT; fbn++)
+      bnos[fbn] = xint(indirect[fbn - NDIRECT]);
+  }
+  if(fbn < n)
+    rsect(xint(din->addrs[NDIRECT+1]), (char*)dindirect);
+  for(i = 0; fbn < n; i++){
+    rsect(xint(dindirect[i]), (char*)indirect);
+    for(b = 0; b < NINDIRECT && fbn < n; b++)
+      bnos[fbn++] = xint(indirect[b]);
+  }
+}
+
+// Copy the files in jobs into the blocks laid out for them, skipping
+// blocks of zeroes, which the image already holds. Files are handed out to
+// the copier threads one at a time.
+void *
+copier(void *arg)
+{
+  char buf[BSIZE];
+  struct dinode din;
+  int j;
+
+  while((j = __atomic_fetch_add(&nextjob, 1, __ATOMIC_RELAXED)) < njobs){
+    struct copyjob *job = &jobs[j];
+    u32 *bnos = malloc(max(job->nblocks, 1) * sizeof(*bnos));
+    u32 fbn;
+    int cc, k;
+
+    rinode(job->inum, &din);
+    file_blocks(&din, job->nblocks, bnos);
+    for(fbn = 0; fbn < job->nblocks; fbn++){
+      cc = pread(job->fd, buf, BSIZE, fbn * (off_t)BSIZE);
+      if(cc <= 0){
+        perror("read");
+        exit(1);
+      }
+      memset(buf + cc, 0, BSIZE - cc);
+      for(k = 0; k < BSIZE && !buf[k]; k++)
+        ;
+      if(k < BSIZE)
+        wsect(bnos[fbn], buf);
+    }
+    free(bnos);
+    close(job->fd);
+  }
+  return NULL;
+}
@@ -13,6 +13,8 @@
 #include <stdlib.h>
 #include <stdarg.h>
 
+#include <algorithm>
+#include <memory>
 #include <unordered_map>
 #include <map>
 #include <string>
@@ -20,9 +22,11 @@
 
 #include "include/types.h"
 #include "include/sampler.h"
+#include "include/memlayout.h"
 
 static bool stacktrace_mode = true;
 static bool ignoreidle_mode = false;
+static bool folded_mode = false;
 
 static void __attribute__((noreturn)) 
 edie(const char* errstr, ...) 
@@ -273,6 +277,79 @@ selfless(void)
   signal(SIGPIPE, SIG_DFL);
 }
 
+// The names of the functions at pc, outermost first, with inlined
+// functions after the function they were inlined into.  Given a user
+// image, user PCs are looked up in it and kernel PCs in the other
+// image; otherwise, all of them are looked up in the one image.
+static void
+frame_names(Addr2line &kaddr2line, Addr2line *uaddr2line, uint64_t pc,
+            std::vector<std::string> *out)
+{
+  std::vector<line_info> li;
+  Addr2line *a2l = pc >= KCODE || !uaddr2line ? &kaddr2line : uaddr2line;
+  a2l->lookup(pc, &li);
+
+  size_t start = out->size();
+  for (auto &l : li)
+    if (l.func != "??")
+      out->push_back(l.func);
+  if (out->size() == start) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%#" PRIx64, pc);
+    out->push_back(buf);
+  }
+  std::reverse(out->begin() + start, out->end());
+}
+
+// Print the samples as "folded" stacks, one line per distinct call
+// chain: the frames from the outermost in, separated by semicolons,
+// and the number of samples.  This is what flamegraph.pl and most other
+// flame graph viewers read.
+static void
+print_folded(Addr2line &kaddr2line, Addr2line *uaddr2line,
+             const std::unordered_map<struct pmuevent*, int, pmuevent_ops,
+                                      pmuevent_ops> &map)
+{
+  std::map<std::string, uint64_t> stacks;
+  std::unordered_map<uint64_t, std::vector<std::string>> names;
+
+  auto lookup = [&](uint64_t pc) -> const std::vector<std::string>& {
+    auto it = names.find(pc);
+    if (it == names.end()) {
+      std::vector<std::string> v;
+      frame_names(kaddr2line, uaddr2line, pc, &v);
+      it = names.emplace(pc, std::move(v)).first;
+    }
+    return it->second;
+  };
+
+  for (auto &p : map) {
+    struct pmuevent *e = p.first;
+    std::string stack = e->offcpu ? "[offcpu]" : e->idle ? "[idle]" :
+      e->kernel ? "[kernel]" : "[user]";
+    int depth = 0;
+    while (depth < NTRACE && e->trace[depth])
+      depth++;
+    for (int i = depth - 1; i >= 0; i--)
+      for (auto &name : lookup(e->trace[i]))
+        stack += ";" + name;
+    for (auto &name : lookup(e->rip))
+      stack += ";" + name;
+    stacks[stack] += p.second;
+  }
+
+  for (auto &s : stacks)
+    printf("%s %" PRIu64 "\n", s.first.c_str(), s.second);
+}
+
+static void __attribute__((noreturn))
+usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-f] sample-file elf-file [user-elf-file]\n"
+          "  -f  print folded stacks, for flame graphs\n", argv0);
+  exit(EXIT_FAILURE);
+}
+
 int
 main(int ac, char **av)
 {
@@ -281,17 +358,26 @@ main(int ac, char **av)
   struct logheader *header;
   struct stat buf;
   char *x;
-  int fd;
+  int fd, opt;
 
-  if (ac < 3) {
-    fprintf(stderr, "usage: %s sample-file elf-file\n", av[0]);
-    exit(EXIT_FAILURE);
+  while ((opt = getopt(ac, av, "f")) != -1) {
+    switch (opt) {
+    case 'f':
+      folded_mode = true;
+      break;
+    default:
+      usage(av[0]);
+    }
   }
 
-  selfless();
+  if (ac - optind < 2 || ac - optind > 3)
+    usage(av[0]);
+
+  if (!folded_mode)
+    selfless();
 
-  sample = av[1];
-  elf = av[2];
+  sample = av[optind];
+  elf = av[optind + 1];
 
   fd = open(sample, O_RDONLY);
   if (fd < 0) {
@@ -300,6 +386,9 @@ main(int ac, char **av)
   }
 
   Addr2line addr2line(elf);
+  std::unique_ptr<Addr2line> uaddr2line;
+  if (ac - optind == 3)
+    uaddr2line.reset(new Addr2line(av[optind + 2]));
   
   if (fstat(fd, &buf) < 0)
     edie("fstat");
@@ -312,7 +401,7 @@ main(int ac, char **av)
   header = (struct logheader*)x;
 
   uint64_t samples = 0, idle_samples = 0,
-    ints_disabled_samples = 0, kernel_samples = 0;
+    ints_disabled_samples = 0, kernel_samples = 0, offcpu_us = 0;
   std::unordered_map<struct pmuevent*, int, pmuevent_ops, pmuevent_ops> map;
   for (u32 i = 0; i < header->ncpus; i++) {
     struct pmuevent *p;
@@ -321,6 +410,8 @@ main(int ac, char **av)
     p = (struct pmuevent*)(x + header->cpu[i].offset);
     q = (struct pmuevent*)(x + header->cpu[i].offset + header->cpu[i].size);
     for (; p < q; p++) {
+      if (p->offcpu)
+        offcpu_us += p->count;
       if (p->idle)
         idle_samples += p->count;
       if (p->ints_disabled)
@@ -337,14 +428,27 @@ main(int ac, char **av)
         it->second = it->second + p->count;
     }
   }
+
+  if (folded_mode) {
+    print_folded(addr2line, uaddr2line.get(), map);
+    return 0;
+  }
   
-  std::map<uint64_t, struct pmuevent*, gt> sorted;
+  std::multimap<uint64_t, struct pmuevent*, gt> sorted;
   int total = 0;
   for (std::pair<struct pmuevent* const, int> &p : map) {
-    sorted[p.second] = p.first;
+    sorted.insert(std::make_pair(p.second, p.first));
     total += p.second;
   }
 
+  if (offcpu_us) {
+    // An off-CPU profile's counts are microseconds asleep.
+    printf("off-CPU time: %" PRIu64 " us\n\n", offcpu_us);
+    for (std::pair<const uint64_t, struct pmuevent*> &p : sorted)
+      print_entry(addr2line, p.first, total, p.second);
+    return 0;
+  }
+
   uint64_t user_samples = samples - kernel_samples;
   printf("total samples: %" PRIu64 "  idle samples: %" PRIu64 " (%d%%)\n",
          samples, idle_samples, (int)(idle_samples * 100 / samples));
@@ -0,0 +1,211 @@
+// Decode a scheduling trace read from /dev/schedtrace.
+//
+//   sched-report [-t] trace
+//
+// prints, for each process, how long it ran, how often it was switched
+// in and woken, and how long it took from being woken to running.  -t
+// also prints every event, in time order.
+
+#define __STDC_FORMAT_MACROS
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "include/schedtrace.h"
+
+static void __attribute__((noreturn))
+edie(const char* errstr, ...)
+{
+  va_list ap;
+
+  va_start(ap, errstr);
+  vfprintf(stderr, errstr, ap);
+  va_end(ap);
+  fprintf(stderr, ": %s\n", strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+// Indexed by the kernel's procstate.
+static const char *states[] = {
+  "embryo", "sleeping", "runnable", "running", "zombie",
+};
+
+struct event
+{
+  schedtrace_event e;
+  int cpu;
+
+  bool operator<(const event &o) const
+  {
+    return e.tsc < o.e.tsc;
+  }
+};
+
+struct pid_stats
+{
+  std::string name;
+  uint64_t runtime, nswitch, nwake;
+  uint64_t wake_total, wake_max, nwake_ran;
+  // TSC of a wakeup that hasn't been followed by a switch in yet.
+  uint64_t woken_at;
+
+  pid_stats()
+    : runtime(0), nswitch(0), nwake(0), wake_total(0), wake_max(0),
+      nwake_ran(0), woken_at(0) {}
+};
+
+int
+main(int ac, char **av)
+{
+  bool timeline = false;
+  int opt;
+  while ((opt = getopt(ac, av, "t")) != -1) {
+    switch (opt) {
+    case 't':
+      timeline = true;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t] trace\n", av[0]);
+      exit(2);
+    }
+  }
+  if (optind != ac - 1) {
+    fprintf(stderr, "usage: %s [-t] trace\n", av[0]);
+    exit(2);
+  }
+
+  int fd = open(av[optind], O_RDONLY);
+  if (fd < 0)
+    edie("open %s", av[optind]);
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    edie("fstat");
+  std::vector<char> buf(st.st_size);
+  if (read(fd, buf.data(), buf.size()) != (ssize_t)buf.size())
+    edie("read");
+  close(fd);
+
+  if (buf.size() < sizeof(schedtrace_header)) {
+    fprintf(stderr, "trace too short\n");
+    exit(EXIT_FAILURE);
+  }
+  const schedtrace_header *hdr = (const schedtrace_header*)buf.data();
+  if (buf.size() < sizeof(*hdr) + hdr->ncpus * sizeof(hdr->cpu[0])) {
+    fprintf(stderr, "trace header truncated\n");
+    exit(EXIT_FAILURE);
+  }
+
+  std::vector<event> events;
+  for (uint64_t c = 0; c < hdr->ncpus; c++) {
+    if (hdr->cpu[c].dropped)
+      fprintf(stderr, "cpu %" PRIu64 ": %" PRIu64 " events dropped\n",
+              c, hdr->cpu[c].dropped);
+    if (hdr->cpu[c].offset + hdr->cpu[c].count * sizeof(schedtrace_event) >
+        buf.size()) {
+      fprintf(stderr, "cpu %" PRIu64 ": events truncated\n", c);
+      exit(EXIT_FAILURE);
+    }
+    const schedtrace_event *ev =
+      (const schedtrace_event*)(buf.data() + hdr->cpu[c].offset);
+    for (uint64_t i = 0; i < hdr->cpu[c].count; i++) {
+      event e;
+      e.e = ev[i];
+      e.cpu = c;
+      events.push_back(e);
+    }
+  }
+  if (events.empty()) {
+    printf("no events\n");
+    return 0;
+  }
+  std::stable_sort(events.begin(), events.end());
+
+  double us = hdr->cpuhz / 1e6;
+  uint64_t t0 = events.front().e.tsc;
+  std::map<uint32_t, pid_stats> pids;
+  // What each core switched in last, and when.
+  std::map<int, std::pair<uint32_t, uint64_t> > running;
+
+  for (const event &ev : events) {
+    const schedtrace_event &e = ev.e;
+    pid_stats &ps = pids[e.pid];
+    ps.name.assign(e.name, strnlen(e.name, sizeof(e.name)));
+
+    switch (e.type) {
+    case SCHEDTRACE_SWITCH_IN:
+      ps.nswitch++;
+      running[ev.cpu] = std::make_pair(e.pid, e.tsc);
+      if (ps.woken_at) {
+        uint64_t lat = e.tsc - ps.woken_at;
+        ps.wake_total += lat;
+        ps.wake_max = std::max(ps.wake_max, lat);
+        ps.nwake_ran++;
+        ps.woken_at = 0;
+      }
+      break;
+    case SCHEDTRACE_SWITCH_OUT: {
+      auto it = running.find(ev.cpu);
+      if (it != running.end() && it->second.first == e.pid)
+        ps.runtime += e.tsc - it->second.second;
+      running.erase(ev.cpu);
+      break;
+    }
+    case SCHEDTRACE_WAKEUP:
+      ps.nwake++;
+      if (!ps.woken_at)
+        ps.woken_at = e.tsc;
+      break;
+    }
+
+    if (timeline) {
+      const char *state = e.state < sizeof(states) / sizeof(states[0]) ?
+        states[e.state] : "?";
+      printf("%14.3f cpu %-3d ", (e.tsc - t0) / us, ev.cpu);
+      if (e.type == SCHEDTRACE_SWITCH_IN)
+        printf("in   %5u %s\n", e.pid, ps.name.c_str());
+      else if (e.type == SCHEDTRACE_SWITCH_OUT)
+        printf("out  %5u %s (%s)\n", e.pid, ps.name.c_str(), state);
+      else if (e.type == SCHEDTRACE_WAKEUP)
+        printf("wake %5u %s on cpu %u\n", e.pid, ps.name.c_str(), e.arg);
+      else
+        printf("event %u?\n", e.type);
+    }
+  }
+
+  uint64_t span = events.back().e.tsc - t0;
+  if (timeline)
+    printf("\n");
+  printf("%d cpus, %.3f ms\n", (int)hdr->ncpus, span / us / 1000);
+  printf("%5s %-16s %12s %6s %8s %8s %12s %12s\n", "pid", "name",
+         "runtime(ms)", "%", "switches", "wakeups",
+         "avg wake(us)", "max wake(us)");
+
+  std::vector<std::pair<uint64_t, uint32_t> > order;
+  for (auto &p : pids)
+    order.push_back(std::make_pair(p.second.runtime, p.first));
+  std::sort(order.rbegin(), order.rend());
+  for (auto &o : order) {
+    const pid_stats &ps = pids[o.second];
+    printf("%5u %-16s %12.3f %6.2f %8" PRIu64 " %8" PRIu64,
+           o.second, ps.name.c_str(), ps.runtime / us / 1000,
+           span ? 100.0 * ps.runtime / span : 0, ps.nswitch, ps.nwake);
+    if (ps.nwake_ran)
+      printf(" %12.3f %12.3f\n", ps.wake_total / us / ps.nwake_ran,
+             ps.wake_max / us);
+    else
+      printf(" %12s %12s\n", "-", "-");
+  }
+  return 0;
+}
@@ -89,6 +89,10 @@ SYS_%(uname)s = %(num)d
             print "%s %s(%s)%s;" % (syscall.rettype, syscall.uname,
                                     ", ".join(syscall.uargs), extra)
         print
+        # For syscall_batch
+        for syscall in syscalls:
+            print "#define SYS_%s %d" % (syscall.uname, syscall.num)
+        print
         print "END_DECLS"
 
 class Syscall(object):
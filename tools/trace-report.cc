@@ -0,0 +1,172 @@
+// Decode a tracepoint trace read from /dev/tracepoints.
+//
+//   trace-report [-t] trace
+//
+// prints how many times each tracepoint fired, in total and per core.
+// -t also prints every record, in time order.
+
+#define __STDC_FORMAT_MACROS
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "include/tracepoint.h"
+
+static void __attribute__((noreturn))
+edie(const char* errstr, ...)
+{
+  va_list ap;
+
+  va_start(ap, errstr);
+  vfprintf(stderr, errstr, ap);
+  va_end(ap);
+  fprintf(stderr, ": %s\n", strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+struct tracepoint_info
+{
+  const char *name;
+  const char *args[3];
+};
+
+static const tracepoint_info tracepoints[] = {
+#define X(id, name, a0, a1, a2) { name, { a0, a1, a2 } },
+  TRACEPOINTS(X)
+#undef X
+};
+
+struct event
+{
+  tracepoint_event e;
+  int cpu;
+
+  bool operator<(const event &o) const
+  {
+    return e.tsc < o.e.tsc;
+  }
+};
+
+int
+main(int ac, char **av)
+{
+  bool timeline = false;
+  int opt;
+  while ((opt = getopt(ac, av, "t")) != -1) {
+    switch (opt) {
+    case 't':
+      timeline = true;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t] trace\n", av[0]);
+      exit(2);
+    }
+  }
+  if (optind != ac - 1) {
+    fprintf(stderr, "usage: %s [-t] trace\n", av[0]);
+    exit(2);
+  }
+
+  int fd = open(av[optind], O_RDONLY);
+  if (fd < 0)
+    edie("open %s", av[optind]);
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    edie("fstat");
+  std::vector<char> buf(st.st_size);
+  if (read(fd, buf.data(), buf.size()) != (ssize_t)buf.size())
+    edie("read");
+  close(fd);
+
+  if (buf.size() < sizeof(tracepoint_header)) {
+    fprintf(stderr, "trace too short\n");
+    exit(EXIT_FAILURE);
+  }
+  const tracepoint_header *hdr = (const tracepoint_header*)buf.data();
+  if (buf.size() < sizeof(*hdr) + hdr->ncpus * sizeof(hdr->cpu[0])) {
+    fprintf(stderr, "trace header truncated\n");
+    exit(EXIT_FAILURE);
+  }
+
+  std::vector<event> events;
+  for (uint64_t c = 0; c < hdr->ncpus; c++) {
+    if (hdr->cpu[c].dropped)
+      fprintf(stderr, "cpu %" PRIu64 ": %" PRIu64 " records dropped\n",
+              c, hdr->cpu[c].dropped);
+    if (hdr->cpu[c].offset + hdr->cpu[c].count * sizeof(tracepoint_event) >
+        buf.size()) {
+      fprintf(stderr, "cpu %" PRIu64 ": records truncated\n", c);
+      exit(EXIT_FAILURE);
+    }
+    const tracepoint_event *ev =
+      (const tracepoint_event*)(buf.data() + hdr->cpu[c].offset);
+    for (uint64_t i = 0; i < hdr->cpu[c].count; i++) {
+      event e;
+      e.e = ev[i];
+      e.cpu = c;
+      events.push_back(e);
+    }
+  }
+  if (events.empty()) {
+    printf("no records\n");
+    return 0;
+  }
+  std::stable_sort(events.begin(), events.end());
+
+  double us = hdr->cpuhz / 1e6;
+  uint64_t t0 = events.front().e.tsc;
+  // counts[id][cpu]
+  std::vector<std::vector<uint64_t> > counts(
+    TP_NTYPES, std::vector<uint64_t>(hdr->ncpus));
+
+  for (const event &ev : events) {
+    const tracepoint_event &e = ev.e;
+    if (e.id >= TP_NTYPES) {
+      if (timeline)
+        printf("%14.3f cpu %-3d tracepoint %u?\n", (e.tsc - t0) / us,
+               ev.cpu, e.id);
+      continue;
+    }
+    counts[e.id][ev.cpu]++;
+    if (!timeline)
+      continue;
+    const tracepoint_info &tp = tracepoints[e.id];
+    printf("%14.3f cpu %-3d %5u %-14s", (e.tsc - t0) / us, ev.cpu, e.pid,
+           tp.name);
+    for (int i = 0; i < 3; i++)
+      if (tp.args[i][0])
+        printf(" %s=%#" PRIx64, tp.args[i], e.arg[i]);
+    printf("\n");
+  }
+
+  uint64_t span = events.back().e.tsc - t0;
+  if (timeline)
+    printf("\n");
+  printf("%d cpus, %.3f ms\n", (int)hdr->ncpus, span / us / 1000);
+  printf("%-14s %10s  per cpu\n", "tracepoint", "count");
+  for (int id = 0; id < TP_NTYPES; id++) {
+    uint64_t total = 0, last = 0;
+    for (uint64_t c = 0; c < hdr->ncpus; c++) {
+      total += counts[id][c];
+      if (counts[id][c])
+        last = c + 1;
+    }
+    if (!total)
+      continue;
+    printf("%-14s %10" PRIu64 " ", tracepoints[id].name, total);
+    for (uint64_t c = 0; c < last; c++)
+      printf(" %" PRIu64, counts[id][c]);
+    printf("\n");
+  }
+  return 0;
+}